@@ -0,0 +1,43 @@
+#pragma once
+
+// Latency summaries shared by the benchmarks, so that they all report the same percentiles under
+// the same JSON keys.
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace oxenss::bench {
+
+// Returns the `p`th percentile (0-100) of the already-sorted `sorted`, or 0 if it is empty.
+inline double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    auto i = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::clamp<size_t>(i, 1, sorted.size()) - 1];
+}
+
+// Adds the p50, p90, p99, p99.9 and max of `sorted` to the JSON object `j`, with keys suffixed by
+// `unit` (e.g. "p50_us" and "max_us" for unit "us").
+inline void add_latencies(nlohmann::json& j, const std::vector<double>& sorted, std::string unit) {
+    unit.insert(0, 1, '_');
+    j["p50" + unit] = percentile(sorted, 50);
+    j["p90" + unit] = percentile(sorted, 90);
+    j["p99" + unit] = percentile(sorted, 99);
+    j["p999" + unit] = percentile(sorted, 99.9);
+    j["max" + unit] = sorted.empty() ? 0 : sorted.back();
+}
+
+// Prints the same values as the last columns of a results table row: the percentiles each
+// `width` characters wide and the max `max_width` wide, then ends the line.
+inline void print_latencies(const std::vector<double>& sorted, int width, int max_width) {
+    for (double p : {50.0, 90.0, 99.0, 99.9})
+        std::printf(" %*.1f", width, percentile(sorted, p));
+    std::printf(" %*.1f\n", max_width, sorted.empty() ? 0 : sorted.back());
+}
+
+}  // namespace oxenss::bench
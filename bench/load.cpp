@@ -0,0 +1,1205 @@
+// End-to-end load generator.  Drives one storage server, or every node of a (local) testnet, with
+// a configurable mix of signed client requests -- store, retrieve, batch, expire_msgs,
+// monitor.messages subscriptions and multi-hop onion requests -- over HTTPS, OMQ and QUIC, and
+// reports throughput and latency percentiles for each request type and transport.  --json saves
+// these, with each request type's error counts, to a file.
+//
+// Requests are sent open-loop: they arrive as a Poisson process at the requested rate however fast
+// the nodes answer, and latencies are measured from when each request was due rather than when it
+// actually went out, so a node that falls behind shows up as latency instead of quietly slowing
+// the generator down.  (The onion request construction follows contrib/onion-request.cpp.)
+//
+// With --replay, the requests come from a capture of a node's real client traffic (see the
+// storage server's --capture-file) instead: each captured request is sent at its captured time
+// (sped up or slowed down by --speed) as a synthetic request of the same type, transport and
+// (for stores) size, for one of our accounts standing in for the captured account.
+
+#include <oxenss/common/pubkey.h>
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+#include <oxenss/rpc/traffic_capture.h>
+#include <oxenss/snode/sn_record.h>
+#include <oxenss/snode/swarm.h>
+
+#include "latencies.hpp"
+
+#include <CLI/CLI.hpp>
+#include <cpr/cpr.h>
+#include <nlohmann/json.hpp>
+#include <oxen/quic.hpp>
+#include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
+#include <oxenc/bt_serialize.h>
+#include <oxenc/endian.h>
+#include <oxenc/hex.h>
+#include <oxenmq/oxenmq.h>
+#include <sodium/core.h>
+#include <sodium/crypto_box.h>
+#include <sodium/crypto_sign.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace oxenss;
+using namespace std::literals;
+using steady = std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+namespace {
+
+enum class kind { store, retrieve, batch, expire, monitor, onion };
+constexpr std::array KINDS{
+        kind::store, kind::retrieve, kind::batch, kind::expire, kind::monitor, kind::onion};
+
+constexpr std::string_view to_string(kind k) {
+    switch (k) {
+        case kind::store: return "store"sv;
+        case kind::retrieve: return "retrieve"sv;
+        case kind::batch: return "batch"sv;
+        case kind::expire: return "expire_msgs"sv;
+        case kind::monitor: return "monitor"sv;
+        case kind::onion: return "onion"sv;
+    }
+    return ""sv;
+}
+
+enum class transport { https, omq, quic };
+constexpr std::array TRANSPORTS{transport::https, transport::omq, transport::quic};
+
+constexpr std::string_view to_string(transport t) {
+    switch (t) {
+        case transport::https: return "https"sv;
+        case transport::omq: return "omq"sv;
+        case transport::quic: return "quic"sv;
+    }
+    return ""sv;
+}
+
+int64_t epoch_ms(system_clock::time_point t = system_clock::now()) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+std::atomic<bool> interrupted = false;
+
+extern "C" void on_signal(int) {
+    interrupted = true;
+}
+
+// A Session account that we send requests for
+struct account {
+    std::array<unsigned char, 32> ed_pk;
+    std::array<unsigned char, 64> ed_sk;
+    std::string session_id;  // 05-prefixed hex
+    std::string ed_hex;
+    const snode::SwarmInfo* swarm = nullptr;
+
+    // Hashes of messages we stored (newest last), for expire_msgs requests
+    std::mutex mutex;
+    std::deque<std::string> hashes;
+    static constexpr size_t MAX_HASHES = 100;
+
+    account() {
+        crypto_sign_keypair(ed_pk.data(), ed_sk.data());
+        std::array<unsigned char, 32> x_pk;
+        crypto_sign_ed25519_pk_to_curve25519(x_pk.data(), ed_pk.data());
+        session_id = "05" + oxenc::to_hex(x_pk.begin(), x_pk.end());
+        ed_hex = oxenc::to_hex(ed_pk.begin(), ed_pk.end());
+    }
+
+    std::string sign(std::string_view msg) const {
+        std::string sig(64, '\0');
+        crypto_sign_detached(
+                reinterpret_cast<unsigned char*>(sig.data()),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                ed_sk.data());
+        return sig;
+    }
+
+    std::string sign_b64(std::string_view msg) const { return oxenc::to_base64(sign(msg)); }
+
+    void add_hash(std::string hash) {
+        std::lock_guard lock{mutex};
+        hashes.push_back(std::move(hash));
+        if (hashes.size() > MAX_HASHES)
+            hashes.pop_front();
+    }
+
+    // Returns up to `n` of the most recently stored hashes
+    std::vector<std::string> recent_hashes(size_t n) {
+        std::lock_guard lock{mutex};
+        n = std::min(n, hashes.size());
+        return {hashes.end() - n, hashes.end()};
+    }
+};
+
+// The active service nodes, by swarm
+struct network {
+    std::vector<snode::SwarmInfo> swarms;  // sorted by swarm id, as get_swarm_by_pk needs
+    std::vector<const snode::sn_record*> nodes;
+
+    const snode::sn_record* find(const crypto::legacy_pubkey& pk) const {
+        for (auto* sn : nodes)
+            if (sn->pubkey_legacy == pk)
+                return sn;
+        return nullptr;
+    }
+};
+
+// Fetches the active service nodes from oxend, as contrib/onion-request does
+network fetch_network(oxenmq::OxenMQ& omq, const std::string& oxend) {
+    // Shared with the callbacks, which can outlive us if we time out
+    struct waiter {
+        std::promise<network> got;
+        std::atomic<bool> done = false;
+
+        void fail(std::exception_ptr e) {
+            if (!done.exchange(true))
+                got.set_exception(std::move(e));
+        }
+    };
+    auto w = std::make_shared<waiter>();
+    auto fut = w->got.get_future();
+    auto conn = omq.connect_remote(
+            oxenmq::address{oxend},
+            [](auto) {},
+            [w, oxend](auto, std::string_view err) {
+                w->fail(std::make_exception_ptr(std::runtime_error{
+                        "Failed to connect to oxend @ " + oxend + ": " + std::string{err}}));
+            });
+    omq.request(
+            conn,
+            "rpc.get_service_nodes",
+            [w](bool success, std::vector<std::string> data) {
+                try {
+                    if (!success || data.size() < 2 || data[0] != "200")
+                        throw std::runtime_error{"get_service_nodes request failed"};
+                    std::map<snode::swarm_id_t, std::vector<snode::sn_record>> swarms;
+                    auto json = nlohmann::json::parse(data[1]);
+                    for (auto& s : json.at("service_node_states")) {
+                        auto swarm_id = s.at("swarm_id").get<snode::swarm_id_t>();
+                        auto ed = s.value("pubkey_ed25519", ""s), x = s.value("pubkey_x25519", ""s);
+                        if (swarm_id == snode::INVALID_SWARM_ID || ed.size() != 64 ||
+                            x.size() != 64)
+                            continue;
+                        snode::sn_record sn;
+                        sn.ip = s.at("public_ip").get<std::string>();
+                        sn.port = s.at("storage_port").get<uint16_t>();
+                        sn.omq_quic_port = s.at("storage_lmq_port").get<uint16_t>();
+                        sn.pubkey_legacy = crypto::legacy_pubkey::from_hex(
+                                s.at("service_node_pubkey").get<std::string>());
+                        sn.pubkey_ed25519 = crypto::ed25519_pubkey::from_hex(ed);
+                        sn.pubkey_x25519 = crypto::x25519_pubkey::from_hex(x);
+                        swarms[swarm_id].push_back(std::move(sn));
+                    }
+                    network net;
+                    for (auto& [id, nodes] : swarms)
+                        net.swarms.push_back({id, std::move(nodes)});
+                    for (auto& s : net.swarms)
+                        for (auto& sn : s.snodes)
+                            net.nodes.push_back(&sn);
+                    if (!w->done.exchange(true))
+                        w->got.set_value(std::move(net));
+                } catch (...) {
+                    w->fail(std::current_exception());
+                }
+            },
+            nlohmann::json{
+                    {"fields",
+                     {{"service_node_pubkey", true},
+                      {"pubkey_x25519", true},
+                      {"pubkey_ed25519", true},
+                      {"public_ip", true},
+                      {"storage_port", true},
+                      {"storage_lmq_port", true},
+                      {"swarm_id", true}}},
+                    {"active_only", true}}
+                    .dump());
+    if (fut.wait_for(30s) != std::future_status::ready)
+        throw std::runtime_error{"Timed out waiting for the service node list from " + oxend};
+    return fut.get();
+}
+
+// What we need to decrypt the reply to an onion request
+struct onion_keys {
+    crypto::x25519_seckey seckey;
+    crypto::x25519_pubkey pubkey;
+    crypto::x25519_pubkey destination;
+    crypto::EncryptType etype;
+};
+
+std::string encode_size(uint32_t s) {
+    std::string str(4, '\0');
+    oxenc::write_host_as_little(s, str.data());
+    return str;
+}
+
+// Builds an onion request through `path` (entry node first, destination last); see
+// contrib/onion-request.cpp for a description of the layers.
+std::string build_onion(
+        const std::vector<const snode::sn_record*>& path,
+        std::string_view payload,
+        std::string_view control,
+        crypto::EncryptType etype,
+        onion_keys& keys) {
+    crypto::x25519_pubkey A;
+    crypto::x25519_seckey a;
+    crypto_box_keypair(A.data(), a.data());
+
+    auto data = encode_size(payload.size());
+    data += payload;
+    data += control;
+    auto blob = crypto::ChannelEncryption{a, A, false}.encrypt(
+            etype, data, path.back()->pubkey_x25519);
+    keys = {a, A, path.back()->pubkey_x25519, etype};
+
+    for (auto it = std::next(path.rbegin()); it != path.rend(); ++it) {
+        nlohmann::json routing{
+                {"destination", (*std::prev(it))->pubkey_ed25519.hex()},
+                {"ephemeral_key", A.hex()},
+                {"enc_type", crypto::to_string(etype)}};
+        blob = encode_size(blob.size()) + blob + routing.dump();
+
+        crypto_box_keypair(A.data(), a.data());
+        blob = crypto::ChannelEncryption{a, A, false}.encrypt(etype, blob, (*it)->pubkey_x25519);
+    }
+
+    return encode_size(blob.size()) + blob +
+           nlohmann::json{{"ephemeral_key", A.hex()}, {"enc_type", crypto::to_string(etype)}}
+                   .dump();
+}
+
+struct request {
+    kind k;
+    transport t;
+    const snode::sn_record* to;  // The node it is sent to (the entry node, for onion requests)
+    std::string method;
+    std::string body;  // Request parameters (or the onion blob, for onion requests)
+    steady::time_point due;
+    account* acct;
+    std::shared_ptr<onion_keys> onion;
+};
+
+// Called with the reply status (0 if there was no reply) and body
+using done_fn = std::function<void(int status, std::string body)>;
+
+struct result {
+    size_t ok = 0;
+    size_t failed = 0;
+    std::vector<double> latencies_ms;  // Of the successful requests
+    std::map<std::string, size_t> errors;
+};
+
+class Recorder {
+    std::mutex mutex_;
+    std::map<std::pair<kind, transport>, result> results_;
+
+  public:
+    std::atomic<size_t> sent = 0;
+    std::atomic<size_t> completed = 0;
+    std::atomic<size_t> failed = 0;
+    std::atomic<size_t> in_flight = 0;
+    // Requests not sent because --max-in-flight requests were already waiting for replies
+    std::atomic<size_t> dropped = 0;
+    // Pushed monitor.messages notifications received
+    std::atomic<size_t> notifications = 0;
+
+    void done(const request& req, const std::optional<std::string>& error) {
+        auto ms = std::chrono::duration<double, std::milli>(steady::now() - req.due).count();
+        {
+            std::lock_guard lock{mutex_};
+            auto& r = results_[{req.k, req.t}];
+            if (error) {
+                r.failed++;
+                r.errors[*error]++;
+            } else {
+                r.ok++;
+                r.latencies_ms.push_back(ms);
+            }
+        }
+        (error ? failed : completed)++;
+        in_flight--;
+    }
+
+    std::map<std::pair<kind, transport>, result> results() {
+        std::lock_guard lock{mutex_};
+        return results_;
+    }
+};
+
+// Sends HTTPS requests from a pool of worker threads, each with its own (kept-alive) session
+class HttpsClient {
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<request*, done_fn>> queue_;
+    bool stopping_ = false;
+    const std::chrono::milliseconds timeout_;
+    std::vector<std::thread> threads_;
+
+    void run() {
+        cpr::Session session;
+        session.SetVerifySsl(cpr::VerifySsl{false});
+        session.SetTimeout(cpr::Timeout{timeout_});
+        while (true) {
+            std::pair<request*, done_fn> job;
+            {
+                std::unique_lock lock{mutex_};
+                cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (stopping_)
+                    return;
+                job = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            auto& [req, done] = job;
+            if (req->k == kind::onion) {
+                session.SetUrl(cpr::Url{
+                        "https://" + req->to->ip + ":" + std::to_string(req->to->port) +
+                        "/onion_req/v2"});
+                session.SetBody(cpr::Body{req->body});
+            } else {
+                session.SetUrl(cpr::Url{
+                        "https://" + req->to->ip + ":" + std::to_string(req->to->port) +
+                        "/storage_rpc/v1"});
+                session.SetBody(cpr::Body{
+                        R"({"method":")" + req->method + R"(","params":)" + req->body + "}"});
+            }
+            auto res = session.Post();
+            done(res.error ? 0 : static_cast<int>(res.status_code), std::move(res.text));
+        }
+    }
+
+  public:
+    HttpsClient(size_t workers, std::chrono::milliseconds timeout) : timeout_{timeout} {
+        for (size_t i = 0; i < workers; i++)
+            threads_.emplace_back([this] { run(); });
+    }
+
+    ~HttpsClient() {
+        {
+            std::lock_guard lock{mutex_};
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    // Queues `req` (which must stay alive until `done` is called) to be sent by the next free
+    // worker.  A request waiting here is late, which is counted in its latency.
+    void send(request& req, done_fn done) {
+        {
+            std::lock_guard lock{mutex_};
+            queue_.emplace_back(&req, std::move(done));
+        }
+        cv_.notify_one();
+    }
+};
+
+class OmqClient {
+    oxenmq::OxenMQ omq_;
+    const std::chrono::milliseconds timeout_;
+    std::mutex mutex_;
+    std::unordered_map<crypto::legacy_pubkey, oxenmq::ConnectionID> conns_;
+
+    oxenmq::ConnectionID connection(const snode::sn_record& sn) {
+        std::lock_guard lock{mutex_};
+        auto [it, inserted] = conns_.try_emplace(sn.pubkey_legacy);
+        if (inserted)
+            it->second = omq_.connect_remote(
+                    oxenmq::address{
+                            "curve://" + sn.ip + ":" + std::to_string(sn.omq_quic_port) + "/" +
+                            sn.pubkey_x25519.hex()},
+                    [](auto) {},
+                    [](auto, std::string_view) {});
+        return it->second;
+    }
+
+  public:
+    OmqClient(Recorder& rec, std::chrono::milliseconds timeout) : timeout_{timeout} {
+        omq_.add_category("notify", oxenmq::AuthLevel::none)
+                .add_command("message", [&rec](auto&) { rec.notifications++; })
+                .add_command("messages", [&rec](auto&) { rec.notifications++; });
+        omq_.start();
+    }
+
+    oxenmq::OxenMQ& omq() { return omq_; }
+
+    void send(request& req, done_fn done) {
+        omq_.request(
+                connection(*req.to),
+                req.k == kind::monitor ? req.method : "storage." + req.method,
+                [done = std::move(done)](bool success, std::vector<std::string> data) {
+                    if (!success || data.empty())
+                        return done(0, "");
+                    // Successful replies are just the body; errors are [STATUS, BODY]
+                    if (data.size() == 1)
+                        return done(200, std::move(data[0]));
+                    int status = 0;
+                    try {
+                        status = std::stoi(data[0]);
+                    } catch (...) {
+                    }
+                    done(status, std::move(data[1]));
+                },
+                req.body,
+                oxenmq::send_option::request_timeout{timeout_});
+    }
+};
+
+class QuicClient {
+    inline static const std::basic_string<uint8_t> ALPN{
+            reinterpret_cast<const uint8_t*>("oxenstorage"), 11};
+
+    Recorder& rec_;
+    std::unique_ptr<oxen::quic::Network> net_;
+    std::shared_ptr<oxen::quic::GNUTLSCreds> creds_;
+    std::shared_ptr<oxen::quic::Endpoint> ep_;
+    std::mutex mutex_;
+    std::unordered_map<crypto::legacy_pubkey, std::shared_ptr<oxen::quic::BTRequestStream>>
+            streams_;
+
+    std::shared_ptr<oxen::quic::BTRequestStream> stream(const snode::sn_record& sn) {
+        std::lock_guard lock{mutex_};
+        if (auto it = streams_.find(sn.pubkey_legacy); it != streams_.end())
+            return it->second;
+        auto conn = ep_->connect(
+                {sn.pubkey_ed25519.view(), sn.ip, sn.omq_quic_port},
+                creds_,
+                oxen::quic::opt::handshake_timeout{5s});
+        // The node pushes monitor notifications as commands on the connection's first stream
+        auto s = conn->open_stream<oxen::quic::BTRequestStream>([this](oxen::quic::message m) {
+            if (auto ep = m.endpoint(); ep == "notify"sv || ep == "notify_messages"sv)
+                rec_.notifications++;
+        });
+        streams_.emplace(sn.pubkey_legacy, s);
+        return s;
+    }
+
+    void drop(const crypto::legacy_pubkey& pk) {
+        std::lock_guard lock{mutex_};
+        streams_.erase(pk);
+    }
+
+  public:
+    explicit QuicClient(Recorder& rec) :
+            rec_{rec}, net_{std::make_unique<oxen::quic::Network>()} {
+        std::string pk(32, '\0'), sk(64, '\0');
+        crypto_sign_keypair(
+                reinterpret_cast<unsigned char*>(pk.data()),
+                reinterpret_cast<unsigned char*>(sk.data()));
+        creds_ = oxen::quic::GNUTLSCreds::make_from_ed_seckey(sk);
+        ep_ = net_->endpoint(oxen::quic::Address{}, oxen::quic::opt::outbound_alpns{{ALPN}});
+    }
+
+    // QUIC replies don't carry a status code: errors come back as a plain text body, which the
+    // caller's response parsing rejects.
+    void send(request& req, done_fn done) {
+        stream(*req.to)->command(
+                req.method,
+                req.body,
+                [this, pk = req.to->pubkey_legacy, done = std::move(done)](
+                        const oxen::quic::message& m) {
+                    if (m.timed_out) {
+                        // The connection may be dead, so make a fresh one for the next request
+                        drop(pk);
+                        return done(0, "");
+                    }
+                    done(m.is_error() ? 500 : 200, std::string{m.body()});
+                });
+    }
+};
+
+struct options {
+    std::string oxend = "tcp://public.loki.foundation:9999";
+    std::vector<std::string> targets;
+    std::vector<std::string> transports{"https", "omq", "quic"};
+    std::vector<std::string> mix{
+            "store=30", "retrieve=40", "batch=10", "expire_msgs=5", "monitor=5", "onion=10"};
+    double rate = 100;
+    double duration = 30;
+    size_t accounts = 100;
+    size_t min_size = 100;
+    size_t max_size = 2000;
+    uint64_t ttl_sec = 3600;
+    size_t batch_size = 4;
+    size_t onion_hops = 3;
+    size_t https_workers = 64;
+    size_t max_in_flight = 10'000;
+    double timeout = 10;
+    double report_interval = 5;
+    uint64_t seed = std::random_device{}();
+    std::filesystem::path json_out;
+    std::filesystem::path replay;
+    double speed = 1;
+};
+
+class Generator {
+    const options& opts_;
+    const network& net_;
+    std::vector<std::unique_ptr<account>>& accounts_;
+    std::vector<const snode::sn_record*> targets_;
+    std::vector<transport> transports_, monitor_transports_;
+    std::mt19937_64 rng_;
+    std::discrete_distribution<size_t> kinds_;
+
+    size_t uniform(size_t n) { return std::uniform_int_distribution<size_t>{0, n - 1}(rng_); }
+
+    // Random data of the given size, or of a random size within the configured limits if 0
+    std::string random_data(size_t size = 0) {
+        if (size == 0)
+            size = opts_.min_size + uniform(opts_.max_size - opts_.min_size + 1);
+        std::string data(size, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng_());
+        return data;
+    }
+
+    nlohmann::json store_params(const account& a, size_t size = 0) {
+        auto now = epoch_ms();
+        return {{"pubkey", a.session_id},
+                {"pubkey_ed25519", a.ed_hex},
+                {"namespace", 0},
+                {"data", oxenc::to_base64(random_data(size))},
+                {"ttl", opts_.ttl_sec * 1000},
+                {"timestamp", now},
+                {"sig_timestamp", now},
+                {"signature", a.sign_b64("store" + std::to_string(now))}};
+    }
+
+    nlohmann::json retrieve_params(const account& a) {
+        auto now = epoch_ms();
+        return {{"pubkey", a.session_id},
+                {"pubkey_ed25519", a.ed_hex},
+                {"timestamp", now},
+                {"signature", a.sign_b64("retrieve" + std::to_string(now))}};
+    }
+
+    nlohmann::json expire_params(const account& a, const std::vector<std::string>& hashes) {
+        auto expiry = epoch_ms(system_clock::now() + std::chrono::seconds{opts_.ttl_sec});
+        auto sig_msg = "expire" + std::to_string(expiry);
+        for (auto& h : hashes)
+            sig_msg += h;
+        return {{"pubkey", a.session_id},
+                {"pubkey_ed25519", a.ed_hex},
+                {"messages", hashes},
+                {"expiry", expiry},
+                {"signature", a.sign_b64(sig_msg)}};
+    }
+
+    std::string monitor_body(const account& a) {
+        auto ts = std::chrono::duration_cast<std::chrono::seconds>(
+                          system_clock::now().time_since_epoch())
+                          .count();
+        // MONITOR || session id || timestamp || want data || namespaces
+        auto sig = a.sign("MONITOR" + a.session_id + std::to_string(ts) + "0" + "0");
+        oxenc::bt_dict_producer d;
+        d.append("P", std::string_view{reinterpret_cast<const char*>(a.ed_pk.data()), 32});
+        d.append("d", 0);
+        {
+            auto n = d.append_list("n");
+            n.append(0);
+        }
+        d.append("s", sig);
+        d.append("t", ts);
+        return std::move(d).str();
+    }
+
+    // The node to send a request for `a` to: one of the targets, if given, otherwise any member
+    // of its swarm
+    const snode::sn_record* destination(const account& a) {
+        std::vector<const snode::sn_record*> choices;
+        for (auto& sn : a.swarm->snodes)
+            if (targets_.empty() ||
+                std::find(targets_.begin(), targets_.end(), &sn) != targets_.end())
+                choices.push_back(&sn);
+        return choices[uniform(choices.size())];
+    }
+
+  public:
+    Generator(
+            const options& opts,
+            const network& net,
+            std::vector<std::unique_ptr<account>>& accounts,
+            std::vector<const snode::sn_record*> targets,
+            std::vector<transport> transports,
+            std::vector<double> weights) :
+            opts_{opts},
+            net_{net},
+            accounts_{accounts},
+            targets_{std::move(targets)},
+            transports_{std::move(transports)},
+            rng_{opts.seed},
+            kinds_{weights.begin(), weights.end()} {
+        for (auto t : transports_)
+            if (t != transport::https)
+                monitor_transports_.push_back(t);
+    }
+
+    // Builds a request of kind `k` for `a`.  `t` is the transport to use, if possible; otherwise a
+    // random one is used.  `size` is the size of the data to store (for a store; 0 for a random
+    // size).
+    std::unique_ptr<request> make(
+            kind k,
+            account& a,
+            steady::time_point due,
+            std::optional<transport> t = std::nullopt,
+            size_t size = 0) {
+        auto req = std::make_unique<request>();
+        req->k = k;
+        req->due = due;
+        req->acct = &a;
+        req->to = destination(a);
+
+        std::vector<std::string> hashes;
+        if (req->k == kind::expire && (hashes = a.recent_hashes(5)).empty())
+            req->k = kind::store;  // Nothing to expire yet
+
+        req->method = to_string(req->k);
+        switch (req->k) {
+            case kind::store: req->body = store_params(a, size).dump(); break;
+            case kind::retrieve: req->body = retrieve_params(a).dump(); break;
+            case kind::expire: req->body = expire_params(a, hashes).dump(); break;
+            case kind::batch: {
+                auto reqs = nlohmann::json::array();
+                for (size_t i = 0; i < opts_.batch_size; i++) {
+                    if (i % 2 == 0)
+                        reqs.push_back({{"method", "store"}, {"params", store_params(a)}});
+                    else
+                        reqs.push_back({{"method", "retrieve"}, {"params", retrieve_params(a)}});
+                }
+                req->body = nlohmann::json{{"requests", std::move(reqs)}}.dump();
+                break;
+            }
+            case kind::monitor:
+                req->method = "monitor.messages";
+                req->body = monitor_body(a);
+                if (t && std::count(monitor_transports_.begin(), monitor_transports_.end(), *t))
+                    req->t = *t;
+                else
+                    req->t = monitor_transports_[uniform(monitor_transports_.size())];
+                if (req->t == transport::quic)
+                    req->method = "monitor";
+                return req;
+            case kind::onion: {
+                // Random hops to reach the destination, which is the last hop
+                std::vector<const snode::sn_record*> path;
+                while (path.size() + 1 < opts_.onion_hops && path.size() + 1 < net_.nodes.size())
+                    if (auto* sn = net_.nodes[uniform(net_.nodes.size())];
+                        sn != req->to && std::find(path.begin(), path.end(), sn) == path.end())
+                        path.push_back(sn);
+                path.push_back(req->to);
+                bool store = rng_() % 2;
+                auto payload = nlohmann::json{
+                        {"method", store ? "store" : "retrieve"},
+                        {"params", store ? store_params(a) : retrieve_params(a)}};
+                req->onion = std::make_shared<onion_keys>();
+                req->body = build_onion(
+                        path,
+                        payload.dump(),
+                        R"({"headers":[]})",
+                        crypto::EncryptType::xchacha20,
+                        *req->onion);
+                req->to = path.front();
+                req->t = transport::https;
+                return req;
+            }
+        }
+        if (t && std::count(transports_.begin(), transports_.end(), *t))
+            req->t = *t;
+        else
+            req->t = transports_[uniform(transports_.size())];
+        return req;
+    }
+
+    // Generates the next request of the configured mix
+    std::unique_ptr<request> next(steady::time_point due) {
+        return make(KINDS[kinds_(rng_)], *accounts_[uniform(accounts_.size())], due);
+    }
+
+    // Builds the stand-in for a captured request; returns nullptr if it is of a method we don't
+    // replay.  Captured accounts map onto our accounts by their hashes, so that requests for the
+    // same captured account go to the same one of ours.
+    std::unique_ptr<request> replay(
+            const rpc::TrafficCapture::record& r, steady::time_point due) {
+        std::optional<kind> k;
+        if (r.method == "store")
+            k = kind::store;
+        else if (r.method == "retrieve")
+            k = kind::retrieve;
+        else if (r.method == "batch" || r.method == "sequence")
+            k = kind::batch;
+        else if (r.method == "expire_msgs" || r.method == "expire_all")
+            k = kind::expire;
+        else if (
+                (r.method == "monitor" || r.method == "monitor.messages") &&
+                !monitor_transports_.empty())
+            k = kind::monitor;
+        if (!k)
+            return nullptr;
+
+        auto& a = *accounts_[r.account ? r.account % accounts_.size() : uniform(accounts_.size())];
+        auto t = r.via == rpc::TrafficCapture::transport::quic ? transport::quic
+               : r.via == rpc::TrafficCapture::transport::omq  ? transport::omq
+                                                               : transport::https;
+        // Roughly the data size that gives params of the captured size: what's left after the
+        // other store parameters, less the base64 overhead for json.
+        size_t size = 0;
+        if (*k == kind::store) {
+            size_t overhead = r.bt ? 200 : 300;
+            size = r.params_size > overhead ? r.params_size - overhead : 1;
+            if (!r.bt)
+                size = std::max<size_t>(size * 3 / 4, 1);
+        }
+        return make(*k, a, due, t, size);
+    }
+};
+
+// Checks a reply, returning the error (if it was not a success).  Also collects stored message
+// hashes.
+std::optional<std::string> check_reply(const request& req, int status, std::string& body) {
+    if (status == 0)
+        return "no response"s;
+    if (status != 200)
+        return "status " + std::to_string(status);
+    try {
+        switch (req.k) {
+            case kind::store: {
+                auto json = nlohmann::json::parse(body);
+                if (auto it = json.find("hash"); it != json.end())
+                    req.acct->add_hash(it->get<std::string>());
+                break;
+            }
+            case kind::monitor: {
+                oxenc::bt_dict_consumer d{body};
+                if (!d.skip_until("success"))
+                    return "subscription refused"s;
+                break;
+            }
+            case kind::onion: {
+                if (oxenc::is_base64(body))
+                    body = oxenc::from_base64(body);
+                auto& k = *req.onion;
+                auto json = nlohmann::json::parse(crypto::ChannelEncryption{
+                        k.seckey, k.pubkey, false}
+                                                          .decrypt(k.etype, body, k.destination));
+                if (auto inner = json.at("status").get<int>(); inner != 200)
+                    return "inner status " + std::to_string(inner);
+                break;
+            }
+            default: (void)nlohmann::json::parse(body);
+        }
+    } catch (const std::exception&) {
+        return "bad response"s;
+    }
+    return std::nullopt;
+}
+
+nlohmann::json to_json(const result& r, double seconds) {
+    nlohmann::json j{
+            {"ok", r.ok},
+            {"failed", r.failed},
+            {"ok_per_sec", seconds > 0 ? r.ok / seconds : 0},
+            {"errors", r.errors}};
+    bench::add_latencies(j, r.latencies_ms, "ms");
+    return j;
+}
+
+void print(const std::string& name, const result& r, double seconds) {
+    std::printf(
+            "%-20s %9zu ok %7zu failed %9.1f ok/s",
+            name.c_str(),
+            r.ok,
+            r.failed,
+            seconds > 0 ? r.ok / seconds : 0);
+    bench::print_latencies(r.latencies_ms, 9, 10);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    CLI::App cli{"Oxen Storage Server end-to-end load generator"};
+    options opts;
+    std::vector<std::string> target_hex;
+
+    cli.add_option("--oxend", opts.oxend, "OxenMQ address of oxend, to get the service node list")
+            ->capture_default_str();
+    cli.add_option(
+            "--target",
+            target_hex,
+            "Primary pubkey (hex) of a node to send requests to; may be given more than once.  By "
+            "default requests go to any node of the network.  (Onion request paths still use "
+            "other nodes.)");
+    cli.add_option("--transport", opts.transports, "Transports to spread requests over")
+            ->capture_default_str()
+            ->delimiter(',')
+            ->check(CLI::IsMember({"https", "omq", "quic"}));
+    cli.add_option(
+               "--mix",
+               opts.mix,
+               "Relative weights of the request types (store, retrieve, batch, expire_msgs, "
+               "monitor, onion), as NAME=WEIGHT pairs")
+            ->capture_default_str()
+            ->delimiter(',');
+    cli.add_option("--rate,-r", opts.rate, "Requests per second (open loop)")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--duration,-d", opts.duration, "Seconds to run for")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--accounts", opts.accounts, "Number of Session accounts to send requests for")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--min-size", opts.min_size, "Minimum stored message size, in bytes")
+            ->capture_default_str();
+    cli.add_option("--max-size", opts.max_size, "Maximum stored message size, in bytes")
+            ->capture_default_str();
+    cli.add_option("--ttl", opts.ttl_sec, "TTL of stored messages, in seconds")
+            ->capture_default_str()
+            ->check(CLI::Range(60, 14 * 24 * 3600));
+    cli.add_option("--batch-size", opts.batch_size, "Subrequests per batch request")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 20));
+    cli.add_option(
+               "--onion-hops",
+               opts.onion_hops,
+               "Nodes in an onion request path, including the destination")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 10));
+    cli.add_option(
+               "--https-workers",
+               opts.https_workers,
+               "Concurrent HTTPS requests (requests beyond that wait, which counts in their "
+               "latency)")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option(
+               "--max-in-flight",
+               opts.max_in_flight,
+               "Requests awaiting replies beyond which new ones are dropped rather than sent")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--timeout", opts.timeout, "Request timeout, in seconds")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option(
+               "--report-interval", opts.report_interval, "Seconds between progress reports")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--seed", opts.seed, "Random seed");
+    cli.add_option("--json", opts.json_out, "Also write the results as JSON to this file");
+    cli.add_option(
+               "--replay",
+               opts.replay,
+               "Replay a capture of a node's client requests (see the storage server's "
+               "--capture-file) instead of generating requests at --rate for --duration with the "
+               "--mix of request types")
+            ->check(CLI::ExistingFile);
+    cli.add_option(
+               "--speed",
+               opts.speed,
+               "Speed to replay a capture at, relative to its original timing (e.g. 2 sends "
+               "requests twice as fast as they were captured)")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+
+    try {
+        cli.parse(argc, argv);
+    } catch (const CLI::ParseError& e) {
+        return cli.exit(e);
+    }
+
+    if (opts.min_size > opts.max_size) {
+        std::cerr << "--min-size cannot be larger than --max-size\n";
+        return 1;
+    }
+    std::vector<double> weights(KINDS.size(), 0.0);
+    for (auto& m : opts.mix) {
+        auto eq = m.find('=');
+        auto it = std::find_if(KINDS.begin(), KINDS.end(), [&](kind k) {
+            return to_string(k) == std::string_view{m}.substr(0, eq);
+        });
+        try {
+            if (eq == std::string::npos || it == KINDS.end())
+                throw std::invalid_argument{"unknown request type"};
+            weights[it - KINDS.begin()] = std::stod(m.substr(eq + 1));
+        } catch (const std::exception&) {
+            std::cerr << "Invalid --mix value '" << m << "'\n";
+            return 1;
+        }
+    }
+    std::vector<transport> transports;
+    for (auto t : TRANSPORTS)
+        if (std::find(opts.transports.begin(), opts.transports.end(), to_string(t)) !=
+            opts.transports.end())
+            transports.push_back(t);
+    bool need_https = std::count(transports.begin(), transports.end(), transport::https) ||
+                      weights[static_cast<size_t>(kind::onion)] > 0;
+    bool need_quic = std::count(transports.begin(), transports.end(), transport::quic);
+    if (opts.replay.empty() && weights[static_cast<size_t>(kind::monitor)] > 0 && !need_quic &&
+        !std::count(transports.begin(), transports.end(), transport::omq)) {
+        std::cerr << "monitor requests need the omq or quic transport\n";
+        return 1;
+    }
+
+    if (sodium_init() < 0) {
+        std::cerr << "Failed to initialize libsodium\n";
+        return 1;
+    }
+
+    std::optional<rpc::TrafficCapture::capture_log> replay;
+    if (!opts.replay.empty()) {
+        try {
+            replay = rpc::TrafficCapture::read(opts.replay);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    const std::chrono::milliseconds timeout{static_cast<int64_t>(opts.timeout * 1000)};
+    Recorder rec;
+    // Requests live here until their replies come in and finish() is called for them.  (The
+    // transports come after, so that they are destroyed, and stop replying, first.)
+    std::mutex pending_mutex;
+    std::unordered_map<request*, std::unique_ptr<request>> pending;
+    auto finish = [&](request& req, int status, std::string body) {
+        auto error = check_reply(req, status, body);
+        rec.done(req, error);
+        std::lock_guard lock{pending_mutex};
+        pending.erase(&req);
+    };
+
+    OmqClient omq{rec, timeout};
+    std::optional<HttpsClient> https;
+    if (need_https)
+        https.emplace(opts.https_workers, timeout);
+    std::optional<QuicClient> quic;
+    if (need_quic)
+        quic.emplace(rec);
+
+    network net;
+    std::vector<const snode::sn_record*> targets;
+    try {
+        net = fetch_network(omq.omq(), opts.oxend);
+        if (net.nodes.empty())
+            throw std::runtime_error{"oxend returned no active service nodes"};
+        for (auto& hex : target_hex) {
+            auto pk = crypto::legacy_pubkey::maybe_from_hex(hex);
+            auto* sn = pk ? net.find(*pk) : nullptr;
+            if (!sn)
+                throw std::runtime_error{"Target " + hex + " is not an active service node"};
+            targets.push_back(sn);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 2;
+    }
+    std::printf("%zu active nodes in %zu swarms\n", net.nodes.size(), net.swarms.size());
+
+    // Accounts, in the targets' swarms if we have targets
+    std::vector<std::unique_ptr<account>> accounts;
+    while (accounts.size() < opts.accounts) {
+        auto a = std::make_unique<account>();
+        user_pubkey pk;
+        pk.load(a->session_id);
+        a->swarm = snode::get_swarm_by_pk(net.swarms, pk);
+        if (targets.empty() || std::any_of(targets.begin(), targets.end(), [&](auto* sn) {
+                return std::count(a->swarm->snodes.begin(), a->swarm->snodes.end(), *sn);
+            }))
+            accounts.push_back(std::move(a));
+    }
+
+    Generator gen{opts, net, accounts, targets, transports, weights};
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    if (replay)
+        std::printf(
+                "Replaying %zu captured requests (%.0fs of traffic) at %gx speed over %zu "
+                "transport(s) for %zu accounts\n",
+                replay->records.size(),
+                replay->records.empty()
+                        ? 0.0
+                        : std::chrono::duration<double>(replay->records.back().arrival).count(),
+                opts.speed,
+                transports.size(),
+                accounts.size());
+    else
+        std::printf(
+                "Sending %.1f requests/s for %.0fs over %zu transport(s) for %zu accounts\n",
+                opts.rate,
+                opts.duration,
+                transports.size(),
+                accounts.size());
+    std::mt19937_64 arrivals_rng{opts.seed ^ 0x9e3779b97f4a7c15};
+    std::exponential_distribution<double> gap{opts.rate};
+    const auto started = steady::now();
+    const auto end =
+            started + std::chrono::duration_cast<steady::duration>(
+                              std::chrono::duration<double>{opts.duration});
+    auto next_report = started + std::chrono::duration_cast<steady::duration>(
+                                         std::chrono::duration<double>{opts.report_interval});
+    size_t last_completed = 0;
+    double max_lag_ms = 0;
+    auto due = started;
+    size_t next_record = 0;
+    std::map<std::string, size_t> skipped;  // Captured requests of methods we don't replay
+    for (bool first = true; !interrupted; first = false) {
+        const rpc::TrafficCapture::record* captured = nullptr;
+        if (replay) {
+            if (next_record == replay->records.size())
+                break;
+            captured = &replay->records[next_record++];
+            due = started +
+                  std::chrono::duration_cast<steady::duration>(captured->arrival / opts.speed);
+        } else {
+            if (!first)
+                due += std::chrono::duration_cast<steady::duration>(
+                        std::chrono::duration<double>{gap(arrivals_rng)});
+            if (due >= end)
+                break;
+        }
+        std::this_thread::sleep_until(due);
+        auto now = steady::now();
+        max_lag_ms =
+                std::max(max_lag_ms, std::chrono::duration<double, std::milli>(now - due).count());
+
+        if (now >= next_report) {
+            auto completed = rec.completed.load();
+            std::printf(
+                    "[%6.1fs] sent %zu, ok %zu (%.1f/s), failed %zu, in flight %zu, dropped %zu, "
+                    "notifications %zu\n",
+                    std::chrono::duration<double>(now - started).count(),
+                    rec.sent.load(),
+                    completed,
+                    (completed - last_completed) / opts.report_interval,
+                    rec.failed.load(),
+                    rec.in_flight.load(),
+                    rec.dropped.load(),
+                    rec.notifications.load());
+            std::fflush(stdout);
+            last_completed = completed;
+            next_report += std::chrono::duration_cast<steady::duration>(
+                    std::chrono::duration<double>{opts.report_interval});
+        }
+
+        if (rec.in_flight >= opts.max_in_flight) {
+            rec.dropped++;
+            continue;
+        }
+        auto owned = captured ? gen.replay(*captured, due) : gen.next(due);
+        if (!owned) {
+            skipped[captured->method]++;
+            continue;
+        }
+        auto& req = *owned;
+        {
+            std::lock_guard lock{pending_mutex};
+            pending.emplace(&req, std::move(owned));
+        }
+        rec.sent++;
+        rec.in_flight++;
+        auto done = [&finish, &req](int status, std::string body) {
+            finish(req, status, std::move(body));
+        };
+        switch (req.t) {
+            case transport::https: https->send(req, std::move(done)); break;
+            case transport::omq: omq.send(req, std::move(done)); break;
+            case transport::quic: quic->send(req, std::move(done)); break;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(steady::now() - started).count();
+
+    // Wait for the stragglers (which, being open loop, are still counted from when they were due)
+    auto wait_until = steady::now() + timeout + 1s;
+    while (rec.in_flight > 0 && steady::now() < wait_until)
+        std::this_thread::sleep_for(10ms);
+    size_t unfinished = rec.in_flight;
+
+    nlohmann::json report{
+            {"rate", opts.rate},
+            {"seconds", seconds},
+            {"accounts", accounts.size()},
+            {"nodes", targets.empty() ? net.nodes.size() : targets.size()},
+            {"sent", rec.sent.load()},
+            {"dropped", rec.dropped.load()},
+            {"unfinished", unfinished},
+            {"notifications", rec.notifications.load()},
+            {"max_send_lag_ms", max_lag_ms}};
+    if (replay) {
+        report["replay"] = {
+                {"file", opts.replay.string()}, {"speed", opts.speed}, {"skipped", skipped}};
+        report["rate"] = seconds > 0 ? rec.sent.load() / seconds : 0.0;
+    }
+    auto& results = (report["results"] = nlohmann::json::object());
+
+    std::printf(
+            "\n%-20s %12s %14s %14s %9s %9s %9s %9s %10s\n",
+            "request",
+            "",
+            "",
+            "",
+            "p50 (ms)",
+            "p90 (ms)",
+            "p99 (ms)",
+            "p99.9(ms)",
+            "max (ms)");
+    result total;
+    for (auto& [key, r] : rec.results()) {
+        auto name = std::string{to_string(key.first)} + "/" + std::string{to_string(key.second)};
+        std::sort(r.latencies_ms.begin(), r.latencies_ms.end());
+        print(name, r, seconds);
+        results[name] = to_json(r, seconds);
+        total.ok += r.ok;
+        total.failed += r.failed;
+        total.latencies_ms.insert(
+                total.latencies_ms.end(), r.latencies_ms.begin(), r.latencies_ms.end());
+        for (auto& [err, n] : r.errors)
+            total.errors[name + ": " + err] += n;
+    }
+    std::sort(total.latencies_ms.begin(), total.latencies_ms.end());
+    print("total", total, seconds);
+    results["total"] = to_json(total, seconds);
+
+    std::printf(
+            "sent %zu; dropped %zu (over --max-in-flight); unfinished %zu; %zu notifications; "
+            "max send lag %.1fms\n",
+            rec.sent.load(),
+            rec.dropped.load(),
+            unfinished,
+            rec.notifications.load(),
+            max_lag_ms);
+    for (auto& [err, n] : total.errors)
+        std::printf("  %8zu x %s\n", n, err.c_str());
+    for (auto& [method, n] : skipped)
+        std::printf("  %8zu x not replayed: %s\n", n, method.c_str());
+
+    if (!opts.json_out.empty()) {
+        std::ofstream out{opts.json_out};
+        out << report.dump(2) << '\n';
+    }
+
+    return unfinished ? 3 : 0;
+}
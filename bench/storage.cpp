@@ -0,0 +1,355 @@
+// Storage engine benchmark.  Fills a database with a realistic mix of messages (by namespace, TTL
+// and size) and then times each of the main Database operations against it, reporting throughput
+// and latency percentiles.  With --json the results are also written as a JSON document with
+// stable keys, so that runs of different versions (or schema/pragma changes) can be diffed.
+
+#include <oxenss/common/message.h>
+#include <oxenss/common/namespace.h>
+#include <oxenss/common/pubkey.h>
+#include <oxenss/storage/database.hpp>
+
+#include "latencies.hpp"
+
+#include <CLI/CLI.hpp>
+#include <nlohmann/json.hpp>
+#include <oxenc/base64.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace oxenss;
+using namespace std::literals;
+using std::chrono::system_clock;
+
+namespace {
+
+// The namespace/TTL/size mix we fill the database with, roughly matching what mainnet nodes see.
+struct namespace_mix {
+    namespace_id ns;
+    double weight;
+    std::chrono::milliseconds ttl;
+    size_t min_size, max_size;
+};
+
+const std::vector<namespace_mix> MIX{
+        {namespace_id::Default, 0.55, 14 * 24h, 200, 3000},
+        {namespace_id::UserProfile, 0.03, 30 * 24h, 300, 2000},
+        {namespace_id::Contacts, 0.04, 30 * 24h, 500, 8000},
+        {namespace_id::ConvoInfoVolatile, 0.08, 30 * 24h, 300, 4000},
+        {namespace_id::UserGroups, 0.03, 30 * 24h, 300, 4000},
+        {namespace_id::GroupMessages, 0.18, 14 * 24h, 200, 3000},
+        {namespace_id::GroupKeys, 0.02, 30 * 24h, 200, 6000},
+        {namespace_id::GroupInfo, 0.02, 30 * 24h, 200, 2000},
+        {namespace_id::GroupMembers, 0.02, 30 * 24h, 200, 4000},
+        {namespace_id::LegacyClosed, 0.03, 14 * 24h, 200, 3000},
+};
+
+// Average number of messages per owner
+constexpr size_t MESSAGES_PER_OWNER = 20;
+
+class Generator {
+    std::mt19937_64 rng_;
+    std::discrete_distribution<size_t> mix_;
+    std::vector<user_pubkey> owners_;
+
+  public:
+    Generator(uint64_t seed, size_t owners) : rng_{seed} {
+        std::vector<double> weights;
+        for (auto& m : MIX)
+            weights.push_back(m.weight);
+        mix_ = std::discrete_distribution<size_t>{weights.begin(), weights.end()};
+
+        owners_.reserve(owners);
+        std::string raw(33, '\x05');
+        while (owners_.size() < owners) {
+            for (size_t i = 1; i < raw.size(); i++)
+                raw[i] = static_cast<char>(rng_());
+            if (user_pubkey pk; pk.load(raw))
+                owners_.push_back(std::move(pk));
+        }
+    }
+
+    std::mt19937_64& rng() { return rng_; }
+
+    size_t uniform(size_t n) { return std::uniform_int_distribution<size_t>{0, n - 1}(rng_); }
+
+    const user_pubkey& owner() { return owners_[uniform(owners_.size())]; }
+
+    std::string hash() {
+        std::array<unsigned char, 32> raw;
+        for (auto& c : raw)
+            c = static_cast<unsigned char>(rng_());
+        auto h = oxenc::to_base64(raw.begin(), raw.end());
+        h.resize(43);  // Drop the padding, as real message hashes do
+        return h;
+    }
+
+    // Returns a message from the mix, stored some random fraction of the way through its lifetime
+    // (or, if `expired`, just past the end of it).
+    message next(system_clock::time_point now, bool expired = false) {
+        auto& m = MIX[mix_(rng_)];
+        auto age = expired ? m.ttl + std::chrono::milliseconds{1 + uniform(60'000)}
+                           : std::chrono::milliseconds{uniform(m.ttl.count())};
+        auto timestamp = now - age;
+        std::string data(m.min_size + uniform(m.max_size - m.min_size + 1), '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng_());
+        return message{owner(), hash(), m.ns, timestamp, timestamp + m.ttl, std::move(data)};
+    }
+};
+
+struct result {
+    std::string name;
+    size_t ops = 0;
+    size_t items = 0;  // Messages processed, for batch operations; same as ops otherwise
+    double seconds = 0;
+    std::vector<double> latencies_us;
+};
+
+// Calls `op(i)` for i in [0, count), timing each call.  `op` returns the number of messages the
+// call processed (for throughput reporting).
+result run(const std::string& name, size_t count, const std::function<size_t(size_t)>& op) {
+    result r{name};
+    r.latencies_us.reserve(count);
+    auto started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        auto t = std::chrono::steady_clock::now();
+        r.items += op(i);
+        r.latencies_us.push_back(
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t)
+                        .count());
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    r.ops = count;
+    std::sort(r.latencies_us.begin(), r.latencies_us.end());
+    return r;
+}
+
+nlohmann::json to_json(const result& r) {
+    nlohmann::json j{
+            {"ops", r.ops},
+            {"items", r.items},
+            {"seconds", r.seconds},
+            {"ops_per_sec", r.seconds > 0 ? r.ops / r.seconds : 0},
+            {"items_per_sec", r.seconds > 0 ? r.items / r.seconds : 0}};
+    bench::add_latencies(j, r.latencies_us, "us");
+    return j;
+}
+
+void print(const result& r) {
+    std::printf(
+            "%-24s %9zu ops %12.0f items/s",
+            r.name.c_str(),
+            r.ops,
+            r.seconds > 0 ? r.items / r.seconds : 0);
+    bench::print_latencies(r.latencies_us, 10, 12);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    CLI::App cli{"Oxen Storage Server storage engine benchmark"};
+
+    size_t messages = 1'000'000;
+    size_t ops = 10'000;
+    size_t batch_size = 1000;
+    size_t shards = 1;
+    uint64_t seed = 12345;
+    std::filesystem::path dir = "bench_storage_db";
+    std::filesystem::path json_out;
+    bool keep = false;
+    bool reuse = false;
+
+    cli.add_option("--messages,-n", messages, "Number of messages to fill the database with")
+            ->capture_default_str();
+    cli.add_option("--ops", ops, "Number of operations to time for each benchmark")
+            ->capture_default_str();
+    cli.add_option("--batch-size", batch_size, "Messages per bulk_store call")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--shards", shards, "Number of database shards")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 64));
+    cli.add_option("--seed", seed, "Random seed")->capture_default_str();
+    cli.add_option("--dir", dir, "Directory to create the database in")->capture_default_str();
+    cli.add_option("--json", json_out, "Also write the results as JSON to this file");
+    cli.add_flag("--keep", keep, "Don't delete the database when done");
+    cli.add_flag(
+            "--reuse",
+            reuse,
+            "Reuse a database left in --dir by a previous --keep run (with the same --messages and "
+            "--seed) rather than filling a new one");
+
+    try {
+        cli.parse(argc, argv);
+    } catch (const CLI::ParseError& e) {
+        return cli.exit(e);
+    }
+
+    if (!reuse)
+        std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    Generator gen{seed, std::max<size_t>(messages / MESSAGES_PER_OWNER, 1)};
+    auto now = system_clock::now();
+
+    nlohmann::json report{
+            {"messages", messages}, {"ops", ops}, {"shards", shards}, {"seed", seed}};
+    auto& results = (report["results"] = nlohmann::json::object());
+    auto record = [&](result r) {
+        print(r);
+        results[r.name] = to_json(r);
+    };
+
+    // A sample of the stored messages, which the retrieve/delete/expiry benchmarks operate on
+    std::vector<message> sample;
+    const size_t sample_every = std::max<size_t>(messages / std::max<size_t>(4 * ops, 1), 1);
+
+    {
+        Database db{dir, Database::DEFAULT_MAX_WRITERS, Database::DEFAULT_MAX_READERS, shards};
+
+        std::printf(
+                "%-24s %13s %20s %10s %10s %10s %10s %12s\n",
+                "benchmark",
+                "",
+                "",
+                "p50 (us)",
+                "p90 (us)",
+                "p99 (us)",
+                "p99.9 (us)",
+                "max (us)");
+
+        // Fill (or, when reusing, regenerate the same messages to sample from without storing)
+        size_t filled = 0;
+        std::vector<message> batch;
+        auto fill = run("fill_bulk_store", (messages + batch_size - 1) / batch_size, [&](size_t) {
+            batch.clear();
+            while (batch.size() < batch_size && filled < messages) {
+                batch.push_back(gen.next(now));
+                if (filled++ % sample_every == 0)
+                    sample.push_back(batch.back());
+            }
+            if (!reuse)
+                db.bulk_store(batch);
+            return batch.size();
+        });
+        if (!reuse)
+            record(std::move(fill));
+        std::shuffle(sample.begin(), sample.end(), gen.rng());
+        auto used_bytes = db.get_used_bytes();
+        report["db_used_bytes"] = used_bytes;
+        std::printf("database: %zu messages, %lld bytes used\n", messages, (long long)used_bytes);
+
+        auto sampled = [&](size_t i) -> message& { return sample[i % sample.size()]; };
+
+        record(run("store", ops, [&](size_t) {
+            db.store(gen.next(now));
+            return 1;
+        }));
+
+        record(run("store_existing", ops, [&](size_t i) {
+            db.store(sampled(i));
+            return 1;
+        }));
+
+        record(run("bulk_store", std::max<size_t>(ops / batch_size, 1), [&](size_t) {
+            batch.clear();
+            while (batch.size() < batch_size)
+                batch.push_back(gen.next(now));
+            db.bulk_store(batch);
+            return batch.size();
+        }));
+
+        record(run("retrieve", ops, [&](size_t i) {
+            auto& m = sampled(i);
+            return db.retrieve(m.pubkey, m.msg_namespace, "").first.size();
+        }));
+
+        record(run("retrieve_last_hash", ops, [&](size_t i) {
+            auto& m = sampled(i);
+            return db.retrieve(m.pubkey, m.msg_namespace, m.hash).first.size();
+        }));
+
+        record(run("retrieve_random", ops, [&](size_t) {
+            return db.retrieve_random() ? 1 : 0;
+        }));
+
+        record(run("get_expiries", ops, [&](size_t i) {
+            auto& m = sampled(i);
+            return db.get_expiries(m.pubkey, {m.hash}).size();
+        }));
+
+        record(run("update_expiry", ops, [&](size_t i) {
+            auto& m = sampled(i);
+            return db.update_expiry(m.pubkey, {m.hash}, {now + 14 * 24h}).size();
+        }));
+
+        record(run("stats_message_count", std::max<size_t>(ops / 100, 1), [&](size_t) {
+            db.get_message_count();
+            return 1;
+        }));
+        record(run("stats_owner_count", std::max<size_t>(ops / 100, 1), [&](size_t) {
+            db.get_owner_count();
+            return 1;
+        }));
+        record(run("stats_namespace_counts", std::max<size_t>(ops / 100, 1), [&](size_t) {
+            db.get_namespace_counts();
+            return 1;
+        }));
+        record(run("stats_message_counts", std::max<size_t>(ops / 1000, 1), [&](size_t) {
+            return db.get_message_counts().size();
+        }));
+        record(run("stats_used_bytes", std::max<size_t>(ops / 100, 1), [&](size_t) {
+            db.get_used_bytes();
+            return 1;
+        }));
+
+        // Deletes go last (after everything else that uses the sample)
+        record(run("delete_by_hash", std::min(ops, sample.size()), [&](size_t i) {
+            auto& m = sampled(i);
+            return db.delete_by_hash(m.pubkey, {m.hash}).size();
+        }));
+
+        // Expiry cleanup: add already-expired messages, then time the clean_expired() calls it
+        // takes to get rid of them all.
+        batch.clear();
+        for (size_t i = 0; i < ops; i++)
+            batch.push_back(gen.next(now, /*expired=*/true));
+        db.bulk_store(batch);
+        bool done = false;
+        auto cleanup = run("clean_expired", 0, nullptr);
+        while (!done) {
+            auto r = run("clean_expired", 1, [&](size_t) {
+                auto n = db.clean_expired();
+                done = db.expired_backlog() == 0;
+                return static_cast<size_t>(n);
+            });
+            cleanup.ops++;
+            cleanup.items += r.items;
+            cleanup.seconds += r.seconds;
+            cleanup.latencies_us.push_back(r.latencies_us.front());
+        }
+        std::sort(cleanup.latencies_us.begin(), cleanup.latencies_us.end());
+        record(std::move(cleanup));
+    }
+
+    if (!json_out.empty()) {
+        std::ofstream out{json_out};
+        out << report.dump(2) << '\n';
+    }
+
+    if (!keep)
+        std::filesystem::remove_all(dir);
+
+    return 0;
+}
@@ -0,0 +1,609 @@
+// Swarm churn simulation.  Builds a realistic network (thousands of nodes in hundreds of swarms)
+// and replays a sequence of blocks in which nodes get decommissioned, recommissioned, registered
+// and deregistered, with swarms being topped up, dissolved and created the way oxend does it.  A
+// sample of nodes ("observers") processes each block's swarm list as a storage server would, and
+// we time derive_swarm_events, update_state, apply_swarm_changes and preserve_ips, along with the
+// data selection that follows (working out which of its messages a node relays where, as
+// bootstrap_swarms and the dissolved-swarm salvage do), and add up the messages and bytes that the
+// reshuffles make nodes relay.  --json saves the timings and relay totals (along with the network
+// parameters used) to a file.
+
+#include <oxenss/snode/sn_record.h>
+#include <oxenss/snode/swarm.h>
+
+#include "latencies.hpp"
+
+#include <CLI/CLI.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using namespace oxenss;
+using namespace oxenss::snode;
+using namespace std::literals;
+
+namespace {
+
+// oxend's swarm sizes
+constexpr size_t MIN_SWARM_SIZE = 5;
+constexpr size_t IDEAL_SWARM_SIZE = 7;
+constexpr size_t MAX_SWARM_SIZE = 10;
+
+struct churn {
+    double decommissions = 0.5;  // active nodes decommissioned per block (mean)
+    double recommission = 0.05;  // chance per block of a decommissioned node coming back
+    double expire = 0.01;        // chance per block of a decommissioned node being deregistered
+    double registrations = 0.5;  // new nodes per block (mean)
+    double deregistrations = 0.4;  // active nodes leaving the network per block (mean)
+};
+
+// The simulated network's swarm assignments, following (a simplified version of) oxend's rules:
+// swarms that drop below the minimum size are topped up from spare nodes or nodes of swarms above
+// the ideal size, or else dissolved; spare nodes fill swarms up to the ideal size; and once there
+// are enough spare and excess nodes they form a new swarm.
+class Network {
+    std::mt19937_64& rng_;
+    uint32_t next_id_ = 0;
+
+    size_t uniform(size_t n) { return std::uniform_int_distribution<size_t>{0, n - 1}(rng_); }
+
+    size_t poisson(double mean) {
+        return mean > 0 ? std::poisson_distribution<size_t>{mean}(rng_) : 0;
+    }
+
+    sn_record make_node() {
+        sn_record sn;
+        auto id = next_id_++;
+        std::array<unsigned char, 32> pk;
+        for (auto& c : pk)
+            c = static_cast<unsigned char>(rng_());
+        std::memcpy(pk.data(), &id, sizeof(id));
+        std::memcpy(sn.pubkey_legacy.data(), pk.data(), 32);
+        pk[31] ^= 1;
+        std::memcpy(sn.pubkey_ed25519.data(), pk.data(), 32);
+        pk[31] ^= 2;
+        std::memcpy(sn.pubkey_x25519.data(), pk.data(), 32);
+        sn.ip = "10." + std::to_string(id >> 16 & 0xff) + "." + std::to_string(id >> 8 & 0xff) +
+                "." + std::to_string(id & 0xff);
+        sn.port = 22021;
+        sn.omq_quic_port = 22020;
+        return sn;
+    }
+
+    // Moves one node into `to`: a spare one if there is one, otherwise one from the largest swarm
+    // above the ideal size (other than `to` itself).  Returns false if there is no such node.
+    bool take_node(std::vector<sn_record>& to) {
+        if (!spare.empty()) {
+            to.push_back(std::move(spare.back()));
+            spare.pop_back();
+            return true;
+        }
+        std::vector<sn_record>* from = nullptr;
+        for (auto& [id, s] : swarms)
+            if (&s != &to && s.size() > IDEAL_SWARM_SIZE && (!from || s.size() > from->size()))
+                from = &s;
+        if (!from)
+            return false;
+        auto i = uniform(from->size());
+        to.push_back(std::move((*from)[i]));
+        from->erase(from->begin() + i);
+        return true;
+    }
+
+    size_t excess() const {
+        size_t n = 0;
+        for (auto& [id, s] : swarms)
+            if (s.size() > IDEAL_SWARM_SIZE)
+                n += s.size() - IDEAL_SWARM_SIZE;
+        return n;
+    }
+
+    // The smallest swarm with fewer than `limit` nodes, if any
+    std::vector<sn_record>* smallest_below(size_t limit) {
+        std::vector<sn_record>* best = nullptr;
+        for (auto& [id, s] : swarms)
+            if (s.size() < limit && (!best || s.size() < best->size()))
+                best = &s;
+        return best;
+    }
+
+    void assign() {
+        for (auto it = swarms.begin(); it != swarms.end();) {
+            auto& s = it->second;
+            while (s.size() < MIN_SWARM_SIZE && take_node(s)) {}
+            if (s.size() < MIN_SWARM_SIZE) {
+                spare.insert(spare.end(), s.begin(), s.end());
+                it = swarms.erase(it);
+                dissolutions++;
+            } else {
+                ++it;
+            }
+        }
+
+        while (!spare.empty())
+            if (auto* s = smallest_below(IDEAL_SWARM_SIZE)) {
+                s->push_back(std::move(spare.back()));
+                spare.pop_back();
+            } else {
+                break;
+            }
+
+        while (spare.size() + excess() >= IDEAL_SWARM_SIZE) {
+            swarm_id_t id;
+            do
+                id = rng_();
+            while (id == INVALID_SWARM_ID || swarms.count(id));
+            auto& s = swarms[id];
+            while (s.size() < IDEAL_SWARM_SIZE && take_node(s)) {}
+            new_swarms++;
+        }
+
+        while (!spare.empty())
+            if (auto* s = smallest_below(MAX_SWARM_SIZE)) {
+                s->push_back(std::move(spare.back()));
+                spare.pop_back();
+            } else {
+                break;
+            }
+    }
+
+    // Returns the swarm and position of a random swarm member, or a null swarm if there are none.
+    // (Swarms can be empty here until the next assign() dissolves them.)
+    std::pair<std::vector<sn_record>*, size_t> pick_active() {
+        size_t members = 0;
+        for (auto& [id, s] : swarms)
+            members += s.size();
+        if (members == 0)
+            return {nullptr, 0};
+        auto i = uniform(members);
+        for (auto& [id, s] : swarms) {
+            if (i < s.size())
+                return {&s, i};
+            i -= s.size();
+        }
+        return {nullptr, 0};
+    }
+
+    // Removes and returns a random active (swarm member) node, if there are any
+    std::optional<sn_record> take_active() {
+        auto [s, i] = pick_active();
+        if (!s)
+            return std::nullopt;
+        auto sn = std::move((*s)[i]);
+        s->erase(s->begin() + i);
+        return sn;
+    }
+
+  public:
+    std::map<swarm_id_t, std::vector<sn_record>> swarms;
+    std::vector<sn_record> spare;  // Active nodes not (yet) in a swarm
+    std::vector<sn_record> decommissioned;
+
+    size_t new_swarms = 0, dissolutions = 0;
+
+    Network(std::mt19937_64& rng, size_t nodes) : rng_{rng} {
+        for (size_t i = 0; i < nodes; i++)
+            spare.push_back(make_node());
+        assign();
+        new_swarms = 0;
+    }
+
+    size_t active() const {
+        size_t n = spare.size();
+        for (auto& [id, s] : swarms)
+            n += s.size();
+        return n;
+    }
+
+    // Applies one block's worth of churn
+    void block(const churn& c) {
+        for (size_t i = poisson(c.decommissions); i > 0; i--)
+            if (auto sn = take_active())
+                decommissioned.push_back(std::move(*sn));
+            else
+                break;
+        for (size_t i = poisson(c.deregistrations); i > 0; i--)
+            if (!take_active())
+                break;
+        std::uniform_real_distribution<double> chance;
+        for (auto it = decommissioned.begin(); it != decommissioned.end();) {
+            auto r = chance(rng_);
+            if (r < c.recommission) {
+                spare.push_back(std::move(*it));
+                it = decommissioned.erase(it);
+            } else if (r < c.recommission + c.expire) {
+                it = decommissioned.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (size_t i = poisson(c.registrations); i > 0; i--)
+            spare.push_back(make_node());
+        assign();
+    }
+
+    // The swarm list, as a block update delivers it to storage servers (sorted by swarm id)
+    std::vector<SwarmInfo> swarm_list() const {
+        std::vector<SwarmInfo> list;
+        list.reserve(swarms.size());
+        for (auto& [id, s] : swarms)
+            list.push_back({id, s});
+        return list;
+    }
+
+    // Returns a random swarm member, or nullptr if there are none
+    const sn_record* random_active() {
+        auto [s, i] = pick_active();
+        return s ? &(*s)[i] : nullptr;
+    }
+};
+
+// The swarm space positions of the network's messages, sorted, for counting the messages in
+// swarm space ranges (which is what the range scans of bootstrapping go through)
+class Messages {
+    std::vector<uint64_t> positions_;
+
+    size_t count_linear(uint64_t begin, uint64_t end) const {
+        if (begin > end)
+            return 0;
+        return std::upper_bound(positions_.begin(), positions_.end(), end) -
+               std::lower_bound(positions_.begin(), positions_.end(), begin);
+    }
+
+    // Splits a (possibly wrapping) inclusive range into non-wrapping pieces
+    static std::vector<std::pair<uint64_t, uint64_t>> pieces(std::pair<uint64_t, uint64_t> r) {
+        if (r.first <= r.second)
+            return {r};
+        return {{0, r.second}, {r.first, std::numeric_limits<uint64_t>::max()}};
+    }
+
+  public:
+    Messages(std::mt19937_64& rng, size_t count) : positions_(count) {
+        for (auto& p : positions_)
+            p = rng();
+        std::sort(positions_.begin(), positions_.end());
+    }
+
+    size_t count(std::pair<uint64_t, uint64_t> r) const {
+        size_t n = 0;
+        for (auto [b, e] : pieces(r))
+            n += count_linear(b, e);
+        return n;
+    }
+
+    // Messages in both ranges
+    size_t count(std::pair<uint64_t, uint64_t> a, std::pair<uint64_t, uint64_t> b) const {
+        size_t n = 0;
+        for (auto [ab, ae] : pieces(a))
+            for (auto [bb, be] : pieces(b))
+                n += count_linear(std::max(ab, bb), std::min(ae, be));
+        return n;
+    }
+};
+
+size_t swarm_index(const std::vector<SwarmInfo>& swarms, swarm_id_t id) {
+    auto it = std::lower_bound(swarms.begin(), swarms.end(), SwarmInfo{id, {}});
+    return it != swarms.end() && it->swarm_id == id ? it - swarms.begin() : swarms.size();
+}
+
+// Works out what a node that held the messages of `held` relays, and to how many nodes, given the
+// events it derived from the new `swarms`: everything to nodes that joined its swarm; the part
+// that falls in a new swarm's range to that swarm's members; and, if its swarm dissolved,
+// everything to whichever swarms it now belongs to.  Returns the count of messages times
+// recipients.
+size_t select_relays(
+        const Messages& msgs,
+        std::pair<uint64_t, uint64_t> held,
+        const SwarmEvents& events,
+        const std::vector<SwarmInfo>& swarms) {
+    size_t relayed = 0;
+    if (!events.new_snodes.empty())
+        relayed += msgs.count(held) * events.new_snodes.size();
+    for (auto id : events.new_swarms)
+        if (auto i = swarm_index(swarms, id); i < swarms.size())
+            relayed += msgs.count(held, swarm_space_range(swarms, i)) * swarms[i].snodes.size();
+    if (events.dissolved)
+        for (size_t i = 0; i < swarms.size(); i++)
+            relayed += msgs.count(held, swarm_space_range(swarms, i)) * swarms[i].snodes.size();
+    return relayed;
+}
+
+struct result {
+    std::string name;
+    std::vector<double> latencies_us;
+    double total_us = 0;
+
+    void add(double us) {
+        latencies_us.push_back(us);
+        total_us += us;
+    }
+};
+
+// Runs `f`, returning how long it took in microseconds
+template <typename F>
+double time_us(F&& f) {
+    auto t = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t).count();
+}
+
+nlohmann::json to_json(const result& r) {
+    nlohmann::json j{{"calls", r.latencies_us.size()}, {"total_ms", r.total_us / 1000}};
+    bench::add_latencies(j, r.latencies_us, "us");
+    return j;
+}
+
+void print(const result& r) {
+    std::printf(
+            "%-24s %9zu calls %12.1f ms",
+            r.name.c_str(),
+            r.latencies_us.size(),
+            r.total_us / 1000);
+    bench::print_latencies(r.latencies_us, 10, 12);
+}
+
+struct observer {
+    sn_record address;
+    std::unique_ptr<Swarm> swarm;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    CLI::App cli{"Oxen Storage Server swarm churn simulation"};
+
+    size_t nodes = 2000;
+    size_t blocks = 200;
+    size_t observers = 100;
+    size_t messages = 5'000'000;
+    size_t message_size = 1000;
+    double missing_ips = 0.02;
+    uint64_t seed = 12345;
+    churn c;
+    std::filesystem::path json_out;
+
+    cli.add_option("--nodes,-n", nodes, "Number of nodes to start the network with")
+            ->capture_default_str()
+            ->check(CLI::Range(size_t{IDEAL_SWARM_SIZE}, size_t{1'000'000}));
+    cli.add_option("--blocks", blocks, "Number of blocks to simulate")->capture_default_str();
+    cli.add_option(
+               "--observers",
+               observers,
+               "Number of nodes that process each block as a storage server would (and whose "
+               "relays the network-wide totals are extrapolated from)")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--messages", messages, "Number of messages stored on the network")
+            ->capture_default_str();
+    cli.add_option("--message-size", message_size, "Average message size, in bytes")
+            ->capture_default_str();
+    cli.add_option(
+               "--missing-ips",
+               missing_ips,
+               "Fraction of nodes whose IP is missing from a block update, for preserve_ips")
+            ->capture_default_str()
+            ->check(CLI::Range(0.0, 1.0));
+    cli.add_option("--decommissions", c.decommissions, "Mean decommissions per block")
+            ->capture_default_str();
+    cli.add_option(
+               "--recommission",
+               c.recommission,
+               "Chance per block of a decommissioned node being recommissioned")
+            ->capture_default_str()
+            ->check(CLI::Range(0.0, 1.0));
+    cli.add_option(
+               "--expire",
+               c.expire,
+               "Chance per block of a decommissioned node being deregistered")
+            ->capture_default_str()
+            ->check(CLI::Range(0.0, 1.0));
+    cli.add_option("--registrations", c.registrations, "Mean new nodes per block")
+            ->capture_default_str();
+    cli.add_option(
+               "--deregistrations",
+               c.deregistrations,
+               "Mean active nodes leaving the network per block")
+            ->capture_default_str();
+    cli.add_option("--seed", seed, "Random seed")->capture_default_str();
+    cli.add_option("--json", json_out, "Also write the results as JSON to this file");
+
+    try {
+        cli.parse(argc, argv);
+    } catch (const CLI::ParseError& e) {
+        return cli.exit(e);
+    }
+
+    std::mt19937_64 rng{seed};
+    Network net{rng, nodes};
+    Messages msgs{rng, messages};
+    std::printf(
+            "network: %zu nodes in %zu swarms; %zu messages of %zu bytes\n",
+            net.active(),
+            net.swarms.size(),
+            messages,
+            message_size);
+
+    result derive{"derive_swarm_events"}, update{"update_state"}, apply{"apply_swarm_changes"},
+            preserve{"preserve_ips"}, select{"data_selection"}, per_block{"node_block_total"};
+
+    std::vector<observer> obs;
+    auto add_observer = [&] {
+        if (auto* sn = net.random_active())
+            obs.push_back({*sn, std::make_unique<Swarm>(*sn)});
+    };
+    for (size_t i = 0; i < std::min(observers, net.active()); i++)
+        add_observer();
+    Swarm applier{sn_record{}};
+
+    size_t events_new_swarms = 0, events_new_snodes = 0, events_dissolved = 0;
+    size_t relayed_msgs = 0;
+    double estimated_msgs = 0;
+    std::vector<SwarmInfo> prev_swarms;
+    std::bernoulli_distribution missing{missing_ips};
+
+    for (size_t b = 0; b <= blocks; b++) {
+        // (Block 0 is the initial network, which every observer starts from)
+        if (b > 0)
+            net.block(c);
+        auto swarms = net.swarm_list();
+
+        // Observers that left the network get replaced by new ones
+        std::unordered_set<crypto::legacy_pubkey> funded;
+        for (auto& s : swarms)
+            for (auto& sn : s.snodes)
+                funded.insert(sn.pubkey_legacy);
+        for (auto& sn : net.spare)
+            funded.insert(sn.pubkey_legacy);
+        for (auto& sn : net.decommissioned)
+            funded.insert(sn.pubkey_legacy);
+        size_t replaced = 0;
+        obs.erase(
+                std::remove_if(
+                        obs.begin(),
+                        obs.end(),
+                        [&](const observer& o) {
+                            return !funded.count(o.address.pubkey_legacy) && ++replaced;
+                        }),
+                obs.end());
+        for (; replaced > 0; replaced--)
+            add_observer();
+
+        size_t block_relayed = 0, active_observers = 0;
+        for (auto& o : obs) {
+            auto prev_id = o.swarm->our_swarm_id();
+            auto copy = swarms;
+            SwarmEvents events;
+            auto derive_us = time_us([&] { events = o.swarm->derive_swarm_events(swarms); });
+            bool active = events.our_swarm_id != INVALID_SWARM_ID;
+            active_observers += active;
+            auto update_us = time_us([&] {
+                o.swarm->set_swarm_id(events.our_swarm_id);
+                o.swarm->update_state(std::move(copy), net.decommissioned, events, active);
+            });
+            derive.add(derive_us);
+            update.add(update_us);
+            double total = derive_us + update_us;
+
+            if (b == 0 || !active || prev_id == INVALID_SWARM_ID)
+                continue;
+            if (auto i = swarm_index(prev_swarms, prev_id); i < prev_swarms.size()) {
+                auto held = swarm_space_range(prev_swarms, i);
+                size_t r = 0;
+                auto us = time_us([&] { r = select_relays(msgs, held, events, swarms); });
+                select.add(us);
+                total += us;
+                block_relayed += r;
+            }
+            per_block.add(total);
+            events_new_swarms += events.new_swarms.size();
+            events_new_snodes += events.new_snodes.size();
+            events_dissolved += events.dissolved;
+        }
+        relayed_msgs += block_relayed;
+        if (active_observers > 0)
+            estimated_msgs += static_cast<double>(block_relayed) * net.active() / active_observers;
+
+        // The non-active path, and preserve_ips on an update with some IPs missing
+        auto copy = swarms;
+        apply.add(time_us([&] { applier.apply_swarm_changes(std::move(copy)); }));
+        copy = swarms;
+        for (auto& s : copy)
+            for (auto& sn : s.snodes)
+                if (missing(rng)) {
+                    sn.ip = "0.0.0.0";
+                    sn.port = 0;
+                    sn.omq_quic_port = 0;
+                }
+        if (!prev_swarms.empty())
+            preserve.add(time_us([&] { preserve_ips(copy, prev_swarms); }));
+
+        prev_swarms = std::move(swarms);
+    }
+
+    std::printf(
+            "after %zu blocks: %zu active nodes in %zu swarms (%zu spare), %zu decommissioned; "
+            "%zu new swarms, %zu dissolved\n",
+            blocks,
+            net.active(),
+            net.swarms.size(),
+            net.spare.size(),
+            net.decommissioned.size(),
+            net.new_swarms,
+            net.dissolutions);
+
+    nlohmann::json report{
+            {"nodes", nodes},
+            {"blocks", blocks},
+            {"observers", obs.size()},
+            {"messages", messages},
+            {"message_size", message_size},
+            {"seed", seed},
+            {"final_nodes", net.active()},
+            {"final_swarms", net.swarms.size()},
+            {"new_swarms", net.new_swarms},
+            {"dissolved_swarms", net.dissolutions}};
+    auto& results = (report["results"] = nlohmann::json::object());
+
+    std::printf(
+            "%-24s %15s %15s %10s %10s %10s %10s %12s\n",
+            "operation",
+            "",
+            "total",
+            "p50 (us)",
+            "p90 (us)",
+            "p99 (us)",
+            "p99.9 (us)",
+            "max (us)");
+    for (auto* r : {&derive, &update, &apply, &preserve, &select, &per_block}) {
+        std::sort(r->latencies_us.begin(), r->latencies_us.end());
+        print(*r);
+        results[r->name] = to_json(*r);
+    }
+
+    auto observed_bytes = static_cast<double>(relayed_msgs) * message_size;
+    auto estimated_bytes = estimated_msgs * message_size;
+    std::printf(
+            "observer events: %zu new swarms, %zu new swarm members, %zu dissolved swarms\n"
+            "relayed by observers: %zu messages, %.1f MB\n"
+            "estimated network-wide: %.0f messages, %.1f MB (%.1f MB per block)\n",
+            events_new_swarms,
+            events_new_snodes,
+            events_dissolved,
+            relayed_msgs,
+            observed_bytes / 1e6,
+            estimated_msgs,
+            estimated_bytes / 1e6,
+            blocks ? estimated_bytes / 1e6 / blocks : 0);
+    report["observer_events"] = {
+            {"new_swarms", events_new_swarms},
+            {"new_snodes", events_new_snodes},
+            {"dissolved", events_dissolved}};
+    report["relayed"] = {
+            {"observed_messages", relayed_msgs},
+            {"observed_bytes", observed_bytes},
+            {"estimated_messages", estimated_msgs},
+            {"estimated_bytes", estimated_bytes}};
+
+    if (!json_out.empty()) {
+        std::ofstream out{json_out};
+        out << report.dump(2) << '\n';
+    }
+
+    return 0;
+}
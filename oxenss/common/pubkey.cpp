@@ -1,8 +1,10 @@
 #include "pubkey.h"
 #include "mainnet.h"
+#include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <charconv>
 #include <cassert>
+#include <cstring>
 
 namespace oxenss {
 
@@ -54,4 +56,18 @@ std::string user_pubkey::prefixed_raw() const {
     return bytes;
 }
 
+uint64_t user_pubkey::swarm_space() const {
+    assert(pubkey_.size() == 32);
+
+    uint64_t res = 0;
+    for (size_t i = 0; i < 4; i++) {
+        uint64_t buf;
+        std::memcpy(&buf, pubkey_.data() + i * 8, 8);
+        res ^= buf;
+    }
+    oxenc::big_to_host_inplace(res);
+
+    return res;
+}
+
 }  // namespace oxenss
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace oxenss {
@@ -55,6 +56,10 @@ class user_pubkey {
     // Returns the raw bytes that makes up the pubkey, including the type/network prefix byte.
     // Returns an empty string for an invalid (default constructed) pubkey.
     std::string prefixed_raw() const;
+
+    // Maps the pubkey into a 64-bit "swarm space" value; the swarm a pubkey belongs to is whichever
+    // one has a swarm id closest to this value.  Must not be called on an invalid pubkey.
+    uint64_t swarm_space() const;
 };
 
 }  // namespace oxenss
@@ -0,0 +1,262 @@
+#include "blake2b.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+
+namespace oxenss::crypto {
+
+namespace {
+
+    void hash_one(const blake2b_pieces& in, hash32& out) {
+        blake2b_hasher h;
+        for (auto& p : in)
+            h.update(p);
+        out = h.finalize();
+    }
+
+}  // namespace
+
+// The multi-buffer implementation needs GCC/clang vector extensions, and loads message words
+// straight out of memory (so a little-endian CPU).  It only pays off when the four lanes run in
+// parallel in vector registers, which is the case with AVX2 on x86 or with NEON on ARM64 (where
+// libsodium only has the portable C implementation); without AVX2, libsodium's SSE4.1 Blake2b is
+// about as fast as the lanes are.
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && \
+        (defined(__x86_64__) || defined(__aarch64__))
+
+namespace {
+
+    constexpr size_t LANES = 4;
+    constexpr size_t BLOCK_SIZE = 128;
+
+    using u64x4 = uint64_t __attribute__((vector_size(32)));
+
+    constexpr uint64_t IV[8] = {
+            0x6a09e667f3bcc908,
+            0xbb67ae8584caa73b,
+            0x3c6ef372fe94f82b,
+            0xa54ff53a5f1d36f1,
+            0x510e527fade682d1,
+            0x9b05688c2b3e6c1f,
+            0x1f83d9abfb41bd6b,
+            0x5be0cd19137e2179};
+
+    constexpr uint8_t SIGMA[12][16] = {
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+            {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+            {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+            {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+            {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+            {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+            {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+            {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+            {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+            {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+            {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+    // The state of four hashes, one per lane; `t` is the lane's byte count so far (our inputs
+    // never need the high word of the counter), `last` is all ones for a lane's final block, and
+    // lanes with a 0 in `active` have no block this time and are left unchanged.
+    struct lanes {
+        u64x4 h[8];
+        u64x4 m[16];
+        u64x4 t, last, active;
+    };
+
+    // Rotates right in place (taking references, to stay out of the way of vector-passing ABI
+    // differences between the default and AVX2 targets)
+    template <int N>
+    [[gnu::always_inline]] inline void rotr(u64x4& x) {
+        x = (x >> N) | (x << (64 - N));
+    }
+
+    [[gnu::always_inline]] inline void g(
+            u64x4& a, u64x4& b, u64x4& c, u64x4& d, const u64x4& x, const u64x4& y) {
+        a += b + x;
+        d ^= a;
+        rotr<32>(d);
+        c += d;
+        b ^= c;
+        rotr<24>(b);
+        a += b + y;
+        d ^= a;
+        rotr<16>(d);
+        c += d;
+        b ^= c;
+        rotr<63>(b);
+    }
+
+    [[gnu::always_inline]] inline void compress_lanes(lanes& s) {
+        u64x4 v[16];
+        for (int i = 0; i < 8; i++) {
+            v[i] = s.h[i];
+            v[i + 8] = u64x4{} + IV[i];
+        }
+        v[12] ^= s.t;
+        v[14] ^= s.last;
+        for (const auto& sigma : SIGMA) {
+            const auto& m = s.m;
+            g(v[0], v[4], v[8], v[12], m[sigma[0]], m[sigma[1]]);
+            g(v[1], v[5], v[9], v[13], m[sigma[2]], m[sigma[3]]);
+            g(v[2], v[6], v[10], v[14], m[sigma[4]], m[sigma[5]]);
+            g(v[3], v[7], v[11], v[15], m[sigma[6]], m[sigma[7]]);
+            g(v[0], v[5], v[10], v[15], m[sigma[8]], m[sigma[9]]);
+            g(v[1], v[6], v[11], v[12], m[sigma[10]], m[sigma[11]]);
+            g(v[2], v[7], v[8], v[13], m[sigma[12]], m[sigma[13]]);
+            g(v[3], v[4], v[9], v[14], m[sigma[14]], m[sigma[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            s.h[i] ^= (v[i] ^ v[i + 8]) & s.active;
+    }
+
+#ifdef __x86_64__
+    [[gnu::target("avx2")]] void compress_avx2(lanes& s) {
+        compress_lanes(s);
+    }
+#else
+    void compress_vector(lanes& s) {
+        compress_lanes(s);
+    }
+#endif
+
+    using compress_fn = void (*)(lanes&);
+
+    // Returns the lanes' compression function for this CPU (or nullptr if we shouldn't use them)
+    compress_fn get_compress() {
+#ifdef __x86_64__
+        static const compress_fn f = cpu_features().avx2 ? compress_avx2 : nullptr;
+        return f;
+#else
+        return compress_vector;
+#endif
+    }
+
+    // Reads one input of a batch, a block at a time
+    struct reader {
+        const blake2b_pieces* in;
+        size_t size = 0;
+        size_t piece = 0;
+        size_t offset = 0;
+
+        // Copies the next (up to) BLOCK_SIZE bytes into `block`, zero-padding a short final block
+        void next_block(unsigned char* block) {
+            size_t want = BLOCK_SIZE;
+            while (want > 0 && piece < in->size()) {
+                auto p = (*in)[piece];
+                size_t n = std::min(want, p.size() - offset);
+                std::memcpy(block, p.data() + offset, n);
+                block += n;
+                want -= n;
+                offset += n;
+                if (offset == p.size()) {
+                    piece++;
+                    offset = 0;
+                }
+            }
+            std::memset(block, 0, want);
+        }
+    };
+
+    void hash_lanes(compress_fn compress, const blake2b_pieces* const* in, hash32* const* out) {
+        lanes s;
+        for (int i = 0; i < 8; i++)
+            s.h[i] = u64x4{} + IV[i];
+        // No key, 32-byte output
+        s.h[0] ^= u64x4{} + 0x01010020;
+
+        reader r[LANES];
+        size_t blocks[LANES];
+        size_t max_blocks = 0;
+        for (size_t k = 0; k < LANES; k++) {
+            r[k].in = in[k];
+            for (auto& p : *in[k])
+                r[k].size += p.size();
+            // (An empty input still gets one, all-zero, block)
+            blocks[k] = std::max<size_t>(1, (r[k].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            max_blocks = std::max(max_blocks, blocks[k]);
+        }
+
+        alignas(32) uint64_t words[LANES][16] = {};
+        for (size_t b = 0; b < max_blocks; b++) {
+            for (size_t k = 0; k < LANES; k++) {
+                bool active = b < blocks[k];
+                if (active)
+                    r[k].next_block(reinterpret_cast<unsigned char*>(words[k]));
+                s.t[k] = std::min(r[k].size, (b + 1) * BLOCK_SIZE);
+                s.last[k] = active && b + 1 == blocks[k] ? ~uint64_t{0} : 0;
+                s.active[k] = active ? ~uint64_t{0} : 0;
+            }
+            for (size_t j = 0; j < 16; j++)
+                s.m[j] = u64x4{words[0][j], words[1][j], words[2][j], words[3][j]};
+            compress(s);
+        }
+
+        for (size_t k = 0; k < LANES; k++)
+            for (size_t i = 0; i < 4; i++) {
+                uint64_t w = s.h[i][k];
+                std::memcpy(out[k]->data() + 8 * i, &w, 8);
+            }
+    }
+
+}  // namespace
+
+void blake2b_batch(const blake2b_pieces* inputs, size_t n, hash32* out) {
+    auto compress = get_compress();
+    if (!compress || n < LANES) {
+        for (size_t i = 0; i < n; i++)
+            hash_one(inputs[i], out[i]);
+        return;
+    }
+
+    // Lanes run for as many blocks as their longest input, so we group inputs of similar sizes
+    // together: we go through them from shortest to longest, hashing the odd few shortest ones
+    // one at a time.
+    std::vector<size_t> sizes(n);
+    for (size_t i = 0; i < n; i++)
+        for (auto& p : inputs[i])
+            sizes[i] += p.size();
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(
+            order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] < sizes[b]; });
+
+    size_t i = 0;
+    for (; i < n % LANES; i++)
+        hash_one(inputs[order[i]], out[order[i]]);
+    for (; i < n; i += LANES) {
+        const blake2b_pieces* in[LANES];
+        hash32* o[LANES];
+        for (size_t k = 0; k < LANES; k++) {
+            in[k] = &inputs[order[i + k]];
+            o[k] = &out[order[i + k]];
+        }
+        hash_lanes(compress, in, o);
+    }
+}
+
+std::string_view blake2b_batch_backend() {
+#ifdef __x86_64__
+    return get_compress() ? "avx2" : "none";
+#else
+    return "vector";
+#endif
+}
+
+#else
+
+void blake2b_batch(const blake2b_pieces* inputs, size_t n, hash32* out) {
+    for (size_t i = 0; i < n; i++)
+        hash_one(inputs[i], out[i]);
+}
+
+std::string_view blake2b_batch_backend() {
+    return "none";
+}
+
+#endif
+
+}  // namespace oxenss::crypto
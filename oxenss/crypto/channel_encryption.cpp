@@ -1,11 +1,15 @@
 #include "channel_encryption.hpp"
 
+#include "cpu_features.h"
+#include "shared_key_cache.h"
+
 #include <cassert>
 #include <exception>
 #include <iostream>
 #include <memory>
 
 #include <openssl/evp.h>
+#include <sodium/crypto_aead_aes256gcm.h>
 #include <sodium/crypto_aead_xchacha20poly1305.h>
 #include <sodium/crypto_auth_hmacsha256.h>
 #include <sodium/crypto_generichash.h>
@@ -52,8 +56,76 @@ namespace {
 
     using aes256_ctx_ptr = std::unique_ptr<EVP_CIPHER_CTX, aes256_evp_deleter>;
 
+    // A cipher context for the current thread, reused by each call (rather than allocating a new
+    // one every time) and reset when done with (which also wipes the key schedule).
+    class thread_cipher_ctx {
+      public:
+        thread_cipher_ctx() {
+            thread_local aes256_ctx_ptr ctx{EVP_CIPHER_CTX_new()};
+            if (!ctx)
+                throw std::runtime_error{"Could not allocate cipher context"};
+            ctx_ = ctx.get();
+        }
+        ~thread_cipher_ctx() { EVP_CIPHER_CTX_reset(ctx_); }
+        thread_cipher_ctx(const thread_cipher_ctx&) = delete;
+        thread_cipher_ctx& operator=(const thread_cipher_ctx&) = delete;
+
+        EVP_CIPHER_CTX* get() const { return ctx_; }
+
+      private:
+        EVP_CIPHER_CTX* ctx_;
+    };
+
+    // On OpenSSL 3, EVP_aes_256_*() gives a cipher that has to be looked up again (through the
+    // provider) on every EVP_*Init call; fetching it once up front avoids that.
+    const EVP_CIPHER* aes256_gcm() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        static const EVP_CIPHER* cipher = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+        if (cipher)
+            return cipher;
+#endif
+        return EVP_aes_256_gcm();
+    }
+    const EVP_CIPHER* aes256_cbc() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        static const EVP_CIPHER* cipher = EVP_CIPHER_fetch(nullptr, "AES-256-CBC", nullptr);
+        if (cipher)
+            return cipher;
+#endif
+        return EVP_aes_256_cbc();
+    }
+
+    constexpr size_t GCM_IV_SIZE = 12, GCM_TAG_SIZE = 16, CBC_IV_SIZE = 16, AES_BLOCK_SIZE = 16;
+    static_assert(GCM_IV_SIZE == crypto_aead_aes256gcm_NPUBBYTES);
+    static_assert(GCM_TAG_SIZE == crypto_aead_aes256gcm_ABYTES);
+
+    GcmBackend gcm_backend_override = GcmBackend::automatic;
+
+    // Whether libsodium should handle AES-GCM for a message of the given size
+    bool sodium_gcm(size_t size) {
+        // libsodium 1.0.18's AES-GCM requires AES-NI and PCLMUL (it has no ARM or software
+        // implementation).
+        static const bool available = cpu_features().aesni && cpu_features().pclmul &&
+                                      crypto_aead_aes256gcm_is_available();
+        if (!available)
+            return false;
+        switch (gcm_backend_override) {
+            case GcmBackend::openssl: return false;
+            case GcmBackend::libsodium: return true;
+            case GcmBackend::automatic: break;
+        }
+        return size < ChannelEncryption::GCM_SODIUM_MAX;
+    }
+
 }  // namespace
 
+ChannelEncryption::ChannelEncryption(
+        x25519_seckey private_key, x25519_pubkey public_key, bool server, size_t key_cache) :
+        private_key_{std::move(private_key)},
+        public_key_{std::move(public_key)},
+        server_{server},
+        key_cache_{key_cache ? std::make_shared<SharedKeyCache>(key_cache) : nullptr} {}
+
 EncryptType parse_enc_type(std::string_view enc_type) {
     if (enc_type == "xchacha20" || enc_type == "xchacha20-poly1305")
         return EncryptType::xchacha20;
@@ -70,12 +142,11 @@ std::ostream& operator<<(std::ostream& o, const EncryptType& t) {
 
 std::string ChannelEncryption::encrypt(
         EncryptType type, std::string_view plaintext, const x25519_pubkey& pubkey) const {
-    switch (type) {
-        case EncryptType::xchacha20: return encrypt_xchacha20(plaintext, pubkey);
-        case EncryptType::aes_gcm: return encrypt_gcm(plaintext, pubkey);
-        case EncryptType::aes_cbc: return encrypt_cbc(plaintext, pubkey);
-    }
-    throw std::runtime_error{"Invalid encryption type"};
+    std::string ciphertext;
+    ciphertext.resize(max_encrypted_size(type, plaintext.size()));
+    ciphertext.resize(encrypt_to(
+            type, plaintext, pubkey, reinterpret_cast<unsigned char*>(ciphertext.data())));
+    return ciphertext;
 }
 
 std::string ChannelEncryption::decrypt(
@@ -88,21 +159,21 @@ std::string ChannelEncryption::decrypt(
     throw std::runtime_error{"Invalid decryption type"};
 }
 
-static std::string encrypt_openssl(
+// Encrypts into `out`, which must have room for the iv, plaintext, one extra block and the tag.
+// Returns the size of the ciphertext (including the prepended iv and appended tag).
+static size_t encrypt_openssl(
         const EVP_CIPHER* cipher,
         int taglen,
         std::basic_string_view<unsigned char> plaintext,
-        const std::array<uint8_t, crypto_scalarmult_BYTES>& key) {
-    // Initialise cipher context
-    aes256_ctx_ptr ctx_ptr{EVP_CIPHER_CTX_new()};
-    auto* ctx = ctx_ptr.get();
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key,
+        unsigned char* out) {
+    thread_cipher_ctx ctx_holder;
+    auto* ctx = ctx_holder.get();
 
-    std::string output;
-    // Start the output with the iv, then output space plus an extra possible 'blockSize'
-    // (according to libssl docs) for the cipher data.
+    // Start the output with the iv, followed by the cipher data (which, according to libssl docs,
+    // can be up to a block more than the plaintext).
     const int ivLength = EVP_CIPHER_iv_length(cipher);
-    output.resize(ivLength + plaintext.size() + EVP_CIPHER_block_size(cipher) + taglen);
-    auto* o = reinterpret_cast<unsigned char*>(output.data());
+    auto* o = out;
     randombytes_buf(o, ivLength);
     const auto* iv = o;
     o += ivLength;
@@ -129,44 +200,61 @@ static std::string encrypt_openssl(
         throw std::runtime_error{"Failed to copy encryption tag"};
     o += taglen;
 
-    // Remove excess buffer space
-    output.resize(reinterpret_cast<char*>(o) - output.data());
+    return o - out;
+}
 
-    return output;
+// Same as above, but with libsodium's AES-256-GCM, which produces the same iv + ciphertext + tag.
+static size_t encrypt_sodium_gcm(
+        std::basic_string_view<unsigned char> plaintext,
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key,
+        unsigned char* out) {
+    randombytes_buf(out, GCM_IV_SIZE);
+    unsigned long long clen;
+    crypto_aead_aes256gcm_encrypt(
+            out + GCM_IV_SIZE,
+            &clen,
+            plaintext.data(),
+            plaintext.size(),
+            nullptr,
+            0,        // additional data
+            nullptr,  // nsec (always unused)
+            out,
+            key.data());
+    return GCM_IV_SIZE + clen;
 }
 
-static std::string decrypt_openssl(
+// Decrypts into `out`, which must either have room for the ciphertext plus a block, or else be
+// exactly where the ciphertext (following the iv) is, to decrypt in place.  Returns the length of
+// the plaintext.
+static size_t decrypt_openssl(
         const EVP_CIPHER* cipher,
         size_t taglen,
         std::basic_string_view<unsigned char> ciphertext,
-        const std::array<uint8_t, crypto_scalarmult_BYTES>& key) {
-    // Initialise cipher context
-    aes256_ctx_ptr ctx_ptr{EVP_CIPHER_CTX_new()};
-    auto* ctx = ctx_ptr.get();
-
-    // We prepend the iv on the beginning of the ciphertext; extract it
-    auto iv = ciphertext.substr(0, EVP_CIPHER_iv_length(cipher));
-    ciphertext.remove_prefix(iv.size());
-
-    // We also append the tag (if applicable) so extract it:
-    if (ciphertext.size() < taglen)
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key,
+        unsigned char* out) {
+    thread_cipher_ctx ctx_holder;
+    auto* ctx = ctx_holder.get();
+
+    // We prepend the iv on the beginning of the ciphertext, and append the tag (if applicable), so
+    // extract them:
+    const size_t ivLength = EVP_CIPHER_iv_length(cipher);
+    if (ciphertext.size() < ivLength + taglen)
         throw std::runtime_error{"Encrypted value is too short"};
+    auto iv = ciphertext.substr(0, ivLength);
+    ciphertext.remove_prefix(iv.size());
     auto tag = ciphertext.substr(ciphertext.size() - taglen);
     ciphertext.remove_suffix(tag.size());
 
-    // libssl docs say we need up to block size of extra buffer space:
-    std::string output;
-    output.resize(ciphertext.size() + EVP_CIPHER_block_size(cipher));
-
     // Initialise cipher context
     if (EVP_DecryptInit_ex(ctx, cipher, nullptr, key.data(), iv.data()) <= 0) {
         throw std::runtime_error("Could not initialise decryption context");
     }
 
     int len;
-    auto* o = reinterpret_cast<unsigned char*>(output.data());
+    auto* o = out;
 
-    // Decrypt every full blocks
+    // Decrypt every full blocks.  (When decrypting in place this never writes past the end of the
+    // ciphertext, and so never touches the tag that follows it).
     if (EVP_DecryptUpdate(ctx, o, &len, ciphertext.data(), ciphertext.size()) <= 0) {
         throw std::runtime_error("Could not decrypt block");
     }
@@ -182,46 +270,88 @@ static std::string decrypt_openssl(
     }
     o += len;
 
-    // Remove excess buffer space
-    output.resize(reinterpret_cast<char*>(o) - output.data());
+    return o - out;
+}
+
+// Same as above, but with libsodium's AES-256-GCM.  (Decrypting in place works the same way).
+static size_t decrypt_sodium_gcm(
+        std::basic_string_view<unsigned char> ciphertext,
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key,
+        unsigned char* out) {
+    if (ciphertext.size() < GCM_IV_SIZE + GCM_TAG_SIZE)
+        throw std::runtime_error{"Encrypted value is too short"};
+    unsigned long long mlen;
+    if (0 != crypto_aead_aes256gcm_decrypt(
+                     out,
+                     &mlen,
+                     nullptr,  // nsec (always unused)
+                     ciphertext.data() + GCM_IV_SIZE,
+                     ciphertext.size() - GCM_IV_SIZE,
+                     nullptr,
+                     0,  // additional data
+                     ciphertext.data(),
+                     key.data()))
+        throw std::runtime_error{"Could not decrypt (AES-GCM)"};
+    return mlen;
+}
 
+static std::string decrypt_openssl(
+        const EVP_CIPHER* cipher,
+        size_t taglen,
+        std::basic_string_view<unsigned char> ciphertext,
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key) {
+    // libssl docs say we need up to block size of extra buffer space:
+    std::string output;
+    output.resize(ciphertext.size() + EVP_CIPHER_block_size(cipher));
+    output.resize(decrypt_openssl(
+            cipher, taglen, ciphertext, key, reinterpret_cast<unsigned char*>(output.data())));
     return output;
 }
 
+static std::string_view decrypt_openssl_in_place(
+        const EVP_CIPHER* cipher,
+        size_t taglen,
+        std::string& ciphertext,
+        const std::array<uint8_t, crypto_scalarmult_BYTES>& key) {
+    const size_t ivLength = EVP_CIPHER_iv_length(cipher);
+    auto len = decrypt_openssl(
+            cipher,
+            taglen,
+            to_uchar(ciphertext),
+            key,
+            reinterpret_cast<unsigned char*>(ciphertext.data()) + ivLength);
+    return std::string_view{ciphertext}.substr(ivLength, len);
+}
+
 std::string ChannelEncryption::encrypt_cbc(
         std::string_view plaintext_, const x25519_pubkey& pubKey) const {
-    return encrypt_openssl(
-            EVP_aes_256_cbc(),
-            0,
-            to_uchar(plaintext_),
-            calculate_shared_secret(private_key_, pubKey));
+    return encrypt(EncryptType::aes_cbc, plaintext_, pubKey);
 }
 
 std::string ChannelEncryption::decrypt_cbc(
         std::string_view ciphertext_, const x25519_pubkey& pubKey) const {
     return decrypt_openssl(
-            EVP_aes_256_cbc(),
-            0,
-            to_uchar(ciphertext_),
-            calculate_shared_secret(private_key_, pubKey));
+            aes256_cbc(), 0, to_uchar(ciphertext_), shared_key(EncryptType::aes_cbc, pubKey));
 }
 
 std::string ChannelEncryption::encrypt_gcm(
         std::string_view plaintext_, const x25519_pubkey& pubKey) const {
-    return encrypt_openssl(
-            EVP_aes_256_gcm(),
-            16 /* tag length */,
-            to_uchar(plaintext_),
-            derive_symmetric_key(private_key_, pubKey));
+    return encrypt(EncryptType::aes_gcm, plaintext_, pubKey);
 }
 
 std::string ChannelEncryption::decrypt_gcm(
         std::string_view ciphertext_, const x25519_pubkey& pubKey) const {
-    return decrypt_openssl(
-            EVP_aes_256_gcm(),
-            16 /* tag length */,
-            to_uchar(ciphertext_),
-            derive_symmetric_key(private_key_, pubKey));
+    auto ciphertext = to_uchar(ciphertext_);
+    auto key = shared_key(EncryptType::aes_gcm, pubKey);
+    if (!sodium_gcm(ciphertext.size()))
+        return decrypt_openssl(aes256_gcm(), GCM_TAG_SIZE, ciphertext, key);
+
+    std::string plaintext;
+    if (ciphertext.size() > GCM_IV_SIZE + GCM_TAG_SIZE)
+        plaintext.resize(ciphertext.size() - GCM_IV_SIZE - GCM_TAG_SIZE);
+    plaintext.resize(decrypt_sodium_gcm(
+            ciphertext, key, reinterpret_cast<unsigned char*>(plaintext.data())));
+    return plaintext;
 }
 
 static std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES> xchacha20_shared_key(
@@ -245,22 +375,41 @@ static std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES> xc
     return key;
 }
 
-std::string ChannelEncryption::encrypt_xchacha20(
-        std::string_view plaintext_, const x25519_pubkey& pubKey) const {
-    auto plaintext = to_uchar(plaintext_);
+std::array<unsigned char, 32> ChannelEncryption::shared_key(
+        EncryptType type, const x25519_pubkey& pubkey) const {
+    if (key_cache_)
+        if (auto key = key_cache_->find(pubkey, type))
+            return *key;
 
-    std::string ciphertext;
-    ciphertext.resize(
-            crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + plaintext.size() +
-            crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    std::array<unsigned char, 32> key;
+    switch (type) {
+        case EncryptType::xchacha20:
+            key = xchacha20_shared_key(public_key_, private_key_, pubkey, !server_);
+            break;
+        case EncryptType::aes_gcm: key = derive_symmetric_key(private_key_, pubkey); break;
+        case EncryptType::aes_cbc: key = calculate_shared_secret(private_key_, pubkey); break;
+        default: throw std::runtime_error{"Invalid encryption type"};
+    }
+    if (key_cache_)
+        key_cache_->insert(pubkey, type, key);
+    return key;
+}
 
-    const auto key = xchacha20_shared_key(public_key_, private_key_, pubKey, !server_);
+std::string ChannelEncryption::encrypt_xchacha20(
+        std::string_view plaintext_, const x25519_pubkey& pubKey) const {
+    return encrypt(EncryptType::xchacha20, plaintext_, pubKey);
+}
 
+// Encrypts into `out`, which must have room for the nonce, plaintext and tag.  Returns the size
+// of the ciphertext (including the nonce).
+static size_t xchacha20_encrypt(
+        std::basic_string_view<unsigned char> plaintext,
+        const std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES>& key,
+        unsigned char* out) {
     // Generate random nonce, and stash it at the beginning of ciphertext:
-    randombytes_buf(ciphertext.data(), crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+    randombytes_buf(out, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
 
-    auto* c = reinterpret_cast<unsigned char*>(ciphertext.data()) +
-              crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
+    auto* c = out + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
     unsigned long long clen;
 
     crypto_aead_xchacha20poly1305_ietf_encrypt(
@@ -271,28 +420,62 @@ std::string ChannelEncryption::encrypt_xchacha20(
             nullptr,
             0,        // additional data
             nullptr,  // nsec (always unused)
-            reinterpret_cast<const unsigned char*>(ciphertext.data()),
+            out,
             key.data());
-    assert(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + clen <= ciphertext.size());
-    ciphertext.resize(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + clen);
-    return ciphertext;
+    assert(clen == plaintext.size() + crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    return crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + clen;
 }
 
-std::string ChannelEncryption::decrypt_xchacha20(
-        std::string_view ciphertext_, const x25519_pubkey& pubKey) const {
-    auto ciphertext = to_uchar(ciphertext_);
+size_t ChannelEncryption::max_encrypted_size(EncryptType type, size_t plaintext_size) {
+    switch (type) {
+        case EncryptType::xchacha20:
+            return crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + plaintext_size +
+                   crypto_aead_xchacha20poly1305_ietf_ABYTES;
+        // (OpenSSL wants room for an extra block, which for GCM is a single byte)
+        case EncryptType::aes_gcm: return GCM_IV_SIZE + plaintext_size + 1 + GCM_TAG_SIZE;
+        case EncryptType::aes_cbc: return CBC_IV_SIZE + plaintext_size + AES_BLOCK_SIZE;
+    }
+    throw std::runtime_error{"Invalid encryption type"};
+}
+
+size_t ChannelEncryption::encrypt_to(
+        EncryptType type,
+        std::string_view plaintext_,
+        const x25519_pubkey& pubkey,
+        unsigned char* out) const {
+    auto plaintext = to_uchar(plaintext_);
+    switch (type) {
+        case EncryptType::xchacha20:
+            return xchacha20_encrypt(
+                    plaintext,
+                    shared_key(EncryptType::xchacha20, pubkey),
+                    out);
+        case EncryptType::aes_gcm: {
+            auto key = shared_key(EncryptType::aes_gcm, pubkey);
+            if (sodium_gcm(plaintext.size()))
+                return encrypt_sodium_gcm(plaintext, key, out);
+            return encrypt_openssl(aes256_gcm(), GCM_TAG_SIZE, plaintext, key, out);
+        }
+        case EncryptType::aes_cbc:
+            return encrypt_openssl(
+                    aes256_cbc(), 0, plaintext, shared_key(EncryptType::aes_cbc, pubkey), out);
+    }
+    throw std::runtime_error{"Invalid encryption type"};
+}
 
+// Decrypts into `m`, which must either have room for the plaintext or else be exactly where the
+// ciphertext (following the nonce) is, to decrypt in place.  Returns the length of the plaintext.
+static size_t xchacha20_decrypt(
+        std::basic_string_view<unsigned char> ciphertext,
+        const std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES>& key,
+        unsigned char* m) {
     // Extract nonce from the beginning of the ciphertext:
+    if (ciphertext.size() <
+        crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + crypto_aead_xchacha20poly1305_ietf_ABYTES)
+        throw std::runtime_error{"Invalid ciphertext: too short"};
     auto nonce = ciphertext.substr(0, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
     ciphertext.remove_prefix(nonce.size());
-    if (ciphertext.size() < crypto_aead_xchacha20poly1305_ietf_ABYTES)
-        throw std::runtime_error{"Invalid ciphertext: too short"};
-
-    const auto key = xchacha20_shared_key(public_key_, private_key_, pubKey, !server_);
 
-    std::string plaintext;
-    plaintext.resize(ciphertext.size() - crypto_aead_xchacha20poly1305_ietf_ABYTES);
-    auto* m = reinterpret_cast<unsigned char*>(plaintext.data());
     unsigned long long mlen;
     if (0 != crypto_aead_xchacha20poly1305_ietf_decrypt(
                      m,
@@ -305,9 +488,69 @@ std::string ChannelEncryption::decrypt_xchacha20(
                      nonce.data(),
                      key.data()))
         throw std::runtime_error{"Could not decrypt (XChaCha20-Poly1305)"};
-    assert(mlen <= plaintext.size());
-    plaintext.resize(mlen);
+    assert(mlen <= ciphertext.size() - crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    return mlen;
+}
+
+std::string ChannelEncryption::decrypt_xchacha20(
+        std::string_view ciphertext, const x25519_pubkey& pubKey) const {
+    const auto key = shared_key(EncryptType::xchacha20, pubKey);
+
+    std::string plaintext;
+    if (ciphertext.size() >
+        crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + crypto_aead_xchacha20poly1305_ietf_ABYTES)
+        plaintext.resize(
+                ciphertext.size() - crypto_aead_xchacha20poly1305_ietf_NPUBBYTES -
+                crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    plaintext.resize(xchacha20_decrypt(
+            to_uchar(ciphertext), key, reinterpret_cast<unsigned char*>(plaintext.data())));
     return plaintext;
 }
 
+std::string_view ChannelEncryption::decrypt_in_place(
+        EncryptType type, std::string& ciphertext, const x25519_pubkey& pubkey) const {
+    switch (type) {
+        case EncryptType::xchacha20: {
+            const auto key = shared_key(EncryptType::xchacha20, pubkey);
+            auto len = xchacha20_decrypt(
+                    to_uchar(ciphertext),
+                    key,
+                    reinterpret_cast<unsigned char*>(ciphertext.data()) +
+                            crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+            return std::string_view{ciphertext}.substr(
+                    crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, len);
+        }
+        case EncryptType::aes_gcm: {
+            auto key = shared_key(EncryptType::aes_gcm, pubkey);
+            if (!sodium_gcm(ciphertext.size()))
+                return decrypt_openssl_in_place(aes256_gcm(), GCM_TAG_SIZE, ciphertext, key);
+            auto len = decrypt_sodium_gcm(
+                    to_uchar(ciphertext),
+                    key,
+                    reinterpret_cast<unsigned char*>(ciphertext.data()) + GCM_IV_SIZE);
+            return std::string_view{ciphertext}.substr(GCM_IV_SIZE, len);
+        }
+        case EncryptType::aes_cbc:
+            return decrypt_openssl_in_place(
+                    aes256_cbc(), 0, ciphertext, shared_key(EncryptType::aes_cbc, pubkey));
+    }
+    throw std::runtime_error{"Invalid decryption type"};
+}
+
+void ChannelEncryption::set_gcm_backend(GcmBackend backend) {
+    gcm_backend_override = backend;
+}
+
+std::string ChannelEncryption::describe_backends() {
+    std::string gcm;
+    if (!sodium_gcm(0))
+        gcm = "openssl";
+    else if (gcm_backend_override == GcmBackend::automatic)
+        gcm = "libsodium (< " + std::to_string(GCM_SODIUM_MAX) + " bytes), openssl";
+    else
+        gcm = "libsodium";
+    return "cpu features: " + cpu_features().to_string() + "; aes-gcm: " + gcm +
+           "; xchacha20: libsodium; aes-cbc: openssl";
+}
+
 }  // namespace oxenss::crypto
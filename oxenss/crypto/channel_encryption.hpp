@@ -1,6 +1,8 @@
 #pragma once
 
 #include <oxenss/common/formattable.h>
+#include <array>
+#include <memory>
 #include <string>
 #include <string_view>
 
@@ -28,13 +30,32 @@ inline constexpr std::string_view to_string(EncryptType type) {
     return ""sv;
 }
 
+// Which library implements AES-GCM.  With hardware AES (AES-NI and PCLMUL), libsodium's
+// implementation has less per-call overhead and so is faster for small messages, while OpenSSL's
+// has faster bulk throughput; `automatic` picks between them by message size.  Without hardware
+// AES only OpenSSL is available.
+enum class GcmBackend {
+    automatic,
+    openssl,
+    libsodium,
+};
+
+class SharedKeyCache;
+
 // Encryption/decryption class for encryption/decrypting outgoing/incoming messages.
 class ChannelEncryption {
   public:
-    ChannelEncryption(x25519_seckey private_key, x25519_pubkey public_key, bool server = true) :
-            private_key_{std::move(private_key)},
-            public_key_{std::move(public_key)},
-            server_{server} {}
+    // With automatic AES-GCM backend selection, libsodium handles messages smaller than this and
+    // OpenSSL the rest.
+    static constexpr size_t GCM_SODIUM_MAX = 2048;
+
+    // If `key_cache` is non-zero then we keep (up to) that many of the symmetric keys we derive
+    // from peers' pubkeys, for reuse when the same pubkey comes up again (see SharedKeyCache).
+    ChannelEncryption(
+            x25519_seckey private_key,
+            x25519_pubkey public_key,
+            bool server = true,
+            size_t key_cache = 0);
 
     // Encrypts `plaintext` message using encryption `type`. `pubkey` is the recipients public
     // key. `reply` should be false for a client-to-snode message, and true on a returning
@@ -44,6 +65,25 @@ class ChannelEncryption {
     std::string decrypt(
             EncryptType type, std::string_view ciphertext, const x25519_pubkey& pubkey) const;
 
+    // Returns the buffer size needed to encrypt a `plaintext_size` message with encrypt_to (the
+    // actual ciphertext can be slightly smaller).
+    static size_t max_encrypted_size(EncryptType type, size_t plaintext_size);
+
+    // Same as encrypt(), but writes the ciphertext to `out`, which must have room for
+    // max_encrypted_size(type, plaintext.size()) bytes.  Returns the size of the ciphertext.
+    size_t encrypt_to(
+            EncryptType type,
+            std::string_view plaintext,
+            const x25519_pubkey& pubkey,
+            unsigned char* out) const;
+
+    // Decrypts `ciphertext` in place, overwriting it with the plaintext rather than allocating a
+    // new string for it.  Returns the plaintext, which is a view into `ciphertext` (following
+    // the nonce/iv, which stays at the beginning).  Throws on failure, in which case the contents
+    // of `ciphertext` are unspecified.
+    std::string_view decrypt_in_place(
+            EncryptType type, std::string& ciphertext, const x25519_pubkey& pubkey) const;
+
     // AES-CBC encryption.
     std::string encrypt_cbc(std::string_view plainText, const x25519_pubkey& pubKey) const;
     std::string decrypt_cbc(std::string_view cipherText, const x25519_pubkey& pubKey) const;
@@ -64,10 +104,26 @@ class ChannelEncryption {
     std::string encrypt_xchacha20(std::string_view plaintext, const x25519_pubkey& pubKey) const;
     std::string decrypt_xchacha20(std::string_view ciphertext, const x25519_pubkey& pubKey) const;
 
+    // Overrides the AES-GCM backend (for benchmarking and testing).  Selecting libsodium where it
+    // isn't available falls back to OpenSSL.  Not thread-safe: call before encrypting anything.
+    static void set_gcm_backend(GcmBackend backend);
+
+    // Describes the CPU features and the implementations we use for each encryption type, for
+    // logging at startup.
+    static std::string describe_backends();
+
+    // The cache of derived keys, if enabled
+    const SharedKeyCache* key_cache() const { return key_cache_.get(); }
+
   private:
     const x25519_seckey private_key_;
     const x25519_pubkey public_key_;
     bool server_;  // True if we are the server (i.e. the snode).
+    std::shared_ptr<SharedKeyCache> key_cache_;
+
+    // Returns the symmetric key for encrypting to/decrypting from `pubkey` with encryption
+    // `type`, from the key cache if possible.
+    std::array<unsigned char, 32> shared_key(EncryptType type, const x25519_pubkey& pubkey) const;
 };
 
 }  // namespace oxenss::crypto
@@ -0,0 +1,53 @@
+#include "cpu_features.h"
+
+#include <sodium/core.h>
+#include <sodium/runtime.h>
+
+#include <utility>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace oxenss::crypto {
+
+static CpuFeatures detect() {
+    CpuFeatures f;
+    // libsodium does the cpuid probing (and needs to be initialized first for it)
+    if (sodium_init() < 0)
+        return f;
+    f.aesni = sodium_runtime_has_aesni();
+    f.pclmul = sodium_runtime_has_pclmul();
+    f.avx2 = sodium_runtime_has_avx2();
+#if defined(__aarch64__) && defined(__linux__)
+    auto hwcap = getauxval(AT_HWCAP);
+    f.arm_aes = hwcap & HWCAP_AES;
+    f.arm_pmull = hwcap & HWCAP_PMULL;
+#endif
+    return f;
+}
+
+const CpuFeatures& cpu_features() {
+    static const CpuFeatures features = detect();
+    return features;
+}
+
+std::string CpuFeatures::to_string() const {
+    std::string s;
+    for (auto [have, name] :
+         {std::pair{aesni, "aes-ni"},
+          {pclmul, "pclmul"},
+          {avx2, "avx2"},
+          {arm_aes, "arm-aes"},
+          {arm_pmull, "arm-pmull"}}) {
+        if (!have)
+            continue;
+        if (!s.empty())
+            s += ' ';
+        s += name;
+    }
+    return s.empty() ? "none" : s;
+}
+
+}  // namespace oxenss::crypto
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+namespace oxenss::crypto {
+
+/// CPU features that the symmetric ciphers we use can take advantage of.  (The libraries
+/// implementing them, libsodium and OpenSSL, do their own runtime detection to pick their
+/// kernels; we use this to pick between the libraries, and to report what's available).
+struct CpuFeatures {
+    // x86: AES-NI and carry-less multiplication (for AES and GCM's GHASH), and AVX2 (which
+    // libsodium's chacha20 uses)
+    bool aesni = false;
+    bool pclmul = false;
+    bool avx2 = false;
+    // ARMv8 crypto extensions: AES and polynomial multiply (for GHASH)
+    bool arm_aes = false;
+    bool arm_pmull = false;
+
+    // Hardware AES and GHASH, for AES-GCM
+    bool hw_aes_gcm() const { return (aesni && pclmul) || (arm_aes && arm_pmull); }
+
+    // Space-separated list of the detected features, e.g. "aes-ni pclmul avx2", or "none"
+    std::string to_string() const;
+};
+
+/// Returns the features of the CPU we are running on (detected on first call).
+const CpuFeatures& cpu_features();
+
+}  // namespace oxenss::crypto
@@ -0,0 +1,103 @@
+#include "crypto_pool.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace oxenss::crypto {
+
+static auto logcat = log::Cat("crypto");
+
+size_t CryptoPool::default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency() / 2);
+}
+
+CryptoPool::CryptoPool(size_t threads, size_t max_queue, std::function<void(size_t)> init) :
+        max_queue_{max_queue} {
+    threads = std::max<size_t>(threads, 1);
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        workers_.push_back(std::make_unique<worker>());
+    for (size_t i = 0; i < threads; i++)
+        workers_[i]->thread = std::thread{[this, i, init] {
+            if (init)
+                init(i);
+            run(i);
+        }};
+}
+
+CryptoPool::~CryptoPool() {
+    {
+        std::lock_guard lock{idle_mutex_};
+        stopping_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto& w : workers_)
+        w->thread.join();
+}
+
+bool CryptoPool::try_submit(std::function<void()>& job) {
+    if (queued_.fetch_add(1, std::memory_order_relaxed) >= max_queue_) {
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto& w = *workers_[next_.fetch_add(1, std::memory_order_relaxed) % workers_.size()];
+    {
+        std::lock_guard lock{w.mutex};
+        w.jobs.push_back(std::move(job));
+    }
+    {
+        std::lock_guard lock{idle_mutex_};
+        available_++;
+    }
+    idle_cv_.notify_one();
+    return true;
+}
+
+bool CryptoPool::take(size_t i, std::function<void()>& job) {
+    for (size_t k = 0; k < workers_.size(); k++) {
+        auto& w = *workers_[(i + k) % workers_.size()];
+        std::lock_guard lock{w.mutex};
+        if (w.jobs.empty())
+            continue;
+        // Our own jobs in order; stolen ones from the other end, away from where their owner
+        // takes them
+        if (k == 0) {
+            job = std::move(w.jobs.front());
+            w.jobs.pop_front();
+        } else {
+            job = std::move(w.jobs.back());
+            w.jobs.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void CryptoPool::run(size_t i) {
+    std::function<void()> job;
+    while (true) {
+        {
+            std::unique_lock lock{idle_mutex_};
+            idle_cv_.wait(lock, [this] { return stopping_ || available_ > 0; });
+            if (stopping_)
+                return;
+            // We can't fail to take a job after claiming one here: jobs only leave the queues
+            // after being claimed.
+            available_--;
+        }
+        if (!take(i, job))
+            continue;
+        try {
+            job();
+        } catch (const std::exception& e) {
+            log::error(logcat, "Crypto pool job failed: {}", e.what());
+        }
+        job = nullptr;
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+}  // namespace oxenss::crypto
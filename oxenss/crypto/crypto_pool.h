@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oxenss::crypto {
+
+/// Pool of threads dedicated to expensive cryptographic work (such as the key exchanges and
+/// decryption of onion requests) so that it never runs on, and can't stall, the threads doing
+/// network I/O or request handling.
+///
+/// Each thread has its own job queue, which submitted jobs are spread across round-robin; a thread
+/// whose queue is empty steals jobs from the back of the other threads' queues.  The total number
+/// of queued jobs is bounded so that a flood of requests gets refused rather than queueing without
+/// limit.
+class CryptoPool {
+  public:
+    static constexpr size_t DEFAULT_MAX_QUEUE = 2000;
+
+    /// The default thread count: half of the available cores (but at least one).
+    static size_t default_threads();
+
+    /// \param init if given, called at the start of each thread (with the thread's index), e.g. to
+    /// pin the thread to a core.
+    explicit CryptoPool(
+            size_t threads = default_threads(),
+            size_t max_queue = DEFAULT_MAX_QUEUE,
+            std::function<void(size_t)> init = nullptr);
+
+    /// Stops the threads once they finish their current jobs; jobs still queued are dropped.
+    ~CryptoPool();
+
+    CryptoPool(const CryptoPool&) = delete;
+    CryptoPool& operator=(const CryptoPool&) = delete;
+
+    /// Queues `job` to run on one of the pool's threads.  Returns false if the queue is full, in
+    /// which case `job` is left untouched (so that the caller can still run it or fail it);
+    /// otherwise `job` has been moved from.
+    bool try_submit(std::function<void()>& job);
+
+    size_t threads() const { return workers_.size(); }
+
+    /// The number of jobs queued or running
+    size_t queued() const { return queued_.load(std::memory_order_relaxed); }
+
+    /// The number of jobs refused because the queue was full
+    uint64_t rejected() const { return rejected_.load(std::memory_order_relaxed); }
+
+  private:
+    struct worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<worker>> workers_;
+    const size_t max_queue_;
+
+    // Jobs submitted but not yet finished, which is what gets bounded by max_queue_
+    std::atomic<size_t> queued_ = 0;
+    std::atomic<size_t> next_ = 0;
+    std::atomic<uint64_t> rejected_ = 0;
+
+    // Idle threads wait on this for jobs to become available (or for shutdown)
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    size_t available_ = 0;  // Jobs sitting in queues, not yet taken by a thread
+    bool stopping_ = false;
+
+    // Takes a job for worker `i` from its own queue or, failing that, from another one's.
+    bool take(size_t i, std::function<void()>& job);
+
+    void run(size_t i);
+};
+
+}  // namespace oxenss::crypto
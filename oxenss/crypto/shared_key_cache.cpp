@@ -0,0 +1,47 @@
+#include "shared_key_cache.h"
+
+#include <iterator>
+
+namespace oxenss::crypto {
+
+SharedKeyCache::SharedKeyCache(size_t capacity) : capacity_{capacity} {
+    index_.reserve(capacity_);
+}
+
+std::optional<SharedKeyCache::shared_key> SharedKeyCache::find(
+        const x25519_pubkey& pubkey, EncryptType type) {
+    std::lock_guard lock{mutex_};
+    auto it = index_.find(id{pubkey, type});
+    if (it == index_.end()) {
+        misses_++;
+        return std::nullopt;
+    }
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->key;
+}
+
+void SharedKeyCache::insert(const x25519_pubkey& pubkey, EncryptType type, const shared_key& key) {
+    if (capacity_ == 0)
+        return;
+    id key_id{pubkey, type};
+    std::lock_guard lock{mutex_};
+    if (index_.count(key_id))  // Someone else got here first
+        return;
+    if (lru_.size() >= capacity_) {
+        // Reuse the evicted entry's list node
+        index_.erase(lru_.back().key_id);
+        lru_.splice(lru_.begin(), lru_, std::prev(lru_.end()));
+        lru_.front() = {key_id, key};
+    } else {
+        lru_.push_front({key_id, key});
+    }
+    index_.emplace(key_id, lru_.begin());
+}
+
+size_t SharedKeyCache::size() const {
+    std::lock_guard lock{mutex_};
+    return lru_.size();
+}
+
+}  // namespace oxenss::crypto
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include "channel_encryption.hpp"
+#include "keys.h"
+
+namespace oxenss::crypto {
+
+/// Bounded LRU cache of the symmetric keys ChannelEncryption derives from a peer's x25519 pubkey,
+/// keyed by the pubkey and encryption type.  Deriving a key costs an x25519 scalar multiplication
+/// (plus a hash), which is wasted when the same pubkey comes up again: for instance, we decrypt an
+/// onion request and then encrypt the reply to it with the same ephemeral key.
+///
+/// All methods are thread-safe.
+class SharedKeyCache {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 10'000;
+
+    using shared_key = std::array<unsigned char, 32>;
+
+    explicit SharedKeyCache(size_t capacity = DEFAULT_CAPACITY);
+
+    /// Returns the cached key for the pubkey and type (making it the most recently used), if
+    /// there is one.
+    std::optional<shared_key> find(const x25519_pubkey& pubkey, EncryptType type);
+
+    /// Adds a key to the cache, evicting the least recently used one if full.
+    void insert(const x25519_pubkey& pubkey, EncryptType type, const shared_key& key);
+
+    /// Returns the number of lookups answered from the cache
+    size_t hits() const { return hits_; }
+    /// Returns the number of lookups that had to derive the key
+    size_t misses() const { return misses_; }
+    /// Returns the number of cached keys
+    size_t size() const;
+
+  private:
+    struct id {
+        x25519_pubkey pubkey;
+        EncryptType type;
+        bool operator==(const id& o) const { return type == o.type && pubkey == o.pubkey; }
+    };
+    struct id_hash {
+        size_t operator()(const id& i) const {
+            return std::hash<x25519_pubkey>{}(i.pubkey) ^ static_cast<size_t>(i.type);
+        }
+    };
+    struct entry {
+        id key_id;
+        shared_key key;
+    };
+
+    const size_t capacity_;
+
+    mutable std::mutex mutex_;
+    // Most recently used first
+    std::list<entry> lru_;
+    std::unordered_map<id, std::list<entry>::iterator, id_hash> index_;
+
+    std::atomic<size_t> hits_ = 0, misses_ = 0;
+};
+
+}  // namespace oxenss::crypto
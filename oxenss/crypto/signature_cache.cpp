@@ -0,0 +1,71 @@
+#include "signature_cache.h"
+
+#include <sodium/crypto_generichash_blake2b.h>
+#include <sodium/crypto_sign_ed25519.h>
+#include <sodium/randombytes.h>
+
+namespace oxenss::crypto {
+
+SignatureCache::SignatureCache(size_t capacity) : capacity_{capacity} {
+    randombytes_buf(hash_key_.data(), hash_key_.size());
+    verified_.reserve(capacity_);
+    order_.reserve(capacity_);
+}
+
+SignatureCache::key_t SignatureCache::make_key(
+        const unsigned char* sig, std::string_view msg, const unsigned char* pk) const {
+    key_t key;
+    crypto_generichash_blake2b_state st;
+    crypto_generichash_blake2b_init(&st, hash_key_.data(), hash_key_.size(), key.size());
+    crypto_generichash_blake2b_update(&st, pk, 32);
+    crypto_generichash_blake2b_update(&st, sig, 64);
+    crypto_generichash_blake2b_update(
+            &st, reinterpret_cast<const unsigned char*>(msg.data()), msg.size());
+    crypto_generichash_blake2b_final(&st, key.data(), key.size());
+    return key;
+}
+
+bool SignatureCache::verify(
+        const unsigned char* sig, std::string_view msg, const unsigned char* pk) {
+    auto key = make_key(sig, msg, pk);
+    {
+        std::lock_guard lock{mutex_};
+        if (verified_.count(key)) {
+            hits_++;
+            return true;
+        }
+    }
+
+    misses_++;
+    if (0 != crypto_sign_ed25519_verify_detached(
+                     sig, reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), pk))
+        return false;
+
+    if (capacity_ == 0)
+        return true;
+
+    std::lock_guard lock{mutex_};
+    if (verified_.count(key))  // Someone else got here first
+        return true;
+    if (order_.size() < capacity_) {
+        order_.push_back(key);
+    } else {
+        verified_.erase(order_[next_]);
+        order_[next_] = key;
+        next_ = (next_ + 1) % capacity_;
+    }
+    verified_.insert(key);
+    return true;
+}
+
+SignatureCache& signature_cache() {
+    static SignatureCache cache;
+    return cache;
+}
+
+bool verify_signature_cached(
+        const unsigned char* sig, std::string_view msg, const unsigned char* pk) {
+    return signature_cache().verify(sig, msg, pk);
+}
+
+}  // namespace oxenss::crypto
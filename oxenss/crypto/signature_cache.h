@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace oxenss::crypto {
+
+/// Bounded cache of recently verified Ed25519 signatures.  Clients repeat the same signed request
+/// (for instance a retrieve poll with an unchanged timestamp) many times within the allowed clock
+/// window, and subaccount tokens get re-verified on every request, so remembering which
+/// (pubkey, message, signature) triples we have already verified saves most of our signature
+/// checks.
+///
+/// Only successful verifications are remembered.  Entries are keyed by a keyed Blake2b hash of
+/// the triple, using a random per-cache key so that nobody can go looking for collisions offline.
+/// When full, the oldest entry is evicted.
+///
+/// All methods are thread-safe.
+class SignatureCache {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 20'000;
+
+    explicit SignatureCache(size_t capacity = DEFAULT_CAPACITY);
+
+    /// Verifies the 64-byte signature `sig` of `msg` by the 32-byte Ed25519 pubkey `pk`, returning
+    /// true if valid.  Previously verified signatures are answered from the cache.
+    bool verify(const unsigned char* sig, std::string_view msg, const unsigned char* pk);
+
+    /// Returns the number of verifications answered from the cache
+    size_t hits() const { return hits_; }
+    /// Returns the number of verifications that had to check the signature
+    size_t misses() const { return misses_; }
+
+  private:
+    using key_t = std::array<unsigned char, 32>;
+    struct key_hash {
+        size_t operator()(const key_t& k) const {
+            size_t h;
+            std::memcpy(&h, k.data(), sizeof(h));
+            return h;
+        }
+    };
+
+    key_t make_key(const unsigned char* sig, std::string_view msg, const unsigned char* pk) const;
+
+    std::array<unsigned char, 32> hash_key_;
+
+    std::mutex mutex_;
+    std::unordered_set<key_t, key_hash> verified_;
+    // Ring buffer of inserted keys, in insertion order, used to evict the oldest when full
+    std::vector<key_t> order_;
+    size_t next_ = 0;
+    size_t capacity_;
+
+    std::atomic<size_t> hits_ = 0, misses_ = 0;
+};
+
+/// Verifies an Ed25519 signature, as above, via a process-wide cache.  Used for verifying both
+/// request signatures and subaccount tokens.
+bool verify_signature_cached(
+        const unsigned char* sig, std::string_view msg, const unsigned char* pk);
+
+/// The process-wide cache used by verify_signature_cached()
+SignatureCache& signature_cache();
+
+}  // namespace oxenss::crypto
@@ -1,5 +1,5 @@
 #include "subaccount.h"
-#include <sodium/crypto_sign_ed25519.h>
+#include "signature_cache.h"
 #include <cassert>
 
 namespace oxenss {
@@ -16,9 +16,9 @@ void signed_subaccount_token::verify(
 
     assert(ed_pk);
 
-    // Verify that the subaccount token has been signed by the main account owner
-    if (0 != crypto_sign_ed25519_verify_detached(
-                     signature.data(), token.token.data(), token.token.size(), ed_pk))
+    // Verify that the subaccount token has been signed by the main account owner.  (The same token
+    // gets used for many requests, so this is nearly always answered from the cache).
+    if (!crypto::verify_signature_cached(signature.data(), token.sview(), ed_pk))
         throw subaccount_verification_bad_signature{};
 }
 
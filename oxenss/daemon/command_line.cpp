@@ -139,6 +139,20 @@ parse_result parse_cli_args(int argc, char* argv[]) {
                "Log verbosity level, see Log Levels below for accepted values")
             ->type_name("LEVEL")
             ->capture_default_str();
+    cli.add_flag(
+            "--log-async,!--no-log-async",
+            options.log_async,
+            "Write log messages from a background thread so that logging never blocks request "
+            "handling on I/O (messages are dropped, and the drops noted, if it falls behind).  "
+            "Enabled by default.");
+    cli.add_option(
+               "--log-rate-limit",
+               options.log_rate_limit,
+               "Maximum number of log messages per second from each log category, beyond which "
+               "messages below error level are suppressed (and the number suppressed noted) for "
+               "the rest of the second.  0 disables the limit.  Only applies with --log-async.")
+            ->capture_default_str()
+            ->type_name("N");
     cli.add_option(
                "--oxend-rpc",
                options.oxend_omq_rpc,
@@ -156,6 +170,111 @@ parse_result parse_cli_args(int argc, char* argv[]) {
                "--https-port", options.https_port, "Public port to listen on for HTTPS connections")
             ->capture_default_str()
             ->type_name("PORT");
+    cli.add_option(
+               "--https-threads",
+               options.https_threads,
+               "Number of event loop threads handling HTTPS connections, each listening on the "
+               "HTTPS port (with SO_REUSEPORT, so that the kernel spreads incoming connections "
+               "across them).  0 uses a quarter of the available cores.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 64))
+            ->type_name("N");
+    cli.add_option(
+               "--worker-threads",
+               options.worker_threads,
+               "Number of general OxenMQ worker threads, in addition to the ones reserved for each "
+               "category of service node and client commands.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 64))
+            ->type_name("N");
+    cli.add_option(
+               "--db-threads",
+               options.db_threads,
+               "Number of threads, each with its own queue, doing the database work of message "
+               "storage and retrieval, so that a slow disk doesn't hold up the handling of other "
+               "requests.  0 does the database work on the general worker threads.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 64))
+            ->type_name("N");
+    cli.add_option(
+               "--crypto-threads",
+               options.crypto_threads,
+               "Number of threads doing onion request encryption and decryption.  0 uses half of "
+               "the available cores.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 256))
+            ->type_name("N");
+    cli.add_flag(
+            "--pin-threads",
+            options.pin_threads,
+            "Pin each of the HTTPS, database and crypto threads to its own core (as far as "
+            "there are enough cores).");
+    cli.add_option(
+               "--numa-node",
+               options.numa_node,
+               "With --pin-threads, pin the threads to the cores of this NUMA node only; -1 uses "
+               "all the cores available to us.")
+            ->capture_default_str()
+            ->check(CLI::Range(-1, 1023))
+            ->type_name("NODE");
+    cli.add_flag(
+            "--tls-tickets,!--no-tls-tickets",
+            options.tls_tickets,
+            "Issue TLS session tickets to HTTPS clients so that they can resume their session "
+            "(skipping the full handshake) when reconnecting.  Enabled by default.");
+    cli.add_option(
+               "--tls-ticket-rotation",
+               options.tls_ticket_rotation_min,
+               "How often, in minutes, to replace the key that TLS session tickets are encrypted "
+               "with.  Tickets (and cached sessions) stay valid for between one and two rotation "
+               "periods.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 24 * 60))
+            ->type_name("MINUTES");
+    cli.add_option(
+               "--tls-session-cache",
+               options.tls_session_cache,
+               "Maximum number of TLS sessions to keep for resuming the sessions of HTTPS clients "
+               "that don't use session tickets; 0 disables the cache.")
+            ->capture_default_str()
+            ->type_name("N");
+    cli.add_option(
+               "--rate-limit-burst",
+               options.rate_limit_burst,
+               "Number of requests that a client or service node may make in a burst before "
+               "being rate limited")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 65535))
+            ->type_name("N");
+    cli.add_option(
+               "--rate-limit-client",
+               options.rate_limit_client,
+               "Sustained number of requests per second allowed from each client (IPv4 address "
+               "or IPv6 /64)")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 1'000'000))
+            ->type_name("N");
+    cli.add_option(
+               "--rate-limit-snode",
+               options.rate_limit_snode,
+               "Sustained number of requests per second allowed from each service node")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 1'000'000))
+            ->type_name("N");
+    cli.add_option(
+               "--rate-limit-clients",
+               options.rate_limit_clients,
+               "Number of clients to track for rate limiting at once; beyond this the least "
+               "recently seen clients are forgotten")
+            ->capture_default_str()
+            ->check(CLI::Range(1024, 10'000'000))
+            ->type_name("N");
+    cli.add_flag(
+            "--rate-limit-adaptive,!--no-rate-limit-adaptive",
+            options.rate_limit_adaptive,
+            "Scale the client rate limit with load: down (to as little as 1/8 of "
+            "--rate-limit-client) while we are falling behind on requests, and up (to as much as "
+            "twice it) while we have capacity to spare.  Enabled by default.");
     cli.add_option(
             "ignored",
             [](auto&&) { return true; },
@@ -184,8 +303,233 @@ parse_result parse_cli_args(int argc, char* argv[]) {
                "--stats-access-key",
                options.stats_access_keys,
                "One or more public keys (x25519) that will be granted access to the "
-               "`get_stats` omq endpoint")
+               "`get_stats`, `get_metrics` and `get_traces` omq endpoints")
             ->type_name("PUBKEY");
+    cli.add_option(
+               "--store-batch-window",
+               options.store_batch_window_ms,
+               "How long (in milliseconds) to accumulate incoming client stores before writing "
+               "them to the database in a single transaction.  Larger values increase store "
+               "throughput at the cost of store latency; 0 writes each store immediately.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 1000))
+            ->type_name("MS");
+    cli.add_option(
+               "--forward-batch-window",
+               options.forward_batch_window_ms,
+               "How long (in milliseconds) to accumulate client requests being forwarded to each "
+               "swarm peer before sending them to it in a single request.  Larger values reduce "
+               "the number of requests between swarm members at the cost of latency; 0 forwards "
+               "each request immediately.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 100))
+            ->type_name("MS");
+    cli.add_option(
+               "--swarm-quorum",
+               options.swarm_quorum,
+               "Reply to client stores, deletes and expiries as soon as this many swarm peers "
+               "(besides ourself) have returned their results, rather than waiting for all of "
+               "them; peers yet to answer are marked as pending in the reply.  0 waits for all "
+               "swarm peers.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 100))
+            ->type_name("N");
+    cli.add_option(
+               "--oxend-cache-ttl",
+               options.oxend_cache_ttl,
+               "How long (in seconds) to answer identical client oxend_requests (such as ONS "
+               "lookups) from the result of an earlier one, rather than asking oxend again.  "
+               "Cached results are always dropped when a new block arrives; 0 disables caching.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 600))
+            ->type_name("SECONDS");
+    cli.add_flag(
+            "--quic-onion-relay",
+            options.quic_onion_relay,
+            "Relay onion requests to other service nodes over QUIC, with a stream per request, "
+            "rather than over OxenMQ.  Nodes that don't accept onion requests over QUIC are still "
+            "sent them over OxenMQ.");
+    cli.add_flag(
+            "--quic-data-relay",
+            options.quic_data_relay,
+            "Send message data to other service nodes (when bootstrapping new swarm members, for "
+            "instance) over QUIC, with a stream per batch, rather than over OxenMQ.  This keeps "
+            "bulk transfers out of the way of OxenMQ's other traffic between nodes.  Nodes that "
+            "don't accept data over QUIC are still sent it over OxenMQ.");
+    cli.add_flag(
+            "--quic-0rtt,!--no-quic-0rtt",
+            options.quic_0rtt,
+            "Issue session tickets to QUIC clients so that, when reconnecting, they can send their "
+            "first request without waiting for the handshake to complete (0-RTT).  Enabled by "
+            "default.");
+    cli.add_option(
+               "--trace-sample-rate",
+               options.trace_sample_rate,
+               "Fraction of client requests (from 0 to 1) to record trace spans of, for retrieval "
+               "via the `get_traces` omq endpoint.  Requests forwarded from other nodes are "
+               "traced whenever the originating node traces them.")
+            ->capture_default_str()
+            ->check(CLI::Range(0.0, 1.0))
+            ->type_name("RATE");
+    cli.add_option(
+               "--capture-file",
+               options.capture_file,
+               "Record a sample of the client requests we receive (their methods, sizes, timings "
+               "and anonymized account hashes, but no payloads) into this file, for replaying "
+               "against a test node with bench_load --replay.  Any existing file is replaced.")
+            ->type_name("FILE");
+    cli.add_option(
+               "--capture-sample-rate",
+               options.capture_sample_rate,
+               "Fraction of client requests (from 0 to 1) to record with --capture-file.")
+            ->capture_default_str()
+            ->check(CLI::Range(0.0, 1.0))
+            ->type_name("RATE");
+    cli.add_option(
+               "--capture-max-size",
+               options.capture_max_mb,
+               "Stop recording with --capture-file once the file reaches this size.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 1024 * 1024))
+            ->type_name("MiB");
+    cli.add_option(
+               "--reach-retests-per-tick",
+               options.reach_retests_per_tick,
+               "Maximum number of failing service nodes to retest for reachability every 200ms; "
+               "higher values work through a backlog of failing nodes (e.g. after being "
+               "decommissioned) faster.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 1000))
+            ->type_name("N");
+    cli.add_option(
+               "--reach-tests-in-flight",
+               options.reach_tests_in_flight,
+               "Maximum number of service node reachability tests (each probing HTTPS, OxenMQ "
+               "and QUIC in parallel) to have in progress at once.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 10000))
+            ->type_name("N");
+    cli.add_option(
+               "--db-writers",
+               options.db_max_writers,
+               "Maximum number of read-write database connections to open.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 64))
+            ->type_name("N");
+    cli.add_option(
+               "--db-readers",
+               options.db_max_readers,
+               "Maximum number of read-only database connections to open; these serve retrieve "
+               "and other lookup requests concurrently with database writes.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 256))
+            ->type_name("N");
+    cli.add_option(
+               "--db-shards",
+               options.db_shards,
+               "Number of database files to split message storage across.  Each shard has its own "
+               "writer and connection pools (sized by --db-writers/--db-readers) and size limit.  "
+               "Changing this for an existing data directory is not supported.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 64))
+            ->type_name("N");
+    cli.add_option(
+               "--wal-checkpoint-interval",
+               options.wal_checkpoint_ms,
+               "How often (in milliseconds) a background thread checkpoints the database's "
+               "write-ahead log (it also truncates the log whenever writes go idle).  0 disables "
+               "the background checkpointer, leaving checkpoints to whichever write fills the "
+               "log.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 60000))
+            ->type_name("MS");
+    cli.add_option(
+               "--wal-checkpoint-size",
+               options.wal_checkpoint_mb,
+               "Write-ahead log size that triggers a background checkpoint before the next "
+               "--wal-checkpoint-interval.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 1024))
+            ->type_name("MiB");
+    cli.add_option(
+               "--owner-quota-messages",
+               options.owner_quota_messages,
+               "Maximum number of messages stored for a single account (across all of its "
+               "namespaces); stores beyond this are refused.  0 means no limit.")
+            ->capture_default_str()
+            ->type_name("N");
+    cli.add_option(
+               "--owner-quota-size",
+               options.owner_quota_mb,
+               "Maximum size of the message data stored for a single account (across all of its "
+               "namespaces); stores beyond this are refused.  0 means no limit.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 3584))
+            ->type_name("MiB");
+    cli.add_option(
+               "--namespace-quota-messages",
+               options.namespace_quota_messages,
+               "Maximum number of messages stored in a single namespace (across all accounts); "
+               "stores beyond this are refused.  0 means no limit.")
+            ->capture_default_str()
+            ->type_name("N");
+    cli.add_option(
+               "--namespace-quota-size",
+               options.namespace_quota_mb,
+               "Maximum size of the message data stored in a single namespace (across all "
+               "accounts); stores beyond this are refused.  0 means no limit.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 3584))
+            ->type_name("MiB");
+    cli.add_option(
+               "--memory-namespace",
+               options.memory_namespaces,
+               "Namespace whose messages are kept in memory rather than in the database; may be "
+               "given multiple times.  Intended for namespaces of short-lived or frequently "
+               "replaced messages, which are lost on restart unless --memory-spill is also given.")
+            ->check(CLI::Range(-32768, 32767))
+            ->type_name("NS");
+    cli.add_option(
+               "--memory-tier-size",
+               options.memory_tier_mb,
+               "Maximum memory used for messages of the --memory-namespace namespaces; once full, "
+               "the messages closest to expiry are dropped to make room for new ones.")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 65536))
+            ->type_name("MiB");
+    cli.add_flag(
+            "--memory-spill",
+            options.memory_spill,
+            "Save the in-memory messages to disk on shutdown, and reload them at startup.");
+    cli.add_option(
+               "--snapshot-dir",
+               options.snapshot_dir,
+               "Directory to write online snapshots of the database to (every "
+               "--snapshot-interval).  A snapshot can be used as the data directory of a new "
+               "node, or given to another node's --import-snapshot.")
+            ->type_name("DIR");
+    cli.add_option(
+               "--snapshot-interval",
+               options.snapshot_interval_min,
+               "How often to write a database snapshot to --snapshot-dir; 0 disables snapshots.")
+            ->capture_default_str()
+            ->type_name("MINUTES");
+    cli.add_option(
+               "--import-snapshot",
+               options.import_snapshot,
+               "Database snapshot (see --snapshot-dir) to copy our swarm's messages from once our "
+               "swarm is known, instead of waiting for swarm members to send them to us.")
+            ->check(CLI::ExistingDirectory)
+            ->type_name("DIR");
+    cli.add_option(
+               "--drain-timeout",
+               options.drain_timeout,
+               "How long to keep running on shutdown, refusing new client requests while relaying "
+               "already-stored messages to our swarm.  Relays not done by then are saved to disk "
+               "and sent after the next startup.")
+            ->capture_default_str()
+            ->check(CLI::Range(0, 600))
+            ->type_name("SECONDS");
     cli.set_version_flag("--version,-v", std::string{oxenss::STORAGE_SERVER_VERSION_INFO});
 
     // Deprecated options, put in the "" group to hide them:
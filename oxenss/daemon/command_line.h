@@ -11,16 +11,105 @@ struct command_line_options {
     std::string ip = "0.0.0.0";
     uint16_t https_port = 22021;
     uint16_t omq_quic_port = 22020;
+    // Number of HTTPS event loop threads; 0 picks a default based on the number of cores
+    uint32_t https_threads = 0;
+    // Thread topology: general OxenMQ workers (on top of those reserved for each command
+    // category), database threads, and crypto threads (0 picks a default based on the number of
+    // cores); and whether to pin those and the HTTPS threads to cores, optionally all of them
+    // within one NUMA node (-1 for any node)
+    uint32_t worker_threads = 1;
+    uint32_t db_threads = 4;
+    uint32_t crypto_threads = 0;
+    bool pin_threads = false;
+    int numa_node = -1;
+    // TLS session resumption for HTTPS clients: whether to issue session tickets, how often (in
+    // minutes) to rotate the ticket key, and how many sessions to keep in the server-side cache
+    bool tls_tickets = true;
+    uint32_t tls_ticket_rotation_min = 60;
+    uint32_t tls_session_cache = 20000;
+    // Rate limiting: the burst (bucket size) allowed, the sustained requests per second from each
+    // client and service node, and the number of clients to track at once
+    uint32_t rate_limit_burst = 600;
+    uint32_t rate_limit_client = 300;
+    uint32_t rate_limit_snode = 600;
+    uint32_t rate_limit_clients = 10000;
+    // Whether to scale client rate limits with load
+    bool rate_limit_adaptive = true;
     std::string oxend_omq_rpc;  // Defaults to ipc://$HOME/.oxen/[testnet/]oxend.sock
     bool force_start = false;
     bool testnet = false;
     std::string log_level = "info";
+    // Whether to write log messages from a background thread rather than the logging thread, and
+    // the number of messages per second (below error level) allowed from each log category
+    bool log_async = true;
+    uint32_t log_rate_limit = 1000;
     std::filesystem::path data_dir;
     std::string oxend_key;          // test only (but needed for backwards compatibility)
     std::string oxend_x25519_key;   // test only
     std::string oxend_ed25519_key;  // test only
-    // x25519 key that will be given access to get_stats omq endpoint
+    // x25519 key that will be given access to the get_stats, get_metrics and get_traces omq
+    // endpoints
     std::vector<std::string> stats_access_keys;
+    // Reachability testing of other service nodes: the maximum number of failing nodes to retest
+    // per testing tick (every 200ms), and of tests to have in flight at once
+    uint32_t reach_retests_per_tick = 4;
+    uint32_t reach_tests_in_flight = 32;
+    // How long (in milliseconds) to accumulate client stores before writing them to the database
+    // in a single transaction; 0 disables batching.
+    uint32_t store_batch_window_ms = 5;
+    // How long (in milliseconds) to accumulate client requests being forwarded to each swarm peer
+    // before sending them in a single request; 0 disables batching.
+    uint32_t forward_batch_window_ms = 2;
+    // Number of swarm peer results to wait for before replying to recursive client requests (0 =
+    // all of them)
+    uint32_t swarm_quorum = 0;
+    // How long (in seconds) to reuse oxend_request results for identical requests; 0 disables
+    // caching them.
+    uint32_t oxend_cache_ttl = 30;
+    // Whether to relay onion requests to other service nodes over QUIC rather than OxenMQ
+    bool quic_onion_relay = false;
+    // Whether to relay message data (for replication and bootstrapping) to other service nodes
+    // over QUIC rather than OxenMQ
+    bool quic_data_relay = false;
+    // Whether to let returning QUIC clients send their first request in 0-RTT data
+    bool quic_0rtt = true;
+    // Fraction of client requests to record traces of
+    double trace_sample_rate = 0.001;
+    // File to capture a sample of client requests into (empty = no capture), the fraction of
+    // requests to capture, and the maximum capture size (in MiB)
+    std::filesystem::path capture_file;
+    double capture_sample_rate = 0.01;
+    uint32_t capture_max_mb = 1024;
+    // Maximum number of read-write and read-only database connections
+    uint32_t db_max_writers = 2;
+    uint32_t db_max_readers = 16;
+    // Number of database files to shard storage across (1 = unsharded)
+    uint32_t db_shards = 1;
+    // How often (in milliseconds) the background checkpointer checkpoints the database WAL (0 =
+    // leave it to sqlite's inline auto-checkpoints), and the WAL size (in MiB) that triggers a
+    // checkpoint early
+    uint32_t wal_checkpoint_ms = 1000;
+    uint32_t wal_checkpoint_mb = 16;
+    // Per-owner and per-namespace storage quotas, in messages and MiB of message data (0 =
+    // unlimited)
+    uint32_t owner_quota_messages = 0;
+    uint32_t owner_quota_mb = 0;
+    uint32_t namespace_quota_messages = 0;
+    uint32_t namespace_quota_mb = 0;
+    // Namespaces whose messages are kept in memory instead of the database, the memory limit (in
+    // MiB) for those messages, and whether to save them to disk on shutdown
+    std::vector<int> memory_namespaces;
+    uint32_t memory_tier_mb = 256;
+    bool memory_spill = false;
+    // Directory to periodically write database snapshots to, and how often (in minutes; 0
+    // disables periodic snapshots)
+    std::filesystem::path snapshot_dir;
+    uint32_t snapshot_interval_min = 0;
+    // Snapshot to seed our swarm's messages from once we know our swarm
+    std::filesystem::path import_snapshot;
+    // How long (in seconds) we spend draining on shutdown: finishing replication to our swarm
+    // before saving whatever remains for after the restart (0 = save it right away)
+    uint32_t drain_timeout = 10;
 };
 
 using parse_result = std::variant<command_line_options, int>;
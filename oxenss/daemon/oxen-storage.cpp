@@ -2,6 +2,7 @@
 #include <oxenss/common/mainnet.h>
 #include <oxenss/crypto/channel_encryption.hpp>
 #include <oxenss/crypto/keys.h>
+#include <oxenss/crypto/shared_key_cache.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/rpc/oxend_rpc.h>
 #include <oxenss/rpc/request_handler.h>
@@ -11,6 +12,7 @@
 #include <oxenss/server/server_certificates.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/snode/swarm.h>
+#include <oxenss/utils/affinity.hpp>
 #include <oxenss/version.h>
 
 #include <oxenmq/oxenmq.h>
@@ -21,6 +23,7 @@
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
+#include <set>
 #include <stdexcept>
 #include <variant>
 #include <vector>
@@ -71,7 +74,7 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    logging::init(options.data_dir, log_level);
+    logging::init(options.data_dir, log_level, options.log_async, options.log_rate_limit);
 
     if (options.testnet) {
         is_mainnet = false;
@@ -97,6 +100,7 @@ int main(int argc, char* argv[]) {
         log::error(logcat, "Could not initialize libsodium");
         return EXIT_FAILURE;
     }
+    log::info(logcat, "Encryption: {}", crypto::ChannelEncryption::describe_backends());
 
     if (const auto fd_limit = sysconf(_SC_OPEN_MAX); fd_limit != -1) {
         log::debug(logcat, "Open file descriptor limit: {}", fd_limit);
@@ -133,7 +137,11 @@ int main(int argc, char* argv[]) {
         log::info(logcat, "- x25519:  {}", me.pubkey_x25519);
         log::info(logcat, "- lokinet: {}", me.pubkey_ed25519.snode_address());
 
-        crypto::ChannelEncryption channel_encryption{private_key_x25519, me.pubkey_x25519};
+        crypto::ChannelEncryption channel_encryption{
+                private_key_x25519,
+                me.pubkey_x25519,
+                true,
+                crypto::SharedKeyCache::DEFAULT_CAPACITY};
 
         auto ssl_cert = options.data_dir / "cert.pem";
         auto ssl_key = options.data_dir / "key.pem";
@@ -143,28 +151,113 @@ int main(int argc, char* argv[]) {
         if (!exists(ssl_dh))
             generate_dh_pem(ssl_dh);
 
+        // When pinning, each pool's threads get spread over the cores (of the NUMA node, if given)
+        std::vector<unsigned> cpus;
+        if (options.pin_threads) {
+            cpus = options.numa_node >= 0 ? util::numa_node_cpus(options.numa_node)
+                                          : util::allowed_cpus();
+            if (cpus.empty())
+                log::warning(logcat, "Unable to determine CPUs to pin threads to; not pinning");
+        }
+        util::CpuPlanner cpu_planner{std::move(cpus)};
+
         // Set up oxenmq now, but don't actually start it until after we set up the ServiceNode
         // instance (because ServiceNode and OxenmqServer reference each other).
-        auto oxenmq_server_ptr =
-                std::make_unique<server::OMQ>(me, private_key_x25519, stats_access_keys);
+        auto oxenmq_server_ptr = std::make_unique<server::OMQ>(
+                me,
+                private_key_x25519,
+                stats_access_keys,
+                server::OMQ::thread_config{
+                        options.worker_threads, options.db_threads, cpu_planner.pin("db")});
         auto& oxenmq_server = *oxenmq_server_ptr;
 
-        snode::ServiceNode service_node{
-                me, private_key, oxenmq_server, options.data_dir, options.force_start};
-
-        rpc::RequestHandler request_handler{service_node, channel_encryption, private_key_ed25519};
+        // The database gets opened in the background, so that the listeners below can come up
+        // (answering with "not ready" until then) while it runs its startup checks; this
+        // configures it once it is open.
+        auto db_setup = [&options](Database& db) {
+            if (!options.memory_namespaces.empty()) {
+                std::set<namespace_id> memory_namespaces;
+                for (auto ns : options.memory_namespaces)
+                    memory_namespaces.insert(static_cast<namespace_id>(ns));
+                db.enable_memory_tier(
+                        std::move(memory_namespaces),
+                        size_t{options.memory_tier_mb} * 1024 * 1024,
+                        options.memory_spill);
+            }
+
+            db.set_quotas(
+                    {options.owner_quota_messages,
+                     int64_t{options.owner_quota_mb} * 1024 * 1024,
+                     options.namespace_quota_messages,
+                     int64_t{options.namespace_quota_mb} * 1024 * 1024});
+
+            if (options.wal_checkpoint_ms > 0)
+                db.start_checkpointer(
+                        std::chrono::milliseconds{options.wal_checkpoint_ms},
+                        int64_t{options.wal_checkpoint_mb} * 1024 * 1024);
+        };
 
-        rpc::RateLimiter rate_limiter{*oxenmq_server};
+        snode::ServiceNode service_node{
+                me,
+                private_key,
+                oxenmq_server,
+                options.data_dir,
+                options.force_start,
+                std::chrono::milliseconds{options.store_batch_window_ms},
+                std::chrono::milliseconds{options.forward_batch_window_ms},
+                options.db_max_writers,
+                options.db_max_readers,
+                options.db_shards,
+                std::move(db_setup)};
+
+        service_node.traces().sample_rate(options.trace_sample_rate);
+        service_node.set_reachability_limits(
+                options.reach_retests_per_tick, options.reach_tests_in_flight);
+
+        if (!options.import_snapshot.empty())
+            service_node.import_snapshot_on_join(options.import_snapshot);
+
+        rpc::RequestHandler request_handler{
+                service_node,
+                channel_encryption,
+                private_key_ed25519,
+                options.crypto_threads ? options.crypto_threads
+                                       : crypto::CryptoPool::default_threads(),
+                cpu_planner.pin("crypto")};
+        request_handler.set_swarm_quorum(options.swarm_quorum);
+        request_handler.set_oxend_cache_ttl(std::chrono::seconds{options.oxend_cache_ttl});
+        if (!options.capture_file.empty())
+            request_handler.start_capture(
+                    options.capture_file,
+                    options.capture_sample_rate,
+                    uint64_t{options.capture_max_mb} * 1024 * 1024);
+
+        rpc::RateLimiter rate_limiter{
+                *oxenmq_server,
+                {options.rate_limit_burst,
+                 options.rate_limit_client,
+                 options.rate_limit_snode,
+                 options.rate_limit_clients,
+                 options.rate_limit_adaptive}};
+
+        server::TlsSessions tls_sessions{
+                {options.tls_tickets,
+                 std::chrono::minutes{options.tls_ticket_rotation_min},
+                 options.tls_session_cache}};
+        service_node.set_tls_sessions(&tls_sessions);
 
         server::HTTPS https_server{
                 service_node,
                 request_handler,
                 rate_limiter,
+                tls_sessions,
                 {{options.ip, options.https_port, true}},
                 ssl_cert,
                 ssl_key,
                 ssl_dh,
-                {me.pubkey_legacy, private_key}};
+                {me.pubkey_legacy, private_key},
+                options.https_threads ? options.https_threads : server::HTTPS::default_threads(),
+                cpu_planner.pin("https")};
 
         oxenmq_server.init(
                 &service_node,
@@ -177,13 +270,28 @@ int main(int argc, char* argv[]) {
                 request_handler,
                 rate_limiter,
                 oxen::quic::Address{options.ip, options.omq_quic_port},
-                private_key_ed25519);
+                private_key_ed25519,
+                options.quic_0rtt);
 
         service_node.register_mq_server(quic.get());
+        if (options.quic_onion_relay)
+            service_node.set_quic_onion_relay(quic.get());
+        if (options.quic_data_relay)
+            service_node.set_quic_data_relay(quic.get());
         quic->startup_endpoint();
 
         https_server.start();
 
+        oxenmq_server->add_timer(
+                [&] {
+                    https_server.probe_loop_lag();
+                    rate_limiter.update_load(
+                            {service_node.admission().queue_delay(),
+                             https_server.loop_lag(),
+                             service_node.store_backlog()});
+                },
+                rpc::RateLimiter::LOAD_INTERVAL);
+
 #ifdef ENABLE_SYSTEMD
         sd_notify(0, "READY=1");
         oxenmq_server->add_timer(
@@ -193,6 +301,19 @@ int main(int argc, char* argv[]) {
                 10s);
 #endif
 
+        if (!options.snapshot_dir.empty() && options.snapshot_interval_min > 0)
+            oxenmq_server->add_timer(
+                    [&service_node, dir = options.snapshot_dir] {
+                        if (!service_node.get_db().snapshot_async(dir))
+                            log::warning(
+                                    logcat, "Previous database snapshot still running; skipping");
+                    },
+                    std::chrono::minutes{options.snapshot_interval_min});
+
+        // Everything is listening now; we still need the database before we can get going (if
+        // opening it failed this throws, and we shut down).
+        service_node.wait_for_db();
+
         // Log general stats at startup and again every hour
         log::info(logcat, service_node.get_status_line());
         oxenmq_server->add_timer(
@@ -202,10 +323,16 @@ int main(int argc, char* argv[]) {
             std::this_thread::sleep_for(100ms);
 
         log::warning(logcat, "Received signal {}; shutting down...", signalled.load());
+#ifdef ENABLE_SYSTEMD
+        sd_notify(0, "STOPPING=1\nSTATUS=Draining");
+#endif
+        service_node.drain(std::chrono::seconds{options.drain_timeout});
         service_node.shutdown();
         log::info(logcat, "Stopping https server");
         https_server.shutdown(true);
         log::info(logcat, "Stopping quic server");
+        service_node.set_quic_onion_relay(nullptr);
+        service_node.set_quic_data_relay(nullptr);
         quic.reset();
         log::info(logcat, "Stopping omq server");
         oxenmq_server_ptr.reset();
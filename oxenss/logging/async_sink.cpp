@@ -0,0 +1,222 @@
+#include "async_sink.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+namespace oxenss::logging {
+
+static size_t round_up_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+AsyncSink::AsyncSink(
+        std::vector<std::shared_ptr<spdlog::sinks::sink>> sinks,
+        size_t queue_size,
+        uint32_t rate_limit) :
+        sinks_{std::move(sinks)}, rate_limit_{rate_limit} {
+    size_t size = round_up_pow2(std::max<size_t>(queue_size, 2));
+    ring_ = std::make_unique<slot[]>(size);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; i++)
+        ring_[i].seq.store(i, std::memory_order_relaxed);
+    thread_ = std::thread{[this] { run(); }};
+}
+
+AsyncSink::~AsyncSink() {
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    }
+    wake_cv_.notify_one();
+    thread_.join();
+}
+
+AsyncSink::category_limit& AsyncSink::limit_for(const spdlog::details::log_msg& msg) {
+    std::string name{msg.logger_name.data(), msg.logger_name.size()};
+    {
+        std::shared_lock lock{limits_mutex_};
+        if (auto it = limits_.find(name); it != limits_.end())
+            return *it->second;
+    }
+    std::unique_lock lock{limits_mutex_};
+    auto& limit = limits_[std::move(name)];
+    if (!limit)
+        limit = std::make_unique<category_limit>();
+    return *limit;
+}
+
+bool AsyncSink::allowed(const spdlog::details::log_msg& msg) {
+    if (rate_limit_ == 0 || msg.level >= spdlog::level::err)
+        return true;
+
+    auto& limit = limit_for(msg);
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+    if (auto window = limit.window.load(std::memory_order_relaxed);
+        window != now && limit.window.compare_exchange_strong(window, now)) {
+        // We started a new window, so report what the last one suppressed
+        limit.count = 0;
+        if (auto n = limit.suppressed.exchange(0); n > 0) {
+            auto note = fmt::format(
+                    "Suppressed {} log message{} (rate limit: {}/s)",
+                    n,
+                    n == 1 ? "" : "s",
+                    rate_limit_);
+            push(spdlog::details::log_msg{msg.logger_name, spdlog::level::warn, note});
+        }
+    }
+    if (limit.count.fetch_add(1, std::memory_order_relaxed) < rate_limit_)
+        return true;
+    limit.suppressed++;
+    suppressed_++;
+    return false;
+}
+
+void AsyncSink::log(const spdlog::details::log_msg& msg) {
+    if (allowed(msg))
+        push(msg);
+}
+
+bool AsyncSink::push(const spdlog::details::log_msg& msg) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    slot* s;
+    while (true) {
+        s = &ring_[pos & mask_];
+        auto seq = s->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // The writer hasn't gotten to this slot's last message yet: we're full
+            dropped_++;
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+    // (The buffer has inline space for typical messages, so this doesn't allocate)
+    s->msg = spdlog::details::log_msg_buffer{msg};
+    s->seq.store(pos + 1);
+    enqueued_++;
+
+    if (sleeping_) {
+        std::lock_guard lock{mutex_};
+        wake_cv_.notify_one();
+    }
+    return true;
+}
+
+void AsyncSink::write(const spdlog::details::log_msg& msg) {
+    for (auto& sink : sinks_) {
+        if (!sink->should_log(msg.level))
+            continue;
+        try {
+            sink->log(msg);
+        } catch (...) {
+            // Nowhere to report it, and it mustn't kill the writer thread
+        }
+    }
+}
+
+size_t AsyncSink::drain() {
+    size_t n = 0;
+    while (true) {
+        auto& s = ring_[tail_ & mask_];
+        if (s.seq.load(std::memory_order_acquire) != tail_ + 1)
+            break;
+        write(s.msg);
+        // Frees the slot for the producer of the position one lap ahead
+        s.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        tail_++;
+        n++;
+    }
+    written_ += n;
+
+    if (auto drops = dropped_.load(); drops != reported_drops_) {
+        auto note = fmt::format(
+                "Dropped {} log message{} (log queue full)",
+                drops - reported_drops_,
+                drops - reported_drops_ == 1 ? "" : "s");
+        reported_drops_ = drops;
+        write(spdlog::details::log_msg{"logging", spdlog::level::warn, note});
+    }
+    return n;
+}
+
+void AsyncSink::flush_sinks() {
+    for (auto& sink : sinks_) {
+        try {
+            sink->flush();
+        } catch (...) {
+        }
+    }
+}
+
+void AsyncSink::run() {
+    bool unflushed = false;
+    while (true) {
+        if (drain() > 0) {
+            unflushed = true;
+            continue;
+        }
+
+        // The queue is empty, so this is a good time for writing things out
+        uint64_t flush_gen;
+        {
+            std::lock_guard lock{mutex_};
+            flush_gen = flush_requested_;
+        }
+        if (unflushed || flush_gen != flushed_) {
+            flush_sinks();
+            unflushed = false;
+            {
+                std::lock_guard lock{mutex_};
+                flushed_ = flush_gen;
+            }
+            flushed_cv_.notify_all();
+        }
+
+        std::unique_lock lock{mutex_};
+        if (stop_)
+            break;
+        // Producers only wake us up while we say we're sleeping, so check again for anything
+        // pushed before we said so.  (The timeout is just a backstop.)
+        sleeping_ = true;
+        if (ring_[tail_ & mask_].seq.load() != tail_ + 1 && flush_requested_ == flushed_)
+            wake_cv_.wait_for(lock, std::chrono::milliseconds{100});
+        sleeping_ = false;
+    }
+
+    // Anything pushed on the way out still gets written
+    drain();
+    flush_sinks();
+}
+
+void AsyncSink::flush() {
+    std::unique_lock lock{mutex_};
+    auto gen = ++flush_requested_;
+    wake_cv_.notify_one();
+    // The writer only flushes once it has emptied the queue, so under a flood of messages this
+    // gives up rather than waiting indefinitely.
+    flushed_cv_.wait_for(lock, std::chrono::seconds{1}, [&] { return flushed_ >= gen; });
+}
+
+void AsyncSink::set_pattern(const std::string& pattern) {
+    for (auto& sink : sinks_)
+        sink->set_pattern(pattern);
+}
+
+void AsyncSink::set_formatter(std::unique_ptr<spdlog::formatter> formatter) {
+    for (auto& sink : sinks_)
+        sink->set_formatter(formatter->clone());
+}
+
+}  // namespace oxenss::logging
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <spdlog/details/log_msg_buffer.h>
+#include <spdlog/sinks/sink.h>
+
+namespace oxenss::logging {
+
+/// spdlog sink that hands log messages off to a background thread, which writes them out to the
+/// wrapped sinks, so that logging never blocks the thread doing the logging on I/O.
+///
+/// Messages go through a bounded lock-free ring buffer; a message logged while the ring is full is
+/// dropped (and counted) rather than waiting for space, and the writer thread notes how many were
+/// dropped once it catches up.  Messages can also be rate limited per category (i.e. spdlog logger
+/// name): beyond the limit, messages below `error` level are suppressed for the rest of the second,
+/// and then summarized by a single message saying how many were.
+class AsyncSink : public spdlog::sinks::sink {
+  public:
+    static constexpr size_t DEFAULT_QUEUE_SIZE = 4096;
+
+    /// \param sinks the sinks that messages get written to
+    /// \param queue_size the maximum number of queued messages (rounded up to a power of two)
+    /// \param rate_limit the number of messages per second allowed per category before messages
+    /// below `error` level get suppressed; 0 for no limit.
+    explicit AsyncSink(
+            std::vector<std::shared_ptr<spdlog::sinks::sink>> sinks,
+            size_t queue_size = DEFAULT_QUEUE_SIZE,
+            uint32_t rate_limit = 0);
+
+    /// Writes out anything still queued, then stops the writer thread.
+    ~AsyncSink() override;
+
+    AsyncSink(const AsyncSink&) = delete;
+    AsyncSink& operator=(const AsyncSink&) = delete;
+
+    void log(const spdlog::details::log_msg& msg) override;
+
+    /// Waits (for up to a second) for everything queued so far to be written, then flushes the
+    /// wrapped sinks.
+    void flush() override;
+
+    void set_pattern(const std::string& pattern) override;
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override;
+
+    /// Returns the number of messages dropped because the queue was full
+    uint64_t dropped() const { return dropped_; }
+    /// Returns the number of messages suppressed by rate limiting
+    uint64_t suppressed() const { return suppressed_; }
+    /// Returns the number of messages currently waiting to be written
+    size_t queued() const { return enqueued_ - written_; }
+
+  private:
+    struct slot {
+        // Vyukov-style sequence number: equals the slot's position when it is free for that
+        // position's producer, and position + 1 once the message in it is ready to be written.
+        std::atomic<size_t> seq;
+        spdlog::details::log_msg_buffer msg;
+    };
+
+    struct category_limit {
+        std::atomic<int64_t> window{0};  // the second being counted
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint64_t> suppressed{0};  // in the current window
+    };
+
+    // Returns false if `msg` should be suppressed by its category's rate limit
+    bool allowed(const spdlog::details::log_msg& msg);
+    category_limit& limit_for(const spdlog::details::log_msg& msg);
+
+    bool push(const spdlog::details::log_msg& msg);
+    // Writes out what is queued; returns the number of messages written
+    size_t drain();
+    void write(const spdlog::details::log_msg& msg);
+    void flush_sinks();
+    void run();
+
+    const std::vector<std::shared_ptr<spdlog::sinks::sink>> sinks_;
+    const uint32_t rate_limit_;
+
+    std::unique_ptr<slot[]> ring_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};  // next position to enqueue at
+    alignas(64) size_t tail_ = 0;              // next position to write (writer thread only)
+
+    std::atomic<uint64_t> enqueued_{0}, written_{0}, dropped_{0}, suppressed_{0};
+    uint64_t reported_drops_ = 0;  // writer thread only
+
+    std::shared_mutex limits_mutex_;
+    std::unordered_map<std::string, std::unique_ptr<category_limit>> limits_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_cv_, flushed_cv_;
+    std::atomic<bool> sleeping_{false};
+    // Flushes are numbered, so that flush() can wait for the one it asked for
+    uint64_t flush_requested_ = 0, flushed_ = 0;
+    bool stop_ = false;
+
+    std::thread thread_;
+};
+
+}  // namespace oxenss::logging
@@ -1,15 +1,27 @@
 #include "oxen_logger.h"
+#include "async_sink.h"
 #include <oxen/log.hpp>
 #include <fmt/std.h>
 
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
 #include <filesystem>
 
 namespace oxenss::logging {
 
 static auto logcat = oxen::log::Cat("logging");
 
-void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
+static std::shared_ptr<AsyncSink> async_sink_;
+
+const AsyncSink* async_sink() {
+    return async_sink_.get();
+}
+
+void init(
+        const std::filesystem::path& data_dir,
+        oxen::log::Level log_level,
+        bool async,
+        uint32_t rate_limit) {
 
     log::reset_level(log_level);
 
@@ -23,7 +35,13 @@ void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
             log::set_level(cat, quic_level);
     }
 
-    log::add_sink(log::Type::Print, "stdout");
+    // When logging asynchronously the stdout and file sinks both sit behind the async sink (and so
+    // are only ever written to by its thread).
+    std::vector<std::shared_ptr<spdlog::sinks::sink>> async_sinks;
+    if (async)
+        async_sinks.push_back(std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
+    else
+        log::add_sink(log::Type::Print, "stdout");
 
     auto log_location = data_dir / "storage.logs";
 
@@ -33,21 +51,39 @@ void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
     // setting this to `true` can be useful for debugging on testnet
     bool rotate_on_open = false;
 
+    std::string file_error;
     try {
         auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
                 log_location, LOG_FILE_SIZE_LIMIT, EXTRA_FILES, rotate_on_open);
 
-        log::add_sink(std::move(file_sink));
+        if (async)
+            async_sinks.push_back(std::move(file_sink));
+        else
+            log::add_sink(std::move(file_sink));
     } catch (const spdlog::spdlog_ex& ex) {
+        file_error = ex.what();
+    }
+
+    if (async) {
+        async_sink_ = std::make_shared<AsyncSink>(
+                std::move(async_sinks), AsyncSink::DEFAULT_QUEUE_SIZE, rate_limit);
+        log::add_sink(async_sink_);
+    }
+
+    if (!file_error.empty()) {
         log::error(
                 logcat,
                 "Failed to open {} for logging: {}.  File logging disabled.",
                 log_location,
-                ex.what());
+                file_error);
         return;
     }
 
     log::info(logcat, "Writing logs to {}", log_location);
+    if (async && rate_limit > 0)
+        log::info(logcat, "Logging asynchronously, at most {} messages/s per category", rate_limit);
+    else if (async)
+        log::info(logcat, "Logging asynchronously");
 }
 
 }  // namespace oxenss::logging
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 
 #include <oxen/log.hpp>
@@ -10,6 +11,19 @@ namespace log = oxen::log;
 
 namespace oxenss::logging {
 
-void init(const std::filesystem::path& data_dir, oxen::log::Level log_level);
+class AsyncSink;
+
+/// Sets up logging to stdout and to a log file in `data_dir`.  With `async`, log messages are
+/// written out by a background thread (see AsyncSink) rather than by the thread logging them, and
+/// `rate_limit` (if non-zero) limits each category to that many messages per second below error
+/// level.
+void init(
+        const std::filesystem::path& data_dir,
+        oxen::log::Level log_level,
+        bool async = true,
+        uint32_t rate_limit = 0);
+
+/// Returns the async sink set up by `init()`, or nullptr if logging is synchronous.
+const AsyncSink* async_sink();
 
 }  // namespace oxenss::logging
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace oxenss::rpc {
+
+using namespace std::literals;
+
+/// Load-based admission control for client requests.  We keep a moving average of how long work
+/// sits queued before a worker thread gets to it (measured on queued HTTPS requests, and by a
+/// periodic probe job going through the same worker queue as OMQ requests).  While that delay is
+/// high we turn new client requests away up front, and we drop queued client requests that have
+/// waited so long that the client has most likely given up.  SN-to-SN traffic is never refused
+/// here, so that it gets the workers' time when we are overloaded.
+///
+/// All methods are thread-safe.
+class AdmissionControl {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // Client requests that were queued for longer than this get dropped without being processed
+    static constexpr auto QUEUE_DEADLINE = 5s;
+
+    // New client requests are refused while the average queue delay is above this...
+    static constexpr auto OVERLOAD_DELAY = 500ms;
+    // ...but only while that average is based on recent measurements: refusing requests means there
+    // is less to measure, and we don't want to get stuck refusing everything.
+    static constexpr auto SAMPLE_MAX_AGE = 1s;
+
+    // How often the probe job (see record_queue_delay) should be queued
+    static constexpr auto PROBE_INTERVAL = 100ms;
+
+    /// Records the time that a job (i.e. a request or the probe job) spent queued before something
+    /// started working on it.
+    void record_queue_delay(clock::duration delay, clock::time_point now = clock::now()) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+        // Exponential moving average with alpha = 1/8; updates racing each other could lose a
+        // sample, but that doesn't matter for our purposes.
+        auto avg = delay_us_.load(std::memory_order_relaxed);
+        delay_us_.store(avg + (us - avg) / 8, std::memory_order_relaxed);
+        last_sample_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    /// Returns true if we are currently overloaded
+    bool overloaded(clock::time_point now = clock::now()) const {
+        return queue_delay() > OVERLOAD_DELAY &&
+               now - clock::time_point{clock::duration{
+                             last_sample_.load(std::memory_order_relaxed)}} <
+                       SAMPLE_MAX_AGE;
+    }
+
+    /// Returns true if we should refuse a new client request right away (because we are
+    /// overloaded), counting it as refused if so.
+    bool refuse_client(clock::time_point now = clock::now()) {
+        if (!overloaded(now))
+            return false;
+        refused_++;
+        return true;
+    }
+
+    /// Returns true if a client request that was queued at `queued` has missed its deadline (and
+    /// so should be dropped rather than processed), counting it as expired if so.  This also
+    /// records the request's queue delay.
+    bool expired(clock::time_point queued, clock::time_point now = clock::now()) {
+        record_queue_delay(now - queued, now);
+        if (now - queued <= QUEUE_DEADLINE)
+            return false;
+        expired_++;
+        return true;
+    }
+
+    /// Returns the current average queue delay
+    std::chrono::microseconds queue_delay() const {
+        return std::chrono::microseconds{delay_us_.load(std::memory_order_relaxed)};
+    }
+
+    /// Returns the number of client requests refused for being overloaded
+    uint64_t refused() const { return refused_; }
+    /// Returns the number of client requests dropped for missing their deadline
+    uint64_t expired_requests() const { return expired_; }
+
+  private:
+    std::atomic<int64_t> delay_us_{0};
+    std::atomic<clock::rep> last_sample_{0};
+    std::atomic<uint64_t> refused_{0}, expired_{0};
+};
+
+}  // namespace oxenss::rpc
@@ -5,6 +5,7 @@
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
 
+#include <algorithm>
 #include <chrono>
 #include <limits>
 #include <type_traits>
@@ -529,8 +530,9 @@ static void load(retrieve& r, Dict& d) {
           sig,
           subacc,
           subacc_sig,
-          ts] =
-            load_fields<Str, Str, int, int, namespace_id, Str, Str, SV, SV, SV, SV, TP>(
+          ts,
+          wait] =
+            load_fields<Str, Str, int, int, namespace_id, Str, Str, SV, SV, SV, SV, TP, int64_t>(
                     d,
                     "lastHash",
                     "last_hash",
@@ -543,7 +545,8 @@ static void load(retrieve& r, Dict& d) {
                     "signature",
                     "subaccount",
                     "subaccount_sig",
-                    "timestamp");
+                    "timestamp",
+                    "wait");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
     auto& pk = pubkey ? pubkey : pubKey;
@@ -576,6 +579,13 @@ static void load(retrieve& r, Dict& d) {
 
     r.max_count = max_count;
     r.max_size = max_size;
+
+    if (wait) {
+        if (*wait < 0)
+            throw parse_error{"Invalid 'wait' value: must not be negative"};
+        r.wait = std::min<std::chrono::milliseconds>(
+                std::chrono::milliseconds{*wait}, RETRIEVE_MAX_WAIT);
+    }
 }
 void retrieve::load_from(json params) {
     load(*this, params);
@@ -965,9 +975,11 @@ static client_subrequest as_subrequest(client_request&& req) {
     return var::visit(
             [](auto&& r) -> client_subrequest {
                 using T = std::decay_t<decltype(r)>;
-                if constexpr (type_list_contains<T, client_rpc_subrequests>)
+                if constexpr (type_list_contains<T, client_rpc_subrequests>) {
+                    if constexpr (std::is_same_v<T, retrieve>)
+                        r.wait = 0ms;  // Only top-level retrieves can wait
                     return std::move(r);
-                else
+                } else
                     throw parse_error{
                             "Invalid batch subrequest: subrequests may not contain meta-requests"};
             },
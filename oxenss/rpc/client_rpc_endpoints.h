@@ -63,6 +63,12 @@ struct no_args : endpoint {
 /// - "reason": a reason string, e.g. propagating a thrown exception messages
 /// - "bad_peer_response": true if the peer returned an unparsable response
 /// - "query_failure": true if the database failed to perform the query
+/// - "over_quota": true if the store was refused because the account or namespace is over its
+///   storage quota
+///
+/// When the node is configured to reply once a quorum of swarm members has answered, members that
+/// had not yet answered instead have a `"pending": true` result (and neither succeeded nor failed,
+/// as far as the reply knows).
 struct recursive : endpoint {
     // True on the initial client request, false on forwarded requests
     bool recurse;
@@ -216,6 +222,12 @@ struct store final : recursive {
 ///
 ///   Note that regardless of the two values the response will always include at least one message,
 ///   even if it would exceed the given maximum size.
+/// - `wait` (optional) if no messages are available then, rather than returning an empty result
+///   right away, wait up to this many milliseconds for a new message to arrive in the namespace and
+///   then return it (or return the empty result once the time is up).  This lets clients that do
+///   not keep a `monitor` subscription poll much less often.  The wait is capped at 8 seconds, and
+///   only applies to top-level retrieve requests (it is ignored inside batch or sequence requests).
+///   A node with too many waiting requests may return an empty result without waiting.
 ///
 /// Authentication parameters: these are optional during a transition period, up until Oxen
 /// hard-fork 19, and become required starting there.  During the transition period, *if* provided
@@ -253,6 +265,7 @@ struct retrieve final : endpoint {
     std::optional<std::string> last_hash;
     std::optional<int> max_count;
     std::optional<int> max_size;
+    std::chrono::milliseconds wait{0};
 
     bool check_signature = false;  // For transition; delete this once we require sigs always
     std::optional<std::array<unsigned char, 32>> pubkey_ed25519;
@@ -713,6 +726,9 @@ struct get_swarm final : endpoint {
 ///
 /// See oxend rpc documentation (or the oxen-core/src/rpc/core_rpc_server_command_defs.h file) for
 /// information on using these oxend rpc endpoints.
+///
+/// Results may be served from a short-lived cache of earlier identical requests (i.e. with the same
+/// endpoint and params); cached results are dropped whenever a new block arrives.
 struct oxend_request final : endpoint {
     static constexpr auto names() { return NAMES("oxend_request"); }
 
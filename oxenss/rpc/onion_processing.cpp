@@ -1,6 +1,7 @@
 #include "onion_processing.h"
 #include <oxenss/crypto/channel_encryption.hpp>
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/probes.hpp>
 #include <oxenss/utils/string_utils.hpp>
 
 #include <oxenc/endian.h>
@@ -13,19 +14,33 @@ namespace oxenss::rpc {
 
 static auto logcat = log::Cat("rpc");
 
-ParsedInfo process_inner_request(std::string plaintext) {
+std::string onion_slice::release() && {
+    buffer.resize(offset + size);
+    buffer.erase(0, offset);
+    offset = 0;
+    return std::move(buffer);
+}
+
+bool operator==(const onion_slice& lhs, const onion_slice& rhs) {
+    return lhs.view() == rhs.view();
+}
+
+ParsedInfo process_inner_request(onion_slice plaintext) {
 
     ParsedInfo ret;
 
     try {
-        auto [ciphertext, inner_json] = parse_combined_payload(plaintext);
+        auto [ciphertext, inner_json] = parse_combined_payload(plaintext.view());
+        // Where the ciphertext is in the plaintext buffer, so that we can slice it out of the
+        // buffer (which, unlike the view, survives the buffer being moved)
+        const size_t inner_offset = ciphertext.data() - plaintext.buffer.data();
 
         /// Kind of unfortunate that we use "headers" (which is empty)
         /// to identify we are the final destination...
         if (inner_json.count("headers")) {
             log::trace(logcat, "Found body: <{}>", ciphertext);
             auto& [body, json, b64] = ret.emplace<FinalDestinationInfo>();
-            body = std::move(ciphertext);
+            body = {std::move(plaintext.buffer), inner_offset, ciphertext.size()};
             if (auto it = inner_json.find("json"); it != inner_json.end())
                 json = it->get<bool>();
             if (auto it = inner_json.find("base64"); it != inner_json.end())
@@ -78,7 +93,7 @@ ParsedInfo process_inner_request(std::string plaintext) {
                 protocol = "https";
         } else {
             auto& [ctext, eph_key, enc_type, next] = ret.emplace<RelayToNodeInfo>();
-            ctext = std::move(ciphertext);
+            ctext = {std::move(plaintext.buffer), inner_offset, ciphertext.size()};
             next = crypto::ed25519_pubkey::from_hex(
                     inner_json.at("destination").get_ref<const std::string&>());
             eph_key = crypto::x25519_pubkey::from_hex(
@@ -98,13 +113,13 @@ ParsedInfo process_inner_request(std::string plaintext) {
 
 ParsedInfo process_ciphertext_v2(
         const crypto::ChannelEncryption& decryptor,
-        std::string_view ciphertext,
+        std::string ciphertext,
         const crypto::x25519_pubkey& ephem_key,
         crypto::EncryptType enc_type) {
-    std::optional<std::string> plaintext;
+    std::optional<std::string_view> plaintext;
 
     try {
-        plaintext = decryptor.decrypt(enc_type, ciphertext, ephem_key);
+        plaintext = decryptor.decrypt_in_place(enc_type, ciphertext, ephem_key);
     } catch (const std::exception& e) {
         log::error(
                 logcat,
@@ -113,12 +128,14 @@ ParsedInfo process_ciphertext_v2(
                 enc_type,
                 e.what());
     }
+    OXENSS_PROBE(onion_decrypt, ciphertext.size(), int{plaintext.has_value()});
     if (!plaintext)
         return ProcessCiphertextError::INVALID_CIPHERTEXT;
 
     log::debug(logcat, "onion request decrypted: (len: {})", plaintext->size());
 
-    return process_inner_request(std::move(*plaintext));
+    const size_t offset = plaintext->data() - ciphertext.data();
+    return process_inner_request({std::move(ciphertext), offset, plaintext->size()});
 }
 
 bool is_onion_url_target_allowed(std::string_view target) {
@@ -163,7 +180,7 @@ CiphertextPlusJson parse_combined_payload(std::string_view payload) {
 }
 
 std::ostream& operator<<(std::ostream& os, const FinalDestinationInfo& d) {
-    return os << fmt::format("[\"body\": {}]", d.body);
+    return os << fmt::format("[\"body\": {}]", d.body.view());
 }
 
 bool operator==(const FinalDestinationInfo& lhs, const FinalDestinationInfo& rhs) {
@@ -178,7 +195,7 @@ std::ostream& operator<<(std::ostream& os, const RelayToServerInfo& d) {
                    d.host,
                    d.port,
                    d.target,
-                   d.payload);
+                   d.payload.view());
 }
 
 bool operator==(const RelayToServerInfo& lhs, const RelayToServerInfo& rhs) {
@@ -189,7 +206,7 @@ bool operator==(const RelayToServerInfo& lhs, const RelayToServerInfo& rhs) {
 std::ostream& operator<<(std::ostream& os, const RelayToNodeInfo& d) {
     return os << fmt::format(
                    R"("["ciphertext": {}, "ephemeral_key": {}, "enc_type": {}, "next_node": {}])",
-                   d.ciphertext,
+                   d.ciphertext.view(),
                    d.ephemeral_key,
                    d.enc_type,
                    d.next_node);
@@ -13,12 +13,37 @@ namespace oxenss::rpc {
 // starting at somewhere higher than 0.
 inline constexpr int MAX_ONION_HOPS = 15;
 
-using CiphertextPlusJson = std::pair<std::string, nlohmann::json>;
+/// The ciphertext is a view into the payload passed to parse_combined_payload
+using CiphertextPlusJson = std::pair<std::string_view, nlohmann::json>;
+
+/// Part of a decrypted onion request layer: the buffer the layer was decrypted into, plus the
+/// position of the part within it.  This lets us pass on the parts of a layer (such as the inner
+/// ciphertext for the next hop) without copying them out of that buffer.
+struct onion_slice {
+    std::string buffer;
+    size_t offset = 0;
+    size_t size = 0;
+
+    onion_slice() = default;
+    // All of `buf`
+    onion_slice(std::string buf) : buffer{std::move(buf)}, size{buffer.size()} {}
+    onion_slice(const char* s) : onion_slice{std::string{s}} {}
+    onion_slice(std::string buf, size_t offset, size_t size) :
+            buffer{std::move(buf)}, offset{offset}, size{size} {}
+
+    std::string_view view() const { return std::string_view{buffer}.substr(offset, size); }
+
+    // Returns just the slice, reusing the buffer (which has to be shifted in place if the slice
+    // doesn't start at the beginning) rather than copying it.
+    std::string release() &&;
+};
+
+bool operator==(const onion_slice& lhs, const onion_slice& rhs);
 
 /// The request is to be forwarded to another SS node
 struct RelayToNodeInfo {
     /// Inner ciphertext for next node
-    std::string ciphertext;
+    onion_slice ciphertext;
     // Key to be forwarded to next node for decryption
     crypto::x25519_pubkey ephemeral_key;
     // The encryption type with which this request was encoded
@@ -35,7 +60,7 @@ bool operator==(const RelayToNodeInfo& lhs, const RelayToNodeInfo& rhs);
 /// that supports our protocol (e.g. Session File Server)
 struct RelayToServerInfo {
     // Result of decryption (intact)
-    std::string payload;
+    onion_slice payload;
     // Server's address
     std::string host;
     // Server's port
@@ -53,7 +78,7 @@ bool operator==(const RelayToServerInfo& lhs, const RelayToServerInfo& rhs);
 /// We are the final destination for this request
 struct FinalDestinationInfo {
     // Request body
-    std::string body;
+    onion_slice body;
 
     // If true, and the response has a content type indicating json, then embed the "body" value
     // as a direct json value rather than encapsulating it as a json string.  For example, when
@@ -84,15 +109,17 @@ enum class ProcessCiphertextError {
 using ParsedInfo = std::
         variant<RelayToNodeInfo, RelayToServerInfo, FinalDestinationInfo, ProcessCiphertextError>;
 
+/// Decrypts an onion request layer in place, within `ciphertext`, and parses it; the parts of the
+/// returned info that come from the layer are slices of that buffer.
 ParsedInfo process_ciphertext_v2(
         const crypto::ChannelEncryption& decryptor,
-        std::string_view ciphertext,
+        std::string ciphertext,
         const crypto::x25519_pubkey& ephem_key,
         crypto::EncryptType enc_type);
 
 CiphertextPlusJson parse_combined_payload(std::string_view payload);
 
-ParsedInfo process_inner_request(std::string plaintext);
+ParsedInfo process_inner_request(onion_slice plaintext);
 
 // Returns true if `target` is a permitted target for proxying http/https requests through an
 // onion request.  Requires that the target start with /oxen/, end with /lsrpc, and does not
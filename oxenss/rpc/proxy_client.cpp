@@ -0,0 +1,190 @@
+#include "proxy_client.h"
+#include "request_handler.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/version.h>
+
+#include <cpr/cpr.h>
+
+#include <deque>
+#include <forward_list>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("rpc");
+
+struct ProxyClient::pool : std::enable_shared_from_this<pool> {
+    struct request {
+        std::string url;
+        std::string body;
+        std::function<void(Response)> cb;
+    };
+    struct idle_session {
+        std::shared_ptr<cpr::Session> session;
+        std::chrono::steady_clock::time_point since;
+    };
+    struct host {
+        size_t active = 0;
+        // Most recently used last, so that we reuse the connection most likely to still be open
+        std::vector<idle_session> idle;
+        std::deque<request> queued;
+    };
+
+    const std::chrono::milliseconds timeout;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, host> hosts;
+    std::forward_list<cpr::AsyncWrapper<void>> pending;
+    uint64_t reused = 0, created = 0;
+    size_t bytes = 0;  // Of the requests in flight or queued
+
+    explicit pool(std::chrono::milliseconds timeout) : timeout{timeout} {}
+
+    std::shared_ptr<cpr::Session> make_session() {
+        auto s = std::make_shared<cpr::Session>();
+        s->SetHeader(cpr::Header{
+                {"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
+                {"Content-Type", "application/octet-stream"}});
+        s->SetTimeout(cpr::Timeout{timeout});
+        s->SetSslOptions(cpr::Ssl(cpr::ssl::TLSv1_2{}));
+        s->SetRedirect(cpr::Redirect{0L});
+        // Uses HTTP/2 if the server supports it (via ALPN), and HTTP/1.1 otherwise
+        s->SetHttpVersion(cpr::HttpVersion{cpr::HttpVersionCode::VERSION_2_0_TLS});
+        return s;
+    }
+
+    // Sends `req` to the destination `base`, for which a slot (in `host::active`) has already been
+    // taken.  Must be called with the mutex held.
+    void send(const std::string& base, host& h, request req) {
+        std::shared_ptr<cpr::Session> session;
+        if (!h.idle.empty()) {
+            session = std::move(h.idle.back().session);
+            h.idle.pop_back();
+            reused++;
+        } else {
+            session = make_session();
+            created++;
+        }
+        size_t size = req.url.size() + req.body.size();
+        session->SetUrl(cpr::Url{std::move(req.url)});
+        session->SetBody(cpr::Body{std::move(req.body)});
+        pending.emplace_front(session->PostCallback(
+                [self = shared_from_this(), base, session, size, cb = std::move(req.cb)](
+                        cpr::Response r) mutable {
+                    bool ok = r.error.code == cpr::ErrorCode::OK;
+                    cb(to_response(std::move(r)));
+                    self->finished(base, std::move(session), ok, size);
+                }));
+    }
+
+    // Called when a request to `base` has completed, to return the session to the pool (unless
+    // the request failed, in which case we don't trust its connection) and send the next queued
+    // request, if any.  `size` is the size of the finished request (see `bytes`).
+    void finished(
+            const std::string& base, std::shared_ptr<cpr::Session> session, bool ok, size_t size) {
+        std::lock_guard lock{mutex};
+        bytes -= size;
+        auto& h = hosts[base];
+        if (!h.queued.empty()) {
+            if (ok)
+                h.idle.push_back({std::move(session), std::chrono::steady_clock::now()});
+            auto req = std::move(h.queued.front());
+            h.queued.pop_front();
+            return send(base, h, std::move(req));
+        }
+        h.active--;
+        if (ok)
+            h.idle.push_back({std::move(session), std::chrono::steady_clock::now()});
+    }
+
+    static Response to_response(cpr::Response r) {
+        Response res;
+        if (r.error.code != cpr::ErrorCode::OK) {
+            log::debug(
+                    logcat,
+                    "Onion proxied request to {} failed: {}",
+                    r.url.str(),
+                    r.error.message);
+            res.body = r.error.message;
+            if (r.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT)
+                res.status = http::GATEWAY_TIMEOUT;
+            else
+                res.status = http::BAD_GATEWAY;
+        } else {
+            res.status.first = r.status_code;
+            res.status.second = r.status_line;
+            for (auto& [k, v] : r.header)
+                res.headers.emplace_back(std::move(k), std::move(v));
+            res.body = std::move(r.text);
+        }
+        return res;
+    }
+};
+
+ProxyClient::ProxyClient(std::chrono::milliseconds timeout) :
+        pool_{std::make_shared<pool>(timeout)} {}
+
+ProxyClient::~ProxyClient() = default;
+
+void ProxyClient::post(
+        const std::string& base,
+        std::string url,
+        std::string body,
+        std::function<void(Response)> cb) {
+    std::unique_lock lock{pool_->mutex};
+    auto& h = pool_->hosts[base];
+    if (h.active < MAX_ACTIVE_PER_HOST) {
+        h.active++;
+        pool_->bytes += url.size() + body.size();
+        return pool_->send(base, h, {std::move(url), std::move(body), std::move(cb)});
+    }
+    if (h.queued.size() >= MAX_QUEUED_PER_HOST) {
+        lock.unlock();
+        log::debug(logcat, "Onion proxied request to {} failed: too many pending requests", base);
+        return cb({http::SERVICE_UNAVAILABLE, "Too many pending requests to " + base});
+    }
+    pool_->bytes += url.size() + body.size();
+    h.queued.push_back({std::move(url), std::move(body), std::move(cb)});
+}
+
+void ProxyClient::cleanup() {
+    auto expiry = std::chrono::steady_clock::now() - IDLE_TIMEOUT;
+    // Sessions get destroyed (closing their connections) after we release the lock
+    std::vector<std::shared_ptr<cpr::Session>> closing;
+    std::lock_guard lock{pool_->mutex};
+    pool_->pending.remove_if(
+            [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
+    for (auto it = pool_->hosts.begin(); it != pool_->hosts.end();) {
+        auto& idle = it->second.idle;
+        // Idle sessions are in order of when they became idle, so the expired ones are at the front
+        auto keep = idle.begin();
+        while (keep != idle.end() && keep->since < expiry)
+            closing.push_back(std::move((keep++)->session));
+        idle.erase(idle.begin(), keep);
+        if (idle.empty() && !it->second.active)
+            it = pool_->hosts.erase(it);
+        else
+            ++it;
+    }
+}
+
+ProxyClient::stats ProxyClient::get_stats() const {
+    stats s;
+    std::lock_guard lock{pool_->mutex};
+    s.hosts = pool_->hosts.size();
+    for (auto& [base, h] : pool_->hosts) {
+        s.active += h.active;
+        s.queued += h.queued.size();
+        s.idle += h.idle.size();
+    }
+    s.bytes = pool_->bytes;
+    s.reused = pool_->reused;
+    s.created = pool_->created;
+    return s;
+}
+
+}  // namespace oxenss::rpc
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace oxenss::rpc {
+
+struct Response;
+
+using namespace std::literals;
+
+/// HTTP(S) client for onion requests that we proxy to a server (i.e. RelayToServerInfo requests).
+/// Rather than making a new connection, with a full TCP and TLS handshake, for every request this
+/// keeps a pool of keep-alive connections to each destination (which are mostly the same few file
+/// and open group servers) and negotiates HTTP/2 with servers that support it.
+///
+/// The number of requests in flight to each destination is bounded: requests beyond that wait in
+/// a (likewise bounded) queue for a connection to become free.
+class ProxyClient {
+  public:
+    // Maximum number of concurrent requests (and thus connections) to one destination
+    static constexpr size_t MAX_ACTIVE_PER_HOST = 16;
+    // Maximum number of requests waiting for a connection to one destination; requests beyond
+    // this fail immediately with a 503.
+    static constexpr size_t MAX_QUEUED_PER_HOST = 256;
+    // Idle connections are closed after this long (servers will generally have closed them long
+    // before this anyway).
+    static constexpr auto IDLE_TIMEOUT = 60s;
+
+    explicit ProxyClient(std::chrono::milliseconds timeout);
+    ~ProxyClient();
+
+    ProxyClient(const ProxyClient&) = delete;
+    ProxyClient& operator=(const ProxyClient&) = delete;
+
+    /// POSTs `body` to the `url`, which must consist of an http(s) `base` (with scheme, host and,
+    /// if not the default, port, e.g. "https://example.com:8443") followed by the path.  `cb` is
+    /// invoked, from a cpr worker thread, with the server's response or, if the request fails, a
+    /// BAD_GATEWAY or GATEWAY_TIMEOUT error.
+    void post(
+            const std::string& base,
+            std::string url,
+            std::string body,
+            std::function<void(Response)> cb);
+
+    /// Closes connections that have been idle for longer than IDLE_TIMEOUT, and drops the handles
+    /// of finished requests.  Should be called periodically.
+    void cleanup();
+
+    struct stats {
+        size_t hosts = 0;      // destinations we have connections to or requests for
+        size_t active = 0;     // requests in flight
+        size_t queued = 0;     // requests waiting for a connection
+        size_t idle = 0;       // idle connections
+        size_t bytes = 0;      // url and body bytes of the requests in flight or waiting
+        uint64_t reused = 0;   // requests sent over a previously used connection
+        uint64_t created = 0;  // connections created
+    };
+    stats get_stats() const;
+
+  private:
+    // The pool state lives in its own shared object, which requests in flight keep alive, so that
+    // destroying the client doesn't have to wait for them.
+    struct pool;
+    std::shared_ptr<pool> pool_;
+};
+
+}  // namespace oxenss::rpc
@@ -4,6 +4,8 @@
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <cstring>
+#include <utility>
 
 extern "C" {
 #include <arpa/inet.h>
@@ -15,99 +17,260 @@ namespace {
 
     using namespace std::chrono;
 
-    // Time between to consecutive tokens for clients
-    constexpr microseconds TOKEN_PERIOD_US = 1'000'000us / RateLimiter::TOKEN_RATE;
+    constexpr int TOKEN_SHIFT = 48;
+    constexpr uint64_t TIME_MASK = (uint64_t{1} << TOKEN_SHIFT) - 1;
 
-    // Time between to consecutive tokens for snodes
-    constexpr microseconds TOKEN_PERIOD_SN_US = 1'000'000us / RateLimiter::TOKEN_RATE_SN;
+    constexpr uint64_t make_state(uint64_t tokens, uint64_t time_us) {
+        return tokens << TOKEN_SHIFT | (time_us & TIME_MASK);
+    }
 
-    constexpr microseconds FILL_EMPTY_BUCKET_US = TOKEN_PERIOD_US * RateLimiter::BUCKET_SIZE;
+    // Spreads keys (such as consecutive IPv4 addresses) evenly across the table's sets
+    constexpr uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Client keys: IPv4 addresses go in the lower 32 bits with the upper 32 bits all set, which
+    // never clashes with the /64 prefix of a (non-multicast) IPv6 address.
+    constexpr uint64_t ipv4_key(uint32_t ip) {
+        return uint64_t{0xffff'ffff} << 32 | ip;
+    }
+
+    // 0 marks an unused slot, so keys must be non-zero
+    constexpr uint64_t nonzero(uint64_t key) {
+        return key ? key : 1;
+    }
 
 }  // namespace
 
-RateLimiter::RateLimiter(oxenmq::OxenMQ& omq) {
-    omq.add_timer(
-            [this] {
-                std::lock_guard lock{mutex_};
-                clean_buckets(steady_clock::now());
-            },
-            10s);
+RateLimiter::table::table(size_t capacity, uint32_t token_rate, uint32_t bucket_size) {
+    size_t sets = 1;
+    while (sets * WAYS < capacity)
+        sets <<= 1;
+    slots = std::make_unique<slot[]>(sets * WAYS);
+    set_mask = sets - 1;
+    token_period_us = std::max<uint64_t>(1'000'000 / std::max<uint32_t>(token_rate, 1), 1);
+    fill_us = token_period_us * bucket_size;
 }
 
-template <typename TokenBucket>
-static bool fill_bucket(
-        TokenBucket& bucket, steady_clock::time_point now, bool service_node = false) {
-    auto elapsed_us = duration_cast<microseconds>(now - bucket.last_time_point);
-    // clamp elapsed time to how long it takes to fill up the whole bucket
-    // (simplifies overflow checking)
-    elapsed_us = std::min(elapsed_us, FILL_EMPTY_BUCKET_US);
-
-    const auto token_period = service_node ? TOKEN_PERIOD_SN_US : TOKEN_PERIOD_US;
-
-    const uint32_t token_added = elapsed_us.count() / token_period.count();
-    bucket.num_tokens += token_added;
-    if (bucket.num_tokens >= RateLimiter::BUCKET_SIZE) {
-        bucket.num_tokens = RateLimiter::BUCKET_SIZE;
-        return true;
-    }
-    return false;
+RateLimiter::RateLimiter(oxenmq::OxenMQ& omq) : RateLimiter{omq, config{}} {}
+
+RateLimiter::RateLimiter(oxenmq::OxenMQ& omq, config conf) :
+        conf_{conf},
+        clients_{conf_.max_clients, conf_.token_rate, conf_.bucket_size},
+        // There are only a couple of thousand service nodes, but leave plenty of room so that
+        // they don't have to evict each other
+        snodes_{8192, conf_.token_rate_sn, conf_.bucket_size} {
+    omq.add_timer([this] { clean_buckets(); }, 10s);
 }
 
-template <typename TokenBucket>
-static bool remove_token(TokenBucket& b, steady_clock::time_point now, bool sn = false) {
-    fill_bucket(b, now, sn);
-    if (b.num_tokens == 0)
-        return false;
-    b.num_tokens--;
-    b.last_time_point = now;
+uint64_t RateLimiter::micros(steady_clock::time_point t) const {
+    return t > epoch_ ? duration_cast<microseconds>(t - epoch_).count() : 0;
+}
+
+bool RateLimiter::take_token(
+        table& t, uint64_t key, steady_clock::time_point time, uint32_t cost, uint32_t scale) {
+    const uint64_t now = micros(time);
+    slot* set = &t.slots[(mix(key) & t.set_mask) * WAYS];
+    cost = std::clamp<uint32_t>(cost, 1, conf_.bucket_size);
+    // How long an empty bucket takes to fill up at the current rate
+    const uint64_t fill_us = t.fill_us * SCALE_ONE / scale;
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        for (size_t w = 0; w < WAYS; w++) {
+            auto& s = set[w];
+            if (s.key.load(std::memory_order_acquire) != key)
+                continue;
+            auto state = s.state.load(std::memory_order_acquire);
+            while (true) {
+                // If the slot got taken over by another key since we looked at it then the state
+                // we loaded might be that key's: start over.
+                if (s.key.load(std::memory_order_acquire) != key)
+                    break;
+                uint64_t last = state & TIME_MASK;
+                uint64_t tokens = state >> TOKEN_SHIFT;
+                // clamp elapsed time to how long it takes to fill up the whole bucket
+                // (simplifies overflow checking)
+                uint64_t elapsed = std::min(now > last ? now - last : 0, fill_us);
+                tokens = std::min<uint64_t>(
+                        tokens + elapsed * scale / (t.token_period_us * SCALE_ONE),
+                        conf_.bucket_size);
+                if (tokens < cost)
+                    return false;
+                if (s.state.compare_exchange_weak(
+                            state,
+                            make_state(tokens - cost, now),
+                            std::memory_order_acq_rel,
+                            std::memory_order_acquire))
+                    return true;
+            }
+            break;
+        }
+
+        // Not found, so take over a slot: preferably an unused one, then one whose bucket is
+        // full (an idle client), and otherwise the least recently used.
+        slot* victim = nullptr;
+        uint64_t victim_key = 0, oldest = 0;
+        for (size_t w = 0; w < WAYS; w++) {
+            auto& s = set[w];
+            auto k = s.key.load(std::memory_order_acquire);
+            if (k == key) {  // Someone else just added it
+                victim = nullptr;
+                break;
+            }
+            if (k == 0) {
+                victim = &s;
+                victim_key = 0;
+                break;
+            }
+            auto last = s.state.load(std::memory_order_relaxed) & TIME_MASK;
+            auto age = now > last ? now - last : 0;
+            if (!victim || age > oldest) {
+                victim = &s;
+                victim_key = k;
+                oldest = age;
+            }
+        }
+        if (!victim)
+            continue;
+        if (victim->key.compare_exchange_strong(
+                    victim_key, key, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            // The new bucket starts full, less the tokens for this request
+            victim->state.store(
+                    make_state(conf_.bucket_size - cost, now), std::memory_order_release);
+            return true;
+        }
+    }
+    // We keep losing races for this set, which only happens under heavy contention for it;
+    // don't hold the request up any longer.
     return true;
 }
 
 bool RateLimiter::should_rate_limit(
         const crypto::legacy_pubkey& pubkey, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
-    if (auto [it, ins] = snode_buckets_.emplace(pubkey, TokenBucket{BUCKET_SIZE - 1, now}); ins)
+    uint64_t key;
+    std::memcpy(&key, pubkey.data(), sizeof(key));
+    if (take_token(snodes_, nonzero(key), now, 1, SCALE_ONE))
         return false;
-    else
-        return !remove_token(it->second, now, true);
+    snode_limited_++;
+    return true;
 }
 
-bool RateLimiter::should_rate_limit_client(uint32_t ip, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
+bool RateLimiter::limit_client_key(uint64_t key, steady_clock::time_point now, uint32_t cost) {
+    if (take_token(clients_, nonzero(key), now, cost, scale_.load(std::memory_order_relaxed)))
+        return false;
+    client_limited_++;
+    return true;
+}
 
-    if (auto it = client_buckets_.find(ip); it != client_buckets_.end())
-        return !remove_token(it->second, now);
+bool RateLimiter::should_rate_limit_client(
+        uint32_t ip, steady_clock::time_point now, uint32_t cost) {
+    return limit_client_key(ipv4_key(ip), now, cost);
+}
 
-    if (client_buckets_.size() >= MAX_CLIENTS) {
-        clean_buckets(now);
-        if (client_buckets_.size() >= MAX_CLIENTS)
-            return true;
+bool RateLimiter::should_rate_limit_client_ipv6(
+        std::string_view ip, steady_clock::time_point now, uint32_t cost) {
+    if (ip.size() != 16)
+        return false;
+    static constexpr unsigned char v4_mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (std::memcmp(ip.data(), v4_mapped, sizeof(v4_mapped)) == 0) {
+        uint32_t ipv4;
+        std::memcpy(&ipv4, ip.data() + 12, 4);
+        return should_rate_limit_client(ntohl(ipv4), now, cost);
     }
-    client_buckets_.emplace(ip, TokenBucket{BUCKET_SIZE - 1, now});
-    return false;
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++)
+        prefix = prefix << 8 | static_cast<unsigned char>(ip[i]);
+    return limit_client_key(prefix, now, cost);
 }
 
 bool RateLimiter::should_rate_limit_client(
-        const std::string& ip_dotted_quad, steady_clock::time_point now) {
-    struct in_addr ip;
-    int res = inet_pton(AF_INET, ip_dotted_quad.c_str(), &ip);
-    return res == 1 ? should_rate_limit_client(ip.s_addr, now) : false;
+        const std::string& ip, steady_clock::time_point now, uint32_t cost) {
+    if (struct in_addr a; inet_pton(AF_INET, ip.c_str(), &a) == 1)
+        return should_rate_limit_client(ntohl(a.s_addr), now, cost);
+
+    std::string_view addr{ip};
+    if (addr.size() >= 2 && addr.front() == '[' && addr.back() == ']')
+        addr = addr.substr(1, addr.size() - 2);
+    if (struct in6_addr a; inet_pton(AF_INET6, std::string{addr}.c_str(), &a) == 1)
+        return should_rate_limit_client_ipv6(
+                {reinterpret_cast<const char*>(a.s6_addr), sizeof(a.s6_addr)}, now, cost);
+    return false;
 }
 
-void RateLimiter::clean_buckets(steady_clock::time_point now) {
-    for (auto it = client_buckets_.begin(); it != client_buckets_.end();) {
-        if (fill_bucket(it->second, now))
-            it = client_buckets_.erase(it);
-        else
-            ++it;
-    }
+uint32_t RateLimiter::endpoint_cost(std::string_view endpoint) {
+    // Stores (and batches, which typically include stores) write to the database and notify
+    // monitoring clients; retrieves can return a lot of data.
+    constexpr std::pair<std::string_view, uint32_t> costs[] = {
+            {"store", 4},
+            {"batch", 4},
+            {"sequence", 4},
+            {"ifelse", 4},
+            {"delete_all", 4},
+            {"retrieve", 2},
+            {"delete", 2},
+            {"expire", 2},
+            {"oxend_request", 2},
+    };
+    for (auto& [name, cost] : costs)
+        if (name == endpoint)
+            return cost;
+    return 1;
+}
 
-    for (auto it = snode_buckets_.begin(); it != snode_buckets_.end();) {
-        if (fill_bucket(it->second, now, true))
-            it = snode_buckets_.erase(it);
-        else
-            ++it;
+void RateLimiter::update_load(const load& l) {
+    if (!conf_.adaptive)
+        return;
+    auto pressure = std::max(
+            {static_cast<double>(l.queue_delay.count()) /
+                     duration_cast<microseconds>(QUEUE_DELAY_TARGET).count(),
+             static_cast<double>(l.loop_lag.count()) /
+                     duration_cast<microseconds>(LOOP_LAG_TARGET).count(),
+             static_cast<double>(l.store_backlog) / STORE_BACKLOG_TARGET});
+
+    constexpr auto min_scale = static_cast<uint32_t>(MIN_LOAD_SCALE * SCALE_ONE);
+    constexpr auto max_scale = static_cast<uint32_t>(MAX_LOAD_SCALE * SCALE_ONE);
+    auto scale = scale_.load(std::memory_order_relaxed);
+    // Back off quickly when overloaded, and recover gradually (so that we don't immediately
+    // overload ourselves again).
+    if (pressure > 1)
+        scale = std::max(min_scale, scale * 3 / 4);
+    else if (pressure < 0.5)
+        scale = std::min(max_scale, scale + SCALE_ONE / 8);
+    else
+        return;
+    scale_.store(scale, std::memory_order_relaxed);
+}
+
+void RateLimiter::clean_buckets(steady_clock::time_point time) {
+    const uint64_t now = micros(time);
+    const auto client_scale = scale_.load(std::memory_order_relaxed);
+    for (auto* t : {&clients_, &snodes_}) {
+        // (Client buckets refill at the current load scale)
+        const uint64_t fill_us =
+                t == &clients_ ? t->fill_us * SCALE_ONE / client_scale : t->fill_us;
+        size_t n = (t->set_mask + 1) * WAYS;
+        for (size_t i = 0; i < n; i++) {
+            auto& s = t->slots[i];
+            auto key = s.key.load(std::memory_order_acquire);
+            if (!key)
+                continue;
+            auto last = s.state.load(std::memory_order_acquire) & TIME_MASK;
+            // A bucket that would have refilled completely is the same as no bucket at all.  (If
+            // the slot gets reused before we clear it then the key no longer matches, and we
+            // leave it alone).
+            if (now > last && now - last >= fill_us)
+                s.key.compare_exchange_strong(key, 0, std::memory_order_acq_rel);
+        }
     }
 }
 
+size_t RateLimiter::memory_usage() const {
+    return (clients_.set_mask + 1 + snodes_.set_mask + 1) * WAYS * sizeof(slot);
+}
+
 }  // namespace oxenss::rpc
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <cstdint>
-#include <mutex>
-#include <unordered_map>
+#include <memory>
+#include <string>
+#include <string_view>
 
 #include <oxenss/crypto/keys.h>
 
@@ -15,44 +17,166 @@ class OxenMQ;
 
 namespace oxenss::rpc {
 
+/// Rate limits requests from clients (by IP address) and from service nodes (by pubkey).
+///
+/// Buckets live in fixed-size, set-associative tables of atomic slots, so that checking and
+/// updating a bucket is a handful of atomic operations (with a CAS to take a token) rather than a
+/// trip through a lock shared by every request-handling thread.  A new client takes over an
+/// unused slot of its set or, failing that, one whose bucket has refilled completely (and so
+/// carries no state worth keeping), or otherwise the least recently used one.
+///
+/// IPv6 clients are limited by /64 prefix, since a single host typically has a whole /64 to pick
+/// addresses from.
+///
+/// Client rates adapt to how loaded we are (see update_load): they get cut while we are falling
+/// behind, and raised (up to MAX_LOAD_SCALE times the configured rate) while we have capacity to
+/// spare.  Requests can also cost more than one token, so that expensive endpoints use up a
+/// client's allowance faster than cheap ones (see endpoint_cost).
 class RateLimiter {
   public:
-    // TODO: make those two constants command line parameters?
+    // Defaults for the bucket size (i.e. the burst allowed) and the tokens (requests) per second
     inline constexpr static uint32_t BUCKET_SIZE = 600;
-
-    // Tokens (requests) per second
     inline constexpr static uint32_t TOKEN_RATE = 300;  // Too much for a client??
     inline constexpr static uint32_t TOKEN_RATE_SN = 600;
+    // Default for the number of clients that we can track at once
     inline constexpr static uint32_t MAX_CLIENTS = 10000;
 
+    // The range that the client token rate gets scaled within as load changes
+    inline constexpr static double MIN_LOAD_SCALE = 0.125;
+    inline constexpr static double MAX_LOAD_SCALE = 2.0;
+    // How often update_load should be called
+    inline constexpr static auto LOAD_INTERVAL = std::chrono::seconds{1};
+    // Load levels at which we start cutting client rates: how long jobs wait for a worker thread,
+    // how long callbacks wait for an HTTPS event loop, and how many stores are waiting to be
+    // written to the database.
+    inline constexpr static auto QUEUE_DELAY_TARGET = std::chrono::milliseconds{100};
+    inline constexpr static auto LOOP_LAG_TARGET = std::chrono::milliseconds{50};
+    inline constexpr static size_t STORE_BACKLOG_TARGET = 5000;
+
+    struct config {
+        uint32_t bucket_size = BUCKET_SIZE;  // At most 65535
+        uint32_t token_rate = TOKEN_RATE;
+        uint32_t token_rate_sn = TOKEN_RATE_SN;
+        uint32_t max_clients = MAX_CLIENTS;
+        // If false then update_load does nothing and clients always get `token_rate`
+        bool adaptive = true;
+    };
+
+    // Measurements of how loaded we are, for update_load
+    struct load {
+        // Average time jobs wait for a worker thread (see AdmissionControl::queue_delay)
+        std::chrono::microseconds queue_delay{0};
+        // How far behind the HTTPS event loops are
+        std::chrono::microseconds loop_lag{0};
+        // Client stores waiting to be written to the database
+        size_t store_backlog = 0;
+    };
+
     RateLimiter() = delete;
-    RateLimiter(oxenmq::OxenMQ& omq);
+    explicit RateLimiter(oxenmq::OxenMQ& omq);
+    RateLimiter(oxenmq::OxenMQ& omq, config conf);
 
     bool should_rate_limit(
             const crypto::legacy_pubkey& pubkey,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+    // Takes the IPv4 address in host byte order.  `cost` is the number of tokens the request
+    // takes (see endpoint_cost).
     bool should_rate_limit_client(
             uint32_t ip,
-            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+            uint32_t cost = 1);
+
+    // Same as above, but takes an IPv6 address as 16 raw (network order) bytes.  IPv4-mapped
+    // addresses are treated as the IPv4 address.
+    bool should_rate_limit_client_ipv6(
+            std::string_view ip,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+            uint32_t cost = 1);
 
-    // Same as above, but takes a "a.b.c.d" string.  Returns false (i.e. don't rate limit) if
-    // the given address isn't parseable as an IPv4 address at all.
+    // Same as above, but takes an "a.b.c.d" or IPv6 (optionally [bracketed]) string.  Returns
+    // false (i.e. don't rate limit) if the given address isn't parseable as an IP address at all.
     bool should_rate_limit_client(
-            const std::string& ip_dotted_quad,
+            const std::string& ip,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+            uint32_t cost = 1);
+
+    // Onion requests are comparable to our most expensive endpoints: we have to decrypt them, and
+    // then either proxy them or process the request inside.
+    inline constexpr static uint32_t ONION_REQUEST_COST = 4;
+
+    // Returns the number of tokens a client request to the given endpoint should cost: more for
+    // requests that write to the database or that do more work, and 1 for everything else (such
+    // as `info`).
+    static uint32_t endpoint_cost(std::string_view endpoint);
+
+    // Adjusts the client token rate to the given load: if any of the measurements is above its
+    // target then the rate gets cut by a quarter; if they are all comfortably below (less than half
+    // of) their targets then the rate goes back up by an eighth of the configured rate.  Meant to
+    // be called every LOAD_INTERVAL.
+    void update_load(const load& l);
+
+    // The current multiplier applied to the configured client token rate
+    double load_scale() const {
+        return static_cast<double>(scale_.load(std::memory_order_relaxed)) / SCALE_ONE;
+    }
+
+    // The numbers of service node and client requests that were rate limited
+    uint64_t snode_limited() const { return snode_limited_; }
+    uint64_t client_limited() const { return client_limited_; }
+
+    // The memory used by the bucket tables, in bytes.  (This is fixed: the tables are allocated up
+    // front for `max_clients` clients.)
+    size_t memory_usage() const;
+
+    // Releases the slots of buckets that have refilled completely.  Called periodically.
+    void clean_buckets(
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
   private:
-    struct TokenBucket {
-        uint32_t num_tokens;
-        std::chrono::steady_clock::time_point last_time_point;
+    struct slot {
+        // The client or service node the slot is for; 0 if unused
+        std::atomic<uint64_t> key{0};
+        // The bucket: tokens in the top 16 bits, and the time of the last token taken (in
+        // microseconds since `epoch_`) in the rest.
+        std::atomic<uint64_t> state{0};
+    };
+    // Slots per set
+    static constexpr size_t WAYS = 8;
+
+    struct table {
+        std::unique_ptr<slot[]> slots;
+        size_t set_mask;
+        uint64_t token_period_us;
+        uint64_t fill_us;  // How long an empty bucket takes to fill up
+
+        table(size_t capacity, uint32_t token_rate, uint32_t bucket_size);
     };
 
-    std::mutex mutex_;
+    // Fixed point representation of 1.0 for scale_
+    static constexpr uint32_t SCALE_ONE = 256;
+
+    const config conf_;
+    std::atomic<uint32_t> scale_{SCALE_ONE};
+    const std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+    table clients_, snodes_;
+
+    std::atomic<uint64_t> snode_limited_ = 0, client_limited_ = 0;
+
+    // Takes `cost` tokens from `key`'s bucket (creating the bucket if needed), with the bucket
+    // refilling at `scale` (in SCALE_ONE units) times the table's token rate.  Returns false if
+    // the bucket doesn't have enough tokens, i.e. the request should be limited.
+    bool take_token(
+            table& t,
+            uint64_t key,
+            std::chrono::steady_clock::time_point now,
+            uint32_t cost,
+            uint32_t scale);
 
-    std::unordered_map<crypto::legacy_pubkey, TokenBucket> snode_buckets_;
-    std::unordered_map<uint32_t, TokenBucket> client_buckets_;
+    // Rate limits a client by its bucket key: the IPv4 address, or the /64 prefix of an IPv6
+    // address.
+    bool limit_client_key(uint64_t key, std::chrono::steady_clock::time_point now, uint32_t cost);
 
-    void clean_buckets(std::chrono::steady_clock::time_point now);
+    uint64_t micros(std::chrono::steady_clock::time_point t) const;
 };
 
 }  // namespace oxenss::rpc
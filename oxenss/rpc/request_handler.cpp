@@ -5,25 +5,28 @@
 #include <oxenss/server/omq.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/latency.hpp>
+#include <oxenss/utils/object_pool.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
 #include <oxenss/common/mainnet.h>
 #include <oxenss/common/format.h>
+#include <oxenss/crypto/blake2b.h>
 #include <oxenss/crypto/subaccount.h>
 #include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/signature_cache.h>
 
+#include <atomic>
 #include <chrono>
 #include <future>
 
-#include <cpr/cpr.h>
 #include <nlohmann/json.hpp>
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
 #include <sodium/crypto_core_ed25519.h>
-#include <sodium/crypto_generichash.h>
 #include <sodium/crypto_scalarmult_curve25519.h>
 #include <sodium/crypto_scalarmult_ed25519.h>
 #include <sodium/crypto_sign.h>
@@ -46,41 +49,42 @@ inline constexpr auto ONION_URL_TIMEOUT = 25s;
 std::string to_string(const Response& res) {
     std::stringstream ss;
 
-    const bool is_json = std::holds_alternative<json>(res.body);
+    const bool is_json =
+            std::holds_alternative<json>(res.body) || res.encoding == body_encoding::json;
     ss << "Status: " << res.status.first << " " << res.status.second
        << ", Content-Type: " << (is_json ? "application/json" : "text/plain") << ", Body: <"
-       << (is_json ? std::get<json>(res.body).dump() : view_body(res)) << ">";
+       << (std::holds_alternative<json>(res.body) ? std::get<json>(res.body).dump()
+                                                   : view_body(res))
+       << ">";
 
     return ss.str();
 }
 
 namespace {
-    json swarm_to_json(const std::optional<snode::SwarmInfo>& swarm) {
-        if (!swarm)
-            return json{
-                    {"snodes", json::array()},
-                    {"swarm", util::int_to_string(snode::INVALID_SWARM_ID, 16)},
-            };
-        json snodes_json = json::array();
-        for (const auto& sn : swarm->snodes) {
-            snodes_json.push_back(
-                    json{{"address",  // Deprecated, use pubkey_legacy instead
-                          oxenc::to_base32z(sn.pubkey_legacy.view()) + ".snode"},
-                         {"pubkey_legacy", sn.pubkey_legacy.hex()},
-                         {"pubkey_x25519", sn.pubkey_x25519.hex()},
-                         {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
-                         {"port",  // Deprecated string port for backwards compat; prefer https_port
-                          std::to_string(sn.port)},
-                         {"port_https", sn.port},
-                         {"port_omq", sn.omq_quic_port},
-                         {"port_quic", sn.omq_quic_port},
-                         {"ip", sn.ip}});
+    // Builds a swarm response body (i.e. the swarm id and its nodes, plus the usual "hf" and "t"
+    // fields) from the pre-encoded swarm, as json or bt to match the request.
+    Response swarm_response_body(
+            http::response_code status,
+            const snode::encoded_swarm& swarm,
+            snode::hf_revision hf,
+            bool json_req,
+            std::chrono::system_clock::time_point now = std::chrono::system_clock::now()) {
+        std::string out;
+        if (json_req) {
+            out.reserve(swarm.json.size() + 100);
+            R"({{"hf":[{},{}],"snodes":)"_format_to(out, hf.first, hf.second);
+            out += swarm.json;
+            R"(,"swarm":"{}","t":{}}})"_format_to(out, swarm.id_hex, to_epoch_ms(now));
+        } else {
+            out.reserve(swarm.bt.size() + 100);
+            "d2:hfli{}ei{}ee6:snodes"_format_to(out, hf.first, hf.second);
+            out += swarm.bt;
+            "5:swarm{}:{}1:ti{}ee"_format_to(
+                    out, swarm.id_hex.size(), swarm.id_hex, to_epoch_ms(now));
         }
-
-        return json{
-                {"snodes", std::move(snodes_json)},
-                {"swarm", util::int_to_string(swarm->swarm_id, 16)},
-        };
+        Response r{status, std::move(out)};
+        r.encoding = json_req ? body_encoding::json : body_encoding::bt;
+        return r;
     }
 
     void add_misc_response_fields(
@@ -110,6 +114,53 @@ namespace {
         return req;
     }
 
+    // Starts the trace span of a client request, if it is traced.  The span is shared so that it
+    // can be finished (by the callback from timed_reply) whenever the request gets its reply.
+    std::shared_ptr<util::trace::span> start_request_span(
+            RequestHandler& h, std::string_view name, const util::trace::context& parent = {}) {
+        auto span = h.start_span(name, parent);
+        if (!span)
+            return nullptr;
+        return std::make_shared<util::trace::span>(std::move(span));
+    }
+
+    // Returns the trace context of a swarm peer's span that it included in a (bt-encoded)
+    // forwarded request, if the request is traced.
+    util::trace::context forwarded_trace(std::string_view params) {
+        try {
+            oxenc::bt_dict_consumer d{params};
+            if (d.skip_until("traceparent"))
+                return util::trace::context::parse(d.consume_string_view());
+        } catch (const std::exception&) {
+            // Invalid requests get rejected when loading them
+        }
+        return {};
+    }
+
+    // Wraps the callback of a top-level client request to record the request's total time (from
+    // when it was queued, if known).  The callback is invoked inside a scope of the endpoint so
+    // that serializing the response gets attributed to it, even when replying from another thread.
+    // The request's trace span, if any, is finished once the reply has been sent.
+    response_callback timed_reply(
+            util::endpoint_latency& lat,
+            const util::request_scope& scope,
+            std::shared_ptr<util::trace::span> span,
+            response_callback cb) {
+        return [&lat, started = scope.started(), span = std::move(span), cb = std::move(cb)](
+                       Response r) {
+            auto status = r.status.first;
+            {
+                util::request_scope reply{&lat};
+                cb(std::move(r));
+            }
+            lat.record(util::latency_stage::total, std::chrono::steady_clock::now() - started);
+            if (span) {
+                span->tag("http.status_code", std::to_string(status));
+                span->end();
+            }
+        };
+    }
+
     template <typename RPC>
     void register_client_rpc_endpoint(RequestHandler::rpc_map& regs) {
         RequestHandler::rpc_handler calls;
@@ -118,28 +169,51 @@ namespace {
                     [](auto&& params) { return load_request<RPC>(std::move(params)); },
                     std::move(params));
         };
-        calls.http_json = [](RequestHandler& h, json params, std::function<void(Response)> cb) {
-            auto req = load_request<RPC>(std::move(params));
-            h.process_client_req(std::move(req), std::move(cb));
+        calls.http_json = [](RequestHandler& h, json params, response_callback& cb) {
+            auto& lat = h.latency(RPC::names()[0]);
+            util::request_scope scope{&lat};
+            auto span = start_request_span(h, RPC::names()[0]);
+            util::trace::scope trace{span.get()};
+            RPC req;
+            {
+                util::stage_timer timer{util::latency_stage::parse};
+                req = load_request<RPC>(std::move(params));
+            }
+            h.process_client_req(
+                    std::move(req), timed_reply(lat, scope, std::move(span), std::move(cb)));
         };
         calls.mq = [](rpc::RequestHandler& h,
                       std::string_view params,
                       [[maybe_unused]] bool forwarded,
-                      std::function<void(rpc::Response)> cb) {
+                      bool trust_trace,
+                      response_callback cb) {
+            auto& lat = h.latency(RPC::names()[0]);
+            util::request_scope scope{&lat};
             RPC req;
             if (params.empty())
                 params = "{}"sv;
-            if (params.front() == 'd') {
-                req.load_from(oxenc::bt_dict_consumer{params});
-                req.b64 = false;
-            } else {
-                auto body = nlohmann::json::parse(params, nullptr, false);
-                if (body.is_discarded()) {
-                    log::debug(logcat, "Bad OMQ client request: not valid json or bt_dict");
-                    return cb(rpc::Response{
-                            http::BAD_REQUEST, "invalid body: expected json or bt_dict"sv});
+            auto span = start_request_span(
+                    h,
+                    RPC::names()[0],
+                    forwarded && trust_trace && params.front() == 'd' ? forwarded_trace(params)
+                                                                      : util::trace::context{});
+            util::trace::scope trace{span.get()};
+            if (span && forwarded)
+                span->tag("forwarded", "true");
+            {
+                util::stage_timer timer{util::latency_stage::parse};
+                if (params.front() == 'd') {
+                    req.load_from(oxenc::bt_dict_consumer{params});
+                    req.b64 = false;
+                } else {
+                    auto body = nlohmann::json::parse(params, nullptr, false);
+                    if (body.is_discarded()) {
+                        log::debug(logcat, "Bad OMQ client request: not valid json or bt_dict");
+                        return cb(rpc::Response{
+                                http::BAD_REQUEST, "invalid body: expected json or bt_dict"sv});
+                    }
+                    req.load_from(std::move(body));
                 }
-                req.load_from(std::move(body));
             }
             if constexpr (std::is_base_of_v<rpc::recursive, RPC>) {
                 req.recurse = !forwarded;
@@ -149,7 +223,8 @@ namespace {
                         "invalid request: received invalid forwarded non-forwardable request"sv});
             }
 
-            h.process_client_req(std::move(req), std::move(cb));
+            h.process_client_req(
+                    std::move(req), timed_reply(lat, scope, std::move(span), std::move(cb)));
         };
 
         for (auto& name : RPC::names()) {
@@ -279,6 +354,7 @@ namespace {
             bool skip_revoke_check,
             const std::array<unsigned char, 64>& sig,
             const T&... val) {
+        util::stage_timer timer{util::latency_stage::auth};
         std::string data = concatenate_sig_message_parts(val...);
 
         const auto& raw = pubkey.raw();
@@ -317,11 +393,9 @@ namespace {
             pk = subaccount->token.pubkey().data();
         }
 
-        bool verified = 0 == crypto_sign_verify_detached(
-                                     sig.data(),
-                                     reinterpret_cast<const unsigned char*>(data.data()),
-                                     data.size(),
-                                     pk);
+        // Clients repeat identical signed requests (e.g. retrieve polls) within the signature
+        // tolerance window, so this is often answered from the cache.
+        bool verified = crypto::verify_signature_cached(sig.data(), data, pk);
         if (!verified)
             log::debug(logcat, "Signature verification failed");
         return verified;
@@ -346,51 +420,95 @@ namespace {
 const RequestHandler::rpc_map RequestHandler::client_rpc_endpoints =
         register_client_rpc_endpoints(rpc::client_rpc_types{});
 
-std::string compute_hash_blake2b_b64(std::vector<std::string_view> parts) {
-    constexpr size_t HASH_SIZE = 32;
-    crypto_generichash_state state;
-    crypto_generichash_init(&state, nullptr, 0, HASH_SIZE);
+namespace {
+
+    // Base64-encodes a message hash (without padding)
+    std::string hash_to_b64(const crypto::hash32& hash) {
+        std::string b64hash = oxenc::to_base64(hash.begin(), hash.end());
+        // Trim padding:
+        while (!b64hash.empty() && b64hash.back() == '=')
+            b64hash.pop_back();
+        return b64hash;
+    }
+
+    // The pieces of a message's hash input; `buf` holds the network id and the namespace string
+    crypto::blake2b_pieces message_hash_pieces(
+            const user_pubkey& pubkey,
+            namespace_id ns,
+            std::string_view data,
+            std::array<char, 21>& buf) {
+        buf[0] = static_cast<char>(pubkey.type());
+        char* ns_buf_ptr = buf.data() + 1;
+        std::string_view ns_for_hash =
+                ns != namespace_id::Default ? detail::to_hashable(to_int(ns), ns_buf_ptr) : ""sv;
+        return {std::string_view{buf.data(), 1}, pubkey.raw(), ns_for_hash, data};
+    }
+
+}  // namespace
+
+std::string compute_hash_blake2b_b64(std::initializer_list<std::string_view> parts) {
+    crypto::blake2b_hasher hasher;
     for (const auto& s : parts)
-        crypto_generichash_update(
-                &state, reinterpret_cast<const unsigned char*>(s.data()), s.size());
-    std::array<unsigned char, HASH_SIZE> hash;
-    crypto_generichash_final(&state, hash.data(), HASH_SIZE);
-
-    std::string b64hash = oxenc::to_base64(hash.begin(), hash.end());
-    // Trim padding:
-    while (!b64hash.empty() && b64hash.back() == '=')
-        b64hash.pop_back();
-    return b64hash;
+        hasher.update(s);
+    return hash_to_b64(hasher.finalize());
 }
 
 std::string computeMessageHash(const user_pubkey& pubkey, namespace_id ns, std::string_view data) {
-    char netid = static_cast<char>(pubkey.type());
-    std::array<char, 20> ns_buf;
-    char* ns_buf_ptr = ns_buf.data();
-    std::string_view ns_for_hash =
-            ns != namespace_id::Default ? detail::to_hashable(to_int(ns), ns_buf_ptr) : ""sv;
-    return compute_hash(
-            compute_hash_blake2b_b64, std::string_view{&netid, 1}, pubkey.raw(), ns_for_hash, data);
+    std::array<char, 21> buf;
+    crypto::blake2b_hasher hasher;
+    for (auto& piece : message_hash_pieces(pubkey, ns, data, buf))
+        hasher.update(piece);
+    return hash_to_b64(hasher.finalize());
+}
+
+std::vector<std::string> computeMessageHashes(const std::vector<const rpc::store*>& stores) {
+    std::vector<std::array<char, 21>> bufs(stores.size());
+    std::vector<crypto::blake2b_pieces> inputs;
+    inputs.reserve(stores.size());
+    for (size_t i = 0; i < stores.size(); i++) {
+        auto& s = *stores[i];
+        inputs.push_back(message_hash_pieces(s.pubkey, s.msg_namespace, s.data, bufs[i]));
+    }
+    std::vector<std::string> hashes;
+    hashes.reserve(stores.size());
+    for (auto& h : crypto::blake2b_batch(inputs))
+        hashes.push_back(hash_to_b64(h));
+    return hashes;
 }
 
 RequestHandler::RequestHandler(
-        snode::ServiceNode& sn, const crypto::ChannelEncryption& ce, crypto::ed25519_seckey edsk) :
-        service_node_{sn}, channel_cipher_(ce), ed25519_sk_{std::move(edsk)} {
-    // Periodically clean up any proxy request futures
+        snode::ServiceNode& sn,
+        const crypto::ChannelEncryption& ce,
+        crypto::ed25519_seckey edsk,
+        size_t crypto_threads,
+        std::function<void(size_t)> crypto_init) :
+        service_node_{sn},
+        channel_cipher_(ce),
+        ed25519_sk_{std::move(edsk)},
+        proxy_client_{ONION_URL_TIMEOUT},
+        crypto_pool_{
+                crypto_threads, crypto::CryptoPool::DEFAULT_MAX_QUEUE, std::move(crypto_init)} {
+    // Periodically clean up finished proxy requests and idle proxy connections
+    service_node_.omq_server()->add_timer([this] { proxy_client_.cleanup(); }, 1s);
+
+    service_node_.set_new_message_callback(
+            [this](const message& m) { wake_waiting_retrieves(m.pubkey, m.msg_namespace); });
     service_node_.omq_server()->add_timer(
-            [this] {
-                pending_proxy_requests_.remove_if(
-                        [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
-            },
-            1s);
+            [this] { expire_waiting_retrieves(); }, RETRIEVE_WAIT_CHECK_INTERVAL);
+}
+
+void RequestHandler::db_job(std::function<void()> job) {
+    service_node_.omq_server().db_job(std::move(job));
 }
 
-Response RequestHandler::handle_wrong_swarm(const user_pubkey& pubKey) {
+Response RequestHandler::handle_wrong_swarm(const user_pubkey& pubKey, bool b64) {
     log::trace(logcat, "Got client request to a wrong swarm");
 
-    json swarm = swarm_to_json(service_node_.get_swarm(pubKey));
-    add_misc_response_fields(swarm, service_node_);
-    return {http::MISDIRECTED_REQUEST, std::move(swarm)};
+    return swarm_response_body(
+            http::MISDIRECTED_REQUEST,
+            *service_node_.get_encoded_swarm(pubKey),
+            service_node_.hf(),
+            b64);
 }
 
 struct swarm_response {
@@ -398,12 +516,61 @@ struct swarm_response {
     int pending;
     bool b64;
     nlohmann::json result;
-    std::function<void(rpc::Response)> cb;
+    // Successful peer responses for bt-encoded requests, as {ed25519 hex, bt-encoded dict} pairs.
+    // We splice these into the reply as-is rather than round-tripping them through json.
+    std::vector<std::pair<std::string, std::string>> peer_bt;
+    response_callback cb;
+    // For recording how long it takes our peers to respond
+    util::endpoint_latency* latency = nullptr;
+    std::chrono::steady_clock::time_point distributed;
+    int peer_count = 0, peers_pending = 0;
+    // Quorum mode (see RequestHandler::set_swarm_quorum): the number of peer results, besides our
+    // own result, that we reply as soon as we have; 0 to wait for all of them.  `waiting` holds
+    // the ed25519 hex of the peers we haven't heard back from.
+    int quorum = 0;
+    bool have_local = false;
+    bool replied = false;
+    std::unordered_set<std::string> waiting;
+    // Callbacks of duplicate requests that joined this one while it was in flight (see
+    // RequestHandler::join_inflight_store); they get copies of the reply.
+    std::vector<response_callback> joined_cbs;
+    // If set, called (with `mutex` held) once we have replied
+    std::function<void()> on_replied;
 };
 
+// Builds the bt-encoded response to a recursive swarm request: this is just what bt-encoding
+// `res.result` would produce, except that the raw peer responses in `res.peer_bt` get merged into
+// the "swarm" dict without needing to be decoded.
+static std::string serialize_swarm_response(swarm_response& res) {
+    std::sort(res.peer_bt.begin(), res.peer_bt.end());
+    std::string out{"d"};
+    // nlohmann::json keeps object keys sorted, so we can just write them out in order
+    for (auto& [key, val] : res.result.items()) {
+        out += oxenc::bt_serialize(key);
+        if (key != "swarm") {
+            bt_serialize_json(val, out);
+            continue;
+        }
+        out += 'd';
+        auto raw = res.peer_bt.begin();
+        for (auto& [hex, peer] : val.items()) {
+            for (; raw != res.peer_bt.end() && raw->first < hex; ++raw)
+                out.append(oxenc::bt_serialize(raw->first)).append(raw->second);
+            out += oxenc::bt_serialize(hex);
+            bt_serialize_json(peer, out);
+        }
+        for (; raw != res.peer_bt.end(); ++raw)
+            out.append(oxenc::bt_serialize(raw->first)).append(raw->second);
+        out += 'e';
+    }
+    out += 'e';
+    return out;
+}
+
 // Replies to a recursive swarm request via its callback; sends an http::OK unless all of the
 // swarm entries returned things with "failed" in them, in which case we send back an
-// INTERNAL_SERVER_ERROR along with the response.
+// INTERNAL_SERVER_ERROR along with the response.  The reply is json for json requests, and
+// pre-serialized bt for bt-encoded requests.
 void reply_or_fail(const std::shared_ptr<swarm_response>& res) {
     auto res_code = http::INTERNAL_SERVER_ERROR;
     for (const auto& [snode, reply] : res->result.items()) {
@@ -412,7 +579,43 @@ void reply_or_fail(const std::shared_ptr<swarm_response>& res) {
             break;
         }
     }
-    res->cb(Response{res_code, std::move(res->result)});
+
+    Response r;
+    if (res->b64) {
+        r = Response{res_code, std::move(res->result)};
+    } else {
+        r = Response{res_code, serialize_swarm_response(*res)};
+        r.encoding = body_encoding::bt;
+    }
+    for (auto& cb : res->joined_cbs)
+        cb(Response{r});
+    res->cb(std::move(r));
+}
+
+// Called, with `res->mutex` held, as each result of a recursive request (`local` for our own,
+// otherwise a peer's) has been added to the response: replies, once all are in or, in quorum mode,
+// once we have our own result and a quorum of peer results.  Peers still outstanding when replying
+// early get marked as pending in the reply.
+static void result_arrived(
+        snode::ServiceNode& sn, const std::shared_ptr<swarm_response>& res, bool local) {
+    --res->pending;
+    if (local)
+        res->have_local = true;
+    if (res->replied)
+        return;
+    int answered = res->peer_count - res->peers_pending;
+    bool quorum = res->quorum > 0 && res->have_local && answered >= res->quorum;
+    if (res->pending > 0 && !quorum)
+        return;
+    res->replied = true;
+    if (res->pending > 0) {
+        sn.record_quorum_reply();
+        for (auto& hex : res->waiting)
+            res->result["swarm"][hex] = json{{"pending", true}};
+    }
+    reply_or_fail(res);
+    if (res->on_replied)
+        res->on_replied();
 }
 
 static void distribute_command(
@@ -422,12 +625,38 @@ static void distribute_command(
         const rpc::recursive& req) {
     auto peers = sn.get_swarm_peers();
     res->pending += peers.size();
-
+    res->peer_count = res->peers_pending = peers.size();
+    if (peers.empty())
+        return;
+    if (res->quorum > 0)
+        for (auto& peer : peers)
+            res->waiting.insert(peer.pubkey_ed25519.hex());
+    res->latency = &sn.latency(cmd);
+    res->distributed = std::chrono::steady_clock::now();
+
+    auto bt = req.to_bt();
+    auto body = bt_serialize(bt);
     for (auto& peer : peers) {
-        sn.omq_server()->request(
-                peer.pubkey_x25519.view(),
-                "sn.storage_cc",
-                [res, peer, cmd](bool success, auto parts) {
+        // When traced, each peer gets the request with the context of its own span added, so
+        // that the spans of its handling of the request become children of it.
+        std::shared_ptr<util::trace::span> span;
+        std::string peer_body;
+        if (util::trace::span s{"forward"}; s) {
+            s.tag("peer", peer.pubkey_ed25519.hex());
+            auto traced = bt;
+            var::get<oxenc::bt_dict>(traced)["traceparent"] = s.ctx().traceparent();
+            peer_body = bt_serialize(traced);
+            span = std::make_shared<util::trace::span>(std::move(s));
+        }
+        sn.forward_to_peer(
+                peer,
+                std::string{cmd},
+                span ? std::move(peer_body) : body,
+                [&sn, res, peer, cmd, span](bool success, std::vector<std::string> parts) {
+                    if (span) {
+                        span->tag("success", success ? "true" : "false");
+                        span->end();
+                    }
                     json peer_result;
                     if (!success)
                         log::warning(
@@ -438,7 +667,14 @@ static void distribute_command(
                     bool good_result = success && parts.size() == 1;
                     if (good_result) {
                         try {
-                            peer_result = bt_to_json(oxenc::bt_dict_consumer{parts[0]});
+                            oxenc::bt_dict_consumer d{parts[0]};
+                            if (res->b64)
+                                peer_result = bt_to_json(std::move(d));
+                            else
+                                // The raw response gets passed through to the client, so we just
+                                // need to make sure it is well-formed.
+                                while (!d.is_finished())
+                                    d.skip_value();
                         } catch (const std::exception& e) {
                             log::warning(
                                     logcat,
@@ -452,8 +688,23 @@ static void distribute_command(
 
                     std::lock_guard lock{res->mutex};
 
-                    // If we're the last response then we reply:
-                    bool send_reply = --res->pending == 0;
+                    if (--res->peers_pending == 0)
+                        res->latency->record(
+                                util::latency_stage::swarm,
+                                std::chrono::steady_clock::now() - res->distributed);
+                    res->waiting.erase(peer.pubkey_ed25519.hex());
+                    if (res->replied) {
+                        // We already replied on reaching a quorum, so this is too late to include
+                        log::debug(
+                                logcat,
+                                "Late {} result from {} ({})",
+                                cmd,
+                                peer.pubkey_legacy,
+                                good_result ? "ok" : "failed");
+                        sn.record_late_peer_result();
+                        --res->pending;
+                        return;
+                    }
 
                     if (!good_result) {
                         peer_result = json{{"failed", true}};
@@ -464,30 +715,29 @@ static void distribute_command(
                             peer_result["reason"] = parts[1];
                         } else
                             peer_result["bad_peer_response"] = true;
-                    } else if (res->b64) {
-                        if (auto it = peer_result.find("signature");
-                            it != peer_result.end() && it->is_string())
-                            *it = oxenc::to_base64(it->get_ref<const std::string&>());
+                    } else if (!res->b64) {
+                        res->peer_bt.emplace_back(peer.pubkey_ed25519.hex(), std::move(parts[0]));
+                    } else if (auto it = peer_result.find("signature");
+                               it != peer_result.end() && it->is_string()) {
+                        *it = oxenc::to_base64(it->get_ref<const std::string&>());
                     }
 
-                    res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
+                    if (!peer_result.is_null())
+                        res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
 
-                    if (send_reply)
-                        reply_or_fail(res);
-                },
-                cmd,
-                bt_serialize(req.to_bt()),
-                oxenmq::send_option::request_timeout{5s});
+                    result_arrived(sn, res, false);
+                });
     }
 }
 
 template <typename RPC, typename = std::enable_if_t<std::is_base_of_v<rpc::recursive, RPC>>>
 std::pair<std::shared_ptr<swarm_response>, std::unique_lock<std::mutex>> static setup_recursive_request(
-        snode::ServiceNode& sn, RPC& req, std::function<void(Response)> cb) {
-    auto res = std::make_shared<swarm_response>();
+        snode::ServiceNode& sn, RPC& req, response_callback cb, int quorum) {
+    auto res = util::make_pooled<swarm_response>();
     res->cb = std::move(cb);
     res->pending = 1;
     res->b64 = req.b64;
+    res->quorum = quorum;
 
     std::unique_lock<std::mutex> lock{res->mutex, std::defer_lock};
     if (req.recurse) {
@@ -498,13 +748,18 @@ std::pair<std::shared_ptr<swarm_response>, std::unique_lock<std::mutex>> static
     return {std::move(res), std::move(lock)};
 }
 
-void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::store&& req, response_callback cb) {
+    process_client_req(std::move(req), std::move(cb), ""s);
+}
+
+void RequestHandler::process_client_req(
+        rpc::store&& req, response_callback cb, std::string message_hash) {
 #ifndef NDEBUG
     log::trace(logcat, "Storing message: {}", oxenc::to_base64(req.data));
 #endif
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     using namespace std::chrono;
     bool public_in = is_public_inbox_namespace(req.msg_namespace);
@@ -561,136 +816,274 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
 
     bool entry_router = req.recurse == true;
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
-    auto& mine = req.recurse
-                       ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
-                       : res->result;
+    // Refuse stores that our quotas would reject before sending them all over the swarm.  (Our
+    // peers have their own quotas, and store() checks ours again regardless.)
+    if (entry_router &&
+        !service_node_.get_db().within_quota(req.pubkey, req.msg_namespace, req.data.size())) {
+        log::debug(logcat, "store: quota exceeded for {}", obfuscate_pubkey(req.pubkey));
+        return cb(Response{http::INSUFFICIENT_STORAGE, "store: quota exceeded"sv});
+    }
 
-    std::string message_hash = computeMessageHash(req.pubkey, req.msg_namespace, req.data);
+    if (message_hash.empty())
+        message_hash = computeMessageHash(req.pubkey, req.msg_namespace, req.data);
 
-    bool new_msg;
-    std::chrono::system_clock::time_point expiry;
-    bool success = false;
-    try {
-        success = service_node_.process_store(
-                message{req.pubkey,
-                        message_hash,
-                        req.msg_namespace,
-                        req.timestamp,
-                        req.expiry,
-                        std::move(req.data)},
-                &new_msg,
-                &expiry);
-    } catch (const std::exception& e) {
-        log::error(
-                logcat,
-                "Internal Server Error. Could not store message for {}: {}",
-                obfuscate_pubkey(req.pubkey),
-                e.what());
-        mine["reason"] = e.what();
-    }
-    if (success) {
-        mine["hash"] = message_hash;
-        auto sig = create_signature(ed25519_sk_, message_hash);
-        mine["signature"] =
-                req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
-        if (!new_msg)
-            mine["already"] = true;
-        mine["expiry"] = to_epoch_ms(expiry);
-
-        if (entry_router)
-            // Backwards compat: put the hash at top level, too.  TODO: remove eventually
-            res->result["hash"] = message_hash;
-    } else {
-        mine["failed"] = true;
-        mine["query_failure"] = true;
+    // Clients retrying a store often send it again while we are still waiting on the swarm for the
+    // first copy; rather than storing and distributing it all over again, the retry just gets the
+    // same reply as the first copy.
+    std::string inflight_key;
+    if (entry_router) {
+        inflight_key = fmt::format(
+                "{}/{}/{}", message_hash, to_epoch_ms(req.expiry), req.b64 ? "json" : "bt");
+        if (join_inflight_store(inflight_key, cb)) {
+            log::debug(logcat, "Duplicate store of {} joined the one in flight", message_hash);
+            service_node_.record_coalesced_store();
+            return;
+        }
     }
+
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
+    if (entry_router)
+        res->on_replied = [this, inflight_key, r = res.get()] {
+            end_inflight_store(inflight_key, r);
+        };
+    // The store result comes back via callback, possibly on this thread, so we can't hold the lock
+    // across the store call; the callback re-locks to record our result.
+    if (lock.owns_lock())
+        lock.unlock();
     if (entry_router) {
-        // Deprecated: we accidentally set this one inside the entry router's "swarm" instead of in
-        // the outer response, so keep it here for now in case something is relying on that:
-        mine["t"] = to_epoch_ms(now);
+        std::lock_guard guard{inflight_mutex_};
+        inflight_stores_[inflight_key] = res;
+    }
+    auto pubkey = req.pubkey;
+    auto ns = req.msg_namespace;
+
+    auto on_stored = [this, res = res, message_hash, entry_router, now, pubkey, ns](
+                             std::optional<StoreResult> result,
+                             std::chrono::system_clock::time_point expiry,
+                             std::string_view error) {
+        std::lock_guard lock{res->mutex};
+        auto& mine = entry_router
+                           ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
+                           : res->result;
+
+        if (!result)
+            mine["reason"] = error;
+        else if (*result == StoreResult::OverQuota)
+            mine["reason"] = "quota exceeded";
+
+        if (result && *result != StoreResult::Full && *result != StoreResult::OverQuota) {
+            mine["hash"] = message_hash;
+            auto sig = create_signature(ed25519_sk_, message_hash);
+            mine["signature"] =
+                    res->b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
+            if (*result != StoreResult::New)
+                mine["already"] = true;
+            mine["expiry"] = to_epoch_ms(expiry);
+
+            if (entry_router)
+                // Backwards compat: put the hash at top level, too.  TODO: remove eventually
+                res->result["hash"] = message_hash;
+
+            log::trace(
+                    logcat,
+                    "Successfully stored message {}{} for {}",
+                    message_hash,
+                    ns != namespace_id::Default ? fmt::format("[{}]", to_int(ns)) : "",
+                    obfuscate_pubkey(pubkey));
+        } else {
+            mine["failed"] = true;
+            if (result && *result == StoreResult::OverQuota)
+                mine["over_quota"] = true;
+            else
+                mine["query_failure"] = true;
+        }
+        if (entry_router) {
+            // Deprecated: we accidentally set this one inside the entry router's "swarm" instead of
+            // in the outer response, so keep it here for now in case something is relying on that:
+            mine["t"] = to_epoch_ms(now);
 
-        add_misc_response_fields(res->result, service_node_, now);
+            add_misc_response_fields(res->result, service_node_, now);
+        }
+
+        result_arrived(service_node_, res, true);
+    };
+
+    service_node_.process_store(
+            message{req.pubkey,
+                    std::move(message_hash),
+                    req.msg_namespace,
+                    req.timestamp,
+                    req.expiry,
+                    std::move(req.data)},
+            std::move(on_stored));
+}
+
+bool RequestHandler::join_inflight_store(const std::string& key, response_callback& cb) {
+    std::shared_ptr<swarm_response> res;
+    {
+        std::lock_guard lock{inflight_mutex_};
+        if (auto it = inflight_stores_.find(key); it != inflight_stores_.end())
+            res = it->second.lock();
     }
+    if (!res)
+        return false;
+    // (Not holding inflight_mutex_ here: end_inflight_store gets called with res->mutex held)
+    std::lock_guard lock{res->mutex};
+    if (res->replied)
+        return false;
+    res->joined_cbs.push_back(std::move(cb));
+    return true;
+}
 
-    log::trace(
-            logcat,
-            "Successfully stored message {}{} for {}",
-            message_hash,
-            req.msg_namespace != namespace_id::Default
-                    ? fmt::format("[{}]", to_int(req.msg_namespace))
-                    : "",
-            obfuscate_pubkey(req.pubkey));
-
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+void RequestHandler::end_inflight_store(const std::string& key, const swarm_response* res) {
+    std::lock_guard lock{inflight_mutex_};
+    if (auto it = inflight_stores_.find(key);
+        it != inflight_stores_.end() && it->second.lock().get() == res)
+        inflight_stores_.erase(it);
 }
 
-void RequestHandler::process_client_req(
-        rpc::oxend_request&& req, std::function<void(rpc::Response)> cb) {
+static Response oxend_result_response(const json& result, snode::ServiceNode& sn) {
+    json res{{"result", result}};
+    add_misc_response_fields(res, sn);
+    return {http::OK, std::move(res)};
+}
+
+OxendCache::lookup OxendCache::start(
+        const std::string& key, response_callback& cb, std::chrono::steady_clock::time_point now) {
+    lookup l;
+    std::lock_guard lock{mutex_};
+    if (auto it = cache_.find(key); it != cache_.end()) {
+        if (now < it->second.expiry) {
+            l.cached = it->second.result;
+            return l;
+        }
+        cache_.erase(it);
+    }
+    auto [it, first] = waiting_.try_emplace(key);
+    it->second.push_back(std::move(cb));
+    l.call = first;
+    l.gen = gen_;
+    return l;
+}
+
+std::vector<response_callback> OxendCache::finish(
+        const std::string& key,
+        uint64_t gen,
+        result_ptr result,
+        std::chrono::steady_clock::time_point now) {
+    std::vector<response_callback> cbs;
+    std::lock_guard lock{mutex_};
+    if (auto it = waiting_.find(key); it != waiting_.end()) {
+        cbs = std::move(it->second);
+        waiting_.erase(it);
+    }
+    // Results are only cached if no new block arrived while we were waiting
+    if (result && gen == gen_ && ttl_.count() > 0) {
+        if (cache_.size() >= OXEND_CACHE_MAX)
+            for (auto c = cache_.begin(); c != cache_.end();)
+                c = c->second.expiry <= now ? cache_.erase(c) : std::next(c);
+        if (cache_.size() >= OXEND_CACHE_MAX)
+            cache_.clear();
+        cache_[key] = {std::move(result), now + ttl_};
+    }
+    return cbs;
+}
+
+void OxendCache::clear() {
+    std::lock_guard lock{mutex_};
+    cache_.clear();
+    gen_++;
+}
+
+void OxendCache::ttl(std::chrono::milliseconds ttl) {
+    std::lock_guard lock{mutex_};
+    ttl_ = ttl;
+}
+
+size_t OxendCache::size() const {
+    std::lock_guard lock{mutex_};
+    return cache_.size();
+}
+
+void RequestHandler::process_client_req(rpc::oxend_request&& req, response_callback cb) {
     std::optional<std::string> oxend_params;
     if (req.params)
         oxend_params = req.params->dump();
 
+    std::string key = req.endpoint;
+    if (oxend_params)
+        key.append(1, '\0').append(*oxend_params);
+
+    auto lookup = oxend_cache_.start(key, cb);
+    if (lookup.cached) {
+        service_node_.record_oxend_cache_hit();
+        return cb(oxend_result_response(*lookup.cached, service_node_));
+    }
+    if (!lookup.call) {
+        service_node_.record_oxend_coalesced();
+        return;
+    }
+
     service_node_.omq_server().oxend_request(
             "rpc." + req.endpoint,
-            [cb = std::move(cb), this](bool success, auto&& data) {
-                std::string err;
+            [this, key = std::move(key), gen = lookup.gen](bool success, auto&& data) {
+                std::shared_ptr<const json> result;
+                Response err;
                 // Currently we only support json endpoints; if we want to support non-json
                 // endpoints (which end in ".bin") at some point in the future then we'll need to
                 // return those endpoint results differently here.
                 if (success && data.size() >= 2 && data[0] == "200") {
-                    json result = json::parse(data[1], nullptr, false);
-                    if (result.is_discarded()) {
+                    json r = json::parse(data[1], nullptr, false);
+                    if (r.is_discarded()) {
                         log::warning(
                                 logcat,
                                 "Invalid oxend response to client request: result is not valid "
                                 "json");
-                        return cb({http::BAD_GATEWAY, "oxend returned unparsable data"s});
+                        err = {http::BAD_GATEWAY, "oxend returned unparsable data"s};
+                    } else {
+                        result = std::make_shared<const json>(std::move(r));
                     }
-                    json res{{"result", std::move(result)}};
-                    add_misc_response_fields(res, service_node_);
+                } else {
+                    err = {http::BAD_REQUEST,
+                           data.size() >= 2 && !data[1].empty() ? std::move(data[1])
+                                                                : "Unknown oxend error"s};
+                }
 
-                    return cb({http::OK, std::move(res)});
+                auto cbs = oxend_cache_.finish(key, gen, result);
+                for (size_t i = 0; i < cbs.size(); i++) {
+                    if (result)
+                        cbs[i](oxend_result_response(*result, service_node_));
+                    else
+                        cbs[i](i + 1 < cbs.size() ? Response{err} : std::move(err));
                 }
-                return cb(
-                        {http::BAD_REQUEST,
-                         data.size() >= 2 && !data[1].empty() ? std::move(data[1])
-                                                              : "Unknown oxend error"s});
             },
             oxend_params);
 }
 
-void RequestHandler::process_client_req(
-        rpc::get_swarm&& req, std::function<void(rpc::Response)> cb) {
-    const auto swarm = service_node_.get_swarm(req.pubkey);
+void RequestHandler::process_client_req(rpc::get_swarm&& req, response_callback cb) {
+    const auto swarm = service_node_.get_encoded_swarm(req.pubkey);
 
     log::debug(
             logcat,
             "get swarm for {}, swarm size: {}",
             obfuscate_pubkey(req.pubkey),
-            swarm ? swarm->snodes.size() : 0);
-
-    auto body = swarm_to_json(swarm);
-    add_misc_response_fields(body, service_node_);
+            swarm->size);
 
 #ifndef NDEBUG
-    log::trace(logcat, "swarm details for pk {}: {}", obfuscate_pubkey(req.pubkey), body.dump());
+    log::trace(logcat, "swarm details for pk {}: {}", obfuscate_pubkey(req.pubkey), swarm->json);
 #endif
 
-    cb(Response{http::OK, std::move(body)});
+    cb(swarm_response_body(http::OK, *swarm, service_node_.hf(), req.b64));
 }
 
-void RequestHandler::process_client_req(
-        rpc::retrieve&& req, std::function<void(rpc::Response)> cb) {
+std::optional<Response> RequestHandler::check_retrieve(
+        rpc::retrieve& req, system_clock::time_point now) {
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
-
-    auto now = system_clock::now();
+        return handle_wrong_swarm(req.pubkey, req.b64);
 
     if (!is_noauth_retrieve_namespace(req.msg_namespace) && !req.check_signature) {
         log::debug(logcat, "retrieve: request signature required");
-        return cb(Response{http::UNAUTHORIZED, "retrieve: request signature required"sv});
+        return Response{http::UNAUTHORIZED, "retrieve: request signature required"sv};
     }
 
     if (req.check_signature) {
@@ -700,8 +1093,8 @@ void RequestHandler::process_client_req(
                     logcat,
                     "retrieve: invalid timestamp ({}s from now)",
                     duration_cast<seconds>(req.timestamp - now).count());
-            return cb(Response{
-                    http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv});
+            return Response{
+                    http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv};
         }
 
         if (!verify_signature(
@@ -718,7 +1111,7 @@ void RequestHandler::process_client_req(
                             : ""s,
                     req.timestamp)) {
             log::debug(logcat, "retrieve: signature verification failed");
-            return cb(Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv});
+            return Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv};
         }
     }
 
@@ -739,43 +1132,252 @@ void RequestHandler::process_client_req(
     } else if (!req.max_size || *req.max_size > RETRIEVE_MAX_SIZE)
         req.max_size = RETRIEVE_MAX_SIZE;
 
-    std::vector<message> msgs;
-    bool more = false;
+    return std::nullopt;
+}
+
+// Returns true if `s` can be written into a json string as-is, without any escaping.
+static bool json_safe(std::string_view s) {
+    return std::all_of(s.begin(), s.end(), [](char c) {
+        return c >= 0x20 && c < 0x7f && c != '"' && c != '\\';
+    });
+}
+
+// Builds the response to a json retrieve request, writing the json directly (and base64-encoding
+// the message data straight into the output) rather than building a json object holding copies
+// of all the messages.  The output is identical to what dumping the equivalent json would give.
+static Response json_retrieve_response(
+        const MessageList& msgs,
+        bool more,
+        snode::hf_revision hf,
+        system_clock::time_point now) {
+    util::stage_timer timer{util::latency_stage::serialize};
+    size_t size = 80;
+    for (const auto& msg : msgs)
+        size += oxenc::to_base64_size(msg.data.size()) + msg.hash.size() + 80;
+    std::string out;
+    out.reserve(size);
+
+    "{{\"hf\":[{},{}],\"messages\":["_format_to(out, hf.first, hf.second);
+    for (size_t i = 0; i < msgs.size(); i++) {
+        const auto& msg = msgs[i];
+        if (i > 0)
+            out += ',';
+        out += R"({"data":")";
+        oxenc::to_base64(msg.data.begin(), msg.data.end(), std::back_inserter(out));
+        R"(","expiration":{},"hash":)"_format_to(out, to_epoch_ms(msg.expiry));
+        if (json_safe(msg.hash))
+            out.append(1, '"').append(msg.hash).append(1, '"');
+        else
+            out += json(std::string{msg.hash}).dump();
+        R"(,"timestamp":{}}})"_format_to(out, to_epoch_ms(msg.timestamp));
+    }
+    R"(],"more":{},"t":{}}})"_format_to(out, more, to_epoch_ms(now));
+
+    Response r{http::OK, std::move(out)};
+    r.encoding = body_encoding::json;
+    return r;
+}
+
+// Builds the response to a bt-encoded retrieve request; this is the bt equivalent of
+// json_retrieve_response.
+static Response bt_retrieve_response(
+        const MessageList& msgs,
+        bool more,
+        snode::hf_revision hf,
+        system_clock::time_point now) {
+    util::stage_timer timer{util::latency_stage::serialize};
+    oxenc::bt_dict_producer out;
+    {
+        auto l = out.append_list("hf");
+        l.append(hf.first);
+        l.append(hf.second);
+    }
+    {
+        auto list = out.append_list("messages");
+        for (const auto& msg : msgs) {
+            auto m = list.append_dict();
+            m.append("data", msg.data);
+            m.append("expiration", to_epoch_ms(msg.expiry));
+            m.append("hash", msg.hash);
+            m.append("timestamp", to_epoch_ms(msg.timestamp));
+        }
+    }
+    out.append("more", more ? 1 : 0);
+    out.append("t", to_epoch_ms(now));
+
+    Response r{http::OK, std::move(out).str()};
+    r.encoding = body_encoding::bt;
+    return r;
+}
+
+std::vector<Response> RequestHandler::process_retrieves(
+        const std::vector<rpc::retrieve*>& reqs, std::vector<bool>* found_none) {
+    auto now = system_clock::now();
+
+    std::vector<Response> responses(reqs.size());
+    if (found_none)
+        found_none->assign(reqs.size(), false);
+    std::vector<Database::retrieve_params> params;
+    std::vector<size_t> valid;
+    for (size_t i = 0; i < reqs.size(); i++) {
+        assert(reqs[i]->pubkey == reqs[0]->pubkey);
+        if (auto err = check_retrieve(*reqs[i], now)) {
+            responses[i] = std::move(*err);
+            continue;
+        }
+        auto& req = *reqs[i];
+        params.push_back(
+                {req.msg_namespace, req.last_hash.value_or(""), req.max_count, req.max_size});
+        valid.push_back(i);
+    }
+    if (valid.empty())
+        return responses;
+
+    const auto& pubkey = reqs[valid.front()]->pubkey;
+    std::vector<std::pair<MessageList, bool>> results;
     try {
-        std::tie(msgs, more) = service_node_.get_db().retrieve(
-                req.pubkey,
-                req.msg_namespace,
-                req.last_hash.value_or(""),
-                req.max_count,
-                req.max_size);
-        service_node_.record_retrieve_request();
+        results = service_node_.get_db().retrieve_multi(pubkey, params);
+        for (size_t i = 0; i < valid.size(); i++)
+            service_node_.record_retrieve_request();
     } catch (const std::exception& e) {
         auto msg = fmt::format(
                 "Internal Server Error. Could not retrieve messages for {}",
-                obfuscate_pubkey(req.pubkey));
+                obfuscate_pubkey(pubkey));
         log::critical(logcat, msg);
-        return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
+        for (auto i : valid)
+            responses[i] = Response{http::INTERNAL_SERVER_ERROR, msg};
+        return responses;
     }
 
-    log::trace(logcat, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
+    for (size_t j = 0; j < valid.size(); j++) {
+        auto& req = *reqs[valid[j]];
+        auto& [msgs, more] = results[j];
 
-    json messages = json::array();
-    for (const auto& msg : msgs) {
-        messages.push_back(json{
-                {"hash", msg.hash},
-                {"timestamp", to_epoch_ms(msg.timestamp)},
-                {"expiration", to_epoch_ms(msg.expiry)},
-                {"data", req.b64 ? oxenc::to_base64(msg.data) : std::move(msg.data)},
-        });
+        log::trace(logcat, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(pubkey));
+        if (found_none)
+            (*found_none)[valid[j]] = msgs.empty();
+
+        // Write the response out directly rather than building (and then dumping or converting) a
+        // json object holding all the message data.
+        responses[valid[j]] = req.b64 ? json_retrieve_response(msgs, more, service_node_.hf(), now)
+                                      : bt_retrieve_response(msgs, more, service_node_.hf(), now);
     }
 
-    json res{{"messages", std::move(messages)}, {"more", more}};
-    add_misc_response_fields(res, service_node_, now);
+    return responses;
+}
+
+void RequestHandler::process_client_req(rpc::retrieve&& req, response_callback cb) {
+    struct pending {
+        rpc::retrieve req;
+        response_callback cb;
+    };
+    auto p = util::make_pooled<pending>(pending{std::move(req), std::move(cb)});
+
+    // A waiting retrieve starts waiting *before* we look for messages: if it only started after
+    // finding none, a message stored in between wouldn't wake it.  If the lookup does find
+    // messages we then cancel the wait and answer with them--unless a new message has already
+    // woken it, in which case it gets answered from there.
+    std::optional<uint64_t> waiting;
+    if (p->req.wait > 0ms)
+        waiting = add_waiting_retrieve(p->req, p->cb);
+
+    // The lookup happens on a database thread; we carry the request's latency stats and trace
+    // span over so that its database time still gets attributed to it.
+    db_job([this, p, waiting, span = util::trace::current()] {
+        util::request_scope scope{&latency(rpc::retrieve::names()[0])};
+        util::trace::scope trace{span};
+        std::vector<bool> found_none;
+        auto res = std::move(process_retrieves({&p->req}, &found_none).front());
+        if (!waiting)
+            return p->cb(std::move(res));
+        if (found_none.front())
+            return;
+        if (auto cb = cancel_waiting_retrieve(p->req.pubkey, *waiting))
+            (*cb)(std::move(res));
+    });
+}
+
+std::optional<uint64_t> RequestHandler::add_waiting_retrieve(
+        const rpc::retrieve& req, response_callback& cb) {
+    auto key = req.pubkey.prefixed_raw();
+    auto deadline = steady_clock::now() + req.wait;
+    std::lock_guard lock{waiting_mutex_};
+    if (waiting_.size() >= RETRIEVE_MAX_WAITING ||
+        waiting_.count(key) >= RETRIEVE_MAX_WAITING_PER_ACCOUNT)
+        return std::nullopt;
+    auto id = next_waiting_id_++;
+    waiting_.emplace(std::move(key), waiting_retrieve{req, std::move(cb), deadline, id});
+    return id;
+}
 
-    return cb(Response{http::OK, std::move(res)});
+std::optional<response_callback> RequestHandler::cancel_waiting_retrieve(
+        const user_pubkey& pubkey, uint64_t id) {
+    std::lock_guard lock{waiting_mutex_};
+    for (auto [it, end] = waiting_.equal_range(pubkey.prefixed_raw()); it != end; ++it) {
+        if (it->second.id == id) {
+            auto cb = std::move(it->second.cb);
+            waiting_.erase(it);
+            return cb;
+        }
+    }
+    return std::nullopt;
+}
+
+void RequestHandler::wake_waiting_retrieves(const user_pubkey& pubkey, namespace_id ns) {
+    auto woken = util::make_pooled<std::vector<waiting_retrieve>>();
+    {
+        std::lock_guard lock{waiting_mutex_};
+        if (waiting_.empty())
+            return;
+        for (auto [it, end] = waiting_.equal_range(pubkey.prefixed_raw()); it != end;) {
+            if (it->second.req.msg_namespace == ns) {
+                woken->push_back(std::move(it->second));
+                it = waiting_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (woken->empty())
+        return;
+
+    log::debug(logcat, "New message woke {} waiting retrieve(s)", woken->size());
+
+    // We get called from the message storing code, so do the actual retrieving elsewhere.  These
+    // are all for the same account, so can be answered with a single lookup.
+    db_job([this, woken] {
+        std::vector<rpc::retrieve*> reqs;
+        for (auto& w : *woken)
+            reqs.push_back(&w.req);
+        auto responses = process_retrieves(reqs);
+        for (size_t i = 0; i < responses.size(); i++)
+            (*woken)[i].cb(std::move(responses[i]));
+    });
 }
 
-void RequestHandler::process_client_req(rpc::info&&, std::function<void(rpc::Response)> cb) {
+void RequestHandler::expire_waiting_retrieves() {
+    std::vector<waiting_retrieve> expired;
+    {
+        auto now = steady_clock::now();
+        std::lock_guard lock{waiting_mutex_};
+        for (auto it = waiting_.begin(); it != waiting_.end();) {
+            if (it->second.deadline <= now) {
+                expired.push_back(std::move(it->second));
+                it = waiting_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Nothing arrived (or we would have been woken), so the answer is still "no messages"
+    auto now = system_clock::now();
+    for (auto& w : expired)
+        w.cb(w.req.b64 ? json_retrieve_response({}, false, service_node_.hf(), now)
+                       : bt_retrieve_response({}, false, service_node_.hf(), now));
+}
+
+void RequestHandler::process_client_req(rpc::info&&, response_callback cb) {
     auto res = json{
             {"version", STORAGE_SERVER_VERSION}, {"timestamp", to_epoch_ms(system_clock::now())}};
     add_misc_response_fields(res, service_node_);
@@ -824,12 +1426,11 @@ namespace {
     }
 }  // namespace
 
-void RequestHandler::process_client_req(
-        rpc::delete_all&& req, std::function<void(rpc::Response)> cb) {
+void RequestHandler::process_client_req(rpc::delete_all&& req, response_callback cb) {
     log::debug(logcat, "processing delete_all {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     const auto tolerance = req.recurse ? SIGNATURE_TOLERANCE : SIGNATURE_TOLERANCE_FORWARDED;
@@ -856,7 +1457,7 @@ void RequestHandler::process_client_req(
         return cb(Response{http::UNAUTHORIZED, "delete_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -889,15 +1490,14 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::delete_msgs&& req, response_callback cb) {
     log::debug(logcat, "processing delete_msgs {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     if (!verify_signature(
                 service_node_.get_db(),
@@ -918,24 +1518,39 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
         // of the swarm members deleted anything.
         cb = [cb = std::move(cb)](Response r) {
             if (r.status.first == 200) {
+                bool deleted_some = false;
                 if (auto* jsonptr = std::get_if<nlohmann::json>(&r.body)) {
                     auto& result = *jsonptr;
-                    bool deleted_some = false;
                     for (const auto& [pubkey, val] : result["swarm"].items()) {
                         if (!val["deleted"].empty()) {
                             deleted_some = true;
                             break;
                         }
                     }
-                    if (!deleted_some)
-                        r.status = http::NOT_FOUND;
-                }
+                } else if (r.encoding == body_encoding::bt) {
+                    oxenc::bt_dict_consumer result{view_body(r)};
+                    if (result.skip_until("swarm") && result.is_dict()) {
+                        auto swarm = result.consume_dict_consumer();
+                        while (!deleted_some && !swarm.is_finished()) {
+                            if (!swarm.is_dict()) {
+                                swarm.skip_value();
+                                continue;
+                            }
+                            auto val = swarm.consume_dict_consumer();
+                            deleted_some = val.skip_until("deleted") && val.is_list() &&
+                                           !val.consume_list_consumer().is_finished();
+                        }
+                    }
+                } else
+                    deleted_some = true;
+                if (!deleted_some)
+                    r.status = http::NOT_FOUND;
             }
             cb(std::move(r));
         };
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -951,17 +1566,15 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(
-        rpc::revoke_subaccount&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::revoke_subaccount&& req, response_callback cb) {
     log::debug(
             logcat, "processing revoke_subaccount{} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.timestamp < now - SIGNATURE_TOLERANCE || req.timestamp > now + SIGNATURE_TOLERANCE) {
@@ -989,7 +1602,7 @@ void RequestHandler::process_client_req(
                 Response{http::UNAUTHORIZED, "revoke_subaccount signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // Put our stuff inside "swarm" alongside all the other results
     auto& mine = req.recurse
@@ -1002,19 +1615,17 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(
-        rpc::unrevoke_subaccount&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::unrevoke_subaccount&& req, response_callback cb) {
     log::debug(
             logcat,
             "processing unrevoke_subaccount{} request",
             req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.timestamp < now - SIGNATURE_TOLERANCE || req.timestamp > now + SIGNATURE_TOLERANCE) {
@@ -1042,7 +1653,7 @@ void RequestHandler::process_client_req(
                 http::UNAUTHORIZED, "unrevoke_subaccount signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // Put our stuff inside "swarm" alongside all the other results
     auto& mine = req.recurse
@@ -1056,16 +1667,14 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(
-        rpc::delete_before&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::delete_before&& req, response_callback cb) {
     log::debug(logcat, "processing delete_before {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.before > now + 1min) {
@@ -1091,7 +1700,7 @@ void RequestHandler::process_client_req(
         return cb(Response{http::UNAUTHORIZED, "delete_before signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1123,15 +1732,14 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::expire_all&& req, response_callback cb) {
     log::debug(logcat, "processing expire_all {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.expiry < now - (req.recurse ? SIGNATURE_TOLERANCE : SIGNATURE_TOLERANCE_FORWARDED)) {
@@ -1158,7 +1766,7 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
         return cb(Response{http::UNAUTHORIZED, "expire_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1189,15 +1797,14 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::expire_msgs&& req, response_callback cb) {
     log::debug(logcat, "processing expire {} request", req.recurse ? "direct" : "forwarded");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     // Should already be guaranteed by client_rpc_endpoints.cpp request parser:
     assert(req.expiry.size() == 1 || req.expiry.size() == req.messages.size());
@@ -1261,7 +1868,7 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
         }
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb), swarm_quorum_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1335,15 +1942,14 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    result_arrived(service_node_, res, true);
 }
 
-void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<void(Response)> cb) {
+void RequestHandler::process_client_req(rpc::get_expiries&& req, response_callback cb) {
     log::debug(logcat, "processing get_expiries request");
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
+        return cb(handle_wrong_swarm(req.pubkey, req.b64));
 
     auto now = system_clock::now();
     if (req.sig_ts < now - SIGNATURE_TOLERANCE || req.sig_ts > now + SIGNATURE_TOLERANCE) {
@@ -1375,40 +1981,139 @@ void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<v
     return cb(Response{http::OK, std::move(res)});
 }
 
-void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc::Response)> cb) {
+namespace {
+    // Converts a subrequest's response into its entry in the "results" list of a batch or
+    // sequence response.
+    json subresult_json(Response&& r) {
+        json subres{{"code", r.status.first}};
+        if (auto* j = std::get_if<json>(&r.body))
+            subres["body"] = std::move(*j);
+        else if (r.encoding == body_encoding::json)
+            subres["body"] = json::parse(view_body(r));
+        else if (r.encoding == body_encoding::bt)
+            subres["body"] = bt_to_json(oxenc::bt_dict_consumer{view_body(r)});
+        else
+            subres["body"] = std::string{view_body(r)};
+        return subres;
+    }
+
+    // Builds the final response of a batch or sequence.  For json requests we write it out
+    // directly, so that already-serialized subresponses (such as retrieves) can be copied in as-is;
+    // otherwise we build it as json (for conversion to bt).
+    Response results_response(std::vector<Response>& responses, bool b64) {
+        if (!b64) {
+            json results = json::array();
+            for (auto& r : responses)
+                results.push_back(subresult_json(std::move(r)));
+            return Response{http::OK, json({{"results", std::move(results)}})};
+        }
+
+        std::string out = R"({"results":[)";
+        for (size_t i = 0; i < responses.size(); i++) {
+            auto& r = responses[i];
+            if (i > 0)
+                out += ',';
+            out += R"({"body":)";
+            if (auto* j = std::get_if<json>(&r.body))
+                out += j->dump();
+            else if (r.encoding == body_encoding::json)
+                out += view_body(r);
+            else
+                out += subresult_json(std::move(r))["body"].dump();
+            R"(,"code":{}}})"_format_to(out, r.status.first);
+        }
+        out += "]}";
+
+        Response res{http::OK, std::move(out)};
+        res.encoding = body_encoding::json;
+        return res;
+    }
+
+    // Collects the responses of a batch's subrequests, which may arrive in any order (and from
+    // different threads, for subrequests that recurse through the swarm).  Each subrequest writes
+    // only to its own slot, and whichever finishes last assembles the final response.
+    struct batch_manager {
+        std::vector<Response> responses;
+        std::atomic<size_t> remaining;
+        bool b64;
+        response_callback cb;
+
+        batch_manager(size_t n, bool b64, response_callback cb) :
+                responses(n), remaining{n}, b64{b64}, cb{std::move(cb)} {}
+
+        void set(size_t i, Response&& r) {
+            responses[i] = std::move(r);
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                cb(results_response(responses, b64));
+        }
+    };
+}  // namespace
+
+void RequestHandler::process_client_req(rpc::batch&& req, response_callback cb) {
 
     assert(!req.subreqs.empty());
 
     // `cb` expects to be invoked once with the full response, but we have a vector of requests to
     // initiate and many possible subrequests (like `store`) are asynchronous because they recurse
-    // through the swarm.  Responses thus may arrive at random times, so we need to fully populate
-    // our subresults initially (with nulls) them fill in the values as they arrive.  Once we get a
-    // full set of non-null values, we can then pass the final response back to `cb`.
+    // through the swarm, so responses may arrive at random times; batch_manager collects them
+    // until we have a full set.
+    auto manager = util::make_pooled<batch_manager>(req.subreqs.size(), req.b64, std::move(cb));
+
+    // Clients typically poll several namespaces at once with a batch of retrieves for the same
+    // pubkey, so we answer those together with a single database lookup.
+    std::vector<bool> handled(req.subreqs.size(), false);
+    for (size_t i = 0; i < req.subreqs.size(); i++) {
+        auto* first = std::get_if<rpc::retrieve>(&req.subreqs[i]);
+        if (!first || handled[i])
+            continue;
+        std::vector<rpc::retrieve*> group{first};
+        std::vector<size_t> indices{i};
+        for (size_t j = i + 1; j < req.subreqs.size(); j++) {
+            auto* r = std::get_if<rpc::retrieve>(&req.subreqs[j]);
+            if (r && !handled[j] && r->pubkey == first->pubkey) {
+                group.push_back(r);
+                indices.push_back(j);
+            }
+        }
+        if (group.size() < 2)
+            continue;
+        auto retrieves = util::make_pooled<std::vector<rpc::retrieve>>();
+        for (size_t k = 0; k < indices.size(); k++) {
+            handled[indices[k]] = true;
+            retrieves->push_back(std::move(*group[k]));
+        }
+        db_job([this, manager, retrieves, indices = std::move(indices)] {
+            std::vector<rpc::retrieve*> reqs;
+            for (auto& r : *retrieves)
+                reqs.push_back(&r);
+            auto responses = process_retrieves(reqs);
+            for (size_t k = 0; k < indices.size(); k++)
+                manager->set(indices[k], std::move(responses[k]));
+        });
+    }
 
-    auto subresults = std::make_shared<json>(json::array());
-    for (size_t i = 0; i < req.subreqs.size(); i++)
-        subresults->emplace_back();
+    // The message hashes of multiple stores get computed together
+    std::vector<const rpc::store*> stores;
+    for (auto& subreq : req.subreqs)
+        if (auto* s = std::get_if<rpc::store>(&subreq))
+            stores.push_back(s);
+    std::vector<std::string> store_hashes;
+    if (stores.size() > 1)
+        store_hashes = computeMessageHashes(stores);
+    size_t next_store = 0;
 
     for (size_t i = 0; i < req.subreqs.size(); i++) {
-        auto handler = [subresults, i, cb](Response r) {
-            json& subres = (*subresults)[i];
-            subres["code"] = r.status.first;
-            if (auto* j = std::get_if<json>(&r.body))
-                subres["body"] = std::move(*j);
-            else
-                subres["body"] = std::string{view_body(r)};
-            bool done = true;
-            for (auto& sr : *subresults)
-                if (sr.is_null()) {
-                    done = false;
-                    break;
-                }
-            if (done)
-                cb(Response{http::OK, json({{"results", std::move(*subresults)}})});
-        };
+        if (handled[i])
+            continue;
         var::visit(
-                [this, handler = std::move(handler)](auto&& s) {
-                    process_client_req(std::move(s), std::move(handler));
+                [&, i](auto&& s) {
+                    auto set = [manager, i](Response r) { manager->set(i, std::move(r)); };
+                    if constexpr (std::is_same_v<std::decay_t<decltype(s)>, rpc::store>) {
+                        if (!store_hashes.empty())
+                            return process_client_req(
+                                    std::move(s), std::move(set), store_hashes[next_store++]);
+                    }
+                    process_client_req(std::move(s), std::move(set));
                 },
                 req.subreqs[i]);
     }
@@ -1417,67 +2122,89 @@ void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc
 namespace {
     struct sequence_manager {
         std::vector<client_subrequest> subreqs;
-        json subresults = json::array();
-        std::function<void(Response r)> subresult_callback;
+        std::vector<Response> responses;
+        // Responses for subrequests that were answered ahead of time; see next_subrequest().
+        std::vector<std::optional<Response>> answered;
+        bool b64;
+        response_callback cb;
     };
-}  // namespace
 
-void RequestHandler::process_client_req(
-        rpc::sequence&& req, std::function<void(rpc::Response)> cb) {
-
-    assert(!req.subreqs.empty());
+    void next_subrequest(RequestHandler& rh, const std::shared_ptr<sequence_manager>& m);
 
-    // This gets a bit hairy because of how the asynchronous requests can work when we have a
-    // swarm-recursive request (like a store), and so we define a recursive lambda here that owns
-    // itself (via the captured `sequence_manager` shared pointer) and clears that ownership only
-    // once the response is fully constructed.
-    //
-    // It goes like this:
-    // - we initiate the first request, and once it is done (i.e. locally *and* all remote responses
-    //   are collected or timed out) then the lambda below gets called.
-    // - we append the result to our collected results, then:
-    //   - if that result was a failure, we return what we have but stop processing more
-    //   - if we have a full set of results we fire it back to the requestor via `cb`
-    //   - otherwise (i.e. the result is good and we have fewer results than requests), we fire the
-    //     next subrequest (which will call back into the same lambda when it finishes, repeating
-    //     everything)
-    //
-    // The `manager` object here is a bit of an Ouroborus: it contains a lambda that captures a
-    // shared pointer to itself.  We break the link (by clearing the lambda) as soon as we have the
-    // full response.
-    //
-    auto manager = std::make_shared<sequence_manager>();
-    manager->subreqs = std::move(req.subreqs);
-    manager->subresult_callback = [this, manager, cb = std::move(cb)](Response r) {
-        json& subres = manager->subresults.emplace_back();
+    // Records the response to the current subrequest of a sequence, then either fires off the next
+    // one or, if this one failed or was the last, sends back the final response.
+    void sequence_result(
+            RequestHandler& rh, const std::shared_ptr<sequence_manager>& m, Response&& r) {
         auto status = r.status.first;
-        subres["code"] = status;
-        if (auto* j = std::get_if<json>(&r.body))
-            subres["body"] = std::move(*j);
+        m->responses.push_back(std::move(r));
+        if (status < 200 || status > 299 || m->responses.size() >= m->subreqs.size())
+            m->cb(results_response(m->responses, m->b64));
         else
-            subres["body"] = std::string{view_body(r)};
+            next_subrequest(rh, m);
+    }
 
-        if (status < 200 || status > 299 || manager->subresults.size() >= manager->subreqs.size()) {
-            manager->subresult_callback = nullptr;
-            cb(Response{http::OK, json({{"results", std::move(manager->subresults)}})});
+    // Fires off the next subrequest of a sequence.  A run of consecutive retrieves for the same
+    // pubkey gets answered all at once with a single database lookup (retrieves have no side
+    // effects, so answering the later ones early is harmless even if an earlier one fails); the
+    // responses are then fed back one at a time, just as if they had been processed individually.
+    void next_subrequest(RequestHandler& rh, const std::shared_ptr<sequence_manager>& m) {
+        size_t i = m->responses.size();
+        if (!m->answered[i]) {
+            if (auto* first = std::get_if<rpc::retrieve>(&m->subreqs[i])) {
+                std::vector<rpc::retrieve*> run{first};
+                for (size_t j = i + 1; j < m->subreqs.size(); j++) {
+                    auto* r = std::get_if<rpc::retrieve>(&m->subreqs[j]);
+                    if (!r || !(r->pubkey == first->pubkey))
+                        break;
+                    run.push_back(r);
+                }
+                if (run.size() > 1) {
+                    // Looked up on a database thread, which then carries on with the sequence
+                    rh.db_job([&rh, m, i, run = std::move(run)] {
+                        auto responses = rh.process_retrieves(run);
+                        for (size_t k = 0; k < responses.size(); k++)
+                            m->answered[i + k] = std::move(responses[k]);
+                        next_subrequest(rh, m);
+                    });
+                    return;
+                }
+            }
+        }
+
+        if (m->answered[i]) {
+            auto r = std::move(*m->answered[i]);
+            m->answered[i].reset();
+            sequence_result(rh, m, std::move(r));
         } else {
-            // subrequest was successful and we're not done, so fire off the next one
             var::visit(
                     [&](auto&& subreq) {
-                        process_client_req(std::move(subreq), manager->subresult_callback);
+                        rh.process_client_req(std::move(subreq), [&rh, m](Response r) {
+                            sequence_result(rh, m, std::move(r));
+                        });
                     },
-                    manager->subreqs[manager->subresults.size()]);
+                    m->subreqs[i]);
         }
-    };
+    }
+}  // namespace
 
-    var::visit(
-            [&](auto&& subreq) {
-                process_client_req(std::move(subreq), manager->subresult_callback);
-            },
-            manager->subreqs[0]);
+void RequestHandler::process_client_req(rpc::sequence&& req, response_callback cb) {
+
+    assert(!req.subreqs.empty());
+
+    // Subrequests are fired off one at a time: each subrequest's callback (which holds the only
+    // references to `manager` once we return) records the result and then either starts the next
+    // subrequest or, if the subrequest failed or was the last one, sends back the response.
+    auto manager = util::make_pooled<sequence_manager>();
+    manager->subreqs = std::move(req.subreqs);
+    manager->responses.reserve(manager->subreqs.size());
+    manager->answered.resize(manager->subreqs.size());
+    manager->b64 = req.b64;
+    manager->cb = std::move(cb);
+
+    next_subrequest(*this, manager);
 }
 
-void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rpc::Response)> cb) {
+void RequestHandler::process_client_req(rpc::ifelse&& req, response_callback cb) {
 
     bool cond = req.condition(service_node_);
     json response{
@@ -1492,11 +2219,7 @@ void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rp
 
     auto wrap_response = [response = std::move(response),
                           cb = std::move(cb)](rpc::Response r) mutable {
-        response["result"] = json{{"code", r.status.first}};
-        if (auto* j = std::get_if<json>(&r.body))
-            response["result"]["body"] = std::move(*j);
-        else
-            response["result"]["body"] = std::string{view_body(r)};
+        response["result"] = subresult_json(std::move(r));
         cb(Response{http::OK, std::move(response)});
     };
 
@@ -1506,7 +2229,9 @@ void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rp
 }
 
 void RequestHandler::process_client_req(
-        std::string_view req_json, std::function<void(Response)> cb) {
+        std::string_view req_json,
+        response_callback cb,
+        std::optional<TrafficCapture::transport> capture_via) {
     log::trace(logcat, "process_client_req str <{}>", req_json);
 
     json body = json::parse(req_json, nullptr, false);
@@ -1535,11 +2260,29 @@ void RequestHandler::process_client_req(
         return cb(Response{http::BAD_REQUEST, "invalid json: no `params` field"sv});
     }
 
+    if (capture_ && capture_via)
+        if (auto p = capture_->start(*capture_via, method_name, 0, false)) {
+            // Record the size of the params alone, as the OMQ and QUIC captures do (and only
+            // serialize them for that once we know the request is being sampled).
+            p->rec.params_size = params_it->dump().size();
+            capture_->set_account(*p, TrafficCapture::json_pubkey(*params_it));
+            cb = [this, pending = std::move(*p), cb = std::move(cb)](Response res) mutable {
+                // Serialize a json body here, rather than in the reply, so that we can measure it
+                // without doing it twice.
+                if (auto* j = std::get_if<json>(&res.body)) {
+                    res.body = j->dump();
+                    res.encoding = body_encoding::json;
+                }
+                capture_->finish(std::move(pending), res.status.first, view_body(res).size());
+                cb(std::move(res));
+            };
+        }
+
     process_client_req(method_name, std::move(*params_it), std::move(cb));
 }
 
 void RequestHandler::process_client_req(
-        std::string_view method_name, json params, std::function<void(Response)> cb) {
+        std::string_view method_name, json params, response_callback cb) {
     if (auto it = client_rpc_endpoints.find(method_name); it != client_rpc_endpoints.end()) {
         log::debug(logcat, "Process client request: {}", method_name);
         try {
@@ -1547,12 +2290,17 @@ void RequestHandler::process_client_req(
         } catch (const rpc::parse_error& e) {
             // These exceptions carry a failure message to send back to the client
             log::debug(logcat, "Invalid request: {}", e.what());
-            return cb(Response{http::BAD_REQUEST, "invalid request: "s + e.what()});
+            if (cb)
+                cb(Response{http::BAD_REQUEST, "invalid request: "s + e.what()});
+            return;
         } catch (const std::exception& e) {
             // Other exceptions might contain something sensitive or irrelevant so warn about it
-            // and send back a generic message.
+            // and send back a generic message (if the request hadn't already taken over the
+            // callback before failing).
             log::warning(logcat, "Client request raised an exception: {}", e.what());
-            return cb(Response{http::INTERNAL_SERVER_ERROR, "request failed"sv});
+            if (cb)
+                cb(Response{http::INTERNAL_SERVER_ERROR, "request failed"sv});
+            return;
         }
     }
 
@@ -1633,7 +2381,10 @@ Response RequestHandler::wrap_proxy_response(
         bool base64) const {
     int status = res.status.first;
     std::string body;
-    if (std::holds_alternative<std::string>(res.body))
+    if (embed_json && res.encoding == body_encoding::json)
+        // Already-serialized json gets spliced in just as the json object would be
+        body = R"({{"body":{},"status":{}}})"_format(view_body(res), status);
+    else if (std::holds_alternative<std::string>(res.body))
         body = json{{"status", status}, {"body", std::move(std::get<std::string>(res.body))}}
                        .dump();
     else if (std::holds_alternative<std::string_view>(res.body))
@@ -1655,18 +2406,53 @@ void RequestHandler::process_onion_req(std::string_view ciphertext, OnionRequest
         return data.cb(
                 {http::SERVICE_UNAVAILABLE,
                  fmt::format("Snode not ready: {}", service_node_.own_address().pubkey_ed25519)});
+    if (service_node_.draining())
+        return data.cb({http::SERVICE_UNAVAILABLE, "Service node is shutting down"s});
 
     log::debug(logcat, "process_onion_req");
 
     service_node_.record_onion_request();
 
-    var::visit(
-            [&](auto&& x) { process_onion_req(std::move(x), std::move(data)); },
-            process_ciphertext_v2(channel_cipher_, ciphertext, data.ephem_key, data.enc_type));
+    // The span covers our part of the onion request, up until we have the reply (from the next
+    // hop, for a relayed request) to send back.  Each hop samples onion requests on its own, as the
+    // trace context doesn't get passed along the onion path (see util::trace::context).
+    auto span = start_request_span(*this, "onion_request");
+    if (span) {
+        span->tag("hop", std::to_string(data.hop_no));
+        data.cb = [span, cb = std::move(data.cb)](Response res) {
+            span->tag("http.status_code", std::to_string(res.status.first));
+            cb(std::move(res));
+            span->end();
+        };
+    }
+
+    // The decryption (a key exchange plus symmetric decryption) happens on the crypto pool, after
+    // which we come back to a worker thread to process the request.
+    auto cb = data.cb;
+    std::function<void()> decrypt = [this,
+                                     ciphertext = std::string{ciphertext},
+                                     data = std::move(data),
+                                     span]() mutable {
+        // Decrypted in place, in our copy of the ciphertext, which the parsed request then slices
+        auto parsed = process_ciphertext_v2(
+                channel_cipher_, std::move(ciphertext), data.ephem_key, data.enc_type);
+        service_node_.omq_server()->job(
+                [this, parsed = std::move(parsed), data = std::move(data), span]() mutable {
+                    util::trace::scope trace{span.get()};
+                    var::visit(
+                            [&](auto&& x) { process_onion_req(std::move(x), std::move(data)); },
+                            std::move(parsed));
+                });
+    };
+    if (!crypto_pool_.try_submit(decrypt)) {
+        log::debug(logcat, "Refusing onion request: crypto queue is full");
+        return cb({http::SERVICE_UNAVAILABLE, "Server busy, try again later"s});
+    }
 }
 
 void RequestHandler::process_onion_req(FinalDestinationInfo&& info, OnionRequestMetadata&& data) {
     log::debug(logcat, "We are the target of the onion request!");
+    service_node_.record_onion_outcome(snode::onion_outcome::final_destination);
 
     if (!service_node_.snode_ready())
         return data.cb(wrap_proxy_response(
@@ -1677,10 +2463,17 @@ void RequestHandler::process_onion_req(FinalDestinationInfo&& info, OnionRequest
                 info.base64));
 
     process_client_req(
-            info.body,
+            info.body.view(),
             [this, data = std::move(data), json = info.json, b64 = info.base64](rpc::Response res) {
-                data.cb(wrap_proxy_response(
-                        std::move(res), data.ephem_key, data.enc_type, json, b64));
+                // Encrypt the reply on the crypto pool too, unless it is full (in which case,
+                // since we have to reply, we do it here)
+                std::function<void()> reply =
+                        [this, data, json, b64, res = std::move(res)]() mutable {
+                            data.cb(wrap_proxy_response(
+                                    std::move(res), data.ephem_key, data.enc_type, json, b64));
+                        };
+                if (!crypto_pool_.try_submit(reply))
+                    reply();
             });
 }
 
@@ -1691,20 +2484,24 @@ void RequestHandler::process_onion_req(RelayToNodeInfo&& info, OnionRequestMetad
     if (!dest_node) {
         auto msg = fmt::format("Next node not found: {}", dest);
         log::debug(logcat, "{}", msg);
+        service_node_.record_onion_outcome(snode::onion_outcome::relay_failed);
         return data.cb({http::BAD_GATEWAY, std::move(msg)});
     }
 
-    auto on_response = [cb = std::move(data.cb)](bool success, std::vector<std::string> data) {
+    auto on_response = [&sn = service_node_, cb = std::move(data.cb)](
+                               bool success, std::vector<std::string> data) {
         // Processing the result we got from upstream
 
         if (!success) {
             log::debug(logcat, "[Onion request] Request time out");
+            sn.record_onion_outcome(snode::onion_outcome::relay_failed);
             return cb({http::GATEWAY_TIMEOUT, "Request time out"s});
         }
 
         // We expect a two-part message, but for forwards compatibility allow extra parts
         if (data.size() < 2) {
             log::debug(logcat, "[Onion request] Invalid response; expected at least 2 parts");
+            sn.record_onion_outcome(snode::onion_outcome::relay_failed);
             return cb({http::INTERNAL_SERVER_ERROR, "Invalid response from snode"s});
         }
 
@@ -1718,6 +2515,9 @@ void RequestHandler::process_onion_req(RelayToNodeInfo&& info, OnionRequestMetad
                     logcat,
                     "Onion request relay failed with: {}",
                     std::holds_alternative<nlohmann::json>(res.body) ? "<json>" : view_body(res));
+        sn.record_onion_outcome(
+                res.status == http::OK ? snode::onion_outcome::relayed
+                                       : snode::onion_outcome::relay_failed);
 
         cb(std::move(res));
     };
@@ -1727,7 +2527,7 @@ void RequestHandler::process_onion_req(RelayToNodeInfo&& info, OnionRequestMetad
     data.ephem_key = ekey;
     data.enc_type = etype;
     service_node_.send_onion_to_sn(
-            *dest_node, std::move(payload), std::move(data), std::move(on_response));
+            *dest_node, payload.view(), std::move(data), std::move(on_response));
 }
 
 void RequestHandler::process_onion_req(RelayToServerInfo&& info, OnionRequestMetadata&& data) {
@@ -1735,63 +2535,38 @@ void RequestHandler::process_onion_req(RelayToServerInfo&& info, OnionRequestMet
 
     // Forward the request to url but only if it ends in `/lsrpc`
     if (!(info.protocol == "http" || info.protocol == "https") ||
-        !is_onion_url_target_allowed(info.target))
+        !is_onion_url_target_allowed(info.target)) {
+        service_node_.record_onion_outcome(snode::onion_outcome::invalid);
         return data.cb(wrap_proxy_response(
                 {http::BAD_REQUEST, "Invalid url"s}, data.ephem_key, data.enc_type));
+    }
 
-    std::string urlstr;
-    urlstr.reserve(
-            info.protocol.size() + 3 + info.host.size() + 6 /*:port*/ + 1 + info.target.size());
-    urlstr += info.protocol;
-    urlstr += "://";
-    urlstr += info.host;
+    std::string base;
+    base.reserve(info.protocol.size() + 3 + info.host.size() + 6 /*:port*/);
+    base += info.protocol;
+    base += "://";
+    base += info.host;
     if (info.port != (info.protocol == "https" ? 443 : 80)) {
-        urlstr += ':';
-        urlstr += std::to_string(info.port);
+        base += ':';
+        base += std::to_string(info.port);
     }
+    std::string urlstr;
+    urlstr.reserve(base.size() + 1 + info.target.size());
+    urlstr += base;
     if (!util::starts_with(info.target, "/"))
         urlstr += '/';
     urlstr += info.target;
 
     service_node_.record_proxy_request();
+    service_node_.record_onion_outcome(snode::onion_outcome::proxied);
 
-    pending_proxy_requests_.emplace_front(cpr::PostCallback(
-            [&omq = *service_node_.omq_server(), cb = std::move(data.cb)](cpr::Response r) {
-                Response res;
-                if (r.error.code != cpr::ErrorCode::OK) {
-                    log::debug(
-                            logcat,
-                            "Onion proxied request to {} failed: {}",
-                            r.url.str(),
-                            r.error.message);
-                    res.body = r.error.message;
-                    if (r.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT)
-                        res.status = http::GATEWAY_TIMEOUT;
-                    else
-                        res.status = http::BAD_GATEWAY;
-                } else {
-                    res.status.first = r.status_code;
-                    res.status.second = r.status_line;
-                    for (auto& [k, v] : r.header)
-                        res.headers.emplace_back(std::move(k), std::move(v));
-                    res.body = std::move(r.text);
-                }
-
-                cb(std::move(res));
-            },
-            cpr::Url{std::move(urlstr)},
-            cpr::Header{
-                    {"User-Agent",
-                     "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
-                    {"Content-Type", "application/octet-stream"}},
-            cpr::Timeout{ONION_URL_TIMEOUT},
-            cpr::Ssl(cpr::ssl::TLSv1_2{}),
-            cpr::Redirect{0L},
-            cpr::Body{std::move(info.payload)}));
+    proxy_client_.post(
+            base, std::move(urlstr), std::move(info.payload).release(), std::move(data.cb));
 }
 
 void RequestHandler::process_onion_req(
         ProcessCiphertextError&& error, OnionRequestMetadata&& data) {
+    service_node_.record_onion_outcome(snode::onion_outcome::invalid);
     switch (error) {
         case ProcessCiphertextError::INVALID_CIPHERTEXT:
             return data.cb({http::BAD_REQUEST, "Invalid ciphertext"s});
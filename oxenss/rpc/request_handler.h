@@ -1,24 +1,33 @@
 #pragma once
 
 #include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/crypto_pool.h>
 #include "client_rpc_endpoints.h"
 #include "onion_processing.h"
+#include "proxy_client.h"
+#include "traffic_capture.h"
 #include <oxenc/bt_serialize.h>
 #include <oxenss/crypto/keys.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/callback.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/server/utils.h>
 #include <oxenss/utils/time.hpp>
 
+#include <algorithm>
 #include <chrono>
-#include <forward_list>
 #include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include <nlohmann/json_fwd.hpp>
-#include <cpr/async_wrapper.h>
 #include <variant>
 
 namespace oxenss::rpc {
@@ -62,11 +71,37 @@ inline constexpr int RETRIEVE_MAX_SIZE = 7'800'000;
 // Maximum subrequests that can be stuffed into a single batch request
 inline constexpr size_t BATCH_REQUEST_MAX = 20;
 
+// Maximum time that a retrieve can wait for a new message to arrive (via its `wait` parameter).
+// This is kept below the 10s that an HTTPS request is allowed to go without a response.
+inline constexpr auto RETRIEVE_MAX_WAIT = 8s;
+
+// Maximum number of retrieves that we will keep waiting at once, and maximum number for a single
+// account; retrieves beyond these get answered right away.
+inline constexpr size_t RETRIEVE_MAX_WAITING = 10'000;
+inline constexpr size_t RETRIEVE_MAX_WAITING_PER_ACCOUNT = 10;
+
+// How often we check for waiting retrieves that have run out of time
+inline constexpr auto RETRIEVE_WAIT_CHECK_INTERVAL = 250ms;
+
+// How long we reuse an oxend_request result for identical requests by default (it also gets
+// dropped when a new block arrives), and the most results we keep
+inline constexpr auto OXEND_CACHE_TTL = 30s;
+inline constexpr size_t OXEND_CACHE_MAX = 1000;
+
+// What the string body of a Response contains: usually just an opaque string (an error message,
+// an already-encrypted onion response, etc.), but some responses get serialized directly into
+// json or bt rather than building a json object.  Those still need to be treated as json/bt by
+// anything that wraps or embeds them.
+enum class body_encoding : uint8_t { opaque, json, bt };
+
 // Simpler wrapper that works for most of our responses
 struct Response {
     http::response_code status = http::OK;
     std::variant<std::string, std::string_view, nlohmann::json> body;
     std::vector<std::pair<std::string, std::string>> headers;
+    // How a string `body` is encoded.  `bt` is only used in responses to bt-encoded requests
+    // (which only come directly from OMQ/QUIC clients); `json` only in responses to json requests.
+    body_encoding encoding = body_encoding::opaque;
 
     Response() = default;
     Response(
@@ -89,6 +124,10 @@ inline std::string_view view_body(const Response& r) {
 
 std::string to_string(const Response& res);
 
+// The callback through which a request handler replies to a request.  Move-only, so callbacks
+// that capture other callbacks (as the wrappers around a request's reply do) can move them along.
+using response_callback = util::callback<void(Response)>;
+
 namespace detail {
     // detail::to_hashable takes either an integral type, system_clock::time_point, or a string
     // type and converts it to a string_view by writing an integer value (using std::to_chars)
@@ -115,7 +154,7 @@ namespace detail {
 }  // namespace detail
 
 /// Compute a hash from the given strings, concatenated together.
-std::string compute_hash_blake2b_b64(std::vector<std::string_view> parts);
+std::string compute_hash_blake2b_b64(std::initializer_list<std::string_view> parts);
 
 /// Computes a message hash based on its constituent parts.  Takes a function (which accepts a
 /// container of string_views) and any number of std::string, std::string_view, system_clock
@@ -139,20 +178,86 @@ std::string compute_hash(Func hasher, const T&... args) {
 /// Computes a message hash using blake2b hash of various messages attributes.
 std::string computeMessageHash(const user_pubkey& pubkey, namespace_id ns, std::string_view data);
 
+/// Computes the message hashes of several stores at once; gives the same hashes as calling
+/// computeMessageHash on each, but hashes them together with crypto::blake2b_batch.
+std::vector<std::string> computeMessageHashes(const std::vector<const rpc::store*>& stores);
+
+// Recent successful oxend_request results, keyed by oxend endpoint and params, and the requests
+// currently waiting on oxend (under the same keys), so that identical requests arriving in the
+// meantime share the one oxend call.  The cache gets cleared on each new block; results of calls
+// started before a clearing don't get cached.
+class OxendCache {
+  public:
+    using result_ptr = std::shared_ptr<const nlohmann::json>;
+
+    struct lookup {
+        // The cached result, if there was one
+        result_ptr cached;
+        // True if the caller has to make the oxend call, and then pass its result to finish()
+        bool call = false;
+        // To be given to finish()
+        uint64_t gen = 0;
+    };
+
+    // Looks up `key`.  On a hit the cached result is returned, and `cb` left alone; otherwise `cb`
+    // is taken to wait for the result of the request's oxend call, which the caller has to make
+    // if `call` is set (i.e. if no identical request is already waiting on oxend).
+    lookup start(
+            const std::string& key,
+            response_callback& cb,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Records the result (nullptr if the call failed) of the oxend call for `key`, caching it if
+    // it succeeded (and the cache hasn't been cleared since the call's start()), and returns the
+    // callbacks waiting on it.
+    std::vector<response_callback> finish(
+            const std::string& key,
+            uint64_t gen,
+            result_ptr result,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Drops all of the cached results
+    void clear();
+
+    // Sets how long results get reused; 0 disables the cache (but not the sharing of identical
+    // requests in flight).
+    void ttl(std::chrono::milliseconds ttl);
+
+    // The number of cached results (including expired ones not yet dropped)
+    size_t size() const;
+
+  private:
+    struct cached {
+        result_ptr result;
+        std::chrono::steady_clock::time_point expiry;
+    };
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, cached> cache_;
+    std::unordered_map<std::string, std::vector<response_callback>> waiting_;
+    // Counts the clearings of the cache
+    uint64_t gen_ = 0;
+    std::chrono::milliseconds ttl_ = OXEND_CACHE_TTL;
+};
+
 struct OnionRequestMetadata {
     crypto::x25519_pubkey ephem_key;
+    // (A std::function because the metadata gets copied along with the reply)
     std::function<void(Response)> cb;
     int hop_no = 0;
     crypto::EncryptType enc_type = crypto::EncryptType::aes_gcm;
 };
 
+// The collected results of a request recursing through the swarm
+struct swarm_response;
+
 class RequestHandler {
 
     snode::ServiceNode& service_node_;
     const crypto::ChannelEncryption& channel_cipher_;
     const crypto::ed25519_seckey ed25519_sk_;
 
-    std::forward_list<cpr::AsyncWrapper<void>> pending_proxy_requests_;
+    // Pooled connections for proxying onion requests to servers
+    ProxyClient proxy_client_;
 
     // Wrap response `res` to an intermediate node
     Response wrap_proxy_response(
@@ -162,8 +267,9 @@ class RequestHandler {
             bool json = false,
             bool base64 = true) const;
 
-    // Return the correct swarm for `pubKey`
-    Response handle_wrong_swarm(const user_pubkey& pubKey);
+    // Return the correct swarm for `pubKey`, json-encoded if `b64` (i.e. for a json request),
+    // otherwise bt-encoded
+    Response handle_wrong_swarm(const user_pubkey& pubKey, bool b64);
 
     // ===== Session Client Requests =====
 
@@ -177,42 +283,170 @@ class RequestHandler {
     // Query the database and return requested messages
     Response process_retrieve(const nlohmann::json& params);
 
+    // Validates a retrieve request (swarm, signature, timestamp) and normalizes its count/size
+    // limits.  Returns an error response if the request should be rejected, nullopt otherwise.
+    std::optional<Response> check_retrieve(
+            rpc::retrieve& req, std::chrono::system_clock::time_point now);
+
+    // Retrieves waiting for a new message to arrive, keyed by prefixed account pubkey
+    struct waiting_retrieve {
+        rpc::retrieve req;
+        response_callback cb;
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t id;
+    };
+    std::mutex waiting_mutex_;
+    std::unordered_multimap<std::string, waiting_retrieve> waiting_;
+    uint64_t next_waiting_id_ = 0;
+
+    // Adds a copy of `req` (and `cb`) to the waiting retrieves, returning an id with which it can
+    // be cancelled.  Returns nullopt (without touching `cb`) if there are already too many waiting.
+    std::optional<uint64_t> add_waiting_retrieve(const rpc::retrieve& req, response_callback& cb);
+
+    // Removes a retrieve added by add_waiting_retrieve() and returns its callback, to be answered
+    // by the caller.  Returns nullopt if the retrieve is no longer waiting because it has already
+    // been woken or has expired, in which case it gets answered from there instead.
+    std::optional<response_callback> cancel_waiting_retrieve(
+            const user_pubkey& pubkey, uint64_t id);
+
+    // Answers any waiting retrieves whose wait has run out
+    void expire_waiting_retrieves();
+
+    // Recursive client stores still waiting on swarm peers, keyed by message hash, expiry and
+    // encoding, so that duplicates of them arriving in the meantime can join them rather than
+    // being stored and distributed all over again.
+    std::mutex inflight_mutex_;
+    std::unordered_map<std::string, std::weak_ptr<swarm_response>> inflight_stores_;
+
+    // If a store with the given key is in flight, adds `cb` to the callbacks getting its reply
+    // and returns true; otherwise returns false (and leaves `cb` alone).
+    bool join_inflight_store(const std::string& key, response_callback& cb);
+    // Removes the in-flight store entry of `res`, once it has replied.
+    void end_inflight_store(const std::string& key, const swarm_response* res);
+
+    OxendCache oxend_cache_;
+
+    // Number of swarm peer results to wait for before replying to a recursive request; 0 waits
+    // for all of them (see set_swarm_quorum).
+    int swarm_quorum_ = 0;
+
+    // Sampled capture of client requests, if enabled (see start_capture)
+    std::unique_ptr<TrafficCapture> capture_;
+
+    // Threads for onion request decryption and encryption, so that it stays off of the network
+    // and request handling threads.  Declared last so that its threads (which use the other
+    // members) get stopped first.
+    crypto::CryptoPool crypto_pool_;
+
     // ===================================
 
   public:
+    // \param crypto_threads the number of crypto pool threads
+    // \param crypto_init if given, called at the start of each crypto pool thread (with the
+    // thread's index), e.g. to pin the thread to a core.
     RequestHandler(
             snode::ServiceNode& sn,
             const crypto::ChannelEncryption& ce,
-            crypto::ed25519_seckey ed_sk);
+            crypto::ed25519_seckey ed_sk,
+            size_t crypto_threads = crypto::CryptoPool::default_threads(),
+            std::function<void(size_t)> crypto_init = nullptr);
+
+    // Runs `job`, which does blocking database work, on a database thread (see OMQ::db_job).
+    void db_job(std::function<void()> job);
+
+    // Enables quorum mode for recursive (swarm-wide) requests such as stores and deletes: instead
+    // of waiting for every swarm peer's result (or its timeout), we reply as soon as we have our
+    // own result plus `peers` peer results, with the peers yet to answer marked as "pending" in
+    // the reply.  Results arriving after that are only logged and counted.  0 (the default)
+    // waits for all peers.
+    void set_swarm_quorum(int peers) { swarm_quorum_ = std::max(peers, 0); }
+
+    // Sets how long successful oxend_request results get reused for identical requests (unless
+    // a new block arrives first); 0 disables the cache (but not the sharing of identical requests
+    // in flight).
+    void set_oxend_cache_ttl(std::chrono::milliseconds ttl) { oxend_cache_.ttl(ttl); }
+
+    // Starts capturing a `sample_rate` fraction of client requests into `path` (see
+    // TrafficCapture), up to `max_size` bytes of log.  Must be called before any requests arrive.
+    // Throws if the file can't be created.
+    void start_capture(std::filesystem::path path, double sample_rate, uint64_t max_size) {
+        capture_ = std::make_unique<TrafficCapture>(std::move(path), sample_rate, max_size);
+    }
+
+    // The client request capture, or nullptr if not capturing
+    TrafficCapture* capture() { return capture_.get(); }
+
+    // Drops the cached oxend_request results; called when oxend tells us about a new block, as
+    // results (e.g. of ONS lookups) can change with each block.
+    void clear_oxend_cache() { oxend_cache_.clear(); }
+
+    // Returns the latency histograms of a request endpoint (see ServiceNode::latency)
+    util::endpoint_latency& latency(std::string_view endpoint) {
+        return service_node_.latency(endpoint);
+    }
+
+    // Returns the state of the connection pool for proxying onion requests to servers
+    ProxyClient::stats proxy_stats() const { return proxy_client_.get_stats(); }
+
+    // The thread pool doing onion request encryption and decryption
+    const crypto::CryptoPool& crypto_pool() const { return crypto_pool_; }
+
+    // Our encryption of onion requests and responses
+    const crypto::ChannelEncryption& channel_cipher() const { return channel_cipher_; }
+
+    // Starts the trace span of a request arriving at this node (see util::trace::span::sampled)
+    util::trace::span start_span(std::string_view name, const util::trace::context& parent = {}) {
+        return util::trace::span::sampled(service_node_.traces(), name, parent);
+    }
 
     // Handlers for parsed client requests
-    void process_client_req(rpc::store&& req, std::function<void(Response)> cb);
-    void process_client_req(rpc::retrieve&& req, std::function<void(Response)> cb);
-    void process_client_req(rpc::get_swarm&& req, std::function<void(Response)> cb);
-    void process_client_req(rpc::oxend_request&& req, std::function<void(Response)> cb);
-    void process_client_req(rpc::info&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::delete_all&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::delete_msgs&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::delete_before&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::expire_all&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::expire_msgs&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::get_expiries&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::batch&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::sequence&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::ifelse&&, std::function<void(Response)> cb);
-    void process_client_req(rpc::revoke_subaccount&& req, std::function<void(Response)> cb);
-    void process_client_req(rpc::unrevoke_subaccount&& req, std::function<void(Response)> cb);
+    void process_client_req(rpc::store&& req, response_callback cb);
+    // (The same, with the message hash already computed, e.g. for the stores of a batch)
+    void process_client_req(rpc::store&& req, response_callback cb, std::string message_hash);
+    void process_client_req(rpc::retrieve&& req, response_callback cb);
+    void process_client_req(rpc::get_swarm&& req, response_callback cb);
+    void process_client_req(rpc::oxend_request&& req, response_callback cb);
+    void process_client_req(rpc::info&&, response_callback cb);
+    void process_client_req(rpc::delete_all&&, response_callback cb);
+    void process_client_req(rpc::delete_msgs&&, response_callback cb);
+    void process_client_req(rpc::delete_before&&, response_callback cb);
+    void process_client_req(rpc::expire_all&&, response_callback cb);
+    void process_client_req(rpc::expire_msgs&&, response_callback cb);
+    void process_client_req(rpc::get_expiries&&, response_callback cb);
+    void process_client_req(rpc::batch&&, response_callback cb);
+    void process_client_req(rpc::sequence&&, response_callback cb);
+    void process_client_req(rpc::ifelse&&, response_callback cb);
+    void process_client_req(rpc::revoke_subaccount&& req, response_callback cb);
+    void process_client_req(rpc::unrevoke_subaccount&& req, response_callback cb);
+
+    // Processes several retrieve requests, which must all be for the same pubkey, using a single
+    // database lookup.  Returns the responses in the same order as `reqs`; these are the same as
+    // processing each request individually would have given.  Used for batch/sequence requests
+    // that poll multiple namespaces at once.
+    // If `found_none` is given then it is filled with a flag for each request indicating whether
+    // it succeeded without returning any messages.
+    std::vector<Response> process_retrieves(
+            const std::vector<rpc::retrieve*>& reqs, std::vector<bool>* found_none = nullptr);
+
+    // Called when a new message is stored to answer any retrieves waiting on the message's account
+    // and namespace.
+    void wake_waiting_retrieves(const user_pubkey& pubkey, namespace_id ns);
 
     struct rpc_handler {
         std::function<client_request(std::variant<nlohmann::json, oxenc::bt_dict_consumer> params)>
                 load_req;
-        std::function<void(RequestHandler&, nlohmann::json, std::function<void(Response)>)>
-                http_json;
+        // Takes the callback by reference, and only moves it away once the request has been
+        // loaded, so that the caller can still reply to a request that fails to load.
+        std::function<void(RequestHandler&, nlohmann::json, response_callback&)> http_json;
+        // `trust_trace` says whether to continue a trace context included in a forwarded request;
+        // it is only set for requests from our swarm peers, so that other nodes can't make us
+        // trace (and buffer the spans of) whatever they like.
         std::function<void(
                 RequestHandler&,
                 std::string_view params,
                 bool recurse,
-                std::function<void(Response)>)>
+                bool trust_trace,
+                response_callback)>
                 mq;
     };
 
@@ -222,13 +456,17 @@ class RequestHandler {
 
     // Process a client request taking encoded json to be parsed containing something like
     // `{"method": "abc", "params": {"some_arg": 1}}`, dispatching to the appropriate request
-    // handler.
-    void process_client_req(std::string_view req_json, std::function<void(Response)> cb);
+    // handler.  `capture_via` is the transport the request arrived over directly from a client,
+    // for the traffic capture; requests without one (i.e. those from onion requests) aren't
+    // captured.
+    void process_client_req(
+            std::string_view req_json,
+            response_callback cb,
+            std::optional<TrafficCapture::transport> capture_via = std::nullopt);
 
     // Processes a pre-parsed client request taking the method name ("store", "retrieve", etc.)
     // and the json params object.
-    void process_client_req(
-            std::string_view method, nlohmann::json params, std::function<void(Response)> cb);
+    void process_client_req(std::string_view method, nlohmann::json params, response_callback cb);
 
     // Processes a swarm test request; if it succeeds the callback is immediately invoked,
     // otherwise the test is scheduled for retries for some time until it succeeds, fails, or
@@ -250,7 +488,7 @@ class RequestHandler {
     //
     // Returns (via the response callback) the oxend JSON object on success; on failure returns
     // a failure response with a body of the error string.
-    void process_oxend_request(const nlohmann::json& params, std::function<void(Response)> cb);
+    void process_oxend_request(const nlohmann::json& params, response_callback cb);
 
     // Test only: retrieve all db entries
     Response process_retrieve_all();
@@ -0,0 +1,278 @@
+#include "traffic_capture.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/random.hpp>
+
+#include <oxenc/bt_serialize.h>
+#include <oxenc/endian.h>
+#include <oxenc/hex.h>
+#include <nlohmann/json.hpp>
+#include <sodium/crypto_shorthash.h>
+#include <sodium/randombytes.h>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace oxenss::rpc {
+
+static auto logcat = log::Cat("capture");
+
+static void append_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+static void append_le64(std::string& out, uint64_t v) {
+    oxenc::host_to_little_inplace(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static bool read_varint(std::string_view& in, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        auto c = static_cast<unsigned char>(in.front());
+        in.remove_prefix(1);
+        v |= uint64_t{c & 0x7fu} << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool read_le64(std::string_view& in, uint64_t& v) {
+    if (in.size() < 8)
+        return false;
+    v = oxenc::load_little_to_host<uint64_t>(in.data());
+    in.remove_prefix(8);
+    return true;
+}
+
+static uint64_t to_threshold(double rate) {
+    if (!(rate > 0))
+        return 0;
+    if (rate >= 1)
+        return std::numeric_limits<uint64_t>::max();
+    return static_cast<uint64_t>(rate * 0x1p64);
+}
+
+TrafficCapture::TrafficCapture(std::filesystem::path path, double sample_rate, uint64_t max_size) :
+        started_{std::chrono::steady_clock::now()},
+        threshold_{to_threshold(sample_rate)},
+        max_size_{max_size},
+        last_flush_{started_} {
+    randombytes_buf(key_.data(), key_.size());
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_)
+        throw std::runtime_error{"Unable to open request capture file " + path.string()};
+
+    buf_ += MAGIC;
+    append_le64(
+            buf_,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count());
+    flush_locked();
+    log::info(
+            logcat,
+            "Capturing {:.2f}% of client requests to {}",
+            sample_rate * 100,
+            path.string());
+}
+
+TrafficCapture::~TrafficCapture() {
+    flush();
+}
+
+bool TrafficCapture::sample() const {
+    return threshold_ == std::numeric_limits<uint64_t>::max() ||
+           (threshold_ && util::rng()() < threshold_);
+}
+
+std::optional<TrafficCapture::pending> TrafficCapture::start(
+        transport via, std::string_view method, size_t params_size, bool bt) {
+    if (full_.load(std::memory_order_relaxed) || !sample())
+        return std::nullopt;
+
+    std::optional<pending> p{std::in_place};
+    p->started = std::chrono::steady_clock::now();
+    auto& r = p->rec;
+    r.arrival = std::chrono::duration_cast<std::chrono::microseconds>(p->started - started_);
+    r.via = via;
+    r.bt = bt;
+    r.method = method.substr(0, 255);
+    r.params_size = params_size;
+    return p;
+}
+
+void TrafficCapture::set_account(pending& p, std::string_view pubkey) const {
+    if (pubkey.empty()) {
+        p.rec.account = 0;
+        return;
+    }
+    // Hash the same account the same way however the request encoded its pubkey
+    std::string bytes;
+    if (pubkey.size() % 2 == 0 && oxenc::is_hex(pubkey)) {
+        bytes = oxenc::from_hex(pubkey);
+        pubkey = bytes;
+    }
+    std::array<unsigned char, crypto_shorthash_BYTES> h;
+    crypto_shorthash(
+            h.data(),
+            reinterpret_cast<const unsigned char*>(pubkey.data()),
+            pubkey.size(),
+            key_.data());
+    p.rec.account = oxenc::load_little_to_host<uint64_t>(h.data());
+    if (p.rec.account == 0)
+        p.rec.account = 1;  // 0 means no pubkey
+}
+
+void TrafficCapture::finish(pending&& p, uint16_t status, size_t response_size) {
+    auto now = std::chrono::steady_clock::now();
+    p.rec.duration = std::chrono::duration_cast<std::chrono::microseconds>(now - p.started);
+    p.rec.status = status;
+    p.rec.response_size = response_size;
+    auto rec = serialize(p.rec);
+
+    std::lock_guard lock{mutex_};
+    if (full_)
+        return;
+    if (written_ + buf_.size() + rec.size() > max_size_) {
+        log::warning(logcat, "Request capture reached its size limit; no longer capturing");
+        full_ = true;
+        flush_locked();
+        return;
+    }
+    buf_ += rec;
+    captured_++;
+    if (buf_.size() >= FLUSH_SIZE || now - last_flush_ >= FLUSH_INTERVAL) {
+        last_flush_ = now;
+        flush_locked();
+    }
+}
+
+void TrafficCapture::flush() {
+    std::lock_guard lock{mutex_};
+    flush_locked();
+}
+
+void TrafficCapture::flush_locked() {
+    if (buf_.empty())
+        return;
+    out_.write(buf_.data(), buf_.size());
+    out_.flush();
+    written_ += buf_.size();
+    buf_.clear();
+    if (!out_ && !full_) {
+        log::warning(logcat, "Failed to write captured requests; no longer capturing");
+        full_ = true;
+    }
+}
+
+std::string TrafficCapture::serialize(const record& r) {
+    std::string out;
+    out.reserve(32 + r.method.size());
+    append_varint(out, r.arrival.count());
+    append_varint(out, r.duration.count());
+    out += static_cast<char>((static_cast<uint8_t>(r.via) & 0x03) | (r.bt ? 0x04 : 0));
+    auto method = std::string_view{r.method}.substr(0, 255);
+    out += static_cast<char>(method.size());
+    out += method;
+    append_varint(out, r.params_size);
+    append_varint(out, r.status);
+    append_varint(out, r.response_size);
+    append_le64(out, r.account);
+    return out;
+}
+
+std::string TrafficCapture::request_pubkey(std::string_view params) {
+    if (params.empty())
+        return {};
+    if (params.front() != 'd') {
+        auto json = nlohmann::json::parse(params, nullptr, false);
+        return json.is_discarded() ? std::string{} : json_pubkey(json);
+    }
+    try {
+        oxenc::bt_dict_consumer d{params};
+        if (d.skip_until("pubkey"))
+            return d.consume_string();
+        if (d.skip_until("requests")) {
+            auto reqs = d.consume_list_consumer();
+            if (!reqs.is_finished()) {
+                auto req = reqs.consume_dict_consumer();
+                if (req.skip_until("params")) {
+                    auto sub = req.consume_dict_consumer();
+                    if (sub.skip_until("pubkey"))
+                        return sub.consume_string();
+                }
+            }
+        }
+    } catch (const std::exception&) {
+        // Not our problem here: the request handler will reject it
+    }
+    return {};
+}
+
+std::string TrafficCapture::json_pubkey(const nlohmann::json& params) {
+    if (!params.is_object())
+        return {};
+    if (auto it = params.find("pubkey"); it != params.end() && it->is_string())
+        return it->get<std::string>();
+    if (auto it = params.find("requests");
+        it != params.end() && it->is_array() && !it->empty() && it->front().is_object())
+        if (auto sub = it->front().find("params"); sub != it->front().end())
+            return json_pubkey(*sub);
+    return {};
+}
+
+TrafficCapture::capture_log TrafficCapture::read(const std::filesystem::path& path) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in)
+        throw std::runtime_error{"Unable to open " + path.string()};
+    std::string data{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    std::string_view s{data};
+
+    uint64_t started;
+    if (s.substr(0, MAGIC.size()) != MAGIC)
+        throw std::runtime_error{path.string() + " is not a request capture"};
+    s.remove_prefix(MAGIC.size());
+    if (!read_le64(s, started))
+        throw std::runtime_error{path.string() + " is truncated"};
+
+    capture_log result;
+    result.started = std::chrono::system_clock::time_point{
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::microseconds{started})};
+    while (!s.empty()) {
+        record r;
+        uint64_t arrival, duration, status;
+        if (!read_varint(s, arrival) || !read_varint(s, duration) || s.size() < 2)
+            break;
+        auto flags = static_cast<uint8_t>(s[0]);
+        auto method_len = static_cast<uint8_t>(s[1]);
+        s.remove_prefix(2);
+        if (s.size() < method_len)
+            break;
+        r.method = s.substr(0, method_len);
+        s.remove_prefix(method_len);
+        if (!read_varint(s, r.params_size) || !read_varint(s, status) ||
+            !read_varint(s, r.response_size) || !read_le64(s, r.account))
+            break;
+        r.arrival = std::chrono::microseconds{arrival};
+        r.duration = std::chrono::microseconds{duration};
+        r.via = static_cast<transport>(flags & 0x03);
+        r.bt = flags & 0x04;
+        r.status = static_cast<uint16_t>(status);
+        result.records.push_back(std::move(r));
+    }
+    std::stable_sort(
+            result.records.begin(), result.records.end(), [](const record& a, const record& b) {
+                return a.arrival < b.arrival;
+            });
+    return result;
+}
+
+}  // namespace oxenss::rpc
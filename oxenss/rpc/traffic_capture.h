@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace oxenss::rpc {
+
+using namespace std::literals;
+
+/// Opt-in, sampled recording of the client requests we receive into a compact binary log, so that
+/// real request mixes can be replayed against a test node later (see bench_load --replay).
+///
+/// Payloads are never recorded: a captured request is just its method, transport, encoding and
+/// parameter size, when it arrived and how long we took to answer it, the response status and
+/// size, and a keyed (SipHash) hash of the account pubkey it was for.  The hash key is random for
+/// each capture, so requests for the same account can be told apart from those for others within a
+/// capture, but can't be traced back to the account or linked across captures.
+///
+/// The log starts with MAGIC and the capture's start time (as little-endian microseconds since
+/// the epoch), followed by records of:
+/// - arrival time, in microseconds since the start time (varint)
+/// - time to respond, in microseconds (varint)
+/// - flags byte: the transport in the low 2 bits, and 0x04 if the params were bt-encoded
+/// - method name length (1 byte) and method name
+/// - params size, response status and response size (varints)
+/// - account hash (8 bytes, little-endian; 0 if the request had no pubkey)
+///
+/// Records are written when a request finishes, so they are not quite in arrival order.
+class TrafficCapture {
+  public:
+    enum class transport : uint8_t { https = 0, omq = 1, quic = 2 };
+
+    inline constexpr static std::string_view MAGIC = "OXSSCAP\x01"sv;
+    inline constexpr static double DEFAULT_SAMPLE_RATE = 0.01;
+    inline constexpr static uint64_t DEFAULT_MAX_SIZE = 1024 * 1024 * 1024;
+    // Buffered records get written out once there are this many bytes of them, or once they are
+    // this old.
+    inline constexpr static size_t FLUSH_SIZE = 64 * 1024;
+    inline constexpr static auto FLUSH_INTERVAL = 1s;
+
+    struct record {
+        std::chrono::microseconds arrival{0};  // Since the start of the capture
+        std::chrono::microseconds duration{0};
+        transport via = transport::https;
+        bool bt = false;
+        std::string method;
+        uint64_t params_size = 0;
+        uint16_t status = 0;
+        uint64_t response_size = 0;
+        uint64_t account = 0;
+    };
+
+    // A request being captured (returned by start() for a sampled request)
+    struct pending {
+        std::chrono::steady_clock::time_point started;
+        record rec;
+    };
+
+    /// Starts a capture into `path`, replacing any existing file; throws if the file can't be
+    /// created.  Captures a `sample_rate` fraction (from 0 to 1) of requests, and stops once the
+    /// log reaches `max_size` bytes.
+    TrafficCapture(
+            std::filesystem::path path,
+            double sample_rate = DEFAULT_SAMPLE_RATE,
+            uint64_t max_size = DEFAULT_MAX_SIZE);
+
+    // Writes out whatever is still buffered
+    ~TrafficCapture();
+
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+    /// Called when a client request arrives: samples it and, if it is to be captured, returns its
+    /// record-in-progress, to be given to finish() along with the response.
+    std::optional<pending> start(
+            transport via, std::string_view method, size_t params_size, bool bt);
+
+    /// Sets the account of a request being captured, given the pubkey from its params (see
+    /// request_pubkey) in any of its encodings.
+    void set_account(pending& p, std::string_view pubkey) const;
+
+    /// Completes and records a request started with start().
+    void finish(pending&& p, uint16_t status, size_t response_size);
+
+    /// Writes out buffered records.
+    void flush();
+
+    /// The number of requests captured so far
+    uint64_t captured() const { return captured_.load(std::memory_order_relaxed); }
+
+    /// Extracts the account pubkey from a request's json or bt-encoded params (or those of its
+    /// first subrequest, for batch-like requests), for set_account(); empty if there isn't one.
+    static std::string request_pubkey(std::string_view params);
+    // The same, for already-parsed json params
+    static std::string json_pubkey(const nlohmann::json& params);
+
+    /// Encodes a record in the log format.
+    static std::string serialize(const record& r);
+
+    struct capture_log {
+        std::chrono::system_clock::time_point started;
+        std::vector<record> records;  // Sorted by arrival time
+    };
+
+    /// Reads a capture log; throws std::runtime_error if it is not one.  A truncated last record
+    /// (as left by a node that didn't shut down cleanly) is ignored.
+    static capture_log read(const std::filesystem::path& path);
+
+  private:
+    bool sample() const;
+    void flush_locked();
+
+    const std::chrono::steady_clock::time_point started_;
+    const uint64_t threshold_;  // A random 64-bit value below this gets captured
+    const uint64_t max_size_;
+    std::array<unsigned char, 16> key_;  // SipHash key for account hashes
+
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::string buf_;
+    uint64_t written_ = 0;
+    std::chrono::steady_clock::time_point last_flush_;
+    std::atomic<bool> full_ = false;
+    std::atomic<uint64_t> captured_ = 0;
+};
+
+}  // namespace oxenss::rpc
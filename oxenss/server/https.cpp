@@ -6,6 +6,8 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/latency.hpp>
+#include <oxenss/utils/probes.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/file.hpp>
 
@@ -25,6 +27,9 @@ static auto logcat = log::Cat("server");
 
 using nlohmann::json;
 
+// Response body for client requests refused or dropped by admission control
+constexpr auto busy_msg = "Server busy, try again later"sv;
+
 // Sends an error response and finalizes the response.
 void HTTPS::error_response(
         HttpResponse& res, http::response_code code, std::optional<std::string_view> body) const {
@@ -57,15 +62,19 @@ HTTPS::HTTPS(
         snode::ServiceNode& sn,
         rpc::RequestHandler& rh,
         rpc::RateLimiter& rl,
+        TlsSessions& tls,
         std::vector<std::tuple<std::string, uint16_t, bool>> bind,
         const std::filesystem::path& ssl_cert,
         const std::filesystem::path& ssl_key,
         const std::filesystem::path& ssl_dh,
-        crypto::legacy_keypair legacy_keys) :
+        crypto::legacy_keypair legacy_keys,
+        size_t threads,
+        std::function<void(size_t)> thread_init) :
         service_node_{sn},
         omq_{*service_node_.omq_server()},
         request_handler_{rh},
         rate_limiter_{rl},
+        tls_sessions_{tls},
         legacy_keys_{std::move(legacy_keys)} {
     // Add a category for handling incoming https requests
     omq_.add_category(
@@ -77,27 +86,23 @@ HTTPS::HTTPS(
 
     // uWS is designed to work from a single thread, which is good (we pull off the requests and
     // then stick them into the LMQ job queue to be scheduled along with other jobs).  But as a
-    // consequence, we need to create everything inside that thread.  We *also* need to get the
-    // (thread local) event loop pointer back from the thread so that we can shut it down later
-    // (injecting a callback into it is one of the few thread-safe things we can do across
-    // threads).
+    // consequence, we need to create everything inside that thread.  To use more than one core
+    // we run several such threads, each with its own event loop and app listening on the same
+    // addresses.  We *also* need to get the (thread local) event loop pointer back from each
+    // thread so that we can shut it down later (injecting a callback into it is one of the few
+    // thread-safe things we can do across threads).
+    //
+    // Things we need in the owning thread, fulfilled from each http thread:
     //
-    // Things we need in the owning thread, fulfilled from the http thread:
-
     // - the uWS::Loop* for the event loop thread (which is thread_local).  We can get this
-    // during
-    //   thread startup, after the thread does basic initialization.
-    std::promise<uWS::Loop*> loop_promise;
-    auto loop_future = loop_promise.get_future();
-
-    // - the us_listen_socket_t* on which the server is listening.  We can't get this until we
-    //   actually start listening, so wait until `start()` for it.  (We also double-purpose it
+    //   during thread startup, after the thread does basic initialization.
+    //
+    // - the us_listen_socket_t*s on which the loop is listening.  We can't get these until we
+    //   actually start listening, so wait until `start()` for them.  (We also double-purpose it
     //   to send back an exception if one fires during startup).
-    std::promise<std::vector<us_listen_socket_t*>> startup_success_promise;
-    startup_success_ = startup_success_promise.get_future();
-
-    // Things we need to send from the owning thread to the event loop thread:
-    // - a signal when the thread should bind to the port and start the event loop (when we call
+    //
+    // Things we need to send from the owning thread to the event loop threads:
+    // - a signal when the threads should bind to the port and start the event loop (when we call
     //   start()).
     // startup_promise_
 
@@ -106,84 +111,142 @@ HTTPS::HTTPS(
             .cert_file_name = ssl_cert.c_str(),
             .dh_params_file_name = ssl_dh.c_str()};
 
-    server_thread_ = std::thread{
-            [this, bind = std::move(bind), &https_opts](
-                    std::promise<uWS::Loop*> loop_promise,
-                    std::future<bool> startup_future,
-                    std::promise<std::vector<us_listen_socket_t*>> startup_success) {
-                uWS::SSLApp https{https_opts};
-                try {
-                    create_endpoints(https);
-                } catch (...) {
-                    loop_promise.set_exception(std::current_exception());
-                    return;
-                }
-                // We've initialized, signal the calling thread
-                loop_promise.set_value(uWS::Loop::get());
-                // Now wait until we get the signal to go (sent when the caller calls start() call).
-                if (!startup_future.get())
-                    // False means cancel, i.e. we got destroyed/shutdown without start() being
-                    // called
-                    return;
-
-                // we don't currently do cors
-                // cors_ = {...};
-
-                std::vector<us_listen_socket_t*> listening;
-                try {
-                    bool required_bind_failed = false;
-                    for (const auto& [addr, port, required] : bind)
-                        https.listen(
-                                addr,
-                                port,
-                                LIBUS_LISTEN_EXCLUSIVE_PORT,
-                                [&listening,
-                                 req = required,
-                                 &required_bind_failed,
-                                 addr = fmt::format("{}:{}", addr, port)](
-                                        us_listen_socket_t* sock) {
-                                    if (sock) {
-                                        log::info(logcat, "HTTPS server listening at {}", addr);
-                                        listening.push_back(sock);
-                                    } else if (req) {
-                                        required_bind_failed = true;
-                                        log::critical(
-                                                logcat,
-                                                "HTTPS server failed to bind to required address "
-                                                "{}",
-                                                addr);
-                                    } else {
-                                        log::warning(
-                                                logcat,
-                                                "HTTPS server failed to bind to (non-required) "
-                                                "address {}",
-                                                addr);
-                                    }
-                                });
-
-                    if (listening.empty() || required_bind_failed) {
-                        std::ostringstream error;
-                        error << "RPC HTTP server failed to bind; ";
-                        if (listening.empty())
-                            error << "no valid bind address(es) given; ";
-                        error << "tried to bind to:";
-                        for (const auto& [addr, port, required] : bind)
-                            error << ' ' << addr << ':' << port;
-                        throw std::runtime_error{error.str()};
-                    }
-                } catch (...) {
-                    startup_success.set_exception(std::current_exception());
-                    return;
-                }
-                startup_success.set_value(std::move(listening));
+    auto startup_future = startup_promise_.get_future().share();
+    threads = std::max<size_t>(threads, 1);
+    loops_.resize(threads);
+    std::vector<std::future<uWS::Loop*>> loop_futures;
+    for (size_t i = 0; i < threads; i++) {
+        std::promise<uWS::Loop*> loop_promise;
+        loop_futures.push_back(loop_promise.get_future());
+        std::promise<std::vector<us_listen_socket_t*>> startup_success;
+        loops_[i].startup_success = startup_success.get_future();
+        loops_[i].thread = std::thread{
+                [this, i, &https_opts, &bind, thread_init](
+                        std::promise<uWS::Loop*> loop_promise,
+                        std::shared_future<bool> startup_future,
+                        std::promise<std::vector<us_listen_socket_t*>> startup_success) {
+                    if (thread_init)
+                        thread_init(i);
+                    run_loop(
+                            i,
+                            https_opts,
+                            bind,
+                            std::move(loop_promise),
+                            std::move(startup_future),
+                            std::move(startup_success));
+                },
+                std::move(loop_promise),
+                startup_future,
+                std::move(startup_success)};
+    }
 
-                https.run();
-            },
-            std::move(loop_promise),
-            startup_promise_.get_future(),
-            std::move(startup_success_promise)};
+    // `https_opts` and `bind` are only used by the threads until they send us their loop (and
+    // have thus finished setting up, and copied what they need).
+    try {
+        for (size_t i = 0; i < threads; i++)
+            loops_[i].loop = loop_futures[i].get();
+    } catch (...) {
+        // Wait for the rest to finish setting up, then tell them to give up
+        for (size_t i = 0; i < threads; i++)
+            if (loop_futures[i].valid())
+                loop_futures[i].wait();
+        startup_promise_.set_value(false);
+        for (auto& l : loops_)
+            l.thread.join();
+        throw;
+    }
+}
 
-    loop_ = loop_future.get();
+size_t HTTPS::default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency() / 4);
+}
+
+void HTTPS::run_loop(
+        size_t index,
+        const uWS::SocketContextOptions& opts,
+        const std::vector<std::tuple<std::string, uint16_t, bool>>& bind_addrs,
+        std::promise<uWS::Loop*> loop_promise,
+        std::shared_future<bool> startup_future,
+        std::promise<std::vector<us_listen_socket_t*>> startup_success) {
+    auto bind = bind_addrs;
+    uWS::SSLApp https{opts};
+    try {
+        tls_sessions_.install(static_cast<ssl_ctx_st*>(https.getNativeHandle()));
+        create_endpoints(https);
+    } catch (...) {
+        loop_promise.set_exception(std::current_exception());
+        return;
+    }
+    // We've initialized, signal the calling thread
+    loop_promise.set_value(uWS::Loop::get());
+    // Now wait until we get the signal to go (sent when the caller calls start() call).
+    if (!startup_future.get())
+        // False means cancel, i.e. we got destroyed/shutdown without start() being called
+        return;
+
+    // we don't currently do cors
+    // cors_ = {...};
+
+    // With a single loop we insist on having the port to ourselves (so that we fail, rather than
+    // silently sharing it, if something else is already listening on it); with several each of
+    // them needs to bind with SO_REUSEPORT, which is what uSockets does by default.
+    const int listen_opts = loops_.size() > 1 ? LIBUS_LISTEN_DEFAULT : LIBUS_LISTEN_EXCLUSIVE_PORT;
+    // Every loop binds the same addresses, so only the first one logs about it
+    const bool log_binds = index == 0;
+
+    std::vector<us_listen_socket_t*> listening;
+    try {
+        bool required_bind_failed = false;
+        for (const auto& [addr, port, required] : bind)
+            https.listen(
+                    addr,
+                    port,
+                    listen_opts,
+                    [&listening,
+                     req = required,
+                     &required_bind_failed,
+                     log_binds,
+                     addr = fmt::format("{}:{}", addr, port)](us_listen_socket_t* sock) {
+                        if (sock)
+                            listening.push_back(sock);
+                        else if (req)
+                            required_bind_failed = true;
+                        if (!log_binds)
+                            return;
+                        if (sock)
+                            log::info(logcat, "HTTPS server listening at {}", addr);
+                        else if (req)
+                            log::critical(
+                                    logcat,
+                                    "HTTPS server failed to bind to required address {}",
+                                    addr);
+                        else
+                            log::warning(
+                                    logcat,
+                                    "HTTPS server failed to bind to (non-required) address {}",
+                                    addr);
+                    });
+
+        if (listening.empty() || required_bind_failed) {
+            std::ostringstream error;
+            error << "RPC HTTP server failed to bind; ";
+            if (listening.empty())
+                error << "no valid bind address(es) given; ";
+            error << "tried to bind to:";
+            for (const auto& [addr, port, required] : bind)
+                error << ' ' << addr << ':' << port;
+            throw std::runtime_error{error.str()};
+        }
+    } catch (...) {
+        // Close whatever we did bind so that the loop has nothing left to run
+        for (auto* s : listening)
+            us_listen_socket_close(/*ssl=*/true, s);
+        startup_success.set_exception(std::current_exception());
+        return;
+    }
+    startup_success.set_value(std::move(listening));
+
+    https.run();
 }
 
 bool HTTPS::check_ready(HttpResponse& res) {
@@ -193,6 +256,10 @@ bool HTTPS::check_ready(HttpResponse& res) {
                 res, http::SERVICE_UNAVAILABLE, "Service node is not ready: " + reason + "\n");
         return false;
     }
+    if (service_node_.draining()) {
+        error_response(res, http::SERVICE_UNAVAILABLE, "Service node is shutting down\n");
+        return false;
+    }
     return true;
 }
 
@@ -209,10 +276,11 @@ void queue_response_internal(
         https.add_generic_headers(r);
 
         const bool is_json = std::holds_alternative<json>(res.body);
+        const bool json_type = is_json || res.encoding == rpc::body_encoding::json;
         if (std::none_of(begin(res.headers), end(res.headers), [](const auto& h) {
                 return util::string_iequal(h.first, "content-type");
             }))
-            r.writeHeader("Content-Type", is_json ? "application/json" : "text/plain");
+            r.writeHeader("Content-Type", json_type ? "application/json" : "text/plain");
         for (const auto& [h, v] : res.headers)
             r.writeHeader(h, v);
 
@@ -236,21 +304,24 @@ namespace {
         HTTPS& https;
         oxenmq::OxenMQ& omq;
         HttpResponse& res;
+        // The event loop that owns the connection, which replies have to be sent from
+        uWS::Loop* loop;
         Request request;
         std::vector<std::pair<std::string, std::string>> extra_headers;
         bool aborted{false};
         bool replied{false};
 
         call_data(HTTPS& https, oxenmq::OxenMQ& omq, HttpResponse& res) :
-                https{https}, omq{omq}, res{res} {}
+                https{https}, omq{omq}, res{res}, loop{uWS::Loop::get()} {}
 
         // If we have to drop the request because we are overloaded we want to reply with an
         // error (so that we close the connection instead of leaking it and leaving it hanging).
         // We don't do this, of course, if the request got aborted and replied to.
         ~call_data() {
+            https.body_buffers().release(std::move(request.body));
             if (replied || aborted)
                 return;
-            https.loop_defer([&https = https, &res = res] {
+            HTTPS::loop_defer(loop, [&https = https, &res = res] {
                 https.error_response(
                         res, http::SERVICE_UNAVAILABLE, "Server busy, try again later");
             });
@@ -277,8 +348,9 @@ namespace {
         if (!data || data->replied)
             return;
         data->replied = true;
-        data->https.loop_defer(
-                [data = std::move(data), res = std::move(res), force_close]() mutable {
+        auto* loop = data->loop;
+        HTTPS::loop_defer(
+                loop, [data = std::move(data), res = std::move(res), force_close]() mutable {
                     if (data->aborted)
                         return;
                     queue_response_internal(data->https, data->res, std::move(res), force_close);
@@ -349,38 +421,42 @@ namespace {
 
     // Sets up a request handler that processes the initial incoming requests, sets up the
     // appropriate handlers for incoming data, and invokes the `ready` callback once all data
-    // has been received (i.e. when the request is complete).  Can optionally call `prevalidate`
-    // on the partial call_data: it will have everything except for the body set (and can be
-    // used, for instance, to abort a request based only on headers); it will also be called
-    // from the same thread calling handle_request (typically the http thread), *not* a worker
-    // thread.
+    // has been received (i.e. when the request is complete).  Requests with bodies larger than
+    // `max_body` are refused: as soon as the Content-Length says so, or otherwise as soon as
+    // that much data has arrived.  Can optionally call `prevalidate` on the partial call_data: it
+    // will have everything except for the body set (and can be used, for instance, to abort a
+    // request based only on headers); it will also be called from the same thread calling
+    // handle_request (typically the http thread), *not* a worker thread.
     template <typename ReadyCallback>
     static void handle_request(
             HTTPS& https,
             oxenmq::OxenMQ& omq,
             HttpRequest& req,
             HttpResponse& res,
+            uint64_t max_body,
             ReadyCallback ready,
             std::function<void(call_data& c)> prevalidate = nullptr) {
+        uint64_t length = 0;
         if (auto len = req.getHeader("content-length"); !len.empty()) {
-            if (uint64_t length; !util::parse_int(len, length)) {
+            if (!util::parse_int(len, length)) {
                 log::warning(
                         logcat,
                         "Received HTTPS request from {} with invalid Content-Length, dropping",
                         get_remote_address(res));
-                queue_response_internal(
+                return queue_response_internal(
                         https,
                         res,
                         rpc::Response{http::BAD_REQUEST, "invalid Content-Length"sv},
                         true);
-            } else if (length > MAX_REQUEST_BODY_SIZE) {
+            }
+            if (length > max_body) {
                 log::warning(
                         logcat,
                         "Received HTTPS request from {} with too-large body ({} > {}), dropping",
                         get_remote_address(res),
                         length,
-                        MAX_REQUEST_BODY_SIZE);
-                queue_response_internal(
+                        max_body);
+                return queue_response_internal(
                         https,
                         res,
                         rpc::Response{http::PAYLOAD_TOO_LARGE, "Request body too large"sv},
@@ -394,6 +470,9 @@ namespace {
         request.uri = req.getUrl();
         for (const auto& [header, value] : req)
             request.headers[std::string{header}] = value;
+        // Allocate the whole body up front (so that it doesn't get reallocated as it grows), but
+        // only up to a point: beyond that it grows as the data actually arrives.
+        request.body = https.body_buffers().acquire(std::min(length, MAX_BODY_PRESIZE));
 
         https.handle_cors(req, request.headers);
         log::debug(
@@ -407,9 +486,28 @@ namespace {
             prevalidate(*data);
 
         res.onAborted([data] { data->aborted = true; });
-        res.onData([data = std::move(data), ready = std::move(ready)](
+        res.onData([data = std::move(data), ready = std::move(ready), max_body](
                            std::string_view d, bool done) mutable {
-            data->request.body += d;
+            if (!data || data->replied || data->aborted)
+                return;
+            auto& body = data->request.body;
+            if (body.size() + d.size() > max_body) {
+                log::warning(
+                        logcat,
+                        "HTTPS request body from {} exceeded {} bytes, dropping",
+                        data->request.remote_addr,
+                        max_body);
+                data->replied = true;
+                queue_response_internal(
+                        data->https,
+                        data->res,
+                        rpc::Response{http::PAYLOAD_TOO_LARGE, "Request body too large"sv},
+                        true);
+                // Releases the partial body now rather than whenever uWS drops this callback
+                data.reset();
+                return;
+            }
+            body += d;
             if (done)
                 ready(std::move(data));
         });
@@ -462,13 +560,16 @@ void HTTPS::create_endpoints(uWS::SSLApp& https) {
     });
 }
 
-bool HTTPS::should_rate_limit_client(std::string_view addr) {
+bool HTTPS::should_rate_limit_client(std::string_view addr, uint32_t cost) {
+    auto now = std::chrono::steady_clock::now();
+    if (addr.size() == 16)
+        return rate_limiter_.should_rate_limit_client_ipv6(addr, now, cost);
     if (addr.size() != 4)
         return true;
     uint32_t ip;
     std::memcpy(&ip, addr.data(), 4);
     oxenc::big_to_host_inplace(ip);
-    return rate_limiter_.should_rate_limit_client(ip);
+    return rate_limiter_.should_rate_limit_client(ip, now, cost);
 }
 
 void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
@@ -483,6 +584,10 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
         log::debug(logcat, "Rate limiting client request from {}", get_remote_address(res));
         return error_response(res, http::TOO_MANY_REQUESTS);
     }
+    if (service_node_.admission().refuse_client()) {
+        log::debug(logcat, "Refusing client request from {}: overloaded", get_remote_address(res));
+        return error_response(res, http::SERVICE_UNAVAILABLE, busy_msg);
+    }
     if (!req.getHeader("x-loki-long-poll").empty()) {
         // Obsolete header, return an error code
         return error_response(
@@ -494,10 +599,12 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
             omq_,
             req,
             res,
+            MAX_STORAGE_RPC_BODY_SIZE,
             [this,
              started = std::chrono::steady_clock::now()](std::shared_ptr<call_data> data) mutable {
                 auto& omq = data->omq;
                 auto& request = data->request;
+                OXENSS_PROBE(request_queued, "https");
                 omq.inject_task(
                         "https",
                         "https:" + request.uri,
@@ -505,7 +612,21 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
                         [this, data = std::move(data), started]() mutable {
                             if (data->replied || data->aborted)
                                 return;
-
+                            if (service_node_.admission().expired(started)) {
+                                log::debug(logcat, "Dropping client request that queued too long");
+                                queue_response(
+                                        std::move(data), {http::SERVICE_UNAVAILABLE, busy_msg});
+                                return;
+                            }
+                            OXENSS_PROBE(
+                                    request_start,
+                                    "https",
+                                    int64_t{std::chrono::duration_cast<std::chrono::microseconds>(
+                                                    std::chrono::steady_clock::now() - started)
+                                                    .count()});
+
+                            // Lets the request's endpoint record how long it was queued
+                            util::request_scope queued{nullptr, started};
                             try {
                                 request_handler_.process_client_req(
                                         data->request.body,
@@ -517,7 +638,8 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
                                                             std::chrono::steady_clock::now() -
                                                             started));
                                             queue_response(std::move(data), std::move(response));
-                                        });
+                                        },
+                                        rpc::TrafficCapture::transport::https);
                             } catch (const std::exception& e) {
                                 auto error = "Exception caught with processing client request: "s +
                                              e.what();
@@ -525,20 +647,31 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
                                 queue_response(
                                         std::move(data), {http::INTERNAL_SERVER_ERROR, error});
                             }
+                            OXENSS_PROBE(request_done, "https");
                         });
             });
 }
 
 void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
+    if (should_rate_limit_client(res.getRemoteAddress(), rpc::RateLimiter::ONION_REQUEST_COST)) {
+        log::debug(logcat, "Rate limiting onion request from {}", get_remote_address(res));
+        return error_response(res, http::TOO_MANY_REQUESTS);
+    }
+    if (service_node_.admission().refuse_client()) {
+        log::debug(logcat, "Refusing onion request from {}: overloaded", get_remote_address(res));
+        return error_response(res, http::SERVICE_UNAVAILABLE, busy_msg);
+    }
     handle_request(
             *this,
             omq_,
             req,
             res,
+            MAX_REQUEST_BODY_SIZE,
             [this,
              started = std::chrono::steady_clock::now()](std::shared_ptr<call_data> data) mutable {
                 auto& omq = data->omq;
                 auto& request = data->request;
+                OXENSS_PROBE(request_queued, "https");
                 omq.inject_task(
                         "https",
                         "https:" + request.uri,
@@ -546,6 +679,18 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
                         [this, data = std::move(data), started]() mutable {
                             if (data->replied || data->aborted)
                                 return;
+                            if (service_node_.admission().expired(started)) {
+                                log::debug(logcat, "Dropping client request that queued too long");
+                                queue_response(
+                                        std::move(data), {http::SERVICE_UNAVAILABLE, busy_msg});
+                                return;
+                            }
+                            OXENSS_PROBE(
+                                    request_start,
+                                    "https",
+                                    int64_t{std::chrono::duration_cast<std::chrono::microseconds>(
+                                                    std::chrono::steady_clock::now() - started)
+                                                    .count()});
 
                             rpc::OnionRequestMetadata onion{
                                     crypto::x25519_pubkey{},
@@ -589,6 +734,7 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
                                 log::error(logcat, "{}", msg);
                                 queue_response(std::move(data), {http::BAD_REQUEST, msg});
                             }
+                            OXENSS_PROBE(request_done, "https");
                         });
             });
 }
@@ -599,37 +745,82 @@ void HTTPS::start() {
 
     startup_promise_.set_value(true);
     sent_startup_ = true;
-    listen_socks_ = startup_success_.get();
+    // Collect every loop's sockets even if one of them fails, so that shutdown can still close
+    // the ones that did start listening.
+    std::exception_ptr failed;
+    for (auto& l : loops_) {
+        try {
+            l.listen_socks = l.startup_success.get();
+        } catch (...) {
+            if (!failed)
+                failed = std::current_exception();
+        }
+    }
+    if (failed)
+        std::rethrow_exception(failed);
+    log::info(logcat, "HTTPS server running {} event loop(s)", loops_.size());
 }
 
 void HTTPS::shutdown(bool join) {
-    if (!server_thread_.joinable())
+    if (loops_.empty() || !loops_.front().thread.joinable())
         return;
 
-    if (!sent_shutdown_) {
+    if (std::lock_guard lock{probe_mutex_}; !sent_shutdown_) {
         log::trace(logcat, "initiating shutdown");
         if (!sent_startup_) {
             startup_promise_.set_value(false);
             sent_startup_ = true;
-        } else if (!listen_socks_.empty()) {
-            loop_defer([this] {
-                log::trace(logcat, "closing {} listening sockets", listen_socks_.size());
-                for (auto* s : listen_socks_)
-                    us_listen_socket_close(/*ssl=*/true, s);
-                listen_socks_.clear();
-
-                closing_ = true;
-            });
+        } else {
+            closing_ = true;
+            for (auto& l : loops_) {
+                if (l.listen_socks.empty())
+                    continue;
+                loop_defer(l.loop, [&socks = l.listen_socks] {
+                    log::trace(logcat, "closing {} listening sockets", socks.size());
+                    for (auto* s : socks)
+                        us_listen_socket_close(/*ssl=*/true, s);
+                    socks.clear();
+                });
+            }
         }
         sent_shutdown_ = true;
     }
 
-    log::trace(logcat, "joining https server thread");
+    log::trace(logcat, "joining https server threads");
     if (join)
-        server_thread_.join();
+        for (auto& l : loops_)
+            l.thread.join();
     log::trace(logcat, "done shutdown");
 }
 
+void HTTPS::probe_loop_lag() {
+    std::lock_guard lock{probe_mutex_};
+    if (!sent_startup_ || sent_shutdown_)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    auto lag = probe_lag_us_.exchange(0);
+    if (probes_pending_ > 0) {
+        // A loop is still stuck behind the previous probe; don't pile more on.
+        lag = std::max<int64_t>(
+                lag,
+                std::chrono::duration_cast<std::chrono::microseconds>(now - probe_sent_).count());
+        loop_lag_us_ = lag;
+        return;
+    }
+    loop_lag_us_ = lag;
+    probe_sent_ = now;
+    probes_pending_ = loops_.size();
+    for (auto& l : loops_)
+        loop_defer(l.loop, [this, sent = now] {
+            auto lag = std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - sent)
+                               .count();
+            auto max = probe_lag_us_.load();
+            while (max < lag && !probe_lag_us_.compare_exchange_weak(max, lag)) {}
+            probes_pending_--;
+        });
+}
+
 HTTPS::~HTTPS() {
     shutdown(true);
 }
@@ -3,11 +3,18 @@
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/utils/buffer_pool.hpp>
 #include <oxenss/version.h>
+#include "tls_sessions.h"
 #include "utils.h"
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <functional>
 #include <future>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
 #include <uWebSockets/App.h>
@@ -19,8 +26,16 @@ class OxenMQ;
 namespace oxenss::server {
 using namespace std::literals;
 
-// Maximum incoming HTTPS request size, in bytes.
+// Maximum incoming HTTPS request size, in bytes.  Onion requests can get this large (they carry
+// file uploads, for instance).
 inline constexpr uint64_t MAX_REQUEST_BODY_SIZE = 10 * 1024 * 1024;
+// Maximum size of a storage_rpc request body; this comfortably fits a batch of maximum-size
+// stores.
+inline constexpr uint64_t MAX_STORAGE_RPC_BODY_SIZE = 4 * 1024 * 1024;
+// The most of a request body we allocate based on its Content-Length, before the data actually
+// arrives, so that clients can't tie up memory by claiming large bodies and then sending them
+// slowly (or not at all).
+inline constexpr uint64_t MAX_BODY_PRESIZE = 1024 * 1024;
 
 // Full uWebSocket http request/response objects:
 using HttpRequest = uWS::HttpRequest;
@@ -28,31 +43,47 @@ using HttpResponse = uWS::HttpResponse<true /*SSL*/>;
 
 class HTTPS {
   public:
+    /// The default number of event loop threads: a quarter of the available cores (but at least
+    /// one).
+    static size_t default_threads();
+
     // Construct the https server listening on one or more addresses.
     //
     // \param bind {address,port,required} tuples to bind to.  If `required` is set then the
     // constructor will throw if binding fails, if not then the construction will succeed as
     // long as at least one bind address works.
+    //
+    // \param tls TLS session resumption state, shared by all of the event loops.
+    //
+    // \param threads the number of event loop threads to run.  Each has its own uWebSockets app
+    // listening on all of the `bind` addresses (using SO_REUSEPORT when there is more than one,
+    // so that the kernel spreads incoming connections across them).
+    //
+    // \param thread_init if given, called at the start of each event loop thread (with the
+    // thread's index), e.g. to pin the thread to a core.
     HTTPS(snode::ServiceNode& sn,
           rpc::RequestHandler& rh,
           rpc::RateLimiter& rl,
+          TlsSessions& tls,
           std::vector<std::tuple<std::string, uint16_t, bool>> bind,
           const std::filesystem::path& ssl_cert,
           const std::filesystem::path& ssl_key,
           const std::filesystem::path& ssl_dh,
-          crypto::legacy_keypair legacy_keys);
+          crypto::legacy_keypair legacy_keys,
+          size_t threads = 1,
+          std::function<void(size_t)> thread_init = nullptr);
 
     ~HTTPS();
 
-    /// Starts the event loop in the thread handling http requests.  Core must have been
-    /// initialized and OxenMQ started.  Will propagate an exception from the thread if startup
+    /// Starts the event loops in the threads handling http requests.  Core must have been
+    /// initialized and OxenMQ started.  Will propagate an exception from a thread if startup
     /// fails.
     void start();
 
     /// Closes the http server connection.  Can safely be called multiple times, or to abort a
     /// startup if called before start().
     ///
-    /// \param join - if true, wait for the server thread to exit.  If false then joining will
+    /// \param join - if true, wait for the server threads to exit.  If false then joining will
     /// occur during destruction.
     void shutdown(bool join = false);
 
@@ -69,20 +100,36 @@ class HTTPS {
     /// handles cors headers by adding any needed headers to the given vector
     void handle_cors(HttpRequest& req, http::headers& extra_headers);
 
-    // Posts a callback to the uWebSockets thread loop controlling this connection; all writes
-    // must be done from that thread, and so this method is provided to defer a callback from
-    // another thread into that one.  The function should have signature `void ()`.
+    // Posts a callback to the uWebSockets thread loop controlling a connection; all writes must
+    // be done from that thread, and so this method is provided to defer a callback from another
+    // thread into that one.  `loop` is the loop that accepted the connection (i.e. the value of
+    // `uWS::Loop::get()` in the request handler).  The function should have signature `void ()`.
     template <typename Func>
-    void loop_defer(Func&& f) {
-        loop_->defer(std::forward<Func>(f));
+    static void loop_defer(uWS::Loop* loop, Func&& f) {
+        loop->defer(std::forward<Func>(f));
     }
 
     const std::string& server_header() const { return server_header_; }
 
-    bool closing() const { return closing_; }
+    bool closing() const { return closing_.load(std::memory_order_relaxed); }
+
+    size_t threads() const { return loops_.size(); }
+
+    // Posts a probe to each event loop to measure how long callbacks wait for the loop to get to
+    // them.  Meant to be called periodically: loop_lag() returns what the previous probes found
+    // (or, if a loop hasn't gotten to its probe yet, how long it has been waiting for).
+    void probe_loop_lag();
+
+    // The largest event loop lag found by the latest probes
+    std::chrono::microseconds loop_lag() const {
+        return std::chrono::microseconds{loop_lag_us_.load(std::memory_order_relaxed)};
+    }
 
     snode::ServiceNode& service_node() { return service_node_; }
 
+    // Pool of buffers for incoming request bodies
+    util::BufferPool& body_buffers() { return body_buffers_; }
+
   private:
     // Checks whether the snode is ready; if not, sets an error message and returns false (the
     // handler should return immediately).
@@ -90,28 +137,42 @@ class HTTPS {
 
     void create_endpoints(uWS::SSLApp& http);
 
-    bool should_rate_limit_client(std::string_view addr);
+    // Takes `cost` tokens from the rate limiter bucket of the client at raw address `addr`
+    bool should_rate_limit_client(std::string_view addr, uint32_t cost = 1);
 
     void process_storage_rpc_req(HttpRequest& req, HttpResponse& res);
     void process_onion_req_v2(HttpRequest& req, HttpResponse& res);
 
-    // A promise we send from outside into the event loop thread to signal it to start.  We sent
-    // "true" to go ahead with binding + starting the event loop, or false to abort.
+    // Runs in each event loop thread: sets up the app, then binds and runs it once we signal it
+    // to go ahead.
+    void run_loop(
+            size_t index,
+            const uWS::SocketContextOptions& opts,
+            const std::vector<std::tuple<std::string, uint16_t, bool>>& bind,
+            std::promise<uWS::Loop*> loop_promise,
+            std::shared_future<bool> startup_future,
+            std::promise<std::vector<us_listen_socket_t*>> startup_success);
+
+    // A promise we send from outside into the event loop threads to signal them to start.  We
+    // send "true" to go ahead with binding + starting the event loops, or false to abort.
     std::promise<bool> startup_promise_;
-    // A future (promise held by the thread) that delivers us the listening uSockets sockets so
-    // that, when we want to shut down, we can tell uWebSockets to close them (which will then
-    // run off the end of the event loop).  This also doubles to propagate listen exceptions
-    // back to us.
-    std::future<std::vector<us_listen_socket_t*>> startup_success_;
     // Whether we have sent the startup/shutdown signals
     bool sent_startup_{false}, sent_shutdown_{false};
 
-    // The uWebSockets event loop pointer (so that we can inject a callback to shut it down)
-    uWS::Loop* loop_{nullptr};
-    // The socket(s) we are listening on
-    std::vector<us_listen_socket_t*> listen_socks_;
-    // The thread in which the uWebSockets event listener is running
-    std::thread server_thread_;
+    struct event_loop {
+        // The uWebSockets event loop pointer (so that we can inject a callback to shut it down)
+        uWS::Loop* loop{nullptr};
+        // A future (promise held by the thread) that delivers us the listening uSockets sockets
+        // so that, when we want to shut down, we can tell uWebSockets to close them (which will
+        // then run off the end of the event loop).  This also doubles to propagate listen
+        // exceptions back to us.
+        std::future<std::vector<us_listen_socket_t*>> startup_success;
+        // The socket(s) this loop is listening on
+        std::vector<us_listen_socket_t*> listen_socks;
+        // The thread in which the uWebSockets event listener is running
+        std::thread thread;
+    };
+    std::vector<event_loop> loops_;
     // Cached string we send for the Server header
     std::string server_header_ =
             "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING};
@@ -120,8 +181,15 @@ class HTTPS {
     // header entirely.
     std::unordered_set<std::string> cors_;
     // Will be set to true when we're trying to shut down which closes any connections as we
-    // reply to them.  Should only be read/write from inside the uWS loop.
-    bool closing_ = false;
+    // reply to them.
+    std::atomic<bool> closing_ = false;
+    // Held while posting loop lag probes, so that shutdown can't stop the loops in between
+    std::mutex probe_mutex_;
+    // Loop lag: the latest result, the largest lag found so far by the current probes, when they
+    // were posted, and how many haven't run yet.
+    std::atomic<int64_t> loop_lag_us_{0}, probe_lag_us_{0};
+    std::chrono::steady_clock::time_point probe_sent_;
+    std::atomic<size_t> probes_pending_{0};
     // If true then always reply with 'Access-Control-Allow-Origin: *' to allow anything.
     bool cors_any_ = false;
     // Our owning service node
@@ -132,8 +200,13 @@ class HTTPS {
     rpc::RequestHandler& request_handler_;
     // Rate limiter for direct client requests
     rpc::RateLimiter& rate_limiter_;
+    // Session tickets and cache for TLS resumption
+    TlsSessions& tls_sessions_;
     // Keys for signing responses
     crypto::legacy_keypair legacy_keys_;
+    // Reusable buffers for request bodies.  Buffers up to the presize limit are pooled, i.e. the
+    // size of all but unusually large bodies.
+    util::BufferPool body_buffers_{MAX_BODY_PRESIZE};
 
     friend void queue_response_internal(
             HTTPS& https, HttpResponse& r, rpc::Response res, bool force_close);
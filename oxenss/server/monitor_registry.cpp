@@ -0,0 +1,160 @@
+#include "monitor_registry.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/memory.hpp>
+
+#include <iterator>
+#include <mutex>
+
+namespace oxenss::server {
+
+static auto logcat = log::Cat("server");
+
+namespace_set::namespace_set(const std::vector<namespace_id>& namespaces) {
+    for (auto ns : namespaces) {
+        if (in_bitmap(ns))
+            bits_ |= bit(ns);
+        else
+            others_.push_back(ns);
+    }
+    std::sort(others_.begin(), others_.end());
+    others_.erase(std::unique(others_.begin(), others_.end()), others_.end());
+}
+
+void namespace_set::merge(const namespace_set& other) {
+    bits_ |= other.bits_;
+    if (other.others_.empty() ||
+        std::includes(
+                others_.begin(), others_.end(), other.others_.begin(), other.others_.end()))
+        return;
+    std::vector<namespace_id> merged;
+    merged.reserve(others_.size() + other.others_.size());
+    std::set_union(
+            others_.begin(),
+            others_.end(),
+            other.others_.begin(),
+            other.others_.end(),
+            std::back_inserter(merged));
+    others_ = std::move(merged);
+}
+
+std::vector<namespace_id> namespace_set::to_vector() const {
+    std::vector<namespace_id> result;
+    auto it = others_.begin();
+    for (; it != others_.end() && to_int(*it) < BITMAP_MIN; ++it)
+        result.push_back(*it);
+    for (int i = 0; i < 64; i++)
+        if (bits_ & (uint64_t{1} << i))
+            result.push_back(static_cast<namespace_id>(BITMAP_MIN + i));
+    result.insert(result.end(), it, others_.end());
+    return result;
+}
+
+size_t namespace_set::heap_bytes() const {
+    return util::heap_bytes(others_);
+}
+
+void MonitorRegistry::update(std::vector<sub_info>& subs, const connection_id& conn) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& [pubkey, pubkey_hex, namespaces, want_data, batched] : subs) {
+        pubkey_t pk;
+        if (pubkey.size() != pk.size()) {
+            log::debug(logcat, "Ignoring subscription for invalid pubkey {}", pubkey_hex);
+            continue;
+        }
+        std::memcpy(pk.data(), pubkey.data(), pk.size());
+        namespace_set ns{namespaces};
+
+        auto& s = shard_for(pk);
+        std::unique_lock lock{s.mutex};
+        bool found = false;
+        for (auto [it, end] = s.monitors.equal_range(pk); it != end;) {
+            auto& mon_data = it->second;
+            if (!found && mon_data.conn == conn) {
+                mon_data.namespaces.merge(ns);
+                log::debug(
+                        logcat,
+                        "sub renewed for {} monitoring namespace(s) {}",
+                        pubkey_hex,
+                        fmt::join(mon_data.namespaces.to_vector(), ", "));
+                mon_data.reset_expiry();
+                mon_data.want_data |= want_data;
+                mon_data.batched |= batched;
+                found = true;
+            } else if (mon_data.expiry < now) {
+                // We're here anyway, so don't leave this one for the sweeper
+                it = s.monitors.erase(it);
+                count_--;
+                continue;
+            }
+            ++it;
+        }
+        if (not found) {
+            log::debug(
+                    logcat,
+                    "new subscription for {} monitoring namespace(s) {}",
+                    pubkey_hex,
+                    fmt::join(namespaces, ", "));
+            s.monitors.emplace(
+                    std::piecewise_construct,
+                    std::forward_as_tuple(pk),
+                    std::forward_as_tuple(namespaces, want_data, batched, conn));
+            count_++;
+        }
+    }
+}
+
+void MonitorRegistry::get_notifiers(
+        const user_pubkey& pk, namespace_id ns, notify_targets& targets) const {
+    pubkey_t key;
+    if (pk.raw().size() != key.size() - 1)
+        return;
+    key[0] = static_cast<unsigned char>(pk.type());
+    std::memcpy(key.data() + 1, pk.raw().data(), key.size() - 1);
+
+    auto now = std::chrono::steady_clock::now();
+    auto& s = shard_for(key);
+    std::shared_lock lock{s.mutex};
+    for (auto [it, end] = s.monitors.equal_range(key); it != end; ++it) {
+        const auto& mon_data = it->second;
+        if (mon_data.expiry < now || !mon_data.namespaces.contains(ns))
+            continue;
+        auto& vec = mon_data.batched ? (mon_data.want_data ? targets.batched_with_data
+                                                           : targets.batched)
+                                     : (mon_data.want_data ? targets.with_data : targets.to);
+        vec.push_back(mon_data.conn);
+    }
+}
+
+size_t MonitorRegistry::sweep(std::chrono::steady_clock::time_point now) {
+    size_t removed = 0;
+    // One shard at a time, so that we only ever hold up lookups on a small part of the registry
+    for (auto& s : shards_) {
+        std::unique_lock lock{s.mutex};
+        for (auto it = s.monitors.begin(); it != s.monitors.end();) {
+            if (it->second.expiry < now) {
+                it = s.monitors.erase(it);
+                removed++;
+            } else {
+                ++it;
+            }
+        }
+    }
+    count_ -= removed;
+    if (removed)
+        log::debug(logcat, "Removed {} expired subscription(s)", removed);
+    return removed;
+}
+
+size_t MonitorRegistry::memory_usage() const {
+    size_t bytes = 0;
+    for (auto& s : shards_) {
+        std::shared_lock lock{s.mutex};
+        bytes += util::hashtable_bytes(s.monitors);
+        for (auto& [pk, mon] : s.monitors)
+            bytes += mon.namespaces.heap_bytes();
+    }
+    return bytes;
+}
+
+}  // namespace oxenss::server
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <shared_mutex>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+#include <oxen/quic/connection_ids.hpp>
+#include <oxenmq/connections.h>
+
+#include "../common/namespace.h"
+#include "../common/pubkey.h"
+#include "utils.h"
+
+namespace oxenss::server {
+
+using connection_id = std::variant<oxenmq::ConnectionID, oxen::quic::ConnectionID>;
+
+using namespace std::literals;
+
+/// Set of namespaces that a subscription covers.  Namespaces in [BITMAP_MIN, BITMAP_MIN + 64),
+/// which covers all the namespaces clients currently use, are stored as bits of a single integer;
+/// any others go in a sorted vector (which is empty for nearly all subscriptions).
+class namespace_set {
+    static constexpr int BITMAP_MIN = -16;
+
+    uint64_t bits_ = 0;
+    std::vector<namespace_id> others_;  // sorted
+
+    static bool in_bitmap(namespace_id ns) {
+        return to_int(ns) >= BITMAP_MIN && to_int(ns) < BITMAP_MIN + 64;
+    }
+    static uint64_t bit(namespace_id ns) { return uint64_t{1} << (to_int(ns) - BITMAP_MIN); }
+
+  public:
+    namespace_set() = default;
+    explicit namespace_set(const std::vector<namespace_id>& namespaces);
+
+    bool contains(namespace_id ns) const {
+        if (in_bitmap(ns))
+            return bits_ & bit(ns);
+        return !others_.empty() && std::binary_search(others_.begin(), others_.end(), ns);
+    }
+
+    bool empty() const { return bits_ == 0 && others_.empty(); }
+
+    /// Adds all the namespaces of `other` to this set
+    void merge(const namespace_set& other);
+
+    /// Returns the namespaces, in ascending order
+    std::vector<namespace_id> to_vector() const;
+
+    /// Returns the heap memory used by the set (usually none)
+    size_t heap_bytes() const;
+};
+
+struct MonitorData {
+    static constexpr auto MONITOR_EXPIRY_TIME = 65min;
+
+    std::chrono::steady_clock::time_point expiry;  // When this notify reg expires
+    namespace_set namespaces;
+    connection_id conn;
+    bool want_data;  // true if the subscriber wants msg data
+    bool batched;    // true if the subscriber wants notifications batched
+
+    MonitorData(
+            const std::vector<namespace_id>& namespaces,
+            bool data,
+            bool batched,
+            connection_id c,
+            std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) :
+            expiry{std::chrono::steady_clock::now() + ttl},
+            namespaces{namespaces},
+            conn{c},
+            want_data{data},
+            batched{batched} {}
+
+    void reset_expiry(std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) {
+        expiry = std::chrono::steady_clock::now() + ttl;
+    }
+};
+
+/// The connections to notify of a new message, split by how they want to be notified
+struct notify_targets {
+    std::vector<connection_id> to;         // metadata only, sent immediately
+    std::vector<connection_id> with_data;  // with message data, sent immediately
+    std::vector<connection_id> batched;    // metadata only, batched
+    std::vector<connection_id> batched_with_data;  // with message data, batched
+
+    bool empty() const {
+        return to.empty() && with_data.empty() && batched.empty() && batched_with_data.empty();
+    }
+    bool wants_data() const { return !with_data.empty() || !batched_with_data.empty(); }
+};
+
+/// Registry of the accounts that connected clients are monitoring for push notifications.  Looking
+/// up the subscribers of a stored message happens for every message we store, so the registry is
+/// split into independently locked shards (so that lookups don't contend with each other, or with
+/// subscription updates, unless they hit the same shard), keyed by raw pubkey bytes so that lookups
+/// don't allocate.
+///
+/// Subscriptions that expire without being renewed are removed by sweep(), which should be called
+/// every SWEEP_INTERVAL.
+///
+/// All methods are thread-safe.
+class MonitorRegistry {
+  public:
+    static constexpr size_t SHARDS = 16;
+    static constexpr auto SWEEP_INTERVAL = 5min;
+
+    // Network id byte followed by the 32-byte pubkey
+    using pubkey_t = std::array<unsigned char, USER_PUBKEY_SIZE_BYTES>;
+
+    /// Adds the given subscriptions for connection `conn`.  If `conn` already monitors one of the
+    /// accounts then the subscription is renewed and extended to cover the union of the given and
+    /// existing namespaces (and the data and batching flags, if newly set).
+    void update(std::vector<sub_info>& subs, const connection_id& conn);
+
+    /// Appends the connections that should be notified of a message in namespace `ns` of account
+    /// `pk` to the appropriate list of `targets`.
+    void get_notifiers(const user_pubkey& pk, namespace_id ns, notify_targets& targets) const;
+
+    /// Removes subscriptions that expired before `now`, returning how many were removed.
+    size_t sweep(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    /// Returns the number of subscriptions (including expired ones not yet swept away)
+    size_t size() const { return count_; }
+
+    /// Returns (an estimate of) the memory used by the subscriptions, in bytes
+    size_t memory_usage() const;
+
+  private:
+    // Pubkeys are uniformly random, so we can just use some of their bytes as the hash (and a
+    // different byte to pick the shard, so that a shard's entries are still spread across all of
+    // its buckets).
+    struct pubkey_hash {
+        size_t operator()(const pubkey_t& pk) const {
+            size_t h;
+            std::memcpy(&h, pk.data() + 1, sizeof(h));
+            return h;
+        }
+    };
+    static constexpr size_t SHARD_BYTE = 1 + sizeof(size_t);
+
+    // Aligned so that shards being locked on different threads don't share cache lines
+    struct alignas(64) shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_multimap<pubkey_t, MonitorData, pubkey_hash> monitors;
+    };
+    std::array<shard, SHARDS> shards_;
+    std::atomic<size_t> count_ = 0;
+
+    shard& shard_for(const pubkey_t& pk) { return shards_[pk[SHARD_BYTE] % SHARDS]; }
+    const shard& shard_for(const pubkey_t& pk) const {
+        return shards_[pk[SHARD_BYTE] % SHARDS];
+    }
+};
+
+}  // namespace oxenss::server
@@ -2,8 +2,16 @@
 #include <sodium/crypto_sign.h>
 #include "../rpc/rate_limiter.h"
 #include "../rpc/request_handler.h"
+#include "../snode/service_node.h"
+#include "../utils/latency.hpp"
+#include "../utils/memory.hpp"
+#include "../utils/probes.hpp"
 #include "utils.h"
 
+#include <algorithm>
+#include <functional>
+#include <optional>
+
 namespace oxenss::server {
 
 static auto logcat = log::Cat("server");
@@ -14,6 +22,7 @@ void MQBase::handle_monitor_message_single(
     // Values we receive, in bt-dict order:
     std::string_view ed_pk;                         // P (ed25519 pubkey only for session ids)
     std::optional<signed_subaccount_token> subacc;  // S (token signature), T (token)
+    bool batched = false;                           // b (given and true if batching is desired)
     bool want_data = false;                         // d (given and true if data is desired)
     using namespace_int = std::underlying_type_t<namespace_id>;
     std::vector<namespace_id> namespaces;  // n (ordered list of numeric namespaces)
@@ -55,6 +64,10 @@ void MQBase::handle_monitor_message_single(
                                 SUBACCOUNT_TOKEN_LENGTH));
         }
 
+        // Flag to batch notifications together (optional)
+        if (d.skip_until("b"))
+            batched = d.consume_integer<bool>();
+
         // Flag to send full message data as part of the pushed notifications (optional)
         if (d.skip_until("d"))
             want_data = d.consume_integer<bool>();
@@ -160,7 +173,8 @@ void MQBase::handle_monitor_message_single(
         return monitor_error(out, MonitorResponse::BAD_SIG, "Signature verification failed");
     }
 
-    subs.emplace_back(std::move(pubkey), std::move(pubkey_hex), std::move(namespaces), want_data);
+    subs.emplace_back(
+            std::move(pubkey), std::move(pubkey_hex), std::move(namespaces), want_data, batched);
     out.append("success", 1);
 }
 
@@ -174,7 +188,8 @@ bool MQBase::handle_client_rpc(
         std::string_view params,
         const std::string& remote_addr,
         std::function<void(http::response_code, std::string_view)> reply,
-        bool forwarded) {
+        bool forwarded,
+        bool trust_trace) {
     // Check client rpc endpoints
     auto it = rpc::RequestHandler::client_rpc_endpoints.find(name);
     if (it == rpc::RequestHandler::client_rpc_endpoints.end())
@@ -182,30 +197,73 @@ bool MQBase::handle_client_rpc(
 
     auto& handler = it->second.mq;
 
-    if (!forwarded && rate_limiter_->should_rate_limit_client(remote_addr)) {
+    if (!forwarded && service_node_ && service_node_->draining()) {
+        reply(http::SERVICE_UNAVAILABLE, "Service node is shutting down"sv);
+        return true;
+    }
+    // Until the database is open (at startup) we can't do anything with the request except hold up
+    // a worker thread waiting for it, so refuse it (even if forwarded: the peer already has it).
+    if (service_node_ && !service_node_->db_ready()) {
+        reply(http::SERVICE_UNAVAILABLE, "Service node is not ready yet, try again later"sv);
+        return true;
+    }
+    if (!forwarded && rate_limiter_->should_rate_limit_client(
+                              remote_addr,
+                              std::chrono::steady_clock::now(),
+                              rpc::RateLimiter::endpoint_cost(name))) {
         log::debug(logcat, "Rate limiting client request from {}", remote_addr);
         reply(http::TOO_MANY_REQUESTS, "Too many requests, try again later"sv);
         return true;
     }
+    // Requests forwarded from other SNs are never refused, so that they get priority over client
+    // requests when we are overloaded.
+    if (!forwarded && service_node_ && service_node_->admission().refuse_client()) {
+        log::debug(logcat, "Refusing client request from {}: overloaded", remote_addr);
+        reply(http::SERVICE_UNAVAILABLE, "Server busy, try again later"sv);
+        return true;
+    }
+
+    bool bt_encoded = !params.empty() && params.front() == 'd';
+    std::optional<rpc::TrafficCapture::pending> captured;
+    if (auto* capture = forwarded ? nullptr : request_handler_->capture())
+        if ((captured = capture->start(
+                     quic_ ? rpc::TrafficCapture::transport::quic
+                           : rpc::TrafficCapture::transport::omq,
+                     name,
+                     params.size(),
+                     bt_encoded)))
+            capture->set_account(*captured, rpc::TrafficCapture::request_pubkey(params));
 
     try {
         handler(*request_handler_,
                 params,
                 forwarded,
-                [this, reply, bt_encoded = !params.empty() && params.front() == 'd'](
+                trust_trace,
+                [this, reply, bt_encoded, captured = std::move(captured)](
                         rpc::Response res) mutable {
                     std::string_view body;
                     std::string dump;
-
-                    if (auto* j = std::get_if<nlohmann::json>(&res.body)) {
-                        nlohmann::json resp = wrap_response(res.status, std::move(*j));
-                        if (bt_encoded)
-                            dump = bt_serialize(json_to_bt(std::move(resp)));
-                        else
-                            dump = resp.dump();
-                        body = dump;
-                    } else {
-                        body = view_body(res);
+                    {
+                        util::stage_timer timer{util::latency_stage::serialize};
+                        if (auto* j = std::get_if<nlohmann::json>(&res.body)) {
+                            nlohmann::json resp = wrap_response(res.status, std::move(*j));
+                            if (bt_encoded)
+                                dump = bt_serialize_json(resp);
+                            else
+                                dump = resp.dump();
+                            body = dump;
+                        } else if (res.encoding != rpc::body_encoding::opaque) {
+                            bool bt = res.encoding == rpc::body_encoding::bt;
+                            assert(bt == bt_encoded);
+                            auto* s = std::get_if<std::string>(&res.body);
+                            dump = wrap_serialized_response(
+                                    res.status,
+                                    s ? std::move(*s) : std::string{view_body(res)},
+                                    bt);
+                            body = dump;
+                        } else {
+                            body = view_body(res);
+                        }
                     }
 
                     log::debug(
@@ -218,6 +276,9 @@ bool MQBase::handle_client_rpc(
                             : bt_encoded ? "bt-encoded"
                                          : "json");
 
+                    if (captured)
+                        request_handler_->capture()->finish(
+                                std::move(*captured), res.status.first, body.size());
                     reply(res.status, body);
                 });
     } catch (const rpc::parse_error& e) {
@@ -272,99 +333,155 @@ void MQBase::handle_monitor(
     reply(result);
 }
 
-namespace {
-    // Merges sorted vectors a and b together, returns the sorted, combined vector (but without any
-    // duplicates).  We avoid reallocating the vectors when possible (i.e. if either is a subset of
-    // the other).
-    std::vector<namespace_id> merge_namespaces(
-            std::vector<namespace_id> a, std::vector<namespace_id> b) {
-        // If the first arg of b comes before a, then our only subset case can be b as a superset of
-        // a, so swap arguments so that the subset case always involves `a` as the superset.
-        if (!b.empty() && (a.empty() || b.front() < a.front()))
-            a.swap(b);
-        // Figure out if a is a superset of b (in which case we can just return a):
-        auto ita = a.begin(), itb = b.begin();
-        while (ita != a.end() && itb != b.end()) {
-            if (*itb > *ita)
-                ita++;  // We have an element only in a, which is fine, skip it
-            else if (*itb == *ita) {
-                ita++;  // The element is in both, which is fine.
-                itb++;
-            } else
-                break;  // We found a b that isn't in a, so we don't have a subset.
-        }
-        if (itb == b.end())
-            return a;  // We hit the end of b without any violations above, which means everything
-                       // in b is already in a.
-
-        // Otherwise we need to merge them into a new sorted container c:
-        std::vector<namespace_id> c;
-        ita = a.begin();
-        itb = b.begin();
-        while (ita != a.end() || itb != b.end()) {
-            if (itb == b.end())
-                c.push_back(*ita++);
-            else if (ita == a.end())
-                c.push_back(*itb++);
-            else if (*ita < *itb)
-                c.push_back(*ita++);
-            else if (*ita == *itb) {
-                c.push_back(*ita++);
-                itb++;  // Value is in both vectors, but we only want it once
-            } else
-                c.push_back(*itb++);
+void MQBase::update_monitors(std::vector<sub_info>& subs, connection_id conn) {
+    monitoring_.update(subs, conn);
+}
+
+void MQBase::get_notifiers(message& m, notify_targets& targets) {
+    monitoring_.get_notifiers(m.pubkey, m.msg_namespace, targets);
+}
+
+void MQBase::deliver_notifies(
+        notify_targets& targets,
+        std::string_view metadata,
+        std::string_view full,
+        std::chrono::steady_clock::time_point now) {
+    std::vector<std::pair<connection_id, uint64_t>> resync;
+    {
+        std::lock_guard lock{notify_budgets_mutex_};
+
+        // Returns the connection's budget, refilled for the time since it was last used
+        auto budget = [&](const connection_id& c) -> notify_budget& {
+            auto& b = notify_budgets_.try_emplace(c, notify_budget{NOTIFY_BUDGET_BURST, now})
+                              .first->second;
+            std::chrono::duration<double> elapsed = now - b.updated;
+            b.bytes = std::min(NOTIFY_BUDGET_BURST, b.bytes + NOTIFY_BUDGET_RATE * elapsed.count());
+            b.updated = now;
+            return b;
+        };
+        auto spend = [&](const connection_id& c, notify_budget& b, size_t size) {
+            b.bytes -= size;
+            if (b.dropped) {
+                resync.emplace_back(c, b.dropped);
+                b.dropped = 0;
+            }
+        };
+        // Removes the connections of `conns` that can't afford `size` bytes, moving them to
+        // `degrade_to` (if given) if they can still afford the metadata-only notification.
+        auto filter = [&](std::vector<connection_id>& conns,
+                          std::vector<connection_id>* degrade_to,
+                          size_t size) {
+            auto keep = [&](const connection_id& c) {
+                auto& b = budget(c);
+                if (b.bytes >= size) {
+                    spend(c, b, size);
+                    return true;
+                }
+                if (degrade_to && b.bytes >= metadata.size()) {
+                    spend(c, b, metadata.size());
+                    degrade_to->push_back(c);
+                    notifies_degraded_++;
+                } else {
+                    b.dropped++;
+                    notifies_dropped_++;
+                }
+                return false;
+            };
+            conns.erase(
+                    std::remove_if(conns.begin(), conns.end(), std::not_fn(keep)), conns.end());
+        };
+        filter(targets.to, nullptr, metadata.size());
+        filter(targets.batched, nullptr, metadata.size());
+        filter(targets.with_data, &targets.to, full.size());
+        filter(targets.batched_with_data, &targets.batched, full.size());
+    }
+
+    for (auto& [c, dropped] : resync) {
+        log::debug(logcat, "Sending resync notice after {} dropped notification(s)", dropped);
+        oxenc::bt_dict_producer d;
+        d.append("dropped", dropped);
+        notify_resync(c, d.view());
+    }
+
+    if (!targets.to.empty()) {
+        OXENSS_PROBE(notify_send, targets.to.size(), metadata.size());
+        notify(targets.to, metadata);
+    }
+    if (!targets.batched.empty()) {
+        OXENSS_PROBE(notify_send, targets.batched.size(), metadata.size());
+        queue_notify(targets.batched, metadata);
+    }
+    if (!targets.with_data.empty()) {
+        OXENSS_PROBE(notify_send, targets.with_data.size(), full.size());
+        notify(targets.with_data, full);
+    }
+    if (!targets.batched_with_data.empty()) {
+        OXENSS_PROBE(notify_send, targets.batched_with_data.size(), full.size());
+        queue_notify(targets.batched_with_data, full);
+    }
+}
+
+size_t MQBase::sweep_monitors(std::chrono::steady_clock::time_point now) {
+    {
+        std::lock_guard lock{notify_budgets_mutex_};
+        auto cutoff = now - NOTIFY_BUDGET_IDLE;
+        for (auto it = notify_budgets_.begin(); it != notify_budgets_.end();) {
+            if (it->second.updated < cutoff)
+                it = notify_budgets_.erase(it);
+            else
+                ++it;
         }
-        return c;
     }
+    return monitoring_.sweep();
+}
 
-}  // namespace
+size_t MQBase::notify_memory() {
+    size_t bytes = 0;
+    {
+        std::lock_guard lock{notify_batches_mutex_};
+        bytes += util::hashtable_bytes(notify_batches_);
+        for (auto& [c, batch] : notify_batches_)
+            bytes += util::heap_bytes(batch);
+    }
+    std::lock_guard lock{notify_budgets_mutex_};
+    return bytes + util::hashtable_bytes(notify_budgets_);
+}
 
-void MQBase::update_monitors(std::vector<sub_info>& subs, connection_id conn) {
-    std::unique_lock lock{monitoring_mutex_};
-    for (auto& [pubkey, pubkey_hex, namespaces, want_data] : subs) {
-        bool found = false;
-        for (auto [it, end] = monitoring_.equal_range(pubkey); it != end; ++it) {
-            auto& mon_data = it->second;
-            if (mon_data.conn == conn) {
-                mon_data.namespaces =
-                        merge_namespaces(std::move(mon_data.namespaces), std::move(namespaces));
-                log::debug(
-                        logcat,
-                        "sub renewed for {} monitoring namespace(s) {}",
-                        pubkey_hex,
-                        fmt::join(mon_data.namespaces, ", "));
-                mon_data.reset_expiry();
-                mon_data.want_data |= want_data;
-                found = true;
-                break;
+void MQBase::queue_notify(const std::vector<connection_id>& conns, std::string_view notification) {
+    std::vector<std::pair<connection_id, std::string>> full;
+    {
+        std::lock_guard lock{notify_batches_mutex_};
+        for (const auto& c : conns) {
+            auto it = notify_batches_.try_emplace(c).first;
+            auto& batch = it->second;
+            if (batch.empty())
+                batch += 'l';
+            batch += notification;
+            if (batch.size() >= NOTIFY_BATCH_MAX_SIZE) {
+                batch += 'e';
+                full.emplace_back(c, std::move(batch));
+                notify_batches_.erase(it);
             }
         }
-        if (not found) {
-            log::debug(
-                    logcat,
-                    "new subscription for {} monitoring namespace(s) {}",
-                    pubkey_hex,
-                    fmt::join(namespaces, ", "));
-            monitoring_.emplace(
-                    std::piecewise_construct,
-                    std::forward_as_tuple(std::move(pubkey)),
-                    std::forward_as_tuple(std::move(namespaces), want_data, conn));
-        }
+    }
+    for (auto& [c, batch] : full) {
+        OXENSS_PROBE(notify_batch_send, batch.size());
+        notify_batch(c, batch);
     }
 }
 
-void MQBase::get_notifiers(
-        message& m, std::vector<connection_id>& to, std::vector<connection_id>& with_data) {
-    auto now = std::chrono::steady_clock::now();
-    std::shared_lock lock{monitoring_mutex_};
-
-    for (auto [it, end] = monitoring_.equal_range(m.pubkey.prefixed_raw()); it != end; ++it) {
-        const auto& mon_data = it->second;
-        auto& vec = mon_data.want_data ? with_data : to;
-        if (mon_data.expiry >= now &&
-            std::binary_search(
-                    mon_data.namespaces.begin(), mon_data.namespaces.end(), m.msg_namespace))
-            vec.push_back(mon_data.conn);
+void MQBase::flush_notifies() {
+    decltype(notify_batches_) batches;
+    {
+        std::lock_guard lock{notify_batches_mutex_};
+        if (notify_batches_.empty())
+            return;
+        batches.swap(notify_batches_);
+    }
+    for (auto& [c, batch] : batches) {
+        batch += 'e';
+        OXENSS_PROBE(notify_batch_send, batch.size());
+        notify_batch(c, batch);
     }
 }
 
@@ -1,17 +1,20 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 #include <nlohmann/json_fwd.hpp>
 #include <oxen/quic/connection.hpp>
 #include <oxen/quic/connection_ids.hpp>
 #include <oxenmq/connections.h>
-#include <shared_mutex>
 
 #include "../common/namespace.h"
 #include "../snode/sn_record.h"
+#include "monitor_registry.h"
 #include "utils.h"
 
 namespace oxenss {
@@ -31,33 +34,8 @@ struct message;
 
 namespace oxenss::server {
 
-using connection_id = std::variant<oxenmq::ConnectionID, oxen::quic::ConnectionID>;
-
 using namespace std::literals;
 
-struct MonitorData {
-    static constexpr auto MONITOR_EXPIRY_TIME = 65min;
-
-    std::chrono::steady_clock::time_point expiry;  // When this notify reg expires
-    std::vector<namespace_id> namespaces;          // sorted namespace_ids
-    connection_id conn;
-    bool want_data;  // true if the subscriber wants msg data
-
-    MonitorData(
-            std::vector<namespace_id> namespaces,
-            bool data,
-            connection_id c,
-            std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) :
-            expiry{std::chrono::steady_clock::now() + ttl},
-            namespaces{std::move(namespaces)},
-            conn{c},
-            want_data{data} {}
-
-    void reset_expiry(std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) {
-        expiry = std::chrono::steady_clock::now() + ttl;
-    }
-};
-
 /// Base method for common functionality for message-queue request classes, that is, OxenMQ and
 /// BTRequestStream.
 
@@ -66,6 +44,8 @@ class MQBase {
     snode::ServiceNode* service_node_ = nullptr;
     rpc::RequestHandler* request_handler_ = nullptr;
     rpc::RateLimiter* rate_limiter_ = nullptr;
+    // Whether requests arrive over QUIC rather than OxenMQ (as recorded in request captures)
+    bool quic_ = false;
 
     // Attempts to handle the given request, by name.  Returns true if the name was found (in which
     // case the response is handled), false if not found.
@@ -74,7 +54,8 @@ class MQBase {
             std::string_view params,
             const std::string& remote_addr,
             std::function<void(http::response_code status, std::string_view body)> reply,
-            bool forwarded = false);
+            bool forwarded = false,
+            bool trust_trace = false);
 
     // Subclasses may override this to extend a json or bt response with a status code.  The default
     // returns the given response as-is.  This is primarily aimed at the QUIC implementation which
@@ -85,6 +66,15 @@ class MQBase {
         return response;
     }
 
+    // Same as the above, but for a response that the request handler has already serialized to
+    // json or (if `bt` is true) bt.
+    virtual std::string wrap_serialized_response(
+            [[maybe_unused]] const http::response_code& status,
+            std::string response,
+            [[maybe_unused]] bool bt) const {
+        return response;
+    }
+
     // Called to deal with a monitor request; `reply` is used to respond to the request itself (and
     // will be used during, not after, the method call itself); `conn` is the connection ID used to
     // send notifications back on the connection later.  `conn` is used to uniquely identify the
@@ -99,15 +89,92 @@ class MQBase {
     void update_monitors(std::vector<sub_info>& subs, connection_id conn);
 
     // Tracks accounts we are monitoring for OMQ push notification messages
-    std::unordered_multimap<std::string, MonitorData> monitoring_;
-    mutable std::shared_mutex monitoring_mutex_;
+    MonitorRegistry monitoring_;
+
+    // Batched notifications waiting for the next flush_notifies(): each value is an unterminated
+    // bt list of notification dicts
+    std::unordered_map<connection_id, std::string> notify_batches_;
+    std::mutex notify_batches_mutex_;
+
+    // Per-connection notification send budgets, so that a slow (or malicious) subscriber can't make
+    // us queue up unbounded amounts of notification data for it.
+    struct notify_budget {
+        double bytes;  // Available budget; refills at NOTIFY_BUDGET_RATE, up to NOTIFY_BUDGET_BURST
+        std::chrono::steady_clock::time_point updated;
+        uint64_t dropped = 0;  // Notifications dropped since we last told the connection to resync
+    };
+    std::unordered_map<connection_id, notify_budget> notify_budgets_;
+    std::mutex notify_budgets_mutex_;
+    std::atomic<uint64_t> notifies_degraded_ = 0;
+    std::atomic<uint64_t> notifies_dropped_ = 0;
 
   public:
-    void get_notifiers(
-            message& m, std::vector<connection_id>& to, std::vector<connection_id>& with_data);
+    // How long batched notifications are held (at most) before being sent; flush_notifies() should
+    // be called this often.
+    static constexpr auto NOTIFY_BATCH_WINDOW = 50ms;
+    // A connection's pending batch is sent immediately once it reaches this size
+    static constexpr size_t NOTIFY_BATCH_MAX_SIZE = 1'000'000;
+
+    // Each connection may be sent this many bytes of notifications per second, with bursts of up
+    // to NOTIFY_BUDGET_BURST.  Beyond that we send data notifications without the data, and if even
+    // that doesn't fit then we drop notifications (and later send the connection a resync notice).
+    static constexpr double NOTIFY_BUDGET_RATE = 1'000'000;
+    static constexpr double NOTIFY_BUDGET_BURST = 4'000'000;
+    // Budgets of connections we haven't sent anything to in this long are forgotten
+    static constexpr auto NOTIFY_BUDGET_IDLE = 10min;
+
+    void get_notifiers(message& m, notify_targets& targets);
+
+    // Sends a notification to `targets`, subject to each connection's send budget.  `metadata` is
+    // the notification without message data, `full` the notification with it (which may be empty
+    // if no target wants the data).  Note that this modifies `targets`.  `now` is the time against
+    // which budgets are refilled, and is only given by the test suite.
+    void deliver_notifies(
+            notify_targets& targets,
+            std::string_view metadata,
+            std::string_view full,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Removes expired subscriptions and idle send budgets; should be called every
+    // MonitorRegistry::SWEEP_INTERVAL.  Returns the number of subscriptions removed.  `now` is the
+    // time against which budgets are considered idle.
+    size_t sweep_monitors(
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // The number of notifications sent without the requested message data, and the number
+    // dropped entirely, because a subscriber was over its send budget.
+    uint64_t notifies_degraded() const { return notifies_degraded_; }
+    uint64_t notifies_dropped() const { return notifies_dropped_; }
+
+    // The number of push notification subscriptions (including expired ones not yet swept)
+    size_t monitor_count() const { return monitoring_.size(); }
+
+    // Estimated memory used by push notification subscriptions, and by pending notification
+    // batches and per-connection send budgets, in bytes
+    size_t monitor_memory() const { return monitoring_.memory_usage(); }
+    size_t notify_memory();
+
+    // The rate limiter applied to client requests; null until initialized
+    const rpc::RateLimiter* rate_limiter() const { return rate_limiter_; }
+
+    // The handler of client requests; null until initialized
+    const rpc::RequestHandler* request_handler() const { return request_handler_; }
 
     virtual void notify(std::vector<connection_id>&, std::string_view notification) = 0;
 
+    // Queues a notification to be sent in the next batch to each of `conns`
+    void queue_notify(const std::vector<connection_id>& conns, std::string_view notification);
+
+    // Sends out all pending notification batches
+    void flush_notifies();
+
+    // Sends a batch of notifications (a bt list of notification dicts) to a connection
+    virtual void notify_batch(const connection_id& conn, std::string_view notifications) = 0;
+
+    // Tells a connection that we dropped notifications to it (and so it should re-retrieve
+    // messages for its subscriptions); `body` is a bt-encoded dict.
+    virtual void notify_resync(const connection_id& conn, std::string_view body) = 0;
+
     virtual void reachability_test(std::shared_ptr<snode::sn_test> test) = 0;
 
     virtual ~MQBase() = default;
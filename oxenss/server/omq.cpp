@@ -8,7 +8,10 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/latency.hpp>
+#include <oxenss/utils/probes.hpp>
 #include <oxenss/utils/string_utils.hpp>
 
 #include <oxenc/base64.h>
@@ -18,8 +21,11 @@
 #include <fmt/std.h>
 #include <sodium/crypto_sign.h>
 
+#include <algorithm>
 #include <chrono>
 #include <exception>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <type_traits>
@@ -49,6 +55,11 @@ void OMQ::handle_sn_data(oxenmq::Message& message) {
     log::debug(logcat, "[OMQ]   thread id: {}", std::this_thread::get_id());
     log::debug(logcat, "[OMQ]   from: {}", oxenc::to_hex(message.conn.pubkey()));
 
+    if (!service_node_->db_ready()) {
+        log::debug(logcat, "[OMQ] Not ready for sn.data yet: database is still opening");
+        return message.send_reply(snode::SN_DATA_NOT_READY);
+    }
+
     std::stringstream ss;
 
     // We are only expecting a single part message, so consider removing this
@@ -57,15 +68,41 @@ void OMQ::handle_sn_data(oxenmq::Message& message) {
     }
 
     // TODO: process push batch should move to "Request handler"
-    service_node_->process_push_batch(ss.str());
+    db_job([this, blob = ss.str(), reply = message.send_later()]() mutable {
+        service_node_->process_push_batch(blob);
 
-    log::debug(logcat, "[OMQ] send reply");
+        log::debug(logcat, "[OMQ] send reply");
 
-    // TODO: Investigate if the above could fail and whether we should report
-    // that to the sending SN
-    message.send_reply();
+        // TODO: Investigate if the above could fail and whether we should report
+        // that to the sending SN
+        reply.reply();
+    });
 };
 
+void OMQ::handle_sync_digest(oxenmq::Message& message) {
+    if (message.data.size() != 1 || message.conn.pubkey().size() != 32)
+        return message.send_reply("invalid parameters");
+    try {
+        message.send_reply(service_node_->sync_digest(
+                crypto::x25519_pubkey::from_bytes(message.conn.pubkey()), message.data[0]));
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed sn.sync_digest request from {}: {}", message.remote, e.what());
+        message.send_reply("invalid parameters");
+    }
+}
+
+void OMQ::handle_sync_hashes(oxenmq::Message& message) {
+    if (message.data.size() != 1 || message.conn.pubkey().size() != 32)
+        return message.send_reply("invalid parameters");
+    try {
+        message.send_reply(service_node_->sync_hashes(
+                crypto::x25519_pubkey::from_bytes(message.conn.pubkey()), message.data[0]));
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed sn.sync_hashes request from {}: {}", message.remote, e.what());
+        message.send_reply("invalid parameters");
+    }
+}
+
 void OMQ::handle_ping(oxenmq::Message& message) {
     log::debug(logcat, "Remote pinged me");
     service_node_->update_last_ping(snode::ReachType::OMQ);
@@ -207,6 +244,19 @@ void OMQ::handle_get_stats(oxenmq::Message& message) {
     message.send_reply(payload);
 }
 
+void OMQ::handle_get_metrics(oxenmq::Message& message) {
+    log::debug(logcat, "Received get_metrics request via OMQ");
+
+    message.send_reply(service_node_->get_metrics());
+}
+
+void OMQ::handle_get_traces(oxenmq::Message& message) {
+    log::debug(logcat, "Received get_traces request via OMQ");
+
+    message.send_reply(
+            service_node_->get_traces(message.data.empty() ? ""sv : message.data.front()));
+}
+
 void OMQ::handle_client_request(std::string_view method, oxenmq::Message& message, bool forwarded) {
     log::debug(logcat, "Handling OMQ RPC request for {}", method);
 
@@ -238,16 +288,77 @@ void OMQ::handle_client_request(std::string_view method, oxenmq::Message& messag
                 else
                     send.reply(std::to_string(status.first), body);
             },
-            forwarded);
+            forwarded,
+            forwarded && from_swarm_peer(message));
 
     // This endpoint shouldn't have been registered at all if it isn't found in here
     assert(found);
 }
 
+bool OMQ::from_swarm_peer(const oxenmq::Message& message) const {
+    auto pk = message.conn.pubkey();
+    if (pk.size() != 32)
+        return false;
+    auto peers = service_node_->get_swarm_peers();
+    return std::any_of(peers.begin(), peers.end(), [&](const auto& sn) {
+        return sn.pubkey_x25519.view() == pk;
+    });
+}
+
+void OMQ::handle_storage_cc_batch(oxenmq::Message& message) {
+    std::vector<snode::forwarded_request> reqs;
+    try {
+        if (message.data.size() != 1)
+            throw std::invalid_argument{
+                    "expected 1 message part, received " + std::to_string(message.data.size())};
+        reqs = snode::deserialize_forwarded_batch(message.data[0]);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid forwarded client request batch: {}", e.what());
+        message.send_reply(
+                std::to_string(http::BAD_REQUEST.first),
+                "Invalid request batch: "s + e.what());
+        return;
+    }
+    log::debug(logcat, "Handling batch of {} forwarded client requests", reqs.size());
+
+    struct batch_state {
+        std::mutex mutex;
+        std::vector<std::vector<std::string>> replies;
+        size_t pending;
+        oxenmq::Message::DeferredSend send;
+
+        batch_state(size_t n, oxenmq::Message::DeferredSend send) :
+                replies(n), pending{n}, send{std::move(send)} {}
+    };
+    auto state = std::make_shared<batch_state>(reqs.size(), message.send_later());
+    if (reqs.empty())
+        return state->send.reply(snode::serialize_forwarded_replies(state->replies));
+    const bool trust_trace = from_swarm_peer(message);
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+        std::function<void(http::response_code, std::string_view)> reply =
+                [state, i](http::response_code status, std::string_view body) {
+                    std::vector<std::string> parts;
+                    if (status != http::OK)
+                        parts.push_back(std::to_string(status.first));
+                    parts.emplace_back(body);
+
+                    std::lock_guard lock{state->mutex};
+                    state->replies[i] = std::move(parts);
+                    if (--state->pending == 0)
+                        state->send.reply(snode::serialize_forwarded_replies(state->replies));
+                };
+        if (!handle_client_rpc(
+                    reqs[i].method, reqs[i].body, message.remote, reply, true, trust_trace))
+            reply(http::BAD_REQUEST, "Invalid forwarded request method"sv);
+    }
+}
+
 OMQ::OMQ(
         const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys) :
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys,
+        const thread_config& threads) :
         omq_{std::string{me.pubkey_x25519.view()},
              std::string{privkey.view()},
              true,                                         // is service node
@@ -257,18 +368,46 @@ OMQ::OMQ(
     for (const auto& key : stats_access_keys)
         stats_access_keys_.emplace(key.view());
 
+    // Wraps a command handler with the request_start/request_done tracepoints.  `name` must be
+    // NUL-terminated (i.e. come from a string literal).
+    auto probed = [](std::string_view name, auto handler) {
+        return [name, handler = std::move(handler)](oxenmq::Message& m) {
+            OXENSS_PROBE(request_start, name.data(), int64_t{-1});
+            handler(m);
+            OXENSS_PROBE(request_done, name.data());
+        };
+    };
+
+    // Wraps the handler of an sn.* command to record how long handling it takes.  (This is only
+    // the handler itself: commands that reply asynchronously do so after it returns.)
+    auto timed = [this, probed](std::string_view name, auto handler) {
+        return probed(name, [this, name, handler = std::move(handler)](oxenmq::Message& m) {
+            if (!service_node_)
+                return handler(m);
+            auto& lat = service_node_->latency(name);
+            util::request_scope scope{&lat};
+            handler(m);
+            lat.record(
+                    util::latency_stage::total,
+                    std::chrono::steady_clock::now() - scope.started());
+        });
+    };
+
     // clang-format off
 
     // Endpoints invoked by other SNs
     omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, 2 /*reserved threads*/, 1000 /*max queue*/)
-        .add_request_command("data", [this](auto& m) { handle_sn_data(m); })
-        .add_request_command("ping", [this](auto& m) { handle_ping(m); })
-        .add_request_command("storage_test", [this](auto& m) { handle_storage_test(m); }) // NB: requires a 60s request timeout
-        .add_request_command("onion_request", [this](auto& m) { handle_onion_request(m); })
-        .add_request_command("storage_cc", [this](auto& m) {
+        .add_request_command("data", timed("sn.data", [this](auto& m) { handle_sn_data(m); }))
+        .add_request_command("ping", timed("sn.ping", [this](auto& m) { handle_ping(m); }))
+        .add_request_command("sync_digest", timed("sn.sync_digest", [this](auto& m) { handle_sync_digest(m); }))
+        .add_request_command("sync_hashes", timed("sn.sync_hashes", [this](auto& m) { handle_sync_hashes(m); }))
+        .add_request_command("storage_test", timed("sn.storage_test", [this](auto& m) { handle_storage_test(m); })) // NB: requires a 60s request timeout
+        .add_request_command("onion_request", timed("sn.onion_request", [this](auto& m) { handle_onion_request(m); }))
+        .add_request_command("storage_cc", timed("sn.storage_cc", [this](auto& m) {
             if (m.data.size() >= 2) return handle_client_request(m.data[0], m, true);
             log::warning(logcat, "Invalid forwarded client request: incorrect number of message parts ({})",  m.data.size());
-        })
+        }))
+        .add_request_command("storage_cc_batch", timed("sn.storage_cc_batch", [this](auto& m) { handle_storage_cc_batch(m); }))
         ;
 
     // storage.WHATEVER (e.g. storage.store, storage.retrieve, etc.) endpoints are invokable by
@@ -276,17 +415,19 @@ OMQ::OMQ(
     // HTTPS /storage_rpc/v1 endpoint.
     auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 200 /*max queue*/);
     for (const auto& [name, _cb] : rpc::RequestHandler::client_rpc_endpoints)
-        st_cat.add_request_command(std::string{name}, [this, name=name](auto& m) { handle_client_request(name, m); });
+        st_cat.add_request_command(std::string{name}, probed(name, [this, name=name](auto& m) { handle_client_request(name, m); }));
 
     // monitor.* endpoints are used to subscribe to events such as new messages arriving for an
     // account.
     omq_.add_category("monitor", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 500 /*max queue*/)
-        .add_request_command("messages", [this](auto& m) { handle_monitor_messages(m); })
+        .add_request_command("messages", probed("monitor.messages", [this](auto& m) { handle_monitor_messages(m); }))
         ;
 
     // Endpoints invokable by a local admin
     omq_.add_category("service", oxenmq::AuthLevel::admin)
         .add_request_command("get_stats", [this](auto& m) { handle_get_stats(m); })
+        .add_request_command("get_metrics", [this](auto& m) { handle_get_metrics(m); })
+        .add_request_command("get_traces", [this](auto& m) { handle_get_traces(m); })
         ;
 
     // We send a sub.block to oxend to tell it to push new block notifications to us via this
@@ -294,11 +435,18 @@ OMQ::OMQ(
     omq_.add_category("notify", oxenmq::AuthLevel::admin)
         .add_request_command("block", [this](auto&&) {
             log::debug(logcat, "Received new block notification from oxend, updating swarms");
+            if (request_handler_) request_handler_->clear_oxend_cache();
             if (service_node_) service_node_->update_swarms();
         });
 
     // clang-format on
-    omq_.set_general_threads(1);
+    omq_.set_general_threads(std::max(threads.general, 1u));
+
+    for (size_t i = 0; i < threads.db; i++)
+        db_threads_.push_back(omq_.add_tagged_thread("db" + std::to_string(i), [i, threads] {
+            if (threads.db_init)
+                threads.db_init(i);
+        }));
 
     omq_.MAX_MSG_SIZE =
             10 * 1024 * 1024;  // 10 MB (needed by the fileserver, and swarm msg serialization)
@@ -307,6 +455,13 @@ OMQ::OMQ(
     omq_.EPHEMERAL_ROUTING_ID = false;
 }
 
+void OMQ::db_job(std::function<void()> job) {
+    if (db_threads_.empty())
+        return omq_.job(std::move(job));
+    auto i = next_db_thread_.fetch_add(1, std::memory_order_relaxed) % db_threads_.size();
+    omq_.job(std::move(job), db_threads_[i]);
+}
+
 void OMQ::connect_oxend(const oxenmq::address& oxend_rpc) {
     // Establish our persistent connection to oxend.
     auto start = std::chrono::steady_clock::now();
@@ -398,12 +553,17 @@ void OMQ::init(
 
 std::string OMQ::encode_onion_data(
         std::string_view payload, const rpc::OnionRequestMetadata& data) {
-    return oxenc::bt_serialize<oxenc::bt_dict>({
-            {"data", payload},
-            {"enc_type", to_string(data.enc_type)},
-            {"ephemeral_key", data.ephem_key.view()},
-            {"hop_no", data.hop_no},
-    });
+    // We write straight into a buffer with room for the payload plus the (small, bounded) rest of
+    // the dict, so that the payload gets copied exactly once on its way to the next hop.
+    std::string out;
+    out.resize(payload.size() + 256);
+    oxenc::bt_dict_producer d{out.data(), out.data() + out.size()};
+    d.append("data", payload);
+    d.append("enc_type", to_string(data.enc_type));
+    d.append("ephemeral_key", data.ephem_key.view());
+    d.append("hop_no", data.hop_no);
+    out.resize(d.view().size());
+    return out;
 }
 
 std::pair<std::string_view, rpc::OnionRequestMetadata> OMQ::decode_onion_data(
@@ -452,6 +612,16 @@ void OMQ::notify(std::vector<connection_id>& conns, std::string_view notificatio
             omq_.send(*id, "notify.message", notification);
 }
 
+void OMQ::notify_batch(const connection_id& conn, std::string_view notifications) {
+    if (auto* id = std::get_if<oxenmq::ConnectionID>(&conn))
+        omq_.send(*id, "notify.messages", notifications);
+}
+
+void OMQ::notify_resync(const connection_id& conn, std::string_view body) {
+    if (auto* id = std::get_if<oxenmq::ConnectionID>(&conn))
+        omq_.send(*id, "notify.resync", body);
+}
+
 void OMQ::reachability_test(std::shared_ptr<snode::sn_test> test) {
     auto xpk = test->sn.pubkey_x25519.view();
     omq_.request(
@@ -2,7 +2,9 @@
 #include "utils.h"
 #include "mqbase.h"
 
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <shared_mutex>
 #include <string>
@@ -36,14 +38,25 @@ namespace oxenss::server {
 
 class OMQ : public MQBase {
     oxenmq::OxenMQ omq_;
+
+    // Dedicated database threads (see db_job), and the next one to queue a job on
+    std::vector<oxenmq::TaggedThreadID> db_threads_;
+    std::atomic<size_t> next_db_thread_{0};
     oxenmq::ConnectionID oxend_conn_;
 
     // Get node's address
     std::string peer_lookup(std::string_view pubkey_bin) const;
 
+    // True if the message is from one of our swarm peers
+    bool from_swarm_peer(const oxenmq::Message& message) const;
+
     // Handle Session data coming from peer SN
     void handle_sn_data(oxenmq::Message& message);
 
+    // sn.sync_digest and sn.sync_hashes - swarm anti-entropy requests from swarm peers
+    void handle_sync_digest(oxenmq::Message& message);
+    void handle_sync_hashes(oxenmq::Message& message);
+
     // Called starting at HF18 for SS-to-SS onion requests
     void handle_onion_request(oxenmq::Message& message);
 
@@ -80,6 +93,12 @@ class OMQ : public MQBase {
     void handle_client_request(
             std::string_view method, oxenmq::Message& message, bool forwarded = false);
 
+    /// sn.storage_cc_batch: a batch of client requests forwarded from another swarm member (see
+    /// snode::serialize_forwarded_batch), each of which is handled as if forwarded individually
+    /// via sn.storage_cc.  Replies with a single part holding the individual replies (see
+    /// snode::serialize_forwarded_replies) once they have all completed.
+    void handle_storage_cc_batch(oxenmq::Message& message);
+
     /// Handles a subscription request to monitor new messages (OMQ endpoint monitor.messages).  The
     /// message body must be bt-encoded, and can be either a dict, or a list of dicts, containing
     /// the following keys.  Note that keys are case-sensitive and, for proper bt-encoding, must be
@@ -101,6 +120,8 @@ class OMQ : public MQBase {
     ///   more details.  Both keys must be given when doing subaccount auth, neither key otherwise.
     /// - n -- list of namespace ids to monitor for new messages; the ids must be valid (i.e. -32768
     ///   through 32767), must be sorted in numeric order, and must contain no duplicates.
+    /// - b -- set to 1 if the caller wants notifications to be batched (see below); 0 (or omitted)
+    ///   sends each notification as soon as the message arrives.
     /// - d -- set to 1 if the caller wants the full message data, 0 (or omitted) will omit the data
     ///   from notifications.
     /// - t -- signature timestamp, in integer unix seconds (*not* milliseconds), associated with
@@ -151,6 +172,19 @@ class OMQ : public MQBase {
     /// - z -- the expiry (milliseconds since unix epoch) of the message.
     /// - ~ -- the message data, if requested.
     ///
+    /// For batched subscriptions, notifications are instead collected for up to 50ms and then sent
+    /// together as a single "notify.messages" message (or "notify_messages" over QUIC) whose second
+    /// part is a bt-encoded list of the above dicts, in the order the messages arrived.  As with
+    /// the data flag, batching applies to every notification for the account on the connection if
+    /// any subscription requested it.
+    ///
+    /// Each connection has a notification send budget (1MB/s, with bursts of up to 4MB): a
+    /// subscriber that exceeds it gets notifications without the `~` data key, and once it can't
+    /// even afford those we drop its notifications entirely.  In the latter case the next message
+    /// we can send it is preceded by a "notify.resync" message ("notify_resync" over QUIC) whose
+    /// second part is a bt-encoded dict with key `dropped` set to the number of notifications
+    /// dropped; the client should then retrieve messages to catch up on whatever it missed.
+    ///
     /// Note: if the same connection submits multiple simultaneous subscriptions then the subsequent
     /// subscriptions add to earlier subscriptions.  This has some implications:
     ///
@@ -177,6 +211,12 @@ class OMQ : public MQBase {
 
     void handle_get_stats(oxenmq::Message& message);
 
+    void handle_get_metrics(oxenmq::Message& message);
+
+    /// service.get_traces: replies with the buffered trace spans, as json in the Zipkin v2 format.
+    /// Takes an optional data part holding a (hex) trace id, to return only that trace's spans.
+    void handle_get_traces(oxenmq::Message& message);
+
     // Access pubkeys for the 'service' command category (for access stats & logs), in binary.
     std::unordered_set<std::string> stats_access_keys_;
 
@@ -185,9 +225,27 @@ class OMQ : public MQBase {
     void connect_oxend(const oxenmq::address& oxend_rpc);
 
   public:
+    struct thread_config {
+        // General OxenMQ worker threads, on top of the ones reserved for each command category
+        unsigned general = 1;
+        // Dedicated database threads; with none, database work goes to the general workers
+        unsigned db = 0;
+        // If given, called at the start of each database thread (with the thread's index)
+        std::function<void(size_t)> db_init;
+    };
+
     OMQ(const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex);
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex,
+        const thread_config& threads = {});
+
+    // Runs `job`, which does blocking database work, on one of the database threads (round-robin;
+    // each thread has its own queue), so that a slow disk holds up only the database threads and
+    // not the workers parsing requests.  Without database threads it gets queued as an ordinary
+    // OxenMQ job.  Either way it never runs on the calling thread.
+    void db_job(std::function<void()> job);
+
+    size_t db_threads() const { return db_threads_.size(); }
 
     // Initialize oxenmq; return a future that completes once we have connected to and
     // initialized from oxend.
@@ -230,6 +288,10 @@ class OMQ : public MQBase {
 
     void notify(std::vector<connection_id>&, std::string_view notification) override;
 
+    void notify_batch(const connection_id& conn, std::string_view notifications) override;
+
+    void notify_resync(const connection_id& conn, std::string_view body) override;
+
     void reachability_test(std::shared_ptr<snode::sn_test> test) override;
 };
 
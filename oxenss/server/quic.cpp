@@ -1,9 +1,13 @@
 #include "quic.h"
+#include "omq.h"
 #include <sodium/crypto_generichash_blake2b.h>
 #include "../rpc/rate_limiter.h"
 #include "../rpc/request_handler.h"
+#include "../snode/serialization.h"
 #include "../snode/service_node.h"
 
+#include <oxenc/bt_producer.h>
+
 namespace oxenss::server {
 
 static auto logcat = log::Cat("ssquic");
@@ -35,26 +39,50 @@ QUIC::QUIC(
         rpc::RequestHandler& rh,
         rpc::RateLimiter& rl,
         const Address& bind,
-        const crypto::ed25519_seckey& sk) :
+        const crypto::ed25519_seckey& sk,
+        bool enable_0rtt) :
         local{bind},
         network{std::make_unique<oxen::quic::Network>()},
         tls_creds{oxen::quic::GNUTLSCreds::make_from_ed_seckey(sk.str())},
-        ep{network->endpoint(
-                local,
-                make_endpoint_static_secret(sk),
-                oxen::quic::opt::inbound_alpns{{uALPN}},
-                oxen::quic::opt::outbound_alpns{{uALPN}})},
+        ep{create_endpoint(sk, enable_0rtt)},
         request_handler{rh},
         command_handler{[this](quic::message m) { handle_request(std::move(m)); }} {
     service_node_ = &snode;
     request_handler_ = &rh;
     rate_limiter_ = &rl;
+    quic_ = true;
+}
+
+std::shared_ptr<oxen::quic::Endpoint> QUIC::create_endpoint(
+        const crypto::ed25519_seckey& sk, bool zero_rtt) {
+    if (zero_rtt)
+        // Replayed 0-RTT data is detected (and refused) within the anti-replay window
+        return network->endpoint(
+                local,
+                make_endpoint_static_secret(sk),
+                oxen::quic::opt::inbound_alpns{{uALPN}},
+                oxen::quic::opt::outbound_alpns{{uALPN}},
+                oxen::quic::opt::enable_0rtt_ticketing{});
+    return network->endpoint(
+            local,
+            make_endpoint_static_secret(sk),
+            oxen::quic::opt::inbound_alpns{{uALPN}},
+            oxen::quic::opt::outbound_alpns{{uALPN}});
 }
 
 void QUIC::startup_endpoint() {
-    ep->listen(tls_creds, [&](oxen::quic::connection_interface& c) {
-        c.queue_incoming_stream<oxen::quic::BTRequestStream>(command_handler);
-    });
+    ep->listen(
+            tls_creds,
+            [&](oxen::quic::connection_interface& c) {
+                c.queue_incoming_stream<oxen::quic::BTRequestStream>(command_handler);
+            },
+            // Streams after the first (such as the per-request streams of relayed onion requests)
+            // are request streams too
+            [this](oxen::quic::Connection& c,
+                   oxen::quic::Endpoint& e,
+                   std::optional<int64_t>) -> std::shared_ptr<oxen::quic::Stream> {
+                return e.make_shared<oxen::quic::BTRequestStream>(c, e, command_handler);
+            });
 }
 
 void QUIC::handle_monitor_message(oxen::quic::message m) {
@@ -73,26 +101,155 @@ void QUIC::handle_ping(oxen::quic::message m) {
     m.respond("pong");
 }
 
+void QUIC::handle_onion_request(oxen::quic::message m) {
+    // The message owns the request data that `payload` (below) views, so it must not move again
+    auto msg = std::make_shared<oxen::quic::message>(std::move(m));
+    auto reply = [msg](http::response_code status, std::string_view body) {
+        oxenc::bt_list_producer l;
+        l.append(std::to_string(status.first));
+        l.append(body);
+        msg->respond(std::move(l).str());
+    };
+
+    // Like the OMQ sn.onion_request, this is only for other service nodes
+    if (!from_service_node(*msg)) {
+        log::warning(logcat, "Refusing QUIC onion request from a non-service node");
+        return reply(http::FORBIDDEN, "Onion requests are only accepted from service nodes");
+    }
+
+    std::pair<std::string_view, rpc::OnionRequestMetadata> data;
+    try {
+        data = OMQ::decode_onion_data(msg->body());
+    } catch (const std::exception& e) {
+        auto err = "Invalid internal onion request: "s + e.what();
+        log::error(logcat, err);
+        return reply(http::BAD_REQUEST, err);
+    }
+    auto& [payload, meta] = data;
+
+    meta.cb = [reply](rpc::Response res) {
+        if (auto* js = std::get_if<nlohmann::json>(&res.body))
+            reply(res.status, js->dump());
+        else
+            reply(res.status, rpc::view_body(res));
+    };
+
+    if (meta.hop_no > rpc::MAX_ONION_HOPS)
+        return meta.cb({http::BAD_REQUEST, "onion request max path length exceeded"sv});
+
+    request_handler_->process_onion_req(payload, std::move(meta));
+}
+
+void QUIC::handle_sn_data(oxen::quic::message m) {
+    if (!from_service_node(m)) {
+        log::warning(logcat, "Refusing QUIC sn.data request from a non-service node");
+        return m.respond("Only accepted from service nodes", true);
+    }
+    if (!service_node_->db_ready()) {
+        log::debug(logcat, "Not ready for QUIC sn.data yet: database is still opening");
+        return m.respond(snode::SN_DATA_NOT_READY);
+    }
+    // Storing the messages means database writes, which we mustn't do on the quic thread
+    service_node_->omq_server().db_job([this, m = std::move(m)] {
+        service_node_->process_push_batch(m.body());
+        m.respond(""sv);
+    });
+}
+
+bool QUIC::from_service_node(const oxen::quic::message& m) const {
+    auto conn = m.stream()->endpoint.get_conn(m.conn_rid());
+    auto remote = conn ? conn->remote_key() : ustring_view{};
+    return remote.size() == 32 &&
+           service_node_->find_node(crypto::ed25519_pubkey::from_bytes(
+                   {reinterpret_cast<const char*>(remote.data()), remote.size()}));
+}
+
 void QUIC::handle_request(oxen::quic::message m) {
     auto name = m.endpoint();
 
     if (name == "snode_ping")
         return handle_ping(std::move(m));
 
+    if (name == "sn.onion_request")
+        return handle_onion_request(std::move(m));
+
+    if (name == "sn.data")
+        return handle_sn_data(std::move(m));
+
     if (name == "monitor")
         return handle_monitor_message(std::move(m));
 
-    auto body = m.body();
-    auto remote_host = m.stream()->remote().host();
-    auto responder = [m = std::move(m)](http::response_code, std::string_view body) {
-        m.respond(body);
-    };
-    if (handle_client_rpc(name, body, remote_host, std::move(responder)))
-        return;
+    if (rpc::RequestHandler::client_rpc_endpoints.count(name))
+        return dispatch_client_request(std::move(m));
 
     throw quic::no_such_endpoint{};
 }
 
+struct QUIC::request_slot {
+    QUIC& self;
+    const quic::ConnectionID cid;
+
+    request_slot(QUIC& self, quic::ConnectionID cid) : self{self}, cid{std::move(cid)} {}
+    ~request_slot() { self.finish_client_request(cid); }
+};
+
+void QUIC::dispatch_client_request(oxen::quic::message m) {
+    {
+        std::lock_guard lock{requests_mutex_};
+        auto& reqs = conn_requests_[m.conn_rid()];
+        if (reqs.active >= MAX_CONCURRENT_REQUESTS) {
+            if (reqs.queued.size() >= MAX_QUEUED_REQUESTS) {
+                log::debug(logcat, "Refusing QUIC client request: too many pending requests");
+                return m.respond("Server busy, try again later"sv);
+            }
+            reqs.queued.push_back(std::move(m));
+            return;
+        }
+        reqs.active++;
+    }
+    // Requests can involve database reads and writes, which we mustn't do on the quic thread
+    service_node_->omq_server()->job(
+            [this, m = std::move(m)]() mutable { run_client_request(std::move(m)); });
+}
+
+void QUIC::run_client_request(oxen::quic::message m) {
+    // The message owns the request data that `name` and `body` (below) view, so it must not move
+    // again
+    auto msg = std::make_shared<oxen::quic::message>(std::move(m));
+    auto slot = std::make_shared<request_slot>(*this, msg->conn_rid());
+    auto name = msg->endpoint();
+    auto body = msg->body();
+    auto remote_host = msg->stream()->remote().host();
+    handle_client_rpc(
+            name,
+            body,
+            remote_host,
+            [msg, slot = std::move(slot)](http::response_code, std::string_view body) {
+                msg->respond(body);
+            });
+}
+
+void QUIC::finish_client_request(const oxen::quic::ConnectionID& cid) {
+    std::optional<oxen::quic::message> next;
+    {
+        std::lock_guard lock{requests_mutex_};
+        auto it = conn_requests_.find(cid);
+        if (it == conn_requests_.end())
+            return;
+        auto& reqs = it->second;
+        if (!reqs.queued.empty()) {
+            // The slot passes straight to the next request
+            next.emplace(std::move(reqs.queued.front()));
+            reqs.queued.pop_front();
+        } else if (--reqs.active == 0) {
+            conn_requests_.erase(it);
+        }
+    }
+    if (next)
+        service_node_->omq_server()->job(
+                [this, m = std::move(*next)]() mutable { run_client_request(std::move(m)); });
+}
+
 nlohmann::json QUIC::wrap_response(
         [[maybe_unused]] const http::response_code& status, nlohmann::json body) const {
     // For QUIC requests we always wrap the result into a [CODE, BODY] list (even for successes).
@@ -105,6 +262,12 @@ nlohmann::json QUIC::wrap_response(
     return res;
 }
 
+std::string QUIC::wrap_serialized_response(
+        [[maybe_unused]] const http::response_code& status, std::string body, bool bt) const {
+    // The serialized equivalent of wrap_response's [CODE, BODY]
+    return bt ? "li{}e{}e"_format(status.first, body) : "[{},{}]"_format(status.first, body);
+}
+
 void QUIC::notify(std::vector<connection_id>& conns, std::string_view notification) {
     for (const auto& c : conns)
         if (auto* cid = std::get_if<oxen::quic::ConnectionID>(&c))
@@ -113,6 +276,20 @@ void QUIC::notify(std::vector<connection_id>& conns, std::string_view notificati
                     str->command("notify", notification);
 }
 
+void QUIC::notify_batch(const connection_id& conn, std::string_view notifications) {
+    if (auto* cid = std::get_if<oxen::quic::ConnectionID>(&conn))
+        if (auto c = ep->get_conn(*cid))
+            if (auto str = c->get_stream<oxen::quic::BTRequestStream>(0))
+                str->command("notify_messages", notifications);
+}
+
+void QUIC::notify_resync(const connection_id& conn, std::string_view body) {
+    if (auto* cid = std::get_if<oxen::quic::ConnectionID>(&conn))
+        if (auto c = ep->get_conn(*cid))
+            if (auto str = c->get_stream<oxen::quic::BTRequestStream>(0))
+                str->command("notify_resync", body);
+}
+
 void QUIC::reachability_test(std::shared_ptr<snode::sn_test> test) {
     if (!service_node_->hf_at_least(snode::QUIC_REACHABILITY_TESTING))
         return test->add_result(true);
@@ -143,4 +320,250 @@ void QUIC::reachability_test(std::shared_ptr<snode::sn_test> test) {
     });
 }
 
+QUIC::relay_conn QUIC::relay_connection(const snode::sn_record& sn) {
+    {
+        std::lock_guard lock{relay_mutex_};
+        if (auto it = relay_conns_.find(sn.pubkey_ed25519); it != relay_conns_.end())
+            return it->second;
+    }
+
+    // We mustn't hold the lock while connecting: the close callback takes it, from the quic
+    // thread that connect() waits on.
+    auto conn = ep->connect(
+            {sn.pubkey_ed25519.view(), sn.ip, sn.omq_quic_port},
+            tls_creds,
+            oxen::quic::opt::handshake_timeout{5s},
+            oxen::quic::opt::keep_alive{10s},
+            [this, pk = sn.pubkey_ed25519](oxen::quic::connection_interface& c, uint64_t) {
+                drop_relay_connection(pk, &c);
+            });
+
+    std::unique_lock lock{relay_mutex_};
+    auto [it, inserted] = relay_conns_.emplace(sn.pubkey_ed25519, relay_conn{conn});
+    if (inserted)
+        return it->second;
+    // Another request connected at the same time as us; use its connection instead
+    auto existing = it->second;
+    lock.unlock();
+    conn->close_connection();
+    return existing;
+}
+
+void QUIC::drop_relay_connection(
+        const crypto::ed25519_pubkey& pk, const oxen::quic::connection_interface* conn) {
+    std::lock_guard lock{relay_mutex_};
+    // A new connection may have replaced this one already
+    if (auto it = relay_conns_.find(pk); it != relay_conns_.end() && it->second.conn.get() == conn)
+        relay_conns_.erase(it);
+}
+
+bool QUIC::relay_fallback(
+        const crypto::ed25519_pubkey& pk,
+        const std::weak_ptr<oxen::quic::connection_interface>& conn,
+        int answered,
+        bool rejected,
+        bool stream_answered) {
+    if (!rejected)
+        if (auto c = conn.lock())
+            drop_relay_connection(pk, c.get());
+    if (!rejected && (stream_answered || answered > 1))
+        return false;
+    set_sn_unsupported(pk);
+    return true;
+}
+
+void QUIC::warm_relay_connection(const snode::sn_record& sn) {
+    if (!sn_unsupported(sn.pubkey_ed25519))
+        relay_connection(sn);
+}
+
+void QUIC::close_relay_connection(const crypto::ed25519_pubkey& pk) {
+    std::shared_ptr<oxen::quic::connection_interface> conn;
+    {
+        std::lock_guard lock{relay_mutex_};
+        if (auto it = relay_conns_.find(pk); it != relay_conns_.end()) {
+            conn = std::move(it->second.conn);
+            relay_conns_.erase(it);
+        }
+    }
+    // (Without the lock: closing invokes the close callback, which takes it)
+    if (conn)
+        conn->close_connection();
+}
+
+void QUIC::send_onion(
+        const snode::sn_record& sn,
+        std::string data,
+        onion_reply_callback cb,
+        std::function<void(std::string data, onion_reply_callback cb)> fallback) {
+    if (sn_unsupported(sn.pubkey_ed25519)) {
+        onion_fallbacks_++;
+        return fallback(std::move(data), std::move(cb));
+    }
+
+    auto rc = relay_connection(sn);
+    auto s = rc.conn->open_stream<oxen::quic::BTRequestStream>();
+    // Kept until the reply in case we need to send it again via the fallback
+    auto req = std::make_shared<std::string>(std::move(data));
+    s->command(
+            "sn.onion_request",
+            *req,
+            [this,
+             pk = sn.pubkey_ed25519,
+             conn = std::weak_ptr{rc.conn},
+             answered = rc.answered,
+             req,
+             cb = std::move(cb),
+             fallback = std::move(fallback)](oxen::quic::message m) mutable {
+                // Each request has its own stream, which is done with once we have the reply
+                m.stream()->close();
+                if (!m.timed_out)
+                    ++*answered;
+                if (m.timed_out || m.is_error()) {
+                    // A node that doesn't know about onion requests over QUIC hasn't sent the
+                    // request anywhere, so we can send it the old way.
+                    if (!relay_fallback(pk, conn, *answered, !m.timed_out, !m.timed_out))
+                        return cb(false, {});
+                    log::debug(
+                            logcat,
+                            "{} {} QUIC onion request; using fallback",
+                            pk,
+                            m.timed_out ? "didn't answer" : "rejected");
+                    onion_fallbacks_++;
+                    return fallback(std::move(*req), std::move(cb));
+                }
+                onion_sent_++;
+                std::vector<std::string> parts;
+                try {
+                    oxenc::bt_list_consumer l{m.body()};
+                    while (!l.is_finished())
+                        parts.emplace_back(l.consume_string_view());
+                } catch (const std::exception& e) {
+                    log::debug(
+                            logcat, "Invalid QUIC onion request reply from {}: {}", pk, e.what());
+                    parts.clear();
+                }
+                cb(true, std::move(parts));
+            });
+}
+
+void QUIC::send_data(
+        const snode::sn_record& sn,
+        std::string_view batch,
+        std::function<void(bool success)> done,
+        std::function<void(std::function<void(bool success)> done)> fallback) {
+    if (sn_unsupported(sn.pubkey_ed25519)) {
+        data_fallbacks_++;
+        return fallback(std::move(done));
+    }
+
+    // Shared by the replies to the batch's chunks; whichever finishes the batch (i.e. the last
+    // reply, or the sending itself if the replies all beat it) reports the outcome.
+    struct transfer {
+        std::shared_ptr<oxen::quic::BTRequestStream> stream;
+        std::weak_ptr<oxen::quic::connection_interface> conn;
+        std::shared_ptr<std::atomic<int>> conn_answered;
+        std::atomic<int> pending = 1;  // Chunks awaiting replies, +1 while we are still sending
+        std::atomic<bool> timed_out = false, rejected = false, answered = false, not_ready = false;
+        std::function<void(bool)> done;
+        std::function<void(std::function<void(bool)>)> fallback;
+    };
+    auto t = std::make_shared<transfer>();
+    auto rc = relay_connection(sn);
+    t->stream = rc.conn->open_stream<oxen::quic::BTRequestStream>();
+    t->conn = rc.conn;
+    t->conn_answered = std::move(rc.answered);
+    t->done = std::move(done);
+    t->fallback = std::move(fallback);
+
+    auto finish = [this, pk = sn.pubkey_ed25519](transfer& t) {
+        t.stream->close();
+        if (t.rejected || t.timed_out) {
+            // Messages are stored idempotently, so it doesn't matter if some of the chunks did
+            // get through before we send the whole batch again.
+            if (relay_fallback(pk, t.conn, *t.conn_answered, t.rejected, t.answered)) {
+                log::debug(
+                        logcat,
+                        "{} {} QUIC sn.data; using fallback",
+                        pk,
+                        t.rejected ? "rejected" : "didn't answer");
+                data_fallbacks_++;
+                return t.fallback(std::move(t.done));
+            }
+            return t.done(false);
+        }
+        if (t.not_ready) {
+            // The peer is up but still opening its database: a failed send for the relay
+            // scheduler to retry, not a reason to fall back.
+            log::debug(logcat, "{} isn't ready for sn.data yet", pk);
+            return t.done(false);
+        }
+        data_sent_++;
+        t.done(true);
+    };
+    auto send_chunk = [&t, &finish](std::string_view chunk) {
+        t->pending++;
+        t->stream->command("sn.data", chunk, [t, finish](oxen::quic::message m) {
+            if (m.timed_out) {
+                t->timed_out = true;
+            } else {
+                if (!t->answered.exchange(true))
+                    ++*t->conn_answered;
+                if (m.is_error())
+                    t->rejected = true;
+                else if (m.body() == snode::SN_DATA_NOT_READY)
+                    t->not_ready = true;
+            }
+            if (--t->pending == 0)
+                finish(*t);
+        });
+    };
+
+    // Chunks go out in order on the one stream; QUIC's flow control holds back the ones the
+    // receiver isn't ready for.
+    bool sent = false;
+    try {
+        snode::split_serialized_messages(batch, DATA_CHUNK_SIZE, [&](std::string chunk) {
+            send_chunk(chunk);
+            sent = true;
+        });
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Unable to split relay batch for {}: {}", sn.pubkey_legacy, e.what());
+    }
+    // Something we couldn't split (or an empty batch) goes as-is, for the receiver to deal with
+    if (!sent)
+        send_chunk(batch);
+    if (--t->pending == 0)
+        finish(*t);
+}
+
+bool QUIC::sn_unsupported(const crypto::ed25519_pubkey& pk) {
+    std::lock_guard lock{relay_mutex_};
+    auto it = sn_unsupported_.find(pk);
+    if (it == sn_unsupported_.end())
+        return false;
+    if (std::chrono::steady_clock::now() < it->second)
+        return true;
+    sn_unsupported_.erase(it);
+    return false;
+}
+
+void QUIC::set_sn_unsupported(const crypto::ed25519_pubkey& pk) {
+    std::lock_guard lock{relay_mutex_};
+    sn_unsupported_[pk] = std::chrono::steady_clock::now() + SN_FALLBACK_DURATION;
+}
+
+QUIC::relay_stats QUIC::get_relay_stats() const {
+    relay_stats s;
+    {
+        std::lock_guard lock{relay_mutex_};
+        s.connections = relay_conns_.size();
+    }
+    s.onion_sent = onion_sent_;
+    s.onion_fallbacks = onion_fallbacks_;
+    s.data_sent = data_sent_;
+    s.data_fallbacks = data_fallbacks_;
+    return s;
+}
+
 }  // namespace oxenss::server
@@ -35,20 +35,88 @@ struct PendingRequest {
 
 using RequestQueue = std::deque<PendingRequest>;
 
+// Callback for the reply to an onion request relayed to another service node; takes the same
+// values as an OxenMQ sn.onion_request reply: success is false if the request timed out, otherwise
+// `data` is the [STATUS, BODY] reply.
+using onion_reply_callback = std::function<void(bool success, std::vector<std::string> data)>;
+
 class QUIC : public MQBase {
   public:
     QUIC(snode::ServiceNode& snode,
          rpc::RequestHandler& rh,
          rpc::RateLimiter& rl,
          const Address& bind,
-         const crypto::ed25519_seckey& sk);
+         const crypto::ed25519_seckey& sk,
+         bool enable_0rtt = true);
 
     void startup_endpoint();
 
     void notify(std::vector<connection_id>&, std::string_view notification) override;
 
+    void notify_batch(const connection_id& conn, std::string_view notifications) override;
+
+    void notify_resync(const connection_id& conn, std::string_view body) override;
+
     void reachability_test(std::shared_ptr<snode::sn_test> test) override;
 
+    // Maximum number of client requests from a single connection that we process at once (on
+    // worker threads, each request stream independently of the others); beyond that, requests wait
+    // in arrival order for one of the connection's earlier requests to finish.
+    static constexpr size_t MAX_CONCURRENT_REQUESTS = 8;
+    // Maximum number of a connection's requests waiting for their turn; requests beyond this are
+    // refused as if we were overloaded.
+    static constexpr size_t MAX_QUEUED_REQUESTS = 64;
+
+    // Nodes that don't accept our sn.* commands over QUIC (i.e. older versions) are sent them over
+    // OxenMQ for this long before we try QUIC with them again.  Older nodes either reject the
+    // commands or, on a connection's later streams, don't answer them at all (see relay_fallback).
+    static constexpr auto SN_FALLBACK_DURATION = 1h;
+
+    // Message batches relayed with send_data are sent in chunks of (approximately) at most this
+    // size, each as its own sn.data request, so that the receiver can store each chunk as soon as
+    // it arrives rather than waiting for the whole (up to 9MB) batch.
+    static constexpr size_t DATA_CHUNK_SIZE = 1'000'000;
+
+    // Relays an onion request (`data`, as encoded by OMQ::encode_onion_data) to service node `sn`
+    // on a new stream of our long-lived connection to it, making the connection if we don't have
+    // one yet.  Each request gets its own stream so that a slow or large request doesn't hold up
+    // the others.  If `sn` doesn't accept onion requests over QUIC then `fallback` is called
+    // (either immediately, or once the node rejects or fails to answer the request; see
+    // relay_fallback) to send it some other way.
+    void send_onion(
+            const snode::sn_record& sn,
+            std::string data,
+            onion_reply_callback cb,
+            std::function<void(std::string data, onion_reply_callback cb)> fallback);
+
+    // Sends a serialized batch of messages (see snode::MessageSerializer) to `sn` on a new stream
+    // of our connection to it, which keeps bulk transfers from holding up other traffic and lets
+    // QUIC's per-stream flow control pace them.  `batch` must stay valid until `done` is called
+    // with whether the whole batch was stored.  If `sn` doesn't accept sn.data over QUIC then
+    // `fallback` is called, and given `done`, instead; as with send_onion, that may be after
+    // trying, and failing, to send it over QUIC.
+    void send_data(
+            const snode::sn_record& sn,
+            std::string_view batch,
+            std::function<void(bool success)> done,
+            std::function<void(std::function<void(bool success)> done)> fallback);
+
+    // Opens our relay connection to `sn` ahead of time, if we don't have one yet (and `sn`
+    // accepts sn.* commands over QUIC), so that the first relay to it doesn't wait on a handshake.
+    void warm_relay_connection(const snode::sn_record& sn);
+
+    // Closes our relay connection to `pk`, if we have one.
+    void close_relay_connection(const crypto::ed25519_pubkey& pk);
+
+    struct relay_stats {
+        size_t connections = 0;        // open connections to other nodes for relaying
+        uint64_t onion_sent = 0;       // onion requests relayed over QUIC
+        uint64_t onion_fallbacks = 0;  // onion requests sent via the fallback instead
+        uint64_t data_sent = 0;        // message batches relayed over QUIC
+        uint64_t data_fallbacks = 0;   // message batches sent via the fallback instead
+    };
+    relay_stats get_relay_stats() const;
+
   private:
     const Address local;
     std::unique_ptr<quic::Network> network;
@@ -58,7 +126,10 @@ class QUIC : public MQBase {
     rpc::RequestHandler& request_handler;
     std::function<void(quic::message m)> command_handler;
 
-    std::shared_ptr<quic::Endpoint> create_endpoint();
+    // Creates our endpoint, optionally issuing session tickets that let clients that have
+    // connected to us before send their first request in 0-RTT data.
+    std::shared_ptr<quic::Endpoint> create_endpoint(
+            const crypto::ed25519_seckey& sk, bool zero_rtt);
 
     void handle_request(quic::message m);
 
@@ -66,9 +137,81 @@ class QUIC : public MQBase {
 
     void handle_ping(quic::message m);
 
+    void handle_onion_request(quic::message m);
+
+    void handle_sn_data(quic::message m);
+
+    // Client requests being processed, and waiting to be, per connection
+    struct conn_requests {
+        size_t active = 0;
+        std::deque<quic::message> queued;
+    };
+    std::mutex requests_mutex_;
+    std::unordered_map<quic::ConnectionID, conn_requests> conn_requests_;
+
+    // Held by a client request until it has been answered, to release its connection's slot
+    struct request_slot;
+
+    // Runs a client request on a worker thread, or queues it if its connection already has
+    // MAX_CONCURRENT_REQUESTS requests running.
+    void dispatch_client_request(quic::message m);
+    void run_client_request(quic::message m);
+    // Frees up one of the connection's slots, starting its next queued request, if any.
+    void finish_client_request(const quic::ConnectionID& cid);
+
+    // True if the message came from an active service node
+    bool from_service_node(const quic::message& m) const;
+
+    // A long-lived connection to another service node for relaying onion requests and data, and
+    // the number of its streams that have been answered so far (see relay_fallback).
+    struct relay_conn {
+        std::shared_ptr<quic::connection_interface> conn;
+        std::shared_ptr<std::atomic<int>> answered = std::make_shared<std::atomic<int>>(0);
+    };
+
+    // Our relay connections, and the nodes that recently refused sn.* commands over QUIC (with when
+    // to try them again).
+    mutable std::mutex relay_mutex_;
+    std::unordered_map<crypto::ed25519_pubkey, relay_conn> relay_conns_;
+    std::unordered_map<crypto::ed25519_pubkey, std::chrono::steady_clock::time_point>
+            sn_unsupported_;
+    std::atomic<uint64_t> onion_sent_ = 0;
+    std::atomic<uint64_t> onion_fallbacks_ = 0;
+    std::atomic<uint64_t> data_sent_ = 0;
+    std::atomic<uint64_t> data_fallbacks_ = 0;
+
+    // Returns true if `pk` recently refused our sn.* commands
+    bool sn_unsupported(const crypto::ed25519_pubkey& pk);
+    void set_sn_unsupported(const crypto::ed25519_pubkey& pk);
+
+    relay_conn relay_connection(const snode::sn_record& sn);
+    // Forgets the relay connection to `pk` if it is (still) `conn`
+    void drop_relay_connection(
+            const crypto::ed25519_pubkey& pk, const quic::connection_interface* conn);
+
+    // Called when a relay stream to `pk` on `conn` is done with after being rejected or timing out,
+    // once `answered` (the connection's count of answered streams) includes this stream if it got
+    // any reply at all.  Returns true if what went on the stream should be sent the old way
+    // instead, marking `pk` as not accepting sn.* commands over QUIC: that is if `pk` rejected it,
+    // or if it timed out without a reply on a connection that hasn't answered more than one
+    // stream.  Older nodes only serve the first stream of a connection, so until a connection has
+    // answered a second one we can't tell their timeouts apart from those of a dead node.
+    // Timeouts also drop the connection, which may be dead (e.g. the node restarted).
+    bool relay_fallback(
+            const crypto::ed25519_pubkey& pk,
+            const std::weak_ptr<quic::connection_interface>& conn,
+            int answered,
+            bool rejected,
+            bool stream_answered);
+
     nlohmann::json wrap_response(
             [[maybe_unused]] const http::response_code& status,
             nlohmann::json response) const override;
+
+    std::string wrap_serialized_response(
+            [[maybe_unused]] const http::response_code& status,
+            std::string response,
+            bool bt) const override;
 };
 
 }  // namespace oxenss::server
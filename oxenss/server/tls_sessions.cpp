@@ -0,0 +1,265 @@
+#include "tls_sessions.h"
+
+extern "C" {
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+}
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace oxenss::server {
+
+static auto logcat = log::Cat("server");
+
+// Identifies our sessions to OpenSSL; a session is only resumed in a context with the same id.
+constexpr auto session_id_context = "oxenss"sv;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+using mac_ctx = EVP_MAC_CTX;
+#else
+using mac_ctx = HMAC_CTX;
+#endif
+
+struct tls_callbacks {
+    // Where we keep our TlsSessions pointer in each SSL_CTX
+    static int ctx_index() {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+    // Set on an SSL connection once its handshake has been counted (OpenSSL can report a
+    // completed handshake more than once, e.g. when sending TLS 1.3 tickets after it).
+    static int counted_index() {
+        static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static TlsSessions& get(SSL* ssl) {
+        return *static_cast<TlsSessions*>(
+                SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_callbacks::ctx_index()));
+    }
+
+    static bool init_hmac(mac_ctx* hctx, std::array<unsigned char, 32>& key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        char digest[] = "SHA256";
+        OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.data(), key.size()),
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                OSSL_PARAM_construct_end()};
+        return EVP_MAC_CTX_set_params(hctx, params);
+#else
+        return HMAC_Init_ex(hctx, key.data(), key.size(), EVP_sha256(), nullptr);
+#endif
+    }
+
+    static int ticket_key(
+            SSL* ssl,
+            unsigned char* key_name,
+            unsigned char* iv,
+            EVP_CIPHER_CTX* cctx,
+            mac_ctx* hctx,
+            int enc) {
+        TlsSessions::ticket_key key;
+        int found = get(ssl).find_key(enc ? nullptr : key_name, key);
+        if (!found)
+            return 0;
+        bool ok;
+        if (enc) {
+            std::memcpy(key_name, key.name.data(), key.name.size());
+            ok = RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1 &&
+                 EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key.data(), iv);
+        } else {
+            ok = EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key.data(), iv);
+        }
+        ok = ok && init_hmac(hctx, key.hmac_key);
+        OPENSSL_cleanse(&key, sizeof(key));
+        return ok ? found : -1;
+    }
+
+    static int new_session(SSL* ssl, SSL_SESSION* sess) {
+        auto& self = get(ssl);
+        // TLS 1.3 tickets hold the whole session, so there's nothing for us to look up later
+        if (self.conf_.tickets && SSL_version(ssl) >= TLS1_3_VERSION)
+            return 0;
+        unsigned int id_len;
+        auto* id = SSL_SESSION_get_id(sess, &id_len);
+        int len = i2d_SSL_SESSION(sess, nullptr);
+        if (!id_len || len <= 0)
+            return 0;
+        std::string der(len, '\0');
+        auto* p = reinterpret_cast<unsigned char*>(der.data());
+        i2d_SSL_SESSION(sess, &p);
+        self.add_session(std::string{reinterpret_cast<const char*>(id), id_len}, std::move(der));
+        // We didn't keep a reference to `sess`
+        return 0;
+    }
+
+    static SSL_SESSION* get_session(SSL* ssl, const unsigned char* id, int id_len, int* copy) {
+        *copy = 0;  // We return a new session object, which OpenSSL takes ownership of
+        auto der = get(ssl).get_session({reinterpret_cast<const char*>(id), size_t(id_len)});
+        if (der.empty())
+            return nullptr;
+        auto* p = reinterpret_cast<const unsigned char*>(der.data());
+        return d2i_SSL_SESSION(nullptr, &p, der.size());
+    }
+
+    static void remove_session(SSL_CTX* ctx, SSL_SESSION* sess) {
+        unsigned int id_len;
+        auto* id = SSL_SESSION_get_id(sess, &id_len);
+        static_cast<TlsSessions*>(SSL_CTX_get_ex_data(ctx, ctx_index()))
+                ->remove_session({reinterpret_cast<const char*>(id), id_len});
+    }
+
+    static void info(const SSL* ssl, int where, int /*ret*/) {
+        if (!(where & SSL_CB_HANDSHAKE_DONE))
+            return;
+        auto* s = const_cast<SSL*>(ssl);
+        if (SSL_get_ex_data(s, counted_index()))
+            return;
+        SSL_set_ex_data(s, counted_index(), s);
+        get(s).handshake_done(SSL_session_reused(s));
+    }
+};
+
+TlsSessions::TlsSessions(config conf) : conf_{std::move(conf)} {
+    std::lock_guard lock{keys_mutex_};
+    rotate_keys();
+}
+
+void TlsSessions::install(ssl_ctx_st* ctx) {
+    SSL_CTX_set_ex_data(ctx, tls_callbacks::ctx_index(), this);
+    SSL_CTX_set_session_id_context(
+            ctx,
+            reinterpret_cast<const unsigned char*>(session_id_context.data()),
+            session_id_context.size());
+    SSL_CTX_set_timeout(ctx, conf_.ticket_rotation.count());
+    SSL_CTX_set_info_callback(ctx, &tls_callbacks::info);
+
+    if (conf_.tickets) {
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &tls_callbacks::ticket_key);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, &tls_callbacks::ticket_key);
+#endif
+    } else {
+        // (TLS 1.3 clients then get tickets that refer to a session in our cache instead)
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+    // Clients only need one TLS 1.3 ticket to resume with, and each one costs us an encryption (or
+    // a cache entry)
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    if (conf_.cache_size) {
+        // We use our own cache, rather than OpenSSL's internal one, so that it can be shared
+        // between contexts.
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, &tls_callbacks::new_session);
+        SSL_CTX_sess_set_get_cb(ctx, &tls_callbacks::get_session);
+        SSL_CTX_sess_set_remove_cb(ctx, &tls_callbacks::remove_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+}
+
+void TlsSessions::rotate_keys() {
+    auto now = std::chrono::steady_clock::now();
+    if (!keys_.empty() && now - keys_.front().created < conf_.ticket_rotation)
+        return;
+    ticket_key key;
+    if (RAND_bytes(key.name.data(), key.name.size()) != 1 ||
+        RAND_bytes(key.aes_key.data(), key.aes_key.size()) != 1 ||
+        RAND_bytes(key.hmac_key.data(), key.hmac_key.size()) != 1)
+        throw std::runtime_error{"Failed to generate TLS session ticket key"};
+    key.created = now;
+    keys_.push_front(key);
+    OPENSSL_cleanse(&key, sizeof(key));
+    while (keys_.size() > 2) {
+        OPENSSL_cleanse(&keys_.back(), sizeof(ticket_key));
+        keys_.pop_back();
+    }
+    log::debug(logcat, "Rotated TLS session ticket key");
+}
+
+int TlsSessions::find_key(const unsigned char* name, ticket_key& key) {
+    std::lock_guard lock{keys_mutex_};
+    try {
+        rotate_keys();
+    } catch (const std::exception& e) {
+        log::error(logcat, "{}", e.what());
+        return 0;
+    }
+    if (!name) {
+        key = keys_.front();
+        return 1;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keys_.size(); i++) {
+        if (std::memcmp(keys_[i].name.data(), name, key.name.size()) != 0)
+            continue;
+        // The previous key is only good for one more rotation period
+        if (i > 0 && now - keys_[i].created >= 2 * conf_.ticket_rotation)
+            return 0;
+        key = keys_[i];
+        return i == 0 ? 1 : 2;
+    }
+    return 0;
+}
+
+void TlsSessions::add_session(std::string id, std::string der) {
+    std::lock_guard lock{cache_mutex_};
+    if (auto it = cache_.find(id); it != cache_.end()) {
+        lru_.erase(it->second);
+        cache_.erase(it);
+    }
+    auto expiry = std::chrono::steady_clock::now() + conf_.ticket_rotation;
+    lru_.push_front({std::move(id), std::move(der), expiry});
+    cache_.emplace(lru_.front().id, lru_.begin());
+    while (lru_.size() > conf_.cache_size) {
+        cache_.erase(lru_.back().id);
+        lru_.pop_back();
+    }
+}
+
+std::string TlsSessions::get_session(std::string_view id) {
+    std::lock_guard lock{cache_mutex_};
+    auto it = cache_.find(id);
+    if (it == cache_.end())
+        return {};
+    auto entry = it->second;
+    if (entry->expiry <= std::chrono::steady_clock::now()) {
+        cache_.erase(it);
+        lru_.erase(entry);
+        return {};
+    }
+    lru_.splice(lru_.begin(), lru_, entry);
+    return entry->der;
+}
+
+void TlsSessions::remove_session(std::string_view id) {
+    std::lock_guard lock{cache_mutex_};
+    if (auto it = cache_.find(id); it != cache_.end()) {
+        auto entry = it->second;
+        cache_.erase(it);
+        lru_.erase(entry);
+    }
+}
+
+size_t TlsSessions::cached() const {
+    std::lock_guard lock{cache_mutex_};
+    return lru_.size();
+}
+
+void TlsSessions::handshake_done(bool resumed) {
+    (resumed ? resumed_ : full_).fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace oxenss::server
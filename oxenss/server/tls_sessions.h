@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct ssl_ctx_st;
+
+namespace oxenss::server {
+
+using namespace std::literals;
+
+/// TLS session resumption for the HTTPS listener, so that clients reconnecting (as mobile clients
+/// do constantly) can skip the full handshake, with its key exchange and extra round trip.
+///
+/// This provides session tickets encrypted with keys that we rotate periodically and, for clients
+/// that don't use tickets, a server-side session cache.  Both are shared by every SSL context that
+/// gets `install()`ed, so that a client can resume on any of the HTTPS event loops no matter which
+/// one it first connected to.
+class TlsSessions {
+  public:
+    struct config {
+        // Whether to issue session tickets
+        bool tickets = true;
+        // How often to replace the ticket encryption key.  Tickets encrypted with the previous key
+        // are still accepted (and replaced), so a ticket stays valid for between one and two
+        // rotation periods.  This is also how long a cached session stays valid.
+        std::chrono::seconds ticket_rotation = 1h;
+        // Maximum number of sessions to keep in the server-side cache; 0 disables the cache.
+        size_t cache_size = 20000;
+    };
+
+    explicit TlsSessions(config conf);
+
+    TlsSessions(const TlsSessions&) = delete;
+    TlsSessions& operator=(const TlsSessions&) = delete;
+
+    /// Configures session resumption (and handshake counting) on an SSL context.  The context must
+    /// not outlive this object.
+    void install(ssl_ctx_st* ctx);
+
+    uint64_t full_handshakes() const { return full_.load(std::memory_order_relaxed); }
+    uint64_t resumed_handshakes() const { return resumed_.load(std::memory_order_relaxed); }
+
+    /// The number of sessions currently in the server-side cache
+    size_t cached() const;
+
+  private:
+    const config conf_;
+
+    struct ticket_key {
+        std::array<unsigned char, 16> name;
+        std::array<unsigned char, 32> aes_key;
+        std::array<unsigned char, 32> hmac_key;
+        std::chrono::steady_clock::time_point created;
+    };
+    std::mutex keys_mutex_;
+    // Current key first, followed by the previous one
+    std::deque<ticket_key> keys_;
+
+    struct cached_session {
+        std::string id;
+        std::string der;  // The serialized session
+        std::chrono::steady_clock::time_point expiry;
+    };
+    mutable std::mutex cache_mutex_;
+    // Most recently used first
+    std::list<cached_session> lru_;
+    std::unordered_map<std::string_view, std::list<cached_session>::iterator> cache_;
+
+    std::atomic<uint64_t> full_ = 0, resumed_ = 0;
+
+    // Replaces the current ticket key if it is due for rotation.  Must be called with keys_mutex_
+    // held.
+    void rotate_keys();
+
+    // Copies out the key to encrypt a new ticket with (if `name` is nullptr) or to decrypt a
+    // ticket with the given key name.  Returns 1 for the current key, 2 for the previous one
+    // (which tells OpenSSL to issue a fresh ticket), or 0 if the key isn't known (or has expired).
+    int find_key(const unsigned char* name, ticket_key& key);
+
+    void add_session(std::string id, std::string der);
+    // Returns the serialized session; empty if not found or expired
+    std::string get_session(std::string_view id);
+    void remove_session(std::string_view id);
+
+    void handshake_done(bool resumed);
+
+    friend struct tls_callbacks;
+};
+
+}  // namespace oxenss::server
@@ -75,4 +75,41 @@ nlohmann::json bt_to_json(oxenc::bt_list_consumer l) {
     return j;
 }
 
+void bt_serialize_json(const nlohmann::json& j, std::string& out) {
+    if (j.is_object()) {
+        out += 'd';
+        // json objects keep their keys sorted, which is just what bt encoding needs
+        for (auto& [k, v] : j.items()) {
+            "{}:"_format_to(out, k.size());
+            out += k;
+            bt_serialize_json(v, out);
+        }
+        out += 'e';
+    } else if (j.is_array()) {
+        out += 'l';
+        for (auto& v : j)
+            bt_serialize_json(v, out);
+        out += 'e';
+    } else if (j.is_string()) {
+        auto& s = j.get_ref<const std::string&>();
+        "{}:"_format_to(out, s.size());
+        out += s;
+    } else if (j.is_boolean())
+        out += j.get<bool>() ? "i1e"sv : "i0e"sv;
+    else if (j.is_number_unsigned())
+        "i{}e"_format_to(out, j.get<uint64_t>());
+    else if (j.is_number_integer())
+        "i{}e"_format_to(out, j.get<int64_t>());
+    else
+        throw std::runtime_error{
+                "client request returned json with an unhandled value type, unable to convert to "
+                "bt"};
+}
+
+std::string bt_serialize_json(const nlohmann::json& j) {
+    std::string out;
+    bt_serialize_json(j, out);
+    return out;
+}
+
 }  // namespace oxenss
@@ -23,8 +23,8 @@ using bstring_view = std::basic_string_view<std::byte>;
 // place this here so we can use it in oxenss::*
 using namespace std::literals;
 
-// {pubkey (bytes), pubkey (hex), namespaces, want_data}
-using sub_info = std::tuple<std::string, std::string, std::vector<namespace_id>, bool>;
+// {pubkey (bytes), pubkey (hex), namespaces, want_data, batched}
+using sub_info = std::tuple<std::string, std::string, std::vector<namespace_id>, bool, bool>;
 
 oxenc::bt_value json_to_bt(nlohmann::json j);
 
@@ -32,6 +32,11 @@ nlohmann::json bt_to_json(oxenc::bt_dict_consumer d);
 
 nlohmann::json bt_to_json(oxenc::bt_list_consumer l);
 
+// Produces the same output as `bt_serialize(json_to_bt(j))`, but writes it directly rather than
+// building an intermediate bt_value.  The first version appends to `out`.
+void bt_serialize_json(const nlohmann::json& j, std::string& out);
+std::string bt_serialize_json(const nlohmann::json& j);
+
 inline std::string serialize_response(oxenc::bt_dict supplement = {}) {
     return oxenc::bt_serialize(supplement);
 }
@@ -76,7 +81,8 @@ inline constexpr response_code OK{200, "OK"sv}, BAD_REQUEST{400, "Bad Request"sv
         TOO_MANY_REQUESTS{429, "Too Many Requests"sv},
         INTERNAL_SERVER_ERROR{500, "Internal Server Error"sv}, BAD_GATEWAY{502, "Bad Gateway"sv},
         SERVICE_UNAVAILABLE{503, "Service Unavailable"sv},
-        GATEWAY_TIMEOUT{504, "Gateway Timeout"sv};
+        GATEWAY_TIMEOUT{504, "Gateway Timeout"sv},
+        INSUFFICIENT_STORAGE{507, "Insufficient Storage"sv};
 
 inline constexpr response_code from_code(int status) {
     switch (status) {
@@ -93,6 +99,7 @@ inline constexpr response_code from_code(int status) {
         case 502: return BAD_GATEWAY;
         case 503: return SERVICE_UNAVAILABLE;
         case 504: return GATEWAY_TIMEOUT;
+        case 507: return INSUFFICIENT_STORAGE;
         default: [[fallthrough]];
         case 500: return INTERNAL_SERVER_ERROR;
     }
@@ -0,0 +1,86 @@
+#include "connection_warmer.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <unordered_set>
+
+namespace oxenss::snode {
+
+static auto logcat = log::Cat("snode");
+
+ConnectionWarmer::ConnectionWarmer(
+        connect_fn connect, disconnect_fn disconnect, clock::duration grace_period) :
+        connect_{std::move(connect)}, disconnect_{std::move(disconnect)}, grace_{grace_period} {}
+
+void ConnectionWarmer::set_peers(const std::vector<sn_record>& peers, clock::time_point now) {
+    std::vector<sn_record> to_connect, to_disconnect;
+    {
+        std::lock_guard lock{mutex_};
+        std::unordered_set<crypto::legacy_pubkey> current;
+        for (auto& sn : peers) {
+            current.insert(sn.pubkey_legacy);
+            auto [it, inserted] = peers_.try_emplace(sn.pubkey_legacy, peer{sn, std::nullopt});
+            auto& p = it->second;
+            if (inserted) {
+                to_connect.push_back(sn);
+                continue;
+            }
+            if (!identical(p.sn, sn)) {
+                // It moved (or changed keys), so the connection we have goes nowhere useful
+                to_disconnect.push_back(std::move(p.sn));
+                p.sn = sn;
+                to_connect.push_back(sn);
+            }
+            if (p.left) {
+                log::debug(logcat, "Former swarm peer {} is back", sn.pubkey_legacy);
+                p.left.reset();
+            }
+        }
+        for (auto& [pk, p] : peers_)
+            if (!p.left && !current.count(pk))
+                p.left = now;
+    }
+
+    for (auto& sn : to_disconnect)
+        disconnect_(sn);
+    for (auto& sn : to_connect) {
+        log::debug(logcat, "Connecting ahead of time to new swarm peer {}", sn.pubkey_legacy);
+        connect_(sn);
+    }
+}
+
+void ConnectionWarmer::tick(clock::time_point now) {
+    std::vector<sn_record> to_connect, to_disconnect;
+    {
+        std::lock_guard lock{mutex_};
+        for (auto it = peers_.begin(); it != peers_.end();) {
+            auto& p = it->second;
+            if (!p.left) {
+                to_connect.push_back(p.sn);
+                ++it;
+            } else if (now - *p.left >= grace_) {
+                to_disconnect.push_back(std::move(p.sn));
+                it = peers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (auto& sn : to_disconnect) {
+        log::debug(logcat, "Closing connection to former swarm peer {}", sn.pubkey_legacy);
+        disconnect_(sn);
+    }
+    for (auto& sn : to_connect)
+        connect_(sn);
+}
+
+ConnectionWarmer::stats ConnectionWarmer::get_stats() const {
+    stats s;
+    std::lock_guard lock{mutex_};
+    for (auto& [pk, p] : peers_)
+        (p.left ? s.leaving : s.peers)++;
+    return s;
+}
+
+}  // namespace oxenss::snode
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "sn_record.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+/// Keeps connections to our swarm peers open ahead of time, so that the first storage forward or
+/// message relay to a node that just joined our swarm doesn't have to wait on a TCP connection and
+/// handshake; and closes them again once a node has been out of our swarm for a while (in case it
+/// comes back, as nodes often do around reshuffles, or we still have messages on the way to it).
+///
+/// The actual connecting and disconnecting is done by the given callbacks, which are never invoked
+/// while holding the warmer's lock.  All methods are thread-safe.
+class ConnectionWarmer {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /// Opens (or keeps open) a connection to `sn`.  Called for each new peer, and again every tick
+    /// for every current one, so that dropped connections get reopened.
+    using connect_fn = std::function<void(const sn_record& sn)>;
+    /// Closes the connection to a peer that left.
+    using disconnect_fn = std::function<void(const sn_record& sn)>;
+
+    // How often tick() should be called
+    inline static constexpr auto TICK_INTERVAL = 1min;
+
+    // How long we keep the connection to a node after it leaves our swarm
+    inline static constexpr auto DEFAULT_GRACE_PERIOD = 2min;
+
+    ConnectionWarmer(
+            connect_fn connect,
+            disconnect_fn disconnect,
+            clock::duration grace_period = DEFAULT_GRACE_PERIOD);
+
+    /// Replaces the set of peers to keep connections to.  New peers (and ones whose address
+    /// changed) are connected right away; peers no longer in the set get disconnected once they
+    /// have been out of it for the grace period, unless they come back before then.
+    void set_peers(const std::vector<sn_record>& peers, clock::time_point now = clock::now());
+
+    /// Refreshes the connections to current peers and disconnects departed peers whose grace
+    /// period is over.  Should be called every TICK_INTERVAL.
+    void tick(clock::time_point now = clock::now());
+
+    struct stats {
+        size_t peers = 0;    // current peers being kept connected
+        size_t leaving = 0;  // departed peers still in their grace period
+    };
+    stats get_stats() const;
+
+  private:
+    struct peer {
+        sn_record sn;
+        // When the peer left our swarm, if it has
+        std::optional<clock::time_point> left;
+    };
+
+    const connect_fn connect_;
+    const disconnect_fn disconnect_;
+    const clock::duration grace_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<crypto::legacy_pubkey, peer> peers_;
+};
+
+}  // namespace oxenss::snode
@@ -0,0 +1,86 @@
+#include "metrics.h"
+
+#include <fmt/format.h>
+
+#include <iterator>
+
+namespace oxenss::snode {
+
+static void append_escaped(std::string& out, std::string_view s) {
+    for (char c : s) {
+        if (c == '\\' || c == '"')
+            out += '\\';
+        if (c == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+}
+
+void metrics_writer::family(std::string_view name, std::string_view type, std::string_view help) {
+    family_ = name;
+    out_ += "# TYPE ";
+    out_ += name;
+    out_ += ' ';
+    out_ += type;
+    out_ += "\n# HELP ";
+    out_ += name;
+    out_ += ' ';
+    append_escaped(out_, help);
+    out_ += '\n';
+}
+
+void metrics_writer::write_name(std::string_view suffix, labels l, std::string_view le) {
+    out_ += family_;
+    out_ += suffix;
+    if (l.size() || !le.empty()) {
+        char sep = '{';
+        for (auto& [k, v] : l) {
+            out_ += sep;
+            out_ += k;
+            out_ += "=\"";
+            append_escaped(out_, v);
+            out_ += '"';
+            sep = ',';
+        }
+        if (!le.empty()) {
+            out_ += sep;
+            out_ += "le=\"";
+            out_ += le;
+            out_ += '"';
+        }
+        out_ += '}';
+    }
+    out_ += ' ';
+}
+
+void metrics_writer::sample(std::string_view suffix, labels l, double value) {
+    write_name(suffix, l);
+    fmt::format_to(std::back_inserter(out_), "{}\n", value);
+}
+
+void metrics_writer::histogram(labels l, const util::LatencyHistogram::snapshot& h) {
+    uint64_t cumulative = 0;
+    size_t i = 0;
+    for (auto& [bound, le] : HISTOGRAM_BOUNDS) {
+        auto bound_us = static_cast<uint64_t>(bound * 1'000'000);
+        for (; i < h.counts.size() && util::LatencyHistogram::bucket_value(i) <= bound_us; i++)
+            cumulative += h.counts[i];
+        write_name("_bucket", l, le);
+        out_ += std::to_string(cumulative);
+        out_ += '\n';
+    }
+    write_name("_bucket", l, "+Inf");
+    out_ += std::to_string(h.count);
+    out_ += '\n';
+    sample("_count", l, h.count);
+    sample("_sum", l, h.sum_us / 1e6);
+}
+
+std::string metrics_writer::str() && {
+    out_ += "# EOF\n";
+    return std::move(out_);
+}
+
+}  // namespace oxenss::snode
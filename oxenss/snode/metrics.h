@@ -0,0 +1,76 @@
+#pragma once
+
+#include <oxenss/utils/latency.hpp>
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace oxenss::snode {
+
+/// Builds a metrics scrape in the OpenMetrics text format: metric families, each introduced with
+/// its type and help text, followed by their samples.
+class metrics_writer {
+  public:
+    using labels = std::initializer_list<std::pair<std::string_view, std::string_view>>;
+
+    /// Starts a new metric family.  `type` is one of the OpenMetrics types, e.g. "counter",
+    /// "gauge", "histogram" or "info".
+    void family(std::string_view name, std::string_view type, std::string_view help);
+
+    /// Adds a sample to the current family; `suffix` is appended to the family name (e.g. counter
+    /// samples need "_total").
+    void sample(std::string_view suffix, labels l, double value);
+    template <typename T, std::enable_if_t<std::is_integral_v<T>, int> = 0>
+    void sample(std::string_view suffix, labels l, T value) {
+        write_name(suffix, l);
+        out_ += std::to_string(value);
+        out_ += '\n';
+    }
+
+    /// Shortcuts for a family with a single, unlabelled sample
+    template <typename T>
+    void counter(std::string_view name, std::string_view help, T value) {
+        family(name, "counter", help);
+        sample("_total", {}, value);
+    }
+    template <typename T>
+    void gauge(std::string_view name, std::string_view help, T value) {
+        family(name, "gauge", help);
+        sample("", {}, value);
+    }
+
+    /// Adds the samples of a latency histogram (in seconds) to the current histogram family.  The
+    /// histogram's fine-grained buckets are aggregated into those of HISTOGRAM_BOUNDS.
+    void histogram(labels l, const util::LatencyHistogram::snapshot& h);
+
+    /// Upper bounds, in seconds, of the buckets histograms are exported with (plus +Inf)
+    static constexpr std::pair<double, std::string_view> HISTOGRAM_BOUNDS[] = {
+            {0.001, "0.001"},
+            {0.0025, "0.0025"},
+            {0.005, "0.005"},
+            {0.01, "0.01"},
+            {0.025, "0.025"},
+            {0.05, "0.05"},
+            {0.1, "0.1"},
+            {0.25, "0.25"},
+            {0.5, "0.5"},
+            {1.0, "1.0"},
+            {2.5, "2.5"},
+            {5.0, "5.0"},
+            {10.0, "10.0"}};
+
+    /// Returns the finished scrape
+    std::string str() &&;
+
+  private:
+    std::string out_;
+    std::string family_;
+
+    void write_name(std::string_view suffix, labels l, std::string_view le = {});
+};
+
+}  // namespace oxenss::snode
@@ -105,24 +105,26 @@ std::optional<sn_record> reachability_testing::next_random(
 
 std::vector<std::pair<sn_record, int>> reachability_testing::get_failing(
         const Swarm& swarm, const clock::time_point& now) {
-    // Our failing_queue puts the oldest retest times at the top, so pop them off into our
-    // result until the top node should be retested sometime in the future
+    // Pop nodes off of the wheel, earliest retest time first, until we have as many as we can test
+    // this tick or none are due.  (Popped one at a time so that stale entries don't count).
     std::vector<std::pair<sn_record, int>> result;
-    while (result.size() < MAX_RETESTS_PER_TICK && !failing_queue.empty()) {
-        auto& [pk, retest_time, failures] = failing_queue.top();
-        if (retest_time > now)
+    size_t limit = std::min(max_retests_per_tick, free_test_slots());
+    while (result.size() < limit) {
+        std::optional<failing_entry> next;
+        if (!failing_queue.pop_due(now, 1, [&](failing_entry&& e) { next = std::move(e); }))
             break;
-        if (auto sn = swarm.find_node(pk))
-            result.emplace_back(std::move(*sn), failures);
+        if (auto it = failing.find(next->pk); it == failing.end() || it->second != next->seq)
+            continue;
+        if (auto sn = swarm.find_node(next->pk))
+            result.emplace_back(std::move(*sn), next->failures);
         else  // Node is apparently no longer active, so stop testing it.
-            remove_node_from_failing(pk);
-        failing_queue.pop();
+            remove_node_from_failing(next->pk);
     }
     return result;
 }
 
 void reachability_testing::add_failing_node(
-        const crypto::legacy_pubkey& pk, int previous_failures) {
+        const crypto::legacy_pubkey& pk, int previous_failures, const clock::time_point& now) {
     using namespace std::chrono;
 
     if (previous_failures < 0)
@@ -132,12 +134,24 @@ void reachability_testing::add_failing_node(
     if (next_test_in > TESTING_BACKOFF_MAX)
         next_test_in = TESTING_BACKOFF_MAX;
 
-    failing.insert(pk);
-    failing_queue.emplace(pk, steady_clock::now() + next_test_in, previous_failures + 1);
+    // Replaces any entry the node already has
+    auto seq = next_seq++;
+    failing[pk] = seq;
+    failing_queue.add(now + next_test_in, {pk, previous_failures + 1, seq});
 }
 
 void reachability_testing::remove_node_from_failing(const crypto::legacy_pubkey& pk) {
     failing.erase(pk);
 }
 
+void reachability_testing::set_limits(int retests_per_tick, int tests_in_flight) {
+    max_retests_per_tick = std::max(retests_per_tick, 1);
+    max_in_flight = std::max(tests_in_flight, 1);
+}
+
+std::shared_ptr<void> reachability_testing::test_started() {
+    ++*in_flight;
+    return {nullptr, [in_flight = in_flight](void*) { --*in_flight; }};
+}
+
 }  // namespace oxenss::snode
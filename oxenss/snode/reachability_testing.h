@@ -1,13 +1,16 @@
 #pragma once
 
 #include <oxenss/crypto/keys.h>
+#include <oxenss/utils/timer_wheel.hpp>
 #include "sn_record.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <queue>
+#include <cstdint>
+#include <memory>
 #include <random>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 namespace oxenss::snode {
@@ -16,14 +19,6 @@ using namespace std::literals;
 
 namespace detail {
 
-    // Returns std::greater on the std::get<N>(v)th element value.
-    template <typename T, size_t N>
-    struct nth_greater {
-        constexpr bool operator()(const T& lhs, const T& rhs) const {
-            return std::greater<std::tuple_element_t<N, T>>{}(std::get<N>(lhs), std::get<N>(rhs));
-        }
-    };
-
     struct incoming_test_state {
         std::chrono::steady_clock::time_point last_test{};
         std::chrono::steady_clock::time_point last_whine{};
@@ -62,6 +57,15 @@ class reachability_testing {
     // recommissioned).
     inline static constexpr int MAX_RETESTS_PER_TICK = 4;
 
+    // The maximum number of tests we have in flight at once (each test probes HTTPS, OMQ and QUIC
+    // in parallel), so that slow or unresponsive nodes can't pile tests up on us.  Retests beyond
+    // this wait for a later tick.
+    inline static constexpr int MAX_TESTS_IN_FLIGHT = 32;
+
+    // Slots of the wheel scheduling retests of failing nodes, one per TESTING_TIMER_INTERVAL;
+    // enough to cover TESTING_BACKOFF_MAX (plus the random interval) in a single turn.
+    inline static constexpr size_t FAILING_WHEEL_SLOTS = 1024;
+
     // Maximum time without a ping before we start whining about it.
     //
     // We have a probability of about 0.368* of *not* getting pinged within a ping interval
@@ -89,14 +93,25 @@ class reachability_testing {
     // When we started, so that we know not to hold off on whining about no pings for a while.
     const clock::time_point startup = clock::now();
 
-    // Pubkeys, next test times, and sequential failure counts of service nodes that are
-    // currently in "failed" status along with the last time they failed; we retest them first
-    // after 10s then back off linearly by an additional 10s up to a max testing interval of
-    // 2m30s, until we get a successful response.
-    using FailingPK = std::tuple<crypto::legacy_pubkey, clock::time_point, int>;
-    std::priority_queue<FailingPK, std::vector<FailingPK>, detail::nth_greater<FailingPK, 1>>
-            failing_queue;
-    std::unordered_set<crypto::legacy_pubkey> failing;
+    // Pubkeys and sequential failure counts of service nodes that are currently in "failed"
+    // status, scheduled by their next test time; we retest them first after 10s then back off
+    // linearly by an additional 10s up to a max testing interval of 2m30s, until we get a
+    // successful response.  `failing` maps each failing node to the sequence number of its
+    // current entry in the wheel; entries that don't match (because the node was removed or
+    // re-added since) are stale, and skipped.
+    struct failing_entry {
+        crypto::legacy_pubkey pk;
+        int failures;
+        uint64_t seq;
+    };
+    util::timer_wheel<failing_entry> failing_queue{TESTING_TIMER_INTERVAL, FAILING_WHEEL_SLOTS};
+    std::unordered_map<crypto::legacy_pubkey, uint64_t> failing;
+    uint64_t next_seq = 0;
+
+    int max_retests_per_tick = MAX_RETESTS_PER_TICK;
+    int max_in_flight = MAX_TESTS_IN_FLIGHT;
+    // Shared with the tokens handed out by test_started(), which can outlive us
+    std::shared_ptr<std::atomic<int>> in_flight = std::make_shared<std::atomic<int>>(0);
 
     // Track the last time *this node* was tested by other network nodes; used to detect and
     // warn about possible network issues.
@@ -117,8 +132,9 @@ class reachability_testing {
     std::optional<sn_record> next_random(
             const Swarm& swarm, const clock::time_point& now = clock::now(), bool requeue = true);
 
-    // Removes and returns up to MAX_RETESTS_PER_TICK nodes that are due to be tested (i.e.
-    // next-testing-time <= now).  Returns [snrecord, #previous-failures] for each.
+    // Removes and returns up to the per-tick retest limit (see set_limits) of nodes that are due
+    // to be tested (i.e. next-testing-time <= now), but no more than free_test_slots().  Returns
+    // [snrecord, #previous-failures] for each.
     std::vector<std::pair<sn_record, int>> get_failing(
             const Swarm& swarm, const clock::time_point& now = clock::now());
 
@@ -126,7 +142,27 @@ class reachability_testing {
     // depending on `failures`; see TESTING_BACKOFF).  `previous_failures` should be the number
     // of previous failures *before* this one, i.e. 0 for a random general test; or the failure
     // count returned by `get_failing` for repeated failures.
-    void add_failing_node(const crypto::legacy_pubkey& pk, int previous_failures = 0);
+    void add_failing_node(
+            const crypto::legacy_pubkey& pk,
+            int previous_failures = 0,
+            const clock::time_point& now = clock::now());
+
+    // Returns the number of nodes currently scheduled for retesting.
+    size_t failing_count() const { return failing.size(); }
+
+    // Sets the maximum number of failing nodes to retest per tick, and of tests in flight at once
+    // (both at least 1).
+    void set_limits(int retests_per_tick, int tests_in_flight);
+
+    // Called when starting a test of a node: the test counts as in flight until the returned
+    // token is destroyed.
+    std::shared_ptr<void> test_started();
+
+    // Returns the number of tests in flight
+    int tests_in_flight() const { return *in_flight; }
+
+    // Returns how many more tests can be started before hitting the in-flight limit.
+    int free_test_slots() const { return std::max(0, max_in_flight - *in_flight); }
 
     // Removes a node from the set of failing nodes; should be called whenever we stop testing a
     // node (e.g. because it is not passing, or because it deregistered).
@@ -0,0 +1,379 @@
+#include "relay.h"
+
+#include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/memory.hpp>
+#include <oxenss/utils/probes.hpp>
+
+#include <oxenc/bt_producer.h>
+#include <oxenc/bt_serialize.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace oxenss::snode {
+
+static auto logcat = log::Cat("snode");
+
+RelayScheduler::RelayScheduler(send_fn send, failure_fn on_failure, config conf) :
+        send_{std::move(send)},
+        on_failure_{std::move(on_failure)},
+        conf_{conf},
+        rate_tokens_{static_cast<double>(conf.max_bytes_per_sec)} {
+    producer_thread_ = std::thread{[this] { producer_loop(); }};
+}
+
+RelayScheduler::~RelayScheduler() {
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+        producers_.clear();
+    }
+    space_cv_.notify_all();
+    producer_cv_.notify_all();
+    producer_thread_.join();
+}
+
+void RelayScheduler::enqueue(std::string data, const std::vector<sn_record>& peers) {
+    if (peers.empty())
+        return;
+    OXENSS_PROBE(relay_push, peers.size(), data.size());
+    {
+        std::lock_guard lock{mutex_};
+        enqueue_locked(std::make_shared<batch>(batch{std::move(data), 0}), peers);
+    }
+    dispatch();
+}
+
+void RelayScheduler::add_producer(std::vector<sn_record> peers, producer_fn producer) {
+    if (peers.empty())
+        return;
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        producers_.push_back({std::move(peers), std::move(producer)});
+    }
+    producer_cv_.notify_one();
+}
+
+void RelayScheduler::producer_loop() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+        producer_cv_.wait(lock, [this] { return stopping_ || !producers_.empty(); });
+        if (stopping_)
+            return;
+        auto p = std::move(producers_.front());
+        producers_.pop_front();
+        producing_ = true;
+        lock.unlock();
+
+        auto emit = [this, &p](std::string data) {
+            auto b = std::make_shared<batch>(batch{std::move(data), 0});
+            {
+                std::unique_lock l{mutex_};
+                space_cv_.wait(l, [this, &b] {
+                    return stopping_ || stats_.bytes_queued == 0 ||
+                           stats_.bytes_queued + b->data.size() <= conf_.max_queued_bytes;
+                });
+                if (stopping_)
+                    return false;
+                OXENSS_PROBE(relay_push, p.peers.size(), b->data.size());
+                enqueue_locked(std::move(b), p.peers);
+            }
+            dispatch();
+            return true;
+        };
+        try {
+            p.produce(emit);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to produce relay batches: {}", e.what());
+        }
+
+        lock.lock();
+        producing_ = false;
+    }
+}
+
+void RelayScheduler::enqueue_locked(
+        std::shared_ptr<batch> b, const std::vector<sn_record>& peers) {
+    if (stopping_)
+        return;
+    stats_.bytes_queued += b->data.size();
+    b->pending = peers.size();
+    for (const auto& sn : peers) {
+        auto [it, inserted] = peers_.try_emplace(sn.pubkey_legacy);
+        if (inserted) {
+            it->second.sn = sn;
+            order_.push_back(sn.pubkey_legacy);
+        }
+        it->second.queue.push_back(job{b});
+        stats_.batches_queued++;
+    }
+}
+
+void RelayScheduler::release(batch& b) {
+    if (--b.pending > 0)
+        return;
+    stats_.bytes_queued -= b.data.size();
+    space_cv_.notify_all();
+}
+
+RelayScheduler::ready_list RelayScheduler::take_ready(clock::time_point now) {
+    ready_list ready;
+    if (stopping_)
+        return ready;
+
+    if (conf_.max_bytes_per_sec > 0) {
+        // Allow bursts of up to a second's worth of sending
+        double rate = conf_.max_bytes_per_sec;
+        rate_tokens_ = std::min(
+                rate,
+                rate_tokens_ + rate * std::chrono::duration<double>{now - last_refill_}.count());
+    }
+    last_refill_ = now;
+
+    bool capped = false;
+    for (size_t i = 0, n = order_.size(); i < n && !capped; i++) {
+        auto pk = order_.front();
+        order_.pop_front();
+        auto& p = peers_.at(pk);
+        while (p.in_flight < conf_.peer_window && !p.queue.empty() &&
+               p.queue.front().not_before <= now) {
+            size_t size = p.queue.front().b->data.size();
+            if ((stats_.bytes_in_flight > 0 &&
+                 stats_.bytes_in_flight + size > conf_.max_inflight_bytes) ||
+                (conf_.max_bytes_per_sec > 0 && rate_tokens_ < 0)) {
+                capped = true;
+                break;
+            }
+            p.in_flight++;
+            stats_.bytes_in_flight += size;
+            rate_tokens_ -= size;
+            ready.emplace_back(p.sn, std::move(p.queue.front()));
+            p.queue.pop_front();
+        }
+        // Peers go to the back of the line once served, so that whoever is next gets first dibs
+        // on the caps next time.
+        order_.push_back(pk);
+    }
+    return ready;
+}
+
+void RelayScheduler::send(ready_list ready) {
+    for (auto& [sn, j] : ready) {
+        auto& data = j.b->data;
+        send_(sn, data, [this, sn = sn, j = std::move(j)](bool success) {
+            on_sent(sn, j, success);
+        });
+    }
+}
+
+void RelayScheduler::on_sent(const sn_record& sn, job j, bool success) {
+    bool gave_up = false;
+    {
+        std::lock_guard lock{mutex_};
+        size_t size = j.b->data.size();
+        OXENSS_PROBE(relay_sent, size, int{success}, j.attempts + 1);
+        stats_.bytes_in_flight -= size;
+        auto it = peers_.find(sn.pubkey_legacy);
+        assert(it != peers_.end());
+        auto& p = it->second;
+        p.in_flight--;
+
+        if (success) {
+            stats_.batches_sent++;
+            stats_.bytes_sent += size;
+            release(*j.b);
+        } else if (++j.attempts >= conf_.max_attempts || stopping_) {
+            stats_.batches_failed++;
+            release(*j.b);
+            gave_up = true;
+        } else {
+            stats_.retries++;
+            auto backoff = std::min(
+                    conf_.retry_backoff * (1 << std::min(j.attempts - 1, 16)),
+                    conf_.retry_backoff_max);
+            j.not_before = clock::now() + backoff;
+            p.queue.push_front(std::move(j));
+        }
+
+        if (p.queue.empty() && p.in_flight == 0) {
+            peers_.erase(it);
+            order_.erase(std::find(order_.begin(), order_.end(), sn.pubkey_legacy));
+        }
+    }
+
+    if (gave_up) {
+        log::warning(
+                logcat,
+                "Giving up on relaying a batch of data to {} after {} attempts",
+                sn.pubkey_legacy,
+                conf_.max_attempts);
+        on_failure_(sn);
+    } else if (!success) {
+        log::debug(logcat, "Failed to relay batch data to {}; will retry", sn.pubkey_legacy);
+    }
+
+    dispatch();
+}
+
+void RelayScheduler::dispatch() {
+    ready_list ready;
+    {
+        std::lock_guard lock{mutex_};
+        ready = take_ready(clock::now());
+    }
+    send(std::move(ready));
+}
+
+void RelayScheduler::tick() {
+    dispatch();
+
+    auto now = clock::now();
+    std::unique_lock lock{mutex_};
+    bool active = !peers_.empty() || producing_ || !producers_.empty();
+    if (active && !active_)
+        active_since_ = now;
+    active_ = active;
+
+    // We only log about relays that take a while, so that the many small pushes we make don't
+    // spam the logs.
+    bool log_progress = active && now - active_since_ >= PROGRESS_LOG_INTERVAL &&
+                        now - last_progress_log_ >= PROGRESS_LOG_INTERVAL;
+    bool log_finished = !active && logged_active_;
+    if (!log_progress && !log_finished)
+        return;
+    if (log_progress)
+        last_progress_log_ = now;
+    logged_active_ = log_progress;
+    lock.unlock();
+
+    auto p = get_progress();
+    log::info(
+            logcat,
+            "Relay {}: {}/{} batches delivered ({} failed, {} retries), {} MB sent; {} peers and "
+            "{} producers pending, {} MB queued",
+            log_progress ? "in progress" : "finished",
+            p.batches_sent,
+            p.batches_queued,
+            p.batches_failed,
+            p.retries,
+            p.bytes_sent / 1'000'000,
+            p.peers_pending,
+            p.producers_pending,
+            p.bytes_queued / 1'000'000);
+}
+
+RelayScheduler::progress RelayScheduler::get_progress() const {
+    std::lock_guard lock{mutex_};
+    auto p = stats_;
+    p.peers_pending = peers_.size();
+    p.producers_pending = producers_.size() + producing_;
+    return p;
+}
+
+size_t RelayScheduler::memory_usage() const {
+    std::lock_guard lock{mutex_};
+    size_t bytes = stats_.bytes_queued + util::hashtable_bytes(peers_) + util::heap_bytes(order_);
+    for (auto& [pk, p] : peers_)
+        bytes += util::heap_bytes(p.queue);
+    return bytes;
+}
+
+std::vector<RelayScheduler::queued_batch> RelayScheduler::take_queued() {
+    std::vector<queued_batch> taken;
+    {
+        std::lock_guard lock{mutex_};
+        stopping_ = true;
+        producers_.clear();
+        // A batch queued for several peers is taken just once, with all of them
+        std::unordered_map<const batch*, size_t> index;
+        for (auto& pk : order_) {
+            auto& p = peers_.at(pk);
+            for (auto& j : p.queue) {
+                auto [it, inserted] = index.try_emplace(j.b.get(), taken.size());
+                if (inserted)
+                    taken.push_back({j.b->data, {}});
+                taken[it->second].peers.push_back(pk);
+                release(*j.b);
+            }
+            p.queue.clear();
+        }
+        for (auto it = order_.begin(); it != order_.end();) {
+            if (auto p = peers_.find(*it); p->second.in_flight == 0) {
+                peers_.erase(p);
+                it = order_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    space_cv_.notify_all();
+    producer_cv_.notify_all();
+    return taken;
+}
+
+namespace {
+    // Version of the serialize_relay_queue format
+    constexpr int RELAY_QUEUE_VERSION = 1;
+}  // namespace
+
+std::string serialize_relay_queue(
+        const std::vector<RelayScheduler::queued_batch>& batches,
+        std::chrono::system_clock::time_point saved) {
+    oxenc::bt_dict_producer d;
+    {
+        auto q = d.append_list("q");
+        for (const auto& b : batches) {
+            auto l = q.append_list();
+            l.append(b.data);
+            std::string pks;
+            pks.reserve(32 * b.peers.size());
+            for (const auto& pk : b.peers)
+                pks += pk.view();
+            l.append(pks);
+        }
+    }
+    d.append("t", std::chrono::floor<std::chrono::seconds>(saved.time_since_epoch()).count());
+    d.append("v", RELAY_QUEUE_VERSION);
+    return std::move(d).str();
+}
+
+std::optional<std::pair<
+        std::vector<RelayScheduler::queued_batch>,
+        std::chrono::system_clock::time_point>>
+deserialize_relay_queue(std::string_view data) {
+    std::pair<std::vector<RelayScheduler::queued_batch>, std::chrono::system_clock::time_point>
+            result;
+    auto& [batches, saved] = result;
+    try {
+        oxenc::bt_dict_consumer d{data};
+        if (!d.skip_until("q"))
+            throw std::invalid_argument{"missing q"};
+        for (auto q = d.consume_list_consumer(); !q.is_finished();) {
+            auto l = q.consume_list_consumer();
+            auto& b = batches.emplace_back();
+            b.data = l.consume_string();
+            auto pks = l.consume_string_view();
+            if (pks.size() % 32 != 0)
+                throw std::invalid_argument{"invalid peer pubkeys"};
+            for (size_t i = 0; i < pks.size(); i += 32)
+                std::memcpy(b.peers.emplace_back().data(), pks.data() + i, 32);
+        }
+        if (!d.skip_until("t"))
+            throw std::invalid_argument{"missing t"};
+        saved = std::chrono::system_clock::time_point{
+                std::chrono::seconds{d.consume_integer<int64_t>()}};
+        if (!d.skip_until("v"))
+            throw std::invalid_argument{"missing v"};
+        if (auto v = d.consume_integer<int>(); v != RELAY_QUEUE_VERSION)
+            throw std::invalid_argument{"unsupported version " + std::to_string(v)};
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed to deserialize saved relay queue: {}", e.what());
+        return std::nullopt;
+    }
+    return result;
+}
+
+}  // namespace oxenss::snode
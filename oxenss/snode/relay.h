@@ -0,0 +1,216 @@
+#pragma once
+
+#include "sn_record.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace oxenss::snode {
+
+using namespace std::literals;
+
+/// Flow-controlled delivery of serialized message batches (see MessageSerializer) to other service
+/// nodes.  Batches are queued per peer, and sent with at most a small window of requests in flight
+/// to each peer, subject to global caps on the bytes in flight and on the send rate.  Failed sends
+/// are retried with exponential backoff before being given up on.
+///
+/// Bulk relays (such as bootstrapping a swarm from our whole database) are run as "producers" on a
+/// dedicated thread, where producing a batch waits for queue space; this bounds the memory held in
+/// queued batches no matter how much data there is to relay.  Batches can also be queued directly
+/// (via enqueue()) from any thread, which never waits.
+///
+/// All methods are thread-safe.
+class RelayScheduler {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /// Sends `batch` to `sn`, invoking `done` (from any thread) with the outcome once the send
+    /// completes or fails.  Should not invoke `done` synchronously.
+    using send_fn = std::function<void(
+            const sn_record& sn, const std::string& batch, std::function<void(bool)> done)>;
+
+    /// Called when we give up on delivering a batch to a peer.
+    using failure_fn = std::function<void(const sn_record& sn)>;
+
+    /// Produces batches by calling `emit` for each one; `emit` returns false if the producer
+    /// should stop (because we are shutting down).
+    using producer_fn = std::function<void(const std::function<bool(std::string)>& emit)>;
+
+    struct config {
+        // Maximum number of requests in flight to any one peer
+        int peer_window = 2;
+        // Maximum total bytes in flight across all peers.  We always allow at least one request,
+        // however, even if it is larger than this.
+        size_t max_inflight_bytes = 64'000'000;
+        // Producers wait before producing a new batch while queued (unsent and in-flight) batches
+        // take up more than this many bytes.  (Each batch is counted once no matter how many peers
+        // it is queued for).
+        size_t max_queued_bytes = 128'000'000;
+        // Global send rate cap, in bytes per second; 0 means unlimited.
+        uint64_t max_bytes_per_sec = 50'000'000;
+        // Total number of attempts to deliver a batch to a peer before giving up on it
+        int max_attempts = 5;
+        // The delay before the first retry of a failed send; doubles for each subsequent failure
+        // (up to `retry_backoff_max`).
+        std::chrono::milliseconds retry_backoff = 2s;
+        std::chrono::milliseconds retry_backoff_max = 1min;
+    };
+
+    // How often tick() should be called to retry sends when their backoff expires and to send
+    // batches held back by the rate cap.
+    inline static constexpr auto TICK_INTERVAL = 250ms;
+
+    // How often we log the progress of an ongoing relay
+    inline static constexpr auto PROGRESS_LOG_INTERVAL = 10s;
+
+    struct progress {
+        uint64_t batches_queued = 0;  // Batch deliveries ever queued (one per batch per peer)
+        uint64_t batches_sent = 0;    // ... of which were delivered
+        uint64_t batches_failed = 0;  // ... of which were given up on
+        uint64_t bytes_sent = 0;
+        uint64_t retries = 0;
+        size_t peers_pending = 0;  // Peers with queued or in-flight batches
+        size_t producers_pending = 0;
+        size_t bytes_queued = 0;
+        size_t bytes_in_flight = 0;
+
+        // True if there is nothing queued, in flight, or left to produce
+        bool idle() const { return peers_pending == 0 && producers_pending == 0; }
+    };
+
+    RelayScheduler(send_fn send, failure_fn on_failure, config conf);
+    RelayScheduler(send_fn send, failure_fn on_failure) :
+            RelayScheduler{std::move(send), std::move(on_failure), config{}} {}
+
+    // Stops the producer thread and drops anything still queued.
+    ~RelayScheduler();
+
+    RelayScheduler(const RelayScheduler&) = delete;
+    RelayScheduler& operator=(const RelayScheduler&) = delete;
+
+    /// Queues a batch to be delivered to each of `peers`.  Never waits.
+    void enqueue(std::string batch, const std::vector<sn_record>& peers);
+
+    /// Queues a producer to be run (after any earlier ones) on the producer thread.  Each batch it
+    /// emits is delivered to each of `peers`.
+    void add_producer(std::vector<sn_record> peers, producer_fn producer);
+
+    /// Sends whatever is ready to be sent, and logs progress if due.  Should be called every
+    /// TICK_INTERVAL.
+    void tick();
+
+    progress get_progress() const;
+
+    /// Returns (an estimate of) the memory held by the queue, in bytes: the data of the batches not
+    /// yet delivered to all of their peers, plus our per-peer bookkeeping.
+    size_t memory_usage() const;
+
+    struct queued_batch {
+        std::string data;
+        std::vector<crypto::legacy_pubkey> peers;  // The peers it is still queued for
+    };
+
+    /// Stops all sending and producing, and returns the batches still waiting to be sent, along
+    /// with the peers each is queued for, so that they can be saved and relayed after a restart.
+    /// Batches in flight are left to finish (but are not retried if they fail), and the batches
+    /// that pending producers would have produced are not included.
+    std::vector<queued_batch> take_queued();
+
+  private:
+    struct batch {
+        std::string data;
+        size_t pending;  // How many peers this batch is still queued or in flight for
+    };
+
+    struct job {
+        std::shared_ptr<batch> b;
+        int attempts = 0;
+        clock::time_point not_before{};
+    };
+
+    struct peer_state {
+        sn_record sn;
+        std::deque<job> queue;
+        int in_flight = 0;
+    };
+
+    struct pending_producer {
+        std::vector<sn_record> peers;
+        producer_fn produce;
+    };
+
+    const send_fn send_;
+    const failure_fn on_failure_;
+    const config conf_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable space_cv_;     // Signalled when queued bytes are released
+    std::condition_variable producer_cv_;  // Signalled when a producer is added, or on shutdown
+    std::unordered_map<crypto::legacy_pubkey, peer_state> peers_;
+    // Round-robin order in which peers get to send, so that no peer starves the others of the
+    // global caps.  Contains exactly the keys of `peers_`.
+    std::deque<crypto::legacy_pubkey> order_;
+    std::deque<pending_producer> producers_;
+    bool producing_ = false;
+    bool stopping_ = false;
+
+    progress stats_;
+    double rate_tokens_ = 0;  // Send rate allowance, in bytes; may go negative after a send
+    clock::time_point last_refill_ = clock::now();
+    clock::time_point active_since_{};
+    clock::time_point last_progress_log_{};
+    bool active_ = false;
+    bool logged_active_ = false;
+
+    std::thread producer_thread_;
+
+    void producer_loop();
+
+    // Queues the batch for each of the peers.  Called with the lock held.
+    void enqueue_locked(std::shared_ptr<batch> b, const std::vector<sn_record>& peers);
+
+    // Drops one peer's reference to a batch, releasing its queued bytes if it was the last.
+    // Called with the lock held.
+    void release(batch& b);
+
+    using ready_list = std::vector<std::pair<sn_record, job>>;
+
+    // Pops the jobs that can be sent right now, returning them paired with the destination.
+    // Called with the lock held.
+    ready_list take_ready(clock::time_point now);
+
+    // Sends the given jobs; must be called without the lock held.
+    void send(ready_list ready);
+
+    void on_sent(const sn_record& sn, job j, bool success);
+
+    // Calls take_ready() and then send()s the result
+    void dispatch();
+};
+
+// Serializes the batches taken from a RelayScheduler (see take_queued()), along with the time at
+// which they are being saved, into a bt-encoded form for saving across a restart.
+std::string serialize_relay_queue(
+        const std::vector<RelayScheduler::queued_batch>& batches,
+        std::chrono::system_clock::time_point saved);
+
+// Deserializes a value produced by serialize_relay_queue, returning the batches and the time they
+// were saved; returns nullopt if the value is invalid.
+std::optional<std::pair<
+        std::vector<RelayScheduler::queued_batch>,
+        std::chrono::system_clock::time_point>>
+deserialize_relay_queue(std::string_view data);
+
+}  // namespace oxenss::snode
@@ -6,62 +6,168 @@
 #include <oxenss/utils/time.hpp>
 
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
 #include <oxenc/bt_serialize.h>
 
+#include <algorithm>
 #include <chrono>
+#include <stdexcept>
 
 namespace oxenss::snode {
 
 static auto logcat = log::Cat("snode");
 
-std::vector<std::string> serialize_messages(
-        std::function<const message*()> next_msg, uint8_t version) {
-    std::vector<std::string> res;
+namespace {
 
-    if (version == SERIALIZATION_VERSION_BT) {
-        oxenc::bt_list l;
-        size_t counter = 2;
-        while (auto* msg = next_msg()) {
-            size_t ser_size = 1 +                       // version byte
-                              2 +                       // l...e
-                              36 +                      // 33:pubkey
-                              2 * 15 +                  // millisecond epochs (13 digits) + `i...e`
-                              (4 + msg->hash.size()) +  // xxx:HASH
-                              (6 + msg->data.size())    // xxxxx:DATA
-                    ;
-            counter += ser_size;
-            if (!l.empty() && counter > SERIALIZATION_BATCH_SIZE) {
-                // Adding this message would push us over the limit, so finish it off and start
-                // a new serialization piece.
-                std::ostringstream oss;
-                oss << SERIALIZATION_VERSION_BT << oxenc::bt_serializer(l);
-                res.push_back(oss.str());
-                l.clear();
-                counter = 1 + 2 + ser_size;
-            }
-            assert(msg->pubkey);
-            l.push_back(oxenc::bt_list{
-                    {msg->pubkey.prefixed_raw(),
-                     msg->hash,
-                     to_epoch_ms(msg->timestamp),
-                     to_epoch_ms(msg->expiry),
-                     msg->data}});
-        }
+    bool valid_version(uint8_t version) {
+        return version == SERIALIZATION_VERSION_BT || version == SERIALIZATION_VERSION_COMPACT;
+    }
+
+    void append_string(std::string& out, std::string_view s) {
+        out += std::to_string(s.size());
+        out += ':';
+        out += s;
+    }
+
+    void append_int(std::string& out, int64_t i) {
+        out += 'i';
+        out += std::to_string(i);
+        out += 'e';
+    }
 
-        std::ostringstream oss;
-        oss << uint8_t{1} /* version*/ << oxenc::bt_serializer(l);
-        res.push_back(oss.str());
-    } else {
+    // The start of a v2 owner group, up to the opening of its message list
+    std::string group_header(std::string_view owner, int64_t base) {
+        std::string h{"l"};
+        append_string(h, owner);
+        append_int(h, base);
+        h += 'l';
+        return h;
+    }
+
+    namespace_id consume_namespace(oxenc::bt_list_consumer& m) {
+        auto ns = m.consume_integer<int16_t>();
+        if (ns < NAMESPACE_MIN || ns > NAMESPACE_MAX)
+            throw std::runtime_error{"Invalid message namespace " + std::to_string(ns)};
+        return static_cast<namespace_id>(ns);
+    }
+
+}  // namespace
+
+MessageSerializer::MessageSerializer(
+        uint8_t version, std::function<void(std::string batch)> on_batch) :
+        version_{version}, on_batch_{std::move(on_batch)} {
+    if (!valid_version(version)) {
         log::critical(logcat, "Invalid serialization version {}", +version);
         throw std::logic_error{"Invalid serialization version " + std::to_string(version)};
     }
+}
 
-    return res;
+void MessageSerializer::add(const message& msg) {
+    assert(msg.pubkey);
+    if (version_ == SERIALIZATION_VERSION_COMPACT)
+        return add_compact(msg);
+
+    size_t ser_size = 1 +                      // version byte
+                      2 +                      // l...e
+                      36 +                     // 33:pubkey
+                      2 * 15 +                 // millisecond epochs (13 digits) + `i...e`
+                      (4 + msg.hash.size()) +  // xxx:HASH
+                      (6 + msg.data.size())    // xxxxx:DATA
+            ;
+    size_ += ser_size;
+    if (!list_.empty() && size_ > SERIALIZATION_BATCH_SIZE) {
+        // Adding this message would push us over the limit, so finish it off and start a new
+        // serialization piece.
+        emit();
+        size_ = 1 + 2 + ser_size;
+    }
+    list_.push_back(oxenc::bt_list{
+            {msg.pubkey.prefixed_raw(),
+             msg.hash,
+             to_epoch_ms(msg.timestamp),
+             to_epoch_ms(msg.expiry),
+             msg.data}});
 }
 
-std::vector<message> deserialize_messages(std::string_view slice) {
-    log::trace(logcat, "=== Deserializing ===");
+void MessageSerializer::add_compact(const message& msg) {
+    const auto timestamp = to_epoch_ms(msg.timestamp);
+    const bool new_group = buf_.empty() || !(msg.pubkey == owner_);
+    const auto base = new_group ? timestamp : base_;
+
+    msg_buf_.clear();
+    msg_buf_ += 'l';
+    append_string(msg_buf_, msg.hash);
+    append_int(msg_buf_, timestamp - base);
+    append_int(msg_buf_, to_epoch_ms(msg.expiry) - timestamp);
+    append_int(msg_buf_, to_int(msg.msg_namespace));
+    append_string(msg_buf_, msg.data);
+    msg_buf_ += 'e';
+
+    std::string header;
+    if (new_group)
+        header = group_header(msg.pubkey.prefixed_raw(), base);
+
+    // +3 for closing the group and batch
+    if (!buf_.empty() && (new_group ? 2 : 0) + buf_.size() + header.size() + msg_buf_.size() + 3 >
+                                 SERIALIZATION_BATCH_SIZE) {
+        emit();
+        if (!new_group)
+            header = group_header(msg.pubkey.prefixed_raw(), base);
+    }
+
+    if (buf_.empty()) {
+        buf_ += static_cast<char>(version_);
+        buf_ += 'l';
+    } else if (!header.empty()) {
+        buf_ += "ee";  // Close the previous group
+    }
+    buf_ += header;
+    buf_ += msg_buf_;
+    owner_ = msg.pubkey;
+    base_ = base;
+}
+
+void MessageSerializer::flush() {
+    if (version_ == SERIALIZATION_VERSION_COMPACT ? !buf_.empty() : !list_.empty()) {
+        emit();
+        size_ = 2;
+    }
+}
+
+void MessageSerializer::emit() {
+    batches_++;
+    if (version_ == SERIALIZATION_VERSION_COMPACT) {
+        buf_ += "eee";  // Closes the message list and group, then the list of groups
+        std::string batch;
+        batch.swap(buf_);
+        return on_batch_(std::move(batch));
+    }
+    std::ostringstream oss;
+    oss << version_ << oxenc::bt_serializer(list_);
+    list_.clear();
+    on_batch_(oss.str());
+}
+
+std::vector<std::string> serialize_messages(
+        std::function<const message*()> next_msg, uint8_t version) {
+    std::vector<std::string> res;
+
+    MessageSerializer serializer{version, [&res](std::string batch) {
+                                     res.push_back(std::move(batch));
+                                 }};
+    while (auto* msg = next_msg())
+        serializer.add(*msg);
+    serializer.flush();
+
+    // We always return at least one (possibly empty) batch
+    if (res.empty())
+        res.push_back(std::string{static_cast<char>(version)} + "le");
+
+    return res;
+}
 
+bool for_each_serialized_message(
+        std::string_view slice, const std::function<bool(const message_view&)>& f) {
     // v0 (now unsupported) didn't send a version at all, and sent things incredibly
     // inefficiently. v1+ put the version as the first byte (but can't use any of
     // '0'..'9','a'..'f','A'..'F' because v0 started out with a hex pubkey).
@@ -71,36 +177,172 @@ std::vector<message> deserialize_messages(std::string_view slice) {
         slice.remove_prefix(1);
     }
 
-    if (version != SERIALIZATION_VERSION_BT) {
+    if (!valid_version(version)) {
         log::error(logcat, "Invalid deserialization version {}", +version);
-        return {};
+        return false;
     }
 
-    // v1:
-    std::vector<message> result;
-    try {
-        oxenc::bt_list_consumer l{slice};
+    oxenc::bt_list_consumer l{slice};
+    user_pubkey pubkey;
+
+    if (version == SERIALIZATION_VERSION_BT) {
         while (!l.is_finished()) {
-            auto& item = result.emplace_back();
             auto m = l.consume_list_consumer();
-            if (!item.pubkey.load(m.consume_string_view())) {
+            if (!pubkey.load(m.consume_string_view())) {
                 log::debug(logcat, "Unable to deserialize(v1) pubkey");
-                return {};
+                return false;
             }
-            item.hash = m.consume_string();
-            item.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
-            item.expiry = from_epoch_ms(m.consume_integer<int64_t>());
-            item.data = m.consume_string();
+            auto hash = m.consume_string_view();
+            auto timestamp = from_epoch_ms(m.consume_integer<int64_t>());
+            auto expiry = from_epoch_ms(m.consume_integer<int64_t>());
+            auto data = m.consume_string_view();
+            if (!f({pubkey, hash, namespace_id::Default, timestamp, expiry, data}))
+                return true;
         }
-    } catch (const std::exception& e) {
-        throw e;
-        log::debug(logcat, "Failed to deserialize(v1): {}", e.what());
-        return {};
+        return true;
     }
 
+    // v2:
+    while (!l.is_finished()) {
+        auto group = l.consume_list_consumer();
+        if (!pubkey.load(group.consume_string_view())) {
+            log::debug(logcat, "Unable to deserialize(v2) pubkey");
+            return false;
+        }
+        auto base = group.consume_integer<int64_t>();
+        for (auto msgs = group.consume_list_consumer(); !msgs.is_finished();) {
+            auto m = msgs.consume_list_consumer();
+            auto hash = m.consume_string_view();
+            auto timestamp = base + m.consume_integer<int64_t>();
+            auto expiry = timestamp + m.consume_integer<int64_t>();
+            auto ns = consume_namespace(m);
+            auto data = m.consume_string_view();
+            if (!f({pubkey, hash, ns, from_epoch_ms(timestamp), from_epoch_ms(expiry), data}))
+                return true;
+        }
+    }
+    return true;
+}
+
+std::vector<message> deserialize_messages(std::string_view slice) {
+    log::trace(logcat, "=== Deserializing ===");
+
+    std::vector<message> result;
+    if (!for_each_serialized_message(slice, [&result](const message_view& m) {
+            result.push_back(m.to_message());
+            return true;
+        }))
+        return {};
+
     log::trace(logcat, "=== END ===");
 
     return result;
 }
 
+void split_serialized_messages(
+        std::string_view blob, size_t max_size, const std::function<void(std::string)>& chunk) {
+    if (blob.empty() || !valid_version(static_cast<uint8_t>(blob.front())))
+        throw std::runtime_error{"Invalid serialized message batch version"};
+    const char version = blob.front();
+    const bool compact = version == SERIALIZATION_VERSION_COMPACT;
+    blob.remove_prefix(1);
+
+    // v2 messages go inside their owner's group, which each chunk has to (re)open
+    std::string header;
+    bool group_open = false;
+
+    std::string current;
+    size_t count = 0;
+    auto emit = [&] {
+        if (group_open)
+            current += "ee";
+        current += 'e';
+        chunk(std::move(current));
+        current.clear();
+        count = 0;
+        group_open = false;
+    };
+    auto add = [&](std::string_view msg) {
+        size_t needed = msg.size() + (compact ? 3 : 1);
+        if (compact && !group_open)
+            needed += header.size();
+        if (count && current.size() + needed > max_size)
+            emit();
+        if (current.empty()) {
+            current.reserve(std::min(max_size, blob.size()) + 3);
+            current += version;
+            current += 'l';
+        }
+        if (compact && !group_open) {
+            current += header;
+            group_open = true;
+        }
+        current += msg;
+        count++;
+    };
+
+    oxenc::bt_list_consumer l{blob};
+    while (!l.is_finished()) {
+        if (!compact) {
+            add(l.consume_list_data());
+            continue;
+        }
+        auto group = l.consume_list_consumer();
+        auto owner = group.consume_string_view();
+        auto base = group.consume_integer<int64_t>();
+        if (group_open) {
+            current += "ee";
+            group_open = false;
+        }
+        header = group_header(owner, base);
+        for (auto msgs = group.consume_list_consumer(); !msgs.is_finished();)
+            add(msgs.consume_list_data());
+    }
+    if (!current.empty())
+        emit();
+}
+
+std::string serialize_forwarded_batch(const std::vector<forwarded_request>& reqs) {
+    oxenc::bt_list_producer out;
+    for (const auto& req : reqs) {
+        auto l = out.append_list();
+        l.append(req.method);
+        l.append(req.body);
+    }
+    return std::move(out).str();
+}
+
+std::vector<forwarded_request> deserialize_forwarded_batch(std::string_view data) {
+    std::vector<forwarded_request> result;
+    oxenc::bt_list_consumer l{data};
+    while (!l.is_finished()) {
+        auto req = l.consume_list_consumer();
+        auto& r = result.emplace_back();
+        r.method = req.consume_string();
+        r.body = req.consume_string();
+    }
+    return result;
+}
+
+std::string serialize_forwarded_replies(const std::vector<std::vector<std::string>>& replies) {
+    oxenc::bt_list_producer out;
+    for (const auto& parts : replies) {
+        auto l = out.append_list();
+        for (const auto& part : parts)
+            l.append(part);
+    }
+    return std::move(out).str();
+}
+
+std::vector<std::vector<std::string>> deserialize_forwarded_replies(std::string_view data) {
+    std::vector<std::vector<std::string>> result;
+    oxenc::bt_list_consumer l{data};
+    while (!l.is_finished()) {
+        auto& parts = result.emplace_back();
+        for (auto reply = l.consume_list_consumer(); !reply.is_finished();)
+            parts.push_back(reply.consume_string());
+    }
+    return result;
+}
+
 }  // namespace oxenss::snode
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <oxenss/common/message.h>
+#include <oxenc/bt_value.h>
 
 namespace oxenss::snode {
 
@@ -12,6 +15,61 @@ inline constexpr size_t SERIALIZATION_BATCH_SIZE = 9'000'000;
 // Newer serialization version based on bt-encoding.
 inline constexpr uint8_t SERIALIZATION_VERSION_BT = 1;
 
+// Compact bt-encoded version: messages are grouped by owner, so that each group gives the owner
+// pubkey once, along with a base timestamp; each message then gives its timestamp relative to the
+// base and its expiry relative to its timestamp (and, unlike v1, its namespace).  That is, a batch
+// is the version byte followed by:
+//
+//     l
+//       l 33:OWNER i<BASE>e l
+//         l <HASH> i<TIMESTAMP-BASE>e i<EXPIRY-TIMESTAMP>e i<NAMESPACE>e <DATA> e
+//         ...
+//       e e
+//       ...
+//     e
+//
+// (with millisecond times).  A group can be split across batches by repeating its header.
+inline constexpr uint8_t SERIALIZATION_VERSION_COMPACT = 2;
+
+// Incrementally serializes messages into batches of (approximately) at most
+// SERIALIZATION_BATCH_SIZE bytes, handing each batch off to a callback as soon as it is complete
+// so that the caller never needs to hold more than a single batch in memory.
+class MessageSerializer {
+  public:
+    // Throws std::logic_error if `version` is not a supported serialization version.
+    MessageSerializer(uint8_t version, std::function<void(std::string batch)> on_batch);
+
+    // Adds a message to the current batch, first emitting the current batch if adding the message
+    // would push it over the batch size limit.  The message is copied, and so does not need to
+    // remain valid after the call.
+    void add(const message& msg);
+
+    // Emits the current batch, if non-empty.  Must be called after the last `add()` to get the
+    // final batch.
+    void flush();
+
+    // Returns the number of batches emitted so far.
+    size_t batches() const { return batches_; }
+
+  private:
+    const uint8_t version_;
+    std::function<void(std::string)> on_batch_;
+    size_t batches_ = 0;
+
+    // v1: the batch being built, and its (estimated) serialized size
+    oxenc::bt_list list_;
+    size_t size_ = 2;
+
+    // v2: the serialized batch being built, and the owner and base timestamp of its last group
+    std::string buf_;
+    std::string msg_buf_;
+    user_pubkey owner_;
+    int64_t base_ = 0;
+
+    void add_compact(const message& msg);
+    void emit();
+};
+
 std::vector<std::string> serialize_messages(
         std::function<const message*()> next_msg, uint8_t version);
 
@@ -24,6 +82,59 @@ std::vector<std::string> serialize_messages(It begin, It end, uint8_t version) {
             version);
 }
 
+// A message in a serialized batch, as given to for_each_serialized_message: the hash and data are
+// views into the batch.
+struct message_view {
+    const user_pubkey& pubkey;
+    std::string_view hash;
+    namespace_id msg_namespace;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::system_clock::time_point expiry;
+    std::string_view data;
+
+    message to_message() const {
+        return {pubkey, std::string{hash}, msg_namespace, timestamp, expiry, std::string{data}};
+    }
+};
+
+// Calls `f` with each message of a serialized batch (of any supported version) in turn, parsing
+// them as it goes rather than building the whole batch in memory first.  `f` can return false to
+// stop early.  Returns false (having logged why) if the version or an owner pubkey is invalid;
+// throws if the batch is otherwise malformed.  In either case `f` will have been called for the
+// messages preceding the problem.
+bool for_each_serialized_message(
+        std::string_view blob, const std::function<bool(const message_view&)>& f);
+
+// Deserializes a whole batch.  Returns an empty vector if the version or a pubkey is invalid, and
+// throws on malformed input.
 std::vector<message> deserialize_messages(std::string_view blob);
 
+// Splits a serialized batch of messages (as produced by MessageSerializer) into smaller batches of
+// (approximately) at most `max_size` bytes, each of which deserialize_messages() accepts on its
+// own, so that a batch being streamed to a peer can be stored by the peer piece by piece as it
+// arrives.  A single message larger than `max_size` gets a chunk of its own.  Throws if `blob`
+// is not a valid serialized batch.
+void split_serialized_messages(
+        std::string_view blob, size_t max_size, const std::function<void(std::string)>& chunk);
+
+// A client request forwarded to a swarm peer: the rpc method name and its (bt-encoded) parameters.
+struct forwarded_request {
+    std::string method;
+    std::string body;
+};
+
+// Serializes client requests forwarded to a swarm peer into the single data part of an
+// sn.storage_cc_batch request.
+std::string serialize_forwarded_batch(const std::vector<forwarded_request>& reqs);
+
+// Deserializes the data part of an sn.storage_cc_batch request.  Throws on invalid input.
+std::vector<forwarded_request> deserialize_forwarded_batch(std::string_view data);
+
+// Serializes the replies to an sn.storage_cc_batch request, one per request in the same order, each
+// of which holds the reply parts a single sn.storage_cc request would have replied with.
+std::string serialize_forwarded_replies(const std::vector<std::vector<std::string>>& replies);
+
+// Deserializes the reply to an sn.storage_cc_batch request.  Throws on invalid input.
+std::vector<std::vector<std::string>> deserialize_forwarded_replies(std::string_view data);
+
 }  // namespace oxenss::snode
@@ -1,28 +1,43 @@
 #include "service_node.h"
 
+#include "metrics.h"
 #include "serialization.h"
 #include <oxenmq/connections.h>
 #include <oxenss/version.h>
 #include <oxenss/common/mainnet.h>
+#include <oxenss/crypto/shared_key_cache.h>
+#include <oxenss/crypto/signature_cache.h>
+#include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/server/base.h>
 #include <oxenss/server/omq.h>
+#include <oxenss/server/quic.h>
+#include <oxenss/server/tls_sessions.h>
+#include <oxenss/logging/async_sink.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <numeric>
+#include <oxenss/utils/file.hpp>
+#include <oxenss/utils/memory.hpp>
+#include <oxenss/utils/probes.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/random.hpp>
 
 #include <chrono>
 #include <cpr/cpr.h>
 #include <mutex>
+#include <thread>
 #include <nlohmann/json.hpp>
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <array>
+#include <unordered_set>
 
 using json = nlohmann::json;
 
@@ -43,25 +58,137 @@ ServiceNode::ServiceNode(
         const crypto::legacy_seckey& skey,
         server::OMQ& omq_server,
         const std::filesystem::path& db_location,
-        const bool force_start) :
+        const bool force_start,
+        std::chrono::milliseconds store_batch_window,
+        std::chrono::milliseconds forward_batch_window,
+        size_t db_max_writers,
+        size_t db_max_readers,
+        size_t db_shards,
+        std::function<void(Database&)> db_setup) :
         force_start_{force_start},
-        db_{std::make_unique<Database>(db_location)},
         our_address_{std::move(address)},
         our_seckey_{skey},
         omq_server_{omq_server},
-        all_stats_{*omq_server} {
+        all_stats_{*omq_server},
+        store_batch_window_{store_batch_window},
+        saved_state_path_{db_location / SAVED_BLOCK_UPDATE_FILE},
+        saved_relay_queue_path_{db_location / SAVED_RELAY_QUEUE_FILE},
+        forward_batch_window_{forward_batch_window} {
     mq_servers_.push_back(&omq_server);
     swarm_ = std::make_unique<Swarm>(our_address_);
 
+    relay_ = std::make_unique<RelayScheduler>(
+            [this](const sn_record& sn, const std::string& batch, std::function<void(bool)> done) {
+                log::debug(
+                        logcat,
+                        "Relaying data to: {} (x25519 pubkey {})",
+                        sn.pubkey_legacy,
+                        sn.pubkey_x25519);
+                auto via_omq = [this, sn, b = &batch](std::function<void(bool)> done) {
+                    omq_server_->request(
+                            sn.pubkey_x25519.view(),
+                            "sn.data",
+                            [done = std::move(done)](bool success, auto&& data) {
+                                // (A peer that isn't ready yet answers SN_DATA_NOT_READY, for
+                                // us to retry later)
+                                done(success &&
+                                     (data.empty() || data.front() != SN_DATA_NOT_READY));
+                            },
+                            *b);
+                };
+                // The scheduler keeps `batch` alive until we call `done`
+                if (auto* quic = quic_data_relay_.load())
+                    return quic->send_data(sn, batch, std::move(done), std::move(via_omq));
+                via_omq(std::move(done));
+            },
+            [this](const sn_record& sn) { all_stats_.record_push_failed(sn.pubkey_legacy); });
+    omq_server->add_timer([this] { relay_->tick(); }, RelayScheduler::TICK_INTERVAL);
+
+    warmer_ = std::make_unique<ConnectionWarmer>(
+            [this](const sn_record& sn) {
+                omq_server_->connect_sn(sn.pubkey_x25519.view(), PEER_CONNECTION_KEEP_ALIVE);
+                if (auto* quic = quic_data_relay_.load()) {
+                    try {
+                        quic->warm_relay_connection(sn);
+                    } catch (const std::exception& e) {
+                        log::debug(
+                                logcat,
+                                "Failed to connect to {} over QUIC: {}",
+                                sn.pubkey_legacy,
+                                e.what());
+                    }
+                }
+            },
+            [this](const sn_record& sn) {
+                omq_server_->disconnect(oxenmq::ConnectionID{sn.pubkey_x25519.str()});
+                if (auto* quic = quic_data_relay_.load())
+                    quic->close_relay_connection(sn.pubkey_ed25519);
+            });
+    omq_server->add_timer([this] { warmer_->tick(); }, ConnectionWarmer::TICK_INTERVAL);
+
+    load_saved_state();
+    load_saved_relays();
+
     log::info(logcat, "Requesting initial swarm state");
 
+    // Expiry cleanup normally runs every CLEANUP_PERIOD, but runs more often while it has a backlog
+    // left over from hitting its time budget.  Once expired messages are gone we also evict the
+    // messages closest to expiry if the database is getting full.  (The db is internally
+    // thread-safe, so we don't need to hold sn_mutex_, which would block everything else during the
+    // cleanup).
+    omq_server->add_timer(
+            [this, last = std::chrono::steady_clock::now()]() mutable {
+                if (!db_ready())
+                    return;
+                auto now = std::chrono::steady_clock::now();
+                if (db().expired_backlog() == 0 && now - last < Database::CLEANUP_PERIOD)
+                    return;
+                last = now;
+                db().clean_expired();
+                if (db().expired_backlog() == 0)
+                    db().make_space();
+                db_used_bytes_ = db().get_used_bytes();
+                db_total_bytes_ = db().get_total_bytes();
+            },
+            Database::CLEANUP_BACKLOG_PERIOD);
+
+    // Builds (and periodically rebuilds) the db's in-memory message hash filter
     omq_server->add_timer(
             [this] {
-                std::lock_guard l{sn_mutex_};
-                db_->clean_expired();
+                if (db_ready())
+                    db().rebuild_hash_filter();
             },
             Database::CLEANUP_PERIOD);
 
+    // Checks the stored per-owner message counts a slice of owners at a time
+    omq_server->add_timer(
+            [this] {
+                if (db_ready())
+                    db().reconcile_owner_counts();
+            },
+            Database::CLEANUP_PERIOD);
+
+    // Converts an upgraded database's message hashes in the background (which we only know is
+    // needed once the database is open)
+    omq_server->add_timer(
+            [this] {
+                if (db_ready() && db().hash_migration_pending())
+                    db().migrate_hashes();
+            },
+            Database::CLEANUP_BACKLOG_PERIOD);
+
+    // (The database write itself happens on a database thread)
+    if (store_batch_window_ > 0ms)
+        omq_server_->add_timer(
+                [this] {
+                    if (store_backlog_ > 0)
+                        queue_store_flush();
+                },
+                store_batch_window_);
+
+    if (forward_batch_window_ > 0ms)
+        omq_server_->add_timer([this] { flush_forward_queues(); }, forward_batch_window_);
+
     // Periodically clean up any https request futures
     omq_server_->add_timer(
             [this] {
@@ -70,6 +197,31 @@ ServiceNode::ServiceNode(
             },
             1s);
 
+    // Send out batched push notifications
+    omq_server_->add_timer(
+            [this] {
+                for (auto* s : mq_servers_)
+                    s->flush_notifies();
+            },
+            server::MQBase::NOTIFY_BATCH_WINDOW);
+
+    // Drop push notification subscriptions that expired without being renewed
+    omq_server_->add_timer(
+            [this] {
+                for (auto* s : mq_servers_)
+                    s->sweep_monitors();
+            },
+            server::MonitorRegistry::SWEEP_INTERVAL);
+
+    // Measure how long jobs currently wait for a worker thread, for admission control
+    omq_server_->add_timer(
+            [this] {
+                omq_server_->job([this, queued = std::chrono::steady_clock::now()] {
+                    admission_.record_queue_delay(std::chrono::steady_clock::now() - queued);
+                });
+            },
+            rpc::AdmissionControl::PROBE_INTERVAL);
+
     // We really want to make sure nodes don't get stuck in "syncing" mode,
     // so if we are still "syncing" after a long time, activate SN regardless
     auto delay_timer = std::make_shared<oxenmq::TimerID>();
@@ -85,14 +237,83 @@ ServiceNode::ServiceNode(
                 syncing_ = false;
             },
             1h);
+
+    // Last, so that nothing in here can throw once the thread is running
+    db_thread_ = std::thread{[this,
+                              db_location,
+                              db_max_writers,
+                              db_max_readers,
+                              db_shards,
+                              db_setup = std::move(db_setup)] {
+        std::unique_ptr<Database> db;
+        std::exception_ptr error;
+        try {
+            db = std::make_unique<Database>(db_location, db_max_writers, db_max_readers, db_shards);
+            if (db_setup)
+                db_setup(*db);
+            db_used_bytes_ = db->get_used_bytes();
+            db_total_bytes_ = db->get_total_bytes();
+        } catch (const std::exception& e) {
+            log::critical(logcat, "Failed to open database: {}", e.what());
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard lock{db_mutex_};
+            if (db) {
+                db_ = std::move(db);
+                db_ready_ = true;
+            } else {
+                db_error_ = std::move(error);
+            }
+        }
+        db_cv_.notify_all();
+    }};
+}
+
+ServiceNode::~ServiceNode() {
+    if (snapshot_import_thread_.joinable())
+        snapshot_import_thread_.join();
+    if (db_thread_.joinable())
+        db_thread_.join();
+}
+
+Database& ServiceNode::db() const {
+    if (db_ready_)
+        return *db_;
+    std::unique_lock lock{db_mutex_};
+    db_cv_.wait(lock, [this] { return db_ready_ || db_error_; });
+    if (db_error_)
+        std::rethrow_exception(db_error_);
+    return *db_;
 }
 
 void ServiceNode::on_oxend_connected() {
     auto started = std::chrono::steady_clock::now();
+
+    // If we have a recently saved block update then we start out with it as provisional state
+    // (which gets replaced once oxend gives us an update at least as recent), so that we can begin
+    // serving right away instead of waiting for oxend's reply.
+    bool provisional = false;
+    if (saved_state_) {
+        std::lock_guard lock{sn_mutex_};
+        auto bu = std::move(*saved_state_);
+        saved_state_.reset();
+        auto height = bu.height;
+        log::info(logcat, "Starting with saved swarm state from height {}", height);
+        syncing_ = false;
+        on_swarm_update(std::move(bu), true);
+        provisional_height_ = height;
+        provisional = true;
+    }
+
     update_swarms();
     oxend_ping();
     omq_server_->add_timer([this] { oxend_ping(); }, OXEND_PING_INTERVAL);
     omq_server_->add_timer([this] { ping_peers(); }, reachability_testing::TESTING_TIMER_INTERVAL);
+    omq_server_->add_timer([this] { anti_entropy_sync(); }, ANTI_ENTROPY_INTERVAL);
+
+    if (provisional)
+        return;
 
     std::unique_lock lock{first_response_mutex_};
     while (true) {
@@ -114,47 +335,32 @@ static T get_or(const json& j, std::string_view key, std::common_type_t<T> defau
     return default_val;
 }
 
-static block_update parse_swarm_update(const std::string& response_body) {
-    if (response_body.empty()) {
-        log::critical(logcat, "Bad oxend rpc response: no response body");
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    // map (not unordered_map) because we need the eventual swarm list to be sorted
-    std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
-    block_update bu;
-
-    log::trace(logcat, "swarm response: <{}>", response_body);
-
-    try {
-        json result = json::parse(response_body, nullptr, true);
-
-        bu.height = result.at("height").get<uint64_t>();
-        bu.block_hash = result.at("block_hash").get<std::string>();
-        bu.hardfork = result.at("hardfork").get<int>();
-        bu.snode_revision = get_or<int>(result, "snode_revision", 0);
-        bu.unchanged = get_or<bool>(result, "unchanged", false);
-        if (bu.unchanged)
-            return bu;
-
-        const json service_node_states = result.at("service_node_states");
-
+// The get_service_nodes fields we need, in sorted order (as required for bt-encoded requests)
+constexpr std::array SWARM_UPDATE_FIELDS{
+        "block_hash"sv,
+        "funded"sv,
+        "hardfork"sv,
+        "height"sv,
+        "pubkey_ed25519"sv,
+        "pubkey_x25519"sv,
+        "public_ip"sv,
+        "service_node_pubkey"sv,
+        "snode_revision"sv,
+        "storage_lmq_port"sv,
+        "storage_port"sv,
+        "swarm_id"sv};
+
+namespace {
+    // Accumulates the funded service nodes of a get_service_nodes response into a block update
+    struct swarm_update_builder {
+        block_update bu;
+        // map (not unordered_map) because we need the eventual swarm list to be sorted
+        std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
         int missing_aux_pks = 0, total = 0;
 
-        for (const auto& sn_json : service_node_states) {
-            /// We want to include (test) decommissioned nodes, but not
-            /// partially funded ones.
-            if (!sn_json.at("funded").get<bool>()) {
-                continue;
-            }
-
+        void add(sn_record&& sn, swarm_id_t swarm_id, bool have_aux_pks) {
             total++;
-            const auto& pk_hex = sn_json.at("service_node_pubkey").get_ref<const std::string&>();
-
-            const auto pk_x25519_hex = sn_json.value<std::string>("pubkey_x25519", "");
-            const auto pk_ed25519_hex = sn_json.value<std::string>("pubkey_ed25519", "");
-
-            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
+            if (!have_aux_pks) {
                 // These will always either both be present or neither present.  If they are
                 // missing there isn't much we can do: it means the remote hasn't transmitted
                 // them yet (or our local oxend hasn't received them yet).
@@ -162,20 +368,10 @@ static block_update parse_swarm_update(const std::string& response_body) {
                 log::debug(
                         logcat,
                         "ed25519/x25519 pubkeys are missing from service node info {}",
-                        pk_hex);
-                continue;
+                        sn.pubkey_legacy);
+                return;
             }
 
-            auto sn = sn_record{
-                    sn_json.at("public_ip").get_ref<const std::string&>(),
-                    sn_json.at("storage_port").get<uint16_t>(),
-                    sn_json.at("storage_lmq_port").get<uint16_t>(),
-                    crypto::legacy_pubkey::from_hex(pk_hex),
-                    crypto::ed25519_pubkey::from_hex(pk_ed25519_hex),
-                    crypto::x25519_pubkey::from_hex(pk_x25519_hex)};
-
-            const swarm_id_t swarm_id = sn_json.at("swarm_id").get<swarm_id_t>();
-
             /// Storing decommissioned nodes (with dummy swarm id) in
             /// a separate data structure as it seems less error prone
             if (swarm_id == INVALID_SWARM_ID) {
@@ -187,31 +383,244 @@ static block_update parse_swarm_update(const std::string& response_body) {
             }
         }
 
-        if (missing_aux_pks >
-            MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
-            log::warning(
-                    logcat,
-                    "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
-                    "oxend may be out of sync with the network",
-                    missing_aux_pks,
-                    total);
+        block_update finish() && {
+            if (missing_aux_pks >
+                MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
+                log::warning(
+                        logcat,
+                        "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
+                        "oxend may be out of sync with the network",
+                        missing_aux_pks,
+                        total);
+            }
+
+            for (auto& swarm : swarm_map)
+                bu.swarms.emplace_back(SwarmInfo{swarm.first, std::move(swarm.second)});
+
+            return std::move(bu);
         }
-    } catch (const std::exception& e) {
-        log::critical(logcat, "Bad oxend rpc response: invalid json ({})", e.what());
-        throw std::runtime_error("Failed to parse swarm update");
+    };
+
+    void require_key(oxenc::bt_dict_consumer& d, std::string_view key) {
+        if (!d.skip_until(key))
+            throw std::invalid_argument{"missing " + std::string{key}};
     }
 
-    for (auto const& swarm : swarm_map) {
-        bu.swarms.emplace_back(SwarmInfo{swarm.first, swarm.second});
+    // bt-encoded responses give us keys as raw bytes, but accept hex as well
+    template <typename Key>
+    Key load_key(std::string_view value) {
+        return value.size() == 64 ? Key::from_hex(value) : Key::from_bytes(value);
     }
+}  // namespace
+
+static block_update parse_swarm_update_json(const std::string& response_body) {
+    swarm_update_builder b;
+    auto& bu = b.bu;
+
+    json result = json::parse(response_body, nullptr, true);
+
+    bu.height = result.at("height").get<uint64_t>();
+    bu.block_hash = result.at("block_hash").get<std::string>();
+    bu.hardfork = result.at("hardfork").get<int>();
+    bu.snode_revision = get_or<int>(result, "snode_revision", 0);
+    bu.unchanged = get_or<bool>(result, "unchanged", false);
+    if (bu.unchanged)
+        return bu;
+
+    for (const auto& sn_json : result.at("service_node_states")) {
+        /// We want to include (test) decommissioned nodes, but not
+        /// partially funded ones.
+        if (!sn_json.at("funded").get<bool>())
+            continue;
 
-    return bu;
+        const auto pk_x25519_hex = sn_json.value<std::string>("pubkey_x25519", "");
+        const auto pk_ed25519_hex = sn_json.value<std::string>("pubkey_ed25519", "");
+        const bool have_aux_pks = !pk_x25519_hex.empty() && !pk_ed25519_hex.empty();
+
+        auto sn = sn_record{
+                sn_json.at("public_ip").get_ref<const std::string&>(),
+                sn_json.at("storage_port").get<uint16_t>(),
+                sn_json.at("storage_lmq_port").get<uint16_t>(),
+                crypto::legacy_pubkey::from_hex(
+                        sn_json.at("service_node_pubkey").get_ref<const std::string&>())};
+        if (have_aux_pks) {
+            sn.pubkey_ed25519 = crypto::ed25519_pubkey::from_hex(pk_ed25519_hex);
+            sn.pubkey_x25519 = crypto::x25519_pubkey::from_hex(pk_x25519_hex);
+        }
+
+        b.add(std::move(sn), sn_json.at("swarm_id").get<swarm_id_t>(), have_aux_pks);
+    }
+
+    return std::move(b).finish();
+}
+
+// This walks the encoded data directly, without building any intermediate representation of it, so
+// is considerably cheaper than the json equivalent for a network-sized node list.
+block_update detail::parse_swarm_update_bt(std::string_view response_body) {
+    swarm_update_builder b;
+    auto& bu = b.bu;
+
+    // Note that dict keys are sorted, so we have to consume everything in key order
+    oxenc::bt_dict_consumer d{response_body};
+    require_key(d, "block_hash");
+    auto hash = d.consume_string_view();
+    bu.block_hash = hash.size() == 32 ? oxenc::to_hex(hash) : std::string{hash};
+    require_key(d, "hardfork");
+    bu.hardfork = d.consume_integer<int>();
+    require_key(d, "height");
+    bu.height = d.consume_integer<uint64_t>();
+
+    if (d.skip_until("service_node_states")) {
+        for (auto states = d.consume_list_consumer(); !states.is_finished();) {
+            auto s = states.consume_dict_consumer();
+            require_key(s, "funded");
+            if (!s.consume_integer<int>())
+                continue;
+
+            sn_record sn;
+            auto consume_aux_pk = [&s](std::string_view key, auto& pk) {
+                if (!s.skip_until(key))
+                    return false;
+                auto value = s.consume_string_view();
+                if (value.empty())
+                    return false;
+                pk = load_key<std::remove_reference_t<decltype(pk)>>(value);
+                return true;
+            };
+            bool have_aux_pks = consume_aux_pk("pubkey_ed25519", sn.pubkey_ed25519);
+            have_aux_pks &= consume_aux_pk("pubkey_x25519", sn.pubkey_x25519);
+            require_key(s, "public_ip");
+            sn.ip = s.consume_string();
+            require_key(s, "service_node_pubkey");
+            sn.pubkey_legacy = load_key<crypto::legacy_pubkey>(s.consume_string_view());
+            require_key(s, "storage_lmq_port");
+            sn.omq_quic_port = s.consume_integer<uint16_t>();
+            require_key(s, "storage_port");
+            sn.port = s.consume_integer<uint16_t>();
+            require_key(s, "swarm_id");
+            auto swarm_id = s.consume_integer<swarm_id_t>();
+
+            b.add(std::move(sn), swarm_id, have_aux_pks);
+        }
+    }
+
+    if (d.skip_until("snode_revision"))
+        bu.snode_revision = d.consume_integer<int>();
+    else
+        bu.snode_revision = 0;
+    if (d.skip_until("unchanged"))
+        bu.unchanged = d.consume_integer<int>();
+    if (bu.unchanged)
+        return bu;
+
+    return std::move(b).finish();
+}
+
+// Parses a get_service_nodes response, which is bt-encoded if we asked for it to be (and the
+// responder supports it), and json otherwise.
+static block_update parse_swarm_update(const std::string& response_body) {
+    if (response_body.empty()) {
+        log::critical(logcat, "Bad oxend rpc response: no response body");
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    log::trace(logcat, "swarm response: <{}>", response_body);
+
+    const bool bt = response_body.front() == 'd';
+    try {
+        return bt ? detail::parse_swarm_update_bt(response_body)
+                  : parse_swarm_update_json(response_body);
+    } catch (const std::exception& e) {
+        log::critical(
+                logcat, "Bad oxend rpc response: invalid {} ({})", bt ? "bt" : "json", e.what());
+        throw std::runtime_error("Failed to parse swarm update");
+    }
 }
 
 void ServiceNode::register_mq_server(server::MQBase* server) {
     mq_servers_.push_back(server);
 }
 
+void ServiceNode::import_snapshot_on_join(std::filesystem::path src) {
+    std::lock_guard guard(sn_mutex_);
+    snapshot_import_ = std::move(src);
+}
+
+void ServiceNode::import_snapshot(
+        std::filesystem::path src,
+        uint64_t swarm_id,
+        std::optional<std::pair<uint64_t, uint64_t>> range) {
+    log::info(logcat, "Importing messages of swarm {} from {}", swarm_id, src.string());
+    try {
+        db().import_snapshot(src, range);
+    } catch (const std::exception& e) {
+        log::error(logcat, "Failed to import snapshot {}: {}", src.string(), e.what());
+        return;
+    }
+
+    // If we moved to another swarm while importing then what we imported isn't what we need, so
+    // import again (for the new swarm) on the next swarm update.
+    std::lock_guard lock{sn_mutex_};
+    if (auto state = swarm_->state();
+        state && state->is_valid() && state->our_swarm_id != swarm_id) {
+        log::warning(
+                logcat,
+                "Moved from swarm {} to swarm {} while importing from {}; importing again",
+                swarm_id,
+                state->our_swarm_id,
+                src.string());
+        snapshot_import_ = std::move(src);
+    }
+}
+
+void ServiceNode::load_saved_state() {
+    std::string data;
+    try {
+        if (!std::filesystem::exists(saved_state_path_))
+            return;
+        data = util::slurp_file(saved_state_path_);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Unable to read {}: {}", saved_state_path_.string(), e.what());
+        return;
+    }
+
+    auto saved = deserialize_block_update(data);
+    if (!saved)
+        return;
+    auto& [bu, saved_at] = *saved;
+    auto age = std::chrono::system_clock::now() - saved_at;
+    if (age > SAVED_BLOCK_UPDATE_MAX_AGE) {
+        log::info(
+                logcat,
+                "Ignoring saved swarm state from height {}: it is too old ({})",
+                bu.height,
+                util::short_duration(age));
+        return;
+    }
+    log::info(
+            logcat,
+            "Loaded saved swarm state from height {} ({} swarms, saved {} ago)",
+            bu.height,
+            bu.swarms.size(),
+            util::short_duration(age));
+    saved_state_ = std::move(bu);
+}
+
+void ServiceNode::save_state(const block_update& bu) const {
+    auto tmp = saved_state_path_;
+    tmp += ".tmp";
+    try {
+        util::dump_file(tmp, serialize_block_update(bu, std::chrono::system_clock::now()));
+        std::filesystem::rename(tmp, saved_state_path_);
+    } catch (const std::exception& e) {
+        log::warning(
+                logcat,
+                "Failed to save swarm state to {}: {}",
+                saved_state_path_.string(),
+                e.what());
+    }
+}
+
 void ServiceNode::bootstrap_data() {
     std::lock_guard guard(sn_mutex_);
 
@@ -335,8 +744,121 @@ void ServiceNode::bootstrap_data() {
     }
 }
 
+void ServiceNode::drain(std::chrono::milliseconds timeout) {
+    if (draining_.exchange(true))
+        return;
+    log::info(logcat, "Draining: refusing new client requests, finishing relays to our swarm");
+    auto started = std::chrono::steady_clock::now();
+
+    // Send off whatever is waiting for its batch window rather than waiting for the timers
+    flush_store_queue();
+    flush_forward_queues();
+
+    auto done = [this] {
+        return store_backlog_ == 0 && forwards_pending_ == 0 && relay_->get_progress().idle();
+    };
+    while (!done() && std::chrono::steady_clock::now() - started < timeout)
+        std::this_thread::sleep_for(50ms);
+
+    // Whatever relays are left get saved for after the restart.  (Bulk relays that hadn't been
+    // produced yet, such as bootstrapping a new swarm member, get restarted by the swarm changes
+    // that started them, if still needed.)
+    auto remaining = relay_->take_queued();
+    if (!remaining.empty()) {
+        size_t bytes = 0;
+        for (auto& b : remaining)
+            bytes += b.data.size();
+        auto tmp = saved_relay_queue_path_;
+        tmp += ".tmp";
+        try {
+            util::dump_file(
+                    tmp, serialize_relay_queue(remaining, std::chrono::system_clock::now()));
+            std::filesystem::rename(tmp, saved_relay_queue_path_);
+            log::info(
+                    logcat,
+                    "Saved {} unsent relay batches ({} kB) to send after restarting",
+                    remaining.size(),
+                    bytes / 1000);
+        } catch (const std::exception& e) {
+            log::warning(
+                    logcat,
+                    "Failed to save unsent relays to {}: {}",
+                    saved_relay_queue_path_.string(),
+                    e.what());
+        }
+    }
+
+    if (!db().checkpoint_wal())
+        log::warning(logcat, "Unable to fully checkpoint the database WAL");
+
+    log::info(
+            logcat,
+            "Drained in {}{}",
+            util::short_duration(std::chrono::steady_clock::now() - started),
+            done() ? "" : " (timed out)");
+}
+
+void ServiceNode::load_saved_relays() {
+    if (!std::filesystem::exists(saved_relay_queue_path_))
+        return;
+    std::string data;
+    try {
+        data = util::slurp_file(saved_relay_queue_path_);
+        // They only get one chance: if we can't send them this time around, anti-entropy can
+        std::filesystem::remove(saved_relay_queue_path_);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Unable to read {}: {}", saved_relay_queue_path_.string(), e.what());
+        return;
+    }
+
+    auto saved = deserialize_relay_queue(data);
+    if (!saved)
+        return;
+    auto& [batches, saved_at] = *saved;
+    auto age = std::chrono::system_clock::now() - saved_at;
+    if (age > SAVED_RELAY_QUEUE_MAX_AGE) {
+        log::info(
+                logcat,
+                "Ignoring {} saved relay batches: they are too old ({})",
+                batches.size(),
+                util::short_duration(age));
+        return;
+    }
+    log::info(
+            logcat,
+            "Loaded {} relay batches saved {} ago",
+            batches.size(),
+            util::short_duration(age));
+    saved_relays_ = std::move(batches);
+}
+
+void ServiceNode::send_saved_relays() {
+    std::unordered_map<crypto::legacy_pubkey, const sn_record*> peers;
+    for (auto& sn : swarm_->other_nodes())
+        peers.emplace(sn.pubkey_legacy, &sn);
+
+    size_t sent = 0;
+    for (auto& b : saved_relays_) {
+        std::vector<sn_record> to;
+        for (auto& pk : b.peers)
+            if (auto it = peers.find(pk); it != peers.end())
+                to.push_back(*it->second);
+        if (to.empty())
+            continue;
+        relay_->enqueue(std::move(b.data), to);
+        sent++;
+    }
+    log::info(
+            logcat,
+            "Relaying {} saved batches to our swarm ({} no longer needed)",
+            sent,
+            saved_relays_.size() - sent);
+    saved_relays_.clear();
+}
+
 void ServiceNode::shutdown() {
     shutting_down_ = true;
+    flush_store_queue();
 }
 
 bool ServiceNode::snode_ready(std::string* reason) {
@@ -346,8 +868,6 @@ bool ServiceNode::snode_ready(std::string* reason) {
         return false;
     }
 
-    std::lock_guard guard(sn_mutex_);
-
     std::vector<std::string> problems;
 
     if (!hf_at_least(STORAGE_SERVER_HARDFORK))
@@ -355,15 +875,18 @@ bool ServiceNode::snode_ready(std::string* reason) {
                 "not yet on hardfork {}.{}",
                 STORAGE_SERVER_HARDFORK.first,
                 STORAGE_SERVER_HARDFORK.second));
-    if (!swarm_ || !swarm_->is_valid())
+    if (!swarm_ || !swarm_->state()->is_valid())
         problems.push_back("not in any swarm");
     if (syncing_)
         problems.push_back("not done syncing");
+    if (!db_ready())
+        problems.push_back("database not open yet");
 
     if (reason)
         *reason = util::join("; ", problems);
 
-    return problems.empty() || force_start_;
+    // (force_start_ can get us going without a swarm, but not without a database)
+    return problems.empty() || (force_start_ && db_ready());
 }
 
 void ServiceNode::send_onion_to_sn(
@@ -373,28 +896,31 @@ void ServiceNode::send_onion_to_sn(
         std::function<void(bool success, std::vector<std::string> data)> cb) const {
     // Since HF18 we bencode everything (which is a bit more compact than sending the eph_key in
     // hex, plus flexible enough to allow other metadata such as the hop number and the
-    // encryption type).
+    // encryption type).  The same encoding is used over QUIC.
     data.hop_no++;
+    auto encoded = omq_server_.encode_onion_data(payload, data);
+    if (auto* quic = quic_onion_relay_.load())
+        return quic->send_onion(
+                sn, std::move(encoded), std::move(cb), [this, sn](std::string data, auto cb) {
+                    send_onion_to_sn_omq(sn, std::move(data), std::move(cb));
+                });
+    send_onion_to_sn_omq(sn, std::move(encoded), std::move(cb));
+}
+
+void ServiceNode::send_onion_to_sn_omq(
+        const sn_record& sn,
+        std::string data,
+        std::function<void(bool success, std::vector<std::string> data)> cb) const {
     omq_server_->request(
             sn.pubkey_x25519.view(),
             "sn.onion_request",
             std::move(cb),
             oxenmq::send_option::request_timeout{30s},
-            omq_server_.encode_onion_data(payload, data));
+            std::move(data));
 }
 
-void ServiceNode::relay_data_reliable(const std::string& blob, const sn_record& sn) const {
-    log::debug(
-            logcat, "Relaying data to: {} (x25519 pubkey {})", sn.pubkey_legacy, sn.pubkey_x25519);
-
-    omq_server_->request(
-            sn.pubkey_x25519.view(),
-            "sn.data",
-            [](bool success, auto&& /*data*/) {
-                if (!success)
-                    log::error(logcat, "Failed to relay batch data: timeout");
-            },
-            blob);
+void ServiceNode::relay_data_reliable(std::string blob, const sn_record& sn) const {
+    relay_->enqueue(std::move(blob), {sn});
 }
 
 void ServiceNode::record_proxy_request() {
@@ -409,6 +935,30 @@ void ServiceNode::record_retrieve_request() {
     all_stats_.bump_retrieve_requests();
 }
 
+void ServiceNode::record_onion_outcome(onion_outcome o) {
+    all_stats_.record_onion_outcome(o);
+}
+
+void ServiceNode::record_quorum_reply() {
+    all_stats_.record_quorum_reply();
+}
+
+void ServiceNode::record_late_peer_result() {
+    all_stats_.record_late_peer_result();
+}
+
+void ServiceNode::record_coalesced_store() {
+    all_stats_.record_coalesced_store();
+}
+
+void ServiceNode::record_oxend_cache_hit() {
+    all_stats_.record_oxend_cache_hit();
+}
+
+void ServiceNode::record_oxend_coalesced() {
+    all_stats_.record_oxend_coalesced();
+}
+
 static void write_metadata(
         oxenc::bt_dict_producer& d, std::string_view pubkey, const message& msg) {
     d.append("@", pubkey);
@@ -419,15 +969,25 @@ static void write_metadata(
 }
 
 void ServiceNode::send_notifies(message msg) {
-    auto pubkey = msg.pubkey.prefixed_raw();
-    std::vector<server::connection_id> relay_to, relay_to_with_data;
-
-    for (auto* s : mq_servers_)
-        s->get_notifiers(msg, relay_to, relay_to_with_data);
+    if (new_message_cb_)
+        new_message_cb_(msg);
+
+    std::vector<std::pair<server::MQBase*, server::notify_targets>> targets;
+    bool wants_data = false;
+    for (auto* s : mq_servers_) {
+        server::notify_targets t;
+        s->get_notifiers(msg, t);
+        if (t.empty())
+            continue;
+        wants_data |= t.wants_data();
+        targets.emplace_back(s, std::move(t));
+    }
 
-    if (relay_to.empty() && relay_to_with_data.empty())
+    if (targets.empty())
         return;
 
+    auto pubkey = msg.pubkey.prefixed_raw();
+
     // We output a dict with keys (in order):
     // - @ pubkey
     // - h msg hash
@@ -445,60 +1005,245 @@ void ServiceNode::send_notifies(message msg) {
 
     oxenc::bt_dict_producer d;
     d.reserve(
-            relay_to_with_data.empty() ? metadata_size
-                                       : metadata_size  // all the metadata above
-                                                 + 3    // 1:~
-                                                 + 8    // 76800: plus a couple bytes to grow
-                                                 + msg.data.size());
+            !wants_data ? metadata_size
+                        : metadata_size  // all the metadata above
+                                  + 3    // 1:~
+                                  + 8    // 76800: plus a couple bytes to grow
+                                  + msg.data.size());
 
     write_metadata(d, pubkey, msg);
 
-    if (!relay_to.empty())
-        for (auto* s : mq_servers_)
-            s->notify(relay_to, d.view());
-
-    if (!relay_to_with_data.empty()) {
+    // Subscribers that want the data may still get just the metadata (if they are over their send
+    // budget), so we need to keep both around in that case.
+    std::string metadata;
+    if (wants_data) {
+        metadata = d.view();
         d.append("~", msg.data);
-        for (auto* s : mq_servers_)
-            s->notify(relay_to_with_data, d.view());
     }
+
+    std::string_view metadata_view = wants_data ? std::string_view{metadata} : d.view();
+    std::string_view full_view = wants_data ? d.view() : ""sv;
+    for (auto& [s, t] : targets)
+        s->deliver_notifies(t, metadata_view, full_view);
+}
+
+void ServiceNode::process_store(message msg, store_callback cb) {
+    bool flush_now = store_batch_window_ <= 0ms;
+    {
+        std::lock_guard lock{store_queue_mutex_};
+        store_queue_.push_back({std::move(msg), std::move(cb), util::trace::current_context()});
+        store_backlog_++;
+        if (store_queue_.size() >= STORE_BATCH_MAX)
+            flush_now = true;
+    }
+    if (flush_now)
+        queue_store_flush();
 }
 
-bool ServiceNode::process_store(
-        message msg, bool* new_msg, std::chrono::system_clock::time_point* expiry) {
-    std::lock_guard guard{sn_mutex_};
+void ServiceNode::queue_store_flush() {
+    // One queued flush at a time picks up everything stored before it runs, so while the disk is
+    // slow we don't pile up flush jobs behind it.
+    if (store_flush_queued_.exchange(true))
+        return;
+    omq_server_.db_job([this] {
+        store_flush_queued_ = false;
+        flush_store_queue();
+    });
+}
+
+void ServiceNode::flush_store_queue() {
+    std::vector<pending_store> queue;
+    {
+        std::lock_guard lock{store_queue_mutex_};
+        queue.swap(store_queue_);
+    }
+    if (queue.empty())
+        return;
 
-    /// only accept a message if we are in a swarm
+    std::vector<message> msgs;
+    msgs.reserve(queue.size());
+    for (auto& p : queue)
+        msgs.push_back(std::move(p.msg));
+
+    std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> results;
+    std::string error;
+    /// only accept messages if we are in a swarm
     if (!swarm_) {
         // This should never be printed now that we have "snode_ready"
         log::error(logcat, "error: my swarm in not initialized");
-        return false;
+        error = "swarm not initialized";
+    } else {
+        for (size_t i = 0; i < msgs.size(); i++)
+            all_stats_.bump_store_requests();
+
+        // Each traced store gets its own span of the (shared) batch write
+        std::vector<util::trace::span> spans;
+        for (auto& p : queue)
+            if (p.trace) {
+                auto& span = spans.emplace_back(traces_, "db.store_batch", p.trace);
+                span.tag("batch_size", std::to_string(msgs.size()));
+            }
+
+        /// store in the database (if not already present)
+        try {
+            results = db().store_batch(msgs);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to store batch of {} messages: {}", msgs.size(), e.what());
+            error = e.what();
+            for (auto& span : spans)
+                span.tag("error", error);
+        }
     }
 
-    all_stats_.bump_store_requests();
+    log::trace(logcat, "Stored batch of {} client messages", msgs.size());
+    store_backlog_ -= queue.size();
 
-    /// store in the database (if not already present)
-    const auto result = db_->store(msg, expiry);
-    if (new_msg)
-        *new_msg = result == StoreResult::New;
+    for (size_t i = 0; i < queue.size(); i++) {
+        auto& cb = queue[i].cb;
+        if (results.empty()) {
+            cb(std::nullopt, {}, error);
+            continue;
+        }
+        auto& [result, expiry] = results[i];
+        cb(result, expiry, ""sv);
 
-    if (result == StoreResult::New)
-        send_notifies(std::move(msg));
+        if (result == StoreResult::New) {
+            util::trace::span span{traces_, "send_notifies", queue[i].trace};
+            send_notifies(std::move(msgs[i]));
+        }
+    }
+}
 
-    return result != StoreResult::Full;
+void ServiceNode::forward_to_peer(
+        const sn_record& peer, std::string method, std::string body, forward_callback cb) {
+    // Released when the last copy of the callback goes away, whether or not it ever gets called
+    // (e.g. if the request gets dropped without a reply), so that we can't leak a pending count.
+    forwards_pending_++;
+    std::shared_ptr<void> pending{nullptr, [this](void*) { forwards_pending_--; }};
+    cb = [cb = std::move(cb), pending = std::move(pending)](
+                 bool success, std::vector<std::string> data) {
+        OXENSS_PROBE(forward_reply, int{success}, data.size());
+        cb(success, std::move(data));
+    };
+
+    std::vector<pending_forward> send_now;
+    {
+        std::lock_guard lock{forward_queue_mutex_};
+        bool batch = forward_batch_window_ > 0ms;
+        if (auto it = forward_unbatched_.find(peer.pubkey_legacy); it != forward_unbatched_.end()) {
+            if (std::chrono::steady_clock::now() < it->second)
+                batch = false;
+            else
+                forward_unbatched_.erase(it);
+        }
+
+        if (!batch) {
+            send_now.push_back({std::move(method), std::move(body), std::move(cb)});
+        } else {
+            auto& q = forward_queues_[peer.pubkey_legacy];
+            if (q.reqs.empty())
+                q.peer = peer;
+            q.reqs.push_back({std::move(method), std::move(body), std::move(cb)});
+            if (q.reqs.size() >= FORWARD_BATCH_MAX)
+                send_now.swap(q.reqs);
+        }
+    }
+    if (!send_now.empty())
+        send_forwards(peer, std::move(send_now));
 }
 
-void ServiceNode::save_bulk(const std::vector<message>& msgs) {
-    std::lock_guard guard(sn_mutex_);
+void ServiceNode::flush_forward_queues() {
+    decltype(forward_queues_) queues;
+    {
+        std::lock_guard lock{forward_queue_mutex_};
+        queues.swap(forward_queues_);
+    }
+    for (auto& [pk, q] : queues)
+        if (!q.reqs.empty())
+            send_forwards(q.peer, std::move(q.reqs));
+}
+
+void ServiceNode::send_forwards(const sn_record& peer, std::vector<pending_forward> reqs) {
+    if (reqs.size() == 1) {
+        auto& req = reqs.front();
+        OXENSS_PROBE(forward_send, req.method.c_str(), req.body.size());
+        omq_server_->request(
+                peer.pubkey_x25519.view(),
+                "sn.storage_cc",
+                std::move(req.cb),
+                req.method,
+                req.body,
+                oxenmq::send_option::request_timeout{FORWARD_REQUEST_TIMEOUT});
+        return;
+    }
+
+    std::vector<forwarded_request> batch;
+    batch.reserve(reqs.size());
+    for (auto& req : reqs) {
+        OXENSS_PROBE(forward_send, req.method.c_str(), req.body.size());
+        batch.push_back({std::move(req.method), std::move(req.body)});
+    }
+    OXENSS_PROBE(forward_batch_send, reqs.size());
 
+    log::trace(logcat, "Forwarding batch of {} requests to {}", reqs.size(), peer.pubkey_legacy);
+    omq_server_->request(
+            peer.pubkey_x25519.view(),
+            "sn.storage_cc_batch",
+            [this, peer, reqs = std::make_shared<std::vector<pending_forward>>(std::move(reqs))](
+                    bool success, std::vector<std::string> data) {
+                if (!success) {
+                    log::debug(
+                            logcat,
+                            "Batched request to {} failed; falling back to unbatched requests",
+                            peer.pubkey_legacy);
+                    {
+                        std::lock_guard lock{forward_queue_mutex_};
+                        forward_unbatched_[peer.pubkey_legacy] =
+                                std::chrono::steady_clock::now() + FORWARD_BATCH_FALLBACK;
+                    }
+                    for (auto& req : *reqs)
+                        req.cb(false, {});
+                    return;
+                }
+
+                std::vector<std::vector<std::string>> replies;
+                if (data.size() == 1) {
+                    try {
+                        replies = deserialize_forwarded_replies(data[0]);
+                    } catch (const std::exception& e) {
+                        log::warning(
+                                logcat,
+                                "Invalid batched request reply from {}: {}",
+                                peer.pubkey_legacy,
+                                e.what());
+                    }
+                }
+                // A reply we can't match up to the requests is passed on to each request as an
+                // empty reply (which gets reported as a bad peer response).
+                if (replies.size() != reqs->size())
+                    replies.assign(reqs->size(), {});
+                for (size_t i = 0; i < reqs->size(); i++)
+                    (*reqs)[i].cb(true, std::move(replies[i]));
+            },
+            serialize_forwarded_batch(batch),
+            oxenmq::send_option::request_timeout{FORWARD_REQUEST_TIMEOUT});
+}
+
+void ServiceNode::save_bulk(const std::vector<message>& msgs) {
+    std::vector<std::optional<StoreResult>> results;
     try {
-        db_->bulk_store(msgs);
+        results = db().bulk_store(msgs);
     } catch (const std::exception& e) {
         log::error(logcat, "failed to save batch to the database: {}", e.what());
         return;
     }
 
-    log::trace(logcat, "saved messages count: {}", msgs.size());
+    log::debug(
+            logcat,
+            "saved {} new messages of {} received ({} already stored)",
+            std::count(results.begin(), results.end(), StoreResult::New),
+            msgs.size(),
+            std::count(results.begin(), results.end(), StoreResult::Exists));
 }
 
 void ServiceNode::on_bootstrap_update(block_update&& bu) {
@@ -532,11 +1277,26 @@ static SnodeStatus derive_snode_status(const block_update& bu, const sn_record&
     return SnodeStatus::UNSTAKED;
 }
 
-void ServiceNode::on_swarm_update(block_update&& bu) {
+void ServiceNode::on_swarm_update(block_update&& bu, bool provisional) {
+    if (provisional_height_) {
+        if (bu.height < provisional_height_) {
+            log::info(
+                    logcat,
+                    "Keeping saved swarm state from height {} over oxend's update at height {} "
+                    "(oxend is probably still syncing)",
+                    provisional_height_,
+                    bu.height);
+            return;
+        }
+        log::info(logcat, "Replacing saved swarm state with oxend's state at height {}", bu.height);
+        provisional_height_ = 0;
+    }
+
     hf_revision net_ver{bu.hardfork, bu.snode_revision};
-    if (hardfork_ != net_ver) {
+    if (hf() != net_ver) {
         log::info(logcat, "New hardfork: {}.{}", net_ver.first, net_ver.second);
-        hardfork_ = net_ver;
+        hardfork_ = uint64_t(static_cast<uint32_t>(net_ver.first)) << 32 |
+                    static_cast<uint32_t>(net_ver.second);
     }
 
     if (syncing_ && target_height_ != 0) {
@@ -563,6 +1323,9 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
             log::warning(logcat, "new block height is not higher than the current height");
         }
 
+        if (!provisional)
+            save_state(bu);
+
         block_height_ = bu.height;
         block_hash_ = bu.block_hash;
 
@@ -608,8 +1371,36 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
 
     swarm_->update_state(std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, true);
 
+    warmer_->set_peers(swarm_->other_nodes());
+
+    if (!saved_relays_.empty())
+        send_saved_relays();
+
+    // Stop keeping stats on nodes that have left the network
+    all_stats_.retain_peers(swarm_->all_funded_nodes());
+
+    if (snapshot_import_) {
+        const auto& all_swarms = swarm_->all_valid_swarms();
+        auto it = std::find_if(all_swarms.begin(), all_swarms.end(), [&](const SwarmInfo& s) {
+            return s.swarm_id == events.our_swarm_id;
+        });
+        if (it != all_swarms.end()) {
+            // (A previous import, if any, finished and asked to be redone for our new swarm)
+            if (snapshot_import_thread_.joinable())
+                snapshot_import_thread_.join();
+            snapshot_import_thread_ = std::thread{
+                    [this,
+                     src = std::move(*snapshot_import_),
+                     id = it->swarm_id,
+                     range = swarm_space_range(all_swarms, it - all_swarms.begin())]() mutable {
+                        import_snapshot(std::move(src), id, range);
+                    }};
+            snapshot_import_.reset();
+        }
+    }
+
     if (!events.new_snodes.empty()) {
-        relay_messages(db_->retrieve_all(), events.new_snodes);
+        relay_stored_messages(events.new_snodes);
     }
 
     if (!events.new_swarms.empty()) {
@@ -636,35 +1427,63 @@ void ServiceNode::update_swarms() {
 
     log::debug(logcat, "Swarm update triggered");
 
-    json params{
-            {"fields",
-             {{"service_node_pubkey", true},
-              {"swarm_id", true},
-              {"storage_port", true},
-              {"public_ip", true},
-              {"height", true},
-              {"block_hash", true},
-              {"hardfork", true},
-              {"snode_revision", true},
-              {"funded", true},
-              {"pubkey_x25519", true},
-              {"pubkey_ed25519", true},
-              {"storage_lmq_port", true}}},
-            {"active_only", false}};
-    if (got_first_response_ && !block_hash_.empty())
-        params["poll_block_hash"] = block_hash_;
+    const bool bt = oxend_bt_rpc_;
+    const bool poll = got_first_response_ && !block_hash_.empty();
+    std::string params;
+    if (bt) {
+        oxenc::bt_dict_producer d;
+        d.append("active_only", 0);
+        {
+            auto fields = d.append_dict("fields");
+            for (auto field : SWARM_UPDATE_FIELDS)
+                fields.append(field, 1);
+        }
+        // Lets oxend give us a small "unchanged" reply instead of the whole list when nothing has
+        // changed since the block we already have
+        if (poll)
+            d.append("poll_block_hash", block_hash_);
+        params = std::move(d).str();
+    } else {
+        json fields = json::object();
+        for (auto field : SWARM_UPDATE_FIELDS)
+            fields[std::string{field}] = true;
+        json p{{"fields", std::move(fields)}, {"active_only", false}};
+        if (poll)
+            p["poll_block_hash"] = block_hash_;
+        params = p.dump();
+    }
 
     omq_server_.oxend_request(
             "rpc.get_service_nodes",
-            [this](bool success, std::vector<std::string> data) {
+            [this, bt](bool success, std::vector<std::string> data) {
                 updating_swarms_ = false;
                 if (!success || data.size() < 2) {
                     log::critical(logcat, "Failed to contact local oxend for service node list");
                     return;
                 }
+                if (bt && (data[0] != "200" || data[1].empty() || data[1].front() != 'd')) {
+                    // Older oxends don't do bt-encoded requests; go back to json for good
+                    log::warning(
+                            logcat,
+                            "oxend did not accept a bt-encoded service node list request (status "
+                            "{}); falling back to json requests",
+                            data[0]);
+                    oxend_bt_rpc_ = false;
+                    update_swarms();
+                    return;
+                }
                 try {
                     std::lock_guard lock{sn_mutex_};
-                    block_update bu = parse_swarm_update(data[1]);
+                    block_update bu;
+                    try {
+                        bu = parse_swarm_update(data[1]);
+                    } catch (...) {
+                        if (bt) {
+                            log::warning(logcat, "Falling back to json service node list requests");
+                            oxend_bt_rpc_ = false;
+                        }
+                        throw;
+                    }
                     if (!got_first_response_) {
                         log::info(logcat, "Got initial swarm information from local Oxend");
 
@@ -740,13 +1559,18 @@ void ServiceNode::update_swarms() {
                     log::error(logcat, "Exception caught on swarm update: {}", e.what());
                 }
             },
-            params.dump());
+            std::move(params));
 }
 
 void ServiceNode::update_last_ping(ReachType type) {
     reach_records_.incoming_ping(type);
 }
 
+void ServiceNode::set_reachability_limits(int retests_per_tick, int tests_in_flight) {
+    std::lock_guard lock{sn_mutex_};
+    reach_records_.set_limits(retests_per_tick, tests_in_flight);
+}
+
 void ServiceNode::ping_peers() {
     std::lock_guard lock{sn_mutex_};
 
@@ -770,13 +1594,19 @@ void ServiceNode::ping_peers() {
     /// We always test nodes due to be tested plus one general, non-failing node.
 
     auto to_test = reach_records_.get_failing(*swarm_, now);
-    if (auto rando = reach_records_.next_random(*swarm_, now))
-        to_test.emplace_back(std::move(*rando), 0);
+    if (static_cast<int>(to_test.size()) < reach_records_.free_test_slots())
+        if (auto rando = reach_records_.next_random(*swarm_, now))
+            to_test.emplace_back(std::move(*rando), 0);
 
     if (to_test.empty())
         log::trace(logcat, "no nodes to test this tick");
     else
-        log::debug(logcat, "{} nodes to test", to_test.size());
+        log::debug(
+                logcat,
+                "{} nodes to test ({} in flight, {} failing)",
+                to_test.size(),
+                reach_records_.tests_in_flight(),
+                reach_records_.failing_count());
     for (const auto& [sn, prev_fails] : to_test)
         test_reachability(sn, prev_fails);
 }
@@ -797,10 +1627,13 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
         return;
     }
 
+    // The HTTPS, OMQ and QUIC probes all go out at once; the test stays in flight (counting
+    // against reachability_testing's limit) until the last of them finishes.
     auto test = std::make_shared<sn_test>(
             sn,
             1 + mq_servers_.size(),
-            [this, previous_failures](const sn_record& sn, bool passed) {
+            [this, previous_failures, in_flight = reach_records_.test_started()](
+                    const sn_record& sn, bool passed) {
                 report_reachability(sn, passed, previous_failures);
             });
 
@@ -1030,6 +1863,8 @@ void ServiceNode::report_reachability(const sn_record& sn, bool reachable, int p
         }
     };
 
+    all_stats_.record_reachability_test(reachable);
+
     json params{{"type", "storage"}, {"pubkey", sn.pubkey_legacy.hex()}, {"passed", reachable}};
 
     omq_server_.oxend_request("admin.report_peer_status", std::move(cb), params.dump());
@@ -1139,7 +1974,7 @@ std::pair<MessageTestStatus, std::string> ServiceNode::process_storage_test_req(
     }
 
     // 3. If for a current/past block, try to respond right away
-    auto msg = db_->retrieve_by_hash(msg_hash_hex);
+    auto msg = db().retrieve_by_hash(msg_hash_hex);
     if (!msg)
         return {MessageTestStatus::RETRY, ""};
 
@@ -1176,7 +2011,7 @@ void ServiceNode::initiate_peer_test() {
     }
 
     /// 2. Storage Testing: initiate a testing request with a randomly selected message
-    if (auto msg = db_->retrieve_random()) {
+    if (auto msg = db().retrieve_random()) {
         log::trace(logcat, "Selected random message: {}, {}", msg->hash, msg->data);
         send_storage_test_req(testee, test_height, *msg);
     } else {
@@ -1194,57 +2029,290 @@ void ServiceNode::bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const
 
     const auto& all_swarms = swarm_->all_valid_swarms();
 
-    std::unordered_map<user_pubkey, swarm_id_t> pk_swarm_cache;
-    std::unordered_map<swarm_id_t, std::vector<message>> to_relay;
-
-    std::vector<message> all_entries = db_->retrieve_all();
-    log::debug(logcat, "We have {} messages", all_entries.size());
-    for (auto& entry : all_entries) {
-        if (!entry.pubkey) {
-            log::error(logcat, "Invalid pubkey in a message while bootstrapping other nodes");
+    // We stream the messages for each swarm in turn (via a range scan over the swarm space that the
+    // swarm covers), so that we only ever have a single serialized batch in memory rather than the
+    // entire database.
+    for (size_t i = 0; i < all_swarms.size(); i++) {
+        const auto& swarm = all_swarms[i];
+        if (!swarms.empty() &&
+            std::find(swarms.begin(), swarms.end(), swarm.swarm_id) == swarms.end())
             continue;
+
+        log::trace(logcat, "Bootstrapping swarm {}", swarm.swarm_id);
+        relay_stored_messages(swarm.snodes, swarm_space_range(all_swarms, i));
+    }
+}
+
+void ServiceNode::relay_stored_messages(
+        const std::vector<sn_record>& snodes,
+        std::optional<std::pair<uint64_t, uint64_t>> space_range) const {
+    if (snodes.empty())
+        return;
+
+    relay_->add_producer(snodes, [this, snodes, space_range](const auto& emit) {
+        size_t count = 0;
+        bool more = true;
+        MessageSerializer serializer{relay_serialization_version(), [&](std::string batch) {
+                                         log::debug(
+                                                 logcat,
+                                                 "Relaying serialized batch of {} bytes",
+                                                 batch.size());
+                                         if (more)
+                                             more = emit(std::move(batch));
+                                     }};
+
+        auto relay = [&](message&& msg) {
+            serializer.add(msg);
+            count++;
+            return more;
+        };
+        if (space_range)
+            db().for_each_message_in_range(space_range->first, space_range->second, relay);
+        else
+            db().for_each_message(nullptr, relay);
+        serializer.flush();
+
+        if (logcat->level() <= log::Level::debug) {
+            log::debug(
+                    logcat,
+                    "Queued {} messages in {} batches for relaying to snodes:",
+                    count,
+                    serializer.batches());
+            for (const auto& sn : snodes)
+                log::debug(logcat, "    {}", sn.pubkey_legacy);
         }
+    });
+}
 
-        auto [it, ins] = pk_swarm_cache.try_emplace(entry.pubkey);
-        if (ins) {
-            auto swarm = get_swarm_by_pk(all_swarms, entry.pubkey);
-            it->second = swarm ? swarm->swarm_id : INVALID_SWARM_ID;
+namespace {
+    // Swarm space range (and, for digests, bucket count) of an anti-entropy request
+    struct sync_request {
+        uint64_t begin, end;
+        size_t buckets = 0;
+    };
+
+    std::string encode_sync_request(const sync_request& req) {
+        oxenc::bt_dict_producer d;
+        d.append("b", req.begin);
+        d.append("e", req.end);
+        if (req.buckets)
+            d.append("n", req.buckets);
+        return std::string{d.view()};
+    }
+
+    sync_request decode_sync_request(std::string_view request) {
+        try {
+            oxenc::bt_dict_consumer d{request};
+            sync_request req;
+            req.begin = d.require<uint64_t>("b");
+            req.end = d.require<uint64_t>("e");
+            if (d.skip_until("n"))
+                req.buckets = d.consume_integer<size_t>();
+            return req;
+        } catch (const std::exception& e) {
+            throw std::invalid_argument{"Invalid sync request: "s + e.what()};
         }
-        auto swarm_id = it->second;
+    }
 
-        if (swarms.empty() || std::find(swarms.begin(), swarms.end(), swarm_id) != swarms.end())
-            to_relay[swarm_id].push_back(std::move(entry));
+    // Digests are sent as 16 bytes per bucket: the little-endian count and hash XOR
+    std::string encode_digests(const std::vector<Database::range_digest>& digests) {
+        std::string out(16 * digests.size(), '\0');
+        for (size_t i = 0; i < digests.size(); i++) {
+            oxenc::write_host_as_little(static_cast<uint64_t>(digests[i].count), &out[16 * i]);
+            oxenc::write_host_as_little(digests[i].hash_xor, &out[16 * i + 8]);
+        }
+        return out;
     }
 
-    log::trace(logcat, "Bootstrapping {} swarms", to_relay.size());
+    std::optional<std::vector<Database::range_digest>> decode_digests(std::string_view in) {
+        if (in.size() % 16 != 0)
+            return std::nullopt;
+        std::vector<Database::range_digest> digests(in.size() / 16);
+        for (size_t i = 0; i < digests.size(); i++) {
+            digests[i].count =
+                    static_cast<int64_t>(oxenc::load_little_to_host<uint64_t>(&in[16 * i]));
+            digests[i].hash_xor = oxenc::load_little_to_host<uint64_t>(&in[16 * i + 8]);
+        }
+        return digests;
+    }
 
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (size_t i = 0; i < all_swarms.size(); ++i)
-        swarm_id_to_idx.emplace(all_swarms[i].swarm_id, i);
+    // Throws unless `remote` is one of our swarm peers and the (inclusive, possibly wrapping)
+    // requested range lies within our swarm's space: a sync request makes us scan every message in
+    // the range, so we only answer them for the swarm members that need them, and only for the
+    // messages we are actually meant to hold.
+    void check_sync_request(
+            const SwarmState& state, const crypto::x25519_pubkey& remote, const sync_request& req) {
+        if (std::none_of(state.swarm_peers.begin(), state.swarm_peers.end(), [&](const auto& sn) {
+                return sn.pubkey_x25519 == remote;
+            }))
+            throw std::invalid_argument{"Invalid sync request: not a member of our swarm"};
+
+        const auto& all_swarms = state.all_valid_swarms;
+        auto it = std::find_if(all_swarms.begin(), all_swarms.end(), [&](const SwarmInfo& s) {
+            return s.swarm_id == state.our_swarm_id;
+        });
+        if (it == all_swarms.end())
+            throw std::invalid_argument{"Invalid sync request: we are not in a swarm"};
+        auto [begin, end] = swarm_space_range(all_swarms, it - all_swarms.begin());
+
+        // Measuring everything as an offset from the start of our range takes care of wrapping:
+        // the request is within our range if both ends are, and it doesn't wrap around past our
+        // range's end.
+        uint64_t size = end - begin, req_begin = req.begin - begin, req_end = req.end - begin;
+        if (req_begin > size || req_end > size || req_begin > req_end)
+            throw std::invalid_argument{"Invalid sync request: range is outside our swarm space"};
+    }
+}  // namespace
+
+std::string ServiceNode::sync_digest(
+        const crypto::x25519_pubkey& remote, std::string_view request) {
+    auto req = decode_sync_request(request);
+    if (req.buckets < 1 || req.buckets > ANTI_ENTROPY_MAX_REQUEST_BUCKETS)
+        throw std::invalid_argument{"Invalid sync request: bad bucket count"};
+    if (!swarm_)
+        throw std::invalid_argument{"Invalid sync request: we are not in a swarm"};
+    check_sync_request(*swarm_->state(), remote, req);
+    return encode_digests(db().range_digests(req.begin, req.end, req.buckets));
+}
 
-    for (const auto& [swarm_id, items] : to_relay)
-        relay_messages(items, all_swarms[swarm_id_to_idx[swarm_id]].snodes);
+std::string ServiceNode::sync_hashes(
+        const crypto::x25519_pubkey& remote, std::string_view request) {
+    auto req = decode_sync_request(request);
+    if (!swarm_)
+        throw std::invalid_argument{"Invalid sync request: we are not in a swarm"};
+    check_sync_request(*swarm_->state(), remote, req);
+    oxenc::bt_dict_producer d;
+    if (auto hashes = db().range_hashes(req.begin, req.end, ANTI_ENTROPY_MAX_HASHES)) {
+        auto l = d.append_list("h");
+        for (auto& hash : *hashes)
+            l.append(hash);
+    } else {
+        d.append("t", 1);  // Too many
+    }
+    return std::string{d.view()};
 }
 
-void ServiceNode::relay_messages(
-        const std::vector<message>& messages, const std::vector<sn_record>& snodes) const {
-    std::vector<std::string> batches =
-            serialize_messages(messages.begin(), messages.end(), SERIALIZATION_VERSION_BT);
+void ServiceNode::anti_entropy_sync() {
+    if (!snode_ready())
+        return;
 
-    if (logcat->level() <= log::Level::debug) {
-        log::debug(logcat, "Relayed messages:");
-        for (auto msg : batches)
-            log::debug(logcat, "    {}", msg);
-        log::debug(logcat, "To Snodes:");
-        for (auto sn : snodes)
-            log::debug(logcat, "    {}", sn.pubkey_legacy);
+    auto state = swarm_->state();
+    if (state->swarm_peers.empty())
+        return;
+    const auto& all_swarms = state->all_valid_swarms;
+    auto it = std::find_if(all_swarms.begin(), all_swarms.end(), [&](const SwarmInfo& s) {
+        return s.swarm_id == state->our_swarm_id;
+    });
+    if (it == all_swarms.end())
+        return;
+    auto range = swarm_space_range(all_swarms, it - all_swarms.begin());
+    auto& peer = state->swarm_peers[util::uniform_distribution_portable(
+            util::rng(), state->swarm_peers.size())];
 
-        log::debug(logcat, "Serialised batches: {}", batches.size());
-    }
+    log::debug(logcat, "Comparing message digests with swarm peer {}", peer.pubkey_legacy);
+    omq_server_->request(
+            peer.pubkey_x25519.view(),
+            "sn.sync_digest",
+            [this, peer, range](bool success, std::vector<std::string> data) {
+                std::optional<std::vector<Database::range_digest>> theirs;
+                if (success && data.size() == 1)
+                    theirs = decode_digests(data[0]);
+                if (!theirs || theirs->size() != ANTI_ENTROPY_BUCKETS) {
+                    log::debug(
+                            logcat,
+                            "Message digest request to {} failed: {}",
+                            peer.pubkey_legacy,
+                            success ? "invalid response" : "request failed");
+                    return;
+                }
 
-    for (const sn_record& sn : snodes)
-        for (auto& batch : batches)
-            relay_data_reliable(batch, sn);
+                auto ours = db().range_digests(range.first, range.second, ANTI_ENTROPY_BUCKETS);
+                std::vector<size_t> differing;
+                for (size_t i = 0; i < ours.size(); i++)
+                    if (ours[i] != (*theirs)[i])
+                        differing.push_back(i);
+                if (differing.empty()) {
+                    log::debug(logcat, "Messages are in sync with {}", peer.pubkey_legacy);
+                    return;
+                }
+                log::info(
+                        logcat,
+                        "{}/{} message digest buckets differ from swarm peer {}",
+                        differing.size(),
+                        ours.size(),
+                        peer.pubkey_legacy);
+
+                // Look at a random selection of the differing buckets, if there are too many
+                std::shuffle(differing.begin(), differing.end(), util::rng());
+                if (differing.size() > ANTI_ENTROPY_MAX_BUCKETS)
+                    differing.resize(ANTI_ENTROPY_MAX_BUCKETS);
+                for (auto bucket : differing) {
+                    auto bounds = Database::range_bucket_bounds(
+                            range.first, range.second, ANTI_ENTROPY_BUCKETS, bucket);
+                    omq_server_->request(
+                            peer.pubkey_x25519.view(),
+                            "sn.sync_hashes",
+                            [this, peer, bounds](bool success, std::vector<std::string> data) {
+                                if (!success || data.size() != 1) {
+                                    log::debug(
+                                            logcat,
+                                            "Message hash request to {} failed",
+                                            peer.pubkey_legacy);
+                                    return;
+                                }
+                                std::vector<std::string> hashes;
+                                try {
+                                    oxenc::bt_dict_consumer d{data[0]};
+                                    if (!d.skip_until("h"))
+                                        return;  // Too many hashes in the bucket
+                                    auto l = d.consume_list_consumer();
+                                    while (!l.is_finished())
+                                        hashes.push_back(l.consume_string());
+                                } catch (const std::exception& e) {
+                                    log::warning(
+                                            logcat,
+                                            "Invalid message hash response from {}: {}",
+                                            peer.pubkey_legacy,
+                                            e.what());
+                                    return;
+                                }
+                                std::sort(hashes.begin(), hashes.end());
+                                anti_entropy_push(peer, bounds, hashes);
+                            },
+                            encode_sync_request({bounds.first, bounds.second}));
+                }
+            },
+            encode_sync_request({range.first, range.second, ANTI_ENTROPY_BUCKETS}));
+}
+
+void ServiceNode::anti_entropy_push(
+        const sn_record& peer,
+        std::pair<uint64_t, uint64_t> range,
+        const std::vector<std::string>& peer_hashes) {
+    auto ours = db().range_hashes(range.first, range.second, ANTI_ENTROPY_MAX_HASHES);
+    if (!ours)
+        return;
+    std::vector<std::string> missing;
+    std::set_difference(
+            ours->begin(),
+            ours->end(),
+            peer_hashes.begin(),
+            peer_hashes.end(),
+            std::back_inserter(missing));
+    if (missing.empty())
+        return;
+
+    MessageSerializer serializer{relay_serialization_version(), [&](std::string batch) {
+                                     relay_data_reliable(std::move(batch), peer);
+                                 }};
+    size_t count = 0;
+    for (auto& hash : missing)
+        if (auto msg = db().retrieve_by_hash(hash)) {
+            serializer.add(*msg);
+            count++;
+        }
+    serializer.flush();
+    log::info(logcat, "Pushed {} messages missing from swarm peer {}", count, peer.pubkey_legacy);
 }
 
 void to_json(nlohmann::json& j, const test_result& val) {
@@ -1254,12 +2322,43 @@ void to_json(nlohmann::json& j, const test_result& val) {
 
 static nlohmann::json to_json(const all_stats& stats) {
     json peers;
-    for (const auto& [pk, stats] : stats.peer_report()) {
+    stats.visit_peer_report([&peers](const crypto::legacy_pubkey& pk, const peer_stats& stats) {
         auto& p = peers[pk.hex()];
 
         p["requests_failed"] = stats.requests_failed;
-        p["pushes_failed"] = stats.requests_failed;
-        p["storage_tests"] = stats.storage_tests;
+        p["pushes_failed"] = stats.pushes_failed;
+        auto& tests = p["storage_tests"] = json::array();
+        stats.for_each_storage_test([&tests](const test_result& t) { tests.push_back(t); });
+        // Fraction of storage tests passed per stats period, most recent first (null if none)
+        auto& success = p["storage_test_success"] = json::array();
+        for (size_t w = 0; w < stats.test_windows.size(); w++) {
+            if (auto r = stats.success_ratio(w); r >= 0)
+                success.push_back(r);
+            else
+                success.push_back(nullptr);
+        }
+    });
+
+    // Latencies in ms, over the same recent window as the request counts
+    auto ms = [](std::chrono::microseconds us) {
+        return std::chrono::duration<double, std::milli>(us).count();
+    };
+    json latency = json::object();
+    for (const auto& [endpoint, stages] : stats.get_recent_latencies()) {
+        json ep = json::object();
+        for (size_t i = 0; i < stages.size(); i++) {
+            auto& h = stages[i];
+            if (!h.count)
+                continue;
+            ep[std::string{util::to_string(static_cast<util::latency_stage>(i))}] = json{
+                    {"count", h.count},
+                    {"mean", ms(h.mean())},
+                    {"p50", ms(h.percentile(0.5))},
+                    {"p90", ms(h.percentile(0.9))},
+                    {"p99", ms(h.percentile(0.99))}};
+        }
+        if (!ep.empty())
+            latency[endpoint] = std::move(ep);
     }
 
     auto [window, recent] = stats.get_recent_requests();
@@ -1274,6 +2373,7 @@ static nlohmann::json to_json(const all_stats& stats) {
             {"recent_retrieve_requests", recent.client_retrieve_requests},
             {"recent_onion_requests", recent.onion_requests},
             {"recent_proxy_requests", recent.proxy_requests},
+            {"recent_latency", std::move(latency)},
 
             {"peers", std::move(peers)}};
 }
@@ -1289,7 +2389,62 @@ std::string ServiceNode::get_stats() const {
     val["height"] = block_height_;
     val["target_height"] = target_height_;
 
-    std::vector<int> counts = db_->get_message_counts();
+    auto relay = relay_->get_progress();
+    val["relay"] = json{
+            {"batches_queued", relay.batches_queued},
+            {"batches_sent", relay.batches_sent},
+            {"batches_failed", relay.batches_failed},
+            {"bytes_sent", relay.bytes_sent},
+            {"retries", relay.retries},
+            {"peers_pending", relay.peers_pending},
+            {"bytes_queued", relay.bytes_queued}};
+
+    uint64_t notifies_degraded = 0, notifies_dropped = 0;
+    for (auto* mq : mq_servers_) {
+        notifies_degraded += mq->notifies_degraded();
+        notifies_dropped += mq->notifies_dropped();
+    }
+    val["notifies_degraded"] = notifies_degraded;
+    val["notifies_dropped"] = notifies_dropped;
+
+    auto& sigs = crypto::signature_cache();
+    val["signature_cache_hits"] = sigs.hits();
+    val["signature_cache_misses"] = sigs.misses();
+
+    val["requests_refused"] = admission_.refused();
+    val["requests_expired"] = admission_.expired_requests();
+    val["queue_delay_ms"] =
+            std::chrono::duration<double, std::milli>(admission_.queue_delay()).count();
+
+    // Memory used by each subsystem, in bytes (mostly estimates, see util::hashtable_bytes etc.)
+    auto& mem = (val["memory"] = json{
+                         {"relay_queue", relay_->memory_usage()},
+                         {"peer_stats", all_stats_.peer_report_memory()},
+                         {"stats_history", all_stats_.history_memory()}});
+    size_t monitors = 0, notify_queues = 0, rate_limiter = 0, proxy_requests = 0;
+    // The servers may share a rate limiter and request handler, which we only want to count once
+    std::unordered_set<const void*> seen;
+    for (auto* mq : mq_servers_) {
+        monitors += mq->monitor_memory();
+        notify_queues += mq->notify_memory();
+        if (auto* rl = mq->rate_limiter(); rl && seen.insert(rl).second)
+            rate_limiter += rl->memory_usage();
+        if (auto* rh = mq->request_handler(); rh && seen.insert(rh).second)
+            proxy_requests += rh->proxy_stats().bytes;
+    }
+    mem["monitors"] = monitors;
+    mem["notify_queues"] = notify_queues;
+    mem["rate_limiter"] = rate_limiter;
+    mem["proxy_requests"] = proxy_requests;
+    if (auto used = util::malloc_in_use())
+        mem["malloc_in_use"] = *used;
+
+    // Everything else comes from the database, which takes a little while to open at startup
+    val["db_ready"] = db_ready();
+    if (!db_ready())
+        return val.dump();
+
+    std::vector<int> counts = db().get_message_counts();
     int64_t total = std::accumulate(counts.begin(), counts.end(), int64_t{0});
 
     counts.erase(
@@ -1340,24 +2495,311 @@ std::string ServiceNode::get_stats() const {
         val["account_msg_mean"] = total / (double)counts.size();
 
     auto& ns_stats = (val["namespace_messages"] = nlohmann::json::object());
-    for (auto& [ns, count] : db_->get_namespace_counts())
+    for (auto& [ns, count] : db().get_namespace_counts())
         ns_stats[fmt::format("{}", ns)] = count;
 
-    val["db_used"] = db_->get_used_bytes();
-    val["db_total"] = db_->get_total_bytes();
-    val["db_max"] = Database::SIZE_LIMIT;
+    val["db_used"] = db().get_used_bytes();
+    val["db_total"] = db().get_total_bytes();
+    val["db_max"] = db().size_limit();
+    val["expired_backlog"] = db().expired_backlog();
+    val["evicted"] = db().evicted_messages();
+    val["evicted_bytes"] = db().evicted_bytes();
+    val["memory_bytes"] = db().memory_tier_bytes();
+    val["memory_evicted"] = db().memory_tier_evicted();
+
+    // The database's share of the memory accounting above
+    auto dbmem = db().get_memory_usage();
+    mem.update(json{
+            {"sqlite_used", dbmem.sqlite_used},
+            {"sqlite_highwater", dbmem.sqlite_highwater},
+            {"db_page_cache", dbmem.page_cache},
+            {"db_statements", dbmem.statements},
+            {"db_schema", dbmem.schema},
+            {"db_connections_checked", dbmem.connections_checked},
+            {"db_prepared_statements", dbmem.prepared_statements},
+            {"owner_cache", dbmem.owner_cache},
+            {"memory_tier", dbmem.memory_tier}});
 
     return val.dump();
 }
 
+std::string ServiceNode::get_metrics() const {
+    metrics_writer m;
+
+    m.family("oxenss_build", "info", "Storage server version");
+    m.sample("_info", {{"version", STORAGE_SERVER_VERSION_STRING}}, 1);
+
+    m.family("oxenss_client_requests", "counter", "Client requests received, by type");
+    m.sample("_total", {{"type", "store"}}, all_stats_.get_total_store_requests());
+    m.sample("_total", {{"type", "retrieve"}}, all_stats_.get_total_retrieve_requests());
+    m.sample("_total", {{"type", "onion"}}, all_stats_.get_total_onion_requests());
+    m.sample("_total", {{"type", "proxy"}}, all_stats_.get_total_proxy_requests());
+
+    m.family("oxenss_onion_requests", "counter", "Onion requests received, by outcome");
+    for (auto o :
+         {onion_outcome::final_destination,
+          onion_outcome::relayed,
+          onion_outcome::relay_failed,
+          onion_outcome::proxied,
+          onion_outcome::invalid})
+        m.sample("_total", {{"outcome", to_str(o)}}, all_stats_.get_onion_outcomes(o));
+
+    m.counter(
+            "oxenss_swarm_quorum_replies",
+            "Recursive client requests answered once a quorum of swarm peers had replied",
+            all_stats_.get_quorum_replies());
+    m.counter(
+            "oxenss_swarm_late_peer_results",
+            "Swarm peer results of recursive requests that came in after we had replied",
+            all_stats_.get_late_peer_results());
+    m.counter(
+            "oxenss_coalesced_stores",
+            "Duplicate client stores answered with the reply of an identical store in flight",
+            all_stats_.get_coalesced_stores());
+    m.counter(
+            "oxenss_oxend_request_cache_hits",
+            "Client oxend_requests answered from the cache of recent oxend results",
+            all_stats_.get_oxend_cache_hits());
+    m.counter(
+            "oxenss_oxend_request_coalesced",
+            "Client oxend_requests that shared an identical request already waiting on oxend",
+            all_stats_.get_oxend_coalesced());
+    m.counter(
+            "oxenss_requests_refused",
+            "Client requests refused for being overloaded",
+            admission_.refused());
+    m.counter(
+            "oxenss_requests_expired",
+            "Client requests dropped after waiting too long",
+            admission_.expired_requests());
+    m.gauge("oxenss_queue_delay_seconds",
+            "Average time requests wait for a worker thread",
+            std::chrono::duration<double>(admission_.queue_delay()).count());
+
+    if (auto* rl = omq_server_.rate_limiter()) {
+        m.family("oxenss_rate_limited_requests", "counter", "Requests refused by rate limiting");
+        m.sample("_total", {{"source", "client"}}, rl->client_limited());
+        m.sample("_total", {{"source", "snode"}}, rl->snode_limited());
+        m.gauge("oxenss_rate_limit_scale",
+                "Current multiplier of the client rate limit, adjusted to load",
+                rl->load_scale());
+    }
+
+    if (auto* rh = omq_server_.request_handler()) {
+        auto proxy = rh->proxy_stats();
+        m.family("oxenss_proxy_connections", "gauge", "Connections for proxied onion requests");
+        m.sample("", {{"state", "active"}}, proxy.active);
+        m.sample("", {{"state", "idle"}}, proxy.idle);
+        m.gauge("oxenss_proxy_queued",
+                "Proxied onion requests waiting for a connection",
+                proxy.queued);
+        m.counter(
+                "oxenss_proxy_connects",
+                "Connections made for proxied onion requests",
+                proxy.created);
+        m.counter(
+                "oxenss_proxy_connections_reused",
+                "Proxied onion requests sent over an existing connection",
+                proxy.reused);
+
+        auto& crypto = rh->crypto_pool();
+        m.gauge("oxenss_crypto_queued", "Onion crypto jobs queued or running", crypto.queued());
+        m.counter(
+                "oxenss_crypto_rejected",
+                "Onion requests refused because the crypto queue was full",
+                crypto.rejected());
+
+        if (auto* keys = rh->channel_cipher().key_cache()) {
+            m.family(
+                    "oxenss_shared_key_lookups",
+                    "counter",
+                    "Lookups of onion request shared keys in the key cache");
+            m.sample("_total", {{"result", "hit"}}, keys->hits());
+            m.sample("_total", {{"result", "miss"}}, keys->misses());
+            m.gauge("oxenss_shared_keys_cached", "Onion request shared keys cached", keys->size());
+        }
+    }
+
+    if (auto* logs = logging::async_sink()) {
+        m.family("oxenss_log_messages_lost", "counter", "Log messages not written, by reason");
+        m.sample("_total", {{"reason", "dropped"}}, logs->dropped());
+        m.sample("_total", {{"reason", "rate_limited"}}, logs->suppressed());
+        m.gauge("oxenss_log_messages_queued", "Log messages waiting to be written", logs->queued());
+    }
+
+    auto* quic = quic_onion_relay_.load();
+    if (!quic)
+        quic = quic_data_relay_.load();
+    if (quic) {
+        auto relay = quic->get_relay_stats();
+        m.gauge("oxenss_quic_relay_connections",
+                "QUIC connections to other nodes for relaying onion requests and data",
+                relay.connections);
+        m.family("oxenss_onion_relays", "counter", "Onion requests relayed, by transport");
+        m.sample("_total", {{"transport", "quic"}}, relay.onion_sent);
+        m.sample("_total", {{"transport", "omq"}}, relay.onion_fallbacks);
+        m.family("oxenss_data_relays", "counter", "Message batches relayed, by transport");
+        m.sample("_total", {{"transport", "quic"}}, relay.data_sent);
+        m.sample("_total", {{"transport", "omq"}}, relay.data_fallbacks);
+    }
+
+    if (tls_sessions_) {
+        m.family("oxenss_tls_handshakes", "counter", "HTTPS TLS handshakes completed, by type");
+        m.sample("_total", {{"type", "full"}}, tls_sessions_->full_handshakes());
+        m.sample("_total", {{"type", "resumed"}}, tls_sessions_->resumed_handshakes());
+        m.gauge("oxenss_tls_session_cache_entries",
+                "TLS sessions in the server-side session cache",
+                tls_sessions_->cached());
+    }
+
+    size_t monitors = 0;
+    uint64_t notifies_degraded = 0, notifies_dropped = 0;
+    for (auto* mq : mq_servers_) {
+        monitors += mq->monitor_count();
+        notifies_degraded += mq->notifies_degraded();
+        notifies_dropped += mq->notifies_dropped();
+    }
+    m.gauge("oxenss_monitor_subscriptions", "Push notification subscriptions", monitors);
+    m.counter(
+            "oxenss_notifies_degraded",
+            "Notifications sent without message data because of send budgets",
+            notifies_degraded);
+    m.counter(
+            "oxenss_notifies_dropped",
+            "Notifications dropped because of send budgets",
+            notifies_dropped);
+
+    auto& sigs = crypto::signature_cache();
+    m.family("oxenss_signature_cache_lookups", "counter", "Signature verification cache lookups");
+    m.sample("_total", {{"result", "hit"}}, sigs.hits());
+    m.sample("_total", {{"result", "miss"}}, sigs.misses());
+
+    m.family("oxenss_reachability_tests", "counter", "Reachability tests of other nodes");
+    m.sample("_total", {{"result", "reachable"}}, all_stats_.get_reachability_tests(true));
+    m.sample("_total", {{"result", "unreachable"}}, all_stats_.get_reachability_tests(false));
+
+    m.family("oxenss_storage_tests", "counter", "Storage tests of other nodes, by result");
+    for (auto r : {ResultType::OK, ResultType::MISMATCH, ResultType::REJECTED, ResultType::OTHER})
+        m.sample("_total", {{"result", to_str(r)}}, all_stats_.get_storage_test_results(r));
+
+    auto relay = relay_->get_progress();
+    m.family("oxenss_relay_batches", "counter", "Relay batch deliveries to peers, by result");
+    m.sample("_total", {{"result", "queued"}}, relay.batches_queued);
+    m.sample("_total", {{"result", "sent"}}, relay.batches_sent);
+    m.sample("_total", {{"result", "failed"}}, relay.batches_failed);
+    m.counter("oxenss_relay_retries", "Relay batch delivery retries", relay.retries);
+    m.counter("oxenss_relay_sent_bytes", "Bytes relayed to peers", relay.bytes_sent);
+    m.gauge("oxenss_relay_queued_bytes", "Bytes queued for relaying", relay.bytes_queued);
+    m.gauge("oxenss_relay_peers_pending",
+            "Peers with queued or in-flight relay batches",
+            relay.peers_pending);
+
+    auto warm = warmer_->get_stats();
+    m.family("oxenss_warm_peer_connections",
+             "gauge",
+             "Swarm peer connections kept open ahead of time, by whether the peer is still in our "
+             "swarm");
+    m.sample("", {{"peer", "current"}}, warm.peers);
+    m.sample("", {{"peer", "leaving"}}, warm.leaving);
+
+    m.gauge("oxenss_db_used_bytes", "Database bytes in use", db_used_bytes_.load());
+    m.gauge("oxenss_db_total_bytes", "Database bytes allocated on disk", db_total_bytes_.load());
+    m.gauge("oxenss_db_ready", "Whether the database has finished opening", db_ready());
+    // The rest of the database metrics need it open
+    if (db_ready()) {
+        m.gauge("oxenss_db_max_bytes", "Maximum database size", db().size_limit());
+        m.gauge("oxenss_db_expired_backlog",
+                "Expired messages not yet deleted",
+                db().expired_backlog());
+        m.counter(
+                "oxenss_db_evicted_messages",
+                "Messages evicted to make space",
+                db().evicted_messages());
+        m.counter("oxenss_db_evicted_bytes", "Bytes freed by evictions", db().evicted_bytes());
+        m.counter(
+                "oxenss_db_quota_rejections",
+                "Stores rejected for exceeding an owner or namespace quota",
+                db().quota_rejections());
+        m.gauge("oxenss_memory_tier_bytes",
+                "Bytes of messages kept in memory",
+                db().memory_tier_bytes());
+
+        auto pools = db().get_pool_usage();
+        m.family("oxenss_db_connections", "gauge", "Database connections, by pool and state");
+        m.sample("", {{"pool", "writer"}, {"state", "open"}}, pools.writers_open);
+        m.sample("", {{"pool", "writer"}, {"state", "busy"}}, pools.writers_busy);
+        m.sample("", {{"pool", "reader"}, {"state", "open"}}, pools.readers_open);
+        m.sample("", {{"pool", "reader"}, {"state", "busy"}}, pools.readers_busy);
+
+        auto ckpt = db().get_checkpoint_stats();
+        m.family("oxenss_db_checkpoints", "counter", "Background WAL checkpoints run, by mode");
+        m.sample("_total", {{"mode", "passive"}}, ckpt.passive);
+        m.sample("_total", {{"mode", "truncate"}}, ckpt.truncate);
+        m.counter(
+                "oxenss_db_checkpoints_busy",
+                "Background WAL checkpoints that could not complete because the database was busy",
+                ckpt.busy);
+        m.counter(
+                "oxenss_db_checkpoint_seconds",
+                "Time spent running background WAL checkpoints",
+                ckpt.seconds);
+        m.gauge("oxenss_db_wal_bytes", "Size of the database write-ahead log", ckpt.wal_bytes);
+    }
+
+    m.family("oxenss_request_duration_seconds",
+             "histogram",
+             "Request handling time, by endpoint and stage");
+    for (auto& [endpoint, stages] : all_stats_.get_latencies()) {
+        for (size_t i = 0; i < stages.size(); i++) {
+            if (!stages[i].count)
+                continue;
+            auto stage = util::to_string(static_cast<util::latency_stage>(i));
+            m.histogram({{"endpoint", endpoint}, {"stage", stage}}, stages[i]);
+        }
+    }
+
+    m.counter("oxenss_trace_spans", "Trace spans recorded", traces_.recorded());
+
+    return std::move(m).str();
+}
+
+std::string ServiceNode::get_traces(std::string_view trace_id) const {
+    using namespace std::chrono;
+    auto endpoint = json{
+            {"serviceName", "oxenss"},
+            {"ipv4", our_address_.ip},
+            {"port", our_address_.port},
+    };
+    auto spans = json::array();
+    for (auto& s : traces_.get()) {
+        auto trace = s.ctx.trace_hex();
+        if (!trace_id.empty() && trace != trace_id)
+            continue;
+        json j;
+        j["traceId"] = std::move(trace);
+        j["id"] = s.ctx.span_hex();
+        if (s.parent_id)
+            j["parentId"] = util::trace::context{{}, s.parent_id}.span_hex();
+        j["name"] = std::move(s.name);
+        j["timestamp"] = duration_cast<microseconds>(s.start.time_since_epoch()).count();
+        j["duration"] = std::max<int64_t>(s.duration.count(), 1);
+        j["localEndpoint"] = endpoint;
+        if (!s.tags.empty()) {
+            auto& tags = j["tags"] = json::object();
+            for (auto& [k, v] : s.tags)
+                tags[k] = std::move(v);
+        }
+        spans.push_back(std::move(j));
+    }
+    return spans.dump();
+}
+
 std::string ServiceNode::get_status_line() const {
     // This produces a short, single-line status string, used when running as a
     // systemd Type=notify service to update the service Status line.  The
     // status message has to be fairly short: has to fit on one line, and if
     // it's too long systemd just truncates it when displaying it.
 
-    std::lock_guard guard(sn_mutex_);
-
     // v2.3.4; sw=abcd…789(n=7); 1234 msgs (47.3MB) for 567 users; reqs(S/R/O/P):
     // 123/456/789/1011 (last 62.3min)
     std::ostringstream s;
@@ -1368,31 +2810,35 @@ std::string ServiceNode::get_status_line() const {
     if (syncing_)
         s << "; SYNCING";
     s << "; sw=";
-    if (!swarm_ || !swarm_->is_valid())
+    if (auto state = swarm_ ? swarm_->state() : nullptr; !state || !state->is_valid())
         s << "NONE";
     else {
-        std::string swarm = fmt::format("{:016x}", swarm_->our_swarm_id());
+        std::string swarm = fmt::format("{:016x}", state->our_swarm_id);
         s << swarm.substr(0, 4) << u8"…" << swarm.substr(swarm.size() - 3);
-        s << "(n=" << (1 + swarm_->other_nodes().size()) << ")";
-    }
-    s << "; " << db_->get_message_count() << " msgs";
-
-    if (auto bytes_stored = db_->get_used_bytes(); bytes_stored > 0) {
-        s << " (";
-        auto oldprec = s.precision(3);
-        if (bytes_stored >= 999'500'000)
-            s << bytes_stored * 1e-9 << 'G';
-        else if (bytes_stored >= 999'500)
-            s << bytes_stored * 1e-6 << 'M';
-        else if (bytes_stored >= 1000)
-            s << bytes_stored * 1e-3 << 'k';
-        else
-            s << bytes_stored;
-        s.precision(oldprec);
-        s << "B)";
+        s << "(n=" << (1 + state->swarm_peers.size()) << ")";
     }
+    if (!db_ready()) {
+        s << "; database opening";
+    } else {
+        s << "; " << db().get_message_count() << " msgs";
+
+        if (auto bytes_stored = db().get_used_bytes(); bytes_stored > 0) {
+            s << " (";
+            auto oldprec = s.precision(3);
+            if (bytes_stored >= 999'500'000)
+                s << bytes_stored * 1e-9 << 'G';
+            else if (bytes_stored >= 999'500)
+                s << bytes_stored * 1e-6 << 'M';
+            else if (bytes_stored >= 1000)
+                s << bytes_stored * 1e-3 << 'k';
+            else
+                s << bytes_stored;
+            s.precision(oldprec);
+            s << "B)";
+        }
 
-    s << " for " << db_->get_owner_count() << " users";
+        s << " for " << db().get_owner_count() << " users";
+    }
 
     auto [window, stats] = all_stats_.get_recent_requests();
     s << "; reqs(S/R/O/P): " << stats.client_store_requests << '/' << stats.client_retrieve_requests
@@ -1401,50 +2847,77 @@ std::string ServiceNode::get_status_line() const {
     return s.str();
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
-    std::lock_guard guard(sn_mutex_);
-
+void ServiceNode::process_push_batch(std::string_view blob) {
     if (blob.empty())
         return;
 
-    std::vector<message> items = deserialize_messages(blob);
-
     log::trace(logcat, "Saving all: begin");
 
-    log::debug(logcat, "Got {} messages from peers, size: {}", items.size(), blob.size());
+    // We store the messages in chunks as we parse them, rather than deserializing the whole
+    // (up to SERIALIZATION_BATCH_SIZE) blob first.
+    std::vector<message> chunk;
+    chunk.reserve(PUSH_STORE_CHUNK);
+    size_t count = 0;
+    auto store_chunk = [&] {
+        save_bulk(chunk);
+        count += chunk.size();
+        chunk.clear();
+    };
+    bool valid = false;
+    try {
+        valid = for_each_serialized_message(blob, [&](const message_view& m) {
+            chunk.push_back(m.to_message());
+            if (chunk.size() >= PUSH_STORE_CHUNK)
+                store_chunk();
+            return true;
+        });
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid message batch from peer: {}", e.what());
+    }
+    // Messages parsed before a problem are still good
+    if (!chunk.empty())
+        store_chunk();
 
-    save_bulk(items);
+    log::debug(
+            logcat,
+            "Got {} messages from peers, size: {}{}",
+            count,
+            blob.size(),
+            valid ? "" : " (batch was invalid)");
 
     log::trace(logcat, "Saving all: end");
 }
 
 bool ServiceNode::is_pubkey_for_us(const user_pubkey& pk) const {
-    std::lock_guard guard(sn_mutex_);
-
     if (!swarm_) {
         log::error(logcat, "Swarm data missing");
         return false;
     }
-    return swarm_->is_pubkey_for_us(pk);
+    return swarm_->state()->is_pubkey_for_us(pk);
 }
 
 std::optional<SwarmInfo> ServiceNode::get_swarm(const user_pubkey& pk) const {
-    std::lock_guard guard(sn_mutex_);
-
     if (!swarm_) {
         log::error(logcat, "Swarm data missing");
         return {};
     }
 
-    if (auto* swarm = get_swarm_by_pk(swarm_->all_valid_swarms(), pk))
+    auto state = swarm_->state();
+    if (auto* swarm = state->get_swarm(pk))
         return *swarm;
     return std::nullopt;
 }
 
-std::vector<sn_record> ServiceNode::get_swarm_peers() const {
-    std::lock_guard guard{sn_mutex_};
+std::shared_ptr<const encoded_swarm> ServiceNode::get_encoded_swarm(const user_pubkey& pk) const {
+    if (!swarm_) {
+        log::error(logcat, "Swarm data missing");
+        return encode_swarm(nullptr);
+    }
+    return swarm_->state()->get_encoded_swarm(pk);
+}
 
-    return swarm_->other_nodes();
+std::vector<sn_record> ServiceNode::get_swarm_peers() const {
+    return swarm_->state()->swarm_peers;
 }
 
 }  // namespace oxenss::snode
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <forward_list>
+#include <functional>
 #include <future>
 #include <map>
 #include <memory>
@@ -9,18 +13,26 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include <cpr/async_wrapper.h>
 #include <oxenss/storage/database.hpp>
 #include <oxenss/crypto/keys.h>
+#include <oxenss/rpc/admission.h>
 #include <oxenss/server/mqbase.h>
+#include <oxenss/utils/trace.hpp>
+#include "connection_warmer.h"
 #include "reachability_testing.h"
+#include "relay.h"
+#include "serialization.h"
 #include "stats.h"
 #include "swarm.h"
 
 namespace oxenss::server {
 class OMQ;
 class QUIC;
+class TlsSessions;
 }  // namespace oxenss::server
 
 namespace oxenss::rpc {
@@ -57,6 +69,101 @@ inline constexpr hf_revision MULTI_EXPIRY_HARDFORK = {19, 4};
 // The hardfork at which we start testing QUIC reachability
 inline constexpr hf_revision QUIC_REACHABILITY_TESTING = {19, 4};
 
+// The hardfork from which we relay stored messages to swarm peers in the compact (v2) format; until
+// then some peers may not understand it.
+inline constexpr hf_revision COMPACT_SERIALIZATION_HARDFORK = {19, 5};
+
+// Messages received from a swarm peer are stored this many at a time as they are deserialized, so
+// that we never hold more than this many copies of received messages at once.
+inline constexpr size_t PUSH_STORE_CHUNK = 1'000;
+
+// Default window for which client stores are accumulated before being written to the database in
+// a single transaction.  A window of 0 disables batching and writes each store immediately.
+//
+// The window is added to every store's latency, so it is kept small next to what a store already
+// costs: the reply waits for the store to be forwarded to the rest of the swarm, which takes tens
+// of milliseconds.  At the same time it needs to be long enough to collect several stores at busy
+// times, when a node sees hundreds of stores per second (and a single writer committing each one
+// on its own is what falls behind): 5ms collects a few at a few hundred stores/s, and up to
+// STORE_BATCH_MAX, flushed early, at tens of thousands.
+inline constexpr auto DEFAULT_STORE_BATCH_WINDOW = 5ms;
+
+// If this many stores get queued before the store batch window elapses then we write them
+// immediately rather than waiting for the window to elapse.
+inline constexpr size_t STORE_BATCH_MAX = 250;
+
+// File (in the database directory) in which we save the last block update we accepted, so that we
+// can start serving with it right away on restart rather than waiting for oxend.
+inline constexpr auto SAVED_BLOCK_UPDATE_FILE = "swarm_state.bin"sv;
+
+// We ignore a saved block update older than this (as the swarms have likely changed a fair bit
+// since then).
+inline constexpr auto SAVED_BLOCK_UPDATE_MAX_AGE = 1h;
+
+// File (in the database directory) in which we save, when draining on shutdown, the message
+// relays to our swarm peers that didn't get sent, to send them once we have started up again.
+inline constexpr auto SAVED_RELAY_QUEUE_FILE = "relay_queue.bin"sv;
+
+// We don't send saved relays from longer ago than this; by then anti-entropy will have caught our
+// peers up anyway.
+inline constexpr auto SAVED_RELAY_QUEUE_MAX_AGE = 1h;
+
+// Default window for which client requests forwarded to a swarm peer are accumulated before being
+// sent to it in a single sn.storage_cc_batch request.  A window of 0 disables batching and sends an
+// sn.storage_cc request for each one immediately.
+inline constexpr auto DEFAULT_FORWARD_BATCH_WINDOW = 2ms;
+
+// If this many forwarded requests get queued for a peer before the window elapses then we send
+// them right away.
+inline constexpr size_t FORWARD_BATCH_MAX = 100;
+
+// How long we stop batching requests to a peer after a batch request to it fails, which could be
+// because it is running an older version that doesn't support sn.storage_cc_batch.
+inline constexpr auto FORWARD_BATCH_FALLBACK = 10min;
+
+// Request timeout for client requests forwarded to swarm peers
+inline constexpr auto FORWARD_REQUEST_TIMEOUT = 5s;
+
+// Our reply to a peer's sn.data push while our database isn't open yet.  The sender counts it as a
+// failed send, to retry later, rather than as a rejection of the endpoint.
+inline constexpr auto SN_DATA_NOT_READY = "not ready"sv;
+
+// How long OxenMQ keeps the connections we open ahead of time to our swarm peers (see
+// ConnectionWarmer) open without traffic; they get renewed every ConnectionWarmer::TICK_INTERVAL
+// for as long as the node stays in our swarm.
+inline constexpr auto PEER_CONNECTION_KEEP_ALIVE = 5min;
+
+// Callback invoked with the reply to a client request forwarded to a swarm peer (see
+// ServiceNode::forward_to_peer).  The arguments are the same as a plain OMQ request callback:
+// `success` is false on timeout, and otherwise `data` holds the reply parts (a single bt-encoded
+// dict on success; an error code and message if the peer rejected the request).
+using forward_callback = std::function<void(bool success, std::vector<std::string> data)>;
+
+// Callback invoked once a store made via `ServiceNode::process_store` has been written (or has
+// failed).  `result` is nullopt if the store failed (we are not in a swarm, or a database error
+// occurred), in which case `error` contains a brief description of the failure.  Otherwise `expiry`
+// contains the message's expiry after the store (which may be later than the stored message's
+// expiry, for an existing message with a later expiry).  Note that a StoreResult::Full result
+// means the message was *not* stored.
+using store_callback = std::function<void(
+        std::optional<StoreResult> result,
+        std::chrono::system_clock::time_point expiry,
+        std::string_view error)>;
+
+// Swarm anti-entropy: every ANTI_ENTROPY_INTERVAL we compare digests of our swarm's messages, in
+// ANTI_ENTROPY_BUCKETS buckets of swarm space (see Database::range_digests), with those of a
+// random swarm peer, and then push to that peer whatever it is missing from (up to
+// ANTI_ENTROPY_MAX_BUCKETS of) the buckets that differ.  Every peer does the same, so whatever we
+// are missing arrives when they sync with us.
+inline constexpr auto ANTI_ENTROPY_INTERVAL = 5min;
+inline constexpr size_t ANTI_ENTROPY_BUCKETS = 256;
+inline constexpr size_t ANTI_ENTROPY_MAX_BUCKETS = 16;
+// The most hashes we return for a single bucket; for a bucket with more than this we decline and
+// the requester skips that bucket.
+inline constexpr size_t ANTI_ENTROPY_MAX_HASHES = 50'000;
+// Upper limit on the number of buckets a peer may ask us for digests of
+inline constexpr size_t ANTI_ENTROPY_MAX_REQUEST_BUCKETS = 4096;
+
 class Swarm;
 
 /// WRONG_REQ - request was ignored as not valid (e.g. incorrect tester)
@@ -74,21 +181,40 @@ constexpr std::string_view to_string(SnodeStatus status) {
     return "Unknown"sv;
 }
 
+namespace detail {
+    // Parses a bt-encoded oxend get_service_nodes response into a block update, skipping the nodes
+    // that aren't funded or are missing their ed25519/x25519 pubkeys.  Throws if the response is
+    // truncated, malformed, or missing a required field.  (Exposed for the test suite.)
+    block_update parse_swarm_update_bt(std::string_view response_body);
+}  // namespace detail
+
 /// All service node logic that is not network-specific
 class ServiceNode {
-    bool syncing_ = true;
+    std::atomic<bool> syncing_ = true;
     bool active_ = false;
+    std::atomic<bool> draining_ = false;
     bool got_first_response_ = false;
     std::condition_variable first_response_cv_;
     std::mutex first_response_mutex_;
     bool force_start_ = false;
     std::atomic<bool> shutting_down_ = false;
-    hf_revision hardfork_ = {0, 0};
+    // Packed as major << 32 | minor so that it can be read without holding sn_mutex_
+    std::atomic<uint64_t> hardfork_ = 0;
     uint64_t block_height_ = 0;
     uint64_t target_height_ = 0;
     std::string block_hash_;
     std::unique_ptr<Swarm> swarm_;
+
+    // The database is opened (which can take a while, for schema upgrades and count checks) on
+    // db_thread_, so that we can start listening right away; until it is ready client requests are
+    // refused and anything else that needs it waits for it.  db_ is set (under db_mutex_) just
+    // before db_ready_, unless opening failed, in which case db_error_ is set instead.
     std::unique_ptr<Database> db_;
+    std::atomic<bool> db_ready_ = false;
+    std::exception_ptr db_error_;
+    mutable std::mutex db_mutex_;
+    mutable std::condition_variable db_cv_;
+    std::thread db_thread_;
 
     SnodeStatus status_ = SnodeStatus::UNKNOWN;
 
@@ -100,6 +226,18 @@ class ServiceNode {
 
     server::OMQ& omq_server_;
     std::vector<server::MQBase*> mq_servers_;
+    std::atomic<server::QUIC*> quic_onion_relay_ = nullptr;
+    std::atomic<server::QUIC*> quic_data_relay_ = nullptr;
+    // HTTPS TLS session resumption state, for reporting handshake metrics
+    const server::TlsSessions* tls_sessions_ = nullptr;
+
+    // Invoked for each newly stored message; see set_new_message_callback
+    std::function<void(const message&)> new_message_cb_;
+
+    rpc::AdmissionControl admission_;
+
+    // Sampled request trace spans, exported via get_traces()
+    util::trace::TraceBuffer traces_;
 
     std::atomic<int> oxend_pings_ =
             0;  // Consecutive successful pings, used for batching logs about it
@@ -109,14 +247,116 @@ class ServiceNode {
     // when syncing when we get tons of block notifications quickly).
     std::atomic<bool> updating_swarms_ = false;
 
+    // Database sizes as of the last expiry cleanup, for get_metrics() (which must not query the
+    // database)
+    std::atomic<int64_t> db_used_bytes_ = 0, db_total_bytes_ = 0;
+
+    // Whether we request the service node list from oxend bt-encoded (which is much cheaper to
+    // produce and to parse than json); cleared if oxend doesn't understand such requests.
+    std::atomic<bool> oxend_bt_rpc_ = true;
+
     reachability_testing reach_records_;
 
     mutable all_stats all_stats_;
 
+    // Flow-controlled delivery of message batches to other snodes (see relay_data_reliable and
+    // relay_stored_messages)
+    std::unique_ptr<RelayScheduler> relay_;
+
+    // Keeps connections to our swarm peers open, so that forwards and relays to new peers don't
+    // wait on connection setup
+    std::unique_ptr<ConnectionWarmer> warmer_;
+
+    // Serializes changes to the swarm (and block) state.  Readers of the swarm state don't need
+    // it: they go through swarm_->state() instead, which never blocks.
     mutable std::recursive_mutex sn_mutex_;
 
     std::forward_list<cpr::AsyncWrapper<void>> outstanding_https_reqs_;
 
+    // Group-commit store queue: client stores are accumulated here for up to
+    // `store_batch_window_` and then written to the database in a single transaction.
+    struct pending_store {
+        message msg;
+        store_callback cb;
+        // The trace span of the request making the store, if traced
+        util::trace::context trace;
+    };
+    std::mutex store_queue_mutex_;
+    std::vector<pending_store> store_queue_;
+    // Stores queued or being written, i.e. not yet written to the database
+    std::atomic<size_t> store_backlog_ = 0;
+    // Set while a flush_store_queue job is waiting for a database thread
+    std::atomic<bool> store_flush_queued_ = false;
+    const std::chrono::milliseconds store_batch_window_;
+
+    // Where we save accepted block updates (see SAVED_BLOCK_UPDATE_FILE), and the saved block
+    // update loaded at startup (until it gets applied once we have connected to oxend).
+    const std::filesystem::path saved_state_path_;
+    std::optional<block_update> saved_state_;
+    // Height of the saved block update we applied at startup, until oxend gives us a block update
+    // that is at least as recent (and replaces it); 0 once we are on live state from oxend.
+    uint64_t provisional_height_ = 0;
+
+    // Loads saved_state_ from saved_state_path_, if it exists and isn't too old.
+    void load_saved_state();
+
+    // Writes a block update to saved_state_path_.
+    void save_state(const block_update& bu) const;
+
+    // Where drain() saves the relays it didn't get to, and the relays loaded from there at startup
+    // (until we are in a swarm and can send them).
+    const std::filesystem::path saved_relay_queue_path_;
+    std::vector<RelayScheduler::queued_batch> saved_relays_;
+
+    // Loads (and removes) a relay queue saved by drain(), if it exists and isn't too old.
+    void load_saved_relays();
+
+    // Queues the saved relays that are for current swarm peers, and forgets the others.
+    void send_saved_relays();
+
+    // Database snapshot to import our swarm's messages from once we know our swarm; see
+    // import_snapshot_on_join().  The import runs on snapshot_import_thread_, as it can take a
+    // while and must not hold up swarm updates (or anything else that needs sn_mutex_).
+    std::optional<std::filesystem::path> snapshot_import_;
+    std::thread snapshot_import_thread_;
+    // Imports the messages of swarm `swarm_id` (whose swarm space is `range`) from `src`;
+    // invoked on snapshot_import_thread_.
+    void import_snapshot(
+            std::filesystem::path src,
+            uint64_t swarm_id,
+            std::optional<std::pair<uint64_t, uint64_t>> range);
+
+    // Writes all currently queued stores to the database and invokes their callbacks.
+    void flush_store_queue();
+
+    // Queues a flush_store_queue on a database thread, unless one is already queued.
+    void queue_store_flush();
+
+    // Client requests waiting to be forwarded to swarm peers, per peer (see forward_to_peer).
+    struct pending_forward {
+        std::string method;
+        std::string body;
+        forward_callback cb;
+    };
+    struct forward_queue {
+        sn_record peer;
+        std::vector<pending_forward> reqs;
+    };
+    std::mutex forward_queue_mutex_;
+    std::unordered_map<crypto::legacy_pubkey, forward_queue> forward_queues_;
+    // Peers we send unbatched requests to until the given time; see FORWARD_BATCH_FALLBACK.
+    std::unordered_map<crypto::legacy_pubkey, std::chrono::steady_clock::time_point>
+            forward_unbatched_;
+    const std::chrono::milliseconds forward_batch_window_;
+    // Forwarded requests queued or waiting on a reply
+    std::atomic<size_t> forwards_pending_ = 0;
+
+    // Sends all currently queued forwarded requests.
+    void flush_forward_queues();
+
+    // Sends forwarded requests to a peer, as a single batch request if there is more than one.
+    void send_forwards(const sn_record& peer, std::vector<pending_forward> reqs);
+
     void send_notifies(message m);
 
     // Save multiple messages to the database at once (i.e. in a single transaction)
@@ -124,7 +364,9 @@ class ServiceNode {
 
     void on_bootstrap_update(block_update&& bu);
 
-    void on_swarm_update(block_update&& bu);
+    // Applies a new block update from oxend.  `provisional` is set when applying the saved block
+    // update at startup (which we don't need to save again).
+    void on_swarm_update(block_update&& bu, bool provisional = false);
 
     void bootstrap_data();
 
@@ -134,14 +376,27 @@ class ServiceNode {
     /// (called when our old node got dissolved)
     void salvage_data() const;  // mutex not needed
 
-    /// Reliably push message/batch to a service node
-    void relay_data_reliable(
-            const std::string& blob,
-            const sn_record& address) const;  // mutex not needed
+    /// Reliably push message/batch to a service node, via the relay scheduler
+    void relay_data_reliable(std::string blob, const sn_record& address) const;  // mutex not needed
+
+    /// Streams our stored messages to the given snodes, one serialized batch at a time, from the
+    /// relay scheduler's producer thread (so that this returns immediately, and producing more
+    /// batches waits for earlier ones to be delivered).  If `space_range` is given then only
+    /// messages of owners in that (inclusive, possibly wrapping) range of swarm space are sent.
+    void relay_stored_messages(
+            const std::vector<sn_record>& snodes,
+            std::optional<std::pair<uint64_t, uint64_t>> space_range = std::nullopt) const;
+
+    /// Compares message digests with a random swarm peer, pushing it whatever it is missing (see
+    /// ANTI_ENTROPY_INTERVAL).
+    void anti_entropy_sync();
 
-    void relay_messages(
-            const std::vector<message>& msgs,
-            const std::vector<sn_record>& snodes) const;  // mutex not needed
+    /// Pushes to `peer` the messages of owners in the given swarm space range, other than those
+    /// with hashes in (sorted) `peer_hashes`.
+    void anti_entropy_push(
+            const sn_record& peer,
+            std::pair<uint64_t, uint64_t> range,
+            const std::vector<std::string>& peer_hashes);
 
     // Conducts any ping peer tests that are due; (this is designed to be called frequently and
     // does nothing if there are no tests currently due).
@@ -173,32 +428,107 @@ class ServiceNode {
     // retesting.
     void report_reachability(const sn_record& sn, bool reachable, int previous_failures);
 
+    // Sends an encoded onion request to the next SS over OxenMQ
+    void send_onion_to_sn_omq(
+            const sn_record& sn,
+            std::string data,
+            std::function<void(bool success, std::vector<std::string> data)> cb) const;
+
+    // The database, once it is open: blocks until then, and throws if opening it failed.
+    Database& db() const;
+
   public:
     ServiceNode(
             sn_record address,
             const crypto::legacy_seckey& skey,
             server::OMQ& omq_server,
             const std::filesystem::path& db_location,
-            bool force_start);
-
-    Database& get_db() { return *db_; }
-    const Database& get_db() const { return *db_; }
+            bool force_start,
+            std::chrono::milliseconds store_batch_window = DEFAULT_STORE_BATCH_WINDOW,
+            std::chrono::milliseconds forward_batch_window = DEFAULT_FORWARD_BATCH_WINDOW,
+            size_t db_max_writers = Database::DEFAULT_MAX_WRITERS,
+            size_t db_max_readers = Database::DEFAULT_MAX_READERS,
+            size_t db_shards = 1,
+            std::function<void(Database&)> db_setup = nullptr);
+
+    ~ServiceNode();
+
+    // Returns the database, waiting for it to finish opening if it hasn't yet.  Throws if opening
+    // it failed.
+    Database& get_db() { return db(); }
+    const Database& get_db() const { return db(); }
+
+    // True once the database has been opened (and `db_setup`, if given to the constructor, has
+    // configured it), i.e. once get_db() no longer blocks.
+    bool db_ready() const { return db_ready_; }
+
+    // Waits for the database to finish opening; rethrows the exception if opening it failed.
+    void wait_for_db() const { db(); }
+
+    // Seeds the database, the first time we learn which swarm we are in, with the messages of
+    // that swarm from the database snapshot at `src` (see Database::snapshot and
+    // Database::import_snapshot), rather than waiting for swarm members to push them to us.  Must
+    // be called during startup.
+    void import_snapshot_on_join(std::filesystem::path src);
 
     // Adds a MQ server, i.e. QUIC.  The OMQ server is added automatically during construction and
     // should not be added.
     void register_mq_server(server::MQBase* server);
 
+    // Sets a QUIC server to relay onion requests to other service nodes over (rather than over
+    // OxenMQ), or nullptr to go back to OxenMQ (which must be done before destroying the server).
+    void set_quic_onion_relay(server::QUIC* quic) { quic_onion_relay_ = quic; }
+
+    // Likewise for relaying message data (i.e. relay_data_reliable and swarm bootstrapping).
+    void set_quic_data_relay(server::QUIC* quic) { quic_data_relay_ = quic; }
+
+    // Sets the HTTPS server's TLS session state, whose handshake counts we include in our metrics.
+    // Must be called before OxenMQ starts, and must stay alive until OxenMQ is stopped.
+    void set_tls_sessions(const server::TlsSessions* tls) { tls_sessions_ = tls; }
+
+    // Sets a callback to invoke (from whichever thread stores it) for each new message stored, just
+    // before monitoring clients are notified of it.  Must be set during startup; the callback must
+    // not block.  Passing nullptr removes the callback.
+    void set_new_message_callback(std::function<void(const message&)> cb) {
+        new_message_cb_ = std::move(cb);
+    }
+
+    // Returns the latency histograms of a request endpoint, i.e. a client RPC method (such as
+    // "store") or "sn.*" command, in which to record the timings of its requests.
+    util::endpoint_latency& latency(std::string_view endpoint) {
+        return all_stats_.latency(endpoint);
+    }
+
+    // Load-based admission control for client requests
+    rpc::AdmissionControl& admission() { return admission_; }
+
+    // The number of client stores that have been accepted but not yet written to the database
+    size_t store_backlog() const { return store_backlog_.load(std::memory_order_relaxed); }
+
+    // Buffer of the spans of sampled request traces
+    util::trace::TraceBuffer& traces() { return traces_; }
+
     // Return info about this node as it is advertised to other nodes
     const sn_record& own_address() { return our_address_; }
 
     // Record the time of our last being tested over omq/https
     void update_last_ping(ReachType type);
 
+    // Sets the maximum number of failing nodes to retest per testing tick, and of reachability
+    // tests to have in flight at once (see reachability_testing).
+    void set_reachability_limits(int retests_per_tick, int tests_in_flight);
+
     // These three are only needed because we store stats in Service Node,
     // might move it out later
     void record_proxy_request();
     void record_onion_request();
     void record_retrieve_request();
+    void record_onion_outcome(onion_outcome o);
+    void record_quorum_reply();
+    void record_late_peer_result();
+    void record_coalesced_store();
+    void record_oxend_cache_hit();
+    void record_oxend_coalesced();
 
     /// Sends an onion request to the next SS
     void send_onion_to_sn(
@@ -207,11 +537,20 @@ class ServiceNode {
             rpc::OnionRequestMetadata&& data,
             std::function<void(bool success, std::vector<std::string> data)> cb) const;
 
-    const hf_revision& hf() const { return hardfork_; }
+    hf_revision hf() const {
+        auto hf = hardfork_.load();
+        return {static_cast<int>(hf >> 32), static_cast<int>(hf & 0xffff'ffff)};
+    }
 
     const uint64_t& blockheight() const { return block_height_; }
 
-    bool hf_at_least(hf_revision version) const { return hardfork_ >= version; }
+    bool hf_at_least(hf_revision version) const { return hf() >= version; }
+
+    // The serialization version we use for messages relayed to swarm peers
+    uint8_t relay_serialization_version() const {
+        return hf_at_least(COMPACT_SERIALIZATION_HARDFORK) ? SERIALIZATION_VERSION_COMPACT
+                                                           : SERIALIZATION_VERSION_BT;
+    }
 
     // Return true if the service node is ready to handle requests, which means the storage
     // server is fully initialized (and not trying to shut down), the service node is active and
@@ -225,6 +564,17 @@ class ServiceNode {
     // when errors would have occurred without force_start.
     bool snode_ready(std::string* reason = nullptr);
 
+    // Gets us ready to shut down without leaving our swarm peers behind: stops accepting client
+    // requests (requests forwarded by our peers are still served), then waits for up to
+    // `timeout` for queued stores, forwarded requests and message relays to our peers to finish.
+    // Relays still queued after that are saved to disk to be sent after we start up again.
+    // Finally it checkpoints the database WAL, so that the next startup doesn't begin with a long
+    // WAL.  Blocks until done; should be followed by shutdown().
+    void drain(std::chrono::milliseconds timeout);
+
+    // True once drain() has been called
+    bool draining() const { return draining_; }
+
     // Puts the storage server into shutdown mode; this operation is irreversible and should
     // only be used during storage server shutdown.
     void shutdown();
@@ -232,18 +582,22 @@ class ServiceNode {
     // Returns true if the storage server is currently shutting down.
     bool shutting_down() const { return shutting_down_; }
 
-    /// Process message received from a client, return false if not in a swarm.  If new_msg is not
-    /// nullptr, sets it to true if we stored as a new message, false if we already had it.  If
-    /// `expiry` is non-null it will be set to the message's expiry: for a new message this is the
-    /// given expiry; for existing messages this is the message's new expiry (which might have been
-    /// extended to match the one in `msg`, if later).
-    bool process_store(
-            message msg,
-            bool* new_msg = nullptr,
-            std::chrono::system_clock::time_point* expiry = nullptr);
+    /// Process message received from a client.  The message is queued and written to the database
+    /// (along with any other stores queued around the same time) once the store batch window
+    /// elapses, after which `cb` is invoked with the result.  The callback is invoked from
+    /// whichever thread performs the write, which may be the calling thread (e.g. if batching is
+    /// disabled or the queue is full).  Notifications for the message are sent out only if it was
+    /// newly stored.
+    void process_store(message msg, store_callback cb);
+
+    /// Forwards a client request (with the given rpc method name and bt-encoded parameters) to a
+    /// swarm peer, invoking `cb` with the peer's reply.  Requests to the same peer are coalesced
+    /// over the forward batch window into a single sn.storage_cc_batch request.
+    void forward_to_peer(
+            const sn_record& peer, std::string method, std::string body, forward_callback cb);
 
     /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    void process_push_batch(std::string_view blob);
 
     // Attempt to find an answer (message body) to the storage test
     std::pair<MessageTestStatus, std::string> process_storage_test_req(
@@ -251,10 +605,20 @@ class ServiceNode {
             const crypto::legacy_pubkey& tester_addr,
             const std::string& msg_hash_hex);
 
+    /// Handle sn.sync_digest and sn.sync_hashes anti-entropy requests from swarm peers, returning
+    /// the reply.  Throws std::invalid_argument if the request is invalid, if `remote` is not a
+    /// member of our swarm, or if the requested range is not within our swarm's space.
+    std::string sync_digest(const crypto::x25519_pubkey& remote, std::string_view request);
+    std::string sync_hashes(const crypto::x25519_pubkey& remote, std::string_view request);
+
     bool is_pubkey_for_us(const user_pubkey& pk) const;
 
     std::optional<SwarmInfo> get_swarm(const user_pubkey& pk) const;
 
+    // Returns the pre-encoded swarm of `pk` (or of no swarm, if there isn't one), for responses
+    // that include the swarm.
+    std::shared_ptr<const encoded_swarm> get_encoded_swarm(const user_pubkey& pk) const;
+
     std::vector<sn_record> get_swarm_peers() const;
 
     // Stats for session clients that want to know the version number
@@ -262,13 +626,20 @@ class ServiceNode {
 
     std::string get_stats() const;
 
+    // Returns metrics in the OpenMetrics text format.  Unlike get_stats(), which runs database
+    // queries, this only reads counters, so can be called frequently.
+    std::string get_metrics() const;
+
+    // Returns the buffered trace spans as json in the Zipkin v2 span format (which most tracing
+    // systems can import), optionally restricted to the trace with the given (hex) trace id.
+    std::string get_traces(std::string_view trace_id = {}) const;
+
     std::string get_status_line() const;
 
     template <typename PubKey>
     std::optional<sn_record> find_node(const PubKey& pk) const {
-        std::lock_guard guard{sn_mutex_};
         if (swarm_)
-            return swarm_->find_node(pk);
+            return swarm_->state()->find_node(pk);
         return std::nullopt;
     }
 
@@ -27,6 +27,14 @@ inline bool operator!=(const sn_record& lhs, const sn_record& rhs) {
     return !(lhs == rhs);
 }
 
+// Returns true if two sn_record's are equal in every field (unlike `==`, which only compares the
+// legacy pubkeys).
+inline bool identical(const sn_record& lhs, const sn_record& rhs) {
+    return lhs.pubkey_legacy == rhs.pubkey_legacy && lhs.port == rhs.port &&
+           lhs.omq_quic_port == rhs.omq_quic_port && lhs.pubkey_ed25519 == rhs.pubkey_ed25519 &&
+           lhs.pubkey_x25519 == rhs.pubkey_x25519 && lhs.ip == rhs.ip;
+}
+
 struct sn_test {
     const snode::sn_record sn;
     std::function<void(const snode::sn_record, bool passed)> finished;
@@ -1,4 +1,5 @@
 #include "stats.h"
+#include <oxenss/utils/memory.hpp>
 #include <algorithm>
 #include <chrono>
 #include <iostream>
@@ -12,13 +13,67 @@ all_stats::all_stats(oxenmq::OxenMQ& omq) {
     omq.add_timer([this] { cleanup(); }, STATS_CLEANUP_INTERVAL);
 }
 
-static void cleanup_old(
-        std::deque<test_result>& tests, std::chrono::system_clock::time_point cutoff_time) {
-    while (!tests.empty() && tests.front().timestamp <= cutoff_time)
-        tests.pop_front();
+static constexpr auto ROLLING_WINDOW = 120min;
+
+void peer_stats::add_storage_test(const test_result& r) {
+    test_windows[0][static_cast<size_t>(r.result)]++;
+    if (tests_count_ < PEER_TEST_HISTORY) {
+        storage_tests_[(tests_start_ + tests_count_++) % PEER_TEST_HISTORY] = r;
+    } else {
+        // Full, so overwrite the oldest
+        storage_tests_[tests_start_] = r;
+        tests_start_ = (tests_start_ + 1) % PEER_TEST_HISTORY;
+    }
 }
 
-static constexpr auto ROLLING_WINDOW = 120min;
+double peer_stats::success_ratio(std::optional<size_t> window) const {
+    uint64_t ok = 0, total = 0;
+    for (size_t w = window.value_or(0); w < test_windows.size(); w++) {
+        ok += test_windows[w][static_cast<size_t>(ResultType::OK)];
+        for (auto n : test_windows[w])
+            total += n;
+        if (window)
+            break;
+    }
+    return total ? static_cast<double>(ok) / total : -1.0;
+}
+
+void peer_stats::rotate(std::chrono::system_clock::time_point cutoff) {
+    std::move_backward(test_windows.begin(), test_windows.end() - 1, test_windows.end());
+    test_windows[0] = {};
+    while (tests_count_ > 0 && storage_tests_[tests_start_].timestamp <= cutoff) {
+        tests_start_ = (tests_start_ + 1) % PEER_TEST_HISTORY;
+        tests_count_--;
+    }
+}
+
+void all_stats::retain_peers(const std::unordered_map<crypto::legacy_pubkey, sn_record>& nodes) {
+    std::lock_guard lock{peer_report_mutex};
+    for (auto it = peer_report_.begin(); it != peer_report_.end();) {
+        if (nodes.count(it->first))
+            ++it;
+        else
+            it = peer_report_.erase(it);
+    }
+}
+
+size_t all_stats::peer_report_memory() const {
+    std::lock_guard lock{peer_report_mutex};
+    return util::hashtable_bytes(peer_report_);
+}
+
+size_t all_stats::history_memory() const {
+    size_t bytes = 0;
+    {
+        std::lock_guard lock{prev_stats_mutex};
+        bytes += util::heap_bytes(previous_stats);
+    }
+    std::shared_lock lock{latency_mutex_};
+    bytes += util::tree_bytes(latency_);
+    for (auto& [name, lat] : latency_)
+        bytes += util::heap_bytes(name) + util::heap_bytes(lat.previous);
+    return bytes;
+}
 
 void all_stats::cleanup() {
     {
@@ -36,14 +91,61 @@ void all_stats::cleanup() {
         last_rotate = std::chrono::steady_clock::now();
     }
 
+    {
+        std::unique_lock lock{latency_mutex_};
+        for (auto& [name, lat] : latency_) {
+            // One more than the number of previous periods, as the oldest is where they start
+            while (lat.previous.size() > RECENT_STATS_COUNT)
+                lat.previous.pop_front();
+            auto& prev = lat.previous.emplace_back();
+            for (size_t i = 0; i < prev.size(); i++)
+                prev[i] = lat.current.stages[i].get();
+        }
+    }
+
     {
         // Clean up old peer report stats
         std::lock_guard lock{peer_report_mutex};
 
         const auto cutoff = std::chrono::system_clock::now() - ROLLING_WINDOW;
         for (auto& [kv, stats] : peer_report_)
-            cleanup_old(stats.storage_tests, cutoff);
+            stats.rotate(cutoff);
+    }
+}
+
+util::endpoint_latency& all_stats::latency(std::string_view endpoint) {
+    {
+        std::shared_lock lock{latency_mutex_};
+        if (auto it = latency_.find(endpoint); it != latency_.end())
+            return it->second.current;
     }
+    std::unique_lock lock{latency_mutex_};
+    return latency_.try_emplace(std::string{endpoint}).first->second.current;
+}
+
+std::map<std::string, stage_latencies, std::less<>> all_stats::get_recent_latencies() const {
+    std::map<std::string, stage_latencies, std::less<>> result;
+    std::shared_lock lock{latency_mutex_};
+    for (auto& [name, lat] : latency_) {
+        auto& stages = result[name];
+        for (size_t i = 0; i < stages.size(); i++) {
+            stages[i] = lat.current.stages[i].get();
+            if (!lat.previous.empty())
+                stages[i] -= lat.previous.front()[i];
+        }
+    }
+    return result;
+}
+
+std::map<std::string, stage_latencies, std::less<>> all_stats::get_latencies() const {
+    std::map<std::string, stage_latencies, std::less<>> result;
+    std::shared_lock lock{latency_mutex_};
+    for (auto& [name, lat] : latency_) {
+        auto& stages = result[name];
+        for (size_t i = 0; i < stages.size(); i++)
+            stages[i] = lat.current.stages[i].get();
+    }
+    return result;
 }
 
 std::pair<std::chrono::steady_clock::duration, period_stats> all_stats::get_recent_requests()
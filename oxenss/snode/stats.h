@@ -2,10 +2,18 @@
 
 #include "sn_record.h"
 
+#include <oxenss/utils/latency.hpp>
+
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <deque>
+#include <map>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 
 namespace oxenmq {
@@ -41,7 +49,11 @@ inline constexpr const char* to_str(ResultType result) {
     }
 }
 
-// Stats per peer
+// How many of a peer's most recent storage test results we keep
+inline constexpr size_t PEER_TEST_HISTORY = 32;
+
+// Stats per peer.  Fixed size: test results go in a ring buffer, and the per-period result counts
+// are kept up to date as results come in, so that reporting them is cheap.
 struct peer_stats {
     // how many times a single request failed
     uint64_t requests_failed = 0;
@@ -49,7 +61,32 @@ struct peer_stats {
     // causing this node to give up re-transmitting
     uint64_t pushes_failed = 0;
 
-    std::deque<test_result> storage_tests;
+    // Storage test result counts, indexed by ResultType, of the current stats period (element 0)
+    // and of the RECENT_STATS_COUNT previous ones (most recent first).
+    std::array<std::array<uint32_t, 4>, RECENT_STATS_COUNT + 1> test_windows{};
+
+    void add_storage_test(const test_result& r);
+
+    // Calls `f(const test_result&)` for each of the kept storage test results, oldest first.
+    template <typename F>
+    void for_each_storage_test(F&& f) const {
+        for (size_t i = 0; i < tests_count_; i++)
+            f(storage_tests_[(tests_start_ + i) % PEER_TEST_HISTORY]);
+    }
+    size_t storage_test_count() const { return tests_count_; }
+
+    // Returns the fraction of storage tests that passed in the given window (0 for the current
+    // period, 1 for the one before, etc.), or over all the windows if `window` is omitted; a
+    // negative value if there were no tests.
+    double success_ratio(std::optional<size_t> window = std::nullopt) const;
+
+    // Starts a new stats period, dropping the oldest window of counts, and drops kept test results
+    // older than `cutoff`.
+    void rotate(std::chrono::system_clock::time_point cutoff);
+
+  private:
+    std::array<test_result, PEER_TEST_HISTORY> storage_tests_{};
+    size_t tests_start_ = 0, tests_count_ = 0;
 };
 
 struct period_stats {
@@ -57,6 +94,37 @@ struct period_stats {
              onion_requests = 0;
 };
 
+using stage_latencies = std::array<util::LatencyHistogram::snapshot, util::LATENCY_STAGES>;
+
+// Request latencies of one endpoint: the histograms since startup, plus snapshots of them taken
+// at the starts of the recent periods (rotated along with the request counts), so that recent
+// latencies are the difference between the two.
+struct endpoint_latency_stats {
+    util::endpoint_latency current;
+    std::deque<stage_latencies> previous;
+};
+
+// How an onion request we received went for us
+enum class onion_outcome : uint8_t {
+    final_destination,  // we were the destination
+    relayed,            // relayed to the next node, which replied successfully
+    relay_failed,       // next node not found, timed out, or replied with an error
+    proxied,            // forwarded to an external url
+    invalid,            // undecryptable, unparseable, or for a disallowed url
+};
+inline constexpr size_t ONION_OUTCOMES = 5;
+
+inline constexpr const char* to_str(onion_outcome o) {
+    switch (o) {
+        case onion_outcome::final_destination: return "final_destination";
+        case onion_outcome::relayed: return "relayed";
+        case onion_outcome::relay_failed: return "relay_failed";
+        case onion_outcome::proxied: return "proxied";
+        case onion_outcome::invalid:
+        default: return "invalid";
+    }
+}
+
 class all_stats {
     // ===== This node's stats =====
     std::atomic<uint64_t> total_client_store_requests{0}, current_client_store_requests{0},
@@ -64,6 +132,20 @@ class all_stats {
             total_proxy_requests{0}, current_proxy_requests{0}, total_onion_requests{0},
             current_onion_requests{0};
 
+    std::array<std::atomic<uint64_t>, ONION_OUTCOMES> onion_outcomes_{};
+    // Results of our reachability tests of other nodes: [unreachable, reachable]
+    std::array<std::atomic<uint64_t>, 2> reachability_tests_{};
+    // Recursive requests replied to on reaching a quorum of peer results, and the peer results
+    // that then arrived too late to be included
+    std::atomic<uint64_t> quorum_replies_{0}, late_peer_results_{0};
+    // Duplicate client stores that joined an identical store already in flight
+    std::atomic<uint64_t> coalesced_stores_{0};
+    // oxend_request proxy calls answered from the cache, and ones that joined an identical call
+    // already waiting on oxend
+    std::atomic<uint64_t> oxend_cache_hits_{0}, oxend_coalesced_{0};
+    // Storage test results of other nodes, indexed by ResultType
+    std::array<std::atomic<uint64_t>, 4> storage_test_results_{};
+
     // Rolling stats for the previous N periods; each time we call cleanup (i.e. every 10
     // minutes) we rotate these, keeping the most recent 5.  Thus we can determine stats for
     // (approximately) the last hour by using these 5 historical values + the current_... values
@@ -72,7 +154,12 @@ class all_stats {
     std::chrono::steady_clock::time_point last_rotate = std::chrono::steady_clock::now();
     mutable std::mutex prev_stats_mutex;
 
-    // stats per every peer in our swarm (including former peers)
+    // Latencies per request endpoint, created as endpoints are first used.  Endpoints are never
+    // removed, so references to them stay valid.
+    std::map<std::string, endpoint_latency_stats, std::less<>> latency_;
+    mutable std::shared_mutex latency_mutex_;
+
+    // stats per peer we've dealt with that is still registered (see retain_peers)
     std::unordered_map<crypto::legacy_pubkey, peer_stats> peer_report_;
     mutable std::mutex peer_report_mutex;
 
@@ -96,16 +183,55 @@ class all_stats {
 
     // Records a storage test result for the given peer
     void record_storage_test_result(const crypto::legacy_pubkey& sn, ResultType result) {
+        storage_test_results_[static_cast<size_t>(result)]++;
         std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].storage_tests.push_back({std::chrono::system_clock::now(), result});
+        peer_report_[sn].add_storage_test({std::chrono::system_clock::now(), result});
+    }
+
+    void record_onion_outcome(onion_outcome o) { onion_outcomes_[static_cast<size_t>(o)]++; }
+    void record_reachability_test(bool reachable) { reachability_tests_[reachable]++; }
+    void record_quorum_reply() { quorum_replies_++; }
+    void record_late_peer_result() { late_peer_results_++; }
+    uint64_t get_quorum_replies() const { return quorum_replies_; }
+    uint64_t get_late_peer_results() const { return late_peer_results_; }
+    void record_coalesced_store() { coalesced_stores_++; }
+    uint64_t get_coalesced_stores() const { return coalesced_stores_; }
+    void record_oxend_cache_hit() { oxend_cache_hits_++; }
+    void record_oxend_coalesced() { oxend_coalesced_++; }
+    uint64_t get_oxend_cache_hits() const { return oxend_cache_hits_; }
+    uint64_t get_oxend_coalesced() const { return oxend_coalesced_; }
+
+    uint64_t get_onion_outcomes(onion_outcome o) const {
+        return onion_outcomes_[static_cast<size_t>(o)];
+    }
+    uint64_t get_reachability_tests(bool reachable) const { return reachability_tests_[reachable]; }
+    uint64_t get_storage_test_results(ResultType result) const {
+        return storage_test_results_[static_cast<size_t>(result)];
     }
 
-    // Returns a copy of the current peer report
-    std::unordered_map<crypto::legacy_pubkey, peer_stats> peer_report() const {
+    // Calls `f(const crypto::legacy_pubkey&, const peer_stats&)` for each peer in the peer report.
+    // Called with the report locked, so `f` should be quick and mustn't record stats.
+    template <typename F>
+    void visit_peer_report(F&& f) const {
         std::lock_guard lock{peer_report_mutex};
-        return peer_report_;
+        for (const auto& [pk, stats] : peer_report_)
+            f(pk, stats);
     }
 
+    // Returns the number of peers in the peer report
+    size_t peer_report_size() const {
+        std::lock_guard lock{peer_report_mutex};
+        return peer_report_.size();
+    }
+
+    // Returns (an estimate of) the memory used by the peer report, and by the request count and
+    // latency history, in bytes
+    size_t peer_report_memory() const;
+    size_t history_memory() const;
+
+    // Drops the stats of peers that are not in `nodes` (i.e. are no longer registered)
+    void retain_peers(const std::unordered_map<crypto::legacy_pubkey, sn_record>& nodes);
+
     void bump_proxy_requests() {
         total_proxy_requests++;
         current_proxy_requests++;
@@ -128,6 +254,17 @@ class all_stats {
     uint64_t get_total_store_requests() const { return total_client_store_requests; }
     uint64_t get_total_retrieve_requests() const { return total_client_retrieve_requests; }
 
+    /// Returns the latency histograms of the given endpoint (a client RPC method, or "sn.*" for the
+    /// commands of other service nodes), to record request timings.
+    util::endpoint_latency& latency(std::string_view endpoint);
+
+    /// Retrieves the recent latencies of each endpoint that has been used, over the same window as
+    /// get_recent_requests().
+    std::map<std::string, stage_latencies, std::less<>> get_recent_latencies() const;
+
+    /// Retrieves the latencies of each endpoint that has been used since startup
+    std::map<std::string, stage_latencies, std::less<>> get_latencies() const;
+
     /// Retrieves recent request counts using current period + stored previous period counts.
     ///
     /// Returns the time window (*not* the timestamp) of the returned stats and the stats.
@@ -3,9 +3,18 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/utils/string_utils.hpp>
 
+#include <algorithm>
+#include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <ostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <oxenc/base32z.h>
+#include <oxenc/bt_producer.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/endian.h>
 
 namespace oxenss::snode {
@@ -21,12 +30,31 @@ static bool swarm_exists(const std::vector<SwarmInfo>& all_swarms, const swarm_i
     return it != all_swarms.end();
 }
 
+static bool same_nodes(const std::vector<sn_record>& a, const std::vector<sn_record>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), identical);
+}
+
+static bool same_swarms(const std::vector<SwarmInfo>& a, const std::vector<SwarmInfo>& b) {
+    return std::equal(
+            a.begin(), a.end(), b.begin(), b.end(), [](const SwarmInfo& x, const SwarmInfo& y) {
+                return x.swarm_id == y.swarm_id && same_nodes(x.snodes, y.snodes);
+            });
+}
+
 Swarm::~Swarm() = default;
 
+template <typename F>
+void Swarm::update(F&& f) {
+    auto next = std::make_shared<SwarmState>(*state_);
+    f(*next);
+    std::atomic_store(&state_, std::shared_ptr<const SwarmState>{std::move(next)});
+}
+
 bool Swarm::is_existing_swarm(swarm_id_t sid) const {
+    const auto& all_valid_swarms = state_->all_valid_swarms;
     return std::any_of(
-            all_valid_swarms_.begin(),
-            all_valid_swarms_.end(),
+            all_valid_swarms.begin(),
+            all_valid_swarms.end(),
             [sid](const SwarmInfo& cur_swarm_info) { return cur_swarm_info.swarm_id == sid; });
 }
 
@@ -51,14 +79,15 @@ SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) con
     events.our_swarm_id = new_swarm_id;
     events.our_swarm_members = new_swarm_snodes;
 
-    if (cur_swarm_id_ == INVALID_SWARM_ID) {
+    const auto cur_swarm_id = state_->our_swarm_id;
+    if (cur_swarm_id == INVALID_SWARM_ID) {
         // Only started in a swarm, nothing to do at this stage
         return events;
     }
 
-    if (cur_swarm_id_ != new_swarm_id) {
+    if (cur_swarm_id != new_swarm_id) {
         // Got moved to a new swarm
-        if (!swarm_exists(swarms, cur_swarm_id_)) {
+        if (!swarm_exists(swarms, cur_swarm_id)) {
             // Dissolved, new to push all our data to new swarms
             events.dissolved = true;
         }
@@ -70,10 +99,11 @@ SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) con
     /// --- WE are still in the same swarm if we reach here ---
 
     /// See if anyone joined our swarm
+    const auto& swarm_peers = state_->swarm_peers;
     for (const auto& sn : new_swarm_snodes) {
-        const auto it = std::find(swarm_peers_.begin(), swarm_peers_.end(), sn);
+        const auto it = std::find(swarm_peers.begin(), swarm_peers.end(), sn);
 
-        if (it == swarm_peers_.end() && sn != our_address_) {
+        if (it == swarm_peers.end() && sn != our_address_) {
             events.new_snodes.push_back(sn);
         }
     }
@@ -91,12 +121,13 @@ SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) con
 }
 
 void Swarm::set_swarm_id(swarm_id_t sid) {
+    const auto cur_swarm_id = state_->our_swarm_id;
     if (sid == INVALID_SWARM_ID) {
         log::warning(logcat, "We are not currently an active Service Node");
     } else {
-        if (cur_swarm_id_ == INVALID_SWARM_ID) {
+        if (cur_swarm_id == INVALID_SWARM_ID) {
             log::info(logcat, "EVENT: started SN in swarm: 0x{}", util::int_to_string(sid, 16));
-        } else if (cur_swarm_id_ != sid) {
+        } else if (cur_swarm_id != sid) {
             log::info(
                     logcat,
                     "EVENT: got moved into a new swarm: 0x{}",
@@ -104,7 +135,8 @@ void Swarm::set_swarm_id(swarm_id_t sid) {
         }
     }
 
-    cur_swarm_id_ = sid;
+    if (cur_swarm_id != sid)
+        update([sid](SwarmState& state) { state.our_swarm_id = sid; });
 }
 
 void preserve_ips(std::vector<SwarmInfo>& new_swarms, const std::vector<SwarmInfo>& old_swarms) {
@@ -139,8 +171,10 @@ void preserve_ips(std::vector<SwarmInfo>& new_swarms, const std::vector<SwarmInf
 void Swarm::apply_swarm_changes(std::vector<SwarmInfo>&& new_swarms) {
     log::trace(logcat, "Applying swarm changes");
 
-    preserve_ips(new_swarms, all_valid_swarms_);
-    all_valid_swarms_ = std::move(new_swarms);
+    preserve_ips(new_swarms, state_->all_valid_swarms);
+    if (same_swarms(new_swarms, state_->all_valid_swarms))
+        return;
+    update([&](SwarmState& state) { state.set_swarms(std::move(new_swarms)); });
 }
 
 void Swarm::update_state(
@@ -148,6 +182,10 @@ void Swarm::update_state(
         const std::vector<sn_record>& decommissioned,
         const SwarmEvents& events,
         bool active) {
+    const auto& current = *state_;
+    bool changed = false;
+    std::vector<sn_record> peers;
+
     if (active) {
         // The following only makes sense for active nodes in a swarm
 
@@ -163,84 +201,252 @@ void Swarm::update_state(
             log::info(logcat, "EVENT: detected a new swarm: {}", swarm);
         }
 
-        apply_swarm_changes(std::move(swarms));
+        preserve_ips(swarms, current.all_valid_swarms);
 
         const auto& members = events.our_swarm_members;
+        /// sanity check: leave our peers alone if we have no idea who they are
+        if (members.empty()) {
+            peers = current.swarm_peers;
+        } else {
+            peers.reserve(members.size() - 1);
+            std::copy_if(
+                    members.begin(),
+                    members.end(),
+                    std::back_inserter(peers),
+                    [this](const sn_record& record) { return record != our_address_; });
+        }
 
-        /// sanity check
-        if (members.empty())
-            return;
-
-        swarm_peers_.clear();
-        swarm_peers_.reserve(members.size() - 1);
-
-        std::copy_if(
-                members.begin(),
-                members.end(),
-                std::back_inserter(swarm_peers_),
-                [this](const sn_record& record) { return record != our_address_; });
+        changed = !same_swarms(swarms, current.all_valid_swarms) ||
+                  !same_nodes(peers, current.swarm_peers);
     }
 
-    // Store a copy of every node in a separate data structure
-    all_funded_nodes_.clear();
-    all_funded_ed25519_.clear();
-    all_funded_x25519_.clear();
-
-    for (const auto& si : all_valid_swarms_) {
-        for (const auto& sn : si.snodes) {
-            all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
-        }
+    // When inactive the node list comes from the swarms we already have
+    if (!changed &&
+        current.same_funded_nodes(active ? swarms : current.all_valid_swarms, decommissioned)) {
+        log::trace(logcat, "Swarm state unchanged");
+        return;
     }
 
-    for (const auto& sn : decommissioned) {
-        all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
-    }
+    // Everything changes together, in a single new state
+    update([&](SwarmState& state) {
+        if (active) {
+            state.set_swarms(std::move(swarms));
+            state.swarm_peers = std::move(peers);
+        }
 
-    for (const auto& [pk, sn] : all_funded_nodes_) {
-        all_funded_ed25519_.emplace(sn.pubkey_ed25519, pk);
-        all_funded_x25519_.emplace(sn.pubkey_x25519, pk);
-    }
+        auto changes = state.update_funded_nodes(state.all_valid_swarms, decommissioned);
+        log::debug(logcat, "Updated swarm state ({} service node changes)", changes);
+    });
 }
 
-std::optional<sn_record> Swarm::find_node(const crypto::legacy_pubkey& pk) const {
-    if (auto it = all_funded_nodes_.find(pk); it != all_funded_nodes_.end())
+std::optional<sn_record> SwarmState::find_node(const crypto::legacy_pubkey& pk) const {
+    if (auto it = all_funded_nodes.find(pk); it != all_funded_nodes.end())
         return it->second;
     return std::nullopt;
 }
 
-std::optional<sn_record> Swarm::find_node(const crypto::ed25519_pubkey& pk) const {
-    if (auto it = all_funded_ed25519_.find(pk); it != all_funded_ed25519_.end())
+std::optional<sn_record> SwarmState::find_node(const crypto::ed25519_pubkey& pk) const {
+    if (auto it = all_funded_ed25519.find(pk); it != all_funded_ed25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
 
-std::optional<sn_record> Swarm::find_node(const crypto::x25519_pubkey& pk) const {
-    if (auto it = all_funded_x25519_.find(pk); it != all_funded_x25519_.end())
+std::optional<sn_record> SwarmState::find_node(const crypto::x25519_pubkey& pk) const {
+    if (auto it = all_funded_x25519.find(pk); it != all_funded_x25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
 
 uint64_t pubkey_to_swarm_space(const user_pubkey& pk) {
-    const auto bytes = pk.raw();
-    assert(bytes.size() == 32);
-
-    uint64_t res = 0;
-    for (size_t i = 0; i < 4; i++) {
-        uint64_t buf;
-        std::memcpy(&buf, bytes.data() + i * 8, 8);
-        res ^= buf;
+    return pk.swarm_space();
+}
+
+bool SwarmState::is_pubkey_for_us(const user_pubkey& pk) const {
+    auto* swarm = get_swarm(pk);
+    return swarm && our_swarm_id == swarm->swarm_id;
+}
+
+void SwarmState::set_swarms(std::vector<SwarmInfo>&& swarms) {
+    assert(std::is_sorted(swarms.begin(), swarms.end()));
+    all_valid_swarms = std::move(swarms);
+    swarm_ids.clear();
+    swarm_ids.reserve(all_valid_swarms.size());
+    encoded_swarms.clear();
+    encoded_swarms.reserve(all_valid_swarms.size());
+    for (const auto& swarm : all_valid_swarms) {
+        swarm_ids.push_back(swarm.swarm_id);
+        encoded_swarms.push_back(encode_swarm(&swarm));
     }
-    oxenc::big_to_host_inplace(res);
+}
+
+std::shared_ptr<const encoded_swarm> encode_swarm(const SwarmInfo* swarm) {
+    auto enc = std::make_shared<encoded_swarm>();
+    enc->id_hex = util::int_to_string(swarm ? swarm->swarm_id : INVALID_SWARM_ID, 16);
+    if (!swarm) {
+        enc->json = "[]";
+        enc->bt = "le";
+        return enc;
+    }
+    enc->size = swarm->snodes.size();
+
+    // The json is written directly, with the keys in sorted order (as nlohmann::json would write
+    // them); none of the values need escaping.
+    enc->json = "[";
+    oxenc::bt_list_producer bt;
+    for (const auto& sn : swarm->snodes) {
+        auto address = oxenc::to_base32z(sn.pubkey_legacy.view()) + ".snode";
+        if (enc->json.size() > 1)
+            enc->json += ',';
+        fmt::format_to(
+                std::back_inserter(enc->json),
+                R"({{"address":"{}","ip":"{}","port":"{}","port_https":{},"port_omq":{},)"
+                R"("port_quic":{},"pubkey_ed25519":"{}","pubkey_legacy":"{}",)"
+                R"("pubkey_x25519":"{}"}})",
+                address,
+                sn.ip,
+                sn.port,
+                sn.port,
+                sn.omq_quic_port,
+                sn.omq_quic_port,
+                sn.pubkey_ed25519.hex(),
+                sn.pubkey_legacy.hex(),
+                sn.pubkey_x25519.hex());
+
+        auto d = bt.append_dict();
+        d.append("address", address);  // Deprecated, use pubkey_legacy instead
+        d.append("ip", sn.ip);
+        d.append("port", std::to_string(sn.port));  // Deprecated string port; prefer port_https
+        d.append("port_https", sn.port);
+        d.append("port_omq", sn.omq_quic_port);
+        d.append("port_quic", sn.omq_quic_port);
+        d.append("pubkey_ed25519", sn.pubkey_ed25519.hex());
+        d.append("pubkey_legacy", sn.pubkey_legacy.hex());
+        d.append("pubkey_x25519", sn.pubkey_x25519.hex());
+    }
+    enc->json += ']';
+    enc->bt = std::move(bt).str();
+    return enc;
+}
 
-    return res;
+std::shared_ptr<const encoded_swarm> SwarmState::get_encoded_swarm(const user_pubkey& pk) const {
+    if (auto* swarm = get_swarm(pk))
+        return encoded_swarms[swarm - all_valid_swarms.data()];
+    static const auto none = encode_swarm(nullptr);
+    return none;
 }
 
-bool Swarm::is_pubkey_for_us(const user_pubkey& pk) const {
-    auto* swarm = get_swarm_by_pk(all_valid_swarms_, pk);
-    return swarm && cur_swarm_id_ == swarm->swarm_id;
+bool SwarmState::same_funded_nodes(
+        const std::vector<SwarmInfo>& swarms, const std::vector<sn_record>& decommissioned) const {
+    size_t count = 0;
+    auto same = [&](const sn_record& sn) {
+        count++;
+        auto it = all_funded_nodes.find(sn.pubkey_legacy);
+        return it != all_funded_nodes.end() && identical(it->second, sn);
+    };
+    for (const auto& si : swarms)
+        for (const auto& sn : si.snodes)
+            if (!same(sn))
+                return false;
+    for (const auto& sn : decommissioned)
+        if (!same(sn))
+            return false;
+    return count == all_funded_nodes.size();
+}
+
+size_t SwarmState::update_funded_nodes(
+        const std::vector<SwarmInfo>& swarms, const std::vector<sn_record>& decommissioned) {
+    // Drops the ed25519/x25519 lookups of a node that is going away or changing
+    auto unlink = [this](const sn_record& sn) {
+        if (auto it = all_funded_ed25519.find(sn.pubkey_ed25519);
+            it != all_funded_ed25519.end() && it->second == sn.pubkey_legacy)
+            all_funded_ed25519.erase(it);
+        if (auto it = all_funded_x25519.find(sn.pubkey_x25519);
+            it != all_funded_x25519.end() && it->second == sn.pubkey_legacy)
+            all_funded_x25519.erase(it);
+    };
+
+    size_t count = 0, changes = 0;
+    auto upsert = [&](const sn_record& sn) {
+        count++;
+        auto [it, inserted] = all_funded_nodes.try_emplace(sn.pubkey_legacy, sn);
+        if (!inserted) {
+            if (identical(it->second, sn))
+                return;
+            unlink(it->second);
+            it->second = sn;
+        }
+        all_funded_ed25519[sn.pubkey_ed25519] = sn.pubkey_legacy;
+        all_funded_x25519[sn.pubkey_x25519] = sn.pubkey_legacy;
+        changes++;
+    };
+    for (const auto& si : swarms)
+        for (const auto& sn : si.snodes)
+            upsert(sn);
+    for (const auto& sn : decommissioned)
+        upsert(sn);
+
+    // Each node is listed once, so if there are no more entries than nodes now then nothing went
+    // away, and we can skip looking for removed nodes.
+    if (all_funded_nodes.size() > count) {
+        std::unordered_set<crypto::legacy_pubkey> current;
+        current.reserve(count);
+        for (const auto& si : swarms)
+            for (const auto& sn : si.snodes)
+                current.insert(sn.pubkey_legacy);
+        for (const auto& sn : decommissioned)
+            current.insert(sn.pubkey_legacy);
+
+        for (auto it = all_funded_nodes.begin(); it != all_funded_nodes.end();) {
+            if (current.count(it->first)) {
+                ++it;
+                continue;
+            }
+            unlink(it->second);
+            it = all_funded_nodes.erase(it);
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+const SwarmInfo* SwarmState::get_swarm(const user_pubkey& pk) const {
+    return get_swarm_by_space(pubkey_to_swarm_space(pk));
+}
+
+const SwarmInfo* SwarmState::get_swarm_by_space(uint64_t space) const {
+    const size_t n = swarm_ids.size();
+    if (n == 0)
+        return nullptr;
+    if (n == 1)
+        return &all_valid_swarms.front();
+
+    // Branchless lower bound (the ternary compiles to a conditional move, so there are no
+    // mispredictions to pay for): find the first swarm id >= space.
+    const swarm_id_t* base = swarm_ids.data();
+    for (size_t len = n; len > 1;) {
+        size_t half = len / 2;
+        base = base[half] < space ? base + half : base;
+        len -= half;
+    }
+    size_t right = (base - swarm_ids.data()) + (*base < space);
+
+    // From here on this is the same as get_swarm_by_space(), below
+    if (right == n)
+        right = 0;
+    size_t left = (right == 0 ? n : right) - 1;
+
+    uint64_t dright = swarm_ids[right] - space;
+    uint64_t dleft = space - swarm_ids[left];
+
+    return &all_valid_swarms[dright < dleft ? right : left];
 }
 
 const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const user_pubkey& pk) {
+    return get_swarm_by_space(all_swarms, pubkey_to_swarm_space(pk));
+}
+
+const SwarmInfo* get_swarm_by_space(const std::vector<SwarmInfo>& all_swarms, uint64_t res) {
 
     if (all_swarms.empty())
         return nullptr;
@@ -251,8 +457,6 @@ const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const
     if (all_swarms.size() == 1)
         return &all_swarms.front();
 
-    const uint64_t res = pubkey_to_swarm_space(pk);
-
     // NB: this code used to be far more convoluted by trying to accommodate the INVALID_SWARM_ID
     // value, but that was wrong (because pubkeys map to the *full* uint64_t range, including
     // INVALID_SWARM_ID), more complicated, and didn't calculate distances properly when wrapping
@@ -278,6 +482,128 @@ const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const
     return &*(dright < dleft ? right_it : left_it);
 }
 
+std::pair<uint64_t, uint64_t> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, size_t index) {
+    assert(index < all_swarms.size());
+    assert(std::is_sorted(all_swarms.begin(), all_swarms.end()));
+
+    if (all_swarms.size() == 1)
+        return {0, std::numeric_limits<uint64_t>::max()};
+
+    const auto prev = all_swarms[index == 0 ? all_swarms.size() - 1 : index - 1].swarm_id;
+    const auto self = all_swarms[index].swarm_id;
+    const auto next = all_swarms[index + 1 == all_swarms.size() ? 0 : index + 1].swarm_id;
+
+    // All arithmetic here is deliberately modulo 2^64 so that it wraps around the same way that
+    // get_swarm_by_space does.  Values exactly halfway between two swarms belong to the lower
+    // (i.e. left) swarm because get_swarm_by_space only goes right when strictly closer.
+    return {prev + (self - prev) / 2 + 1, self + (next - self) / 2};
+}
+
+namespace {
+    // Version of the serialize_block_update format
+    constexpr int BLOCK_UPDATE_VERSION = 1;
+
+    void append_snode(oxenc::bt_list_producer&& l, const sn_record& sn) {
+        l.append(sn.ip);
+        l.append(sn.port);
+        l.append(sn.omq_quic_port);
+        std::string pks;
+        pks.reserve(96);
+        pks += sn.pubkey_legacy.view();
+        pks += sn.pubkey_ed25519.view();
+        pks += sn.pubkey_x25519.view();
+        l.append(pks);
+    }
+
+    sn_record consume_snode(oxenc::bt_list_consumer l) {
+        sn_record sn;
+        sn.ip = l.consume_string();
+        sn.port = l.consume_integer<uint16_t>();
+        sn.omq_quic_port = l.consume_integer<uint16_t>();
+        auto pks = l.consume_string_view();
+        if (pks.size() != 96)
+            throw std::invalid_argument{"invalid snode pubkeys"};
+        std::memcpy(sn.pubkey_legacy.data(), pks.data(), 32);
+        std::memcpy(sn.pubkey_ed25519.data(), pks.data() + 32, 32);
+        std::memcpy(sn.pubkey_x25519.data(), pks.data() + 64, 32);
+        return sn;
+    }
+
+    void require_key(oxenc::bt_dict_consumer& d, std::string_view key) {
+        if (!d.skip_until(key))
+            throw std::invalid_argument{"missing " + std::string{key}};
+    }
+}  // namespace
+
+std::string serialize_block_update(
+        const block_update& bu, std::chrono::system_clock::time_point saved) {
+    oxenc::bt_dict_producer d;
+    d.append("b", bu.block_hash);
+    {
+        auto decomm = d.append_list("d");
+        for (const auto& sn : bu.decommissioned_nodes)
+            append_snode(decomm.append_list(), sn);
+    }
+    d.append("f", bu.hardfork);
+    d.append("h", bu.height);
+    d.append("r", bu.snode_revision);
+    {
+        auto swarms = d.append_list("s");
+        for (const auto& swarm : bu.swarms) {
+            auto s = swarms.append_list();
+            s.append(swarm.swarm_id);
+            auto snodes = s.append_list();
+            for (const auto& sn : swarm.snodes)
+                append_snode(snodes.append_list(), sn);
+        }
+    }
+    d.append("t", std::chrono::floor<std::chrono::seconds>(saved.time_since_epoch()).count());
+    d.append("v", BLOCK_UPDATE_VERSION);
+    return std::move(d).str();
+}
+
+std::optional<std::pair<block_update, std::chrono::system_clock::time_point>>
+deserialize_block_update(std::string_view data) {
+    std::pair<block_update, std::chrono::system_clock::time_point> result;
+    auto& [bu, saved] = result;
+    try {
+        oxenc::bt_dict_consumer d{data};
+        require_key(d, "b");
+        bu.block_hash = d.consume_string();
+        require_key(d, "d");
+        for (auto l = d.consume_list_consumer(); !l.is_finished();)
+            bu.decommissioned_nodes.push_back(consume_snode(l.consume_list_consumer()));
+        require_key(d, "f");
+        bu.hardfork = d.consume_integer<int>();
+        require_key(d, "h");
+        bu.height = d.consume_integer<uint64_t>();
+        require_key(d, "r");
+        bu.snode_revision = d.consume_integer<int>();
+        require_key(d, "s");
+        for (auto l = d.consume_list_consumer(); !l.is_finished();) {
+            auto s = l.consume_list_consumer();
+            auto& swarm = bu.swarms.emplace_back();
+            swarm.swarm_id = s.consume_integer<swarm_id_t>();
+            for (auto snodes = s.consume_list_consumer(); !snodes.is_finished();) {
+                auto& sn = swarm.snodes.emplace_back(consume_snode(snodes.consume_list_consumer()));
+                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
+            }
+        }
+        require_key(d, "t");
+        saved = std::chrono::system_clock::time_point{
+                std::chrono::seconds{d.consume_integer<int64_t>()}};
+        require_key(d, "v");
+        if (auto v = d.consume_integer<int>(); v != BLOCK_UPDATE_VERSION)
+            throw std::invalid_argument{"unsupported version " + std::to_string(v)};
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed to deserialize saved block update: {}", e.what());
+        return std::nullopt;
+    }
+    std::sort(bu.swarms.begin(), bu.swarms.end());
+    return result;
+}
+
 std::pair<int, int> count_missing_data(const block_update& bu) {
     auto result = std::make_pair(0, 0);
     auto& [missing, total] = result;
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <chrono>
 #include <iostream>
 #include <oxenmq/auth.h>
 #include <limits>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -25,6 +29,19 @@ struct SwarmInfo {
     bool operator<(const SwarmInfo& other) const { return swarm_id < other.swarm_id; }
 };
 
+/// A swarm's id and membership list as included in get_swarm and wrong-swarm responses (i.e. the
+/// "swarm" and "snodes" values), encoded once whenever the swarms change so that those responses
+/// just splice them in rather than building them every time.
+struct encoded_swarm {
+    std::string id_hex;  // the swarm id in hex
+    std::string json;    // the json array of the swarm's nodes
+    std::string bt;      // the bt-encoded list of the swarm's nodes
+    size_t size = 0;     // the number of nodes
+};
+// Returns encodings of the given swarm, or of no swarm (i.e. the invalid swarm id and no nodes)
+// if nullptr.
+std::shared_ptr<const encoded_swarm> encode_swarm(const SwarmInfo* swarm);
+
 struct block_update {
     std::vector<SwarmInfo> swarms;
     std::vector<sn_record> decommissioned_nodes;
@@ -44,6 +61,28 @@ const SwarmInfo* get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms, const
 const SwarmInfo* get_swarm_by_pk(std::vector<SwarmInfo>&& all_swarms, const user_pubkey& pk) =
         delete;
 
+// Same as get_swarm_by_pk, but takes a swarm space value (as returned by pubkey_to_swarm_space)
+// instead of a pubkey.
+const SwarmInfo* get_swarm_by_space(const std::vector<SwarmInfo>& all_swarms, uint64_t space);
+const SwarmInfo* get_swarm_by_space(std::vector<SwarmInfo>&& all_swarms, uint64_t space) = delete;
+
+// Returns the inclusive [begin, end] range of swarm space values that belong to the swarm at
+// `index` of (sorted) `all_swarms`.  The range wraps around if it crosses the top of the space, in
+// which case `begin > end` and the range consists of [begin, 2^64-1] and [0, end].
+std::pair<uint64_t, uint64_t> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, size_t index);
+
+// Serializes a block update (other than the `unchanged` flag) into a compact bt-encoded binary
+// form, along with the time at which it is being saved, for persisting across restarts.
+std::string serialize_block_update(
+        const block_update& bu, std::chrono::system_clock::time_point saved);
+
+// Deserializes a value produced by serialize_block_update, returning the block update and the time
+// it was saved; returns nullopt if the value is invalid.  The swarms are returned sorted by swarm
+// id, and `active_x25519_pubkeys` is rebuilt from them.
+std::optional<std::pair<block_update, std::chrono::system_clock::time_point>>
+deserialize_block_update(std::string_view data);
+
 // Takes a swarm update, returns the number of active SN entries with missing
 // IP/port/ed25519/x25519 data and the total number of entries.  (We don't include
 // decommissioned nodes in either count).
@@ -74,17 +113,73 @@ struct SwarmEvents {
     std::vector<sn_record> our_swarm_members;
 };
 
+/// Immutable snapshot of the swarm state.  Swarm never modifies a published state: every change
+/// publishes a new one in its place, so readers can grab the current state without locking and
+/// keep using it (unchanged) for as long as they hold on to it, regardless of concurrent updates.
+struct SwarmState {
+    swarm_id_t our_swarm_id = INVALID_SWARM_ID;
+    /// Note: this excludes the "dummy" swarm
+    std::vector<SwarmInfo> all_valid_swarms;
+    /// The ids of `all_valid_swarms` (in the same, sorted, order), stored contiguously so that
+    /// looking up a swarm by pubkey only touches a few cache lines rather than a SwarmInfo (and
+    /// its vector of nodes) at every step of the search.
+    std::vector<swarm_id_t> swarm_ids;
+    /// The encodings of `all_valid_swarms` (again in the same order); shared between states, as
+    /// they are only replaced along with the swarms.
+    std::vector<std::shared_ptr<const encoded_swarm>> encoded_swarms;
+    std::vector<sn_record> swarm_peers;
+    /// This includes decommissioned nodes
+    std::unordered_map<crypto::legacy_pubkey, sn_record> all_funded_nodes;
+    std::unordered_map<crypto::ed25519_pubkey, crypto::legacy_pubkey> all_funded_ed25519;
+    std::unordered_map<crypto::x25519_pubkey, crypto::legacy_pubkey> all_funded_x25519;
+
+    bool is_valid() const { return our_swarm_id != INVALID_SWARM_ID; }
+
+    bool is_pubkey_for_us(const user_pubkey& pk) const;
+
+    /// Same as the get_swarm_by_pk and get_swarm_by_space free functions, applied to
+    /// `all_valid_swarms`, but using the `swarm_ids` index.
+    const SwarmInfo* get_swarm(const user_pubkey& pk) const;
+    const SwarmInfo* get_swarm_by_space(uint64_t space) const;
+
+    /// Returns the encodings of the swarm of `pk` (see get_swarm), or of no swarm if there
+    /// isn't one.
+    std::shared_ptr<const encoded_swarm> get_encoded_swarm(const user_pubkey& pk) const;
+
+    /// Replaces `all_valid_swarms` (which must be sorted) and updates the `swarm_ids` index and
+    /// `encoded_swarms`
+    void set_swarms(std::vector<SwarmInfo>&& swarms);
+
+    /// Returns true if `all_funded_nodes` already holds exactly (and identically) the nodes of
+    /// `swarms` and `decommissioned`.
+    bool same_funded_nodes(
+            const std::vector<SwarmInfo>& swarms,
+            const std::vector<sn_record>& decommissioned) const;
+
+    /// Brings `all_funded_nodes` and the ed25519/x25519 lookups in line with the nodes of `swarms`
+    /// and `decommissioned`, touching only the entries of nodes that were added, changed, or
+    /// removed.  Returns the number of such nodes.
+    size_t update_funded_nodes(
+            const std::vector<SwarmInfo>& swarms, const std::vector<sn_record>& decommissioned);
+
+    // Get the node with public key `pk` if exists; these search *all* fully-funded SNs
+    // (including decommissioned ones), not just the current swarm.
+    std::optional<sn_record> find_node(const crypto::legacy_pubkey& pk) const;
+    std::optional<sn_record> find_node(const crypto::ed25519_pubkey& pk) const;
+    std::optional<sn_record> find_node(const crypto::x25519_pubkey& pk) const;
+};
+
+/// Tracks the swarm state.  Changes must be externally synchronized (the ServiceNode makes them
+/// while holding its mutex), but state() may be called from any thread at any time.
 class Swarm {
 
-    swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
-    /// Note: this excludes the "dummy" swarm
-    std::vector<SwarmInfo> all_valid_swarms_;
     sn_record our_address_;
-    std::vector<sn_record> swarm_peers_;
-    /// This includes decommissioned nodes
-    std::unordered_map<crypto::legacy_pubkey, sn_record> all_funded_nodes_;
-    std::unordered_map<crypto::ed25519_pubkey, crypto::legacy_pubkey> all_funded_ed25519_;
-    std::unordered_map<crypto::x25519_pubkey, crypto::legacy_pubkey> all_funded_x25519_;
+    /// The current state, published (and loaded by state()) atomically
+    std::shared_ptr<const SwarmState> state_ = std::make_shared<const SwarmState>();
+
+    /// Publishes a copy of the current state, as modified by `f(state)`
+    template <typename F>
+    void update(F&& f);
 
     /// Check if `sid` is an existing (active) swarm
     bool is_existing_swarm(swarm_id_t sid) const;
@@ -94,42 +189,49 @@ class Swarm {
 
     ~Swarm();
 
+    /// Returns the current state.  This never blocks on (or is blocked by) swarm updates.
+    std::shared_ptr<const SwarmState> state() const { return std::atomic_load(&state_); }
+
     /// Extract relevant information from incoming swarm composition
     SwarmEvents derive_swarm_events(const std::vector<SwarmInfo>& swarms) const;
 
     /// Update swarm state according to `events`. If not `is_active`
-    /// only update the list of all nodes
+    /// only update the list of all nodes.  Nothing is published if this doesn't change anything
+    /// (which is the case for most blocks).
     void update_state(
             std::vector<SwarmInfo>&& swarms,
             const std::vector<sn_record>& decommissioned,
             const SwarmEvents& events,
             bool is_active);
 
+    /// Replaces the swarms (but not the list of all nodes), if they differ from the current ones
     void apply_swarm_changes(std::vector<SwarmInfo>&& new_swarms);
 
-    bool is_pubkey_for_us(const user_pubkey& pk) const;
+    void set_swarm_id(swarm_id_t sid);
 
-    const std::vector<sn_record>& other_nodes() const { return swarm_peers_; }
+    const sn_record& our_address() const { return our_address_; }
 
-    const std::vector<SwarmInfo>& all_valid_swarms() const { return all_valid_swarms_; }
+    // The accessors below refer into the current state, and so may only be used by the thread
+    // making changes; other threads must go through state().
 
-    const sn_record& our_address() const { return our_address_; }
+    bool is_pubkey_for_us(const user_pubkey& pk) const { return state_->is_pubkey_for_us(pk); }
 
-    swarm_id_t our_swarm_id() const { return cur_swarm_id_; }
+    const std::vector<sn_record>& other_nodes() const { return state_->swarm_peers; }
 
-    bool is_valid() const { return cur_swarm_id_ != INVALID_SWARM_ID; }
+    const std::vector<SwarmInfo>& all_valid_swarms() const { return state_->all_valid_swarms; }
 
-    void set_swarm_id(swarm_id_t sid);
+    swarm_id_t our_swarm_id() const { return state_->our_swarm_id; }
+
+    bool is_valid() const { return state_->is_valid(); }
 
     const std::unordered_map<crypto::legacy_pubkey, sn_record>& all_funded_nodes() const {
-        return all_funded_nodes_;
+        return state_->all_funded_nodes;
     }
 
-    // Get the node with public key `pk` if exists; these search *all* fully-funded SNs
-    // (including decommissioned ones), not just the current swarm.
-    std::optional<sn_record> find_node(const crypto::legacy_pubkey& pk) const;
-    std::optional<sn_record> find_node(const crypto::ed25519_pubkey& pk) const;
-    std::optional<sn_record> find_node(const crypto::x25519_pubkey& pk) const;
+    template <typename PubKey>
+    std::optional<sn_record> find_node(const PubKey& pk) const {
+        return state_->find_node(pk);
+    }
 };
 
 }  // namespace oxenss::snode
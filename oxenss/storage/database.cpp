@@ -1,21 +1,39 @@
 #include "database.hpp"
+#include "hash_filter.hpp"
+#include "memory_store.hpp"
 #include <SQLiteCpp/Database.h>
 #include <SQLiteCpp/Exception.h>
 #include <SQLiteCpp/Statement.h>
 #include <SQLiteCpp/Transaction.h>
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/latency.hpp>
+#include <oxenss/utils/memory.hpp>
+#include <oxenss/utils/probes.hpp>
+#include <oxenss/utils/random.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/common/format.h>
+#include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/hex.h>
 
+#include <algorithm>
 #include <array>
+#include <cassert>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <numeric>
 #include <shared_mutex>
 #include <thread>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 
@@ -28,6 +46,9 @@ static auto logcat = log::Cat("db");
 
 constexpr std::chrono::milliseconds SQLite_busy_timeout = 3s;
 
+constexpr int64_t EXPIRY_BUCKET_MS =
+        std::chrono::milliseconds{Database::EXPIRY_BUCKET_SIZE}.count();
+
 namespace {
     template <typename T>
     constexpr bool is_cstr = false;
@@ -228,8 +249,273 @@ namespace {
         return results;
     }
 
+    // Swarm space values are unsigned 64-bit integers but sqlite only does signed 64-bit integers,
+    // so we store them with the top bit flipped, which maps them into the signed range while
+    // preserving their order (and thus lets us do index range scans over swarm space).
+    int64_t swarm_space_key(uint64_t space) {
+        return static_cast<int64_t>(space ^ (uint64_t{1} << 63));
+    }
+
+    // Message hashes are (unpadded) base64 encodings of a 32-byte blake2b digest, but we store them
+    // as the raw 32 bytes, which makes the messages_hash index considerably smaller.  Conversion
+    // happens inside the queries via the hash_blob()/hash_text() SQL functions registered below;
+    // anything that isn't a canonically encoded 32-byte hash is stored unchanged, as text.
+    constexpr size_t HASH_BYTES = 32;
+    constexpr size_t HASH_B64_SIZE = 43;
+
+    bool hash_to_blob(std::string_view hash, std::array<unsigned char, HASH_BYTES>& out) {
+        if (hash.size() != HASH_B64_SIZE || !oxenc::is_base64(hash))
+            return false;
+        oxenc::from_base64(hash.begin(), hash.end(), out.begin());
+        // Reject encodings with non-zero padding bits, which wouldn't round-trip
+        return std::string_view{oxenc::to_base64(out.begin(), out.end())}.substr(
+                       0, HASH_B64_SIZE) == hash;
+    }
+
+    // hash_blob(x): converts a base64 message hash to its 32-byte stored form; anything else is
+    // returned as-is.
+    void sql_hash_blob(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+        if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
+            std::string_view hash{
+                    reinterpret_cast<const char*>(sqlite3_value_text(argv[0])),
+                    static_cast<size_t>(sqlite3_value_bytes(argv[0]))};
+            std::array<unsigned char, HASH_BYTES> raw;
+            if (hash_to_blob(hash, raw))
+                return sqlite3_result_blob(ctx, raw.data(), raw.size(), SQLITE_TRANSIENT);
+        }
+        sqlite3_result_value(ctx, argv[0]);
+    }
+
+    // hash_text(x): the inverse of hash_blob, converting a stored 32-byte hash back to base64.
+    void sql_hash_text(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+        if (sqlite3_value_type(argv[0]) == SQLITE_BLOB &&
+            sqlite3_value_bytes(argv[0]) == HASH_BYTES) {
+            auto* raw = static_cast<const unsigned char*>(sqlite3_value_blob(argv[0]));
+            auto hash = oxenc::to_base64(raw, raw + HASH_BYTES);
+            hash.resize(HASH_B64_SIZE);  // Drop the padding
+            return sqlite3_result_text(ctx, hash.data(), hash.size(), SQLITE_TRANSIENT);
+        }
+        sqlite3_result_value(ctx, argv[0]);
+    }
+
+    // Returns a `hash IN (...)` condition (or `hash NOT IN (...)`, if `negate` is true) for
+    // `count` hashes bound at sequential parameter positions starting from `first`.  The bound
+    // values are the base64 hashes (as text).  When `legacy` is true (i.e. an upgraded database
+    // still has text hashes waiting to be converted) each hash also matches its unconverted form.
+    std::string hash_condition(int first, size_t count, bool legacy, bool negate = false) {
+        std::string cond = negate ? "hash NOT IN (" : "hash IN (";
+        for (size_t i = 0; i < count; i++)
+            fmt::format_to(
+                    std::back_inserter(cond), "{}hash_blob(?{})", i > 0 ? "," : "", first + i);
+        if (legacy)
+            for (size_t i = 0; i < count; i++)
+                fmt::format_to(std::back_inserter(cond), ",?{}", first + i);
+        cond += ')';
+        return cond;
+    }
+
+    // Like hash_condition, but for any number of hashes passed as a single JSON array parameter
+    // (see json_array()) at position `param`, so that the same prepared statement works for any
+    // number of hashes.
+    std::string hash_array_condition(int param, bool legacy) {
+        return legacy ? "hash IN (SELECT hash_blob(value) FROM json_each(?{0})"
+                        " UNION ALL SELECT value FROM json_each(?{0}))"_format(param)
+                      : "hash IN (SELECT hash_blob(value) FROM json_each(?{}))"_format(param);
+    }
+
+    // Encodes a list of strings as a JSON array, for binding as a json_each() parameter.
+    std::string json_array(const std::vector<std::string>& vals) {
+        std::string json;
+        size_t size = 2;
+        for (auto& v : vals)
+            size += v.size() + 3;
+        json.reserve(size);
+        json += '[';
+        for (auto& v : vals) {
+            if (json.size() > 1)
+                json += ',';
+            json += '"';
+            for (char c : v) {
+                if (c == '"' || c == '\\') {
+                    json += '\\';
+                    json += c;
+                } else if (static_cast<unsigned char>(c) < 0x20)
+                    fmt::format_to(std::back_inserter(json), "\\u{:04x}", static_cast<int>(c));
+                else
+                    json += c;
+            }
+            json += '"';
+        }
+        json += ']';
+        return json;
+    }
+
 }  // namespace
 
+// Bounded, thread-safe cache of user pubkey -> owners.id mappings, shared across all of the
+// connections in the database pool so that the common read paths can skip the owners lookup.
+//
+// Entries are evicted by owner id whenever an owners row is inserted or deleted on any connection
+// (via an sqlite update hook, which also sees deletions from the owner_autoclean trigger).  To
+// avoid a racing lookup re-caching a mapping from a snapshot taken before such a change, fills are
+// only accepted if no eviction happened since the lookup started (see `generation()`).
+class OwnerIDCache {
+    std::shared_mutex mutex_;
+    std::unordered_map<user_pubkey, int64_t> ids_;
+    std::unordered_map<int64_t, user_pubkey> pubkeys_;
+    uint64_t generation_ = 0;
+    const size_t max_size_;
+
+  public:
+    explicit OwnerIDCache(size_t max_size) : max_size_{max_size} {}
+
+    // Returns the current eviction generation; this must be obtained *before* querying the
+    // database for a value to be passed to `insert`.
+    uint64_t generation() {
+        std::shared_lock lock{mutex_};
+        return generation_;
+    }
+
+    std::optional<int64_t> find(const user_pubkey& pk) {
+        std::shared_lock lock{mutex_};
+        if (auto it = ids_.find(pk); it != ids_.end())
+            return it->second;
+        return std::nullopt;
+    }
+
+    // Adds a mapping, unless an eviction has happened since `generation` was obtained.
+    void insert(const user_pubkey& pk, int64_t id, uint64_t generation) {
+        std::unique_lock lock{mutex_};
+        if (generation != generation_)
+            return;
+        if (ids_.size() >= max_size_) {
+            // When full just drop an arbitrary entry; we are really only trying to keep the
+            // memory footprint bounded, and the owners lookup on a miss is still fairly cheap.
+            auto it = ids_.begin();
+            pubkeys_.erase(it->second);
+            ids_.erase(it);
+        }
+        if (auto [it, ins] = ids_.emplace(pk, id); ins)
+            pubkeys_.emplace(id, pk);
+    }
+
+    void evict(int64_t id) {
+        std::unique_lock lock{mutex_};
+        generation_++;
+        if (auto it = pubkeys_.find(id); it != pubkeys_.end()) {
+            ids_.erase(it->second);
+            pubkeys_.erase(it);
+        }
+    }
+
+    size_t size() {
+        std::shared_lock lock{mutex_};
+        return ids_.size();
+    }
+    // Returns (an estimate of) the memory used by the cache, in bytes
+    size_t memory_usage() {
+        std::shared_lock lock{mutex_};
+        size_t bytes = util::hashtable_bytes(ids_) + util::hashtable_bytes(pubkeys_);
+        // Each pubkey is held twice, once in each map
+        for (auto& [pk, id] : ids_)
+            bytes += 2 * util::heap_bytes(pk.raw());
+        return bytes;
+    }
+};
+
+// In-memory copy of the revoked_subaccounts table, so that checking a subaccount for revocation
+// on the request path doesn't have to touch the database.
+//
+// The full set is loaded on first use and reloaded after any rolled back write transaction (which
+// may have undone a change we already applied here).  revoke/unrevoke replace the affected
+// owner's tokens with the table contents as read inside their write transaction (so that the
+// revoked_autoclean trigger's pruning is reflected), and owners deleted by owner_autoclean (which
+// cascades to their revoked tokens) are dropped via the same update hook that maintains
+// OwnerIDCache.  As with OwnerIDCache, a full load is only accepted if nothing changed since it
+// started.
+class RevokedSubaccounts {
+    using token_t = decltype(subaccount_token::token);
+
+    std::shared_mutex mutex_;
+    std::unordered_map<user_pubkey, std::vector<token_t>> tokens_;
+    std::unordered_map<int64_t, user_pubkey> owners_;
+    bool loaded_ = false;
+    uint64_t generation_ = 0;
+
+  public:
+    // Returns the current change generation; this must be obtained *before* querying the database
+    // for values to be passed to `load`.
+    uint64_t generation() {
+        std::shared_lock lock{mutex_};
+        return generation_;
+    }
+
+    // Replaces the entire set with the given (owner id, pubkey, token) rows, unless something has
+    // changed since `generation` was obtained.  Returns true if loaded.
+    bool load(
+            const std::vector<std::tuple<int64_t, user_pubkey, token_t>>& rows,
+            uint64_t generation) {
+        std::unique_lock lock{mutex_};
+        if (generation != generation_)
+            return false;
+        tokens_.clear();
+        owners_.clear();
+        for (auto& [id, pk, token] : rows) {
+            tokens_[pk].push_back(token);
+            owners_.emplace(id, pk);
+        }
+        loaded_ = true;
+        return true;
+    }
+
+    // Replaces the revoked tokens of a single owner.
+    void set(int64_t owner, const user_pubkey& pk, std::vector<token_t> tokens) {
+        std::unique_lock lock{mutex_};
+        generation_++;
+        if (tokens.empty()) {
+            tokens_.erase(pk);
+            owners_.erase(owner);
+        } else {
+            tokens_[pk] = std::move(tokens);
+            owners_.emplace(owner, pk);
+        }
+    }
+
+    // Called once a change passed to set() (which has to happen before the change commits) has
+    // committed, so that a load() that read the database in between can't install what it read.
+    void committed() {
+        std::unique_lock lock{mutex_};
+        generation_++;
+    }
+
+    // Called when an owner row is deleted or inserted.
+    void evict(int64_t owner) {
+        std::unique_lock lock{mutex_};
+        generation_++;
+        if (auto it = owners_.find(owner); it != owners_.end()) {
+            tokens_.erase(it->second);
+            owners_.erase(it);
+        }
+    }
+
+    // Forces a full reload on next use.
+    void invalidate() {
+        std::unique_lock lock{mutex_};
+        generation_++;
+        loaded_ = false;
+    }
+
+    // Returns whether `token` is revoked for `pk`, or nullopt if the set isn't currently loaded.
+    std::optional<bool> contains(const user_pubkey& pk, const token_t& token) {
+        std::shared_lock lock{mutex_};
+        if (!loaded_)
+            return std::nullopt;
+        auto it = tokens_.find(pk);
+        return it != tokens_.end() &&
+               std::find(it->second.begin(), it->second.end(), token) != it->second.end();
+    }
+};
+
 class DatabaseImpl {
   public:
     oxenss::Database& parent;
@@ -239,18 +525,113 @@ class DatabaseImpl {
 
     int page_size;
 
-    DatabaseImpl(Database& parent, const std::filesystem::path& db_path, bool initialize) :
+    const bool readonly;
+
+    DatabaseImpl(
+            Database& parent,
+            const std::filesystem::path& db_path,
+            bool initialize,
+            bool readonly = false) :
             parent{parent},
             db{db_path / std::filesystem::u8path("storage.db"),
-               SQLite::OPEN_READWRITE | (initialize ? SQLite::OPEN_CREATE : 0) |
+               (readonly ? SQLite::OPEN_READONLY
+                         : SQLite::OPEN_READWRITE | (initialize ? SQLite::OPEN_CREATE : 0)) |
                        SQLite::OPEN_NOMUTEX,
-               SQLite_busy_timeout.count()} {
-        // Don't fail on these because we can still work even if they fail
-        if (int rc = db.tryExec("PRAGMA journal_mode = WAL"); rc != SQLITE_OK)
-            log::error(logcat, "Failed to set journal mode to WAL: {}", sqlite3_errstr(rc));
+               SQLite_busy_timeout.count()},
+            readonly{readonly} {
+        assert(!(readonly && initialize));
+
+        for (auto [name, func] :
+             {std::pair{"hash_blob", &sql_hash_blob}, std::pair{"hash_text", &sql_hash_text}}) {
+            if (int rc = sqlite3_create_function_v2(
+                        db.getHandle(),
+                        name,
+                        1,
+                        SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                        nullptr,
+                        func,
+                        nullptr,
+                        nullptr,
+                        nullptr);
+                rc != SQLITE_OK) {
+                auto m = fmt::format(
+                        "Failed to register {} function: {}", name, sqlite3_errstr(rc));
+                log::critical(logcat, m);
+                throw std::runtime_error{m};
+            }
+        }
+
+        // Multi-hash queries pass their hashes as a json array
+        if (int rc = db.tryExec("SELECT * FROM json_each('[]')"); rc != SQLITE_OK) {
+            auto m = fmt::format(
+                    "sqlite3 JSON support is required but unavailable: {}", sqlite3_errstr(rc));
+            log::critical(logcat, m);
+            throw std::runtime_error{m};
+        }
+        if (readonly) {
+            // Readers don't change the journal mode (the writer already has), but we give them
+            // memory-mapped I/O and a larger page cache since they do the bulk of the lookups.
+            if (int rc = db.tryExec("PRAGMA mmap_size = {}"_format(Database::READER_MMAP_SIZE));
+                rc != SQLITE_OK)
+                log::warning(logcat, "Failed to set mmap size: {}", sqlite3_errstr(rc));
+            // Negative means KiB rather than pages
+            if (int rc = db.tryExec(
+                        "PRAGMA cache_size = -{}"_format(Database::READER_CACHE_SIZE / 1024));
+                rc != SQLITE_OK)
+                log::warning(logcat, "Failed to set cache size: {}", sqlite3_errstr(rc));
+        } else {
+            // Don't fail on these because we can still work even if they fail
+            if (int rc = db.tryExec("PRAGMA journal_mode = WAL"); rc != SQLITE_OK)
+                log::error(logcat, "Failed to set journal mode to WAL: {}", sqlite3_errstr(rc));
 
-        if (int rc = db.tryExec("PRAGMA synchronous = NORMAL"); rc != SQLITE_OK)
-            log::error(logcat, "Failed to set synchronous mode to NORMAL: {}", sqlite3_errstr(rc));
+            if (int rc = db.tryExec("PRAGMA synchronous = NORMAL"); rc != SQLITE_OK)
+                log::error(
+                        logcat, "Failed to set synchronous mode to NORMAL: {}", sqlite3_errstr(rc));
+
+            sqlite3_update_hook(
+                    db.getHandle(),
+                    [](void* self,
+                       int op,
+                       const char* /*db*/,
+                       const char* table,
+                       sqlite3_int64 rowid) {
+                        if (op != SQLITE_UPDATE && std::strcmp(table, "owners") == 0) {
+                            auto& parent = static_cast<DatabaseImpl*>(self)->parent;
+                            parent.owner_cache_->evict(rowid);
+                            parent.revoked_->evict(rowid);
+                        }
+                    },
+                    this);
+            sqlite3_rollback_hook(
+                    db.getHandle(),
+                    [](void* self) {
+                        static_cast<DatabaseImpl*>(self)->parent.revoked_->invalidate();
+                    },
+                    this);
+            // Keeps track of the WAL size after each commit for the checkpointer.  This replaces
+            // sqlite's own automatic checkpointing (which is itself a wal hook), so until the
+            // checkpointer is running we do what that does: checkpoint once the WAL gets long.
+            sqlite3_wal_hook(
+                    db.getHandle(),
+                    [](void* self, sqlite3* handle, const char* name, int pages) {
+                        auto& parent = static_cast<DatabaseImpl*>(self)->parent;
+                        parent.wal_pages_ = pages;
+                        parent.wal_commits_++;
+                        if (!parent.checkpointer_running_) {
+                            if (pages >= Database::AUTOCHECKPOINT_PAGES)
+                                sqlite3_wal_checkpoint_v2(
+                                        handle,
+                                        name,
+                                        SQLITE_CHECKPOINT_PASSIVE,
+                                        nullptr,
+                                        nullptr);
+                        } else if (pages >= parent.checkpoint_trigger_) {
+                            parent.checkpoint_cv_.notify_one();
+                        }
+                        return SQLITE_OK;
+                    },
+                    this);
+        }
 
         if (int rc = db.tryExec("PRAGMA foreign_keys = ON"); rc != SQLITE_OK) {
             auto m = fmt::format(
@@ -287,12 +668,14 @@ class DatabaseImpl {
             create_schema();
         }
 
-        bool have_namespace = false;
+        bool have_namespace = false, have_expiry_bucket = false;
         SQLite::Statement msg_cols{db, "PRAGMA main.table_info(messages)"};
         while (msg_cols.executeStep()) {
             auto [cid, name] = get<int64_t, std::string>(msg_cols);
             if (name == "namespace")
                 have_namespace = true;
+            else if (name == "expiry_bucket")
+                have_expiry_bucket = true;
         }
 
         if (!have_namespace) {
@@ -304,6 +687,124 @@ ALTER TABLE messages ADD COLUMN namespace INTEGER NOT NULL DEFAULT 0;
             )");
         }
 
+        bool have_swarm_space = false, have_message_count = false, have_message_bytes = false;
+        SQLite::Statement owner_cols{db, "PRAGMA main.table_info(owners)"};
+        while (owner_cols.executeStep()) {
+            auto [cid, name] = get<int64_t, std::string>(owner_cols);
+            if (name == "swarm_space")
+                have_swarm_space = true;
+            else if (name == "message_count")
+                have_message_count = true;
+            else if (name == "message_bytes")
+                have_message_bytes = true;
+        }
+
+        if (!have_swarm_space) {
+            log::info(logcat, "Upgrading database schema: adding owner swarm space");
+            SQLite::Transaction transaction{db};
+            db.exec("ALTER TABLE owners ADD COLUMN swarm_space INTEGER NOT NULL DEFAULT 0");
+
+            SQLite::Statement owners{db, "SELECT id, type, pubkey FROM owners"};
+            SQLite::Statement update{db, "UPDATE owners SET swarm_space = ? WHERE id = ?"};
+            int count = 0;
+            while (owners.executeStep()) {
+                auto [id, type, pk] = get<int64_t, uint8_t, std::string>(owners);
+                auto pubkey = load_pubkey(type, std::move(pk));
+                if (pubkey.raw().size() != 32)
+                    continue;
+                exec_query(update, swarm_space_key(pubkey.swarm_space()), id);
+                update.reset();
+                count++;
+            }
+            transaction.commit();
+            log::info(logcat, "Computed swarm space for {} owners", count);
+        }
+
+        // Set when one of the upgrades below leaves the stored counts to be filled in by
+        // reconcile_counts()
+        bool reconcile = false;
+
+        if (!have_message_count) {
+            // The actual counts get populated by reconcile_counts(), below
+            log::info(logcat, "Upgrading database schema: adding owner message counts");
+            db.exec("ALTER TABLE owners ADD COLUMN message_count INTEGER NOT NULL DEFAULT 0");
+            reconcile = true;
+        }
+        if (!db.tableExists("namespace_counts")) {
+            log::info(logcat, "Upgrading database schema: adding namespace and owner counts");
+            reconcile = true;
+            db.exec(R"(
+CREATE TABLE namespace_counts (
+    namespace INTEGER PRIMARY KEY,
+    count INTEGER NOT NULL
+);
+
+CREATE TABLE counters (
+    name TEXT PRIMARY KEY,
+    value INTEGER NOT NULL
+) WITHOUT ROWID;
+            )");
+        }
+        if (!have_message_bytes) {
+            // The actual sizes get populated by reconcile_counts(), below, and the dropped triggers
+            // get recreated (now also maintaining the sizes) by views_triggers_indices().
+            log::info(logcat, "Upgrading database schema: adding owner and namespace sizes");
+            db.exec(R"(
+ALTER TABLE owners ADD COLUMN message_bytes INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE namespace_counts ADD COLUMN bytes INTEGER NOT NULL DEFAULT 0;
+DROP TRIGGER IF EXISTS messages_count_insert;
+DROP TRIGGER IF EXISTS messages_count_delete;
+            )");
+            reconcile = true;
+        }
+        if (reconcile)
+            db.exec("INSERT INTO counters (name, value) VALUES ('counts_reconcile', 1)"
+                    " ON CONFLICT(name) DO UPDATE SET value = excluded.value");
+        // The owners_count_* triggers only adjust an existing owner count, which databases from
+        // before we kept one don't have.  (The WHERE is needed for sqlite to parse the upsert.)
+        db.exec("INSERT INTO counters (name, value) SELECT 'owners', COUNT(*) FROM owners WHERE 1"
+                " ON CONFLICT(name) DO NOTHING");
+
+        if (!have_expiry_bucket) {
+            // The actual buckets get computed just below
+            log::info(logcat, "Upgrading database schema: adding message expiry buckets");
+            db.exec(R"(
+DROP INDEX IF EXISTS messages_expiry;
+ALTER TABLE messages ADD COLUMN expiry_bucket INTEGER NOT NULL DEFAULT 0;
+            )");
+        }
+
+        // Expiry buckets have to agree with the current EXPIRY_BUCKET_SIZE, so recompute them (and
+        // recreate the trigger that maintains them) if the database was using some other size, or
+        // didn't have them at all.
+        SQLite::Statement bucket_size{
+                db, "SELECT value FROM counters WHERE name = 'expiry_bucket_ms'"};
+        if (exec_and_maybe_get<int64_t>(bucket_size) != EXPIRY_BUCKET_MS) {
+            log::info(logcat, "Computing message expiry buckets");
+            SQLite::Transaction transaction{db};
+            db.exec("DROP TRIGGER IF EXISTS messages_expiry_bucket");
+            db.exec("UPDATE messages SET expiry_bucket = expiry / {}"_format(EXPIRY_BUCKET_MS));
+            db.exec("INSERT INTO counters (name, value) VALUES ('expiry_bucket_ms', {})"
+                    " ON CONFLICT(name) DO UPDATE SET value = excluded.value"_format(
+                            EXPIRY_BUCKET_MS));
+            transaction.commit();
+        }
+
+        // Older databases store message hashes as base64 text; these get converted in the
+        // background (by Database::migrate_hashes()) rather than here because it can take a long
+        // time on a large database.  'hash_migration_id' tracks which message ids are done.
+        SQLite::Statement hash_format{db, "SELECT value FROM counters WHERE name = 'hash_format'"};
+        if (!exec_and_maybe_get<int64_t>(hash_format)) {
+            log::info(
+                    logcat,
+                    "Upgrading database schema: message hashes will be converted to binary");
+            db.exec("INSERT INTO counters (name, value) VALUES"
+                    " ('hash_format', 1), ('hash_migration_id', 0)");
+        }
+        SQLite::Statement hash_migration{
+                db, "SELECT value FROM counters WHERE name = 'hash_migration_id'"};
+        parent.legacy_hashes_ = exec_and_maybe_get<int64_t>(hash_migration).has_value();
+
         if (db.tableExists("revoked_subkeys")) {
             log::info(logcat, "Upgrading database schema: dropping revoked_subkeys");
             db.exec("DROP TABLE revoked_subkeys");
@@ -334,7 +835,9 @@ CREATE TRIGGER IF NOT EXISTS revoked_autoclean
 
         views_triggers_indices();
 
-        log::info(logcat, "Database setup complete");
+        // (Counts that an upgrade above left unpopulated then get filled in by reconcile_counts(),
+        // which the Database constructor runs alongside its other startup work.)
+        log::info(logcat, "Database schema is up to date");
     }
 
     void create_schema() {
@@ -345,21 +848,40 @@ CREATE TABLE owners (
     id INTEGER PRIMARY KEY,
     type INTEGER NOT NULL,
     pubkey BLOB NOT NULL,
+    swarm_space INTEGER NOT NULL,
+    message_count INTEGER NOT NULL DEFAULT 0, -- maintained by triggers
+    message_bytes INTEGER NOT NULL DEFAULT 0, -- total data size; also maintained by triggers
 
     UNIQUE(pubkey, type)
 );
 
 CREATE TABLE messages (
     id INTEGER PRIMARY KEY,
-    hash TEXT NOT NULL,
+    hash BLOB NOT NULL, -- see hash_blob()
     owner INTEGER NOT NULL REFERENCES owners(id),
     namespace INTEGER NOT NULL DEFAULT 0,
     timestamp INTEGER NOT NULL,
     expiry INTEGER NOT NULL,
     data BLOB NOT NULL,
+    expiry_bucket INTEGER NOT NULL DEFAULT 0, -- expiry / EXPIRY_BUCKET_SIZE; see below
 
     UNIQUE(hash)
 );
+
+-- Message and owner counts, maintained by triggers, so that stats (and quotas) don't have to scan
+-- the tables
+CREATE TABLE namespace_counts (
+    namespace INTEGER PRIMARY KEY,
+    count INTEGER NOT NULL,
+    bytes INTEGER NOT NULL DEFAULT 0
+);
+
+CREATE TABLE counters (
+    name TEXT PRIMARY KEY,
+    value INTEGER NOT NULL
+) WITHOUT ROWID;
+
+INSERT INTO counters (name, value) VALUES ('hash_format', 1), ('owners', 0);
         )");
 
         if (db.tableExists("Data")) {
@@ -378,7 +900,9 @@ CREATE TABLE messages (
             // );
 
             SQLite::Statement ins_owner{
-                    db, "INSERT INTO owners (type, pubkey) VALUES (?, ?) RETURNING id"};
+                    db,
+                    "INSERT INTO owners (type, pubkey, swarm_space) VALUES (?, ?, ?) RETURNING "
+                    "id"};
 
             std::unordered_map<std::string, int> owner_ids;
             SQLite::Statement old_owners{db, "SELECT DISTINCT Owner FROM Data"};
@@ -399,7 +923,9 @@ CREATE TABLE messages (
                     continue;
                 }
 
-                int id = exec_and_get<int>(ins_owner, type, old_owner);
+                auto space = load_pubkey(type, std::string{pubkey.data(), pubkey.size()})
+                                     .swarm_space();
+                int id = exec_and_get<int>(ins_owner, type, old_owner, swarm_space_key(space));
                 ins_owner.reset();
                 owner_ids.emplace(std::move(old_owner), id);
             }
@@ -410,7 +936,7 @@ CREATE TABLE messages (
             SQLite::Statement ins_msg{
                     db,
                     "INSERT INTO messages (hash, owner, timestamp, expiry, "
-                    "data) VALUES (?, ?, ?, ?, ?)"};
+                    "data) VALUES (hash_blob(?), ?, ?, ?, ?)"};
 
             SQLite::Statement sel_msgs{
                     db,
@@ -436,6 +962,8 @@ CREATE TABLE messages (
                     bad_owners);
 
             db.exec("DROP TABLE Data");
+            // (These went in before the count triggers existed)
+            db.exec("INSERT INTO counters (name, value) VALUES ('counts_reconcile', 1)");
 
             log::warning(logcat, "Data migration complete!");
         }
@@ -449,6 +977,13 @@ CREATE TABLE messages (
 
         SQLite::Transaction transaction{db};
 
+        // (This one can take a while to build on a large existing database)
+        SQLite::Statement have_owner_id{
+                db,
+                "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = 'messages_owner_id'"};
+        if (!exec_and_maybe_get<int>(have_owner_id))
+            log::info(logcat, "Creating message retrieval index");
+
         db.exec(R"(
 CREATE TRIGGER IF NOT EXISTS owner_autoclean
     AFTER DELETE ON messages FOR EACH ROW WHEN NOT EXISTS (SELECT * FROM messages WHERE owner = old.owner)
@@ -456,9 +991,45 @@ CREATE TRIGGER IF NOT EXISTS owner_autoclean
         DELETE FROM owners WHERE id = old.owner;
     END;
 
-CREATE INDEX IF NOT EXISTS messages_expiry ON messages(expiry);
+CREATE TRIGGER IF NOT EXISTS messages_count_insert
+    AFTER INSERT ON messages FOR EACH ROW
+    BEGIN
+        INSERT INTO namespace_counts (namespace, count, bytes)
+            VALUES (NEW.namespace, 1, length(NEW.data))
+            ON CONFLICT(namespace) DO UPDATE SET count = count + 1, bytes = bytes + excluded.bytes;
+        UPDATE owners SET message_count = message_count + 1,
+                message_bytes = message_bytes + length(NEW.data)
+            WHERE id = NEW.owner;
+    END;
+
+CREATE TRIGGER IF NOT EXISTS messages_count_delete
+    AFTER DELETE ON messages FOR EACH ROW
+    BEGIN
+        UPDATE namespace_counts SET count = count - 1, bytes = bytes - length(OLD.data)
+            WHERE namespace = OLD.namespace;
+        UPDATE owners SET message_count = message_count - 1,
+                message_bytes = message_bytes - length(OLD.data)
+            WHERE id = OLD.owner;
+    END;
+
+CREATE TRIGGER IF NOT EXISTS owners_count_insert
+    AFTER INSERT ON owners FOR EACH ROW
+    BEGIN
+        UPDATE counters SET value = value + 1 WHERE name = 'owners';
+    END;
+
+CREATE TRIGGER IF NOT EXISTS owners_count_delete
+    AFTER DELETE ON owners FOR EACH ROW
+    BEGIN
+        UPDATE counters SET value = value - 1 WHERE name = 'owners';
+    END;
+
+CREATE INDEX IF NOT EXISTS messages_expiry_bucket ON messages(expiry_bucket);
 CREATE INDEX IF NOT EXISTS messages_owner ON messages(owner, namespace, timestamp);
+-- Serves retrieves, which page through an owner's namespace in id order
+CREATE INDEX IF NOT EXISTS messages_owner_id ON messages(owner, namespace, id);
 CREATE INDEX IF NOT EXISTS messages_hash ON messages(hash);
+CREATE INDEX IF NOT EXISTS owners_swarm_space ON owners(swarm_space);
 
 CREATE VIEW IF NOT EXISTS owned_messages AS
     SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, namespace, timestamp, expiry, data
@@ -468,6 +1039,60 @@ DROP TRIGGER IF EXISTS owned_messages_insert;
 DROP TRIGGER IF EXISTS owned_messages_upsert;
 )");
 
+        // Messages are indexed by expiry bucket rather than exact expiry, and this keeps the
+        // bucket in sync when the expiry changes.  Doing it in a trigger means that the bucket (and
+        // thus the index) only gets written when the bucket actually changes: updating just the
+        // expiry doesn't touch any index at all.
+        db.exec(fmt::format(
+                R"(
+CREATE TRIGGER IF NOT EXISTS messages_expiry_bucket
+    AFTER UPDATE OF expiry ON messages FOR EACH ROW WHEN NEW.expiry / {0} != OLD.expiry_bucket
+    BEGIN
+        UPDATE messages SET expiry_bucket = NEW.expiry / {0} WHERE id = NEW.id;
+    END;
+)",
+                EXPIRY_BUCKET_MS));
+
+        transaction.commit();
+    }
+
+    // True if a schema upgrade added trigger-maintained counts that haven't been populated yet.
+    bool counts_reconcile_pending() {
+        SQLite::Statement st{db, "SELECT value FROM counters WHERE name = 'counts_reconcile'"};
+        return exec_and_maybe_get<int64_t>(st).value_or(0) != 0;
+    }
+
+    // Recomputes the trigger-maintained message and owner counts from scratch, which scans every
+    // stored message and so is only done after an upgrade that added the counts (see
+    // counts_reconcile_pending()).  Any later drift of the owner counts gets fixed up a range of
+    // owners at a time by Database::reconcile_owner_counts().
+    void reconcile_counts() {
+        SQLite::Transaction transaction{db};
+
+        db.exec(R"(
+DELETE FROM counters WHERE name = 'counts_reconcile';
+DELETE FROM namespace_counts;
+INSERT INTO namespace_counts (namespace, count, bytes)
+    SELECT namespace, COUNT(*), SUM(length(data)) FROM messages GROUP BY namespace;
+
+INSERT INTO counters (name, value) VALUES ('owners', (SELECT COUNT(*) FROM owners))
+    ON CONFLICT(name) DO UPDATE SET value = excluded.value;
+)");
+
+        int fixed = db.exec(R"(
+UPDATE owners SET message_count = c.count, message_bytes = c.bytes
+    FROM (SELECT owner, COUNT(*) AS count, SUM(length(data)) AS bytes
+          FROM messages GROUP BY owner) AS c
+    WHERE owners.id = c.owner
+        AND (owners.message_count != c.count OR owners.message_bytes != c.bytes)
+)");
+        fixed += db.exec(
+                "UPDATE owners SET message_count = 0, message_bytes = 0"
+                " WHERE (message_count != 0 OR message_bytes != 0) AND NOT EXISTS"
+                " (SELECT * FROM messages WHERE owner = owners.id)");
+        if (fixed > 0)
+            log::warning(logcat, "Corrected stored message counts of {} owners", fixed);
+
         transaction.commit();
     }
 
@@ -480,10 +1105,13 @@ DROP TRIGGER IF EXISTS owned_messages_upsert;
         /// Whether we should reset on destruction; can be set to false if needed.
         bool reset_on_destruction = true;
 
-        explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {}
+        explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {
+            OXENSS_PROBE(db_query_start, st.getQuery().c_str());
+        }
         ~StatementWrapper() noexcept {
             if (reset_on_destruction)
                 st.tryReset();
+            OXENSS_PROBE(db_query_done, st.getQuery().c_str());
         }
         SQLite::Statement& operator*() noexcept { return st; }
         SQLite::Statement* operator->() noexcept { return &st; }
@@ -507,229 +1135,1727 @@ DROP TRIGGER IF EXISTS owned_messages_upsert;
     }
 
     user_pubkey load_pubkey(uint8_t type, std::string pk) { return {type, std::move(pk)}; }
-};
-
-Database::Database(std::filesystem::path db_path) : db_path_{std::move(db_path)} {
-    impl_pool_.push(std::make_unique<DatabaseImpl>(*this, db_path_, /*initialize=*/true));
-
-    clean_expired();
-}
-
-Database::~Database() = default;
-
-/// RAII class that holds a single database instance exclusively for the owner, returning it to the
-/// database connection pool on destruction.  The general idea is that all database-interacting
-/// implementation methods shall do:
-///
-///     {
-///       auto impl = get_impl();
-///       impl->whatever();
-///       // ...
-///     }
-///
-/// where the "..." code shall be as minimal as possible (any sort of recursion or calling
-/// externally provided lambdas or whatnot could lead to an excessive number of database
-/// connections).
-class LockedDBImpl {
-  private:
-    std::unique_ptr<DatabaseImpl> impl_;
-    Database& parent_;
 
-    friend LockedDBImpl Database::get_impl();
-    LockedDBImpl(std::unique_ptr<DatabaseImpl> impl, Database& parent) :
-            impl_{std::move(impl)}, parent_{parent} {}
+    // hash_condition() for the current state of the database, i.e. also matching unconverted text
+    // hashes if an upgrade hasn't finished converting them yet.
+    std::string hash_in(int first, size_t count = 1, bool negate = false) {
+        return hash_condition(first, count, parent.legacy_hashes_, negate);
+    }
+    std::string hash_in_array(int param) {
+        return hash_array_condition(param, parent.legacy_hashes_);
+    }
 
-  public:
-    DatabaseImpl& operator*() noexcept { return *impl_; }
-    DatabaseImpl* operator->() noexcept { return impl_.get(); }
+    // Looks up the owner id of the given pubkey, using (and filling) the shared owner id cache.
+    // Returns nullopt if the pubkey has no owner row (i.e. no stored messages).
+    //
+    // This should only be used for reads and for updates that are also constrained by message
+    // hash; inserts should look up the owner within their transaction.
+    std::optional<int64_t> owner_id(const user_pubkey& pk) {
+        auto& cache = *parent.owner_cache_;
+        if (auto id = cache.find(pk))
+            return id;
+        auto gen = cache.generation();
+        auto id = exec_and_maybe_get<int64_t>(
+                prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"), pk);
+        if (id)
+            cache.insert(pk, *id, gen);
+        return id;
+    }
 
-    ~LockedDBImpl() {
-        std::unique_lock lock{parent_.impl_lock_};
-        parent_.impl_pool_.push(std::move(impl_));
+    // Returns the number of bytes in use in the database file, i.e. excluding free pages.
+    int64_t used_bytes() {
+        return (prepared_get<int64_t>("PRAGMA page_count") -
+                prepared_get<int64_t>("PRAGMA freelist_count")) *
+               page_size;
     }
-};
 
-LockedDBImpl Database::get_impl() {
-    // First see if we can find an idle impl connection in the pool, and if so remove it from the
-    // pool and return it.
-    {
-        std::unique_lock lock{impl_lock_};
-        if (!impl_pool_.empty()) {
-            auto impl = std::move(impl_pool_.top());
-            impl_pool_.pop();
-            return LockedDBImpl{std::move(impl), *this};
+    // Returns the current revoked subaccount tokens of an owner.
+    std::vector<decltype(subaccount_token::token)> revoked_tokens(int64_t owner) {
+        std::vector<decltype(subaccount_token::token)> tokens;
+        auto st = prepared_st("SELECT token FROM revoked_subaccounts WHERE owner = ?");
+        st->bind(1, owner);
+        while (st->executeStep()) {
+            auto col = st->getColumn(0);
+            if (col.getBytes() != SUBACCOUNT_TOKEN_LENGTH)
+                continue;
+            std::memcpy(tokens.emplace_back().data(), col.getBlob(), SUBACCOUNT_TOKEN_LENGTH);
         }
+        return tokens;
     }
-    // The idle pool was empty, so create a new connection (it'll get added to the pool on
-    // destruction).
-    return LockedDBImpl{
-            std::make_unique<DatabaseImpl>(*this, db_path_, /*initialize=*/false), *this};
-}
-
-void Database::clean_expired() {
-    get_impl()->prepared_exec(
-            "DELETE FROM messages WHERE expiry <= ?",
-            to_epoch_ms(std::chrono::system_clock::now()));
-}
-
-int64_t Database::get_message_count() {
-    return get_impl()->prepared_get<int64_t>("SELECT COUNT(*) FROM messages");
-}
 
-int64_t Database::get_owner_count() {
-    return get_impl()->prepared_get<int64_t>("SELECT COUNT(*) FROM owners");
-}
+    // Loads the full revoked subaccount token set into `parent.revoked_`.  Returns false if it
+    // could not be loaded because of a concurrent change.
+    bool load_revoked() {
+        auto gen = parent.revoked_->generation();
+        std::vector<std::tuple<int64_t, user_pubkey, decltype(subaccount_token::token)>> rows;
+        auto st = prepared_st(
+                "SELECT o.id, o.pubkey, o.type, r.token FROM revoked_subaccounts r"
+                " JOIN owners o ON o.id = r.owner");
+        while (st->executeStep()) {
+            auto token = st->getColumn(3);
+            if (token.getBytes() != SUBACCOUNT_TOKEN_LENGTH)
+                continue;
+            auto& [id, pk, tok] = rows.emplace_back();
+            id = st->getColumn(0).getInt64();
+            pk = load_pubkey(st->getColumn(2).getInt(), st->getColumn(1).getString());
+            std::memcpy(tok.data(), token.getBlob(), tok.size());
+        }
+        if (!parent.revoked_->load(rows, gen))
+            return false;
+        log::debug(logcat, "Loaded {} revoked subaccount tokens", rows.size());
+        return true;
+    }
 
-std::vector<int> Database::get_message_counts() {
-    auto impl = get_impl();
-    auto st = impl->prepared_st("SELECT COUNT(*) FROM messages GROUP BY owner");
-    return get_all<int>(st);
-}
+    // The queries used by retrieve(): finding the id of the last message the client already has,
+    // and fetching the messages after it (or from the start).  Retrieves page through these in id
+    // order, which is what the messages_owner_id index is for.
+    std::string last_hash_query() {
+        return "SELECT id FROM messages WHERE owner = ? AND namespace = ? AND " + hash_in(3);
+    }
+    static const char* retrieve_query(bool after_id) {
+        return after_id ? "SELECT hash_text(hash), namespace, timestamp, expiry, data FROM messages"
+                          " WHERE owner = ? AND namespace = ? AND id > ? ORDER BY id LIMIT ?"
+                        : "SELECT hash_text(hash), namespace, timestamp, expiry, data FROM messages"
+                          " WHERE owner = ? AND namespace = ? ORDER BY id LIMIT ?";
+    }
 
-std::vector<std::pair<namespace_id, int64_t>> Database::get_namespace_counts() {
-    auto impl = get_impl();
-    auto st = impl->prepared_st("SELECT namespace, COUNT(*) FROM messages GROUP BY namespace");
-    return get_all<namespace_id, int64_t>(st);
-}
+    // Retrieves messages for an owner id; see Database::retrieve.
+    std::pair<MessageList, bool> retrieve(
+            int64_t owner,
+            namespace_id ns,
+            const std::string& last_hash,
+            std::optional<size_t> max_results,
+            std::optional<size_t> max_size,
+            bool size_b64,
+            size_t per_message_overhead) {
+        if (max_results && *max_results < 1)
+            max_results = 1;
+
+        std::optional<int64_t> last_id;
+        if (!last_hash.empty()) {
+            auto st = prepared_st(last_hash_query());
+            last_id = exec_and_maybe_get<int64_t>(st, owner, to_int(ns), last_hash);
+        }
 
-int64_t Database::get_total_bytes() {
-    auto impl = get_impl();
-    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
-}
+        auto st = prepared_st(retrieve_query(last_id.has_value()));
+        int pos = 1;
+        st->bind(pos++, owner);
+        st->bind(pos++, to_int(ns));
+        if (last_id)
+            st->bind(pos++, *last_id);
+        st->bind(pos++, max_results ? static_cast<int>(*max_results) + 1 : -1);
+
+        std::pair<MessageList, bool> result{};
+        auto& [results, more] = result;
+
+        // We copy the hash and data straight out of sqlite's row into the result arena, rather
+        // than via intermediate strings.
+        size_t agg_size = 0;
+        while (st->executeStep()) {
+            if (max_results && results.size() >= *max_results) {
+                more = true;
+                break;
+            }
+            auto hash_col = st->getColumn(0);
+            std::string_view hash{
+                    static_cast<const char*>(hash_col.getText()),
+                    static_cast<size_t>(hash_col.getBytes())};
+            auto data_col = st->getColumn(4);
+            std::string_view data{
+                    static_cast<const char*>(data_col.getBlob()),
+                    static_cast<size_t>(data_col.getBytes())};
+            if (max_size) {
+                agg_size += per_message_overhead;
+                agg_size += hash.size();
+                agg_size += size_b64 ? data.size() * 4 / 3 : data.size();
+                if (!results.empty() && agg_size > *max_size) {
+                    more = true;
+                    break;
+                }
+            }
 
-int64_t Database::get_used_bytes() {
-    auto impl = get_impl();
-    return get_total_bytes() -
-           impl->prepared_get<int64_t>("PRAGMA freelist_count") * impl->page_size;
-}
+            results.add(
+                    hash,
+                    static_cast<namespace_id>(st->getColumn(1).getInt()),
+                    from_epoch_ms(st->getColumn(2).getInt64()),
+                    from_epoch_ms(st->getColumn(3).getInt64()),
+                    data);
+        }
 
-static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
-    std::optional<message> msg;
-    while (st.executeStep()) {
-        assert(!msg);
-        auto [hash, otype, opubkey, ns, ts, exp, data] =
-                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t, std::string>(
-                        st);
-        msg.emplace(
-                impl.load_pubkey(otype, std::move(opubkey)),
-                std::move(hash),
-                ns,
-                from_epoch_ms(ts),
-                from_epoch_ms(exp),
-                std::move(data));
+        return result;
     }
-    return msg;
-}
-
-std::optional<message> Database::retrieve_random() {
-    clean_expired();
-    auto impl = get_impl();
-    auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages "
-            " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)");
-    return get_message(*impl, st);
-}
-
-std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
-    auto impl = get_impl();
-    auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages WHERE hash = ?");
-    st->bindNoCopy(1, msg_hash);
-    return get_message(*impl, st);
-}
-
-StoreResult Database::store(const message& msg, std::chrono::system_clock::time_point* expiry) {
 
-    auto impl = get_impl();
+    // If a message with the given hash exists then extends its expiry to `new_exp` (if later) and
+    // returns Extended or Exists, setting `*expiry` (if given) to its resulting expiry.  Returns
+    // nullopt if there is no such message.
+    std::optional<StoreResult> update_existing_message(
+            const std::string& hash,
+            int64_t new_exp,
+            std::chrono::system_clock::time_point* expiry) {
+        auto existing = exec_and_maybe_get<int64_t, int64_t>(
+                prepared_st("SELECT id, expiry FROM messages WHERE " + hash_in(1)), hash);
+        if (!existing)
+            return std::nullopt;
+        auto& [id, exp] = *existing;
+        StoreResult ret;
+        if (exp < new_exp) {
+            prepared_exec("UPDATE messages SET expiry = ? WHERE id = ?", new_exp, id);
+            ret = StoreResult::Extended;
+            exp = new_exp;
+        } else {
+            ret = StoreResult::Exists;
+        }
+        if (expiry)
+            *expiry = from_epoch_ms(exp);
+        return ret;
+    }
 
-    StoreResult ret;
-    try {
+    // Returns true if a new message of `size` bytes in namespace `ns` would take the owner (with
+    // owner id `owner`, or nullopt for an owner without messages) or the namespace over one of the
+    // quotas (see Database::set_quotas).  These are just lookups of the trigger-maintained
+    // totals, not scans.
+    bool over_quota(std::optional<int64_t> owner, namespace_id ns, size_t size) {
+        const auto& q = parent.quotas_;
+        auto over = [&size](int64_t count, int64_t bytes, int64_t max_count, int64_t max_bytes) {
+            return (max_count > 0 && count + 1 > max_count) ||
+                   (max_bytes > 0 && bytes + static_cast<int64_t>(size) > max_bytes);
+        };
+        if (q.owner_messages > 0 || q.owner_bytes > 0) {
+            int64_t count = 0, bytes = 0;
+            if (owner)
+                if (auto row = exec_and_maybe_get<int64_t, int64_t>(
+                            prepared_st("SELECT message_count, message_bytes FROM owners"
+                                        " WHERE id = ?"),
+                            *owner))
+                    std::tie(count, bytes) = *row;
+            if (over(count, bytes, q.owner_messages, q.owner_bytes))
+                return true;
+        }
+        if (q.namespace_messages > 0 || q.namespace_bytes > 0) {
+            int64_t count = 0, bytes = 0;
+            if (auto row = exec_and_maybe_get<int64_t, int64_t>(
+                        prepared_st("SELECT count, bytes FROM namespace_counts"
+                                    " WHERE namespace = ?"),
+                        to_int(ns)))
+                std::tie(count, bytes) = *row;
+            if (over(count, bytes, q.namespace_messages, q.namespace_bytes))
+                return true;
+        }
+        return false;
+    }
 
-        SQLite::Transaction transaction{impl->db};
+    // Stores a single message; this must be called from within a transaction (which the caller is
+    // responsible for committing).  See Database::store for the return value and `expiry`.
+    StoreResult store(const message& msg, std::chrono::system_clock::time_point* expiry) {
+        auto new_exp = to_epoch_ms(msg.expiry);
+        auto existing_owner = exec_and_maybe_get<int64_t>(
+                prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"), msg.pubkey);
+
+        // (Public outbox namespaces hold just one message per owner, so aren't subject to quotas)
+        if (parent.quotas_.any() && !is_public_outbox_namespace(msg.msg_namespace) &&
+            over_quota(existing_owner, msg.msg_namespace, msg.data.size())) {
+            // Re-storing a message we already have is still fine, though
+            if (existing_owner)
+                if (auto ret = update_existing_message(msg.hash, new_exp, expiry))
+                    return *ret;
+            parent.quota_rejections_++;
+            return StoreResult::OverQuota;
+        }
 
         int64_t owner_id;
-        if (auto maybe = exec_and_maybe_get<int64_t>(
-                    impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"),
-                    msg.pubkey))
-            owner_id = *maybe;
+        if (existing_owner)
+            owner_id = *existing_owner;
         else
-            owner_id = impl->prepared_get<int64_t>(
-                    "INSERT INTO owners (pubkey, type) VALUES (?, ?) RETURNING id", msg.pubkey);
+            owner_id = prepared_get<int64_t>(
+                    "INSERT INTO owners (pubkey, type, swarm_space) VALUES (?, ?, ?) RETURNING id",
+                    msg.pubkey,
+                    swarm_space_key(msg.pubkey.swarm_space()));
 
         // When storing to a public namespace we clear anything there (except for a duplicate, to
         // avoid unnecessary storage churn).
         if (is_public_outbox_namespace(msg.msg_namespace)) {
-            impl->prepared_exec(
+            prepared_exec(
                     "DELETE FROM messages"
-                    " WHERE owner = ? AND namespace = ? AND hash != ?",
+                    " WHERE owner = ? AND namespace = ? AND " + hash_in(3, 1, /*negate=*/true),
                     owner_id,
                     msg.msg_namespace,
                     msg.hash);
         }
 
-        auto new_exp = to_epoch_ms(msg.expiry);
-
-        if (auto existing = exec_and_maybe_get<int64_t, int64_t>(
-                    impl->prepared_st("SELECT id, expiry FROM messages WHERE hash = ?"),
-                    msg.hash)) {
-            auto& [id, exp] = *existing;
-            if (exp < new_exp) {
-                impl->prepared_exec("UPDATE messages SET expiry = ? WHERE id = ?", new_exp, id);
-                ret = StoreResult::Extended;
-                exp = new_exp;
-            } else {
-                ret = StoreResult::Exists;
-            }
-            if (expiry)
-                *expiry = from_epoch_ms(exp);
-        } else {
-            impl->prepared_exec(
-                    "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
-                    " VALUES (?, ?, ?, ?, ?, ?)",
+        auto update_existing = [&] { return update_existing_message(msg.hash, new_exp, expiry); };
+
+        // If the hash filter says we definitely don't have this message yet then we can skip
+        // straight to the insert.  (We still have to tolerate the insert conflicting, because
+        // during a filter rebuild a message can briefly be missing from it).
+        const bool maybe_exists = parent.hash_filter_->maybe_contains(msg.hash);
+        parent.hash_filter_->add(msg.hash);
+        if (maybe_exists)
+            if (auto ret = update_existing())
+                return *ret;
+
+        if (prepared_exec(
+                    "INSERT INTO messages"
+                    " (owner, hash, namespace, timestamp, expiry, data, expiry_bucket)"
+                    " VALUES (?1, hash_blob(?2), ?3, ?4, ?5, ?6, ?5 / {})"
+                    " ON CONFLICT DO NOTHING"_format(EXPIRY_BUCKET_MS),
                     owner_id,
                     msg.hash,
                     msg.msg_namespace,
                     to_epoch_ms(msg.timestamp),
-                    to_epoch_ms(msg.expiry),
-                    blob_binder{msg.data});
-            ret = StoreResult::New;
-
-            if (expiry)
-                *expiry = msg.expiry;
+                    new_exp,
+                    blob_binder{msg.data}) == 0) {
+            if (auto ret = update_existing())
+                return *ret;
+            throw std::runtime_error{"Failed to insert message " + msg.hash};
         }
 
-        transaction.commit();
+        if (expiry)
+            *expiry = msg.expiry;
+        return StoreResult::New;
+    }
+};
 
-    } catch (const SQLite::Exception& e) {
-        if (e.getErrorCode() == SQLITE_FULL) {
-            if (db_full_counter++ % DB_FULL_FREQUENCY == 0)
-                log::error(logcat, "Failed to store message: database is full");
-            return StoreResult::Full;
-        } else {
-            log::critical(logcat, "Failed to store message: {}", e.getErrorStr());
-            throw;
+Database::Database(
+        std::filesystem::path db_path, size_t max_writers, size_t max_readers, size_t shards) :
+        writers_{std::max<size_t>(max_writers, 1), /*readonly=*/false},
+        readers_{std::max<size_t>(max_readers, 1), /*readonly=*/true},
+        db_path_{std::move(db_path)},
+        owner_cache_{std::make_unique<OwnerIDCache>(OWNER_ID_CACHE_SIZE)},
+        revoked_{std::make_unique<RevokedSubaccounts>()},
+        hash_filter_{std::make_unique<HashFilter>()} {
+    auto shard_dir = db_path_ / "shards";
+    if (shards > 1) {
+        if (std::filesystem::exists(db_path_ / "storage.db"))
+            throw std::runtime_error{"{} contains an unsharded database, which cannot be opened in "
+                                     "sharded mode"_format(db_path_.string())};
+        size_t existing = 0;
+        if (std::filesystem::exists(shard_dir))
+            for (auto& entry : std::filesystem::directory_iterator{shard_dir})
+                existing += entry.is_directory();
+        if (existing != 0 && existing != shards)
+            throw std::runtime_error{"{} contains a database with {} shards, not {}"_format(
+                    shard_dir.string(), existing, shards)};
+
+        // Opening a shard also initializes and cleans it, so do them all concurrently
+        std::vector<std::future<std::unique_ptr<Database>>> opening;
+        for (size_t i = 0; i < shards; i++) {
+            auto path = shard_dir / std::to_string(i);
+            std::filesystem::create_directories(path);
+            opening.push_back(std::async(
+                    std::launch::async, [path = std::move(path), max_writers, max_readers] {
+                        return std::make_unique<Database>(path, max_writers, max_readers);
+                    }));
         }
+        for (auto& f : opening)
+            shards_.push_back(f.get());
+        for (auto& shard : shards_)
+            legacy_hashes_ = legacy_hashes_ || shard->hash_migration_pending();
+        log::info(logcat, "Opened database with {} shards in {}", shards, shard_dir.string());
+        return;
+    }
+    if (std::filesystem::exists(shard_dir))
+        throw std::runtime_error{
+                "{} contains a sharded database, which cannot be opened in unsharded mode"_format(
+                        shard_dir.string())};
+
+    auto started = std::chrono::steady_clock::now();
+    writers_.idle.push(std::make_unique<DatabaseImpl>(*this, db_path_, /*initialize=*/true));
+    writers_.open = 1;
+
+    // With the schema in place the rest of the startup work splits into what needs the writer
+    // (checking the stored counts, then expiry cleanup) and what only needs readers (opening the
+    // reader connections and loading the revoked subaccounts), which can run at the same time.
+    auto readers = std::async(std::launch::async, [this] {
+        warm_readers();
+        get_reader()->load_revoked();
+    });
+    try {
+        if (auto impl = get_impl(); impl->counts_reconcile_pending())
+            impl->reconcile_counts();
+        clean_expired();
+    } catch (...) {
+        readers.wait();
+        throw;
     }
-    return ret;
+    readers.get();
+    log::info(
+            logcat,
+            "Database setup complete in {}",
+            util::short_duration(std::chrono::steady_clock::now() - started));
 }
 
-void Database::bulk_store(const std::vector<message>& items) {
-    auto impl = get_impl();
-    SQLite::Transaction t{impl->db};
-    auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto insert_owner = impl->prepared_st(
-            "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id");
-    std::unordered_map<user_pubkey, int64_t> seen;
-    for (auto& m : items) {
-        if (!m.pubkey)
-            continue;
+void Database::warm_readers() {
+    size_t count;
+    {
+        std::lock_guard lock{impl_lock_};
+        count = readers_.max_open - readers_.open;
+        readers_.open += count;
+    }
+    std::vector<std::future<std::unique_ptr<DatabaseImpl>>> opening;
+    for (size_t i = 0; i < count; i++)
+        opening.push_back(std::async(std::launch::async, [this] {
+            return std::make_unique<DatabaseImpl>(
+                    *this, db_path_, /*initialize=*/false, /*readonly=*/true);
+        }));
+
+    size_t failed = 0;
+    std::vector<std::unique_ptr<DatabaseImpl>> opened;
+    for (auto& f : opening) {
+        try {
+            opened.push_back(f.get());
+        } catch (const std::exception& e) {
+            // Not fatal: get_reader() will try again when it needs the connection
+            log::warning(logcat, "Failed to open read-only database connection: {}", e.what());
+            failed++;
+        }
+    }
+    {
+        std::lock_guard lock{impl_lock_};
+        readers_.open -= failed;
+        for (auto& impl : opened)
+            readers_.idle.push(std::move(impl));
+    }
+    readers_.cv.notify_all();
+}
+
+Database::~Database() {
+    if (checkpoint_thread_.joinable()) {
+        {
+            std::lock_guard lock{checkpoint_mutex_};
+            checkpoint_stop_ = true;
+        }
+        checkpoint_cv_.notify_one();
+        checkpoint_thread_.join();
+    }
+
+    snapshot_abort_ = true;
+    if (snapshot_thread_.joinable())
+        snapshot_thread_.join();
+
+    if (memory_ && memory_spill_) {
+        try {
+            spill_memory_tier(db_path_);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to save in-memory messages: {}", e.what());
+        }
+    }
+}
+
+bool Database::in_memory(namespace_id ns) const {
+    return memory_ && memory_->handles(ns);
+}
+
+namespace {
+    // Loads messages written by Database::spill_memory_tier(), which are a bt-encoded list of
+    // [pubkey, hash, namespace, timestamp, expiry, data] lists.
+    std::vector<message> load_spilled(const std::filesystem::path& path) {
+        std::ifstream in{path, std::ios::binary};
+        std::string data(
+                (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::vector<message> msgs;
+        try {
+            oxenc::bt_list_consumer l{data};
+            while (!l.is_finished()) {
+                auto m = l.consume_list_consumer();
+                message msg;
+                if (!msg.pubkey.load(m.consume_string_view()))
+                    throw std::runtime_error{"invalid pubkey"};
+                msg.hash = m.consume_string();
+                msg.msg_namespace = static_cast<namespace_id>(m.consume_integer<int16_t>());
+                msg.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
+                msg.expiry = from_epoch_ms(m.consume_integer<int64_t>());
+                msg.data = m.consume_string();
+                msgs.push_back(std::move(msg));
+            }
+        } catch (const std::exception& e) {
+            log::error(
+                    logcat,
+                    "Failed to load in-memory messages from {} (after {} messages): {}",
+                    path.string(),
+                    msgs.size(),
+                    e.what());
+        }
+        return msgs;
+    }
+}  // namespace
+
+void Database::enable_memory_tier(
+        std::set<namespace_id> namespaces, size_t max_bytes, bool spill) {
+    if (memory_)
+        throw std::logic_error{"The memory tier can only be enabled once"};
+    if (namespaces.empty())
+        return;
+
+    // Everything below uses the database directly, as memory_ doesn't get set until the end.
+    auto memory = std::make_unique<MemoryStore>(std::move(namespaces), max_bytes);
+
+    // Reload whatever we saved at the last shutdown, sending anything in a namespace that is no
+    // longer kept in memory to the database.
+    auto spill_path = db_path_ / MEMORY_TIER_SPILL_FILE;
+    if (std::filesystem::exists(spill_path)) {
+        auto now = std::chrono::system_clock::now();
+        std::vector<message> to_disk;
+        int64_t restored = 0;
+        for (auto& msg : load_spilled(spill_path)) {
+            if (msg.expiry <= now)
+                continue;
+            if (memory->handles(msg.msg_namespace)) {
+                memory->store(msg);
+                restored++;
+            } else {
+                to_disk.push_back(std::move(msg));
+            }
+        }
+        if (!to_disk.empty())
+            bulk_store(to_disk);
+        std::filesystem::remove(spill_path);
+        log::info(
+                logcat,
+                "Restored {} in-memory messages ({} moved to the database) from {}",
+                restored,
+                to_disk.size(),
+                spill_path.string());
+    }
+
+    auto moved = take_namespaces(memory->namespaces());
+    for (auto& msg : moved)
+        memory->store(msg);
+    if (!moved.empty())
+        log::info(logcat, "Moved {} messages from the database into memory", moved.size());
+
+    memory_ = std::move(memory);
+    memory_spill_ = spill;
+    log::info(
+            logcat,
+            "Keeping messages of namespaces {{{}}} in memory (up to {} MiB){}",
+            fmt::join(memory_->namespaces(), ","),
+            max_bytes / 1024 / 1024,
+            spill ? "; they will be saved to disk on shutdown" : "");
+}
+
+std::vector<message> Database::take_namespaces(const std::set<namespace_id>& namespaces) {
+    std::vector<message> results;
+    if (!shards_.empty()) {
+        for (auto& r : for_each_shard(
+                     [&namespaces](Database& shard) { return shard.take_namespaces(namespaces); }))
+            results.insert(
+                    results.end(),
+                    std::make_move_iterator(r.begin()),
+                    std::make_move_iterator(r.end()));
+        return results;
+    }
+
+    std::string nss;
+    for (auto ns : namespaces) {
+        if (!nss.empty())
+            nss += ',';
+        nss += std::to_string(to_int(ns));
+    }
+
+    auto impl = get_impl();
+    // The counts let us skip the scan in the usual case where there is nothing to move
+    if (impl->prepared_get<int64_t>(
+                "SELECT COALESCE(SUM(count), 0) FROM namespace_counts WHERE namespace IN (" +
+                nss + ")") == 0)
+        return results;
+
+    SQLite::Transaction t{impl->db};
+    auto st = impl->prepared_st(
+            "SELECT type, pubkey, hash_text(hash), namespace, timestamp, expiry, data"
+            " FROM owned_messages WHERE namespace IN (" +
+            nss + ") ORDER BY mid");
+    while (st->executeStep()) {
+        auto [type, pubkey, hash, ns, ts, exp, data] =
+                get<uint8_t, std::string, std::string, namespace_id, int64_t, int64_t, std::string>(
+                        st);
+        results.emplace_back(
+                impl->load_pubkey(type, pubkey),
+                std::move(hash),
+                ns,
+                from_epoch_ms(ts),
+                from_epoch_ms(exp),
+                std::move(data));
+    }
+    impl->prepared_exec("DELETE FROM messages WHERE namespace IN (" + nss + ")");
+    t.commit();
+    return results;
+}
+
+void Database::spill_memory_tier(const std::filesystem::path& dir) {
+    auto msgs = memory_->messages();
+    auto path = dir / MEMORY_TIER_SPILL_FILE;
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out{tmp, std::ios::binary | std::ios::trunc};
+        out << 'l';
+        for (auto& msg : msgs)
+            out << oxenc::bt_serializer(oxenc::bt_list{
+                    {msg.pubkey.prefixed_raw(),
+                     msg.hash,
+                     int64_t{to_int(msg.msg_namespace)},
+                     to_epoch_ms(msg.timestamp),
+                     to_epoch_ms(msg.expiry),
+                     msg.data}});
+        out << 'e';
+        if (!out.flush())
+            throw std::runtime_error{"unable to write " + tmp.string()};
+    }
+    std::filesystem::rename(tmp, path);
+    log::info(logcat, "Saved {} in-memory messages to {}", msgs.size(), path.string());
+}
+
+int64_t Database::memory_tier_bytes() const {
+    return memory_ ? static_cast<int64_t>(memory_->bytes()) : 0;
+}
+
+int64_t Database::memory_tier_evicted() const {
+    return memory_ ? memory_->evicted() : 0;
+}
+
+Database& Database::shard_for(const user_pubkey& pk) {
+    // Our swarm only covers a narrow, contiguous slice of the swarm space, so we split by the low
+    // bits (which are evenly distributed within any such slice) rather than by range.
+    return *shards_[pk.swarm_space() % shards_.size()];
+}
+
+template <typename F>
+auto Database::for_each_shard(F&& f) {
+    // The shards run on threads of their own, so we time them all from here
+    util::stage_timer timer{util::latency_stage::db};
+    auto call = [&f](Database& shard, size_t i) {
+        if constexpr (std::is_invocable_v<F&, Database&, size_t>)
+            return f(shard, i);
+        else
+            return f(shard);
+    };
+    using R = decltype(call(*shards_.front(), 0));
+    std::vector<std::future<R>> futures;
+    futures.reserve(shards_.size());
+    for (size_t i = 0; i < shards_.size(); i++)
+        futures.push_back(std::async(std::launch::async, call, std::ref(*shards_[i]), i));
+    if constexpr (std::is_void_v<R>) {
+        for (auto& fut : futures)
+            fut.get();
+    } else {
+        std::vector<R> results;
+        results.reserve(futures.size());
+        for (auto& fut : futures)
+            results.push_back(fut.get());
+        return results;
+    }
+}
+
+std::vector<std::pair<std::vector<size_t>, std::vector<message>>> Database::group_by_shard(
+        const std::vector<message>& msgs) {
+    std::vector<std::pair<std::vector<size_t>, std::vector<message>>> groups(shards_.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (!msgs[i].pubkey)
+            continue;
+        auto& [indices, shard_msgs] = groups[msgs[i].pubkey.swarm_space() % shards_.size()];
+        indices.push_back(i);
+        shard_msgs.push_back(msgs[i]);
+    }
+    return groups;
+}
+
+/// RAII class that holds a single database instance exclusively for the owner, returning it to the
+/// database connection pool on destruction.  The general idea is that all database-interacting
+/// implementation methods shall do:
+///
+///     {
+///       auto impl = get_impl();
+///       impl->whatever();
+///       // ...
+///     }
+///
+/// where the "..." code shall be as minimal as possible (any sort of recursion or calling
+/// externally provided lambdas or whatnot could lead to an excessive number of database
+/// connections).  In particular a thread must never acquire a second connection of the same kind
+/// while holding one: the pools are capped, so that can deadlock when they are exhausted.
+class LockedDBImpl {
+  private:
+    std::unique_ptr<DatabaseImpl> impl_;
+    Database& parent_;
+    Database::ConnectionPool& pool_;
+    // Times the request's database use, from waiting for the connection until giving it back
+    util::stage_timer timer_;
+
+    friend class Database;
+    LockedDBImpl(
+            std::unique_ptr<DatabaseImpl> impl,
+            Database& parent,
+            Database::ConnectionPool& pool,
+            util::stage_timer timer) :
+            impl_{std::move(impl)}, parent_{parent}, pool_{pool}, timer_{std::move(timer)} {
+        pool_.busy++;
+        OXENSS_PROBE(db_acquire, int{pool_.readonly});
+    }
+
+  public:
+    DatabaseImpl& operator*() noexcept { return *impl_; }
+    DatabaseImpl* operator->() noexcept { return impl_.get(); }
+
+    ~LockedDBImpl() {
+        {
+            std::unique_lock lock{parent_.impl_lock_};
+            pool_.idle.push(std::move(impl_));
+            pool_.busy--;
+        }
+        pool_.cv.notify_one();
+        OXENSS_PROBE(db_release, int{pool_.readonly});
+    }
+};
+
+LockedDBImpl Database::get_impl(ConnectionPool& pool) {
+    util::stage_timer timer{util::latency_stage::db};
+    OXENSS_PROBE(db_wait, int{pool.readonly});
+    std::unique_lock lock{impl_lock_};
+    // If there are no idle connections and we are at the connection limit then we have to wait for
+    // someone else to return one.
+    if (!pool.cv.wait_for(lock, CONNECTION_WAIT_TIMEOUT, [&pool] {
+            return !pool.idle.empty() || pool.open < pool.max_open;
+        }))
+        throw std::runtime_error{"Timed out waiting for an available {} database connection"_format(
+                pool.readonly ? "read-only" : "read-write")};
+
+    if (!pool.idle.empty()) {
+        auto impl = std::move(pool.idle.top());
+        pool.idle.pop();
+        return LockedDBImpl{std::move(impl), *this, pool, std::move(timer)};
+    }
+
+    // The idle pool was empty but we're below the limit, so create a new connection (it'll get
+    // added to the pool on destruction).  We count it before creating it (and release the lock
+    // while opening it) so that concurrent callers can't overshoot the limit.
+    pool.open++;
+    lock.unlock();
+    std::unique_ptr<DatabaseImpl> impl;
+    try {
+        impl = std::make_unique<DatabaseImpl>(
+                *this, db_path_, /*initialize=*/false, /*readonly=*/pool.readonly);
+    } catch (...) {
+        lock.lock();
+        pool.open--;
+        lock.unlock();
+        pool.cv.notify_one();
+        throw;
+    }
+    return LockedDBImpl{std::move(impl), *this, pool, std::move(timer)};
+}
+
+LockedDBImpl Database::get_impl() {
+    return get_impl(writers_);
+}
+
+LockedDBImpl Database::get_reader() {
+    return get_impl(readers_);
+}
+
+void Database::snapshot(const std::filesystem::path& dest, const std::atomic<bool>* abort) {
+    if (std::filesystem::weakly_canonical(dest) == std::filesystem::weakly_canonical(db_path_))
+        throw std::invalid_argument{"Cannot snapshot a database into its own directory"};
+
+    if (!shards_.empty()) {
+        // One shard at a time, to keep the extra I/O (which is the point of throttling) bounded
+        for (size_t i = 0; i < shards_.size(); i++)
+            shards_[i]->snapshot(dest / "shards" / std::to_string(i), abort);
+    } else {
+        std::filesystem::create_directories(dest);
+        auto path = dest / "storage.db";
+        auto tmp = path;
+        tmp += ".tmp";
+        std::filesystem::remove(tmp);
+
+        auto started = std::chrono::steady_clock::now();
+        int pages = 0;
+        try {
+            SQLite::Database out{tmp, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+            auto impl = get_reader();
+            // Everything is copied from within one read transaction: that pins a consistent view
+            // of the database, where otherwise any write made between two backup steps would
+            // restart the backup from scratch (and so a busy node might never finish one).
+            SQLite::Transaction read{impl->db};
+            impl->db.execAndGet("SELECT COUNT(*) FROM sqlite_master");
+            SQLite::Backup backup{out, impl->db};
+            for (int rc = SQLITE_OK; rc != SQLITE_DONE;) {
+                if (abort && *abort)
+                    throw std::runtime_error{"snapshot aborted"};
+                rc = backup.executeStep(SNAPSHOT_PAGES_PER_STEP);
+                if (rc != SQLITE_DONE)
+                    std::this_thread::sleep_for(SNAPSHOT_STEP_PAUSE);
+            }
+            pages = backup.getTotalPageCount();
+            read.commit();
+        } catch (...) {
+            std::filesystem::remove(tmp);
+            throw;
+        }
+        std::filesystem::rename(tmp, path);
+        log::info(
+                logcat,
+                "Wrote database snapshot of {} pages to {} in {}ms",
+                pages,
+                path.string(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started)
+                        .count());
+    }
+
+    if (memory_)
+        spill_memory_tier(dest);
+}
+
+bool Database::snapshot_async(std::filesystem::path dest) {
+    std::lock_guard lock{snapshot_mutex_};
+    if (snapshot_running_.exchange(true))
+        return false;
+    if (snapshot_thread_.joinable())
+        snapshot_thread_.join();
+    snapshot_thread_ = std::thread{[this, dest = std::move(dest)] {
+        try {
+            snapshot(dest, &snapshot_abort_);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Database snapshot to {} failed: {}", dest.string(), e.what());
+        }
+        snapshot_running_ = false;
+    }};
+    return true;
+}
+
+void Database::start_checkpointer(
+        std::chrono::milliseconds period, int64_t wal_size, std::chrono::milliseconds idle_time) {
+    for (auto& shard : shards_)
+        shard->start_checkpointer(period, wal_size, idle_time);
+    if (!shards_.empty() || checkpoint_thread_.joinable())
+        return;
+
+    checkpoint_trigger_ = std::max<int64_t>(wal_size / get_impl()->page_size, 1);
+    checkpointer_running_ = true;
+    checkpoint_thread_ = std::thread{[this, period, idle_time] {
+        try {
+            checkpoint_loop(period, idle_time);
+        } catch (const std::exception& e) {
+            log::error(logcat, "WAL checkpointer failed: {}", e.what());
+        }
+        // Writers go back to checkpointing for themselves
+        checkpointer_running_ = false;
+    }};
+}
+
+void Database::checkpoint_loop(
+        std::chrono::milliseconds period, std::chrono::milliseconds idle_time) {
+    // A connection of our own, so that checkpointing neither waits for nor ties up a pooled one
+    SQLite::Database db{
+            db_path_ / std::filesystem::u8path("storage.db"),
+            SQLite::OPEN_READWRITE | SQLite::OPEN_NOMUTEX,
+            static_cast<int>(CHECKPOINT_BUSY_TIMEOUT.count())};
+    auto checkpoint = [&](int mode) { return run_checkpoint(db.getHandle(), mode); };
+
+    int64_t commits = wal_commits_;
+    auto last_write = std::chrono::steady_clock::now();
+    bool truncated = false;
+
+    std::unique_lock lock{checkpoint_mutex_};
+    while (!checkpoint_stop_) {
+        checkpoint_cv_.wait_for(lock, period, [&] {
+            return checkpoint_stop_ ||
+                   (wal_commits_ != commits && wal_pages_ >= checkpoint_trigger_);
+        });
+        if (checkpoint_stop_)
+            break;
+        lock.unlock();
+
+        auto now = std::chrono::steady_clock::now();
+        if (int64_t c = wal_commits_; c != commits) {
+            commits = c;
+            last_write = now;
+            truncated = false;
+            checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+        } else if (!truncated && now - last_write >= idle_time) {
+            // A truncating checkpoint can fail if readers are still using the WAL, in which case
+            // we just try again after the next idle period.
+            truncated = checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
+            if (!truncated)
+                last_write = now;
+        }
+
+        lock.lock();
+    }
+}
+
+bool Database::run_checkpoint(sqlite3* db, int mode) {
+    auto started = std::chrono::steady_clock::now();
+    int rc = sqlite3_wal_checkpoint_v2(db, nullptr, mode, nullptr, nullptr);
+    checkpoint_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - started)
+                              .count();
+    (mode == SQLITE_CHECKPOINT_TRUNCATE ? checkpoints_truncate_ : checkpoints_passive_)++;
+    if (rc == SQLITE_BUSY)
+        checkpoints_busy_++;
+    else if (rc != SQLITE_OK)
+        log::warning(logcat, "WAL checkpoint failed: {}", sqlite3_errstr(rc));
+    std::error_code ec;
+    auto size =
+            std::filesystem::file_size(db_path_ / std::filesystem::u8path("storage.db-wal"), ec);
+    wal_bytes_ = ec ? 0 : static_cast<int64_t>(size);
+    return rc == SQLITE_OK;
+}
+
+bool Database::checkpoint_wal() {
+    bool ok = true;
+    for (auto& shard : shards_)
+        ok = shard->checkpoint_wal() && ok;
+    if (!shards_.empty())
+        return ok;
+    return run_checkpoint(get_impl()->db.getHandle(), SQLITE_CHECKPOINT_TRUNCATE);
+}
+
+void Database::set_quotas(const StoreQuotas& quotas) {
+    quotas_ = quotas;
+    auto shard_quotas = quotas;
+    if (!shards_.empty()) {
+        auto n = static_cast<int64_t>(shards_.size());
+        for (auto* q : {&shard_quotas.namespace_messages, &shard_quotas.namespace_bytes})
+            if (*q > 0)
+                *q = std::max<int64_t>(*q / n, 1);
+    }
+    for (auto& shard : shards_)
+        shard->set_quotas(shard_quotas);
+}
+
+bool Database::within_quota(const user_pubkey& pubkey, namespace_id ns, size_t size) {
+    if (!quotas_.any() || in_memory(ns) || is_public_outbox_namespace(ns))
+        return true;
+    if (!shards_.empty())
+        return shard_for(pubkey).within_quota(pubkey, ns, size);
+
+    auto impl = get_reader();
+    return !impl->over_quota(impl->owner_id(pubkey), ns, size);
+}
+
+int64_t Database::quota_rejections() const {
+    int64_t rejected = quota_rejections_;
+    for (auto& shard : shards_)
+        rejected += shard->quota_rejections();
+    return rejected;
+}
+
+Database::checkpoint_stats Database::get_checkpoint_stats() const {
+    checkpoint_stats stats{
+            checkpoints_passive_,
+            checkpoints_truncate_,
+            checkpoints_busy_,
+            checkpoint_us_ / 1e6,
+            wal_bytes_};
+    for (auto& shard : shards_) {
+        auto s = shard->get_checkpoint_stats();
+        stats.passive += s.passive;
+        stats.truncate += s.truncate;
+        stats.busy += s.busy;
+        stats.seconds += s.seconds;
+        stats.wal_bytes += s.wal_bytes;
+    }
+    return stats;
+}
+
+static bool visit_owner_messages(
+        DatabaseImpl& impl,
+        SQLite::Statement& owners,
+        const std::function<bool(const user_pubkey& owner)>& owner_filter,
+        const std::function<bool(message&& msg)>& visit);
+
+int64_t Database::import_snapshot(
+        const std::filesystem::path& src,
+        std::optional<std::pair<uint64_t, uint64_t>> space_range) {
+    auto in_range = [&space_range](const user_pubkey& pk) {
+        if (!space_range)
+            return true;
+        auto [begin, end] = *space_range;
+        auto space = pk.swarm_space();
+        return begin <= end ? space >= begin && space <= end : space >= begin || space <= end;
+    };
+
+    int64_t imported = 0, seen = 0;
+    std::vector<message> batch;
+    auto flush = [&] {
+        for (auto& result : bulk_store(batch))
+            imported += result == StoreResult::New;
+        seen += batch.size();
+        batch.clear();
+    };
+
+    // Messages that were in the memory tier of the snapshotted node
+    if (auto spill_path = src / MEMORY_TIER_SPILL_FILE; std::filesystem::exists(spill_path)) {
+        auto now = std::chrono::system_clock::now();
+        for (auto& msg : load_spilled(spill_path))
+            if (msg.expiry > now && in_range(msg.pubkey))
+                batch.push_back(std::move(msg));
+        flush();
+    }
+
+    // The snapshot only gets read, through read-only connections of its own, so it isn't upgraded
+    // or cleaned up (visit_owner_messages skips its expired messages instead) and can be on a
+    // read-only mount.
+    std::vector<std::filesystem::path> dirs;
+    if (auto shard_dir = src / "shards"; std::filesystem::exists(shard_dir)) {
+        for (auto& entry : std::filesystem::directory_iterator{shard_dir})
+            if (entry.is_directory())
+                dirs.push_back(entry.path());
+    } else {
+        dirs.push_back(src);
+    }
+    auto visit = [&](message&& msg) {
+        batch.push_back(std::move(msg));
+        if (batch.size() >= SNAPSHOT_IMPORT_BATCH_SIZE)
+            flush();
+        return true;
+    };
+    for (auto& dir : dirs) {
+        DatabaseImpl source{*this, dir, /*initialize=*/false, /*readonly=*/true};
+        SQLite::Statement owners{source.db, "SELECT id, type, pubkey FROM owners"};
+        visit_owner_messages(source, owners, in_range, visit);
+    }
+    flush();
+
+    log::info(logcat, "Imported {} new messages (of {}) from {}", imported, seen, src.string());
+    return imported;
+}
+
+int64_t Database::clean_expired() {
+    int64_t deleted = memory_ ? memory_->clean_expired() : 0;
+    if (!shards_.empty()) {
+        int64_t backlog = 0;
+        for (auto [d, b] : for_each_shard([](Database& shard) {
+                 auto deleted = shard.clean_expired();
+                 return std::pair{deleted, shard.expired_backlog()};
+             })) {
+            deleted += d;
+            backlog += b;
+        }
+        expired_backlog_ = backlog;
+        return deleted;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    auto now_ms = to_epoch_ms(std::chrono::system_clock::now());
+    auto now_bucket = now_ms / EXPIRY_BUCKET_MS;
+    while (true) {
+        // Each chunk returns the connection to the pool (and thus also releases the write lock)
+        // before we start the next one.
+        // Every message in a bucket before the current one has expired, so those can go without
+        // looking at the exact expiry; only the current bucket needs checking.
+        int chunk = get_impl()->prepared_exec(
+                "DELETE FROM messages WHERE id IN (SELECT id FROM messages"
+                " WHERE expiry_bucket <= ?1 AND (expiry_bucket < ?1 OR expiry <= ?2) LIMIT ?3)",
+                now_bucket,
+                now_ms,
+                CLEANUP_CHUNK_SIZE);
+        deleted += chunk;
+        if (chunk < CLEANUP_CHUNK_SIZE) {
+            expired_backlog_ = 0;
+            break;
+        }
+        if (std::chrono::steady_clock::now() - started >= CLEANUP_TIME_BUDGET) {
+            expired_backlog_ = get_reader()->prepared_get<int64_t>(
+                    "SELECT COUNT(*) FROM messages"
+                    " WHERE expiry_bucket <= ?1 AND (expiry_bucket < ?1 OR expiry <= ?2)",
+                    now_bucket,
+                    now_ms);
+            log::debug(
+                    logcat,
+                    "Expiry cleanup removed {} messages in {}; {} expired messages remaining",
+                    deleted,
+                    util::short_duration(std::chrono::steady_clock::now() - started),
+                    expired_backlog_.load());
+            break;
+        }
+        std::this_thread::yield();
+    }
+    if (deleted > 0)
+        log::trace(logcat, "Removed {} expired messages", deleted);
+    return deleted;
+}
+
+int64_t Database::evict(DatabaseImpl& impl, int64_t count) {
+    // We evict by expiry (to the granularity of the expiry buckets, which is what is indexed)
+    // within each priority level, lowest priority first.  Each pass gets a
+    // condition selecting the namespaces at its level; the default (0) level gets everything not
+    // explicitly given some other priority.
+    std::vector<std::string> passes;
+    {
+        std::lock_guard lock{eviction_mutex_};
+        std::map<int, std::string> levels{{0, ""}};
+        std::string nondefault;
+        for (auto& [ns, priority] : eviction_priorities_) {
+            if (priority == 0)
+                continue;
+            for (auto* list : {&levels[priority], &nondefault}) {
+                if (!list->empty())
+                    *list += ',';
+                *list += std::to_string(to_int(ns));
+            }
+        }
+        for (auto& [priority, nss] : levels) {
+            if (priority != 0)
+                passes.push_back("namespace IN (" + nss + ")");
+            else if (!nondefault.empty())
+                passes.push_back("namespace NOT IN (" + nondefault + ")");
+            else
+                passes.push_back("1");
+        }
+    }
+
+    auto before = impl.used_bytes();
+    int64_t evicted = 0;
+    SQLite::Transaction t{impl.db};
+    for (auto& cond : passes) {
+        evicted += impl.prepared_exec(
+                "DELETE FROM messages WHERE id IN (SELECT id FROM messages WHERE " + cond +
+                        " ORDER BY expiry_bucket LIMIT ?)",
+                count - evicted);
+        if (evicted >= count)
+            break;
+    }
+    t.commit();
+
+    auto freed = std::max<int64_t>(before - impl.used_bytes(), 0);
+    evicted_messages_ += evicted;
+    evicted_bytes_ += freed;
+    log::debug(logcat, "Evicted {} messages, freeing {} bytes", evicted, freed);
+    return evicted;
+}
+
+int64_t Database::make_space() {
+    if (!shards_.empty()) {
+        auto evicted = for_each_shard([](Database& shard) { return shard.make_space(); });
+        return std::accumulate(evicted.begin(), evicted.end(), int64_t{0});
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    int64_t evicted = 0;
+    while (std::chrono::steady_clock::now() - started < CLEANUP_TIME_BUDGET) {
+        auto impl = get_impl();
+        auto used = impl->used_bytes();
+        // Start at the high watermark, but once started keep going down to the low watermark
+        auto watermark = evicted == 0 ? EVICTION_HIGH_WATERMARK : EVICTION_LOW_WATERMARK;
+        if (used < watermark * SIZE_LIMIT)
+            break;
+        auto chunk = evict(*impl, EVICTION_CHUNK_SIZE);
+        if (chunk == 0)
+            break;
+        evicted += chunk;
+    }
+    if (evicted > 0)
+        log::warning(
+                logcat,
+                "Database is nearly full: evicted {} messages closest to expiry",
+                evicted);
+    return evicted;
+}
+
+void Database::set_eviction_priority(namespace_id ns, int priority) {
+    for (auto& shard : shards_)
+        shard->set_eviction_priority(ns, priority);
+    std::lock_guard lock{eviction_mutex_};
+    eviction_priorities_[ns] = priority;
+}
+
+int64_t Database::evicted_messages() const {
+    int64_t total = evicted_messages_;
+    for (auto& shard : shards_)
+        total += shard->evicted_messages();
+    return total;
+}
+
+int64_t Database::evicted_bytes() const {
+    int64_t total = evicted_bytes_;
+    for (auto& shard : shards_)
+        total += shard->evicted_bytes();
+    return total;
+}
+
+// The counts here come from the tables maintained by the messages_count_*/owners_count_* triggers
+// (and recomputed by reconcile_counts() after an upgrade that adds them) rather than scanning the
+// messages table.
+
+void Database::rebuild_hash_filter(bool force) {
+    if (!shards_.empty())
+        return for_each_shard([force](Database& shard) { shard.rebuild_hash_filter(force); });
+
+    auto now = std::chrono::steady_clock::now();
+    if (!force && !hash_filter_->needs_rebuild() &&
+        now - hash_filter_built_ < HASH_FILTER_REBUILD_PERIOD)
+        return;
+
+    // Leave room to grow so that we don't immediately need another rebuild
+    auto capacity = std::max<uint64_t>(2 * get_message_count(), HASH_FILTER_MIN_CAPACITY);
+    if (!hash_filter_->begin_rebuild(capacity))
+        return;
+
+    uint64_t count = 0;
+    try {
+        auto impl = get_reader();
+        auto st = impl->prepared_st("SELECT hash_text(hash) FROM messages");
+        while (st->executeStep()) {
+            auto col = st->getColumn(0);
+            hash_filter_->add_rebuilt(
+                    {static_cast<const char*>(col.getText()), static_cast<size_t>(col.getBytes())});
+            count++;
+        }
+    } catch (const std::exception& e) {
+        log::error(logcat, "Failed to rebuild message hash filter: {}", e.what());
+        hash_filter_->abort_rebuild();
+        return;
+    }
+    hash_filter_->finish_rebuild(count);
+    hash_filter_built_ = now;
+    log::debug(
+            logcat,
+            "Rebuilt message hash filter with {} hashes (capacity {}) in {}",
+            count,
+            capacity,
+            util::short_duration(std::chrono::steady_clock::now() - now));
+}
+
+bool Database::migrate_hashes() {
+    if (!shards_.empty()) {
+        auto done = for_each_shard([](Database& shard) { return shard.migrate_hashes(); });
+        legacy_hashes_ = std::find(done.begin(), done.end(), false) != done.end();
+        return !legacy_hashes_;
+    }
+
+    if (!legacy_hashes_)
+        return true;
+
+    auto started = std::chrono::steady_clock::now();
+    int64_t converted = 0;
+    while (std::chrono::steady_clock::now() - started < HASH_MIGRATION_TIME_BUDGET) {
+        auto impl = get_impl();
+        SQLite::Transaction t{impl->db};
+        auto from = impl->prepared_get<int64_t>(
+                "SELECT value FROM counters WHERE name = 'hash_migration_id'");
+        auto max_id = impl->prepared_get<int64_t>("SELECT COALESCE(MAX(id), 0) FROM messages");
+        if (from >= max_id) {
+            // Everything inserted since the migration started already has a binary hash
+            impl->prepared_exec("DELETE FROM counters WHERE name = 'hash_migration_id'");
+            t.commit();
+            legacy_hashes_ = false;
+            log::info(logcat, "Message hash conversion complete");
+            return true;
+        }
+        auto to = std::min(from + HASH_MIGRATION_CHUNK_SIZE, max_id);
+
+        converted += impl->prepared_exec(
+                "UPDATE OR IGNORE messages SET hash = hash_blob(hash)"
+                " WHERE id > ? AND id <= ? AND typeof(hash) = 'text'"
+                " AND hash_blob(hash) IS NOT hash",
+                from,
+                to);
+        // Anything left that we couldn't convert (because of the OR IGNORE) is a duplicate of a
+        // message that was stored again (in binary form) since the migration started.
+        impl->prepared_exec(
+                "DELETE FROM messages WHERE id > ? AND id <= ? AND typeof(hash) = 'text'"
+                " AND hash_blob(hash) IS NOT hash",
+                from,
+                to);
+        impl->prepared_exec(
+                "UPDATE counters SET value = ? WHERE name = 'hash_migration_id'", to);
+        t.commit();
+    }
+    log::debug(logcat, "Converted {} message hashes to binary", converted);
+    return false;
+}
+
+int Database::reconcile_owner_counts() {
+    if (!shards_.empty()) {
+        auto fixed = for_each_shard([](Database& shard) { return shard.reconcile_owner_counts(); });
+        return std::accumulate(fixed.begin(), fixed.end(), 0);
+    }
+
+    auto impl = get_impl();
+    SQLite::Transaction t{impl->db};
+    auto from = impl->prepared_get<int64_t>(
+            "SELECT COALESCE((SELECT value FROM counters WHERE name = 'count_reconcile_owner'),"
+            " 0)");
+    auto max_id = impl->prepared_get<int64_t>("SELECT COALESCE(MAX(id), 0) FROM owners");
+    if (from >= max_id)
+        from = 0;  // Wrap around and start over from the first owner
+    auto to = std::min(from + RECONCILE_CHUNK_SIZE, max_id);
+
+    int fixed = impl->prepared_exec(
+            "UPDATE owners SET message_count = c.count, message_bytes = c.bytes"
+            " FROM (SELECT owner, COUNT(*) AS count, SUM(length(data)) AS bytes"
+            " FROM messages WHERE owner > ? AND owner <= ? GROUP BY owner) AS c"
+            " WHERE owners.id = c.owner"
+            " AND (owners.message_count != c.count OR owners.message_bytes != c.bytes)",
+            from,
+            to);
+    fixed += impl->prepared_exec(
+            "UPDATE owners SET message_count = 0, message_bytes = 0"
+            " WHERE id > ? AND id <= ? AND (message_count != 0 OR message_bytes != 0)"
+            " AND NOT EXISTS (SELECT * FROM messages WHERE owner = owners.id)",
+            from,
+            to);
+    impl->prepared_exec(
+            "INSERT INTO counters (name, value) VALUES ('count_reconcile_owner', ?)"
+            " ON CONFLICT(name) DO UPDATE SET value = excluded.value",
+            to);
+    t.commit();
+
+    if (fixed > 0)
+        log::warning(logcat, "Corrected stored message counts of {} owners", fixed);
+    return fixed;
+}
+
+int64_t Database::get_message_count() {
+    int64_t count = memory_ ? memory_->message_count() : 0;
+    if (!shards_.empty()) {
+        auto counts = for_each_shard([](Database& shard) { return shard.get_message_count(); });
+        return std::accumulate(counts.begin(), counts.end(), count);
+    }
+
+    return count + get_reader()->prepared_get<int64_t>(
+                           "SELECT COALESCE(SUM(count), 0) FROM namespace_counts");
+}
+
+int64_t Database::get_owner_count() {
+    int64_t count = memory_ ? memory_->owner_count() : 0;
+    if (!shards_.empty()) {
+        auto counts = for_each_shard([](Database& shard) { return shard.get_owner_count(); });
+        return std::accumulate(counts.begin(), counts.end(), count);
+    }
+
+    return count +
+           get_reader()->prepared_get<int64_t>(
+                   "SELECT COALESCE((SELECT value FROM counters WHERE name = 'owners'), 0)");
+}
+
+std::vector<int> Database::get_message_counts() {
+    std::vector<int> counts;
+    if (memory_)
+        counts = memory_->message_counts();
+    if (!shards_.empty()) {
+        for (auto& c : for_each_shard([](Database& shard) { return shard.get_message_counts(); }))
+            counts.insert(counts.end(), c.begin(), c.end());
+        return counts;
+    }
+
+    auto impl = get_reader();
+    auto st = impl->prepared_st("SELECT message_count FROM owners WHERE message_count > 0");
+    auto disk = get_all<int>(st);
+    if (counts.empty())
+        return disk;
+    counts.insert(counts.end(), disk.begin(), disk.end());
+    return counts;
+}
+
+std::vector<std::pair<namespace_id, int64_t>> Database::get_namespace_counts() {
+    std::map<namespace_id, int64_t> counts;
+    if (memory_)
+        counts = memory_->namespace_counts();
+    if (!shards_.empty()) {
+        for (auto& c : for_each_shard([](Database& shard) { return shard.get_namespace_counts(); }))
+            for (auto& [ns, count] : c)
+                counts[ns] += count;
+        return {counts.begin(), counts.end()};
+    }
+
+    auto impl = get_reader();
+    auto st = impl->prepared_st(
+            "SELECT namespace, count FROM namespace_counts WHERE count > 0 ORDER BY namespace");
+    auto disk = get_all<namespace_id, int64_t>(st);
+    if (counts.empty())
+        return disk;
+    for (auto& [ns, count] : disk)
+        counts[ns] += count;
+    return {counts.begin(), counts.end()};
+}
+
+int64_t Database::get_total_bytes() {
+    if (!shards_.empty()) {
+        auto counts = for_each_shard([](Database& shard) { return shard.get_total_bytes(); });
+        return std::accumulate(counts.begin(), counts.end(), int64_t{0});
+    }
+
+    auto impl = get_reader();
+    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+}
+
+Database::pool_usage Database::get_pool_usage() const {
+    pool_usage usage{writers_.open, writers_.busy, readers_.open, readers_.busy};
+    for (auto& shard : shards_) {
+        auto u = shard->get_pool_usage();
+        usage.writers_open += u.writers_open;
+        usage.writers_busy += u.writers_busy;
+        usage.readers_open += u.readers_open;
+        usage.readers_busy += u.readers_busy;
+    }
+    return usage;
+}
+
+Database::memory_usage Database::get_memory_usage() {
+    memory_usage usage;
+    if (shards_.empty()) {
+        // We can only look at the connections that aren't in use (the others are being used
+        // without locking by whoever has them), which we do by taking them all out of the pools
+        // while holding the lock, and putting them back afterwards in the same order.
+        std::lock_guard lock{impl_lock_};
+        for (auto* pool : {&writers_, &readers_}) {
+            std::vector<std::unique_ptr<DatabaseImpl>> idle;
+            for (; !pool->idle.empty(); pool->idle.pop())
+                idle.push_back(std::move(pool->idle.top()));
+            for (auto& impl : idle) {
+                auto* db = impl->db.getHandle();
+                int cur, high;
+                if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cur, &high, 0) == SQLITE_OK)
+                    usage.page_cache += cur;
+                if (sqlite3_db_status(db, SQLITE_DBSTATUS_STMT_USED, &cur, &high, 0) == SQLITE_OK)
+                    usage.statements += cur;
+                if (sqlite3_db_status(db, SQLITE_DBSTATUS_SCHEMA_USED, &cur, &high, 0) ==
+                    SQLITE_OK)
+                    usage.schema += cur;
+                usage.prepared_statements += impl->prepared_sts.size();
+                usage.connections_checked++;
+            }
+            for (auto it = idle.rbegin(); it != idle.rend(); ++it)
+                pool->idle.push(std::move(*it));
+        }
+        usage.owner_cache = owner_cache_->memory_usage();
+    } else {
+        for (auto& shard : shards_) {
+            auto u = shard->get_memory_usage();
+            usage.connections_checked += u.connections_checked;
+            usage.prepared_statements += u.prepared_statements;
+            usage.page_cache += u.page_cache;
+            usage.statements += u.statements;
+            usage.schema += u.schema;
+            usage.owner_cache += u.owner_cache;
+        }
+    }
+
+    sqlite3_int64 cur, high;
+    if (sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &high, 0) == SQLITE_OK) {
+        usage.sqlite_used = cur;
+        usage.sqlite_highwater = high;
+    }
+    usage.memory_tier = memory_tier_bytes();
+    return usage;
+}
+
+int64_t Database::get_used_bytes() {
+    if (!shards_.empty()) {
+        auto counts = for_each_shard([](Database& shard) { return shard.get_used_bytes(); });
+        return std::accumulate(counts.begin(), counts.end(), int64_t{0});
+    }
+
+    return get_reader()->used_bytes();
+}
+
+static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
+    std::optional<message> msg;
+    while (st.executeStep()) {
+        assert(!msg);
+        auto [hash, otype, opubkey, ns, ts, exp, data] =
+                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t, std::string>(
+                        st);
+        msg.emplace(
+                impl.load_pubkey(otype, std::move(opubkey)),
+                std::move(hash),
+                ns,
+                from_epoch_ms(ts),
+                from_epoch_ms(exp),
+                std::move(data));
+    }
+    return msg;
+}
+
+std::optional<message> Database::retrieve_random() {
+    // Pick the memory tier with probability proportional to its share of the messages
+    if (auto count = memory_ ? memory_->message_count() : 0; count > 0) {
+        auto total = static_cast<uint64_t>(get_message_count());
+        if (util::uniform_distribution_portable(util::rng(), total) < static_cast<uint64_t>(count))
+            if (auto msg = memory_->retrieve_random())
+                return msg;
+    }
+
+    if (!shards_.empty()) {
+        // Pick a shard with probability proportional to its message count, so that the selection
+        // is (approximately) uniform across all messages.  If that shard comes up empty (e.g. if
+        // everything in it just expired) we fall back to trying the others.
+        auto counts = for_each_shard([](Database& shard) { return shard.get_message_count(); });
+        auto total = std::accumulate(counts.begin(), counts.end(), int64_t{0});
+        size_t first = 0;
+        if (total > 0) {
+            auto pick = static_cast<int64_t>(
+                    util::uniform_distribution_portable(util::rng(), static_cast<uint64_t>(total)));
+            while (first < counts.size() - 1 && pick >= counts[first])
+                pick -= counts[first++];
+        }
+        for (size_t i = 0; i < shards_.size(); i++)
+            if (auto msg = shards_[(first + i) % shards_.size()]->retrieve_random())
+                return msg;
+        return std::nullopt;
+    }
+
+    auto impl = get_reader();
+
+    // Selecting via `ORDER BY RANDOM()` requires a full table scan, so instead we probe random ids
+    // within the [min, max] id range (each of which is a primary key lookup).  An exact hit gives
+    // us a uniformly selected live message; if we keep landing in gaps (from deleted or expired
+    // messages) we fall back to taking the first live message at or after a random id.
+    auto min_id = exec_and_maybe_get<int64_t>(
+            impl->prepared_st("SELECT id FROM messages ORDER BY id LIMIT 1"));
+    auto max_id = exec_and_maybe_get<int64_t>(
+            impl->prepared_st("SELECT id FROM messages ORDER BY id DESC LIMIT 1"));
+    if (!min_id || !max_id)
+        return std::nullopt;
+
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+    auto& rng = util::rng();
+    auto random_id = [&] {
+        return *min_id + static_cast<int64_t>(util::uniform_distribution_portable(
+                                 rng, static_cast<uint64_t>(*max_id - *min_id) + 1));
+    };
+
+    for (int i = 0; i < RANDOM_PROBE_ATTEMPTS; i++) {
+        auto st = impl->prepared_st(
+                "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data"
+                " FROM owned_messages WHERE mid = ? AND expiry > ?");
+        st->bind(1, random_id());
+        st->bind(2, now);
+        if (auto msg = get_message(*impl, st))
+            return msg;
+    }
+
+    auto start = random_id();
+    {
+        auto st = impl->prepared_st(
+                "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data"
+                " FROM owned_messages WHERE mid >= ? AND expiry > ? ORDER BY mid LIMIT 1");
+        st->bind(1, start);
+        st->bind(2, now);
+        if (auto msg = get_message(*impl, st))
+            return msg;
+    }
+    // Wrap around to the beginning
+    auto st = impl->prepared_st(
+            "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data"
+            " FROM owned_messages WHERE mid < ? AND expiry > ? ORDER BY mid LIMIT 1");
+    st->bind(1, start);
+    st->bind(2, now);
+    return get_message(*impl, st);
+}
+
+std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
+    if (memory_)
+        if (auto msg = memory_->retrieve_by_hash(msg_hash))
+            return msg;
+
+    if (!shards_.empty()) {
+        // Each shard's hash filter makes the shards that don't have it cheap to check
+        for (auto& shard : shards_)
+            if (auto msg = shard->retrieve_by_hash(msg_hash))
+                return msg;
+        return std::nullopt;
+    }
+
+    if (!hash_filter_->maybe_contains(msg_hash))
+        return std::nullopt;
+    auto impl = get_reader();
+    auto st = impl->prepared_st(
+            "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data"
+            " FROM owned_messages WHERE " +
+            impl->hash_in(1));
+    st->bindNoCopy(1, msg_hash);
+    return get_message(*impl, st);
+}
+
+StoreResult Database::store(const message& msg, std::chrono::system_clock::time_point* expiry) {
+    if (in_memory(msg.msg_namespace))
+        return memory_->store(msg, expiry);
+    if (!shards_.empty())
+        return shard_for(msg.pubkey).store(msg, expiry);
+
+    auto impl = get_impl();
+
+    for (bool evicted = false;; evicted = true) {
+        try {
+            SQLite::Transaction transaction{impl->db};
+            auto ret = impl->store(msg, expiry);
+            transaction.commit();
+            hash_filter_->add_committed(msg.hash);
+            return ret;
+        } catch (const SQLite::Exception& e) {
+            if (e.getErrorCode() != SQLITE_FULL) {
+                log::critical(logcat, "Failed to store message: {}", e.getErrorStr());
+                throw;
+            }
+        }
+        // The database is full: make some room and try once more
+        if (evicted || evict(*impl, EVICTION_CHUNK_SIZE) == 0)
+            break;
+    }
+    if (db_full_counter++ % DB_FULL_FREQUENCY == 0)
+        log::error(logcat, "Failed to store message: database is full");
+    return StoreResult::Full;
+}
+
+std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> Database::store_batch(
+        const std::vector<message>& msgs) {
+    if (memory_ && std::any_of(msgs.begin(), msgs.end(), [this](const message& m) {
+            return in_memory(m.msg_namespace);
+        })) {
+        // Store the memory tier's messages directly, and the rest as a (smaller) batch
+        std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> results(
+                msgs.size());
+        std::vector<size_t> indices;
+        std::vector<message> disk_msgs;
+        for (size_t i = 0; i < msgs.size(); i++) {
+            if (in_memory(msgs[i].msg_namespace)) {
+                results[i].first = memory_->store(msgs[i], &results[i].second);
+            } else {
+                indices.push_back(i);
+                disk_msgs.push_back(msgs[i]);
+            }
+        }
+        auto disk_results = store_batch(disk_msgs);
+        for (size_t j = 0; j < indices.size(); j++)
+            results[indices[j]] = disk_results[j];
+        return results;
+    }
+
+    if (!shards_.empty()) {
+        auto groups = group_by_shard(msgs);
+        std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> results(
+                msgs.size());
+        auto shard_results = for_each_shard([&groups](Database& shard, size_t s) {
+            return shard.store_batch(groups[s].second);
+        });
+        for (size_t s = 0; s < shards_.size(); s++) {
+            auto& indices = groups[s].first;
+            for (size_t j = 0; j < indices.size(); j++)
+                results[indices[j]] = shard_results[s][j];
+        }
+        return results;
+    }
+
+    std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> results;
+    if (msgs.empty())
+        return results;
+    results.resize(msgs.size());
+
+    auto impl = get_impl();
+
+    for (bool evicted = false;; evicted = true) {
+        try {
+            SQLite::Transaction transaction{impl->db};
+            for (size_t i = 0; i < msgs.size(); i++)
+                results[i].first = impl->store(msgs[i], &results[i].second);
+            transaction.commit();
+            for (auto& msg : msgs)
+                hash_filter_->add_committed(msg.hash);
+            return results;
+        } catch (const SQLite::Exception& e) {
+            if (e.getErrorCode() != SQLITE_FULL) {
+                log::critical(
+                        logcat,
+                        "Failed to store batch of {} messages: {}",
+                        msgs.size(),
+                        e.getErrorStr());
+                throw;
+            }
+        }
+        // The database is full: make some room (at least as many messages as we are trying to
+        // store) and try once more
+        if (evicted ||
+            evict(*impl, std::max<int64_t>(EVICTION_CHUNK_SIZE, msgs.size())) == 0)
+            break;
+    }
+
+    // Even after making room the batch doesn't fit as a whole (and the failed transaction stored
+    // none of it), so store what does fit one message at a time: only the messages that don't fit
+    // get StoreResult::Full.
+    size_t full = 0;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        try {
+            SQLite::Transaction transaction{impl->db};
+            results[i].first = impl->store(msgs[i], &results[i].second);
+            transaction.commit();
+            hash_filter_->add_committed(msgs[i].hash);
+        } catch (const SQLite::Exception& e) {
+            if (e.getErrorCode() != SQLITE_FULL) {
+                log::critical(logcat, "Failed to store message: {}", e.getErrorStr());
+                throw;
+            }
+            results[i].first = StoreResult::Full;
+            full++;
+        }
+    }
+    if (full > 0 && db_full_counter++ % DB_FULL_FREQUENCY == 0)
+        log::error(
+                logcat,
+                "Failed to store {} of a batch of {} messages: database is full",
+                full,
+                msgs.size());
+    return results;
+}
+
+std::vector<std::optional<StoreResult>> Database::bulk_store(const std::vector<message>& items) {
+    if (memory_ && std::any_of(items.begin(), items.end(), [this](const message& m) {
+            return m.pubkey && in_memory(m.msg_namespace);
+        })) {
+        std::vector<std::optional<StoreResult>> results(items.size());
+        std::vector<size_t> indices;
+        std::vector<message> disk_items;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (items[i].pubkey && in_memory(items[i].msg_namespace)) {
+                auto res = memory_->store(items[i], nullptr, /*extend=*/false);
+                if (res != StoreResult::Full)
+                    results[i] = res;
+            } else {
+                indices.push_back(i);
+                disk_items.push_back(items[i]);
+            }
+        }
+        auto disk_results = bulk_store(disk_items);
+        for (size_t j = 0; j < indices.size(); j++)
+            results[indices[j]] = disk_results[j];
+        return results;
+    }
+
+    if (!shards_.empty()) {
+        auto groups = group_by_shard(items);
+        std::vector<std::optional<StoreResult>> results(items.size());
+        auto shard_results = for_each_shard([&groups](Database& shard, size_t s) {
+            return shard.bulk_store(groups[s].second);
+        });
+        for (size_t s = 0; s < shards_.size(); s++) {
+            auto& indices = groups[s].first;
+            for (size_t j = 0; j < indices.size(); j++)
+                results[indices[j]] = shard_results[s][j];
+        }
+        return results;
+    }
+
+    std::vector<std::optional<StoreResult>> results(items.size());
+
+    auto impl = get_impl();
+    SQLite::Transaction t{impl->db};
+    auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
+    auto insert_owner = impl->prepared_st(
+            "INSERT INTO owners (pubkey, type, swarm_space) VALUES (?, ?, ?)"
+            " ON CONFLICT DO NOTHING RETURNING id");
+    std::unordered_map<user_pubkey, int64_t> seen;
+    for (auto& m : items) {
+        if (!m.pubkey)
+            continue;
         if (auto [it, ins] = seen.emplace(m.pubkey, 0); ins) {
             auto ownerid = exec_and_maybe_get<int64_t>(get_owner, m.pubkey);
             get_owner->reset();
             if (!ownerid) {
-                ownerid = exec_and_maybe_get<int64_t>(insert_owner, m.pubkey);
+                ownerid = exec_and_maybe_get<int64_t>(
+                        insert_owner, m.pubkey, swarm_space_key(m.pubkey.swarm_space()));
                 insert_owner->reset();
             }
             if (ownerid)
@@ -744,33 +2870,90 @@ void Database::bulk_store(const std::vector<message>& items) {
         }
     }
 
-    auto insert_message = impl->prepared_st(
-            "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
-            " VALUES (?, ?, ?, ?, ?, ?)"
-            " ON CONFLICT DO NOTHING");
+    // The ON CONFLICT below can't see a not-yet-converted text copy of the hash, so while those
+    // might exist we have to check for them explicitly.
+    const bool legacy = legacy_hashes_;
+    const auto exists_query = "SELECT COUNT(*) FROM messages WHERE " + impl->hash_in(1);
+
+    // Indices of the messages that we actually attempt to insert
+    std::vector<size_t> pending;
+    pending.reserve(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+        auto& m = items[i];
+        if (!m.pubkey || !seen.count(m.pubkey))
+            continue;
 
-    for (auto& m : items) {
-        if (!m.pubkey)
+        // Inserted messages get updated to New below
+        results[i] = StoreResult::Exists;
+
+        if (legacy && hash_filter_->maybe_contains(m.hash) &&
+            exec_and_get<int64_t>(impl->prepared_st(exists_query), m.hash) > 0)
             continue;
-        auto owner_it = seen.find(m.pubkey);
-        if (owner_it == seen.end())
+
+        hash_filter_->add(m.hash);
+        pending.push_back(i);
+    }
+
+    // Messages are inserted BULK_INSERT_ROWS at a time using a multi-row INSERT; whatever is left
+    // over goes through progressively smaller statements so that we only ever prepare a handful
+    // of different statements.  RETURNING gives us the hashes that were actually inserted (i.e.
+    // not ignored as duplicates), which we map back to their message index.
+    std::unordered_map<std::string_view, size_t> chunk_indices;
+    size_t pos = 0;
+    for (size_t rows : {BULK_INSERT_ROWS, size_t{25}, size_t{1}}) {
+        if (pending.size() - pos < rows)
             continue;
 
-        exec_query(
-                insert_message,
-                owner_it->second,
-                m.hash,
-                m.msg_namespace,
-                to_epoch_ms(m.timestamp),
-                to_epoch_ms(m.expiry),
-                blob_binder{m.data});
-        insert_message->reset();
+        // The parameters are numbered so that each row's expiry can also give its bucket
+        std::string query =
+                "INSERT INTO messages"
+                " (owner, hash, namespace, timestamp, expiry, data, expiry_bucket) VALUES ";
+        for (size_t r = 0; r < rows; r++)
+            fmt::format_to(
+                    std::back_inserter(query),
+                    "{0}(?{1}, hash_blob(?{2}), ?{3}, ?{4}, ?{5}, ?{6}, ?{5} / {7})",
+                    r == 0 ? "" : ", ",
+                    6 * r + 1,
+                    6 * r + 2,
+                    6 * r + 3,
+                    6 * r + 4,
+                    6 * r + 5,
+                    6 * r + 6,
+                    EXPIRY_BUCKET_MS);
+        query += " ON CONFLICT DO NOTHING RETURNING hash_text(hash)";
+        auto st = impl->prepared_st(query);
+
+        for (; pending.size() - pos >= rows; pos += rows) {
+            chunk_indices.clear();
+            int bind_pos = 1;
+            for (size_t r = 0; r < rows; r++) {
+                size_t i = pending[pos + r];
+                auto& m = items[i];
+                chunk_indices.emplace(m.hash, i);
+                bind_oneshot(*st, bind_pos, seen[m.pubkey]);
+                bind_oneshot(*st, bind_pos, m.hash);
+                bind_oneshot(*st, bind_pos, m.msg_namespace);
+                bind_oneshot(*st, bind_pos, to_epoch_ms(m.timestamp));
+                bind_oneshot(*st, bind_pos, to_epoch_ms(m.expiry));
+                bind_oneshot(*st, bind_pos, blob_binder{m.data});
+            }
+            while (st->executeStep()) {
+                if (auto it = chunk_indices.find(st->getColumn(0).getString());
+                    it != chunk_indices.end())
+                    results[it->second] = StoreResult::New;
+            }
+            st->reset();
+        }
     }
 
     t.commit();
+    for (auto i : pending)
+        hash_filter_->add_committed(items[i].hash);
+
+    return results;
 }
 
-std::pair<std::vector<message>, bool> Database::retrieve(
+std::pair<MessageList, bool> Database::retrieve(
         const user_pubkey& pubkey,
         namespace_id ns,
         const std::string& last_hash,
@@ -778,69 +2961,102 @@ std::pair<std::vector<message>, bool> Database::retrieve(
         std::optional<size_t> max_size,
         const bool size_b64,
         const size_t per_message_overhead) {
+    if (in_memory(ns))
+        return memory_->retrieve(
+                pubkey, ns, last_hash, max_results, max_size, size_b64, per_message_overhead);
+    if (!shards_.empty())
+        return shard_for(pubkey).retrieve(
+                pubkey, ns, last_hash, max_results, max_size, size_b64, per_message_overhead);
 
-    auto impl = get_impl();
-    auto owner_st = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
+
+    auto impl = get_reader();
+    auto ownerid = impl->owner_id(pubkey);
     if (!ownerid)
         return {};
 
-    if (max_results && *max_results < 1)
-        max_results = 1;
-
-    std::optional<int64_t> last_id;
-    if (!last_hash.empty()) {
-        auto st = impl->prepared_st(
-                "SELECT id FROM messages WHERE owner = ? AND namespace = ? AND hash = ?");
-        last_id = exec_and_maybe_get<int64_t>(st, *ownerid, to_int(ns), last_hash);
-    }
+    return impl->retrieve(
+            *ownerid, ns, last_hash, max_results, max_size, size_b64, per_message_overhead);
+}
 
-    auto st = impl->prepared_st(
-            last_id ? "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? AND id > ? ORDER BY id LIMIT ?"
-                    : "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? ORDER BY id LIMIT ?");
-    int pos = 1;
-    st->bind(pos++, *ownerid);
-    st->bind(pos++, to_int(ns));
-    if (last_id)
-        st->bind(pos++, *last_id);
-    st->bind(pos++, max_results ? static_cast<int>(*max_results) + 1 : -1);
-
-    std::pair<std::vector<message>, bool> result{};
-    auto& [results, more] = result;
-
-    size_t agg_size = 0;
-    while (st->executeStep()) {
-        auto [hash, ns, ts, exp, data] =
-                get<std::string, namespace_id, int64_t, int64_t, std::string>(st);
-        if (max_results && results.size() >= *max_results) {
-            more = true;
-            break;
-        }
-        if (max_size) {
-            agg_size += per_message_overhead;
-            agg_size += hash.size();
-            agg_size += size_b64 ? data.size() * 4 / 3 : data.size();
-            if (!results.empty() && agg_size > *max_size) {
-                more = true;
-                break;
+std::vector<std::pair<MessageList, bool>> Database::retrieve_multi(
+        const user_pubkey& pubkey,
+        const std::vector<retrieve_params>& params,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    if (memory_ && std::any_of(params.begin(), params.end(), [this](const retrieve_params& p) {
+            return in_memory(p.ns);
+        })) {
+        std::vector<std::pair<MessageList, bool>> results(params.size());
+        std::vector<size_t> indices;
+        std::vector<retrieve_params> disk_params;
+        for (size_t i = 0; i < params.size(); i++) {
+            auto& p = params[i];
+            if (in_memory(p.ns)) {
+                results[i] = memory_->retrieve(
+                        pubkey,
+                        p.ns,
+                        p.last_hash,
+                        p.num_results,
+                        p.max_size,
+                        size_b64,
+                        per_message_overhead);
+            } else {
+                indices.push_back(i);
+                disk_params.push_back(p);
             }
         }
-
-        results.emplace_back(
-                std::move(hash), ns, from_epoch_ms(ts), from_epoch_ms(exp), std::move(data));
+        if (!disk_params.empty()) {
+            auto disk_results =
+                    retrieve_multi(pubkey, disk_params, size_b64, per_message_overhead);
+            for (size_t j = 0; j < indices.size(); j++)
+                results[indices[j]] = std::move(disk_results[j]);
+        }
+        return results;
     }
 
-    return result;
+    if (!shards_.empty())
+        return shard_for(pubkey).retrieve_multi(pubkey, params, size_b64, per_message_overhead);
+
+    std::vector<std::pair<MessageList, bool>> results(params.size());
+    if (params.empty())
+        return results;
+
+    auto impl = get_reader();
+    auto ownerid = impl->owner_id(pubkey);
+    if (!ownerid)
+        return results;
+
+    for (size_t i = 0; i < params.size(); i++) {
+        auto& p = params[i];
+        results[i] = impl->retrieve(
+                *ownerid,
+                p.ns,
+                p.last_hash,
+                p.num_results,
+                p.max_size,
+                size_b64,
+                per_message_overhead);
+    }
+    return results;
 }
 
 std::vector<message> Database::retrieve_all() {
-    auto impl = get_impl();
-
     std::vector<message> results;
+    if (memory_)
+        results = memory_->messages();
+    if (!shards_.empty()) {
+        for (auto& r : for_each_shard([](Database& shard) { return shard.retrieve_all(); }))
+            results.insert(
+                    results.end(),
+                    std::make_move_iterator(r.begin()),
+                    std::make_move_iterator(r.end()));
+        return results;
+    }
+
+    auto impl = get_reader();
+
     auto st = impl->prepared_st(
-            "SELECT type, pubkey, hash, namespace, timestamp, expiry, data"
+            "SELECT type, pubkey, hash_text(hash), namespace, timestamp, expiry, data"
             " FROM owned_messages ORDER BY mid");
 
     while (st->executeStep()) {
@@ -859,24 +3075,291 @@ std::vector<message> Database::retrieve_all() {
     return results;
 }
 
+// Steps through `owners` (which must select id, type, pubkey of owners rows), visiting the
+// unexpired messages of each owner.  Returns false if the visitor requested that we stop.
+static bool visit_owner_messages(
+        DatabaseImpl& impl,
+        SQLite::Statement& owners,
+        const std::function<bool(const user_pubkey& owner)>& owner_filter,
+        const std::function<bool(message&& msg)>& visit) {
+    auto msgs = impl.prepared_st(
+            "SELECT hash_text(hash), namespace, timestamp, expiry, data FROM messages"
+            " WHERE owner = ? AND expiry > ? ORDER BY id");
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+
+    while (owners.executeStep()) {
+        auto [id, type, pk] = get<int64_t, uint8_t, std::string>(owners);
+        auto pubkey = impl.load_pubkey(type, std::move(pk));
+        if (owner_filter && !owner_filter(pubkey))
+            continue;
+
+        msgs->bind(1, id);
+        msgs->bind(2, now);
+        while (msgs->executeStep()) {
+            auto [hash, ns, ts, exp, data] =
+                    get<std::string, namespace_id, int64_t, int64_t, std::string>(msgs);
+            if (!visit(message{
+                        pubkey,
+                        std::move(hash),
+                        ns,
+                        from_epoch_ms(ts),
+                        from_epoch_ms(exp),
+                        std::move(data)}))
+                return false;
+        }
+        msgs->reset();
+    }
+    return true;
+}
+
+void Database::for_each_message(
+        const std::function<bool(const user_pubkey& owner)>& owner_filter,
+        const std::function<bool(message&& msg)>& visit) {
+    if (memory_)
+        for (auto& msg : memory_->messages(owner_filter))
+            if (!visit(std::move(msg)))
+                return;
+
+    if (!shards_.empty()) {
+        // The callbacks aren't required to be thread-safe, so we go through the shards in turn
+        bool stopped = false;
+        auto wrapped = [&](message&& msg) { return !(stopped = !visit(std::move(msg))); };
+        for (auto& shard : shards_) {
+            shard->for_each_message(owner_filter, wrapped);
+            if (stopped)
+                break;
+        }
+        return;
+    }
+
+    auto impl = get_reader();
+    auto owners = impl->prepared_st("SELECT id, type, pubkey FROM owners");
+    visit_owner_messages(*impl, owners, owner_filter, visit);
+}
+
+void Database::for_each_message_in_range(
+        uint64_t space_begin, uint64_t space_end, const std::function<bool(message&& msg)>& visit) {
+    if (memory_) {
+        auto in_range = [space_begin, space_end](const user_pubkey& pk) {
+            auto space = pk.swarm_space();
+            return space_begin <= space_end ? space >= space_begin && space <= space_end
+                                            : space >= space_begin || space <= space_end;
+        };
+        for (auto& msg : memory_->messages(in_range))
+            if (!visit(std::move(msg)))
+                return;
+    }
+
+    if (!shards_.empty()) {
+        bool stopped = false;
+        auto wrapped = [&](message&& msg) { return !(stopped = !visit(std::move(msg))); };
+        for (auto& shard : shards_) {
+            shard->for_each_message_in_range(space_begin, space_end, wrapped);
+            if (stopped)
+                break;
+        }
+        return;
+    }
+
+    auto impl = get_reader();
+
+    auto owners = impl->prepared_st(
+            "SELECT id, type, pubkey FROM owners WHERE swarm_space BETWEEN ? AND ?"
+            " ORDER BY swarm_space");
+    auto visit_range = [&](uint64_t begin, uint64_t end) {
+        owners->bind(1, swarm_space_key(begin));
+        owners->bind(2, swarm_space_key(end));
+        return visit_owner_messages(*impl, owners, nullptr, visit);
+    };
+
+    if (space_begin <= space_end)
+        visit_range(space_begin, space_end);
+    else if (visit_range(space_begin, std::numeric_limits<uint64_t>::max())) {
+        owners->reset();
+        visit_range(0, space_end);
+    }
+}
+
+namespace {
+    // The value XORed into a range_digest for a stored (i.e. raw, when canonical) hash
+    uint64_t digest_value(std::string_view stored_hash) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < 8 && i < stored_hash.size(); i++)
+            v |= uint64_t{static_cast<unsigned char>(stored_hash[i])} << (8 * i);
+        return v;
+    }
+
+    // Same, but for a hash as given to the Database API (i.e. base64)
+    uint64_t digest_value_b64(std::string_view hash) {
+        std::array<unsigned char, HASH_BYTES> raw;
+        if (hash_to_blob(hash, raw))
+            return digest_value({reinterpret_cast<const char*>(raw.data()), raw.size()});
+        return digest_value(hash);
+    }
+
+    bool in_space_range(uint64_t space, uint64_t begin, uint64_t end) {
+        return begin <= end ? space >= begin && space <= end : space >= begin || space <= end;
+    }
+
+    // Calls `f(begin, end)` for the one or two non-wrapping pieces of a swarm space range
+    template <typename F>
+    void for_space_pieces(uint64_t begin, uint64_t end, F&& f) {
+        if (begin <= end) {
+            f(begin, end);
+        } else {
+            f(begin, std::numeric_limits<uint64_t>::max());
+            f(0, end);
+        }
+    }
+}  // namespace
+
+size_t Database::range_bucket(
+        uint64_t space, uint64_t space_begin, uint64_t space_end, size_t buckets) {
+    using u128 = unsigned __int128;
+    u128 span = u128{space_end - space_begin} + 1;  // Can be 2^64, for the entire space
+    return static_cast<size_t>(u128{space - space_begin} * buckets / span);
+}
+
+std::pair<uint64_t, uint64_t> Database::range_bucket_bounds(
+        uint64_t space_begin, uint64_t space_end, size_t buckets, size_t bucket) {
+    // Bucket i holds the offsets o (from space_begin) with floor(o * buckets / span) == i, i.e.
+    // [ceil(i * span / buckets), ceil((i + 1) * span / buckets) - 1].
+    using u128 = unsigned __int128;
+    u128 span = u128{space_end - space_begin} + 1;
+    auto lower = [&](u128 i) { return static_cast<uint64_t>((i * span + buckets - 1) / buckets); };
+    return {space_begin + lower(bucket), space_begin + lower(bucket + 1) - 1};
+}
+
+std::vector<Database::range_digest> Database::range_digests(
+        uint64_t space_begin, uint64_t space_end, size_t buckets) {
+    std::vector<range_digest> digests(buckets);
+    if (buckets == 0)
+        return digests;
+
+    if (memory_)
+        for (auto& msg : memory_->messages([&](const user_pubkey& pk) {
+                 return in_space_range(pk.swarm_space(), space_begin, space_end);
+             })) {
+            auto space = msg.pubkey.swarm_space();
+            auto& d = digests[range_bucket(space, space_begin, space_end, buckets)];
+            d.count++;
+            d.hash_xor ^= digest_value_b64(msg.hash);
+        }
+
+    auto add = [&digests](const std::vector<range_digest>& more) {
+        for (size_t i = 0; i < digests.size(); i++) {
+            digests[i].count += more[i].count;
+            digests[i].hash_xor ^= more[i].hash_xor;
+        }
+    };
+
+    if (!shards_.empty()) {
+        for (auto& shard_digests : for_each_shard([&](Database& shard) {
+                 return shard.range_digests(space_begin, space_end, buckets);
+             }))
+            add(shard_digests);
+        return digests;
+    }
+
+    auto impl = get_reader();
+    auto st = impl->prepared_st(
+            "SELECT o.swarm_space, hash_blob(m.hash)"
+            " FROM owners o JOIN messages m ON m.owner = o.id"
+            " WHERE o.swarm_space BETWEEN ? AND ? AND m.expiry > ?");
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+    for_space_pieces(space_begin, space_end, [&](uint64_t begin, uint64_t end) {
+        st->bind(1, swarm_space_key(begin));
+        st->bind(2, swarm_space_key(end));
+        st->bind(3, now);
+        while (st->executeStep()) {
+            auto [key, hash] = get<int64_t, std::string>(st);
+            auto space = static_cast<uint64_t>(key) ^ (uint64_t{1} << 63);
+            auto& d = digests[range_bucket(space, space_begin, space_end, buckets)];
+            d.count++;
+            d.hash_xor ^= digest_value(hash);
+        }
+        st->reset();
+    });
+    return digests;
+}
+
+std::optional<std::vector<std::string>> Database::range_hashes(
+        uint64_t space_begin, uint64_t space_end, size_t limit) {
+    std::vector<std::string> hashes;
+
+    if (memory_)
+        for (auto& msg : memory_->messages([&](const user_pubkey& pk) {
+                 return in_space_range(pk.swarm_space(), space_begin, space_end);
+             }))
+            hashes.push_back(std::move(msg.hash));
+
+    if (!shards_.empty()) {
+        for (auto& shard_hashes : for_each_shard([&](Database& shard) {
+                 return shard.range_hashes(space_begin, space_end, limit);
+             })) {
+            if (!shard_hashes)
+                return std::nullopt;
+            hashes.insert(hashes.end(), shard_hashes->begin(), shard_hashes->end());
+        }
+    } else {
+        auto impl = get_reader();
+        auto st = impl->prepared_st(
+                "SELECT hash_text(m.hash) FROM owners o JOIN messages m ON m.owner = o.id"
+                " WHERE o.swarm_space BETWEEN ? AND ? AND m.expiry > ? LIMIT ?");
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        for_space_pieces(space_begin, space_end, [&](uint64_t begin, uint64_t end) {
+            st->bind(1, swarm_space_key(begin));
+            st->bind(2, swarm_space_key(end));
+            st->bind(3, now);
+            st->bind(4, static_cast<int64_t>(limit + 1));
+            while (st->executeStep())
+                hashes.push_back(st->getColumn(0).getString());
+            st->reset();
+        });
+    }
+
+    if (hashes.size() > limit)
+        return std::nullopt;
+    std::sort(hashes.begin(), hashes.end());
+    return hashes;
+}
+
 std::vector<std::pair<namespace_id, std::string>> Database::delete_all(const user_pubkey& pubkey) {
+    // For operations spanning namespaces we do the memory tier first and then, if it had anything,
+    // recurse for the rest: the memory tier has nothing left to do on the second go around, so that
+    // call goes straight to the database.
+    if (memory_)
+        if (auto deleted = memory_->delete_all(pubkey); !deleted.empty()) {
+            auto disk = delete_all(pubkey);
+            deleted.insert(deleted.end(), disk.begin(), disk.end());
+            return deleted;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_all(pubkey);
+
     auto impl = get_impl();
 
     auto st = impl->prepared_st(
             "DELETE FROM messages"
             " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
+            " RETURNING namespace, hash_text(hash)");
     return get_all<namespace_id, std::string>(st, pubkey);
 }
 
 std::vector<std::string> Database::delete_all(const user_pubkey& pubkey, namespace_id ns) {
+    if (in_memory(ns))
+        return memory_->delete_all(pubkey, ns);
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_all(pubkey, ns);
+
     auto impl = get_impl();
 
     auto st = impl->prepared_st(
             "DELETE FROM messages"
             " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
             " AND namespace = ?"
-            " RETURNING hash");
+            " RETURNING hash_text(hash)");
     return get_all<std::string>(st, pubkey, ns);
 }
 
@@ -897,6 +3380,22 @@ namespace {
 
 std::vector<std::string> Database::delete_by_hash(
         const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) {
+    if (memory_)
+        if (auto deleted = memory_->delete_by_hash(pubkey, msg_hashes); !deleted.empty()) {
+            std::unordered_set<std::string_view> done{deleted.begin(), deleted.end()};
+            std::vector<std::string> rest;
+            for (auto& hash : msg_hashes)
+                if (!done.count(hash))
+                    rest.push_back(hash);
+            if (!rest.empty()) {
+                auto disk = delete_by_hash(pubkey, rest);
+                deleted.insert(deleted.end(), disk.begin(), disk.end());
+            }
+            return deleted;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_hash(pubkey, msg_hashes);
 
     auto impl = get_impl();
 
@@ -905,35 +3404,38 @@ std::vector<std::string> Database::delete_by_hash(
         auto st = impl->prepared_st(
                 "DELETE FROM messages"
                 " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " AND hash = ?"
-                " RETURNING hash");
+                " AND " +
+                impl->hash_in(3) + " RETURNING hash_text(hash)");
         return get_all<std::string>(st, pubkey, msg_hashes[0]);
     }
 
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "DELETE FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ") RETURNING hash"sv)};
-
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-    return get_all<std::string>(st);
+    auto st = impl->prepared_st(
+            "DELETE FROM messages"
+            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
+            " AND " +
+            impl->hash_in_array(3) + " RETURNING hash_text(hash)");
+    return get_all<std::string>(st, pubkey, json_array(msg_hashes));
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::delete_by_timestamp(
         const user_pubkey& pubkey, std::chrono::system_clock::time_point timestamp) {
+    if (memory_)
+        if (auto deleted = memory_->delete_by_timestamp(pubkey, timestamp); !deleted.empty()) {
+            auto disk = delete_by_timestamp(pubkey, timestamp);
+            deleted.insert(deleted.end(), disk.begin(), disk.end());
+            return deleted;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_timestamp(pubkey, timestamp);
+
     auto impl = get_impl();
 
     auto st = impl->prepared_st(
             "DELETE FROM messages"
             " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
             " AND timestamp <= ?"
-            " RETURNING hash");
+            " RETURNING namespace, hash_text(hash)");
     return get_all<namespace_id, std::string>(st, pubkey, to_epoch_ms(timestamp));
 }
 
@@ -941,13 +3443,18 @@ std::vector<std::string> Database::delete_by_timestamp(
         const user_pubkey& pubkey,
         namespace_id ns,
         std::chrono::system_clock::time_point timestamp) {
+    if (in_memory(ns))
+        return memory_->delete_by_timestamp(pubkey, ns, timestamp);
+    if (!shards_.empty())
+        return shard_for(pubkey).delete_by_timestamp(pubkey, ns, timestamp);
+
     auto impl = get_impl();
 
     auto st = impl->prepared_st(
             "DELETE FROM messages"
             " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
             " AND timestamp <= ? AND namespace = ?"
-            " RETURNING hash");
+            " RETURNING hash_text(hash)");
     return get_all<std::string>(st, pubkey, to_epoch_ms(timestamp), ns);
 }
 
@@ -958,26 +3465,23 @@ static constexpr auto ins_revoke_suffix =
 
 void Database::revoke_subaccounts(
         const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccounts) {
+    if (!shards_.empty())
+        return shard_for(pubkey).revoke_subaccounts(pubkey, subaccounts);
+
     if (subaccounts.empty())
         return;
 
     auto impl = get_impl();
 
-    if (subaccounts.size() == 1) {
-        auto insert_token = impl->prepared_st(fmt::format(
-                "{} VALUES ((SELECT id FROM owners WHERE pubkey = ? AND type = ?), ?) {}",
-                ins_revoke_prefix,
-                ins_revoke_suffix));
-        exec_query(insert_token, pubkey, blob_binder{subaccounts[0].view()});
-        return;
-    }
-
     SQLite::Transaction transaction{impl->db};
 
     auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
     auto ownerid = exec_and_maybe_get<int64_t>(get_owner, pubkey);
-    if (!ownerid)
+    if (!ownerid) {
+        // Commit (of nothing) rather than roll back, which would invalidate revoked_
+        transaction.commit();
         return;
+    }
 
     auto insert_token = impl->prepared_st(
             fmt::format("{} VALUES (?, ?) {}", ins_revoke_prefix, ins_revoke_suffix));
@@ -987,50 +3491,86 @@ void Database::revoke_subaccounts(
         insert_token->reset();
     }
 
+    // Update the in-memory set before committing, while we still hold the database write lock:
+    // that way concurrent changes for the same owner update it in the same order as they commit.
+    // (If the commit fails then the rollback invalidates the set, which then gets reloaded.)
+    revoked_->set(*ownerid, pubkey, impl->revoked_tokens(*ownerid));
     transaction.commit();
+    revoked_->committed();
 }
 
 int Database::unrevoke_subaccounts(
         const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccounts) {
+    if (!shards_.empty())
+        return shard_for(pubkey).unrevoke_subaccounts(pubkey, subaccounts);
+
     if (subaccounts.empty())
         return 0;
 
     auto impl = get_impl();
 
-    if (subaccounts.size() == 1) {
-        auto remove_token = impl->prepared_st(
-                "DELETE FROM revoked_subaccounts"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " AND token = ?");
-        return exec_query(remove_token, pubkey, blob_binder{subaccounts[0].view()});
-    }
+    SQLite::Transaction transaction{impl->db};
 
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "DELETE FROM revoked_subaccounts"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND token IN ("sv,  // ?,?,?,...,?
-                    subaccounts.size(),
-                    ")"sv)};
+    auto ownerid = exec_and_maybe_get<int64_t>(
+            impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"), pubkey);
+    if (!ownerid) {
+        transaction.commit();
+        return 0;
+    }
 
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < subaccounts.size(); i++) {
-        auto sa = subaccounts[i].sview();
-        st.bindNoCopy(3 + i, static_cast<const void*>(sa.data()), sa.size());
+    int removed;
+    if (subaccounts.size() == 1) {
+        removed = impl->prepared_exec(
+                "DELETE FROM revoked_subaccounts WHERE owner = ? AND token = ?",
+                *ownerid,
+                blob_binder{subaccounts[0].view()});
+    } else {
+        SQLite::Statement st{
+                impl->db,
+                multi_in_query(
+                        "DELETE FROM revoked_subaccounts"
+                        " WHERE owner = ? AND token IN ("sv,  // ?,?,?,...,?
+                        subaccounts.size(),
+                        ")"sv)};
+
+        st.bind(1, *ownerid);
+        for (size_t i = 0; i < subaccounts.size(); i++) {
+            auto sa = subaccounts[i].sview();
+            st.bindNoCopy(2 + i, static_cast<const void*>(sa.data()), sa.size());
+        }
+        removed = exec_query(st);
     }
 
-    return exec_query(st);
+    // As in revoke_subaccounts, this has to happen before the commit
+    revoked_->set(*ownerid, pubkey, impl->revoked_tokens(*ownerid));
+    transaction.commit();
+    revoked_->committed();
+    return removed;
 }
 
 bool Database::subaccount_revoked(const user_pubkey& pubkey, const subaccount_token& subaccount) {
-    auto impl = get_impl();
+    if (!shards_.empty())
+        return shard_for(pubkey).subaccount_revoked(pubkey, subaccount);
+
+    if (auto revoked = revoked_->contains(pubkey, subaccount.token))
+        return *revoked;
+
+    // The in-memory set was invalidated by a rollback, so reload it; if something changes while we
+    // are loading then we query this one directly instead.
+    auto impl = get_reader();
+    if (impl->load_revoked())
+        if (auto revoked = revoked_->contains(pubkey, subaccount.token))
+            return *revoked;
+
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return false;
 
     auto count = exec_and_get<int64_t>(
-            impl->prepared_st("SELECT COUNT(*) FROM revoked_subaccounts WHERE token = ? AND "
-                              "owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"),
+            impl->prepared_st(
+                    "SELECT COUNT(*) FROM revoked_subaccounts WHERE token = ? AND owner = ?"),
             blob_binder{subaccount.view()},
-            pubkey);
+            *owner);
     return count > 0;
 }
 
@@ -1040,10 +3580,35 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
         const std::vector<std::chrono::system_clock::time_point> new_exp,
         bool extend_only,
         bool shorten_only) {
-
     if (new_exp.size() != 1 && new_exp.size() != msg_hashes.size())
         throw std::logic_error{"update_expiry: new_exp must be 1 or N"};
 
+    if (memory_)
+        if (auto updated = memory_->update_expiry(
+                    pubkey, msg_hashes, new_exp, extend_only, shorten_only);
+            !updated.empty()) {
+            std::unordered_set<std::string_view> done;
+            for (auto& [hash, exp] : updated)
+                done.insert(hash);
+            std::vector<std::string> rest;
+            std::vector<std::chrono::system_clock::time_point> rest_exp;
+            for (size_t i = 0; i < msg_hashes.size(); i++) {
+                if (done.count(msg_hashes[i]))
+                    continue;
+                rest.push_back(msg_hashes[i]);
+                rest_exp.push_back(new_exp.size() == 1 ? new_exp[0] : new_exp[i]);
+            }
+            if (!rest.empty()) {
+                auto disk = update_expiry(pubkey, rest, rest_exp, extend_only, shorten_only);
+                updated.insert(updated.end(), disk.begin(), disk.end());
+            }
+            return updated;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).update_expiry(
+                pubkey, msg_hashes, new_exp, extend_only, shorten_only);
+
     std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> result;
 
     if (msg_hashes.empty())
@@ -1058,7 +3623,8 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
     if (msg_hashes.size() == 1) {
         // Pre-prepared version for the common single hash case
         if (impl->prepared_exec(
-                    "UPDATE messages SET expiry = ? WHERE hash = ?"s + expiry_constraint +
+                    "UPDATE messages SET expiry = ? WHERE " + impl->hash_in(2) +
+                            expiry_constraint +
                             " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)",
                     to_epoch_ms(new_exp[0]),
                     msg_hashes[0],
@@ -1066,32 +3632,23 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
             result.emplace_back(msg_hashes[0], new_exp[0]);
 
     } else if (new_exp.size() == 1) {
-        SQLite::Statement st{
-                impl->db,
-                multi_in_query(
-                        "UPDATE messages SET expiry = ?"
-                        " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"s +
-                                expiry_constraint + " AND hash IN (",  // ?,?,?,...,?
-                        msg_hashes.size(),
-                        ") RETURNING hash"sv)};
-        st.bind(1, to_epoch_ms(new_exp[0]));
-        bind_pubkey(st, 2, 3, pubkey);
-        for (size_t i = 0; i < msg_hashes.size(); i++)
-            st.bindNoCopy(4 + i, msg_hashes[i]);
-
-        for (auto& hash : get_all<std::string>(st))
+        auto st = impl->prepared_st(
+                "UPDATE messages SET expiry = ?"
+                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"s +
+                expiry_constraint + " AND " + impl->hash_in_array(4) +
+                " RETURNING hash_text(hash)");
+        for (auto& hash :
+             get_all<std::string>(st, to_epoch_ms(new_exp[0]), pubkey, json_array(msg_hashes)))
             result.emplace_back(hash, new_exp[0]);
     } else {
         int64_t owner;
-        if (auto maybe = exec_and_maybe_get<int64_t>(
-                    impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?"),
-                    pubkey))
+        if (auto maybe = impl->owner_id(pubkey))
             owner = *maybe;
         else
             return result;
 
         auto st = impl->prepared_st(
-                "UPDATE messages SET expiry = ? WHERE hash = ?"s + expiry_constraint +
+                "UPDATE messages SET expiry = ? WHERE " + impl->hash_in(2) + expiry_constraint +
                 " AND owner = ?");
         for (size_t i = 0; i < msg_hashes.size(); i++) {
             if (i > 0)
@@ -1105,45 +3662,69 @@ std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> Datab
 
 std::map<std::string, int64_t> Database::get_expiries(
         const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) {
-    auto impl = get_impl();
+    if (memory_)
+        if (auto found = memory_->get_expiries(pubkey, msg_hashes); !found.empty()) {
+            std::vector<std::string> rest;
+            for (auto& hash : msg_hashes)
+                if (!found.count(hash))
+                    rest.push_back(hash);
+            if (!rest.empty())
+                found.merge(get_expiries(pubkey, rest));
+            return found;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).get_expiries(pubkey, msg_hashes);
+
+    auto impl = get_reader();
+
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
 
     if (msg_hashes.size() == 1) {
         // Pre-prepared version for the common single hash case
         auto st = impl->prepared_st(
-                "SELECT hash, expiry FROM messages WHERE hash = ?"
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)");
-        return get_map<std::string, int64_t>(st, msg_hashes[0], pubkey);
+                "SELECT hash_text(hash), expiry FROM messages WHERE " + impl->hash_in(1) +
+                " AND owner = ?");
+        return get_map<std::string, int64_t>(st, msg_hashes[0], *owner);
     }
 
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "SELECT hash, expiry FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ")"sv)};
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-
-    return get_map<std::string, int64_t>(st);
+    auto st = impl->prepared_st(
+            "SELECT hash_text(hash), expiry FROM messages WHERE owner = ? AND " +
+            impl->hash_in_array(2));
+    return get_map<std::string, int64_t>(st, *owner, json_array(msg_hashes));
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::update_all_expiries(
         const user_pubkey& pubkey, std::chrono::system_clock::time_point new_exp) {
+    if (memory_)
+        if (auto updated = memory_->update_all_expiries(pubkey, new_exp); !updated.empty()) {
+            auto disk = update_all_expiries(pubkey, new_exp);
+            updated.insert(updated.end(), disk.begin(), disk.end());
+            return updated;
+        }
+
+    if (!shards_.empty())
+        return shard_for(pubkey).update_all_expiries(pubkey, new_exp);
+
     auto impl = get_impl();
 
     auto new_exp_ms = to_epoch_ms(new_exp);
     auto st = impl->prepared_st(
             "UPDATE messages SET expiry = ?"
             " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
+            " RETURNING namespace, hash_text(hash)");
     return get_all<namespace_id, std::string>(st, new_exp_ms, new_exp_ms, pubkey);
 }
 
 std::vector<std::string> Database::update_all_expiries(
         const user_pubkey& pubkey, namespace_id ns, std::chrono::system_clock::time_point new_exp) {
+    if (in_memory(ns))
+        return memory_->update_all_expiries(pubkey, ns, new_exp);
+    if (!shards_.empty())
+        return shard_for(pubkey).update_all_expiries(pubkey, ns, new_exp);
+
     auto impl = get_impl();
 
     auto new_exp_ms = to_epoch_ms(new_exp);
@@ -1151,7 +3732,7 @@ std::vector<std::string> Database::update_all_expiries(
             "UPDATE messages SET expiry = ?"
             " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
             " AND namespace = ?"
-            " RETURNING hash");
+            " RETURNING hash_text(hash)");
     return get_all<std::string>(st, new_exp_ms, new_exp_ms, pubkey, ns);
 }
 
@@ -1161,4 +3742,50 @@ void oxenss::Database::test_suite_block_for(std::chrono::milliseconds duration)
     std::this_thread::sleep_for(duration);
 }
 
+// Hack used by the test suite to simulate an upgraded database that still has text hashes:
+void oxenss::Database::test_suite_text_hashes() {
+    auto impl = get_impl();
+    impl->db.exec(R"(
+UPDATE messages SET hash = hash_text(hash);
+INSERT INTO counters (name, value) VALUES ('hash_migration_id', 0)
+    ON CONFLICT(name) DO UPDATE SET value = 0;
+)");
+    legacy_hashes_ = true;
+}
+
+void oxenss::Database::test_suite_skew_owner_counts(int64_t extra) {
+    get_impl()->prepared_exec("UPDATE owners SET message_count = message_count + ?", extra);
+}
+
+// Hack used by the test suite to check how sqlite executes the retrieve queries:
+std::vector<std::string> oxenss::Database::test_suite_retrieve_plans() {
+    auto impl = get_impl();
+    std::vector<std::string> plans;
+    for (const auto& query : {impl->last_hash_query(),
+                              std::string{DatabaseImpl::retrieve_query(false)},
+                              std::string{DatabaseImpl::retrieve_query(true)}}) {
+        SQLite::Statement st{impl->db, "EXPLAIN QUERY PLAN " + query};
+        auto& plan = plans.emplace_back();
+        while (st.executeStep()) {
+            if (!plan.empty())
+                plan += "; ";
+            plan += st.getColumn(3).getString();
+        }
+    }
+    return plans;
+}
+
+// Hack used by the test suite to force an eviction without having to fill up the database:
+int64_t oxenss::Database::test_suite_limit_pages(int64_t extra) {
+    auto impl = get_impl();
+    auto pages = impl->prepared_get<int64_t>("PRAGMA page_count") + extra;
+    impl->db.exec("PRAGMA max_page_count = {}"_format(pages));
+    return pages;
+}
+
+int64_t oxenss::Database::test_suite_evict(int64_t count) {
+    auto impl = get_impl();
+    return evict(*impl, count);
+}
+
 }  // namespace oxenss
@@ -3,25 +3,36 @@
 #include <oxenss/common/subaccount_token.h>
 #include <oxenss/common/message.h>
 #include <oxenss/common/pubkey.h>
+#include "message_list.hpp"
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <stack>
 #include <string>
+#include <thread>
 #include <vector>
 
+struct sqlite3;
+
 namespace oxenss {
 
 using namespace std::literals;
 
 class DatabaseImpl;
 class LockedDBImpl;
+class OwnerIDCache;
+class RevokedSubaccounts;
+class HashFilter;
+class MemoryStore;
 
 /// Possible return values of a `store()`:
 enum class StoreResult {
@@ -29,33 +40,220 @@ enum class StoreResult {
     Extended,  // Message existed, but the expiry was extended to match the stored timestamp.
     Exists,    // Message exists and already has an expiry >= the stored one.
     Full,      // Can't insert right now because the database is full.
+    OverQuota, // Not inserted because it would exceed the owner's or namespace's quota.
+};
+
+// Limits on what a single owner (across all of its namespaces) and a single namespace (across all
+// owners) can hold in the database; 0 means unlimited.
+struct StoreQuotas {
+    int64_t owner_messages = 0;
+    int64_t owner_bytes = 0;
+    int64_t namespace_messages = 0;
+    int64_t namespace_bytes = 0;
+
+    bool any() const {
+        return owner_messages > 0 || owner_bytes > 0 || namespace_messages > 0 ||
+               namespace_bytes > 0;
+    }
 };
 
 // Storage database class.
 class Database {
-    std::stack<std::unique_ptr<DatabaseImpl>> impl_pool_;
+    // A pool of database connections of one kind (read-write or read-only).  At most `max_open`
+    // connections are ever opened; once they are all in use callers wait for one to be returned.
+    struct ConnectionPool {
+        std::stack<std::unique_ptr<DatabaseImpl>> idle;
+        // Total connections, including ones currently in use.  Only changed while holding
+        // impl_lock_, but atomic so that they can be read (for stats) without it.
+        std::atomic<size_t> open = 0;
+        std::atomic<size_t> busy = 0;  // Connections currently in use
+        size_t max_open;
+        bool readonly;
+        std::condition_variable cv;
+
+        ConnectionPool(size_t max_open, bool readonly) : max_open{max_open}, readonly{readonly} {}
+    };
+    ConnectionPool writers_;
+    ConnectionPool readers_;
     friend class DatabaseImpl;
     friend class LockedDBImpl;
-    std::mutex impl_lock_;
+    std::mutex impl_lock_;  // Protects both pools
+    LockedDBImpl get_impl(ConnectionPool& pool);
+    // Returns a read-write connection
     LockedDBImpl get_impl();
+    // Returns a read-only connection; these may be used for anything that doesn't modify the
+    // database and don't contend with writers.
+    LockedDBImpl get_reader();
+    // Opens all of the read-only connections that the pool allows (concurrently), so that the
+    // first requests to need them don't have to.
+    void warm_readers();
 
     const std::filesystem::path db_path_;
 
+    // In sharded mode, the shards (each an ordinary, unsharded Database in its own subdirectory)
+    // across which owners are split by swarm space.  Empty when not sharded, in which case this
+    // instance holds the database itself.
+    std::vector<std::unique_ptr<Database>> shards_;
+    Database& shard_for(const user_pubkey& pk);
+    // Invokes `f(shard)` (or `f(shard, index)`) for every shard concurrently; returns the results
+    // in shard order (or nothing, if `f` returns void).
+    template <typename F>
+    auto for_each_shard(F&& f);
+    // Splits messages by shard, returning the indices into `msgs` and copies of the messages for
+    // each shard.  Messages without a pubkey are omitted.
+    std::vector<std::pair<std::vector<size_t>, std::vector<message>>> group_by_shard(
+            const std::vector<message>& msgs);
+
+    // Cache of user pubkey -> owner row id lookups, shared by all pooled connections.
+    std::unique_ptr<OwnerIDCache> owner_cache_;
+
+    // In-memory copy of the revoked subaccount tokens, consulted by subaccount_revoked().
+    std::unique_ptr<RevokedSubaccounts> revoked_;
+
+    // Approximate membership filter of stored message hashes; see rebuild_hash_filter().
+    std::unique_ptr<HashFilter> hash_filter_;
+    std::chrono::steady_clock::time_point hash_filter_built_;
+
+    // Messages of the namespaces kept in memory rather than on disk (see enable_memory_tier());
+    // null if there are no such namespaces.  When sharded this lives in the top-level instance,
+    // not in the shards.
+    std::unique_ptr<MemoryStore> memory_;
+    bool memory_spill_ = false;
+    bool in_memory(namespace_id ns) const;
+    // Removes and returns all messages in the given namespaces from the database.
+    std::vector<message> take_namespaces(const std::set<namespace_id>& namespaces);
+    // Writes the memory tier's messages to MEMORY_TIER_SPILL_FILE in the given directory.
+    void spill_memory_tier(const std::filesystem::path& dir);
+
+    // Background snapshot started by snapshot_async(), if any
+    std::mutex snapshot_mutex_;
+    std::thread snapshot_thread_;
+    std::atomic<bool> snapshot_running_ = false;
+    std::atomic<bool> snapshot_abort_ = false;
+
+    // Background WAL checkpointing (see start_checkpointer()).  The writers' wal hook keeps
+    // wal_pages_ and wal_commits_ up to date after every commit, and wakes the checkpointer early
+    // once the WAL reaches checkpoint_trigger_ pages.
+    std::thread checkpoint_thread_;
+    std::mutex checkpoint_mutex_;
+    std::condition_variable checkpoint_cv_;
+    bool checkpoint_stop_ = false;
+    std::atomic<bool> checkpointer_running_ = false;
+    std::atomic<int64_t> checkpoint_trigger_ = 0;
+    std::atomic<int64_t> wal_pages_ = 0;
+    std::atomic<int64_t> wal_commits_ = 0;
+    std::atomic<int64_t> wal_bytes_ = 0;
+    std::atomic<int64_t> checkpoints_passive_ = 0, checkpoints_truncate_ = 0, checkpoints_busy_ = 0;
+    std::atomic<int64_t> checkpoint_us_ = 0;
+    void checkpoint_loop(std::chrono::milliseconds period, std::chrono::milliseconds idle_time);
+    // Runs a checkpoint (of sqlite mode `mode`) on connection `db`, updating the checkpoint stats;
+    // returns true if it completed.
+    bool run_checkpoint(sqlite3* db, int mode);
+
     friend class TestSuiteHacks;
     void test_suite_block_for(std::chrono::milliseconds duration);
+    void test_suite_text_hashes();
+    // Adds `extra` to every owner's stored message count (without touching the messages).
+    void test_suite_skew_owner_counts(int64_t extra);
+    int64_t test_suite_evict(int64_t count);
+    // Caps the (single) writer's database at its current page count plus `extra`; returns the cap.
+    int64_t test_suite_limit_pages(int64_t extra);
+    std::vector<std::string> test_suite_retrieve_plans();
 
     // keep track of db full errors so we don't print them on every store
     std::atomic<int> db_full_counter = 0;
 
+    // Number of expired messages remaining after the last clean_expired() ran out of time
+    std::atomic<int64_t> expired_backlog_ = 0;
+
+    // True while an upgraded database may still contain message hashes stored as base64 text
+    // rather than raw bytes (see migrate_hashes()).
+    std::atomic<bool> legacy_hashes_ = false;
+
+    // Per-namespace eviction priorities (see set_eviction_priority()); namespaces not listed here
+    // have priority 0.
+    std::mutex eviction_mutex_;
+    std::map<namespace_id, int> eviction_priorities_;
+
+    // Per-owner and per-namespace limits (see set_quotas()), and the stores they have rejected
+    StoreQuotas quotas_;
+    std::atomic<int64_t> quota_rejections_ = 0;
+
+
+    std::atomic<int64_t> evicted_messages_ = 0;
+    std::atomic<int64_t> evicted_bytes_ = 0;
+
+    // Evicts up to `count` messages, closest to expiry (honouring namespace priorities) first, in
+    // its own transaction on the given (writer) connection.  Returns the number evicted.
+    int64_t evict(DatabaseImpl& impl, int64_t count);
+
   public:
     // Recommended period for calling clean_expired()
     static constexpr auto CLEANUP_PERIOD = 10s;
 
+    // Recommended (shorter) period for calling clean_expired() while expired_backlog() is non-zero
+    static constexpr auto CLEANUP_BACKLOG_PERIOD = 1s;
+
+    // clean_expired() deletes at most this many messages per write transaction, releasing the
+    // database write lock between chunks so that stores don't stall behind a large cleanup.
+    static constexpr int CLEANUP_CHUNK_SIZE = 1000;
+
+    // Maximum time a single clean_expired() call will spend deleting before giving up and leaving
+    // the remainder (see expired_backlog()) for a subsequent call.
+    static constexpr auto CLEANUP_TIME_BUDGET = 200ms;
+
+    // Messages are indexed by expiry in coarse buckets of this size rather than by exact expiry.
+    // Changing a message's expiry only has to update the index when it moves to a different
+    // bucket (so the frequent small extensions done by clients usually don't), and expiry cleanup
+    // can drop every message of past buckets without looking at the exact expiry.
+    static constexpr auto EXPIRY_BUCKET_SIZE = 10min;
+
+    // migrate_hashes() converts this many messages per transaction, for at most the given time per
+    // call.
+    static constexpr int64_t HASH_MIGRATION_CHUNK_SIZE = 5000;
+    static constexpr auto HASH_MIGRATION_TIME_BUDGET = 200ms;
+
+    // reconcile_owner_counts() checks the counts of this many owner ids per call.
+    static constexpr int64_t RECONCILE_CHUNK_SIZE = 1000;
+
     static constexpr int64_t SIZE_LIMIT = int64_t(3584) * 1024 * 1024;  // 3.5 GB
 
+    // Maximum number of pubkey -> owner id mappings that we cache in memory
+    static constexpr size_t OWNER_ID_CACHE_SIZE = 100'000;
+
+    // How often the message hash filter gets rebuilt to drop deleted and expired hashes (it also
+    // gets rebuilt whenever it fills up), and the minimum number of hashes it is sized for.
+    static constexpr auto HASH_FILTER_REBUILD_PERIOD = 1h;
+    static constexpr uint64_t HASH_FILTER_MIN_CAPACITY = 1'000'000;
+
+    // Default limits on the number of read-write and read-only connections to open.  sqlite only
+    // allows one writer at a time, so more than a few writers just adds lock contention.
+    static constexpr size_t DEFAULT_MAX_WRITERS = 2;
+    static constexpr size_t DEFAULT_MAX_READERS = 16;
+
+    // How long a caller waits for a connection when the pool is exhausted before giving up with
+    // an exception.
+    static constexpr auto CONNECTION_WAIT_TIMEOUT = 10s;
+
+    // mmap size and page cache size (in bytes) used for read-only connections
+    static constexpr int64_t READER_MMAP_SIZE = int64_t(256) * 1024 * 1024;
+    static constexpr int64_t READER_CACHE_SIZE = int64_t(32) * 1024 * 1024;
+
     // Constructor.  Note that you *must* also set up a timer that runs periodically (every
-    // CLEANUP_PERIOD is recommended) and calls clean_expired().
-    explicit Database(std::filesystem::path db_path);
+    // CLEANUP_PERIOD is recommended) and calls clean_expired().  `max_writers` and `max_readers`
+    // limit the number of read-write and read-only connections (each must be at least 1).
+    //
+    // If `shards` is greater than 1 then messages are split across that many separate database
+    // files, by owner swarm space, each with its own connection pools (of the given sizes) and its
+    // own SIZE_LIMIT.  Operations on a single owner go to just that owner's shard; operations over
+    // the whole database run across all shards concurrently.  The shard count of an existing
+    // database cannot be changed: construction throws if `db_path` holds a database with a
+    // different layout.
+    explicit Database(
+            std::filesystem::path db_path,
+            size_t max_writers = DEFAULT_MAX_WRITERS,
+            size_t max_readers = DEFAULT_MAX_READERS,
+            size_t shards = 1);
 
     ~Database();
 
@@ -67,23 +265,149 @@ class Database {
     // expiry (existing, if longer; otherwise the one from `msg`) will be copied.
     StoreResult store(const message& msg, std::chrono::system_clock::time_point* expiry = nullptr);
 
-    void bulk_store(const std::vector<message>& items);
+    // Stores multiple messages in a single transaction.  Returns a vector of the same length as
+    // `msgs` containing the store result and resulting expiry (as described in `store()`) for each
+    // message.  If the batch doesn't fit in the database (even after evicting to make room) then
+    // the messages are stored one at a time instead, and just the ones that don't fit get
+    // StoreResult::Full.  Other database errors throw (storing nothing, unless they happen while
+    // storing one message at a time).  When sharded there is one transaction per shard, and so
+    // this applies to each shard's part of the batch.
+    std::vector<std::pair<StoreResult, std::chrono::system_clock::time_point>> store_batch(
+            const std::vector<message>& msgs);
+
+    // Number of messages inserted per multi-row INSERT statement by bulk_store.
+    static constexpr size_t BULK_INSERT_ROWS = 500;
+
+    // Stores many messages (e.g. from a swarm peer when we join a swarm) in a single transaction,
+    // using multi-row inserts.  Unlike `store_batch`, existing messages are left untouched (i.e.
+    // not extended) and the database free space is not checked.  Returns a vector of the same
+    // length as `items` containing StoreResult::New for messages that were inserted,
+    // StoreResult::Exists for messages that already existed (or were duplicated earlier in
+    // `items`), and nullopt for messages that were skipped because they have no (insertable)
+    // pubkey.
+    std::vector<std::optional<StoreResult>> bulk_store(const std::vector<message>& items);
 
     // Default value for message overhead calculations in `retrieve`.  In practice, overhead for the
     // message itself (i.e. the json keys, etc.) seems to be in the 75-80 character range (depending
     // on whether json or bt-encoded), not including the hash + the data.
     constexpr static size_t DEFAULT_MSG_OVERHEAD = 100;
 
+    // Default memory limit for enable_memory_tier(), and the file (in the database directory) that
+    // the memory tier is saved to on shutdown when spilling is enabled.
+    static constexpr size_t DEFAULT_MEMORY_TIER_SIZE = size_t(256) * 1024 * 1024;
+    static constexpr auto MEMORY_TIER_SPILL_FILE = "memory_tier.bt"sv;
+
+    // Keeps the messages of the given namespaces in memory instead of in the database, which
+    // avoids all of the disk writes (insert, WAL, index updates, and the eventual delete) for
+    // namespaces holding short-lived or frequently replaced messages.  Everything in the Database
+    // API works the same for these messages (and they are included when iterating over messages
+    // for swarm replication), but they do not survive a restart unless `spill` is given, in which
+    // case they are written to disk on shutdown and reloaded by the next enable_memory_tier().
+    //
+    // The messages take up at most (approximately) `max_bytes` of memory; once that fills up the
+    // messages closest to expiry are dropped to make room for new ones.  Any messages of these
+    // namespaces already in the database are moved into memory.  This must be called (at most
+    // once) during startup, before the Database is used by other threads.
+    void enable_memory_tier(
+            std::set<namespace_id> namespaces,
+            size_t max_bytes = DEFAULT_MEMORY_TIER_SIZE,
+            bool spill = false);
+
+    // Returns the approximate memory used by, and the number of messages dropped from, the memory
+    // tier (0 if not enabled).
+    int64_t memory_tier_bytes() const;
+    int64_t memory_tier_evicted() const;
+
+    // Snapshots copy SNAPSHOT_PAGES_PER_STEP database pages at a time, pausing for
+    // SNAPSHOT_STEP_PAUSE between steps so as not to monopolize the disk.
+    static constexpr int SNAPSHOT_PAGES_PER_STEP = 1024;
+    static constexpr auto SNAPSHOT_STEP_PAUSE = 10ms;
+
+    // import_snapshot() stores messages this many at a time.
+    static constexpr size_t SNAPSHOT_IMPORT_BATCH_SIZE = 10'000;
+
+    // Writes a consistent copy of the database into the directory `dest` (which must not be the
+    // database's own directory), replacing any previous snapshot there.  The result has the same
+    // layout as a database directory (including the shard subdirectories, when sharded, and a
+    // MEMORY_TIER_SPILL_FILE holding the memory tier's messages), so a new node can be started
+    // directly from a copy of it, or it can be fed to import_snapshot().
+    //
+    // This uses the sqlite online backup API from a single read transaction, so stores and
+    // retrievals carry on as usual while it runs (although one reader connection is held, and WAL
+    // checkpoints can't complete, until it finishes).  It is throttled (see SNAPSHOT_STEP_PAUSE)
+    // and so can take a while for a large database: you generally want snapshot_async() instead.
+    // Throws on failure, or if `abort` is given and becomes true, leaving any previous snapshot
+    // in place.
+    void snapshot(const std::filesystem::path& dest, const std::atomic<bool>* abort = nullptr);
+
+    // Starts a snapshot() into `dest` on a background thread, logging the result when done.
+    // Returns false (and does nothing) if a snapshot is already in progress.  A snapshot still
+    // running when the Database is destroyed is aborted.
+    bool snapshot_async(std::filesystem::path dest);
+
+    // Returns true while a snapshot started by snapshot_async() is running.
+    bool snapshot_running() const { return snapshot_running_; }
+
+    // Defaults for start_checkpointer().
+    static constexpr auto CHECKPOINT_PERIOD = 1s;
+    static constexpr int64_t CHECKPOINT_WAL_SIZE = int64_t(16) * 1024 * 1024;
+    static constexpr auto CHECKPOINT_IDLE_TIME = 10s;
+
+    // How long the checkpointer's truncating checkpoints wait for readers to move off of the WAL
+    // before giving up (until the next idle period).  Writers are blocked while it waits.
+    static constexpr auto CHECKPOINT_BUSY_TIMEOUT = 50ms;
+
+    // Until start_checkpointer() is called, a commit that leaves the WAL at least this many pages
+    // long checkpoints it right away, on the committing thread (as sqlite does by default).
+    static constexpr int64_t AUTOCHECKPOINT_PAGES = 1000;
+
+    // Moves WAL checkpointing off of the threads doing writes and onto a dedicated background
+    // thread (with its own connection).  Every `period` after writes were committed, or as soon
+    // as the WAL reaches `wal_size` bytes, it runs a PASSIVE checkpoint, which never blocks
+    // readers or writers (but so may not get all the way through on a busy database).  Once
+    // there have been no writes for `idle_time`, it runs a TRUNCATE checkpoint, which completes
+    // the checkpoint and shrinks the WAL file back down.  Without this the WAL is checkpointed
+    // inline by whichever write takes it past AUTOCHECKPOINT_PAGES.  Call at most once, during
+    // startup; when sharded, each shard gets its own checkpointer.
+    void start_checkpointer(
+            std::chrono::milliseconds period = CHECKPOINT_PERIOD,
+            int64_t wal_size = CHECKPOINT_WAL_SIZE,
+            std::chrono::milliseconds idle_time = CHECKPOINT_IDLE_TIME);
+
+    struct checkpoint_stats {
+        int64_t passive = 0, truncate = 0;  // Checkpoints run, by mode
+        int64_t busy = 0;         // Checkpoints that couldn't finish because the db was busy
+        double seconds = 0;       // Total time spent checkpointing
+        int64_t wal_bytes = 0;    // Size of the WAL file(s) as of the last checkpoint
+    };
+    // Returns the checkpointer's statistics (summed over all shards, when sharded).
+    checkpoint_stats get_checkpoint_stats() const;
+
+    // Checkpoints the whole WAL into the database and truncates it, right now (waiting for
+    // readers and writers, up to the usual busy timeout), e.g. before shutting down so that the
+    // next startup doesn't have a long WAL to deal with.  Returns false if a checkpoint couldn't
+    // complete.
+    bool checkpoint_wal();
+
+    // Copies the unexpired messages of a snapshot (or of any other storage server data directory,
+    // as long as it is not in use) into this database, leaving existing messages untouched, as
+    // bulk_store() does.  If `space_range` is given then only messages of owners with swarm spaces
+    // in the inclusive [first, second] range (with the same wrap-around semantics as
+    // for_each_message_in_range) are copied, which allows seeding a new node with just its own
+    // swarm's messages.  The source is only read, through read-only connections, so it is left
+    // exactly as it was (and can be on a read-only mount), but it must already have the current
+    // schema.  Returns the number of messages added.
+    int64_t import_snapshot(
+            const std::filesystem::path& src,
+            std::optional<std::pair<uint64_t, uint64_t>> space_range = std::nullopt);
+
     // Retrieves messages owned by pubkey received since `last_hash` stored in namespace `ns`.  If
     // last_hash is empty or not found then returns all messages (up to the limit). Optionally takes
     // a maximum number of messages to return or a maximum aggregate size of messages to return.
     //
-    // Note that the `pubkey` value of the returned message's will be left default constructed,
-    // i.e. *not* filled with the given pubkey.
-    //
-    // Returns a vector of messages, and a bool indicating whether there are more results to
-    // retrieve.
-    std::pair<std::vector<message>, bool> retrieve(
+    // Returns the messages (which, unlike `message`, have no pubkey), and a bool indicating whether
+    // there are more results to retrieve.
+    std::pair<MessageList, bool> retrieve(
             const user_pubkey& pubkey,
             namespace_id ns,
             const std::string& last_hash,
@@ -95,32 +419,156 @@ class Database {
                     DEFAULT_MSG_OVERHEAD  // how much overhead per message to allow for
     );
 
+    // One retrieval for `retrieve_multi`, with the same meaning as the corresponding arguments of
+    // `retrieve`.
+    struct retrieve_params {
+        namespace_id ns;
+        std::string last_hash;
+        std::optional<size_t> num_results;
+        std::optional<size_t> max_size;
+    };
+
+    // Performs several retrievals for the same pubkey (typically one per namespace polled by a
+    // client) using a single database connection and owner lookup.  Returns the same
+    // messages/more pairs as `retrieve` would, in the same order as `params`.
+    std::vector<std::pair<MessageList, bool>> retrieve_multi(
+            const user_pubkey& pubkey,
+            const std::vector<retrieve_params>& params,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
     // Retrieves all messages.
     std::vector<message> retrieve_all();
 
+    // Visits all unexpired messages without loading them all into memory at once.  Messages are
+    // visited grouped by owner.  If `owner_filter` is non-null then it is called (once) with each
+    // owner pubkey and messages of owners for which it returns false are skipped without being
+    // loaded.  `visit` is called with each message; if it returns false the iteration stops.
+    // Messages held in memory (see enable_memory_tier()) are visited first, so an owner with
+    // messages both in memory and on disk is visited (and passed to `owner_filter`) twice.
+    //
+    // Note that this holds a database connection (and read snapshot) for the duration of the
+    // iteration, so callbacks should avoid doing anything slow.
+    void for_each_message(
+            const std::function<bool(const user_pubkey& owner)>& owner_filter,
+            const std::function<bool(message&& msg)>& visit);
+
+    // Same as for_each_message, but visits only messages of owners with a swarm space value (see
+    // user_pubkey::swarm_space) in the inclusive range [space_begin, space_end].  If space_begin >
+    // space_end then the range wraps around, i.e. covers [space_begin, 2^64-1] and [0, space_end].
+    // This is an index range scan over owners, and so is cheap even for a small range of a large
+    // database.
+    void for_each_message_in_range(
+            uint64_t space_begin,
+            uint64_t space_end,
+            const std::function<bool(message&& msg)>& visit);
+
+    // Summary of the unexpired messages in one bucket of swarm space, used by swarm members to
+    // cheaply check that they hold the same messages (see range_digests()).
+    struct range_digest {
+        int64_t count = 0;
+        uint64_t hash_xor = 0;  // XOR of the first 8 bytes (little-endian) of each raw hash
+
+        bool operator==(const range_digest& o) const {
+            return count == o.count && hash_xor == o.hash_xor;
+        }
+        bool operator!=(const range_digest& o) const { return !(*this == o); }
+    };
+
+    // Returns which of `buckets` equal-sized buckets of the inclusive (and possibly wrapping)
+    // swarm space range [space_begin, space_end] the swarm space value `space` (which must be in
+    // the range) falls into, and the inclusive range of swarm space covered by bucket `bucket`.
+    static size_t range_bucket(
+            uint64_t space, uint64_t space_begin, uint64_t space_end, size_t buckets);
+    static std::pair<uint64_t, uint64_t> range_bucket_bounds(
+            uint64_t space_begin, uint64_t space_end, size_t buckets, size_t bucket);
+
+    // Splits the swarm space range [space_begin, space_end] (with the same wrap-around semantics
+    // as for_each_message_in_range) into `buckets` buckets (as per range_bucket()) and returns the
+    // digest of the messages in each.  Two nodes holding the same messages in the range get
+    // identical digests, and a difference in a bucket's digests means that they hold different
+    // messages of owners in that bucket.  This only reads the owner's swarm space and message
+    // hash of each message, but is still a scan over all the messages in the range.
+    std::vector<range_digest> range_digests(
+            uint64_t space_begin, uint64_t space_end, size_t buckets);
+
+    // Returns the (sorted) hashes of all unexpired messages of owners in the swarm space range
+    // [space_begin, space_end], or nullopt if there are more than `limit` of them.
+    std::optional<std::vector<std::string>> range_hashes(
+            uint64_t space_begin, uint64_t space_end, size_t limit);
+
     // Return the total number of messages stored
     int64_t get_message_count();
 
     // Returns the per-owner counts of stored messages, for storage statistics purposes.
     std::vector<int> get_message_counts();
 
-    // Returns the number of distinct owner pubkeys with stored messages
+    // Returns the number of distinct owner pubkeys with stored messages.  (Owners with messages
+    // both in memory and in the database are counted twice).
     int64_t get_owner_count();
 
     // Returns the number of messages grouped by namespace id
     std::vector<std::pair<namespace_id, int64_t>> get_namespace_counts();
 
+    // Sets per-owner and per-namespace quotas.  Stores of new messages that would take their owner
+    // or namespace over a quota get StoreResult::OverQuota (re-stores of messages that we already
+    // have still succeed).  The totals are maintained incrementally by database triggers, so
+    // checking them is just a couple of indexed lookups per store.  Quotas don't apply to public
+    // outbox namespaces, the memory tier, or bulk_store().  When sharded, the namespace quotas get
+    // split evenly between the shards.  Must be called during startup.
+    void set_quotas(const StoreQuotas& quotas);
+    const StoreQuotas& quotas() const { return quotas_; }
+
+    // Returns false if storing a new message of `size` bytes in namespace `ns` for `pubkey` would
+    // currently exceed a quota, so that such stores can be refused before doing anything else with
+    // them.  (store() enforces the quotas regardless.)
+    bool within_quota(const user_pubkey& pubkey, namespace_id ns, size_t size);
+
+    // Returns the number of stores rejected for exceeding a quota
+    int64_t quota_rejections() const;
+
     // Returns the number of allocated bytes used on disk (i.e. used pages * page size).  This
     // includes both used and unused storage (i.e. allocated on disk, currently currently unused
     // that will likely be reused by sqlite when needed).
     int64_t get_total_bytes();
 
+    // Returns the maximum database size: SIZE_LIMIT, or SIZE_LIMIT per shard when sharded.
+    int64_t size_limit() const {
+        return SIZE_LIMIT * (shards_.empty() ? 1 : static_cast<int64_t>(shards_.size()));
+    }
+
+    struct pool_usage {
+        size_t writers_open = 0, writers_busy = 0, readers_open = 0, readers_busy = 0;
+    };
+    // Returns the numbers of open and currently used database connections (summed over all shards,
+    // when sharded).
+    pool_usage get_pool_usage() const;
+
+    struct memory_usage {
+        // SQLite's memory use for the whole process (including memory not attributable to one of
+        // our connections), and its high-water mark
+        int64_t sqlite_used = 0, sqlite_highwater = 0;
+        // Page cache, prepared statement and schema memory of the connections not in use when
+        // asked (and how many connections and prepared statements that covers)
+        int64_t page_cache = 0, statements = 0, schema = 0;
+        size_t connections_checked = 0, prepared_statements = 0;
+        int64_t owner_cache = 0;  // Cache of owner ids (estimated)
+        int64_t memory_tier = 0;  // Messages held in memory (see enable_memory_tier())
+    };
+    // Returns the memory used by the database layer, summed over all shards when sharded.
+    memory_usage get_memory_usage();
+
     // Returns the number of used bytes on disk; that is, total pages (as returned by
     // `get_total_bytes`) minus unused pages in the database file.  Note that this is still an upper
     // bound on actual stored size as there may be partially filled pages.
     int64_t get_used_bytes();
 
-    // Get random message. Returns nullopt if there are no messages.
+    // Number of random id probes retrieve_random() makes before falling back to selecting the next
+    // live message after a random id.
+    static constexpr int RANDOM_PROBE_ATTEMPTS = 8;
+
+    // Get a random, unexpired message. Returns nullopt if there are no messages.  This does not
+    // scan the table: the cost is a handful of primary key lookups, regardless of database size.
     std::optional<message> retrieve_random();
 
     // Get message by `msg_hash`, return true if found.  Note that this does *not* filter by
@@ -128,8 +576,58 @@ class Database {
     std::optional<message> retrieve_by_hash(const std::string& msg_hash);
 
     // Removes expired messages from the database; the `Database` instance owner should call
-    // this periodically.
-    void clean_expired();
+    // this periodically.  Deletion happens in chunks of CLEANUP_CHUNK_SIZE and stops once
+    // CLEANUP_TIME_BUDGET has elapsed, in which case the number of expired messages still remaining
+    // is available via `expired_backlog()`.  Returns the number of messages deleted.
+    int64_t clean_expired();
+
+    // Returns the number of expired messages that the last call to clean_expired() did not get to
+    // within its time budget (0 if it removed everything).
+    int64_t expired_backlog() const { return expired_backlog_; }
+
+    // When the database fills up we evict the messages closest to expiry rather than refusing new
+    // ones.  make_space(), which should be called periodically (e.g. after each clean_expired()),
+    // starts evicting once used space exceeds the high watermark (a fraction of SIZE_LIMIT) and
+    // continues until it is below the low watermark, in chunks of EVICTION_CHUNK_SIZE, for at most
+    // CLEANUP_TIME_BUDGET per call.  Independently of that, a store that finds the database
+    // completely full evicts one chunk and retries before giving up with StoreResult::Full.
+    static constexpr double EVICTION_HIGH_WATERMARK = 0.95;
+    static constexpr double EVICTION_LOW_WATERMARK = 0.90;
+    static constexpr int EVICTION_CHUNK_SIZE = 1000;
+
+    // Returns the number of messages evicted.
+    int64_t make_space();
+
+    // Sets the eviction priority of a namespace: when evicting, messages in namespaces with a lower
+    // priority are all evicted before any with a higher priority (and by expiry within the same
+    // priority).  Namespaces default to priority 0.
+    void set_eviction_priority(namespace_id ns, int priority);
+
+    // Returns the total number of messages, and database bytes, reclaimed by evictions.
+    int64_t evicted_messages() const;
+    int64_t evicted_bytes() const;
+
+    // Message hashes are stored as raw 32-byte values, but databases from older versions store
+    // them as base64 text.  Such databases are converted incrementally, without blocking startup:
+    // while hash_migration_pending() is true the owner should call migrate_hashes() periodically,
+    // which converts as much as it can within HASH_MIGRATION_TIME_BUDGET.  Everything keeps
+    // working (somewhat more slowly) while the conversion is in progress.  Returns true once
+    // conversion is complete.
+    bool hash_migration_pending() const { return legacy_hashes_; }
+    bool migrate_hashes();
+
+    // The per-owner message counts and sizes are maintained by triggers and shouldn't ever drift,
+    // but to make sure they can't stay wrong the owner should call this periodically: each call
+    // recomputes the stored counts of the next RECONCILE_CHUNK_SIZE owner ids (wrapping around
+    // after the last one) and corrects any that differ.  Returns the number of owners corrected.
+    int reconcile_owner_counts();
+
+    // Rebuilds the in-memory filter of stored message hashes that lets stores of new messages and
+    // lookups of nonexistent hashes skip a database query.  Until this has been called once the
+    // filter isn't used at all.  The owner should call this at startup and then periodically
+    // (every CLEANUP_PERIOD is fine): unless `force` is given it only actually rebuilds if the
+    // filter is full or HASH_FILTER_REBUILD_PERIOD has passed since the last rebuild.
+    void rebuild_hash_filter(bool force = false);
 
     // Deletes all messages owned by the given pubkey.  Returns the [namespace, hash] pairs of any
     // deleted messages.
@@ -168,7 +666,8 @@ class Database {
             const user_pubkey& pubkey, const std::vector<subaccount_token>& subaccount);
 
     // Checks if a subaccount token exists in the revoked subaccount database. Returns true if the
-    // subaccount has been revoked, false otherwise.
+    // subaccount has been revoked, false otherwise.  This is normally answered from an in-memory
+    // copy of the revoked tokens (loaded at startup) without touching the database.
     bool subaccount_revoked(const user_pubkey& pubkey, const subaccount_token& subaccount);
 
     // Updates the expiry time of the given messages owned by the given pubkey.  Returns a vector of
@@ -0,0 +1,121 @@
+#include "hash_filter.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+namespace oxenss {
+
+namespace {
+    // splitmix64 finalizer, used to derive a second independent hash value
+    uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Calls f(bit) for each of the BloomFilter::HASHES bit positions of `hash`, using double
+    // hashing (h1 + i*h2) to derive them from two base hashes.
+    template <typename F>
+    void for_each_bit(std::string_view hash, uint64_t bits, F&& f) {
+        uint64_t h1 = std::hash<std::string_view>{}(hash);
+        uint64_t h2 = mix(h1) | 1;
+        for (int i = 0; i < BloomFilter::HASHES; i++)
+            f((h1 + i * h2) % bits);
+    }
+}  // namespace
+
+BloomFilter::BloomFilter(uint64_t capacity) :
+        bits_{std::max<uint64_t>(capacity * BITS_PER_ELEMENT, 64)},
+        words_{std::make_unique<std::atomic<uint64_t>[]>((bits_ + 63) / 64)} {}
+
+void BloomFilter::add(std::string_view hash) {
+    for_each_bit(hash, bits_, [this](uint64_t bit) {
+        words_[bit / 64].fetch_or(uint64_t{1} << (bit % 64), std::memory_order_relaxed);
+    });
+}
+
+bool BloomFilter::maybe_contains(std::string_view hash) const {
+    bool found = true;
+    for_each_bit(hash, bits_, [this, &found](uint64_t bit) {
+        if (found && !(words_[bit / 64].load(std::memory_order_relaxed) &
+                       (uint64_t{1} << (bit % 64))))
+            found = false;
+    });
+    return found;
+}
+
+bool HashFilter::ready() const {
+    std::shared_lock lock{mutex_};
+    return current_ != nullptr;
+}
+
+bool HashFilter::needs_rebuild() const {
+    std::shared_lock lock{mutex_};
+    return !next_ && (!current_ || added_ > capacity_);
+}
+
+void HashFilter::add(std::string_view hash) {
+    std::shared_lock lock{mutex_};
+    if (current_)
+        current_->add(hash);
+    if (next_)
+        next_->add(hash);
+    added_++;
+    std::lock_guard plock{pending_mutex_};
+    pending_.emplace(hash);
+}
+
+void HashFilter::add_committed(std::string_view hash) {
+    std::shared_lock lock{mutex_};
+    if (next_)
+        next_->add(hash);
+    std::lock_guard plock{pending_mutex_};
+    if (auto it = pending_.find(std::string{hash}); it != pending_.end())
+        pending_.erase(it);
+}
+
+bool HashFilter::maybe_contains(std::string_view hash) const {
+    std::shared_lock lock{mutex_};
+    return !current_ || current_->maybe_contains(hash);
+}
+
+bool HashFilter::begin_rebuild(uint64_t capacity) {
+    std::unique_lock lock{mutex_};
+    if (next_)
+        return false;
+    next_ = std::make_unique<BloomFilter>(capacity);
+    return true;
+}
+
+void HashFilter::add_rebuilt(std::string_view hash) {
+    std::shared_lock lock{mutex_};
+    if (next_)
+        next_->add(hash);
+}
+
+void HashFilter::finish_rebuild(uint64_t count) {
+    std::unique_lock lock{mutex_};
+    if (!next_)
+        return;
+    // Hashes added before begin_rebuild() that still haven't committed weren't seen by the
+    // rebuild's scan, and their add_committed() would come too late to get them into next_.  (Once
+    // they are in the new filter we don't need to hear about them again.)
+    for (auto& hash : pending_)
+        next_->add(hash);
+    count += pending_.size();
+    pending_.clear();
+    current_ = std::move(next_);
+    capacity_ = current_->bits() / BloomFilter::BITS_PER_ELEMENT;
+    added_ = count;
+}
+
+void HashFilter::abort_rebuild() {
+    std::unique_lock lock{mutex_};
+    next_.reset();
+}
+
+}  // namespace oxenss
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+namespace oxenss {
+
+/// Simple fixed-size Bloom filter over message hashes.  Adding and testing are lock-free and may be
+/// done concurrently from any thread; false positives are possible, false negatives are not.
+class BloomFilter {
+    const uint64_t bits_;
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+  public:
+    // Number of bit positions set for each element.  With BITS_PER_ELEMENT bits per expected
+    // element this gives about a 1% false positive rate at capacity.
+    static constexpr int HASHES = 7;
+    static constexpr uint64_t BITS_PER_ELEMENT = 10;
+
+    // Constructs an empty filter sized for `capacity` elements.
+    explicit BloomFilter(uint64_t capacity);
+
+    void add(std::string_view hash);
+
+    // Returns false if `hash` was definitely never added, true if it (probably) was.
+    bool maybe_contains(std::string_view hash) const;
+
+    uint64_t bits() const { return bits_; }
+};
+
+/// Approximate membership filter over all of the message hashes in the database, used to skip
+/// database lookups for hashes that we definitely don't have.  The filter only ever grows (deleted
+/// and expired hashes stay in it), so it gets periodically rebuilt from the database.
+///
+/// Rebuilding works by calling `begin_rebuild()`, then `add_rebuilt()` with every hash currently in
+/// the database, then `finish_rebuild()`.  Hashes being stored concurrently must be passed to
+/// `add()` before they are inserted *and* to `add_committed()` after the insert commits: the latter
+/// is what catches a message committed after the rebuild's database scan started whose `add()`
+/// happened before `begin_rebuild()`.  Hashes added but not yet committed when the rebuild
+/// finishes (which the scan can't have seen either) get carried over into the rebuilt filter.
+class HashFilter {
+    mutable std::shared_mutex mutex_;
+    std::unique_ptr<BloomFilter> current_;
+    std::unique_ptr<BloomFilter> next_;  // Set while a rebuild is in progress
+    // Hashes passed to add() but not (yet) to add_committed().  Stores that fail never get
+    // committed, so this is also cleared by each finish_rebuild(); it is protected by
+    // pending_mutex_ when holding a shared lock on mutex_, or by a unique lock on mutex_ alone.
+    std::mutex pending_mutex_;
+    std::unordered_multiset<std::string> pending_;
+    uint64_t capacity_ = 0;
+    std::atomic<uint64_t> added_ = 0;  // Approximate number of elements in the current filter
+
+  public:
+    // Returns true once the filter has been built; before that `maybe_contains` always returns
+    // true.
+    bool ready() const;
+
+    // Returns true if the filter is not built yet, or has had more elements added than it was
+    // sized for (and so has a degraded false positive rate).
+    bool needs_rebuild() const;
+
+    void add(std::string_view hash);
+    void add_committed(std::string_view hash);
+
+    bool maybe_contains(std::string_view hash) const;
+
+    // Starts a rebuild with a new, empty filter sized for `capacity` elements.  Returns false
+    // (and does nothing) if a rebuild is already in progress.
+    bool begin_rebuild(uint64_t capacity);
+    void add_rebuilt(std::string_view hash);
+    // Replaces the current filter with the rebuilt one; `count` is the number of hashes that were
+    // passed to add_rebuilt().
+    void finish_rebuild(uint64_t count);
+    // Abandons a rebuild (e.g. because of a database error), keeping the current filter.
+    void abort_rebuild();
+};
+
+}  // namespace oxenss
@@ -0,0 +1,376 @@
+#include "memory_store.hpp"
+
+#include <oxenss/utils/random.hpp>
+#include <oxenss/utils/time.hpp>
+
+#include <mutex>
+
+namespace oxenss {
+
+MemoryStore::MemoryStore(std::set<namespace_id> namespaces, size_t max_bytes) :
+        namespaces_{std::move(namespaces)}, max_bytes_{max_bytes} {}
+
+message MemoryStore::to_message(const std::string& hash, const entry& e, bool with_pubkey) {
+    message msg{hash, e.ns, e.timestamp, e.expiry, e.data};
+    if (with_pubkey)
+        msg.pubkey = e.owner;
+    return msg;
+}
+
+void MemoryStore::set_expiry(message_map::iterator it, time_point expiry) {
+    auto& e = it->second;
+    expiries_.erase(e.by_expiry);
+    e.expiry = expiry;
+    e.by_expiry = expiries_.emplace(expiry, &it->first);
+}
+
+void MemoryStore::erase(message_map::iterator it, bool prune) {
+    auto& [hash, e] = *it;
+    expiries_.erase(e.by_expiry);
+    if (auto o = owners_.find(e.owner); o != owners_.end()) {
+        o->second.erase(std::pair{e.ns, e.seq});
+        if (prune && o->second.empty())
+            owners_.erase(o);
+    }
+    bytes_ -= entry_size(hash, e.data);
+    messages_.erase(it);
+}
+
+template <typename Pred>
+std::vector<std::pair<namespace_id, std::string>> MemoryStore::erase_if(
+        const user_pubkey& owner, Pred pred) {
+    std::vector<std::pair<namespace_id, std::string>> removed;
+    auto o = owners_.find(owner);
+    if (o == owners_.end())
+        return removed;
+    auto& index = o->second;
+    for (auto i = index.begin(); i != index.end();) {
+        auto it = messages_.find(*i->second);
+        ++i;  // erase() invalidates the index entry
+        if (pred(it->first, it->second)) {
+            removed.emplace_back(it->second.ns, it->first);
+            erase(it, /*prune=*/false);
+        }
+    }
+    if (index.empty())
+        owners_.erase(o);
+    return removed;
+}
+
+MemoryStore::message_map::iterator MemoryStore::find(
+        const user_pubkey& owner, const std::string& hash) {
+    auto it = messages_.find(hash);
+    if (it != messages_.end() && !(it->second.owner == owner))
+        it = messages_.end();
+    return it;
+}
+
+MemoryStore::message_map::const_iterator MemoryStore::find(
+        const user_pubkey& owner, const std::string& hash) const {
+    auto it = messages_.find(hash);
+    if (it != messages_.end() && !(it->second.owner == owner))
+        it = messages_.end();
+    return it;
+}
+
+StoreResult MemoryStore::store(const message& msg, time_point* expiry, bool extend) {
+    std::unique_lock lock{mutex_};
+
+    // As in the database, storing to a public namespace replaces whatever was there
+    if (is_public_outbox_namespace(msg.msg_namespace))
+        erase_if(msg.pubkey, [&msg](const std::string& hash, const entry& e) {
+            return e.ns == msg.msg_namespace && hash != msg.hash;
+        });
+
+    if (auto it = messages_.find(msg.hash); it != messages_.end()) {
+        auto ret = StoreResult::Exists;
+        if (extend && it->second.expiry < msg.expiry) {
+            set_expiry(it, msg.expiry);
+            ret = StoreResult::Extended;
+        }
+        if (expiry)
+            *expiry = it->second.expiry;
+        return ret;
+    }
+
+    auto size = entry_size(msg.hash, msg.data);
+    if (size > max_bytes_)
+        return StoreResult::Full;
+    while (bytes_ + size > max_bytes_ && !expiries_.empty()) {
+        erase(messages_.find(*expiries_.begin()->second));
+        evicted_++;
+    }
+
+    auto [it, inserted] = messages_.emplace(
+            msg.hash,
+            entry{msg.pubkey,
+                  msg.msg_namespace,
+                  next_seq_++,
+                  msg.timestamp,
+                  msg.expiry,
+                  msg.data,
+                  expiries_.end()});
+    it->second.by_expiry = expiries_.emplace(msg.expiry, &it->first);
+    owners_[msg.pubkey].emplace(std::pair{msg.msg_namespace, it->second.seq}, &it->first);
+    bytes_ += size;
+
+    if (expiry)
+        *expiry = msg.expiry;
+    return StoreResult::New;
+}
+
+std::pair<MessageList, bool> MemoryStore::retrieve(
+        const user_pubkey& pubkey,
+        namespace_id ns,
+        const std::string& last_hash,
+        std::optional<size_t> max_results,
+        std::optional<size_t> max_size,
+        bool size_b64,
+        size_t per_message_overhead) const {
+    if (max_results && *max_results < 1)
+        max_results = 1;
+
+    std::pair<MessageList, bool> result{};
+    auto& [results, more] = result;
+
+    std::shared_lock lock{mutex_};
+    auto o = owners_.find(pubkey);
+    if (o == owners_.end())
+        return result;
+    auto& index = o->second;
+
+    auto start = index.lower_bound(std::pair{ns, uint64_t{0}});
+    if (!last_hash.empty())
+        if (auto it = find(pubkey, last_hash); it != messages_.end() && it->second.ns == ns)
+            start = index.upper_bound(std::pair{ns, it->second.seq});
+
+    auto now = std::chrono::system_clock::now();
+    size_t agg_size = 0;
+    for (auto i = start; i != index.end() && i->first.first == ns; ++i) {
+        auto& hash = *i->second;
+        auto& e = messages_.find(hash)->second;
+        if (e.expiry <= now)
+            continue;
+        if (max_results && results.size() >= *max_results) {
+            more = true;
+            break;
+        }
+        if (max_size) {
+            agg_size += per_message_overhead;
+            agg_size += hash.size();
+            agg_size += size_b64 ? e.data.size() * 4 / 3 : e.data.size();
+            if (!results.empty() && agg_size > *max_size) {
+                more = true;
+                break;
+            }
+        }
+        results.add(hash, e.ns, e.timestamp, e.expiry, e.data);
+    }
+
+    return result;
+}
+
+std::vector<message> MemoryStore::messages(
+        const std::function<bool(const user_pubkey&)>& owner_filter) const {
+    std::vector<message> result;
+    auto now = std::chrono::system_clock::now();
+    std::shared_lock lock{mutex_};
+    for (auto& [owner, index] : owners_) {
+        if (owner_filter && !owner_filter(owner))
+            continue;
+        for (auto& [key, hash] : index) {
+            auto& e = messages_.find(*hash)->second;
+            if (e.expiry > now)
+                result.push_back(to_message(*hash, e, /*with_pubkey=*/true));
+        }
+    }
+    return result;
+}
+
+std::optional<message> MemoryStore::retrieve_by_hash(const std::string& hash) const {
+    std::shared_lock lock{mutex_};
+    if (auto it = messages_.find(hash); it != messages_.end())
+        return to_message(it->first, it->second, /*with_pubkey=*/true);
+    return std::nullopt;
+}
+
+std::optional<message> MemoryStore::retrieve_random() const {
+    auto now = std::chrono::system_clock::now();
+    std::shared_lock lock{mutex_};
+    if (messages_.empty())
+        return std::nullopt;
+
+    // Probe random buckets; an unordered_map keeps its load factor at most 1, so we will usually
+    // find a non-empty one within a few tries.
+    auto& rng = util::rng();
+    for (int i = 0; i < Database::RANDOM_PROBE_ATTEMPTS; i++) {
+        auto b = util::uniform_distribution_portable(rng, messages_.bucket_count());
+        for (auto it = messages_.begin(b); it != messages_.end(b); ++it)
+            if (it->second.expiry > now)
+                return to_message(it->first, it->second, /*with_pubkey=*/true);
+    }
+
+    // Otherwise fall back to whichever unexpired message expires soonest
+    if (auto it = expiries_.upper_bound(now); it != expiries_.end())
+        return to_message(*it->second, messages_.find(*it->second)->second, /*with_pubkey=*/true);
+    return std::nullopt;
+}
+
+std::vector<std::pair<namespace_id, std::string>> MemoryStore::delete_all(
+        const user_pubkey& pubkey) {
+    std::unique_lock lock{mutex_};
+    return erase_if(pubkey, [](const std::string&, const entry&) { return true; });
+}
+
+std::vector<std::string> MemoryStore::delete_all(const user_pubkey& pubkey, namespace_id ns) {
+    std::vector<std::string> hashes;
+    std::unique_lock lock{mutex_};
+    for (auto& removed :
+         erase_if(pubkey, [ns](const std::string&, const entry& e) { return e.ns == ns; }))
+        hashes.push_back(std::move(removed.second));
+    return hashes;
+}
+
+std::vector<std::string> MemoryStore::delete_by_hash(
+        const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) {
+    std::vector<std::string> deleted;
+    std::unique_lock lock{mutex_};
+    for (auto& hash : msg_hashes) {
+        if (auto it = find(pubkey, hash); it != messages_.end()) {
+            erase(it);
+            deleted.push_back(hash);
+        }
+    }
+    return deleted;
+}
+
+std::vector<std::pair<namespace_id, std::string>> MemoryStore::delete_by_timestamp(
+        const user_pubkey& pubkey, time_point timestamp) {
+    std::unique_lock lock{mutex_};
+    return erase_if(pubkey, [timestamp](const std::string&, const entry& e) {
+        return e.timestamp <= timestamp;
+    });
+}
+
+std::vector<std::string> MemoryStore::delete_by_timestamp(
+        const user_pubkey& pubkey, namespace_id ns, time_point timestamp) {
+    std::vector<std::string> hashes;
+    std::unique_lock lock{mutex_};
+    for (auto& removed : erase_if(pubkey, [ns, timestamp](const std::string&, const entry& e) {
+             return e.ns == ns && e.timestamp <= timestamp;
+         }))
+        hashes.push_back(std::move(removed.second));
+    return hashes;
+}
+
+std::vector<std::pair<std::string, std::chrono::system_clock::time_point>>
+MemoryStore::update_expiry(
+        const user_pubkey& pubkey,
+        const std::vector<std::string>& msg_hashes,
+        const std::vector<time_point>& new_exp,
+        bool extend_only,
+        bool shorten_only) {
+    std::vector<std::pair<std::string, time_point>> result;
+    std::unique_lock lock{mutex_};
+    for (size_t i = 0; i < msg_hashes.size(); i++) {
+        auto exp = new_exp.size() == 1 ? new_exp[0] : new_exp[i];
+        auto it = find(pubkey, msg_hashes[i]);
+        if (it == messages_.end() || (extend_only && it->second.expiry >= exp) ||
+            (shorten_only && it->second.expiry <= exp))
+            continue;
+        set_expiry(it, exp);
+        result.emplace_back(msg_hashes[i], exp);
+    }
+    return result;
+}
+
+std::vector<std::pair<namespace_id, std::string>> MemoryStore::update_all_expiries(
+        const user_pubkey& pubkey, time_point new_exp) {
+    std::vector<std::pair<namespace_id, std::string>> result;
+    std::unique_lock lock{mutex_};
+    auto o = owners_.find(pubkey);
+    if (o == owners_.end())
+        return result;
+    for (auto& [key, hash] : o->second) {
+        auto it = messages_.find(*hash);
+        if (it->second.expiry > new_exp) {
+            set_expiry(it, new_exp);
+            result.emplace_back(key.first, *hash);
+        }
+    }
+    return result;
+}
+
+std::vector<std::string> MemoryStore::update_all_expiries(
+        const user_pubkey& pubkey, namespace_id ns, time_point new_exp) {
+    std::vector<std::string> result;
+    std::unique_lock lock{mutex_};
+    auto o = owners_.find(pubkey);
+    if (o == owners_.end())
+        return result;
+    auto& index = o->second;
+    for (auto i = index.lower_bound(std::pair{ns, uint64_t{0}});
+         i != index.end() && i->first.first == ns;
+         ++i) {
+        auto it = messages_.find(*i->second);
+        if (it->second.expiry > new_exp) {
+            set_expiry(it, new_exp);
+            result.push_back(it->first);
+        }
+    }
+    return result;
+}
+
+std::map<std::string, int64_t> MemoryStore::get_expiries(
+        const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) const {
+    std::map<std::string, int64_t> result;
+    std::shared_lock lock{mutex_};
+    for (auto& hash : msg_hashes)
+        if (auto it = find(pubkey, hash); it != messages_.end())
+            result.emplace(hash, to_epoch_ms(it->second.expiry));
+    return result;
+}
+
+int64_t MemoryStore::clean_expired(time_point now) {
+    int64_t removed = 0;
+    std::unique_lock lock{mutex_};
+    while (!expiries_.empty() && expiries_.begin()->first <= now) {
+        erase(messages_.find(*expiries_.begin()->second));
+        removed++;
+    }
+    return removed;
+}
+
+int64_t MemoryStore::message_count() const {
+    std::shared_lock lock{mutex_};
+    return static_cast<int64_t>(messages_.size());
+}
+
+int64_t MemoryStore::owner_count() const {
+    std::shared_lock lock{mutex_};
+    return static_cast<int64_t>(owners_.size());
+}
+
+std::vector<int> MemoryStore::message_counts() const {
+    std::vector<int> counts;
+    std::shared_lock lock{mutex_};
+    counts.reserve(owners_.size());
+    for (auto& [owner, index] : owners_)
+        counts.push_back(static_cast<int>(index.size()));
+    return counts;
+}
+
+std::map<namespace_id, int64_t> MemoryStore::namespace_counts() const {
+    std::map<namespace_id, int64_t> counts;
+    std::shared_lock lock{mutex_};
+    for (auto& [hash, e] : messages_)
+        counts[e.ns]++;
+    return counts;
+}
+
+size_t MemoryStore::bytes() const {
+    std::shared_lock lock{mutex_};
+    return bytes_;
+}
+
+}  // namespace oxenss
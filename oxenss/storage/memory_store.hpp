@@ -0,0 +1,152 @@
+#pragma once
+
+#include "database.hpp"
+
+#include <oxenss/common/message.h>
+#include <oxenss/common/namespace.h>
+#include <oxenss/common/pubkey.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace oxenss {
+
+/// In-memory message store used by Database for the namespaces configured to live in memory (see
+/// Database::enable_memory_tier).  The methods mirror the corresponding Database methods, and have
+/// the same semantics, except that they only ever see the messages held in memory.  All methods
+/// are thread-safe.
+class MemoryStore {
+    using time_point = std::chrono::system_clock::time_point;
+
+    struct entry {
+        user_pubkey owner;
+        namespace_id ns;
+        uint64_t seq;  // Insertion order, which is the retrieval order within owner & namespace
+        time_point timestamp;
+        time_point expiry;
+        std::string data;
+        std::multimap<time_point, const std::string*>::iterator by_expiry;
+    };
+
+    using message_map = std::unordered_map<std::string, entry>;
+
+    const std::set<namespace_id> namespaces_;
+    const size_t max_bytes_;
+
+    mutable std::shared_mutex mutex_;
+    // Messages keyed by hash.  The other indices point at the (node-stable) keys of this map.
+    message_map messages_;
+    // Per-owner index of [namespace, seq] -> hash
+    std::unordered_map<user_pubkey, std::map<std::pair<namespace_id, uint64_t>, const std::string*>>
+            owners_;
+    // Expiry index, used for expiry cleanup and for evicting when full
+    std::multimap<time_point, const std::string*> expiries_;
+    uint64_t next_seq_ = 0;
+    size_t bytes_ = 0;
+    std::atomic<int64_t> evicted_ = 0;
+
+    static size_t entry_size(const std::string& hash, const std::string& data) {
+        return ENTRY_OVERHEAD + hash.size() + data.size();
+    }
+    static message to_message(const std::string& hash, const entry& e, bool with_pubkey);
+    void set_expiry(message_map::iterator it, time_point expiry);
+    // Removes a message from the store and all indices.  If `prune` is true then the owner's index
+    // is also dropped if this leaves it empty.
+    void erase(message_map::iterator it, bool prune = true);
+    // Erases all of an owner's messages for which `pred(hash, entry)` returns true, returning
+    // the [namespace, hash] pairs of the removed messages.
+    template <typename Pred>
+    std::vector<std::pair<namespace_id, std::string>> erase_if(const user_pubkey& owner, Pred pred);
+    // Looks up a message by hash; returns messages_.end() if not found or owned by someone else.
+    message_map::iterator find(const user_pubkey& owner, const std::string& hash);
+    message_map::const_iterator find(const user_pubkey& owner, const std::string& hash) const;
+
+  public:
+    // Approximate per-message memory overhead (beyond the hash and data) of our indices, used when
+    // accounting for memory use against the limit.
+    static constexpr size_t ENTRY_OVERHEAD = 256;
+
+    // Constructs a store holding messages of the given namespaces, using at most (approximately)
+    // `max_bytes` of memory: once full, storing a new message evicts the messages closest to
+    // expiry to make room.
+    MemoryStore(std::set<namespace_id> namespaces, size_t max_bytes);
+
+    // Returns true if messages in the given namespace belong in this store
+    bool handles(namespace_id ns) const { return namespaces_.count(ns) > 0; }
+
+    const std::set<namespace_id>& namespaces() const { return namespaces_; }
+
+    // Like Database::store.  If `extend` is false then an existing message is left as-is (as
+    // Database::bulk_store does) and reported as StoreResult::Exists.
+    StoreResult store(const message& msg, time_point* expiry = nullptr, bool extend = true);
+
+    std::pair<MessageList, bool> retrieve(
+            const user_pubkey& pubkey,
+            namespace_id ns,
+            const std::string& last_hash,
+            std::optional<size_t> max_results,
+            std::optional<size_t> max_size,
+            bool size_b64,
+            size_t per_message_overhead) const;
+
+    // Returns copies of all unexpired messages (including the owner pubkey), grouped by owner.  If
+    // `owner_filter` is set then only the messages of owners it returns true for are included.
+    std::vector<message> messages(
+            const std::function<bool(const user_pubkey&)>& owner_filter = nullptr) const;
+
+    std::optional<message> retrieve_by_hash(const std::string& hash) const;
+
+    // Returns a random unexpired message.  This is not quite uniform: messages that share a hash
+    // table bucket with others are somewhat less likely to be selected.
+    std::optional<message> retrieve_random() const;
+
+    std::vector<std::pair<namespace_id, std::string>> delete_all(const user_pubkey& pubkey);
+    std::vector<std::string> delete_all(const user_pubkey& pubkey, namespace_id ns);
+    std::vector<std::string> delete_by_hash(
+            const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes);
+    std::vector<std::pair<namespace_id, std::string>> delete_by_timestamp(
+            const user_pubkey& pubkey, time_point timestamp);
+    std::vector<std::string> delete_by_timestamp(
+            const user_pubkey& pubkey, namespace_id ns, time_point timestamp);
+
+    std::vector<std::pair<std::string, time_point>> update_expiry(
+            const user_pubkey& pubkey,
+            const std::vector<std::string>& msg_hashes,
+            const std::vector<time_point>& new_exp,
+            bool extend_only,
+            bool shorten_only);
+    std::vector<std::pair<namespace_id, std::string>> update_all_expiries(
+            const user_pubkey& pubkey, time_point new_exp);
+    std::vector<std::string> update_all_expiries(
+            const user_pubkey& pubkey, namespace_id ns, time_point new_exp);
+
+    std::map<std::string, int64_t> get_expiries(
+            const user_pubkey& pubkey, const std::vector<std::string>& msg_hashes) const;
+
+    // Removes messages with an expiry <= now, returning the number removed.
+    int64_t clean_expired(time_point now = std::chrono::system_clock::now());
+
+    int64_t message_count() const;
+    int64_t owner_count() const;
+    std::vector<int> message_counts() const;
+    std::map<namespace_id, int64_t> namespace_counts() const;
+
+    // Approximate memory currently used by stored messages
+    size_t bytes() const;
+    size_t max_bytes() const { return max_bytes_; }
+
+    // Number of messages evicted to make room for new ones
+    int64_t evicted() const { return evicted_; }
+};
+
+}  // namespace oxenss
@@ -0,0 +1,68 @@
+#include "message_list.hpp"
+
+#include <cstring>
+#include <utility>
+
+namespace oxenss {
+
+// The moved-from list mustn't keep pointing into the (now someone else's) current block, or adding
+// to it would write over the other list's messages.
+MessageList::MessageList(MessageList&& other) noexcept :
+        msgs_{std::move(other.msgs_)},
+        blocks_{std::move(other.blocks_)},
+        free_{std::exchange(other.free_, nullptr)},
+        avail_{std::exchange(other.avail_, 0)} {
+    other.msgs_.clear();
+    other.blocks_.clear();
+}
+
+MessageList& MessageList::operator=(MessageList&& other) noexcept {
+    if (this != &other) {
+        msgs_ = std::move(other.msgs_);
+        blocks_ = std::move(other.blocks_);
+        free_ = std::exchange(other.free_, nullptr);
+        avail_ = std::exchange(other.avail_, 0);
+        other.msgs_.clear();
+        other.blocks_.clear();
+    }
+    return *this;
+}
+
+const message_ref& MessageList::add(
+        std::string_view hash,
+        namespace_id ns,
+        std::chrono::system_clock::time_point timestamp,
+        std::chrono::system_clock::time_point expiry,
+        std::string_view data) {
+    auto h = copy(hash);
+    auto d = copy(data);
+    msgs_.push_back({h, ns, timestamp, expiry, d});
+    return msgs_.back();
+}
+
+char* MessageList::new_block(size_t size) {
+    // (Not make_unique, which would zero it first)
+    return blocks_.emplace_back(std::unique_ptr<char[]>{new char[size]}).get();
+}
+
+std::string_view MessageList::copy(std::string_view s) {
+    if (s.empty())
+        return {};
+    char* dest;
+    if (s.size() > BLOCK_SIZE / 4) {
+        // Big enough to get its own block, leaving the current one for the small stuff
+        dest = new_block(s.size());
+    } else {
+        if (s.size() > avail_) {
+            free_ = new_block(BLOCK_SIZE);
+            avail_ = BLOCK_SIZE;
+        }
+        dest = free_;
+        free_ += s.size();
+        avail_ -= s.size();
+    }
+    std::memcpy(dest, s.data(), s.size());
+    return {dest, s.size()};
+}
+
+}  // namespace oxenss
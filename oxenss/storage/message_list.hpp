@@ -0,0 +1,74 @@
+#pragma once
+
+#include <oxenss/common/message.h>
+#include <oxenss/common/namespace.h>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace oxenss {
+
+/// A message returned by a retrieve: like `message`, but without the owner pubkey, and with the
+/// hash and data being views into the MessageList holding it.
+struct message_ref {
+    std::string_view hash;
+    namespace_id msg_namespace;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::system_clock::time_point expiry;
+    std::string_view data;
+};
+
+/// The messages of a single retrieve.  Rather than each message holding its own heap-allocated
+/// hash and data strings, they are all copied into a per-list arena of large blocks, so that a
+/// retrieve of many messages makes a handful of allocations instead of a couple per message.
+/// Views into the arena stay valid as messages are added and when the list is moved (which leaves
+/// the moved-from list empty, and usable again); the list itself can't be copied (as the copies'
+/// views would point into the original).
+class MessageList {
+  public:
+    // Arena block size; hashes and data larger than a quarter of this get a block of their own
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    using const_iterator = std::vector<message_ref>::const_iterator;
+
+    MessageList() = default;
+    MessageList(MessageList&& other) noexcept;
+    MessageList& operator=(MessageList&& other) noexcept;
+    MessageList(const MessageList&) = delete;
+    MessageList& operator=(const MessageList&) = delete;
+
+    // Adds a message, copying its hash and data into the arena.
+    const message_ref& add(
+            std::string_view hash,
+            namespace_id ns,
+            std::chrono::system_clock::time_point timestamp,
+            std::chrono::system_clock::time_point expiry,
+            std::string_view data);
+
+    void reserve(size_t count) { msgs_.reserve(count); }
+
+    size_t size() const { return msgs_.size(); }
+    bool empty() const { return msgs_.empty(); }
+    const message_ref& operator[](size_t i) const { return msgs_[i]; }
+    const message_ref& front() const { return msgs_.front(); }
+    const message_ref& back() const { return msgs_.back(); }
+    const_iterator begin() const { return msgs_.begin(); }
+    const_iterator end() const { return msgs_.end(); }
+
+    // Returns the number of arena blocks allocated
+    size_t blocks() const { return blocks_.size(); }
+
+  private:
+    std::vector<message_ref> msgs_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* free_ = nullptr;  // The unused part of the current (last regular-sized) block
+    size_t avail_ = 0;
+
+    char* new_block(size_t size);
+    std::string_view copy(std::string_view s);
+};
+
+}  // namespace oxenss
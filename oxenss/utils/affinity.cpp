@@ -0,0 +1,108 @@
+#include "affinity.hpp"
+
+#include <oxen/log.hpp>
+
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace oxenss::util {
+
+static auto logcat = oxen::log::Cat("threads");
+
+std::vector<unsigned> allowed_cpus() {
+    std::vector<unsigned> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (unsigned i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+#endif
+    return cpus;
+}
+
+std::vector<unsigned> numa_node_cpus(unsigned node) {
+    std::ifstream in{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+    std::string list;
+    if (!in || !std::getline(in, list))
+        return {};
+    try {
+        return parse_cpu_list(list);
+    } catch (const std::invalid_argument&) {
+        return {};
+    }
+}
+
+static unsigned parse_cpu(std::string_view s) {
+    unsigned cpu;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), cpu);
+    if (ec != std::errc{} || end != s.data() + s.size())
+        throw std::invalid_argument{"Invalid CPU list: bad CPU number '" + std::string{s} + "'"};
+    return cpu;
+}
+
+std::vector<unsigned> parse_cpu_list(std::string_view list) {
+    while (!list.empty() && (list.back() == '\n' || list.back() == ' '))
+        list.remove_suffix(1);
+    std::vector<unsigned> cpus;
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        auto range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+
+        if (auto dash = range.find('-'); dash != std::string_view::npos) {
+            auto first = parse_cpu(range.substr(0, dash)), last = parse_cpu(range.substr(dash + 1));
+            if (last < first)
+                throw std::invalid_argument{"Invalid CPU list: bad range " + std::string{range}};
+            for (auto cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        } else {
+            cpus.push_back(parse_cpu(range));
+        }
+    }
+    return cpus;
+}
+
+bool pin_this_thread(const std::vector<unsigned>& cpus) {
+    if (cpus.empty())
+        return false;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+CpuPlanner::CpuPlanner(std::vector<unsigned> cpus) : cpus_{std::move(cpus)} {}
+
+thread_init CpuPlanner::pin(std::string name) {
+    if (cpus_.empty())
+        return [](size_t) {};
+    // Threads get their CPUs in the order they start, which doesn't much matter; what matters is
+    // that each pool's threads are spread over distinct CPUs.
+    return [this, name = std::move(name)](size_t i) {
+        unsigned cpu;
+        {
+            std::lock_guard lock{mutex_};
+            cpu = cpus_[next_++ % cpus_.size()];
+        }
+        if (pin_this_thread({cpu}))
+            oxen::log::debug(logcat, "Pinned {} thread {} to CPU {}", name, i, cpu);
+        else
+            oxen::log::warning(logcat, "Failed to pin {} thread {} to CPU {}", name, i, cpu);
+    };
+}
+
+}  // namespace oxenss::util
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace oxenss::util {
+
+/// Called at the start of each of a thread pool's threads with the thread's index in the pool, to
+/// let it set up the thread (e.g. pin it to a core).
+using thread_init = std::function<void(size_t i)>;
+
+/// Returns the CPUs that this process is allowed to run on (empty if that can't be determined).
+std::vector<unsigned> allowed_cpus();
+
+/// Returns the CPUs of NUMA node `node`, according to /sys (empty if there is no such node).
+std::vector<unsigned> numa_node_cpus(unsigned node);
+
+/// Parses a Linux-style CPU list, such as "0-3,8,10-11".  Throws std::invalid_argument if
+/// malformed.
+std::vector<unsigned> parse_cpu_list(std::string_view list);
+
+/// Pins the calling thread to the given CPUs.  Returns false (without changing anything) on
+/// failure or if `cpus` is empty.
+bool pin_this_thread(const std::vector<unsigned>& cpus);
+
+/// Hands out CPUs to the threads of our thread pools, so that pools pinned to cores get their own
+/// where possible: each thread gets the next CPU in turn, wrapping around (and so sharing CPUs
+/// with earlier threads) if there are more threads than CPUs.  Without any CPUs (i.e. when not
+/// pinning), the thread_init functions it hands out do nothing.
+class CpuPlanner {
+  public:
+    explicit CpuPlanner(std::vector<unsigned> cpus = {});
+
+    /// Returns a thread_init for the pool `name` that pins each of its threads to one CPU.  The
+    /// planner must outlive the startup of the pool's threads.
+    thread_init pin(std::string name);
+
+    bool enabled() const { return !cpus_.empty(); }
+
+  private:
+    const std::vector<unsigned> cpus_;
+    std::mutex mutex_;
+    size_t next_ = 0;
+};
+
+}  // namespace oxenss::util
@@ -0,0 +1,62 @@
+#include "buffer_pool.hpp"
+
+namespace oxenss::util {
+
+// Size class `i` holds buffers with a capacity of at least MIN_BUFFER << i
+static constexpr size_t class_size(size_t i) {
+    return BufferPool::MIN_BUFFER << i;
+}
+
+BufferPool::BufferPool(size_t max_buffer, size_t max_retained) :
+        classes_{1}, max_retained_{max_retained} {
+    while (classes_ < MAX_CLASSES && class_size(classes_) <= max_buffer)
+        classes_++;
+}
+
+std::string BufferPool::acquire(size_t size) {
+    // The smallest class that fits `size`
+    size_t cls = 0;
+    while (cls < classes_ && class_size(cls) < size)
+        cls++;
+
+    std::string buf;
+    if (cls < classes_) {
+        std::lock_guard lock{mutex_};
+        if (auto& free = free_[cls]; !free.empty()) {
+            buf = std::move(free.back());
+            free.pop_back();
+            buffers_--;
+            retained_ -= buf.capacity();
+            reused_++;
+            return buf;
+        }
+        allocated_++;
+    }
+    buf.reserve(cls < classes_ ? class_size(cls) : size);
+    return buf;
+}
+
+void BufferPool::release(std::string buf) {
+    auto cap = buf.capacity();
+    if (cap < MIN_BUFFER || cap >= class_size(classes_))
+        return;
+    // The largest class whose size the buffer satisfies
+    size_t cls = 0;
+    while (cls + 1 < classes_ && class_size(cls + 1) <= cap)
+        cls++;
+    buf.clear();
+
+    std::lock_guard lock{mutex_};
+    if (retained_ + cap > max_retained_)
+        return;
+    free_[cls].push_back(std::move(buf));
+    buffers_++;
+    retained_ += cap;
+}
+
+BufferPool::stats BufferPool::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return {buffers_, retained_, reused_, allocated_};
+}
+
+}  // namespace oxenss::util
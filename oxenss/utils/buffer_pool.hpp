@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace oxenss::util {
+
+/// Thread-safe pool of string buffers, for data (such as incoming request bodies) that would
+/// otherwise be allocated and grown afresh for every request.  Buffers are kept in power-of-two
+/// size classes from MIN_BUFFER up to a maximum size; larger buffers, and buffers beyond a limit
+/// on the total memory held, are freed rather than pooled so that the pool's memory use stays
+/// bounded.
+class BufferPool {
+  public:
+    static constexpr size_t MIN_BUFFER = 4096;
+    static constexpr size_t MAX_CLASSES = 16;
+
+    /// \param max_buffer the largest buffer size to pool (rounded down to a power of two)
+    /// \param max_retained the maximum total capacity of the buffers held for reuse
+    explicit BufferPool(size_t max_buffer = 1024 * 1024, size_t max_retained = 64 * 1024 * 1024);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /// Returns an empty string with a capacity of at least `size`, reusing a released buffer if
+    /// one of the right size class is available.
+    std::string acquire(size_t size);
+
+    /// Returns a buffer to the pool for reuse by a later `acquire()` (or frees it if it is too
+    /// small or large to pool, or the pool is full).
+    void release(std::string buf);
+
+    struct stats {
+        size_t buffers = 0;      // buffers held for reuse
+        size_t retained = 0;     // total capacity of those buffers
+        uint64_t reused = 0;     // acquisitions served by a pooled buffer
+        uint64_t allocated = 0;  // acquisitions that had to allocate
+    };
+    stats get_stats() const;
+
+  private:
+    size_t classes_;
+    const size_t max_retained_;
+
+    mutable std::mutex mutex_;
+    std::array<std::vector<std::string>, MAX_CLASSES> free_;
+    size_t buffers_ = 0, retained_ = 0;
+    uint64_t reused_ = 0, allocated_ = 0;
+};
+
+}  // namespace oxenss::util
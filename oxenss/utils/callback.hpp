@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "object_pool.hpp"
+
+namespace oxenss::util {
+
+template <typename Signature>
+class callback;
+
+/// Move-only replacement for `std::function`, for the callbacks that carry a request's reply
+/// through the request pipeline.  Unlike `std::function` the callable does not need to be
+/// copyable (so callbacks can capture other callbacks, unique_ptrs, etc. by move), and callables
+/// of up to INLINE_SIZE bytes (rather than the 16 of libstdc++'s `std::function`, which most
+/// capturing lambdas exceed) are stored inline rather than on the heap.  Larger ones go into a
+/// block from the per-thread pools of object_pool.hpp.
+///
+/// Invoking an empty callback throws `std::bad_function_call`.
+template <typename R, typename... Args>
+class callback<R(Args...)> {
+  public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+    callback() noexcept = default;
+    callback(std::nullptr_t) noexcept {}
+
+    template <
+            typename F,
+            typename Fn = std::decay_t<F>,
+            typename = std::enable_if_t<
+                    !std::is_same_v<Fn, callback> && std::is_invocable_r_v<R, Fn&, Args...>>>
+    callback(F&& f) {
+        if constexpr (std::is_pointer_v<Fn> || std::is_member_pointer_v<Fn> ||
+                      std::is_constructible_v<bool, const Fn&>) {
+            // Function pointers and things like std::function can be empty
+            if (!f)
+                return;
+        }
+        if constexpr (stored_inline<Fn>) {
+            new (storage_) Fn{std::forward<F>(f)};
+        } else {
+            static_assert(alignof(Fn) <= alignof(std::max_align_t));
+            void* p = pool_allocate(sizeof(Fn));
+            try {
+                new (p) Fn{std::forward<F>(f)};
+            } catch (...) {
+                pool_deallocate(p, sizeof(Fn));
+                throw;
+            }
+            new (storage_) Fn*{static_cast<Fn*>(p)};
+        }
+        ops_ = &ops_for<Fn>;
+    }
+
+    callback(callback&& other) noexcept { take(other); }
+
+    callback& operator=(callback&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    callback& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    callback(const callback&) = delete;
+    callback& operator=(const callback&) = delete;
+
+    ~callback() { reset(); }
+
+    explicit operator bool() const noexcept { return ops_; }
+
+    /// True if the callable is stored inline (i.e. the callback did not need an allocation).
+    bool is_inline() const noexcept { return ops_ && ops_->inline_storage; }
+
+    R operator()(Args... args) const {
+        if (!ops_)
+            throw std::bad_function_call{};
+        return ops_->invoke(storage_, std::forward<Args>(args)...);
+    }
+
+  private:
+    template <typename Fn>
+    static constexpr bool stored_inline = sizeof(Fn) <= INLINE_SIZE &&
+                                          alignof(Fn) <= alignof(std::max_align_t) &&
+                                          std::is_nothrow_move_constructible_v<Fn>;
+
+    struct ops {
+        R (*invoke)(void* storage, Args&&... args);
+        // Moves the callable from `from` into (uninitialized) `to`, destroying it in `from`
+        void (*move)(void* from, void* to) noexcept;
+        void (*destroy)(void* storage) noexcept;
+        bool inline_storage;
+    };
+
+    template <typename Fn>
+    static Fn& get(void* storage) noexcept {
+        if constexpr (stored_inline<Fn>)
+            return *std::launder(reinterpret_cast<Fn*>(storage));
+        else
+            return **std::launder(reinterpret_cast<Fn**>(storage));
+    }
+
+    template <typename Fn>
+    static constexpr ops ops_for{
+            [](void* storage, Args&&... args) -> R {
+                if constexpr (std::is_void_v<R>)
+                    std::invoke(get<Fn>(storage), std::forward<Args>(args)...);
+                else
+                    return std::invoke(get<Fn>(storage), std::forward<Args>(args)...);
+            },
+            [](void* from, void* to) noexcept {
+                if constexpr (stored_inline<Fn>) {
+                    auto& f = get<Fn>(from);
+                    new (to) Fn{std::move(f)};
+                    f.~Fn();
+                } else {
+                    // Just the pointer changes hands
+                    new (to) Fn*{&get<Fn>(from)};
+                }
+            },
+            [](void* storage) noexcept {
+                if constexpr (stored_inline<Fn>) {
+                    get<Fn>(storage).~Fn();
+                } else {
+                    auto* f = &get<Fn>(storage);
+                    f->~Fn();
+                    pool_deallocate(f, sizeof(Fn));
+                }
+            },
+            stored_inline<Fn>};
+
+    void take(callback& other) noexcept {
+        if (other.ops_) {
+            other.ops_->move(other.storage_, storage_);
+            ops_ = std::exchange(other.ops_, nullptr);
+        }
+    }
+
+    void reset() noexcept {
+        if (ops_)
+            std::exchange(ops_, nullptr)->destroy(storage_);
+    }
+
+    // Mutable because, as with std::function, invoking a const callback may modify the callable
+    // (e.g. a mutable lambda)
+    alignas(std::max_align_t) mutable unsigned char storage_[INLINE_SIZE];
+    const ops* ops_ = nullptr;
+};
+
+}  // namespace oxenss::util
@@ -0,0 +1,101 @@
+#include "latency.hpp"
+
+#include <cmath>
+#include <utility>
+
+namespace oxenss::util {
+
+size_t LatencyHistogram::bucket(uint64_t us) {
+    if (us < SUB_BUCKETS)
+        return us;
+    if (us >= uint64_t{1} << MAX_BITS)
+        return BUCKETS - 1;
+    int msb = 63 - __builtin_clzll(us);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + ((us >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucket_value(size_t i) {
+    if (i < SUB_BUCKETS)
+        return i;
+    int shift = i / SUB_BUCKETS - 1;
+    uint64_t low = (SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+    return low + (uint64_t{1} << shift) / 2;
+}
+
+LatencyHistogram::snapshot LatencyHistogram::get() const {
+    snapshot s;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        s.count += s.counts[i];
+    }
+    s.sum_us = sum_us_.load(std::memory_order_relaxed);
+    return s;
+}
+
+LatencyHistogram::snapshot& LatencyHistogram::snapshot::operator+=(const snapshot& other) {
+    for (size_t i = 0; i < BUCKETS; i++)
+        counts[i] += other.counts[i];
+    count += other.count;
+    sum_us += other.sum_us;
+    return *this;
+}
+
+LatencyHistogram::snapshot& LatencyHistogram::snapshot::operator-=(const snapshot& earlier) {
+    for (size_t i = 0; i < BUCKETS; i++)
+        counts[i] -= earlier.counts[i];
+    count -= earlier.count;
+    sum_us -= earlier.sum_us;
+    return *this;
+}
+
+std::chrono::microseconds LatencyHistogram::snapshot::percentile(double p) const {
+    if (!count)
+        return 0us;
+    auto rank = static_cast<uint64_t>(std::ceil(p * count));
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::chrono::microseconds{bucket_value(i)};
+    }
+    return std::chrono::microseconds{bucket_value(BUCKETS - 1)};
+}
+
+static thread_local request_scope* current_scope = nullptr;
+
+request_scope::request_scope(endpoint_latency* ep, std::chrono::steady_clock::time_point queued) :
+        endpoint_{ep},
+        created_{std::chrono::steady_clock::now()},
+        queued_{queued},
+        prev_{current_scope} {
+    if (queued_ == std::chrono::steady_clock::time_point{} && endpoint_ && prev_ &&
+        !prev_->endpoint_)
+        queued_ = std::exchange(prev_->queued_, std::chrono::steady_clock::time_point{});
+    if (endpoint_ && queued_ != std::chrono::steady_clock::time_point{})
+        endpoint_->record(latency_stage::queue, created_ - queued_);
+    current_scope = this;
+}
+
+request_scope::~request_scope() {
+    current_scope = prev_;
+}
+
+stage_timer::stage_timer(latency_stage stage) : stage_{stage} {
+    auto bit = uint8_t{1} << static_cast<int>(stage);
+    if (!current_scope || !current_scope->endpoint_ || (current_scope->active_ & bit))
+        return;
+    scope_ = current_scope;
+    scope_->active_ |= bit;
+    started_ = std::chrono::steady_clock::now();
+}
+
+stage_timer::~stage_timer() {
+    if (!scope_)
+        return;
+    scope_->endpoint_->record(stage_, std::chrono::steady_clock::now() - started_);
+    scope_->active_ &= ~(uint8_t{1} << static_cast<int>(stage_));
+}
+
+}  // namespace oxenss::util
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace oxenss::util {
+
+using namespace std::literals;
+
+/// The parts of handling a request that we time separately.  `total` is the whole thing, from
+/// queueing (if known) through to the response being serialized.
+enum class latency_stage : uint8_t { queue, parse, auth, db, swarm, serialize, total };
+inline constexpr size_t LATENCY_STAGES = 7;
+
+constexpr std::string_view to_string(latency_stage s) {
+    switch (s) {
+        case latency_stage::queue: return "queue"sv;
+        case latency_stage::parse: return "parse"sv;
+        case latency_stage::auth: return "auth"sv;
+        case latency_stage::db: return "db"sv;
+        case latency_stage::swarm: return "swarm"sv;
+        case latency_stage::serialize: return "serialize"sv;
+        case latency_stage::total: break;
+    }
+    return "total"sv;
+}
+
+/// Lock-free latency histogram with logarithmic buckets, each power of two being split into
+/// 2^SUB_BITS linear sub-buckets (as in HDR histograms), so that recorded values are kept with a
+/// relative error of at most 1/2^SUB_BITS.  Values are recorded in microseconds; anything above
+/// ~67s goes into the last bucket.
+class LatencyHistogram {
+  public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int MAX_BITS = 26;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    /// A plain copy of a histogram's counts, for reporting
+    struct snapshot {
+        std::array<uint64_t, BUCKETS> counts{};
+        uint64_t count = 0;
+        uint64_t sum_us = 0;
+
+        snapshot& operator+=(const snapshot& other);
+        // Subtracts an earlier snapshot of the same histogram, leaving the values recorded since
+        snapshot& operator-=(const snapshot& earlier);
+
+        /// Returns the (approximate) value below which the fraction `p` of values lie
+        std::chrono::microseconds percentile(double p) const;
+        std::chrono::microseconds mean() const {
+            return std::chrono::microseconds{count ? sum_us / count : 0};
+        }
+    };
+
+    void record(std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        if (us < 0)
+            us = 0;
+        counts_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    /// Returns the current counts.  Histograms are never reset: to get the values recorded over
+    /// some period, subtract a snapshot taken at its start.
+    snapshot get() const;
+
+    /// Returns the bucket holding value `us`
+    static size_t bucket(uint64_t us);
+    /// Returns the midpoint of the values held in bucket `i`
+    static uint64_t bucket_value(size_t i);
+
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> sum_us_{0};
+};
+
+/// The latencies of the stages of one request endpoint
+struct endpoint_latency {
+    std::array<LatencyHistogram, LATENCY_STAGES> stages;
+
+    void record(latency_stage s, std::chrono::steady_clock::duration d) {
+        stages[static_cast<size_t>(s)].record(d);
+    }
+};
+
+/// While alive, attributes the time spent in `stage_timer`s on this thread to endpoint `ep`.  If
+/// `queued` is given then the time since then is recorded as the queue stage of the request, and
+/// is included in `started()`.
+///
+/// The transport handling a request, which doesn't know the endpoint yet, uses a scope without an
+/// endpoint to pass along when the request was queued: the first endpoint scope opened inside it
+/// takes over its `queued` time.
+class request_scope {
+  public:
+    explicit request_scope(
+            endpoint_latency* ep, std::chrono::steady_clock::time_point queued = {});
+    ~request_scope();
+
+    request_scope(const request_scope&) = delete;
+    request_scope& operator=(const request_scope&) = delete;
+
+    /// When this request started: the queue time, if known, otherwise the scope creation time.
+    std::chrono::steady_clock::time_point started() const {
+        return queued_ != std::chrono::steady_clock::time_point{} ? queued_ : created_;
+    }
+
+  private:
+    friend class stage_timer;
+
+    endpoint_latency* endpoint_;
+    std::chrono::steady_clock::time_point created_, queued_;
+    uint8_t active_ = 0;  // bitmask of the stages with a stage_timer currently running
+    request_scope* prev_;
+};
+
+/// Times a stage of the request of the current thread's request_scope, if any, recording the
+/// duration when destroyed.  If a timer for the same stage is already running (e.g. a database
+/// call made while another one is being timed) then this one does nothing, so that time doesn't
+/// get counted twice.
+class stage_timer {
+  public:
+    explicit stage_timer(latency_stage stage);
+    stage_timer(stage_timer&& other) noexcept :
+            scope_{other.scope_}, stage_{other.stage_}, started_{other.started_} {
+        other.scope_ = nullptr;
+    }
+    stage_timer(const stage_timer&) = delete;
+    stage_timer& operator=(const stage_timer&) = delete;
+    stage_timer& operator=(stage_timer&&) = delete;
+    ~stage_timer();
+
+  private:
+    request_scope* scope_ = nullptr;
+    latency_stage stage_;
+    std::chrono::steady_clock::time_point started_;
+};
+
+}  // namespace oxenss::util
@@ -0,0 +1,19 @@
+#include "memory.hpp"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace oxenss::util {
+
+std::optional<size_t> malloc_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto mi = mallinfo2();
+    // Allocated from the main heap, plus allocations big enough to get their own mmap
+    return mi.uordblks + mi.hblkhd;
+#else
+    return std::nullopt;
+#endif
+}
+
+}  // namespace oxenss::util
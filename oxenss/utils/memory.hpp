@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace oxenss::util {
+
+// Estimates of the heap memory held by standard containers, for the per-subsystem memory
+// accounting in get_stats.  They assume the usual libstdc++/libc++ layouts and don't count
+// allocator overhead, so they somewhat undercount, but they take constant time and grow the same
+// way that the real usage does.  None of them include memory that the elements themselves point
+// to: add that separately where it matters.
+
+/// Heap bytes of a string: nothing unless it is too long for the small string buffer
+inline size_t heap_bytes(const std::string& s) {
+    static const size_t sso = std::string{}.capacity();
+    return s.capacity() > sso ? s.capacity() + 1 : 0;
+}
+
+/// Heap bytes of a vector's element storage
+template <typename T, typename A>
+size_t heap_bytes(const std::vector<T, A>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+/// Heap bytes of a deque: its element blocks (of 512 bytes, or one element if larger) plus the
+/// block map
+template <typename T, typename A>
+size_t heap_bytes(const std::deque<T, A>& d) {
+    constexpr size_t block = sizeof(T) < 512 ? 512 / sizeof(T) * sizeof(T) : sizeof(T);
+    size_t blocks = (d.size() * sizeof(T) + block - 1) / block + 1;
+    return blocks * (block + sizeof(void*));
+}
+
+/// Heap bytes of an unordered_(multi)map or unordered_(multi)set: the bucket array, plus a node
+/// (next pointer, cached hash and value) per element
+template <typename C>
+size_t hashtable_bytes(const C& c) {
+    return c.bucket_count() * sizeof(void*) +
+           c.size() * (sizeof(typename C::value_type) + 2 * sizeof(void*));
+}
+
+/// Heap bytes of a (multi)map or (multi)set: a tree node (three pointers and a colour) per
+/// element
+template <typename C>
+size_t tree_bytes(const C& c) {
+    return c.size() * (sizeof(typename C::value_type) + 4 * sizeof(void*));
+}
+
+/// Returns the bytes currently allocated with malloc (for comparing with the sum of what we
+/// account for), or nullopt if the C library can't tell us.
+std::optional<size_t> malloc_in_use();
+
+}  // namespace oxenss::util
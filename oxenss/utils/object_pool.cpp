@@ -0,0 +1,94 @@
+#include "object_pool.hpp"
+
+#include <array>
+#include <new>
+#include <vector>
+
+namespace oxenss::util {
+
+static constexpr size_t NUM_CLASSES = 4;
+static_assert(MIN_POOLED_SIZE << (NUM_CLASSES - 1) == MAX_POOLED_SIZE);
+
+// The size class of a block of `size` bytes; only meaningful for sizes up to MAX_POOLED_SIZE.
+static size_t size_class(size_t size) {
+    size_t cls = 0;
+    while ((MIN_POOLED_SIZE << cls) < size)
+        cls++;
+    return cls;
+}
+
+namespace {
+    struct free_lists {
+        std::array<std::vector<void*>, NUM_CLASSES> blocks;
+
+        ~free_lists() {
+            for (auto& list : blocks)
+                for (auto* p : list)
+                    ::operator delete(p);
+        }
+    };
+
+    // The thread's free lists are created on first use.  These are all trivially destructible so
+    // that they stay usable while other thread_local objects (whose destructors might free pooled
+    // blocks) are destroyed; once the thread's pool is gone, blocks are just freed.
+    thread_local free_lists* tl_lists = nullptr;
+    thread_local bool tl_done = false;
+    thread_local uint64_t tl_reused = 0, tl_allocated = 0;
+
+    struct pool_cleanup {
+        ~pool_cleanup() {
+            delete tl_lists;
+            tl_lists = nullptr;
+            tl_done = true;
+        }
+    };
+
+    free_lists* thread_lists() {
+        if (!tl_lists && !tl_done) {
+            thread_local pool_cleanup cleanup;
+            tl_lists = new free_lists{};
+            for (auto& list : tl_lists->blocks)
+                list.reserve(MAX_FREE_BLOCKS);
+        }
+        return tl_lists;
+    }
+}  // namespace
+
+void* pool_allocate(size_t size) {
+    if (size > MAX_POOLED_SIZE)
+        return ::operator new(size);
+    auto cls = size_class(size);
+    if (auto* lists = thread_lists(); lists && !lists->blocks[cls].empty()) {
+        auto* p = lists->blocks[cls].back();
+        lists->blocks[cls].pop_back();
+        tl_reused++;
+        return p;
+    }
+    tl_allocated++;
+    return ::operator new(MIN_POOLED_SIZE << cls);
+}
+
+void pool_deallocate(void* p, size_t size) noexcept {
+    // (We don't set up a pool here for a thread that has never allocated from one)
+    if (size <= MAX_POOLED_SIZE) {
+        if (auto* lists = tl_lists) {
+            if (auto& list = lists->blocks[size_class(size)]; list.size() < MAX_FREE_BLOCKS) {
+                list.push_back(p);  // Never reallocates, thanks to the reserve()
+                return;
+            }
+        }
+    }
+    ::operator delete(p);
+}
+
+pool_stats thread_pool_stats() {
+    pool_stats s;
+    s.reused = tl_reused;
+    s.allocated = tl_allocated;
+    if (tl_lists)
+        for (auto& list : tl_lists->blocks)
+            s.free_blocks += list.size();
+    return s;
+}
+
+}  // namespace oxenss::util
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace oxenss::util {
+
+/// Per-thread pools of small memory blocks, for the short-lived objects (callbacks, request state,
+/// and the like) that every request would otherwise allocate and free afresh.  Blocks come in a
+/// few size classes, up to MAX_POOLED_SIZE; each thread keeps up to MAX_FREE_BLOCKS freed blocks
+/// of each class for reuse (freeing any beyond that, and all of them when the thread exits), so
+/// the memory held stays bounded.  A block may be freed on a different thread from the one that
+/// allocated it, in which case it joins the freeing thread's pool (if it has one).
+inline constexpr size_t MIN_POOLED_SIZE = 64;
+inline constexpr size_t MAX_POOLED_SIZE = 512;
+inline constexpr size_t MAX_FREE_BLOCKS = 256;
+
+/// Allocates a block of at least `size` bytes (suitably aligned for any object not over-aligned),
+/// from the calling thread's pool where possible.  Must be freed with `pool_deallocate()`, passing
+/// the same size.
+void* pool_allocate(size_t size);
+
+/// Frees a block allocated by `pool_allocate(size)`.
+void pool_deallocate(void* p, size_t size) noexcept;
+
+struct pool_stats {
+    uint64_t reused = 0;     // allocations served by a pooled block
+    uint64_t allocated = 0;  // allocations that had to allocate
+    size_t free_blocks = 0;  // blocks currently held for reuse
+};
+
+/// Returns the pool statistics of the calling thread.
+pool_stats thread_pool_stats();
+
+/// Allocator drawing from the per-thread pools, for use with `std::allocate_shared` and the like.
+template <typename T>
+struct pool_allocator {
+    using value_type = T;
+
+    pool_allocator() noexcept = default;
+    template <typename U>
+    pool_allocator(const pool_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) noexcept { pool_deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>&) const noexcept {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+/// Like `std::make_shared<T>(args...)`, but the object (and its control block) come from the
+/// per-thread pools.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_pooled(Args&&... args) {
+    return std::allocate_shared<T>(pool_allocator<T>{}, std::forward<Args>(args)...);
+}
+
+}  // namespace oxenss::util
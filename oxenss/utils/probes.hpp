@@ -0,0 +1,56 @@
+#pragma once
+
+/// Static (USDT) tracepoints on our hot paths, for profiling production nodes with bpftrace, perf
+/// or SystemTap, e.g.:
+///
+///     bpftrace -e 'usdt:/usr/bin/oxen-storage:oxenss:request_start /arg1 >= 0/ {
+///         @queued_us[str(arg0)] = hist(arg1); }'
+///
+/// Tracepoints are only compiled in when building with -DENABLE_USDT=ON (which needs
+/// <sys/sdt.h>, from systemtap-sdt-dev or similar); without it OXENSS_PROBE() compiles to nothing.
+/// When compiled in, an inactive tracepoint costs a single nop, plus whatever it takes to compute
+/// its arguments: keep those to values that are already at hand.  Arguments must be integers or
+/// pointers (e.g. to NUL-terminated strings, which tracers can read with str()).
+///
+/// The tracepoints (all in the "oxenss" provider) are:
+///
+/// - request_queued(const char* name): an HTTPS request was queued for a worker thread (OMQ and
+///   QUIC requests are queued inside oxenmq, before we see them).
+/// - request_start(const char* name, int64_t queued_us): a worker thread started handling a
+///   request; `name` is the endpoint (e.g. "sn.data", "monitor.messages", or "retrieve" for a
+///   storage.retrieve request) or "https" for HTTPS requests, and `queued_us` how long it waited
+///   for the worker, when known (-1 otherwise).
+/// - request_done(const char* name): the handler of a request returned (requests answered
+///   asynchronously reply later).
+/// - db_wait(int readonly) and db_acquire(int readonly): a thread asked for a database connection
+///   from the read-only or read-write pool, and got one (the time in between is the time spent
+///   waiting for one to be returned to the pool, or opening a new one).
+/// - db_release(int readonly): a database connection was returned to its pool.
+/// - db_query_start(const char* sql) and db_query_done(const char* sql): a prepared statement was
+///   taken for execution, and was reset after it (the time in between is execution plus reading
+///   results).
+/// - forward_send(const char* method, size_t bytes): a client request was forwarded to a swarm
+///   peer (after any batching, see forward_batch_send).
+/// - forward_batch_send(size_t requests): a batch of forwarded requests was sent to a peer.
+/// - forward_reply(int success, size_t parts): a swarm peer answered (or failed to answer) a
+///   request we forwarded to it.
+/// - onion_decrypt(size_t bytes, int ok): an onion request layer was decrypted (`ok` is 0 if
+///   decryption failed).
+/// - notify_send(size_t connections, size_t bytes): a notification was sent to monitoring
+///   connections (or queued for batching, see notify_batch_send).
+/// - notify_batch_send(size_t bytes): a batch of notifications was sent to a connection.
+/// - relay_push(size_t peers, size_t bytes): a batch of data was queued to be relayed to swarm
+///   peers.
+/// - relay_sent(size_t bytes, int success, int attempts): relaying a batch to one peer completed.
+
+#ifdef OXENSS_USDT
+
+#include <sys/sdt.h>
+
+#define OXENSS_PROBE(name, ...) STAP_PROBEV(oxenss, name, __VA_ARGS__)
+
+#else
+
+#define OXENSS_PROBE(name, ...) ((void)0)
+
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace oxenss::util {
+
+/// Hashed timer wheel: a ring of slots, one per `tick`, holding the values that come due during
+/// that tick.  Adding a value is O(1), and popping the due values costs O(1) per slot passed over
+/// plus O(1) per value looked at, regardless of how many values are scheduled, which (unlike a
+/// heap) keeps scheduling cheap with thousands of entries.  Values scheduled more than a full turn
+/// of the wheel ahead share a slot with nearer ones, and stay there (they're skipped over) until
+/// the wheel comes around to their turn; so the wheel should be sized to cover the usual delays.
+///
+/// Due times are rounded up to the next tick, so a value is never popped before its time.  Not
+/// thread-safe.
+template <typename T>
+class timer_wheel {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /// \param tick the time granularity of the wheel
+    /// \param slots the number of slots (rounded up to a power of two); the wheel covers delays of
+    /// up to `tick * slots` without slots being shared between turns.
+    timer_wheel(clock::duration tick, size_t slots, clock::time_point start = clock::now()) :
+            tick_{tick}, start_{start} {
+        size_t n = 1;
+        while (n < slots)
+            n <<= 1;
+        slots_.resize(n);
+        mask_ = n - 1;
+    }
+
+    /// Schedules `value` to come due at `when`.  Times already in the past make it due
+    /// immediately.
+    void add(clock::time_point when, T value) {
+        int64_t due = std::max(tick_at(when, true), cur_);
+        slots_[due & mask_].push_back({due, std::move(value)});
+        size_++;
+    }
+
+    /// Removes up to `limit` values that are due as of `now` and passes each to `f`, earliest tick
+    /// first (and in insertion order within a tick).  Returns the number of values popped.
+    template <typename F>
+    size_t pop_due(clock::time_point now, size_t limit, F&& f) {
+        const int64_t target = tick_at(now, false);
+        size_t popped = 0;
+        while (cur_ <= target && popped < limit) {
+            if (size_ == 0) {
+                cur_ = target;
+                break;
+            }
+            auto& slot = slots_[cur_ & mask_];
+            bool more = false;
+            size_t kept = 0;
+            for (auto& e : slot) {
+                if (e.due <= cur_ && popped + ready_.size() < limit) {
+                    ready_.push_back(std::move(e.value));
+                } else {
+                    more = more || e.due <= cur_;
+                    if (&slot[kept] != &e)
+                        slot[kept] = std::move(e);
+                    kept++;
+                }
+            }
+            slot.erase(slot.begin() + kept, slot.end());
+            if (more)  // We hit the limit with more due in this tick
+                limit = 0;
+            else if (ready_.empty() && cur_ == target)
+                break;  // (We stay on the current tick, for values added later that are due now)
+            else if (ready_.empty())
+                cur_++;
+            // (Otherwise we look at this tick again, in case `f` adds more values due now)
+
+            size_ -= ready_.size();
+            popped += ready_.size();
+            for (auto& v : ready_)
+                f(std::move(v));
+            ready_.clear();
+        }
+        return popped;
+    }
+
+    /// Returns the number of scheduled values.
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+  private:
+    struct entry {
+        int64_t due;  // the tick index the value is due in
+        T value;
+    };
+
+    // Returns the index of the tick containing `t`, or (if `round_up`) of the first tick that
+    // starts at or after `t`.
+    int64_t tick_at(clock::time_point t, bool round_up) const {
+        auto d = t - start_;
+        auto ticks = d / tick_;
+        if (round_up && ticks * tick_ < d)
+            ticks++;
+        else if (!round_up && ticks * tick_ > d)
+            ticks--;
+        return static_cast<int64_t>(ticks);
+    }
+
+    const clock::duration tick_;
+    const clock::time_point start_;
+    std::vector<std::vector<entry>> slots_;
+    size_t mask_;
+    int64_t cur_ = 0;  // the next tick to pop from; everything due before it has been popped
+    size_t size_ = 0;
+    std::vector<T> ready_;  // values being popped, reused between calls
+};
+
+}  // namespace oxenss::util
@@ -0,0 +1,215 @@
+#include "trace.hpp"
+#include "random.hpp"
+
+#include <limits>
+
+namespace oxenss::util::trace {
+
+static constexpr char hex_digits[] = "0123456789abcdef";
+
+static void append_hex(std::string& out, uint64_t v) {
+    for (int shift = 60; shift >= 0; shift -= 4)
+        out += hex_digits[(v >> shift) & 0xf];
+}
+
+static bool parse_hex(std::string_view s, uint64_t& v) {
+    v = 0;
+    for (char c : s) {
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+std::string context::trace_hex() const {
+    std::string out;
+    out.reserve(32);
+    append_hex(out, trace_id[0]);
+    append_hex(out, trace_id[1]);
+    return out;
+}
+
+std::string context::span_hex() const {
+    std::string out;
+    out.reserve(16);
+    append_hex(out, span_id);
+    return out;
+}
+
+std::string context::traceparent() const {
+    std::string out;
+    out.reserve(55);
+    out += "00-";
+    append_hex(out, trace_id[0]);
+    append_hex(out, trace_id[1]);
+    out += '-';
+    append_hex(out, span_id);
+    out += "-01";
+    return out;
+}
+
+context context::parse(std::string_view tp) {
+    // version-traceid-parentid-flags, e.g. 00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01.
+    // Later versions may append further fields, but must keep these ones.
+    context ctx;
+    if (tp.size() < 55 || tp[2] != '-' || tp[35] != '-' || tp[52] != '-')
+        return ctx;
+    uint64_t version, flags;
+    if (!parse_hex(tp.substr(0, 2), version) || version == 0xff ||
+        (version == 0 ? tp.size() != 55 : tp.size() > 55 && tp[55] != '-'))
+        return ctx;
+    if (!parse_hex(tp.substr(3, 16), ctx.trace_id[0]) ||
+        !parse_hex(tp.substr(19, 16), ctx.trace_id[1]) ||
+        !parse_hex(tp.substr(36, 16), ctx.span_id) || !parse_hex(tp.substr(53, 2), flags) ||
+        !(flags & 1) || !ctx.span_id)
+        return context{};
+    return ctx;
+}
+
+TraceBuffer::TraceBuffer(size_t capacity) : capacity_{capacity ? capacity : 1} {
+    sample_rate(DEFAULT_SAMPLE_RATE);
+}
+
+void TraceBuffer::sample_rate(double rate) {
+    uint64_t threshold;
+    if (!(rate > 0))
+        threshold = 0;
+    else if (rate >= 1)
+        threshold = std::numeric_limits<uint64_t>::max();
+    else
+        threshold = static_cast<uint64_t>(rate * 0x1p64);
+    threshold_.store(threshold, std::memory_order_relaxed);
+}
+
+double TraceBuffer::sample_rate() const {
+    auto threshold = threshold_.load(std::memory_order_relaxed);
+    if (threshold == std::numeric_limits<uint64_t>::max())
+        return 1.0;
+    return threshold / 0x1p64;
+}
+
+bool TraceBuffer::sample() const {
+    auto threshold = threshold_.load(std::memory_order_relaxed);
+    return threshold == std::numeric_limits<uint64_t>::max() || (threshold && rng()() < threshold);
+}
+
+void TraceBuffer::add(span_record s) {
+    std::lock_guard lock{mutex_};
+    recorded_++;
+    if (spans_.size() < capacity_) {
+        spans_.push_back(std::move(s));
+        return;
+    }
+    spans_[next_] = std::move(s);
+    if (++next_ == capacity_)
+        next_ = 0;
+}
+
+std::vector<span_record> TraceBuffer::get() const {
+    std::lock_guard lock{mutex_};
+    std::vector<span_record> result;
+    result.reserve(spans_.size());
+    result.insert(result.end(), spans_.begin() + next_, spans_.end());
+    result.insert(result.end(), spans_.begin(), spans_.begin() + next_);
+    return result;
+}
+
+uint64_t TraceBuffer::recorded() const {
+    std::lock_guard lock{mutex_};
+    return recorded_;
+}
+
+static thread_local const span* current_span = nullptr;
+
+span::span(std::string_view name) {
+    if (current_span && *current_span)
+        start(*current_span->buf_, name, current_span->ctx());
+}
+
+span::span(TraceBuffer& buf, std::string_view name, const context& parent) {
+    if (parent)
+        start(buf, name, parent);
+}
+
+span span::sampled(TraceBuffer& buf, std::string_view name, const context& parent) {
+    span s;
+    if (parent)
+        s.start(buf, name, parent);
+    else if (current_span && *current_span)
+        s.start(buf, name, current_span->ctx());
+    else if (buf.sample())
+        s.start(buf, name, {});
+    return s;
+}
+
+void span::start(TraceBuffer& buf, std::string_view name, const context& parent) {
+    buf_ = &buf;
+    auto& r = rng();
+    if (parent) {
+        rec_.ctx.trace_id = parent.trace_id;
+        rec_.parent_id = parent.span_id;
+    } else {
+        do
+            rec_.ctx.trace_id = {r(), r()};
+        while (!rec_.ctx);
+    }
+    do
+        rec_.ctx.span_id = r();
+    while (!rec_.ctx.span_id);
+    rec_.name = name;
+    rec_.start = std::chrono::system_clock::now();
+    started_ = std::chrono::steady_clock::now();
+}
+
+span::span(span&& other) noexcept :
+        buf_{other.buf_}, rec_{std::move(other.rec_)}, started_{other.started_} {
+    other.buf_ = nullptr;
+}
+
+span& span::operator=(span&& other) noexcept {
+    if (this != &other) {
+        end();
+        buf_ = other.buf_;
+        rec_ = std::move(other.rec_);
+        started_ = other.started_;
+        other.buf_ = nullptr;
+    }
+    return *this;
+}
+
+void span::tag(std::string_view key, std::string value) {
+    if (buf_)
+        rec_.tags.emplace_back(key, std::move(value));
+}
+
+void span::end() {
+    if (!buf_)
+        return;
+    rec_.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started_);
+    std::exchange(buf_, nullptr)->add(std::move(rec_));
+    rec_ = span_record{};
+}
+
+scope::scope(const span* s) : prev_{current_span} {
+    current_span = s && *s ? s : nullptr;
+}
+
+scope::~scope() {
+    current_span = prev_;
+}
+
+const span* current() {
+    return current_span;
+}
+
+context current_context() {
+    return current_span ? current_span->ctx() : context{};
+}
+
+}  // namespace oxenss::util::trace
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace oxenss::util::trace {
+
+/// Identifies a span of a sampled trace.  It is propagated to swarm peers (in forwarded client
+/// requests) as a W3C trace context "traceparent" value, so that the spans they record become
+/// children of this one.  Only sampled traces record spans at all, so a non-empty context always
+/// belongs to a trace being recorded.
+///
+/// Trace context is never passed along onion requests: a trace id shared by the hops of an onion
+/// path would link them together, which is exactly what the onion path is there to prevent.
+struct context {
+    std::array<uint64_t, 2> trace_id{};
+    uint64_t span_id = 0;
+
+    explicit operator bool() const { return trace_id[0] || trace_id[1]; }
+
+    /// Returns the trace id as 32 hex digits
+    std::string trace_hex() const;
+    /// Returns the span id as 16 hex digits
+    std::string span_hex() const;
+
+    /// Returns the traceparent value ("00-{trace id}-{span id}-01") for propagating this context.
+    std::string traceparent() const;
+
+    /// Parses a traceparent value.  Returns an empty context if the value is invalid, or if the
+    /// trace is not sampled.
+    static context parse(std::string_view traceparent);
+};
+
+/// A finished span, as kept by a TraceBuffer
+struct span_record {
+    context ctx;
+    // The span id of the parent span (which may be on another node), or 0 for a trace root
+    uint64_t parent_id = 0;
+    std::string name;
+    std::chrono::system_clock::time_point start;
+    std::chrono::microseconds duration{0};
+    std::vector<std::pair<std::string, std::string>> tags;
+};
+
+/// Bounded buffer of the most recently finished spans, from which they get exported (see
+/// ServiceNode::get_traces).  Once full, each new span replaces the oldest one.
+class TraceBuffer {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 10'000;
+    // Fraction of requests (that don't already belong to a trace) that start a new trace
+    static constexpr double DEFAULT_SAMPLE_RATE = 0.001;
+
+    explicit TraceBuffer(size_t capacity = DEFAULT_CAPACITY);
+
+    /// Sets the fraction, from 0 (which disables starting traces) to 1, of requests to trace.
+    /// Requests belonging to a trace started elsewhere are always traced.
+    void sample_rate(double rate);
+    double sample_rate() const;
+
+    /// Returns true if a new trace should be started, according to the sample rate.
+    bool sample() const;
+
+    void add(span_record s);
+
+    /// Returns the buffered spans, oldest first.
+    std::vector<span_record> get() const;
+
+    /// The number of spans ever added (including those since replaced by newer ones)
+    uint64_t recorded() const;
+
+  private:
+    mutable std::mutex mutex_;
+    std::vector<span_record> spans_;
+    const size_t capacity_;
+    size_t next_ = 0;  // Where the next span goes, once full
+    uint64_t recorded_ = 0;
+    // A random 64-bit value below this starts a trace; UINT64_MAX samples everything.
+    std::atomic<uint64_t> threshold_;
+};
+
+/// A span of a trace, timed from construction until `end()` (or destruction).  A span that isn't
+/// part of a sampled trace does nothing, and all of its children likewise do nothing.
+class span {
+  public:
+    span() = default;
+
+    /// Starts a span that is a child of the current thread's active span (see `scope`).  Does
+    /// nothing if there is no active span.
+    explicit span(std::string_view name);
+
+    /// Starts a span recorded into `buf` that is a child of `parent`.  Does nothing if `parent` is
+    /// empty.
+    span(TraceBuffer& buf, std::string_view name, const context& parent);
+
+    /// Starts the span of a request arriving at this node: a child of `parent` if it is set (e.g.
+    /// from an incoming traceparent), otherwise of the current thread's active span, if any, and
+    /// otherwise the root of a new trace if `buf` samples one.
+    static span sampled(TraceBuffer& buf, std::string_view name, const context& parent = {});
+
+    span(span&& other) noexcept;
+    span& operator=(span&& other) noexcept;
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+    ~span() { end(); }
+
+    /// True if this span is being recorded
+    explicit operator bool() const { return buf_; }
+
+    /// The context to pass on to children of this span; empty if not recording.
+    const context& ctx() const { return rec_.ctx; }
+
+    TraceBuffer* buffer() const { return buf_; }
+
+    /// Adds a tag (i.e. a key-value attribute) to the span, if recording.
+    void tag(std::string_view key, std::string value);
+
+    /// Finishes the span now, rather than on destruction.
+    void end();
+
+  private:
+    TraceBuffer* buf_ = nullptr;
+    span_record rec_;
+    std::chrono::steady_clock::time_point started_;
+
+    void start(TraceBuffer& buf, std::string_view name, const context& parent);
+};
+
+/// While alive, makes `s` the current thread's active span, so that spans started by code called
+/// within the scope (which get no span passed to them) become children of it.  A null or
+/// non-recording span masks any outer active span.
+class scope {
+  public:
+    explicit scope(const span* s);
+    ~scope();
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+  private:
+    const span* prev_;
+};
+
+/// Returns the current thread's active span, or nullptr if none (or not recording).
+const span* current();
+
+/// Returns the context of the current thread's active span; empty if there is none.
+context current_context();
+
+}  // namespace oxenss::util::trace
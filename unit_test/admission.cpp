@@ -0,0 +1,48 @@
+#include <oxenss/rpc/admission.h>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+
+using oxenss::rpc::AdmissionControl;
+using namespace std::literals;
+
+TEST_CASE("admission - refuses clients while queue delay is high", "[admission]") {
+    AdmissionControl ac;
+    const auto now = std::chrono::steady_clock::now();
+
+    CHECK_FALSE(ac.overloaded(now));
+    CHECK_FALSE(ac.refuse_client(now));
+
+    // A single slow sample isn't enough to push the average over the threshold
+    ac.record_queue_delay(2s, now);
+    CHECK_FALSE(ac.overloaded(now));
+
+    for (int i = 0; i < 20; i++)
+        ac.record_queue_delay(2s, now);
+    CHECK(ac.queue_delay() > AdmissionControl::OVERLOAD_DELAY);
+    CHECK(ac.refuse_client(now));
+    CHECK(ac.refuse_client(now + 500ms));
+    CHECK(ac.refused() == 2);
+
+    // Without fresh samples we stop refusing, even though the average is still high
+    CHECK_FALSE(ac.refuse_client(now + AdmissionControl::SAMPLE_MAX_AGE));
+    CHECK(ac.refused() == 2);
+
+    // Fast samples bring the average back down
+    for (int i = 0; i < 50; i++)
+        ac.record_queue_delay(1ms, now + 2s);
+    CHECK(ac.queue_delay() < AdmissionControl::OVERLOAD_DELAY);
+    CHECK_FALSE(ac.refuse_client(now + 2s));
+}
+
+TEST_CASE("admission - queue deadlines", "[admission]") {
+    AdmissionControl ac;
+    const auto now = std::chrono::steady_clock::now();
+
+    CHECK_FALSE(ac.expired(now, now + 10ms));
+    CHECK_FALSE(ac.expired(now, now + AdmissionControl::QUEUE_DEADLINE));
+    CHECK(ac.expired(now, now + AdmissionControl::QUEUE_DEADLINE + 1ms));
+    CHECK(ac.expired_requests() == 1);
+    CHECK(ac.queue_delay() > 0us);
+}
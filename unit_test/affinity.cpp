@@ -0,0 +1,62 @@
+#include <oxenss/crypto/crypto_pool.h>
+#include <oxenss/utils/affinity.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+using namespace oxenss;
+using namespace std::literals;
+
+TEST_CASE("affinity - parse CPU lists", "[affinity]") {
+    using V = std::vector<unsigned>;
+    CHECK(util::parse_cpu_list("") == V{});
+    CHECK(util::parse_cpu_list("3") == V{3});
+    CHECK(util::parse_cpu_list("0-3\n") == V{0, 1, 2, 3});
+    CHECK(util::parse_cpu_list("0-1,8,10-11") == V{0, 1, 8, 10, 11});
+
+    CHECK_THROWS_AS(util::parse_cpu_list("x"), std::invalid_argument);
+    CHECK_THROWS_AS(util::parse_cpu_list("3-1"), std::invalid_argument);
+    CHECK_THROWS_AS(util::parse_cpu_list("1,,2"), std::invalid_argument);
+    CHECK_THROWS_AS(util::parse_cpu_list("-2"), std::invalid_argument);
+}
+
+TEST_CASE("affinity - planner", "[affinity]") {
+    // Without CPUs, nothing gets pinned
+    util::CpuPlanner none;
+    CHECK_FALSE(none.enabled());
+    auto noop = none.pin("test");
+    noop(0);
+    CHECK(util::pin_this_thread({}) == false);
+
+#ifdef __linux__
+    auto cpus = util::allowed_cpus();
+    REQUIRE_FALSE(cpus.empty());
+
+    // Pin the threads of a pool to just the first allowed CPU; each thread sees itself pinned
+    util::CpuPlanner planner{{cpus.front()}};
+    CHECK(planner.enabled());
+    auto pin = planner.pin("crypto");
+    std::atomic<int> pinned = 0;
+    std::atomic<int> started = 0;
+    {
+        crypto::CryptoPool pool{2, crypto::CryptoPool::DEFAULT_MAX_QUEUE, [&](size_t i) {
+                                    pin(i);
+                                    if (util::allowed_cpus() == std::vector{cpus.front()})
+                                        pinned++;
+                                    started++;
+                                }};
+        auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (started < 2 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(1ms);
+    }
+    CHECK(started == 2);
+    CHECK(pinned == 2);
+    // (Pinning the pool's threads doesn't affect ours)
+    CHECK(util::allowed_cpus() == cpus);
+#endif
+}
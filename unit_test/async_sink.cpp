@@ -0,0 +1,161 @@
+#include <oxenss/logging/async_sink.h>
+
+#include <catch2/catch.hpp>
+
+#include <spdlog/logger.h>
+#include <spdlog/sinks/base_sink.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oxenss::logging;
+
+namespace {
+
+// Collects the messages written to it; can be made to block, to back up the async sink's queue
+struct capture_sink : spdlog::sinks::base_sink<std::mutex> {
+    std::vector<std::string> messages;
+    int flushes = 0;
+
+    std::mutex block_mutex;
+    std::condition_variable block_cv;
+    bool blocked = false;
+    std::atomic<bool> stuck{false};
+
+    void block() {
+        std::lock_guard lock{block_mutex};
+        blocked = true;
+    }
+    void unblock() {
+        {
+            std::lock_guard lock{block_mutex};
+            blocked = false;
+        }
+        block_cv.notify_all();
+    }
+
+    std::vector<std::string> get() {
+        std::lock_guard lock{mutex_};
+        return messages;
+    }
+
+  protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override {
+        {
+            std::unique_lock lock{block_mutex};
+            stuck = blocked;
+            block_cv.wait(lock, [this] { return !blocked; });
+            stuck = false;
+        }
+        messages.emplace_back(msg.payload.data(), msg.payload.size());
+    }
+    void flush_() override { flushes++; }
+};
+
+bool contains(const std::vector<std::string>& msgs, const std::string& needle) {
+    for (auto& m : msgs)
+        if (m.find(needle) != std::string::npos)
+            return true;
+    return false;
+}
+
+}  // namespace
+
+TEST_CASE("async sink - writes messages in order", "[logging]") {
+    auto capture = std::make_shared<capture_sink>();
+    auto async = std::make_shared<AsyncSink>(std::vector<spdlog::sink_ptr>{capture}, 64);
+    spdlog::logger logger{"test", async};
+    logger.set_level(spdlog::level::trace);
+
+    for (int i = 0; i < 10; i++)
+        logger.info("message {}", i);
+    logger.flush();
+
+    auto msgs = capture->get();
+    REQUIRE(msgs.size() == 10);
+    for (int i = 0; i < 10; i++)
+        CHECK(msgs[i] == "message " + std::to_string(i));
+    CHECK(capture->flushes >= 1);
+    CHECK(async->queued() == 0);
+    CHECK(async->dropped() == 0);
+
+    // Messages from several threads all make it through
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&logger, t] {
+            for (int i = 0; i < 10; i++)
+                logger.debug("thread {} message {}", t, i);
+        });
+    for (auto& t : threads)
+        t.join();
+    async->flush();
+    CHECK(capture->get().size() == 50);
+}
+
+TEST_CASE("async sink - drops messages when full", "[logging]") {
+    auto capture = std::make_shared<capture_sink>();
+    auto async = std::make_shared<AsyncSink>(std::vector<spdlog::sink_ptr>{capture}, 8);
+    spdlog::logger logger{"test", async};
+
+    // The first message gets the writer stuck in the sink (still holding its slot), after which
+    // the queue fills up
+    capture->block();
+    logger.info("first");
+    while (!capture->stuck)
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    for (int i = 0; i < 20; i++)
+        logger.info("message {}", i);
+    CHECK(async->dropped() == 13);
+    CHECK(async->queued() == 8);
+
+    capture->unblock();
+    async->flush();
+    auto msgs = capture->get();
+    REQUIRE(msgs.size() == 9);
+    CHECK(msgs[0] == "first");
+    CHECK(msgs[7] == "message 6");
+    CHECK(msgs[8] == "Dropped 13 log messages (log queue full)");
+    CHECK(async->queued() == 0);
+}
+
+TEST_CASE("async sink - rate limits categories", "[logging]") {
+    auto capture = std::make_shared<capture_sink>();
+    auto async = std::make_shared<AsyncSink>(std::vector<spdlog::sink_ptr>{capture}, 1024, 5);
+    spdlog::logger chatty{"chatty", async}, quiet{"quiet", async};
+
+    // Make sure we don't run into the start of a new second (and hence a new window) mid-test
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    auto into_second = now - std::chrono::duration_cast<std::chrono::seconds>(now);
+    if (into_second > std::chrono::milliseconds{800})
+        std::this_thread::sleep_for(std::chrono::milliseconds{250});
+
+    for (int i = 0; i < 20; i++)
+        chatty.info("chatty {}", i);
+    quiet.info("quiet");
+    // Errors always get through
+    chatty.error("chatty error");
+    async->flush();
+
+    auto msgs = capture->get();
+    CHECK(msgs.size() == 7);
+    CHECK(contains(msgs, "chatty 4"));
+    CHECK_FALSE(contains(msgs, "chatty 5"));
+    CHECK(contains(msgs, "quiet"));
+    CHECK(contains(msgs, "chatty error"));
+    CHECK(async->suppressed() == 15);
+
+    // The next window reports what got suppressed
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    chatty.info("chatty again");
+    async->flush();
+    msgs = capture->get();
+    REQUIRE(msgs.size() == 9);
+    CHECK(msgs[7] == "Suppressed 15 log messages (rate limit: 5/s)");
+    CHECK(msgs[8] == "chatty again");
+}
@@ -0,0 +1,110 @@
+#include <oxenss/crypto/blake2b.h>
+
+#include <catch2/catch.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace oxenss::crypto;
+
+namespace {
+
+hash32 reference(const blake2b_pieces& in) {
+    crypto_generichash_state st;
+    crypto_generichash_init(&st, nullptr, 0, 32);
+    for (auto& p : in)
+        crypto_generichash_update(
+                &st, reinterpret_cast<const unsigned char*>(p.data()), p.size());
+    hash32 h;
+    crypto_generichash_final(&st, h.data(), h.size());
+    return h;
+}
+
+std::string random_string(std::mt19937_64& rng, size_t size) {
+    std::string s(size, '\0');
+    for (auto& c : s)
+        c = static_cast<char>(rng());
+    return s;
+}
+
+}  // namespace
+
+TEST_CASE("blake2b - incremental hasher", "[blake2b]") {
+    // Blake2b-256 test vector of the empty string
+    auto empty = blake2b_hasher{}.finalize();
+    CHECK(std::string_view{reinterpret_cast<const char*>(empty.data()), empty.size()} ==
+          "\x0e\x57\x51\xc0\x26\xe5\x43\xb2\xe8\xab\x2e\xb0\x60\x99\xda\xa1"
+          "\xd1\xe5\xdf\x47\x77\x8f\x77\x87\xfa\xab\x45\xcd\xf1\x2f\xe3\xa8");
+
+    // Feeding it in pieces doesn't change the hash
+    std::mt19937_64 rng{1};
+    auto data = random_string(rng, 1000);
+    auto whole = blake2b_hasher{}.update(data).finalize();
+    blake2b_hasher pieces;
+    for (size_t i = 0; i < data.size(); i += 77)
+        pieces.update(std::string_view{data}.substr(i, 77));
+    CHECK(pieces.finalize() == whole);
+}
+
+TEST_CASE("blake2b - batches", "[blake2b]") {
+    std::mt19937_64 rng{42};
+    std::vector<std::string> strings;
+    std::vector<blake2b_pieces> inputs;
+    // Sizes around the block size, and a few much longer ones (which share lanes with short ones)
+    for (size_t size : {0, 1, 31, 127, 128, 129, 255, 256, 257, 1000, 76'800, 3, 200})
+        strings.push_back(random_string(rng, size));
+    for (size_t i = 0; i < 40; i++)
+        strings.push_back(random_string(rng, rng() % 600));
+    strings.reserve(strings.size() * 3);
+
+    for (auto& s : strings) {
+        // The same data split into pieces in various ways
+        std::string_view sv{s};
+        inputs.push_back({sv});
+        inputs.push_back({sv.substr(0, sv.size() / 3), "", sv.substr(sv.size() / 3)});
+        inputs.push_back(
+                {sv.substr(0, 1), sv.substr(std::min<size_t>(1, sv.size()), 33),
+                 sv.substr(std::min<size_t>(34, sv.size()))});
+    }
+
+    std::vector<hash32> expected;
+    for (auto& in : inputs)
+        expected.push_back(reference(in));
+
+    INFO("multi-buffer implementation: " << blake2b_batch_backend());
+    // Batches of every size up to a few lanes' worth, to cover the leftovers done one at a time
+    for (size_t n = 0; n <= 9; n++) {
+        std::vector<blake2b_pieces> batch(inputs.begin(), inputs.begin() + n);
+        std::vector<hash32> want(expected.begin(), expected.begin() + n);
+        CHECK(blake2b_batch(batch) == want);
+    }
+    CHECK(blake2b_batch(inputs) == expected);
+}
+
+TEST_CASE("blake2b - batch benchmark", "[.][benchmark]") {
+    std::mt19937_64 rng{42};
+    // Typical messages: a network id, pubkey, namespace and a few hundred bytes of data
+    std::vector<std::string> data;
+    for (int i = 0; i < 1000; i++)
+        data.push_back(random_string(rng, 100 + rng() % 400));
+    auto pubkey = random_string(rng, 32);
+    std::vector<blake2b_pieces> inputs;
+    for (auto& d : data)
+        inputs.push_back({"\x05", pubkey, "", d});
+    std::vector<hash32> out(inputs.size());
+
+    BENCHMARK("1000 messages, one at a time") {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            blake2b_hasher h;
+            for (auto& p : inputs[i])
+                h.update(p);
+            out[i] = h.finalize();
+        }
+        return out[0][0];
+    };
+    BENCHMARK("1000 messages, batched") {
+        blake2b_batch(inputs.data(), inputs.size(), out.data());
+        return out[0][0];
+    };
+}
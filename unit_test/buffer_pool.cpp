@@ -0,0 +1,56 @@
+#include <oxenss/utils/buffer_pool.hpp>
+
+#include <catch2/catch.hpp>
+
+using namespace oxenss::util;
+
+TEST_CASE("buffer pool - reuse", "[buffer_pool]") {
+    BufferPool pool{64 * 1024, 1024 * 1024};
+
+    auto a = pool.acquire(10'000);
+    CHECK(a.empty());
+    CHECK(a.capacity() >= 16384);
+    a.append(10'000, 'x');
+    const auto* data = a.data();
+    pool.release(std::move(a));
+    CHECK(pool.get_stats().buffers == 1);
+
+    // Anything in the same size class gets the same buffer back, empty
+    auto b = pool.acquire(9000);
+    CHECK(b.data() == data);
+    CHECK(b.empty());
+    CHECK(pool.get_stats().buffers == 0);
+    CHECK(pool.get_stats().reused == 1);
+
+    // But a larger size doesn't
+    pool.release(std::move(b));
+    auto c = pool.acquire(20'000);
+    CHECK(c.data() != data);
+    CHECK(c.capacity() >= 20'000);
+    CHECK(pool.get_stats().buffers == 1);
+    CHECK(pool.get_stats().allocated == 2);
+}
+
+TEST_CASE("buffer pool - limits", "[buffer_pool]") {
+    BufferPool pool{64 * 1024, 100'000};
+
+    // Small buffers aren't worth pooling, and ones above the maximum size aren't pooled
+    pool.release(std::string(10, 'x'));
+    std::string big;
+    big.reserve(200'000);
+    pool.release(std::move(big));
+    CHECK(pool.get_stats().buffers == 0);
+
+    // Oversized requests still get a buffer, just not a pooled one
+    CHECK(pool.acquire(200'000).capacity() >= 200'000);
+
+    // The total retained is capped
+    for (int i = 0; i < 10; i++) {
+        std::string buf;
+        buf.reserve(32 * 1024);
+        pool.release(std::move(buf));
+    }
+    auto s = pool.get_stats();
+    CHECK(s.buffers == 3);
+    CHECK(s.retained <= 100'000);
+}
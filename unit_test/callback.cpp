@@ -0,0 +1,154 @@
+#include <oxenss/utils/callback.hpp>
+#include <oxenss/utils/object_pool.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oxenss::util;
+
+namespace {
+
+// Counts how many of its copies are alive
+struct counted {
+    std::shared_ptr<int> alive;
+    explicit counted(std::shared_ptr<int> a) : alive{std::move(a)} { ++*alive; }
+    counted(counted&& o) noexcept : alive{o.alive} { ++*alive; }
+    ~counted() { --*alive; }
+    int operator()(int x) const { return x + 1; }
+};
+
+}  // namespace
+
+TEST_CASE("callback - invoke", "[callback]") {
+    callback<int(int)> empty;
+    CHECK_FALSE(empty);
+    CHECK_THROWS_AS(empty(1), std::bad_function_call);
+    callback<int(int)> null{nullptr};
+    CHECK_FALSE(null);
+    CHECK_FALSE(callback<void()>{std::function<void()>{}});
+
+    int calls = 0;
+    callback<int(int)> add = [&calls](int x) {
+        calls++;
+        return x + 10;
+    };
+    REQUIRE(add);
+    CHECK(add.is_inline());
+    CHECK(add(5) == 15);
+    CHECK(calls == 1);
+
+    // Mutable lambdas can be invoked through a const callback
+    const callback<int()> counter = [n = 0]() mutable { return ++n; };
+    CHECK(counter() == 1);
+    CHECK(counter() == 2);
+
+    // Arguments, including move-only ones, are passed through
+    callback<std::string(std::unique_ptr<std::string>)> deref = [](auto p) { return *p; };
+    CHECK(deref(std::make_unique<std::string>("abc")) == "abc");
+}
+
+TEST_CASE("callback - move-only captures", "[callback]") {
+    auto p = std::make_unique<int>(42);
+    callback<int()> get = [p = std::move(p)] { return *p; };
+    CHECK(get.is_inline());
+
+    callback<int()> moved{std::move(get)};
+    CHECK_FALSE(get);
+    REQUIRE(moved);
+    CHECK(moved() == 42);
+
+    // Callbacks wrapping callbacks (as reply wrappers do)
+    callback<int()> wrapped = [inner = std::move(moved)] { return inner() * 2; };
+    CHECK_FALSE(moved);
+    CHECK(wrapped() == 84);
+
+    get = std::move(wrapped);
+    CHECK(get() == 84);
+    get = nullptr;
+    CHECK_FALSE(get);
+}
+
+TEST_CASE("callback - storage and destruction", "[callback]") {
+    auto alive = std::make_shared<int>(0);
+    {
+        callback<int(int)> small = counted{alive};
+        CHECK(small.is_inline());
+        CHECK(*alive == 1);
+        CHECK(small(1) == 2);
+
+        // Too big to store inline, so it goes in a pooled block (which moves don't touch)
+        std::array<char, callback<int(int)>::INLINE_SIZE> padding{};
+        callback<int(int)> big = [c = counted{alive}, padding](int x) { return c(x) + padding[0]; };
+        CHECK_FALSE(big.is_inline());
+        CHECK(*alive == 2);
+        CHECK(big(1) == 2);
+
+        auto moved = std::move(big);
+        CHECK(*alive == 2);
+        CHECK(moved(2) == 3);
+
+        // Assigning destroys the callable being replaced
+        moved = std::move(small);
+        CHECK(*alive == 1);
+        CHECK(moved(3) == 4);
+    }
+    CHECK(*alive == 0);
+}
+
+TEST_CASE("object pool - block reuse", "[callback][object_pool]") {
+    // Run in a fresh thread so that we start with an empty pool (recording what happens there,
+    // since Catch assertions aren't thread-safe)
+    pool_stats initial, after_reuse, after_big, after_limit;
+    bool same_block = false, other_block = false, shared_ok = false;
+    uint64_t shared_reused = 0;
+    std::thread{[&] {
+        initial = thread_pool_stats();
+
+        void* a = pool_allocate(100);
+        pool_deallocate(a, 100);
+        // Anything in the same size class gets the same block back
+        void* b = pool_allocate(128);
+        same_block = b == a;
+        void* c = pool_allocate(129);
+        other_block = c != a;
+        after_reuse = thread_pool_stats();
+        pool_deallocate(b, 128);
+        pool_deallocate(c, 129);
+
+        pool_deallocate(pool_allocate(MAX_POOLED_SIZE + 1), MAX_POOLED_SIZE + 1);
+        after_big = thread_pool_stats();
+
+        std::vector<void*> blocks;
+        for (size_t i = 0; i < MAX_FREE_BLOCKS + 10; i++)
+            blocks.push_back(pool_allocate(MIN_POOLED_SIZE));
+        for (auto* p : blocks)
+            pool_deallocate(p, MIN_POOLED_SIZE);
+        after_limit = thread_pool_stats();
+
+        auto shared = make_pooled<std::string>("hello");
+        auto reused = thread_pool_stats().reused;
+        shared.reset();
+        shared = make_pooled<std::string>("world");
+        shared_ok = *shared == "world";
+        shared_reused = thread_pool_stats().reused - reused;
+    }}.join();
+
+    CHECK(initial.allocated == 0);
+    CHECK(initial.free_blocks == 0);
+    CHECK(same_block);
+    CHECK(other_block);
+    CHECK(after_reuse.reused == 1);
+    CHECK(after_reuse.allocated == 2);
+    // Blocks too large to pool aren't kept
+    CHECK(after_big.free_blocks == 2);
+    // Nor are freed blocks beyond the limit
+    CHECK(after_limit.free_blocks == MAX_FREE_BLOCKS + 2);
+    CHECK(shared_ok);
+    CHECK(shared_reused == 1);
+}
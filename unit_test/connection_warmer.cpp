@@ -0,0 +1,77 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/snode/connection_warmer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace std::literals;
+using oxenss::snode::ConnectionWarmer;
+using oxenss::snode::sn_record;
+
+namespace {
+
+sn_record make_sn(unsigned char id) {
+    sn_record sn;
+    sn.pubkey_legacy.data()[0] = id;
+    sn.ip = "10.0.0." + std::to_string(id);
+    return sn;
+}
+
+// The ids of the nodes in `records`, sorted
+std::vector<int> ids(std::vector<sn_record>& records) {
+    std::vector<int> out;
+    for (auto& sn : records)
+        out.push_back(sn.pubkey_legacy.data()[0]);
+    records.clear();
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+}  // namespace
+
+TEST_CASE("connection warmer - connects to peers and disconnects departed ones", "[warmer]") {
+    std::vector<sn_record> connected, disconnected;
+    ConnectionWarmer warmer{
+            [&](const sn_record& sn) { connected.push_back(sn); },
+            [&](const sn_record& sn) { disconnected.push_back(sn); },
+            2min};
+    auto now = ConnectionWarmer::clock::now();
+
+    warmer.set_peers({make_sn(1), make_sn(2), make_sn(3)}, now);
+    CHECK(ids(connected) == std::vector{1, 2, 3});
+    CHECK(warmer.get_stats().peers == 3);
+
+    // Only new peers get connected on an update
+    warmer.set_peers({make_sn(1), make_sn(3), make_sn(4)}, now + 10s);
+    CHECK(ids(connected) == std::vector{4});
+    CHECK(disconnected.empty());
+    CHECK(warmer.get_stats().peers == 3);
+    CHECK(warmer.get_stats().leaving == 1);
+
+    // Ticks refresh current peers, and keep departed ones until their grace period is up
+    warmer.tick(now + 1min);
+    CHECK(ids(connected) == std::vector{1, 3, 4});
+    CHECK(disconnected.empty());
+    warmer.tick(now + 10s + 2min);
+    CHECK(ids(connected) == std::vector{1, 3, 4});
+    CHECK(ids(disconnected) == std::vector{2});
+    CHECK(warmer.get_stats().leaving == 0);
+
+    // A peer coming back within its grace period keeps its connection
+    warmer.set_peers({make_sn(1), make_sn(4)}, now + 3min);
+    warmer.set_peers({make_sn(1), make_sn(3), make_sn(4)}, now + 4min);
+    CHECK(connected.empty());
+    warmer.tick(now + 10min);
+    CHECK(ids(connected) == std::vector{1, 3, 4});
+    CHECK(disconnected.empty());
+
+    // A peer whose address changed gets reconnected
+    auto moved = make_sn(3);
+    moved.ip = "10.1.1.1";
+    warmer.set_peers({make_sn(1), moved, make_sn(4)}, now + 11min);
+    CHECK(ids(disconnected) == std::vector{3});
+    REQUIRE(connected.size() == 1);
+    CHECK(connected.front().ip == "10.1.1.1");
+}
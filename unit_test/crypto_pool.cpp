@@ -0,0 +1,101 @@
+#include <oxenss/crypto/crypto_pool.h>
+
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+using namespace oxenss::crypto;
+using namespace std::literals;
+
+TEST_CASE("crypto pool - runs jobs", "[crypto_pool]") {
+    CryptoPool pool{4};
+    CHECK(pool.threads() == 4);
+
+    constexpr int N = 1000;
+    std::atomic<int> done = 0;
+    std::promise<void> finished;
+    for (int i = 0; i < N; i++) {
+        std::function<void()> job = [&] {
+            if (++done == N)
+                finished.set_value();
+        };
+        REQUIRE(pool.try_submit(job));
+        CHECK_FALSE(job);
+    }
+    REQUIRE(finished.get_future().wait_for(5s) == std::future_status::ready);
+    CHECK(done == N);
+    CHECK(pool.rejected() == 0);
+}
+
+TEST_CASE("crypto pool - bounded queue", "[crypto_pool]") {
+    CryptoPool pool{1, 3};
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool release = false;
+    std::atomic<int> ran = 0;
+    auto blocking = [&] {
+        std::unique_lock lock{m};
+        cv.wait(lock, [&] { return release; });
+        ran++;
+    };
+
+    for (int i = 0; i < 3; i++) {
+        std::function<void()> job = blocking;
+        REQUIRE(pool.try_submit(job));
+    }
+    CHECK(pool.queued() == 3);
+
+    // A refused job is left for the caller to deal with
+    bool called = false;
+    std::function<void()> extra = [&] { called = true; };
+    CHECK_FALSE(pool.try_submit(extra));
+    REQUIRE(extra);
+    extra();
+    CHECK(called);
+    CHECK(pool.rejected() == 1);
+
+    {
+        std::lock_guard lock{m};
+        release = true;
+    }
+    cv.notify_all();
+    auto until = std::chrono::steady_clock::now() + 5s;
+    while (pool.queued() > 0 && std::chrono::steady_clock::now() < until)
+        std::this_thread::sleep_for(1ms);
+    CHECK(ran == 3);
+    CHECK(pool.queued() == 0);
+}
+
+TEST_CASE("crypto pool - idle threads steal queued jobs", "[crypto_pool]") {
+    CryptoPool pool{2};
+
+    // Block one thread; with jobs spread round-robin across both threads' queues, the jobs queued
+    // behind the blocked one still get run by the other thread.
+    std::promise<void> unblock, blocked;
+    std::function<void()> blocker = [&, f = unblock.get_future().share()] {
+        blocked.set_value();
+        f.wait();
+    };
+    REQUIRE(pool.try_submit(blocker));
+    blocked.get_future().wait();
+
+    constexpr int N = 10;
+    std::atomic<int> done = 0;
+    std::promise<void> finished;
+    for (int i = 0; i < N; i++) {
+        std::function<void()> job = [&] {
+            if (++done == N)
+                finished.set_value();
+        };
+        REQUIRE(pool.try_submit(job));
+    }
+    CHECK(finished.get_future().wait_for(5s) == std::future_status::ready);
+    CHECK(done == N);
+    unblock.set_value();
+}
@@ -1,6 +1,7 @@
 #include <catch2/catch.hpp>
 #include <iostream>
 #include <ostream>
+#include <vector>
 
 #include <oxenss/crypto/channel_encryption.hpp>
 #include <oxenss/crypto/keys.h>
@@ -91,3 +92,76 @@ TEST_CASE("XChaCha20-Poly1309 encryption", "[encrypt][xchacha20]") {
 
     CHECK_THROWS_AS(alice_server.decrypt_xchacha20(ctext_alice, bob_pubkey), std::runtime_error);
 }
+
+TEST_CASE("In-place decryption", "[encrypt][inplace]") {
+    ChannelEncryption alice_client{alice_seckey, alice_pubkey, false};
+    ChannelEncryption bob_server{bob_seckey, bob_pubkey};
+
+    for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+        auto ctext = alice_client.encrypt(type, plaintext_data, bob_pubkey);
+        auto ptext = bob_server.decrypt(type, ctext, alice_pubkey);
+        CHECK(ptext == plaintext_data);
+
+        auto* buf = ctext.data();
+        auto in_place = bob_server.decrypt_in_place(type, ctext, alice_pubkey);
+        CHECK(in_place == plaintext_data);
+        CHECK(in_place.data() > buf);
+        CHECK(in_place.data() + in_place.size() <= buf + ctext.size());
+
+        auto corrupt = alice_client.encrypt(type, plaintext_data, bob_pubkey);
+        corrupt.resize(10);
+        CHECK_THROWS_AS(
+                bob_server.decrypt_in_place(type, corrupt, alice_pubkey), std::runtime_error);
+    }
+}
+
+TEST_CASE("Encryption into a caller buffer", "[encrypt]") {
+    ChannelEncryption alice_client{alice_seckey, alice_pubkey, false};
+    ChannelEncryption bob_server{bob_seckey, bob_pubkey};
+
+    for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+        for (size_t size : {0, 1, 15, 16, 17, 1000}) {
+            CAPTURE(type, size);
+            std::string plaintext(size, 'x');
+            std::vector<unsigned char> buf(
+                    ChannelEncryption::max_encrypted_size(type, plaintext.size()));
+            auto len = alice_client.encrypt_to(type, plaintext, bob_pubkey, buf.data());
+            REQUIRE(len <= buf.size());
+            CHECK(len == alice_client.encrypt(type, plaintext, bob_pubkey).size());
+            std::string ctext{reinterpret_cast<const char*>(buf.data()), len};
+            CHECK(bob_server.decrypt(type, ctext, alice_pubkey) == plaintext);
+        }
+    }
+}
+
+TEST_CASE("AES-GCM backends are interchangeable", "[encrypt][gcm]") {
+    ChannelEncryption alice_box{alice_seckey, alice_pubkey};
+    ChannelEncryption bob_box{bob_seckey, bob_pubkey};
+
+    // (Where libsodium's AES-GCM isn't available everything goes through OpenSSL)
+    for (auto enc : {GcmBackend::openssl, GcmBackend::libsodium, GcmBackend::automatic}) {
+        for (auto dec : {GcmBackend::openssl, GcmBackend::libsodium, GcmBackend::automatic}) {
+            for (size_t size :
+                 {size_t{0},
+                  size_t{100},
+                  ChannelEncryption::GCM_SODIUM_MAX - 1,
+                  ChannelEncryption::GCM_SODIUM_MAX,
+                  size_t{100'000}}) {
+                CAPTURE(static_cast<int>(enc), static_cast<int>(dec), size);
+                std::string plaintext(size, 'y');
+                ChannelEncryption::set_gcm_backend(enc);
+                auto ctext = alice_box.encrypt_gcm(plaintext, bob_pubkey);
+                CHECK(ctext.size() == plaintext.size() + 28);
+                ChannelEncryption::set_gcm_backend(dec);
+                CHECK(bob_box.decrypt_gcm(ctext, alice_pubkey) == plaintext);
+                CHECK(bob_box.decrypt_in_place(EncryptType::aes_gcm, ctext, alice_pubkey) ==
+                      plaintext);
+
+                ctext = alice_box.encrypt_gcm(plaintext, bob_pubkey);
+                ctext.back() ^= 1;
+                CHECK_THROWS_AS(bob_box.decrypt_gcm(ctext, alice_pubkey), std::runtime_error);
+            }
+        }
+    }
+    ChannelEncryption::set_gcm_backend(GcmBackend::automatic);
+}
@@ -0,0 +1,88 @@
+#include <oxenss/utils/latency.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <thread>
+
+using namespace oxenss::util;
+using namespace std::literals;
+
+TEST_CASE("latency - histogram buckets", "[latency]") {
+    // Every value maps into a bucket whose value is within the bucket precision
+    for (uint64_t us : {0, 1, 7, 8, 9, 15, 16, 17, 100, 1234, 99'999, 5'000'000, 60'000'000}) {
+        auto b = LatencyHistogram::bucket(us);
+        REQUIRE(b < LatencyHistogram::BUCKETS);
+        auto v = LatencyHistogram::bucket_value(b);
+        CHECK(v <= us + us / LatencyHistogram::SUB_BUCKETS);
+        CHECK(v + v / LatencyHistogram::SUB_BUCKETS >= us);
+    }
+    // Buckets are ordered
+    for (size_t i = 1; i < LatencyHistogram::BUCKETS; i++)
+        CHECK(LatencyHistogram::bucket_value(i) > LatencyHistogram::bucket_value(i - 1));
+    CHECK(LatencyHistogram::bucket(uint64_t{1} << 40) == LatencyHistogram::BUCKETS - 1);
+}
+
+TEST_CASE("latency - percentiles", "[latency]") {
+    LatencyHistogram h;
+    for (int i = 1; i <= 1000; i++)
+        h.record(std::chrono::microseconds{i * 10});
+
+    auto s = h.get();
+    CHECK(s.count == 1000);
+    CHECK(s.mean() == 5005us);
+    CHECK(s.percentile(0.5).count() == Approx(5000).epsilon(0.07));
+    CHECK(s.percentile(0.99).count() == Approx(9900).epsilon(0.07));
+    CHECK(s.percentile(1.0).count() == Approx(10000).epsilon(0.07));
+
+    CHECK(LatencyHistogram{}.get().percentile(0.5) == 0us);
+
+    // Values recorded since a snapshot
+    h.record(1ms);
+    h.record(3ms);
+    auto since = h.get();
+    since -= s;
+    CHECK(since.count == 2);
+    CHECK(since.mean() == 2ms);
+    CHECK(since.percentile(0.5).count() == Approx(1000).epsilon(0.07));
+
+    since += s;
+    CHECK(since.count == 1002);
+}
+
+TEST_CASE("latency - request stages", "[latency]") {
+    endpoint_latency ep, other;
+    auto count = [](endpoint_latency& e, latency_stage s) {
+        return e.stages[static_cast<size_t>(s)].get().count;
+    };
+
+    // Not in a request: nothing is recorded
+    { stage_timer t{latency_stage::db}; }
+
+    {
+        request_scope transport{nullptr, std::chrono::steady_clock::now() - 5ms};
+        { stage_timer t{latency_stage::db}; }
+        request_scope scope{&ep};
+        CHECK(scope.started() < std::chrono::steady_clock::now() - 5ms);
+        {
+            stage_timer t{latency_stage::db};
+            stage_timer nested{latency_stage::db};
+            stage_timer auth{latency_stage::auth};
+        }
+        {
+            // A second endpoint inside the same transport scope doesn't also get the queue time
+            request_scope second{&other};
+            stage_timer t{latency_stage::serialize};
+        }
+        stage_timer moved{stage_timer{latency_stage::swarm}};
+    }
+
+    CHECK(count(ep, latency_stage::queue) == 1);
+    CHECK(ep.stages[0].get().sum_us >= 5000);
+    CHECK(count(ep, latency_stage::db) == 1);
+    CHECK(count(ep, latency_stage::auth) == 1);
+    CHECK(count(ep, latency_stage::swarm) == 1);
+    CHECK(count(ep, latency_stage::serialize) == 0);
+    CHECK(count(other, latency_stage::queue) == 0);
+    CHECK(count(other, latency_stage::serialize) == 1);
+}
@@ -0,0 +1,54 @@
+#include <oxenss/utils/memory.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace oxenss;
+
+TEST_CASE("memory - container estimates", "[memory]") {
+    CHECK(util::heap_bytes(std::string{}) == 0);
+    CHECK(util::heap_bytes(std::string{"short"}) == 0);
+    std::string big(1000, 'x');
+    CHECK(util::heap_bytes(big) > 1000);
+
+    std::vector<uint64_t> v;
+    CHECK(util::heap_bytes(v) == 0);
+    v.reserve(100);
+    CHECK(util::heap_bytes(v) >= 800);
+
+    // Deques always hold at least a block; beyond that they grow with their size
+    std::deque<uint64_t> d;
+    auto empty = util::heap_bytes(d);
+    d.resize(10000);
+    CHECK(util::heap_bytes(d) > empty + 80000);
+    CHECK(util::heap_bytes(d) < empty + 90000);
+
+    std::unordered_map<uint64_t, uint64_t> h;
+    auto buckets = util::hashtable_bytes(h);
+    for (uint64_t i = 0; i < 1000; i++)
+        h.emplace(i, i);
+    CHECK(util::hashtable_bytes(h) >= buckets + 1000 * 16 + h.bucket_count() * sizeof(void*));
+
+    std::map<uint64_t, uint64_t> t;
+    CHECK(util::tree_bytes(t) == 0);
+    for (uint64_t i = 0; i < 1000; i++)
+        t.emplace(i, i);
+    CHECK(util::tree_bytes(t) >= 1000 * 16);
+}
+
+TEST_CASE("memory - malloc usage", "[memory]") {
+    auto before = util::malloc_in_use();
+    if (!before)
+        return;  // Not supported by this C library
+    auto p = std::make_unique<char[]>(10'000'000);
+    p[0] = 1;
+    auto after = util::malloc_in_use();
+    REQUIRE(after);
+    CHECK(*after >= *before + 10'000'000);
+}
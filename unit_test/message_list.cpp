@@ -0,0 +1,79 @@
+#include <oxenss/storage/message_list.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <string>
+#include <utility>
+
+using namespace oxenss;
+using namespace std::literals;
+
+TEST_CASE("message list - holds messages in an arena", "[storage][message_list]") {
+    const std::chrono::system_clock::time_point now{1'700'000'000s};
+    MessageList list;
+    CHECK(list.empty());
+    CHECK(list.blocks() == 0);
+
+    // The originals can go away: the list has its own copies
+    for (int i = 0; i < 1000; i++) {
+        auto hash = "hash" + std::to_string(i);
+        auto data = std::string(100, 'a' + i % 26);
+        list.add(hash, namespace_id{static_cast<int16_t>(i % 3)}, now, now + 1h, data);
+    }
+    // 1000 messages of ~107 bytes fit in a couple of blocks
+    CHECK(list.blocks() == 2);
+
+    // A big message gets a block of its own, without wasting the current block's free space
+    const std::string big(MessageList::BLOCK_SIZE, 'x');
+    list.add("big", namespace_id::Default, now, now + 1h, big);
+    list.add("small", namespace_id::Default, now, now + 1h, "");
+    CHECK(list.blocks() == 3);
+
+    // Views survive moving the list
+    auto moved = std::move(list);
+    REQUIRE(moved.size() == 1002);
+    for (int i = 0; i < 1000; i++) {
+        CHECK(moved[i].hash == "hash" + std::to_string(i));
+        CHECK(moved[i].msg_namespace == namespace_id{static_cast<int16_t>(i % 3)});
+        CHECK(moved[i].data == std::string(100, 'a' + i % 26));
+        CHECK(moved[i].expiry == now + 1h);
+    }
+    CHECK(moved[1000].data.size() == MessageList::BLOCK_SIZE);
+    CHECK(moved.back().hash == "small");
+    CHECK(moved.back().data.empty());
+
+    size_t count = 0;
+    for (auto& m : moved)
+        count += m.hash.substr(0, 4) == "hash";
+    CHECK(count == 1000);
+}
+
+TEST_CASE("message list - moved-from lists are empty and reusable", "[storage][message_list]") {
+    const std::chrono::system_clock::time_point now{1'700'000'000s};
+    MessageList list;
+    list.add("a", namespace_id::Default, now, now + 1h, std::string(100, 'a'));
+
+    // Adding to the moved-from list must not write into the block that now belongs to `moved`
+    auto moved = std::move(list);
+    CHECK(list.empty());
+    CHECK(list.blocks() == 0);
+    list.add("b", namespace_id::Default, now, now + 1h, std::string(100, 'b'));
+    CHECK(list.blocks() == 1);
+    CHECK(list[0].data == std::string(100, 'b'));
+    CHECK(moved.blocks() == 1);
+    REQUIRE(moved.size() == 1);
+    CHECK(moved[0].data == std::string(100, 'a'));
+    moved.add("c", namespace_id::Default, now, now + 1h, std::string(100, 'c'));
+    CHECK(moved.blocks() == 1);
+    CHECK(moved[0].data == std::string(100, 'a'));
+    CHECK(list[0].data == std::string(100, 'b'));
+
+    moved = std::move(list);
+    CHECK(list.empty());
+    CHECK(list.blocks() == 0);
+    REQUIRE(moved.size() == 1);
+    CHECK(moved[0].hash == "b");
+    list.add("d", namespace_id::Default, now, now + 1h, std::string(100, 'd'));
+    CHECK(moved[0].data == std::string(100, 'b'));
+    CHECK(list[0].data == std::string(100, 'd'));
+}
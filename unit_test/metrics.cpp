@@ -0,0 +1,48 @@
+#include <oxenss/snode/metrics.h>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <string>
+
+using oxenss::snode::metrics_writer;
+using oxenss::util::LatencyHistogram;
+using namespace std::literals;
+
+TEST_CASE("metrics - openmetrics text", "[metrics]") {
+    metrics_writer m;
+    m.counter("test_things", "Things counted", 42);
+    m.family("test_labelled", "gauge", "With \"labels\"");
+    m.sample("", {{"a", "x"}, {"b", "quote\" back\\slash"}}, 1.5);
+
+    CHECK(std::move(m).str() ==
+          "# TYPE test_things counter\n"
+          "# HELP test_things Things counted\n"
+          "test_things_total 42\n"
+          "# TYPE test_labelled gauge\n"
+          "# HELP test_labelled With \\\"labels\\\"\n"
+          "test_labelled{a=\"x\",b=\"quote\\\" back\\\\slash\"} 1.5\n"
+          "# EOF\n");
+}
+
+TEST_CASE("metrics - histograms", "[metrics]") {
+    LatencyHistogram h;
+    h.record(500us);
+    h.record(3ms);
+    h.record(3ms);
+    h.record(20s);
+
+    metrics_writer m;
+    m.family("test_seconds", "histogram", "Latency");
+    m.histogram({{"endpoint", "store"}}, h.get());
+    auto out = std::move(m).str();
+
+    auto has = [&out](std::string_view line) { return out.find(line) != std::string::npos; };
+    CHECK(has("test_seconds_bucket{endpoint=\"store\",le=\"0.001\"} 1\n"));
+    CHECK(has("test_seconds_bucket{endpoint=\"store\",le=\"0.0025\"} 1\n"));
+    CHECK(has("test_seconds_bucket{endpoint=\"store\",le=\"0.005\"} 3\n"));
+    CHECK(has("test_seconds_bucket{endpoint=\"store\",le=\"10.0\"} 3\n"));
+    CHECK(has("test_seconds_bucket{endpoint=\"store\",le=\"+Inf\"} 4\n"));
+    CHECK(has("test_seconds_count{endpoint=\"store\"} 4\n"));
+    CHECK(has("test_seconds_sum{endpoint=\"store\"} 20.0065\n"));
+}
@@ -0,0 +1,249 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/server/monitor_registry.h>
+#include <oxenss/server/mqbase.h>
+
+#include <oxenc/hex.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxenss;
+using oxenss::server::connection_id;
+using oxenss::server::MonitorRegistry;
+using oxenss::server::namespace_set;
+
+namespace {
+
+std::vector<namespace_id> ns_list(std::initializer_list<int16_t> ns) {
+    std::vector<namespace_id> result;
+    for (auto n : ns)
+        result.push_back(static_cast<namespace_id>(n));
+    return result;
+}
+
+connection_id make_conn(char c) {
+    return oxenmq::ConnectionID{std::string(32, c)};
+}
+
+// Records whatever gets sent instead of sending it anywhere
+struct fake_mq : server::MQBase {
+    std::vector<std::pair<connection_id, std::string>> sent, batches, resyncs;
+
+    void notify(std::vector<connection_id>& conns, std::string_view notification) override {
+        for (auto& c : conns)
+            sent.emplace_back(c, notification);
+    }
+    void notify_batch(const connection_id& conn, std::string_view notifications) override {
+        batches.emplace_back(conn, notifications);
+    }
+    void notify_resync(const connection_id& conn, std::string_view body) override {
+        resyncs.emplace_back(conn, body);
+    }
+    void reachability_test(std::shared_ptr<snode::sn_test>) override {}
+};
+
+}  // namespace
+
+TEST_CASE("monitors - namespace sets", "[monitors]") {
+    namespace_set s{ns_list({-10, 0, 5, 14, 47})};
+    CHECK(s.contains(namespace_id::LegacyClosed));
+    CHECK(s.contains(namespace_id::Default));
+    CHECK(s.contains(namespace_id::GroupMembers));
+    CHECK(s.contains(static_cast<namespace_id>(47)));
+    CHECK_FALSE(s.contains(namespace_id::UserProfile));
+    CHECK_FALSE(s.contains(static_cast<namespace_id>(-16)));
+    CHECK_FALSE(s.contains(static_cast<namespace_id>(48)));
+    CHECK_FALSE(s.contains(namespace_id::Min));
+
+    // Namespaces outside the bitmap range
+    namespace_set big{ns_list({-32768, -17, 48, 32767})};
+    CHECK(big.contains(namespace_id::Min));
+    CHECK(big.contains(static_cast<namespace_id>(-17)));
+    CHECK(big.contains(static_cast<namespace_id>(48)));
+    CHECK(big.contains(namespace_id::Max));
+    CHECK_FALSE(big.contains(namespace_id::Default));
+
+    s.merge(big);
+    s.merge(namespace_set{ns_list({-17, 2, 1000})});
+    CHECK(s.to_vector() == ns_list({-32768, -17, -10, 0, 2, 5, 14, 47, 48, 1000, 32767}));
+
+    CHECK(namespace_set{}.empty());
+    CHECK_FALSE(big.empty());
+}
+
+TEST_CASE("monitors - registry lookups", "[monitors]") {
+    MonitorRegistry reg;
+
+    std::string pk_hex = "05" + std::string(64, '1');
+    std::string other_hex = "05" + std::string(64, '2');
+    user_pubkey pk, other;
+    REQUIRE(pk.load(pk_hex));
+    REQUIRE(other.load(other_hex));
+
+    auto a = make_conn('a'), b = make_conn('b'), c = make_conn('c');
+    std::vector<sub_info> subs{{oxenc::from_hex(pk_hex), pk_hex, ns_list({0, 2}), false, false}};
+    reg.update(subs, a);
+    subs = {{oxenc::from_hex(pk_hex), pk_hex, ns_list({2}), true, false},
+            {oxenc::from_hex(other_hex), other_hex, ns_list({0}), false, false}};
+    reg.update(subs, b);
+    CHECK(reg.size() == 3);
+
+    server::notify_targets t;
+    reg.get_notifiers(pk, namespace_id::UserProfile, t);
+    CHECK(t.to == std::vector{a});
+    CHECK(t.with_data == std::vector{b});
+    CHECK(t.batched.empty());
+    CHECK(t.wants_data());
+
+    t = {};
+    reg.get_notifiers(pk, namespace_id::Default, t);
+    CHECK(t.to == std::vector{a});
+    CHECK(t.with_data.empty());
+    CHECK_FALSE(t.wants_data());
+
+    // Renewing from the same connection extends the existing subscription
+    subs = {{oxenc::from_hex(pk_hex), pk_hex, ns_list({-10}), true, false}};
+    reg.update(subs, a);
+    CHECK(reg.size() == 3);
+    t = {};
+    reg.get_notifiers(pk, namespace_id::Default, t);
+    CHECK(t.to.empty());
+    CHECK(t.with_data == std::vector{a});
+
+    // Batched subscriptions get their own lists
+    subs = {{oxenc::from_hex(other_hex), other_hex, ns_list({0}), false, true}};
+    reg.update(subs, c);
+    subs = {{oxenc::from_hex(other_hex), other_hex, ns_list({0}), true, true}};
+    reg.update(subs, b);
+    t = {};
+    reg.get_notifiers(other, namespace_id::Default, t);
+    CHECK(t.to.empty());
+    CHECK(t.with_data.empty());
+    CHECK(t.batched == std::vector{c});
+    CHECK(t.batched_with_data == std::vector{b});
+    t = {};
+    reg.get_notifiers(other, namespace_id::Contacts, t);
+    CHECK(t.empty());
+
+    // Invalid pubkeys are ignored
+    subs = {{"short", "73686f7274", ns_list({0}), false, false}};
+    reg.update(subs, a);
+    CHECK(reg.size() == 4);
+}
+
+TEST_CASE("monitors - expired subscriptions are swept", "[monitors]") {
+    MonitorRegistry reg;
+    auto empty = reg.memory_usage();
+
+    std::vector<sub_info> subs;
+    for (int i = 0; i < 100; i++) {
+        auto hex = fmt::format("05{:064x}", i * 0x1234567);
+        subs.emplace_back(oxenc::from_hex(hex), hex, ns_list({0}), false, false);
+    }
+    reg.update(subs, make_conn('a'));
+    CHECK(reg.size() == 100);
+    auto used = reg.memory_usage();
+    CHECK(used >= empty + 100 * sizeof(server::MonitorData));
+
+    CHECK(reg.sweep() == 0);
+    CHECK(reg.sweep(std::chrono::steady_clock::now() + 64min) == 0);
+    CHECK(reg.sweep(std::chrono::steady_clock::now() + 66min) == 100);
+    CHECK(reg.size() == 0);
+    CHECK(reg.memory_usage() < used);
+}
+
+TEST_CASE("monitors - notification batches", "[monitors]") {
+    fake_mq mq;
+    auto a = make_conn('a'), b = make_conn('b');
+
+    server::notify_targets t;
+    t.batched = {a, b};
+    mq.deliver_notifies(t, "d1:ai1ee", "");
+    t = {};
+    t.batched_with_data = {a};
+    mq.deliver_notifies(t, "d1:ai2ee", "d1:ai2e1:~4:datae");
+    CHECK(mq.batches.empty());
+
+    mq.flush_notifies();
+    REQUIRE(mq.batches.size() == 2);
+    std::sort(mq.batches.begin(), mq.batches.end(), [&](auto& x, auto& y) {
+        return (x.first == a) > (y.first == a);
+    });
+    CHECK(mq.batches[0].first == a);
+    CHECK(mq.batches[0].second == "ld1:ai1eed1:ai2e1:~4:dataee");
+    CHECK(mq.batches[1].first == b);
+    CHECK(mq.batches[1].second == "ld1:ai1eee");
+
+    mq.batches.clear();
+    mq.flush_notifies();
+    CHECK(mq.batches.empty());
+}
+
+TEST_CASE("monitors - notification send budgets", "[monitors]") {
+    fake_mq mq;
+    auto a = make_conn('a'), b = make_conn('b');
+    const auto start = std::chrono::steady_clock::now();
+
+    // Sizes chosen so that four full notifications use up the whole burst budget
+    std::string metadata(100'000, 'm'), full(1'000'000, 'f');
+    for (int i = 0; i < 4; i++) {
+        server::notify_targets t;
+        t.with_data = {a};
+        mq.deliver_notifies(t, metadata, full, start);
+    }
+    REQUIRE(mq.sent.size() == 4);
+    CHECK(mq.sent.back().second.size() == full.size());
+
+    // Over budget: the next gets dropped entirely (there isn't even room for the metadata), while
+    // other connections are unaffected.
+    server::notify_targets t;
+    t.with_data = {a, b};
+    mq.deliver_notifies(t, metadata, full, start + 10ms);
+    REQUIRE(mq.sent.size() == 5);
+    CHECK(mq.sent.back().first == b);
+    CHECK(mq.notifies_dropped() == 1);
+    CHECK(mq.notifies_degraded() == 0);
+    CHECK(mq.resyncs.empty());
+
+    // Once some budget has refilled `a` gets a metadata-only notification, preceded by a resync
+    // notice.
+    t = {};
+    t.with_data = {a};
+    mq.deliver_notifies(t, metadata, full, start + 150ms);
+    REQUIRE(mq.sent.size() == 6);
+    CHECK(mq.sent.back().second.size() == metadata.size());
+    CHECK(mq.notifies_degraded() == 1);
+    REQUIRE(mq.resyncs.size() == 1);
+    CHECK(mq.resyncs[0].first == a);
+    CHECK(mq.resyncs[0].second == "d7:droppedi1ee");
+
+    // After a second the budget has refilled enough for a full notification again
+    t = {};
+    t.with_data = {a};
+    mq.deliver_notifies(t, metadata, full, start + 1150ms);
+    REQUIRE(mq.sent.size() == 7);
+    CHECK(mq.sent.back().second.size() == full.size());
+
+    // Use up `a`'s budget again, dropping some notifications.  Once it has been idle long enough
+    // the sweep forgets its budget, after which `a` starts over like a new connection: with a full
+    // burst budget, and nothing dropped to send a resync notice about.
+    for (int i = 0; i < 4; i++) {
+        t = {};
+        t.with_data = {a};
+        mq.deliver_notifies(t, metadata, full, start + 1200ms);
+    }
+    REQUIRE(mq.sent.size() == 8);
+    CHECK(mq.notifies_dropped() == 4);
+    const auto later = start + 1200ms + server::MQBase::NOTIFY_BUDGET_IDLE + 1s;
+    mq.sweep_monitors(later);
+    t = {};
+    t.with_data = {a};
+    mq.deliver_notifies(t, metadata, full, later);
+    REQUIRE(mq.sent.size() == 9);
+    CHECK(mq.sent.back().second.size() == full.size());
+    CHECK(mq.resyncs.size() == 1);
+}
@@ -89,6 +89,43 @@ TEST_CASE("onion request - relay to snode", "[onion][snode]") {
     CHECK(*std::get_if<RelayToNodeInfo>(&res) == expected);
 }
 
+TEST_CASE("onion request - decrypt and parse layer", "[onion][snode]") {
+    const auto client_pubkey = x25519_pubkey::from_hex(
+            "01c7391664840b2ef7126b3709dbac178ba5f3ef2335a62343d5df7da4a11c30");
+    const auto client_seckey = x25519_seckey::from_hex(
+            "7d446468c186d6fb3c83365ab77a37b1f9fa3e59eb9788a40ae2e9560f196f30");
+    const auto snode_pubkey = x25519_pubkey::from_hex(
+            "f7b99da2e25e3c399902641c707ae20ad72b63ed0cc487730ff0b3bcecf18609");
+    const auto snode_seckey = x25519_seckey::from_hex(
+            "f512f68e81a932aa2ff6d8723baa260a43a6f789d61c91b71f73e4f284e3600a");
+    ChannelEncryption client{client_seckey, client_pubkey, false};
+    ChannelEncryption snode{snode_seckey, snode_pubkey};
+
+    auto data = prefix + R"#({
+        "destination": "ffffeeeeddddccccbbbbaaaa9999888877776666555544443333222211110000",
+        "ephemeral_key": "0000111122223333444455556666777788889999000011112222333344445555",
+        "enc_type": "xchacha20"
+    })#";
+
+    for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+        auto res = process_ciphertext_v2(
+                snode, client.encrypt(type, data, snode_pubkey), client_pubkey, type);
+
+        REQUIRE(std::holds_alternative<RelayToNodeInfo>(res));
+        auto& info = *std::get_if<RelayToNodeInfo>(&res);
+        CHECK(info.ciphertext.view() == ciphertext);
+        CHECK(info.enc_type == EncryptType::xchacha20);
+        // The inner ciphertext stays where it was decrypted, in the layer's buffer
+        CHECK(info.ciphertext.buffer.size() > data.size());
+        CHECK(std::move(info.ciphertext).release() == ciphertext);
+
+        auto bad = process_ciphertext_v2(snode, "garbage", client_pubkey, type);
+        REQUIRE(std::holds_alternative<ProcessCiphertextError>(bad));
+        CHECK(*std::get_if<ProcessCiphertextError>(&bad) ==
+              ProcessCiphertextError::INVALID_CIPHERTEXT);
+    }
+}
+
 TEST_CASE("onion request - url target filtering", "[onion][relay]") {
     CHECK(is_onion_url_target_allowed("/loki/v3/lsrpc"));
     CHECK(is_onion_url_target_allowed("/loki/oxen/v4/lsrpc"));
@@ -0,0 +1,145 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/request_handler.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace oxenss::rpc;
+using namespace std::literals;
+
+namespace {
+
+// A callback that counts the replies it gets
+response_callback counting_cb(int& count) {
+    return [&count](Response) { count++; };
+}
+
+OxendCache::result_ptr make_result(int height) {
+    return std::make_shared<const nlohmann::json>(nlohmann::json{{"height", height}});
+}
+
+}  // namespace
+
+TEST_CASE("oxend cache - hits and expiry", "[oxend-cache]") {
+    OxendCache cache;
+    const auto start = std::chrono::steady_clock::now();
+    int replies = 0;
+
+    auto cb = counting_cb(replies);
+    auto l = cache.start("get_info", cb, start);
+    CHECK(l.call);
+    CHECK_FALSE(l.cached);
+    CHECK_FALSE(cb);  // Taken to wait for the result
+
+    auto cbs = cache.finish("get_info", l.gen, make_result(123), start);
+    REQUIRE(cbs.size() == 1);
+    cbs[0](Response{});
+    CHECK(replies == 1);
+    CHECK(cache.size() == 1);
+
+    // Served from the cache until the ttl runs out, leaving the callback to the caller
+    cb = counting_cb(replies);
+    l = cache.start("get_info", cb, start + OXEND_CACHE_TTL - 1ms);
+    REQUIRE(l.cached);
+    CHECK(l.cached->at("height") == 123);
+    CHECK_FALSE(l.call);
+    CHECK(cb);
+
+    // Other params are a different request
+    l = cache.start("get_info\0{\"x\":1}"s, cb, start);
+    CHECK(l.call);
+    CHECK_FALSE(l.cached);
+    CHECK(cache.finish("get_info\0{\"x\":1}"s, l.gen, nullptr, start).size() == 1);
+
+    // Once expired the next request has to call oxend again
+    cb = counting_cb(replies);
+    l = cache.start("get_info", cb, start + OXEND_CACHE_TTL);
+    CHECK(l.call);
+    CHECK_FALSE(l.cached);
+    CHECK(cache.size() == 0);
+    cache.finish("get_info", l.gen, make_result(124), start + OXEND_CACHE_TTL);
+
+    cb = counting_cb(replies);
+    l = cache.start("get_info", cb, start + OXEND_CACHE_TTL + 1s);
+    REQUIRE(l.cached);
+    CHECK(l.cached->at("height") == 124);
+
+    // Failures don't get cached
+    cb = counting_cb(replies);
+    l = cache.start("ons_resolve", cb, start);
+    CHECK(l.call);
+    CHECK(cache.finish("ons_resolve", l.gen, nullptr, start).size() == 1);
+    cb = counting_cb(replies);
+    CHECK(cache.start("ons_resolve", cb, start).call);
+
+    // A new block clears the cache
+    cache.clear();
+    cb = counting_cb(replies);
+    CHECK(cache.start("get_info", cb, start + OXEND_CACHE_TTL + 1s).call);
+}
+
+TEST_CASE("oxend cache - identical requests share one oxend call", "[oxend-cache]") {
+    OxendCache cache;
+    const auto now = std::chrono::steady_clock::now();
+    int replies = 0, other_replies = 0;
+
+    // Only the first of several identical requests makes the oxend call; the rest wait for it
+    std::vector<OxendCache::lookup> lookups;
+    for (int i = 0; i < 5; i++) {
+        auto cb = counting_cb(replies);
+        lookups.push_back(cache.start("get_info", cb, now));
+        CHECK_FALSE(cb);
+    }
+    CHECK(lookups[0].call);
+    for (int i = 1; i < 5; i++) {
+        CHECK_FALSE(lookups[i].call);
+        CHECK_FALSE(lookups[i].cached);
+    }
+
+    // A different request doesn't join them
+    auto other = counting_cb(other_replies);
+    auto l = cache.start("get_service_nodes", other, now);
+    CHECK(l.call);
+
+    // The one result answers them all
+    auto cbs = cache.finish("get_info", lookups[0].gen, make_result(123), now);
+    REQUIRE(cbs.size() == 5);
+    for (auto& cb : cbs)
+        cb(Response{});
+    CHECK(replies == 5);
+    CHECK(other_replies == 0);
+    for (auto& cb : cache.finish("get_service_nodes", l.gen, make_result(1), now))
+        cb(Response{});
+    CHECK(other_replies == 1);
+
+    // Requests arriving after the call has finished get the cached result instead
+    auto cb = counting_cb(replies);
+    CHECK(cache.start("get_info", cb, now).cached);
+}
+
+TEST_CASE("oxend cache - results from before a new block aren't cached", "[oxend-cache]") {
+    OxendCache cache;
+    const auto now = std::chrono::steady_clock::now();
+    int replies = 0;
+
+    auto cb = counting_cb(replies);
+    auto l = cache.start("get_info", cb, now);
+    REQUIRE(l.call);
+    cache.clear();
+    // The waiting request still gets its reply, but the result isn't kept
+    CHECK(cache.finish("get_info", l.gen, make_result(123), now).size() == 1);
+    CHECK(cache.size() == 0);
+
+    // With a ttl of 0 nothing gets cached, but identical requests are still shared
+    cache.ttl(0ms);
+    cb = counting_cb(replies);
+    l = cache.start("get_info", cb, now);
+    REQUIRE(l.call);
+    cb = counting_cb(replies);
+    CHECK_FALSE(cache.start("get_info", cb, now).call);
+    CHECK(cache.finish("get_info", l.gen, make_result(123), now).size() == 2);
+    CHECK(cache.size() == 0);
+}
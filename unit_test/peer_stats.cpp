@@ -0,0 +1,68 @@
+#include <oxenss/snode/stats.h>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <vector>
+
+using namespace oxenss::snode;
+using namespace std::literals;
+
+namespace {
+
+std::vector<ResultType> results(const peer_stats& p) {
+    std::vector<ResultType> out;
+    p.for_each_storage_test([&](const test_result& t) { out.push_back(t.result); });
+    return out;
+}
+
+}  // namespace
+
+TEST_CASE("peer stats - bounded test history", "[stats]") {
+    peer_stats p;
+    auto now = std::chrono::system_clock::now();
+    CHECK(p.storage_test_count() == 0);
+    CHECK(p.success_ratio() < 0);
+
+    for (size_t i = 0; i < PEER_TEST_HISTORY + 5; i++)
+        p.add_storage_test(
+                {now + std::chrono::seconds{i}, i % 2 ? ResultType::MISMATCH : ResultType::OK});
+
+    // Only the most recent results are kept, oldest first; the counts include all of them
+    REQUIRE(p.storage_test_count() == PEER_TEST_HISTORY);
+    std::vector<test_result> kept;
+    p.for_each_storage_test([&](const test_result& t) { kept.push_back(t); });
+    CHECK(kept.front().timestamp == now + 5s);
+    CHECK(kept.back().timestamp == now + std::chrono::seconds{PEER_TEST_HISTORY + 4});
+    CHECK(p.test_windows[0][static_cast<size_t>(ResultType::OK)] == (PEER_TEST_HISTORY + 6) / 2);
+    CHECK(p.test_windows[0][static_cast<size_t>(ResultType::MISMATCH)] ==
+          (PEER_TEST_HISTORY + 5) / 2);
+}
+
+TEST_CASE("peer stats - windows", "[stats]") {
+    peer_stats p;
+    auto now = std::chrono::system_clock::now();
+
+    p.add_storage_test({now - 3h, ResultType::OK});
+    p.add_storage_test({now - 1h, ResultType::REJECTED});
+    p.add_storage_test({now, ResultType::OK});
+    CHECK(p.success_ratio(0) == Approx(2.0 / 3));
+
+    // Rotating starts a new window and drops results older than the cutoff
+    p.rotate(now - 2h);
+    CHECK(p.success_ratio(0) < 0);
+    CHECK(p.success_ratio(1) == Approx(2.0 / 3));
+    CHECK(results(p) == std::vector{ResultType::REJECTED, ResultType::OK});
+
+    p.add_storage_test({now, ResultType::OK});
+    CHECK(p.success_ratio(0) == 1.0);
+    CHECK(p.success_ratio() == Approx(3.0 / 4));
+
+    // Windows eventually fall off the end
+    for (size_t i = 0; i < RECENT_STATS_COUNT; i++)
+        p.rotate(now - 2h);
+    CHECK(p.success_ratio(RECENT_STATS_COUNT) == 1.0);
+    p.rotate(now + 1s);
+    CHECK(p.success_ratio() < 0);
+    CHECK(p.storage_test_count() == 0);
+}
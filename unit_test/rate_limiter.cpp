@@ -5,6 +5,7 @@
 #include <oxenmq/oxenmq.h>
 
 #include <chrono>
+#include <string>
 
 using oxenss::rpc::RateLimiter;
 using namespace oxenss::crypto;
@@ -109,12 +110,181 @@ TEST_CASE("rate limiter - client - max client limit", "[ratelim][client]") {
 
     uint32_t ip_start = (10 << 24) + 1;
 
-    for (uint32_t i = 0; i < RateLimiter::MAX_CLIENTS; ++i) {
-        rate_limiter.should_rate_limit_client(ip_start + i, now);
+    // Exhaust the buckets of twice as many clients as we track, one after another
+    const uint32_t clients = 2 * RateLimiter::MAX_CLIENTS;
+    for (uint32_t i = 0; i < clients; ++i)
+        for (uint32_t j = 0; j < RateLimiter::BUCKET_SIZE; ++j)
+            rate_limiter.should_rate_limit_client(ip_start + i, now + i * 1us);
+    const auto last = now + clients * 1us;
+
+    // New clients take over the slots of older ones rather than being refused
+    uint32_t overflow_ip = ip_start + clients;
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(overflow_ip, last));
+    // while the most recent clients are still limited
+    CHECK(rate_limiter.should_rate_limit_client(overflow_ip - 1, last));
+
+    // Once they have refilled, the sweep releases the buckets and clients start afresh
+    const auto later = last + 1min;
+    rate_limiter.clean_buckets(later);
+    for (uint32_t j = 0; j < RateLimiter::BUCKET_SIZE; ++j)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(overflow_ip - 1, later));
+    CHECK(rate_limiter.should_rate_limit_client(overflow_ip - 1, later));
+}
+
+TEST_CASE("rate limiter - client - address strings", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq};
+    const auto now = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client("10.1.1.13"s, now));
+    CHECK(rate_limiter.should_rate_limit_client("10.1.1.13"s, now));
+    // The same client, by number and as an IPv4-mapped IPv6 address
+    CHECK(rate_limiter.should_rate_limit_client((10 << 24) + (1 << 16) + (1 << 8) + 13, now));
+    CHECK(rate_limiter.should_rate_limit_client("::ffff:10.1.1.13"s, now));
+    CHECK(rate_limiter.should_rate_limit_client("[::ffff:10.1.1.13]"s, now));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("10.1.1.14"s, now));
+
+    // Garbage isn't limited
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("not an ip"s, now));
+    CHECK(rate_limiter.client_limited() == 4);
+}
+
+TEST_CASE("rate limiter - client - IPv6 /64 prefixes", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq};
+    const auto now = std::chrono::steady_clock::now();
+
+    // Addresses in the same /64 share a bucket
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(
+                "2001:db8:1:2::" + std::to_string(i % 100 + 1), now));
+    CHECK(rate_limiter.should_rate_limit_client("2001:db8:1:2:ffff::1"s, now));
+    CHECK(rate_limiter.should_rate_limit_client("[2001:db8:1:2::abcd]"s, now));
+
+    // but other /64s don't
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("2001:db8:1:3::1"s, now));
+
+    // Raw addresses, as from the HTTPS server
+    std::string raw(16, '\0');
+    raw[0] = 0x20;
+    raw[1] = 0x01;
+    raw[2] = 0x0d;
+    raw[3] = static_cast<char>(0xb8);
+    raw[5] = 1;
+    raw[7] = 2;
+    raw[15] = 0x42;
+    CHECK(rate_limiter.should_rate_limit_client_ipv6(raw, now));
+    raw[7] = 4;
+    CHECK_FALSE(rate_limiter.should_rate_limit_client_ipv6(raw, now));
+}
+
+TEST_CASE("rate limiter - configured limits", "[ratelim]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq, {10, 100, 1000, 1000}};
+    auto identifier = legacy_pubkey::from_hex(
+            "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+    const auto now = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < 10; ++i) {
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now));
+        CHECK_FALSE(rate_limiter.should_rate_limit(identifier, now));
     }
-    uint32_t overflow_ip = ip_start + RateLimiter::MAX_CLIENTS;
-    CHECK(rate_limiter.should_rate_limit_client(overflow_ip, now));
-    // Wait for buckets to be filled
-    const auto delta = 1'000'000us / RateLimiter::TOKEN_RATE;
-    CHECK_FALSE(rate_limiter.should_rate_limit_client(overflow_ip, now + delta));
+    CHECK(rate_limiter.should_rate_limit_client(42, now));
+    CHECK(rate_limiter.should_rate_limit(identifier, now));
+
+    // Service nodes get a token every 1ms, clients every 10ms
+    CHECK_FALSE(rate_limiter.should_rate_limit(identifier, now + 1ms));
+    CHECK(rate_limiter.should_rate_limit_client(42, now + 1ms));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now + 10ms));
+    CHECK(rate_limiter.snode_limited() == 1);
+    CHECK(rate_limiter.client_limited() == 2);
+}
+
+TEST_CASE("rate limiter - memory usage", "[ratelim]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter small{omq, {10, 100, 1000, 1000}};
+    RateLimiter big{omq, {10, 100, 1000, 100000}};
+    // The tables are allocated up front, and sized by the client limit
+    auto used = small.memory_usage();
+    CHECK(used >= (1000 + 8192) * 2 * sizeof(uint64_t));
+    CHECK(big.memory_usage() >= used + 99000 * 2 * sizeof(uint64_t));
+    CHECK_FALSE(small.should_rate_limit_client(42));
+    CHECK(small.memory_usage() == used);
+}
+
+TEST_CASE("rate limiter - client - request costs", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq, {10, 100, 1000, 1000}};
+    const auto now = std::chrono::steady_clock::now();
+
+    CHECK(RateLimiter::endpoint_cost("store") > 1);
+    CHECK(RateLimiter::endpoint_cost("info") == 1);
+    CHECK(RateLimiter::endpoint_cost("no_such_endpoint") == 1);
+
+    // 4 + 4 + 2 tokens empties the bucket
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now, 4));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now, 4));
+    CHECK(rate_limiter.should_rate_limit_client(42, now, 4));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now, 2));
+    CHECK(rate_limiter.should_rate_limit_client(42, now, 1));
+
+    // Refilling enough for a cheap request doesn't allow an expensive one
+    CHECK(rate_limiter.should_rate_limit_client(42, now + 10ms, 2));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now + 10ms, 1));
+    CHECK(rate_limiter.should_rate_limit_client(42, now + 30ms, 4));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now + 50ms, 4));
+
+    // A cost beyond the bucket size is capped to it, rather than always being refused
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(43, now, 1000));
+    CHECK(rate_limiter.should_rate_limit_client(43, now, 1));
+}
+
+TEST_CASE("rate limiter - client - adapts to load", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq, {10, 100, 1000, 1000}};
+    const auto now = std::chrono::steady_clock::now();
+    CHECK(rate_limiter.load_scale() == 1.0);
+
+    // Moderate load leaves the rate alone
+    rate_limiter.update_load({RateLimiter::QUEUE_DELAY_TARGET * 3 / 4, 0us, 0});
+    CHECK(rate_limiter.load_scale() == 1.0);
+
+    // Any signal over its target cuts the rate, down to the minimum
+    rate_limiter.update_load({0us, RateLimiter::LOOP_LAG_TARGET * 2, 0});
+    CHECK(rate_limiter.load_scale() == 0.75);
+    rate_limiter.update_load({0us, 0us, RateLimiter::STORE_BACKLOG_TARGET + 1});
+    CHECK(rate_limiter.load_scale() < 0.75);
+    for (int i = 0; i < 20; i++)
+        rate_limiter.update_load({1s, 0us, 0});
+    CHECK(rate_limiter.load_scale() == Approx(RateLimiter::MIN_LOAD_SCALE));
+
+    // Client buckets now refill at 1/8 of the rate: a token every 80ms rather than every 10ms
+    for (int i = 0; i < 10; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now));
+    CHECK(rate_limiter.should_rate_limit_client(42, now + 40ms));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(42, now + 80ms));
+
+    // Service nodes aren't affected
+    auto identifier = legacy_pubkey::from_hex(
+            "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+    for (int i = 0; i < 10; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit(identifier, now));
+    CHECK_FALSE(rate_limiter.should_rate_limit(identifier, now + 1ms));
+
+    // Once load is low the rate recovers gradually, up to the maximum
+    rate_limiter.update_load({});
+    CHECK(rate_limiter.load_scale() == Approx(RateLimiter::MIN_LOAD_SCALE + 0.125));
+    for (int i = 0; i < 30; i++)
+        rate_limiter.update_load({});
+    CHECK(rate_limiter.load_scale() == Approx(RateLimiter::MAX_LOAD_SCALE));
+}
+
+TEST_CASE("rate limiter - client - fixed rate", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq, {10, 100, 1000, 1000, /*adaptive=*/false}};
+    rate_limiter.update_load({1s, 1s, 1'000'000});
+    CHECK(rate_limiter.load_scale() == 1.0);
+    rate_limiter.update_load({});
+    CHECK(rate_limiter.load_scale() == 1.0);
 }
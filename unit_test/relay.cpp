@@ -0,0 +1,345 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/snode/relay.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+using oxenss::snode::RelayScheduler;
+using oxenss::snode::sn_record;
+
+namespace {
+
+// Records sends so that the test can complete them when it wants to
+struct fake_sender {
+    struct sent {
+        sn_record sn;
+        std::string batch;
+        std::function<void(bool)> done;
+    };
+    std::mutex mutex;
+    std::vector<sent> pending;
+    size_t total = 0;
+
+    RelayScheduler::send_fn fn() {
+        return [this](const sn_record& sn, const std::string& batch, auto done) {
+            std::lock_guard lock{mutex};
+            pending.push_back({sn, batch, std::move(done)});
+            total++;
+        };
+    }
+
+    size_t count() {
+        std::lock_guard lock{mutex};
+        return pending.size();
+    }
+
+    size_t count_for(const sn_record& sn) {
+        std::lock_guard lock{mutex};
+        size_t n = 0;
+        for (auto& s : pending)
+            n += s.sn == sn;
+        return n;
+    }
+
+    // Completes all currently pending sends with the given result, returning how many there were
+    size_t complete(bool success) {
+        std::vector<sent> done;
+        {
+            std::lock_guard lock{mutex};
+            done.swap(pending);
+        }
+        for (auto& s : done)
+            s.done(success);
+        return done.size();
+    }
+};
+
+sn_record make_sn(unsigned char id) {
+    sn_record sn;
+    sn.pubkey_legacy.data()[0] = id;
+    return sn;
+}
+
+// Waits (up to a second) for `pred` to be true
+template <typename Pred>
+bool wait_for(Pred pred) {
+    for (int i = 0; i < 1000; i++) {
+        if (pred())
+            return true;
+        std::this_thread::sleep_for(1ms);
+    }
+    return pred();
+}
+
+RelayScheduler::config test_config() {
+    RelayScheduler::config conf;
+    conf.max_bytes_per_sec = 0;
+    conf.retry_backoff = 0ms;
+    return conf;
+}
+
+}  // namespace
+
+TEST_CASE("relay - per-peer window", "[relay]") {
+    fake_sender sender;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, test_config()};
+    auto a = make_sn(1), b = make_sn(2);
+
+    for (int i = 0; i < 5; i++)
+        relay.enqueue("batch" + std::to_string(i), {a, b});
+    CHECK(sender.count_for(a) == 2);
+    CHECK(sender.count_for(b) == 2);
+
+    auto p = relay.get_progress();
+    CHECK(p.batches_queued == 10);
+    CHECK(p.peers_pending == 2);
+    CHECK(p.bytes_in_flight == 4 * 6);
+    CHECK(p.bytes_queued == 5 * 6);
+
+    // Each completion lets the next batch go out, in order
+    CHECK(sender.complete(true) == 4);
+    CHECK(sender.count() == 4);
+    {
+        std::lock_guard lock{sender.mutex};
+        CHECK(sender.pending[0].batch == "batch2");
+    }
+    while (sender.complete(true) > 0) {}
+
+    p = relay.get_progress();
+    CHECK(p.batches_sent == 10);
+    CHECK(p.bytes_sent == 10 * 6);
+    CHECK(p.bytes_queued == 0);
+    CHECK(p.bytes_in_flight == 0);
+    CHECK(p.idle());
+}
+
+TEST_CASE("relay - global in-flight cap", "[relay]") {
+    fake_sender sender;
+    auto conf = test_config();
+    conf.max_inflight_bytes = 25;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, conf};
+
+    relay.enqueue(std::string(10, 'x'), {make_sn(1), make_sn(2), make_sn(3)});
+    CHECK(sender.count() == 2);
+
+    // A batch bigger than the cap still gets sent once nothing else is in flight
+    relay.enqueue(std::string(100, 'y'), {make_sn(4)});
+    CHECK(sender.count() == 2);
+    CHECK(sender.complete(true) == 2);
+    CHECK(sender.count() == 1);
+    CHECK(sender.complete(true) == 1);
+    CHECK(sender.count() == 1);
+    CHECK(sender.complete(true) == 1);
+    CHECK(relay.get_progress().idle());
+}
+
+TEST_CASE("relay - send rate cap", "[relay]") {
+    fake_sender sender;
+    auto conf = test_config();
+    conf.max_bytes_per_sec = 1000;
+    conf.peer_window = 10;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, conf};
+
+    // The first second's allowance covers the first two, after which we have to wait
+    for (int i = 0; i < 3; i++)
+        relay.enqueue(std::string(600, 'a' + i), {make_sn(1)});
+    CHECK(sender.count() == 2);
+    relay.tick();
+    CHECK(sender.count() == 2);
+
+    std::this_thread::sleep_for(300ms);
+    relay.tick();
+    CHECK(sender.count() == 3);
+}
+
+TEST_CASE("relay - retries and failures", "[relay]") {
+    fake_sender sender;
+    auto conf = test_config();
+    conf.max_attempts = 3;
+    std::vector<sn_record> failed;
+    RelayScheduler relay{sender.fn(), [&](const sn_record& sn) { failed.push_back(sn); }, conf};
+    auto a = make_sn(1), b = make_sn(2);
+
+    relay.enqueue("data", {a, b});
+    // `a` fails every time, `b` on the first attempt only
+    for (int attempt = 0; attempt < 3; attempt++) {
+        std::vector<fake_sender::sent> sends;
+        {
+            std::lock_guard lock{sender.mutex};
+            sends.swap(sender.pending);
+        }
+        for (auto& s : sends)
+            s.done(s.sn == b && attempt > 0);
+    }
+    CHECK(sender.count() == 0);
+    CHECK(sender.total == 5);
+    REQUIRE(failed.size() == 1);
+    CHECK(failed[0] == a);
+
+    auto p = relay.get_progress();
+    CHECK(p.batches_sent == 1);
+    CHECK(p.batches_failed == 1);
+    CHECK(p.retries == 3);
+    CHECK(p.bytes_queued == 0);
+    CHECK(p.idle());
+}
+
+TEST_CASE("relay - retry backoff", "[relay]") {
+    fake_sender sender;
+    auto conf = test_config();
+    conf.retry_backoff = 200ms;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, conf};
+
+    relay.enqueue("data", {make_sn(1)});
+    CHECK(sender.complete(false) == 1);
+    relay.tick();
+    CHECK(sender.count() == 0);
+    std::this_thread::sleep_for(250ms);
+    relay.tick();
+    CHECK(sender.count() == 1);
+}
+
+TEST_CASE("relay - producers wait for queue space", "[relay]") {
+    fake_sender sender;
+    auto conf = test_config();
+    conf.max_queued_bytes = 250;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, conf};
+
+    std::atomic<int> produced = 0;
+    relay.add_producer({make_sn(1), make_sn(2)}, [&](const auto& emit) {
+        for (int i = 0; i < 10; i++) {
+            if (!emit(std::string(100, 'a' + i)))
+                return;
+            produced++;
+        }
+    });
+
+    // Two batches fit in the queue, and then the producer has to wait for them to be delivered
+    REQUIRE(wait_for([&] { return sender.count() == 4; }));
+    std::this_thread::sleep_for(20ms);
+    CHECK(produced.load() == 2);
+    CHECK(relay.get_progress().bytes_queued <= 250);
+    CHECK(relay.get_progress().producers_pending == 1);
+
+    size_t delivered = 0;
+    REQUIRE(wait_for([&] {
+        delivered += sender.complete(true);
+        return relay.get_progress().idle();
+    }));
+    CHECK(produced.load() == 10);
+    CHECK(delivered == 20);
+    CHECK(relay.get_progress().batches_sent == 20);
+}
+
+TEST_CASE("relay - shutdown stops waiting producers", "[relay]") {
+    fake_sender sender;
+    std::atomic<bool> stopped = false;
+    {
+        auto conf = test_config();
+        conf.max_queued_bytes = 1;
+        RelayScheduler relay{sender.fn(), [](auto&) {}, conf};
+        relay.add_producer({make_sn(1)}, [&](const auto& emit) {
+            while (emit("more")) {}
+            stopped = true;
+        });
+        REQUIRE(wait_for([&] { return sender.count() == 1; }));
+    }
+    CHECK(stopped.load());
+}
+
+TEST_CASE("relay - taking what is still queued", "[relay]") {
+    fake_sender sender;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, test_config()};
+    auto a = make_sn(1), b = make_sn(2);
+
+    for (int i = 0; i < 4; i++)
+        relay.enqueue("batch" + std::to_string(i), {a, b});
+    // batch0 and batch1 are in flight to both; batch0 then gets delivered to `a`, letting batch2
+    // go out to it
+    {
+        std::lock_guard lock{sender.mutex};
+        REQUIRE(sender.pending.size() == 4);
+        CHECK(sender.pending[0].sn == a);
+        CHECK(sender.pending[0].batch == "batch0");
+    }
+    {
+        fake_sender::sent first;
+        {
+            std::lock_guard lock{sender.mutex};
+            first = std::move(sender.pending.front());
+            sender.pending.erase(sender.pending.begin());
+        }
+        first.done(true);
+    }
+
+    auto queued = relay.take_queued();
+    REQUIRE(queued.size() == 2);
+    // (The order of batches and peers depends on where the round-robin happens to be)
+    std::sort(queued.begin(), queued.end(), [](auto& x, auto& y) { return x.data < y.data; });
+    for (auto& q : queued)
+        std::sort(q.peers.begin(), q.peers.end(), [](auto& x, auto& y) {
+            return x.data()[0] < y.data()[0];
+        });
+    CHECK(queued[0].data == "batch2");
+    CHECK(queued[0].peers == std::vector{b.pubkey_legacy});
+    CHECK(queued[1].data == "batch3");
+    CHECK(queued[1].peers == std::vector{a.pubkey_legacy, b.pubkey_legacy});
+
+    // Nothing is left to send once what's in flight finishes, and nothing new gets queued
+    relay.enqueue("late", {a});
+    while (sender.complete(true) > 0) {}
+    CHECK(relay.get_progress().idle());
+    CHECK(relay.get_progress().bytes_queued == 0);
+    CHECK(relay.take_queued().empty());
+}
+
+TEST_CASE("relay - memory usage", "[relay]") {
+    fake_sender sender;
+    RelayScheduler relay{sender.fn(), [](auto&) {}, test_config()};
+    auto a = make_sn(1), b = make_sn(2);
+    auto idle = relay.memory_usage();
+
+    // Each batch's data is counted once, however many peers it is queued for
+    std::string data(10000, 'x');
+    for (int i = 0; i < 10; i++)
+        relay.enqueue(data, {a, b});
+    auto used = relay.memory_usage();
+    CHECK(used >= idle + 10 * data.size());
+    CHECK(used < idle + 2 * 10 * data.size());
+
+    while (sender.complete(true) > 0) {}
+    CHECK(relay.memory_usage() < idle + data.size());
+}
+
+TEST_CASE("relay - saved queue serialization", "[relay]") {
+    using oxenss::snode::deserialize_relay_queue;
+    using oxenss::snode::serialize_relay_queue;
+
+    std::vector<RelayScheduler::queued_batch> batches;
+    batches.push_back({"first batch", {make_sn(1).pubkey_legacy, make_sn(2).pubkey_legacy}});
+    batches.push_back({std::string(1000, '\0'), {make_sn(3).pubkey_legacy}});
+    auto saved = std::chrono::system_clock::now();
+
+    auto loaded = deserialize_relay_queue(serialize_relay_queue(batches, saved));
+    REQUIRE(loaded);
+    auto& [got, got_saved] = *loaded;
+    REQUIRE(got.size() == 2);
+    for (size_t i = 0; i < 2; i++) {
+        CHECK(got[i].data == batches[i].data);
+        CHECK(got[i].peers == batches[i].peers);
+    }
+    CHECK(std::chrono::abs(got_saved - saved) < 1s);
+
+    CHECK_FALSE(deserialize_relay_queue(""));
+    CHECK_FALSE(deserialize_relay_queue("garbage"));
+    // A batch with a truncated pubkey list
+    CHECK_FALSE(deserialize_relay_queue("d1:qll1:x31:" + std::string(31, 'k') + "ee1:ti0e1:vi1ee"));
+}
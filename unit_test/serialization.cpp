@@ -1,5 +1,6 @@
 #include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/server/utils.h>
 #include <oxenc/hex.h>
 
 #include <catch2/catch.hpp>
@@ -68,3 +69,305 @@ TEST_CASE("v1 serialization - batch serialization", "[serialization]") {
     serialized = serialize_messages(msgs.begin(), msgs.end(), 1);
     CHECK(serialized.size() == 2);
 }
+
+TEST_CASE("v1 serialization - streaming serializer", "[serialization]") {
+    oxenss::user_pubkey pub_key;
+    REQUIRE(pub_key.load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    std::string data(100000, 'x');
+    const std::chrono::system_clock::time_point timestamp{1'622'576'077s};
+    std::vector<oxenss::message> msgs;
+    for (int i = 0; i < 200; i++)
+        msgs.emplace_back(
+                pub_key,
+                "hash" + std::to_string(i),
+                oxenss::namespace_id::Default,
+                timestamp,
+                timestamp + 24h,
+                data);
+
+    std::vector<std::string> streamed;
+    MessageSerializer serializer{SERIALIZATION_VERSION_BT, [&](std::string batch) {
+                                     streamed.push_back(std::move(batch));
+                                 }};
+    serializer.flush();
+    CHECK(streamed.empty());  // Flushing nothing shouldn't produce an empty batch
+
+    for (const auto& m : msgs)
+        serializer.add(m);
+    serializer.flush();
+    CHECK(serializer.batches() == 3);
+
+    CHECK(streamed == serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT));
+    size_t count = 0;
+    for (const auto& batch : streamed)
+        count += deserialize_messages(batch).size();
+    CHECK(count == msgs.size());
+}
+
+TEST_CASE("v1 serialization - splitting batches", "[serialization]") {
+    oxenss::user_pubkey pub_key;
+    REQUIRE(pub_key.load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    const std::chrono::system_clock::time_point timestamp{1'622'576'077s};
+    std::vector<oxenss::message> msgs;
+    for (int i = 0; i < 50; i++)
+        msgs.emplace_back(
+                pub_key,
+                "hash" + std::to_string(i),
+                oxenss::namespace_id::Default,
+                timestamp,
+                timestamp + 24h,
+                std::string(1000 + 100 * i, 'x'));
+    auto batches = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+    REQUIRE(batches.size() == 1);
+
+    std::vector<std::string> chunks;
+    split_serialized_messages(batches[0], 10'000, [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks.size() > 10);
+    std::vector<oxenss::message> got;
+    for (const auto& c : chunks) {
+        CHECK(c.size() <= 10'000);
+        for (auto& m : deserialize_messages(c))
+            got.push_back(std::move(m));
+    }
+    REQUIRE(got.size() == msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        CHECK(got[i].hash == msgs[i].hash);
+        CHECK(got[i].data == msgs[i].data);
+    }
+
+    // Messages bigger than the chunk size get a chunk each
+    chunks.clear();
+    split_serialized_messages(batches[0], 100, [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks.size() == msgs.size());
+
+    // A chunk at least as big as the batch is the batch
+    chunks.clear();
+    split_serialized_messages(batches[0], batches[0].size(), [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks == batches);
+
+    CHECK_THROWS(split_serialized_messages("l1:ae", 100, [](std::string) {}));
+}
+
+TEST_CASE("v2 serialization - basic values", "[serialization]") {
+    oxenss::user_pubkey pub_key;
+    REQUIRE(pub_key.load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    const auto data = "da\x00ta"s;
+    const auto hash = "hash\x00\x01\x02\x03"s;
+    const std::chrono::system_clock::time_point timestamp{12'345'678ms};
+    const auto expiry = timestamp + 3456s;
+    std::vector<oxenss::message> msgs;
+    msgs.emplace_back(pub_key, hash, oxenss::namespace_id::Default, timestamp, expiry, data);
+    msgs.emplace_back(
+            pub_key, "h2", static_cast<oxenss::namespace_id>(-42), timestamp + 1s, expiry, "");
+    auto serialized = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_COMPACT);
+    REQUIRE(serialized.size() == 1);
+    const auto expected_serialized =
+            "\x02ll"
+            "33:\x05\x43\x68\x52\x00\x05\x78\x6b\x24\x9b\xcd\x46\x1d\x28\xf7\x5e\x56"  // pubkey
+            "\x0e\xa7\x94\x01\x4e\xeb\x17\xfc\xf6\x00\x3f\x37\xd8\x76\x78\x3e"
+            "i12345678e"  // base timestamp
+            "l"
+            "l8:hash\x00\x01\x02\x03i0ei3456000ei0e5:da\x00tae"
+            "l2:h2i1000ei3455000ei-42e0:e"
+            "eee"s;
+    CHECK(serialized.front() == expected_serialized);
+
+    const auto messages = deserialize_messages(serialized.front());
+    REQUIRE(messages.size() == 2);
+    for (int i = 0; i < 2; ++i) {
+        CHECK(messages[i].pubkey == pub_key);
+        CHECK(messages[i].hash == msgs[i].hash);
+        CHECK(messages[i].msg_namespace == msgs[i].msg_namespace);
+        CHECK(messages[i].timestamp == msgs[i].timestamp);
+        CHECK(messages[i].expiry == msgs[i].expiry);
+        CHECK(messages[i].data == msgs[i].data);
+    }
+
+    CHECK(serialize_messages(msgs.begin(), msgs.begin(), SERIALIZATION_VERSION_COMPACT) ==
+          std::vector{"\x02le"s});
+    CHECK(deserialize_messages("\x02le").empty());
+    // Out of range namespace:
+    CHECK_THROWS(deserialize_messages(
+            "\x02ll33:\x05\x43\x68\x52\x00\x05\x78\x6b\x24\x9b\xcd\x46\x1d\x28\xf7\x5e\x56"
+            "\x0e\xa7\x94\x01\x4e\xeb\x17\xfc\xf6\x00\x3f\x37\xd8\x76\x78\x3e"
+            "i0ell1:hi0ei1ei99999e0:eeee"s));
+    // Bad pubkey:
+    CHECK(deserialize_messages("\x02ll3:abci0ell1:hi0ei1ei0e0:eeee"s).empty());
+}
+
+TEST_CASE("v2 serialization - groups and streaming", "[serialization]") {
+    std::vector<oxenss::user_pubkey> owners(3);
+    REQUIRE(owners[0].load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    REQUIRE(owners[1].load("05ffba630924aa1224bb930dde21c0d11bf004608f2812217f8ac812d6c7e3ad48"s));
+    REQUIRE(owners[2].load("053c6e2ad7c3ece2e0d867bd0c7d6af334e1df98fa4b0ec6de31a32f4f8ba7de5f"s));
+    const std::chrono::system_clock::time_point timestamp{1'622'576'077s};
+    std::vector<oxenss::message> msgs;
+    for (int i = 0; i < 300; i++)
+        msgs.emplace_back(
+                owners[i / 100],
+                "hash" + std::to_string(i),
+                static_cast<oxenss::namespace_id>(i % 3),
+                timestamp + std::chrono::milliseconds{i * 1234},
+                timestamp + 14 * 24h,
+                std::string(i % 7 == 0 ? 100'000 : 100, 'x'));
+
+    auto v1 = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+    auto v2 = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_COMPACT);
+    size_t v1_size = 0, v2_size = 0;
+    for (auto& b : v1)
+        v1_size += b.size();
+    for (auto& b : v2) {
+        CHECK(b.size() <= SERIALIZATION_BATCH_SIZE);
+        v2_size += b.size();
+    }
+    CHECK(v2.size() == 1);
+    // Each message saves the 36-byte pubkey and a few digits of each time (less the namespace)
+    CHECK(v2_size + 300 * 40 < v1_size);
+
+    // Messages are handed over one at a time, in order
+    size_t i = 0;
+    REQUIRE(for_each_serialized_message(v2[0], [&](const message_view& m) {
+        REQUIRE(i < msgs.size());
+        CHECK(m.pubkey == msgs[i].pubkey);
+        CHECK(m.hash == msgs[i].hash);
+        CHECK(m.msg_namespace == msgs[i].msg_namespace);
+        CHECK(m.timestamp == msgs[i].timestamp);
+        CHECK(m.expiry == msgs[i].expiry);
+        CHECK(m.data == msgs[i].data);
+        i++;
+        return true;
+    }));
+    CHECK(i == msgs.size());
+
+    i = 0;
+    CHECK(for_each_serialized_message(v2[0], [&](const message_view&) { return ++i < 10; }));
+    CHECK(i == 10);
+
+    // Groups get split (repeating their header) when they don't fit in one batch
+    std::vector<oxenss::message> big;
+    for (int i = 0; i < 200; i++)
+        big.emplace_back(
+                owners[i / 100],
+                "hash" + std::to_string(i),
+                oxenss::namespace_id::Default,
+                timestamp + std::chrono::seconds{i},
+                timestamp + 24h,
+                std::string(100'000, 'x'));
+    auto batches = serialize_messages(big.begin(), big.end(), SERIALIZATION_VERSION_COMPACT);
+    CHECK(batches.size() == 3);
+    std::vector<oxenss::message> got;
+    for (auto& b : batches) {
+        CHECK(b.size() <= SERIALIZATION_BATCH_SIZE);
+        for (auto& m : deserialize_messages(b))
+            got.push_back(std::move(m));
+    }
+    REQUIRE(got.size() == big.size());
+    for (size_t i = 0; i < big.size(); i++) {
+        CHECK(got[i].pubkey == big[i].pubkey);
+        CHECK(got[i].hash == big[i].hash);
+        CHECK(got[i].timestamp == big[i].timestamp);
+        CHECK(got[i].expiry == big[i].expiry);
+    }
+}
+
+TEST_CASE("v2 serialization - splitting batches", "[serialization]") {
+    std::vector<oxenss::user_pubkey> owners(2);
+    REQUIRE(owners[0].load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    REQUIRE(owners[1].load("05ffba630924aa1224bb930dde21c0d11bf004608f2812217f8ac812d6c7e3ad48"s));
+    const std::chrono::system_clock::time_point timestamp{1'622'576'077s};
+    std::vector<oxenss::message> msgs;
+    for (int i = 0; i < 50; i++)
+        msgs.emplace_back(
+                owners[i % 20 < 15 ? 0 : 1],
+                "hash" + std::to_string(i),
+                oxenss::namespace_id::Default,
+                timestamp + std::chrono::seconds{i},
+                timestamp + 24h,
+                std::string(1000 + 100 * i, 'x'));
+    auto batches = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_COMPACT);
+    REQUIRE(batches.size() == 1);
+
+    std::vector<std::string> chunks;
+    split_serialized_messages(batches[0], 10'000, [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks.size() > 10);
+    std::vector<oxenss::message> got;
+    for (const auto& c : chunks) {
+        CHECK(c.size() <= 10'000);
+        for (auto& m : deserialize_messages(c))
+            got.push_back(std::move(m));
+    }
+    REQUIRE(got.size() == msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        CHECK(got[i].pubkey == msgs[i].pubkey);
+        CHECK(got[i].hash == msgs[i].hash);
+        CHECK(got[i].timestamp == msgs[i].timestamp);
+        CHECK(got[i].data == msgs[i].data);
+    }
+
+    chunks.clear();
+    split_serialized_messages(batches[0], 100, [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks.size() == msgs.size());
+
+    chunks.clear();
+    split_serialized_messages(batches[0], batches[0].size(), [&](std::string c) {
+        chunks.push_back(std::move(c));
+    });
+    CHECK(chunks == batches);
+}
+
+TEST_CASE("forwarded request batch serialization", "[serialization]") {
+    std::vector<forwarded_request> reqs{
+            {"store", "d1:ai1ee"}, {"delete", ""}, {"expire", "bin\0ary"s}};
+    auto decoded = deserialize_forwarded_batch(serialize_forwarded_batch(reqs));
+    REQUIRE(decoded.size() == reqs.size());
+    for (size_t i = 0; i < reqs.size(); i++) {
+        CHECK(decoded[i].method == reqs[i].method);
+        CHECK(decoded[i].body == reqs[i].body);
+    }
+    CHECK(deserialize_forwarded_batch(serialize_forwarded_batch({})).empty());
+
+    std::vector<std::vector<std::string>> replies{
+            {"d1:hi123ee"}, {"401", "signature verification failed"}, {}};
+    CHECK(deserialize_forwarded_replies(serialize_forwarded_replies(replies)) == replies);
+
+    CHECK_THROWS(deserialize_forwarded_batch("l5:storee"));
+    CHECK_THROWS(deserialize_forwarded_replies("li1ee"));
+}
+
+TEST_CASE("json to bt serialization", "[serialization]") {
+    using nlohmann::json;
+    auto j = json{
+            {"hf", json::array({19, 3})},
+            {"messages",
+             json::array(
+                     {json{{"data", "da\x00ta"s}, {"hash", "h"}, {"timestamp", 1234}},
+                      json::object()})},
+            {"more", false},
+            {"neg", -42},
+            {"swarm", json{{"bb", json{{"failed", true}}}, {"aa", ""}}},
+            {"t", 1700000000000}};
+
+    auto expected = "d"
+                    "2:hfli19ei3ee"
+                    "8:messagesld4:data5:da\x00ta4:hash1:h9:timestampi1234eedee"
+                    "4:morei0e"
+                    "3:negi-42e"
+                    "5:swarmd2:aa0:2:bbd6:failedi1eee"
+                    "1:ti1700000000000e"
+                    "e"s;
+    CHECK(oxenss::bt_serialize_json(j) == expected);
+    CHECK(oxenss::bt_serialize_json(j) == oxenc::bt_serialize(oxenss::json_to_bt(j)));
+
+    CHECK_THROWS(oxenss::bt_serialize_json(json{{"x", nullptr}}));
+    CHECK_THROWS(oxenss::bt_serialize_json(json{{"x", 1.5}}));
+}
@@ -3,10 +3,12 @@
 
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/snode/service_node.h>
 #include <oxenss/snode/swarm.h>
 #include <oxenss/utils/time.hpp>
 
 #include <oxenc/base64.h>
+#include <oxenc/bt_producer.h>
 
 using namespace std::literals;
 using namespace oxenss::crypto;
@@ -81,4 +83,170 @@ TEST_CASE("service nodes - message hashing", "[service-nodes][messages]") {
     auto expected = "4sMyAuaZlMwww3oFvfhazfw7ASx/7TDtO+TVc8aAjHs";
     CHECK(oxenss::rpc::computeMessageHash(pk, oxenss::namespace_id::Default, data) == expected);
     CHECK(oxenss::rpc::compute_hash_blake2b_b64({pk.prefixed_raw() + data}) == expected);
+
+    // Batched hashing gives the same hashes
+    std::vector<oxenss::rpc::store> stores(6);
+    for (size_t i = 0; i < stores.size(); i++) {
+        stores[i].pubkey = pk;
+        stores[i].msg_namespace = oxenss::namespace_id{static_cast<int16_t>(i % 5)};
+        stores[i].data = data.substr(0, data.size() * i / 5);
+    }
+    std::vector<const oxenss::rpc::store*> ptrs;
+    std::vector<std::string> want;
+    for (auto& st : stores) {
+        ptrs.push_back(&st);
+        want.push_back(oxenss::rpc::computeMessageHash(pk, st.msg_namespace, st.data));
+    }
+    CHECK(want.back() == expected);
+    CHECK(oxenss::rpc::computeMessageHashes(ptrs) == want);
+}
+
+namespace {
+struct bt_test_node {
+    int i;
+    uint64_t swarm_id;
+    bool funded = true;
+    bool aux_pks = true;
+};
+
+// Builds a bt-encoded get_service_nodes response like the one oxend sends (with keys in sorted
+// order, as bt requires), with pubkeys filled with the node number.
+std::string make_bt_swarm_update(const std::vector<bt_test_node>& nodes) {
+    oxenc::bt_dict_producer d;
+    d.append("block_hash", std::string(32, '\xbb'));
+    d.append("hardfork", 19);
+    d.append("height", 1234567);
+    {
+        auto states = d.append_list("service_node_states");
+        for (const auto& n : nodes) {
+            auto s = states.append_dict();
+            s.append("funded", n.funded ? 1 : 0);
+            if (n.aux_pks) {
+                s.append("pubkey_ed25519", std::string(32, static_cast<char>(0x40 + n.i)));
+                s.append("pubkey_x25519", std::string(32, static_cast<char>(0x60 + n.i)));
+            }
+            s.append("public_ip", "10.0.0." + std::to_string(n.i));
+            s.append("service_node_pubkey", std::string(32, static_cast<char>(0x20 + n.i)));
+            s.append("storage_lmq_port", 23000 + n.i);
+            s.append("storage_port", 22000 + n.i);
+            s.append("swarm_id", n.swarm_id);
+        }
+    }
+    d.append("snode_revision", 3);
+    return std::string{d.view()};
+}
+}  // namespace
+
+TEST_CASE("service nodes - bt swarm updates", "[service-nodes][updates]") {
+    using oxenss::snode::INVALID_SWARM_ID;
+    using oxenss::snode::detail::parse_swarm_update_bt;
+
+    const auto data = make_bt_swarm_update({
+            {1, 300},
+            {2, 100},
+            {3, 300},
+            {4, INVALID_SWARM_ID},
+            {5, 100, false},
+            {6, 100, true, false},
+    });
+
+    SECTION("well-formed") {
+        auto bu = parse_swarm_update_bt(data);
+        CHECK(bu.height == 1234567);
+        CHECK(bu.block_hash == std::string(64, 'b'));
+        CHECK(bu.hardfork == 19);
+        CHECK(bu.snode_revision == 3);
+        CHECK_FALSE(bu.unchanged);
+
+        // Swarms come out sorted by id; the unfunded node and the node without aux pubkeys are
+        // skipped, and the node with the invalid swarm id is decommissioned.
+        REQUIRE(bu.swarms.size() == 2);
+        CHECK(bu.swarms[0].swarm_id == 100);
+        REQUIRE(bu.swarms[0].snodes.size() == 1);
+        CHECK(bu.swarms[1].swarm_id == 300);
+        REQUIRE(bu.swarms[1].snodes.size() == 2);
+        const auto& sn = bu.swarms[1].snodes[1];
+        CHECK(sn.ip == "10.0.0.3");
+        CHECK(sn.port == 22003);
+        CHECK(sn.omq_quic_port == 23003);
+        CHECK(sn.pubkey_legacy == legacy_pubkey::from_bytes(std::string(32, '\x23')));
+        CHECK(sn.pubkey_ed25519 == ed25519_pubkey::from_bytes(std::string(32, '\x43')));
+        CHECK(sn.pubkey_x25519 == x25519_pubkey::from_bytes(std::string(32, '\x63')));
+        REQUIRE(bu.decommissioned_nodes.size() == 1);
+        CHECK(bu.decommissioned_nodes[0].ip == "10.0.0.4");
+        CHECK(bu.active_x25519_pubkeys.size() == 3);
+        CHECK(bu.active_x25519_pubkeys.count(std::string(32, '\x62')));
+    }
+
+    SECTION("unchanged") {
+        oxenc::bt_dict_producer d;
+        d.append("block_hash", std::string(32, '\xbb'));
+        d.append("hardfork", 19);
+        d.append("height", 1234567);
+        d.append("snode_revision", 3);
+        d.append("unchanged", 1);
+        auto bu = parse_swarm_update_bt(d.view());
+        CHECK(bu.unchanged);
+        CHECK(bu.height == 1234567);
+        CHECK(bu.swarms.empty());
+    }
+
+    SECTION("truncated") {
+        CHECK_THROWS(parse_swarm_update_bt(""));
+        CHECK_THROWS(parse_swarm_update_bt("d"));
+        for (size_t len : {data.size() - 5, data.size() / 2, size_t{20}})
+            CHECK_THROWS(parse_swarm_update_bt(std::string_view{data}.substr(0, len)));
+    }
+
+    SECTION("malformed") {
+        // Not a dict
+        CHECK_THROWS(parse_swarm_update_bt("l5:helloe"));
+        // Missing a required top-level field
+        {
+            oxenc::bt_dict_producer d;
+            d.append("block_hash", std::string(32, '\xbb'));
+            d.append("hardfork", 19);
+            CHECK_THROWS(parse_swarm_update_bt(d.view()));
+        }
+        // Wrong type for a field
+        {
+            oxenc::bt_dict_producer d;
+            d.append("block_hash", std::string(32, '\xbb'));
+            d.append("hardfork", "nineteen");
+            d.append("height", 1234567);
+            CHECK_THROWS(parse_swarm_update_bt(d.view()));
+        }
+        // A node missing a required field
+        {
+            oxenc::bt_dict_producer d;
+            d.append("block_hash", std::string(32, '\xbb'));
+            d.append("hardfork", 19);
+            d.append("height", 1234567);
+            auto states = d.append_list("service_node_states");
+            auto s = states.append_dict();
+            s.append("funded", 1);
+            s.append("public_ip", "10.0.0.1");
+            s.append("storage_port", 22001);
+            s.append("swarm_id", 100);
+            CHECK_THROWS(parse_swarm_update_bt(d.view()));
+        }
+        // A pubkey of the wrong length
+        {
+            oxenc::bt_dict_producer d;
+            d.append("block_hash", std::string(32, '\xbb'));
+            d.append("hardfork", 19);
+            d.append("height", 1234567);
+            auto states = d.append_list("service_node_states");
+            auto s = states.append_dict();
+            s.append("funded", 1);
+            s.append("pubkey_ed25519", std::string(31, '\x41'));
+            s.append("pubkey_x25519", std::string(32, '\x61'));
+            s.append("public_ip", "10.0.0.1");
+            s.append("service_node_pubkey", std::string(32, '\x21'));
+            s.append("storage_lmq_port", 23001);
+            s.append("storage_port", 22001);
+            s.append("swarm_id", 100);
+            CHECK_THROWS(parse_swarm_update_bt(d.view()));
+        }
+    }
 }
@@ -0,0 +1,107 @@
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+#include <oxenss/crypto/shared_key_cache.h>
+
+#include <catch2/catch.hpp>
+
+#include <string_view>
+
+using namespace oxenss::crypto;
+using namespace std::literals;
+
+namespace {
+
+const auto alice_pubkey =
+        x25519_pubkey::from_hex("01c7391664840b2ef7126b3709dbac178ba5f3ef2335a62343d5df7da4a11c30");
+const auto alice_seckey =
+        x25519_seckey::from_hex("7d446468c186d6fb3c83365ab77a37b1f9fa3e59eb9788a40ae2e9560f196f30");
+const auto bob_pubkey =
+        x25519_pubkey::from_hex("f7b99da2e25e3c399902641c707ae20ad72b63ed0cc487730ff0b3bcecf18609");
+const auto bob_seckey =
+        x25519_seckey::from_hex("f512f68e81a932aa2ff6d8723baa260a43a6f789d61c91b71f73e4f284e3600a");
+
+x25519_pubkey make_pubkey(unsigned char i) {
+    x25519_pubkey pk{};
+    pk.data()[0] = i;
+    return pk;
+}
+
+SharedKeyCache::shared_key make_key(unsigned char i) {
+    SharedKeyCache::shared_key k{};
+    k[31] = i;
+    return k;
+}
+
+}  // namespace
+
+TEST_CASE("shared key cache - lookups", "[shared_key_cache]") {
+    SharedKeyCache cache{10};
+    CHECK_FALSE(cache.find(make_pubkey(1), EncryptType::aes_gcm));
+    cache.insert(make_pubkey(1), EncryptType::aes_gcm, make_key(1));
+
+    auto found = cache.find(make_pubkey(1), EncryptType::aes_gcm);
+    REQUIRE(found);
+    CHECK(*found == make_key(1));
+    // Keys for other encryption types are separate
+    CHECK_FALSE(cache.find(make_pubkey(1), EncryptType::xchacha20));
+
+    CHECK(cache.hits() == 1);
+    CHECK(cache.misses() == 2);
+    CHECK(cache.size() == 1);
+
+    // Inserting an already cached key leaves the cached one alone
+    cache.insert(make_pubkey(1), EncryptType::aes_gcm, make_key(2));
+    CHECK(*cache.find(make_pubkey(1), EncryptType::aes_gcm) == make_key(1));
+    CHECK(cache.size() == 1);
+}
+
+TEST_CASE("shared key cache - evicts least recently used", "[shared_key_cache]") {
+    SharedKeyCache cache{3};
+    for (unsigned char i = 1; i <= 3; i++)
+        cache.insert(make_pubkey(i), EncryptType::aes_gcm, make_key(i));
+
+    // Using 1 makes 2 the least recently used, so it is the one to go
+    CHECK(cache.find(make_pubkey(1), EncryptType::aes_gcm));
+    cache.insert(make_pubkey(4), EncryptType::aes_gcm, make_key(4));
+    CHECK(cache.size() == 3);
+    CHECK_FALSE(cache.find(make_pubkey(2), EncryptType::aes_gcm));
+    for (unsigned char i : {1, 3, 4}) {
+        auto found = cache.find(make_pubkey(i), EncryptType::aes_gcm);
+        REQUIRE(found);
+        CHECK(*found == make_key(i));
+    }
+
+    SharedKeyCache disabled{0};
+    disabled.insert(make_pubkey(1), EncryptType::aes_gcm, make_key(1));
+    CHECK(disabled.size() == 0);
+    CHECK_FALSE(disabled.find(make_pubkey(1), EncryptType::aes_gcm));
+}
+
+TEST_CASE("shared key cache - channel encryption", "[shared_key_cache][encrypt]") {
+    constexpr auto plaintext = "Grumpy cat says no!"sv;
+
+    ChannelEncryption alice_box{alice_seckey, alice_pubkey, false};
+    ChannelEncryption bob_box{bob_seckey, bob_pubkey, true, 100};
+    CHECK_FALSE(alice_box.key_cache());
+    REQUIRE(bob_box.key_cache());
+    auto& cache = *bob_box.key_cache();
+
+    for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+        auto misses = cache.misses();
+        auto hits = cache.hits();
+
+        // Decrypting a request and encrypting the reply to it derive the key once
+        auto request = alice_box.encrypt(type, plaintext, bob_pubkey);
+        CHECK(bob_box.decrypt(type, request, alice_pubkey) == plaintext);
+        auto reply = bob_box.encrypt(type, plaintext, alice_pubkey);
+        CHECK(alice_box.decrypt(type, reply, bob_pubkey) == plaintext);
+        CHECK(cache.misses() == misses + 1);
+        CHECK(cache.hits() == hits + 1);
+
+        // And the cached key agrees with the uncached one
+        ChannelEncryption uncached{bob_seckey, bob_pubkey};
+        CHECK(uncached.decrypt(type, alice_box.encrypt(type, plaintext, bob_pubkey), alice_pubkey)
+              == plaintext);
+    }
+    CHECK(cache.size() == 3);
+}
@@ -0,0 +1,84 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/crypto/signature_cache.h>
+
+#include <sodium/crypto_sign.h>
+
+#include <array>
+#include <string>
+
+using namespace std::literals;
+using oxenss::crypto::SignatureCache;
+
+namespace {
+
+struct keypair {
+    std::array<unsigned char, 32> pk;
+    std::array<unsigned char, 64> sk;
+    keypair() { crypto_sign_keypair(pk.data(), sk.data()); }
+
+    std::array<unsigned char, 64> sign(std::string_view msg) const {
+        std::array<unsigned char, 64> sig;
+        crypto_sign_detached(
+                sig.data(),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                sk.data());
+        return sig;
+    }
+};
+
+}  // namespace
+
+TEST_CASE("signature cache - verification", "[signatures]") {
+    SignatureCache cache;
+    keypair alice, bob;
+
+    auto msg = "retrieve1700000000000"sv;
+    auto sig = alice.sign(msg);
+
+    CHECK(cache.verify(sig.data(), msg, alice.pk.data()));
+    CHECK(cache.misses() == 1);
+    CHECK(cache.hits() == 0);
+    CHECK(cache.verify(sig.data(), msg, alice.pk.data()));
+    CHECK(cache.hits() == 1);
+
+    // Anything different has to be verified again (and fails)
+    CHECK_FALSE(cache.verify(sig.data(), "retrieve1700000000001"sv, alice.pk.data()));
+    CHECK_FALSE(cache.verify(sig.data(), msg, bob.pk.data()));
+    auto bad_sig = sig;
+    bad_sig[10] ^= 0x01;
+    CHECK_FALSE(cache.verify(bad_sig.data(), msg, alice.pk.data()));
+    CHECK(cache.misses() == 4);
+
+    // Failures aren't cached
+    CHECK_FALSE(cache.verify(bad_sig.data(), msg, alice.pk.data()));
+    CHECK(cache.misses() == 5);
+    CHECK(cache.hits() == 1);
+}
+
+TEST_CASE("signature cache - eviction", "[signatures]") {
+    SignatureCache cache{3};
+    keypair alice;
+
+    std::array<std::string, 4> msgs{"a"s, "b"s, "c"s, "d"s};
+    std::array<std::array<unsigned char, 64>, 4> sigs;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        sigs[i] = alice.sign(msgs[i]);
+        CHECK(cache.verify(sigs[i].data(), msgs[i], alice.pk.data()));
+    }
+    CHECK(cache.misses() == 4);
+
+    // The oldest got pushed out by the fourth; the rest are still cached
+    for (size_t i : {1, 2, 3})
+        CHECK(cache.verify(sigs[i].data(), msgs[i], alice.pk.data()));
+    CHECK(cache.hits() == 3);
+    CHECK(cache.verify(sigs[0].data(), msgs[0], alice.pk.data()));
+    CHECK(cache.misses() == 5);
+
+    SignatureCache disabled{0};
+    CHECK(disabled.verify(sigs[0].data(), msgs[0], alice.pk.data()));
+    CHECK(disabled.verify(sigs[0].data(), msgs[0], alice.pk.data()));
+    CHECK(disabled.hits() == 0);
+}
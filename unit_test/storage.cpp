@@ -1,10 +1,21 @@
 #include <oxenss/storage/database.hpp>
+#include <oxenss/storage/hash_filter.hpp>
+#include <oxenss/storage/memory_store.hpp>
 
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/time.hpp>
 
+#include <oxenc/base64.h>
+
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
 #include <string>
 #include <thread>
 #include <future>
@@ -56,7 +67,6 @@ TEST_CASE("storage - data persistence", "[storage]") {
         auto [items, more] = storage.retrieve(pubkey, namespace_id::Default, "");
 
         REQUIRE(items.size() == 1);
-        CHECK_FALSE(items[0].pubkey);  // pubkey is left unset when we retrieve for pubkey
         CHECK(items[0].hash == hash);
         CHECK(items[0].msg_namespace == namespace_id::Default);
         CHECK(items[0].expiry - items[0].timestamp == ttl);
@@ -93,7 +103,6 @@ TEST_CASE("storage - data persistence, namespace", "[storage][namespace]") {
         auto [items, more] = storage.retrieve(pubkey, ns, "");
 
         REQUIRE(items.size() == 1);
-        CHECK_FALSE(items[0].pubkey);  // pubkey is left unset when we retrieve for pubkey
         CHECK(items[0].hash == hash);
         CHECK(items[0].msg_namespace == namespace_id{42});
         CHECK(items[0].expiry - items[0].timestamp == ttl);
@@ -248,6 +257,46 @@ TEST_CASE("storage - remove expired entries", "[storage]") {
     CHECK(storage.get_message_count() == 2);
 }
 
+TEST_CASE("storage - chunked expiry cleanup", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+
+    // Enough expired messages to need several cleanup chunks, plus a few that haven't expired
+    const int num_expired = Database::CLEANUP_CHUNK_SIZE * 5 / 2;
+    const int num_live = 10;
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> items;
+    for (int i = 0; i < num_expired + num_live; ++i)
+        items.emplace_back(
+                pubkey,
+                "hash" + std::to_string(i),
+                namespace_id::Default,
+                now,
+                i < num_expired ? now : now + 1h,
+                "data");
+    storage.bulk_store(items);
+    REQUIRE(storage.get_message_count() == num_expired + num_live);
+
+    std::this_thread::sleep_for(5ms);
+    int64_t deleted = 0;
+    // Each call can stop early on its time budget, but must always make progress
+    for (int i = 0; i < 100; i++) {
+        auto d = storage.clean_expired();
+        deleted += d;
+        if (storage.expired_backlog() == 0)
+            break;
+        REQUIRE(d > 0);
+    }
+    CHECK(deleted == num_expired);
+    CHECK(storage.expired_backlog() == 0);
+    CHECK(storage.get_message_count() == num_live);
+    CHECK(storage.clean_expired() == 0);
+}
+
 TEST_CASE("storage - bulk data storage", "[storage]") {
     StorageDeleter fixture;
 
@@ -335,6 +384,100 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
     }
 }
 
+TEST_CASE("storage - bulk store results", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    const auto now = std::chrono::system_clock::now();
+
+    Database storage{"."};
+
+    CHECK(storage.store({pubkey1, "h7", namespace_id::Default, now, now + 1h, "x"}) ==
+          StoreResult::New);
+
+    // Enough messages to need full-size multi-row inserts plus the smaller leftover statements
+    const size_t num_items = 2 * Database::BULK_INSERT_ROWS + 123;
+    std::vector<message> items;
+    for (size_t i = 0; i < num_items; i++)
+        items.emplace_back(
+                i % 3 == 0 ? pubkey2 : pubkey1,
+                "h" + std::to_string(i),
+                namespace_id::Default,
+                now,
+                now + 1h,
+                "data" + std::to_string(i));
+    items.emplace_back(pubkey1, "h3", namespace_id::Default, now, now + 1h, "dupe");
+    items.emplace_back(user_pubkey{}, "nopubkey", namespace_id::Default, now, now + 1h, "x");
+
+    auto results = storage.bulk_store(items);
+    REQUIRE(results.size() == items.size());
+    for (size_t i = 0; i < num_items; i++) {
+        REQUIRE(results[i]);
+        CHECK(*results[i] == (i == 7 ? StoreResult::Exists : StoreResult::New));
+    }
+    CHECK(results[num_items] == StoreResult::Exists);
+    CHECK_FALSE(results[num_items + 1]);
+
+    CHECK(storage.get_owner_count() == 2);
+    CHECK(storage.get_message_count() == num_items);
+
+    // Messages should have been inserted in order, with the right owners and data:
+    auto [msgs, more] = storage.retrieve(pubkey2, namespace_id::Default, "");
+    REQUIRE(msgs.size() == (num_items + 2) / 3);
+    for (size_t i = 0; i < msgs.size(); i++) {
+        CHECK(msgs[i].hash == "h" + std::to_string(3 * i));
+        CHECK(msgs[i].data == "data" + std::to_string(3 * i));
+    }
+
+    // Storing everything again should store nothing
+    results = storage.bulk_store(items);
+    for (size_t i = 0; i < num_items; i++)
+        CHECK(results[i] == StoreResult::Exists);
+    CHECK(storage.get_message_count() == num_items);
+}
+
+TEST_CASE("storage - batched store results", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    const auto bytes = "bytesasstring";
+    const auto now = std::chrono::system_clock::now();
+
+    Database storage{"."};
+
+    CHECK(storage.store({pubkey1, "a", namespace_id::Default, now, now + 100s, bytes}) ==
+          StoreResult::New);
+    CHECK(storage.store({pubkey1, "b", namespace_id::Default, now, now + 100s, bytes}) ==
+          StoreResult::New);
+
+    std::vector<message> batch;
+    batch.emplace_back(pubkey1, "a", namespace_id::Default, now, now + 200s, bytes);
+    batch.emplace_back(pubkey1, "b", namespace_id::Default, now, now + 50s, bytes);
+    batch.emplace_back(pubkey1, "c", namespace_id::Default, now, now + 100s, bytes);
+    batch.emplace_back(pubkey2, "d", namespace_id::Default, now, now + 100s, bytes);
+    batch.emplace_back(pubkey2, "d", namespace_id::Default, now, now + 100s, bytes);
+
+    auto results = storage.store_batch(batch);
+    REQUIRE(results.size() == 5);
+    CHECK(results[0].first == StoreResult::Extended);
+    CHECK(results[0].second == from_epoch_ms(to_epoch_ms(now + 200s)));
+    CHECK(results[1].first == StoreResult::Exists);
+    CHECK(results[1].second == from_epoch_ms(to_epoch_ms(now + 100s)));
+    CHECK(results[2].first == StoreResult::New);
+    CHECK(results[2].second == now + 100s);
+    CHECK(results[3].first == StoreResult::New);
+    CHECK(results[4].first == StoreResult::Exists);
+
+    CHECK(storage.get_owner_count() == 2);
+    CHECK(storage.get_message_count() == 4);
+
+    CHECK(storage.store_batch({}).empty());
+}
+
 TEST_CASE("storage - retrieve limit", "[storage]") {
     StorageDeleter fixture;
 
@@ -370,6 +513,64 @@ TEST_CASE("storage - retrieve limit", "[storage]") {
     CHECK(storage.retrieve(pubkey2, namespace_id::Default, "", 10).first.size() == 5);
 }
 
+TEST_CASE("storage - multi-namespace retrieve", "[storage][namespace]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    user_pubkey pubkey2;
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    for (int ns : {0, 2, 3}) {
+        for (int i = 0; i < 5; i++) {
+            auto hash = "hash" + std::to_string(ns) + "-" + std::to_string(i);
+            storage.store(
+                    {pubkey, hash, static_cast<namespace_id>(ns), now, now + 100s, "bytesasstring"});
+        }
+    }
+    storage.store({pubkey2, "otherhash", namespace_id{4}, now, now + 100s, "bytesasstring"});
+
+    std::vector<Database::retrieve_params> params{
+            {namespace_id{0}, "", std::nullopt, std::nullopt},
+            {namespace_id{2}, "hash2-1", std::nullopt, std::nullopt},
+            {namespace_id{3}, "", 2, std::nullopt},
+            {namespace_id{4}, "", std::nullopt, std::nullopt},
+            {namespace_id{3}, "nosuchhash", std::nullopt, std::nullopt}};
+    auto results = storage.retrieve_multi(pubkey, params);
+    REQUIRE(results.size() == params.size());
+
+    // Every result should be exactly what a separate retrieve would have given:
+    for (size_t i = 0; i < params.size(); i++) {
+        auto& p = params[i];
+        auto [msgs, more] = storage.retrieve(pubkey, p.ns, p.last_hash, p.num_results, p.max_size);
+        REQUIRE(results[i].first.size() == msgs.size());
+        for (size_t j = 0; j < msgs.size(); j++)
+            CHECK(results[i].first[j].hash == msgs[j].hash);
+        CHECK(results[i].second == more);
+    }
+
+    CHECK(results[0].first.size() == 5);
+    CHECK(results[1].first.size() == 3);
+    CHECK(results[1].first[0].hash == "hash2-2");
+    CHECK(results[2].first.size() == 2);
+    CHECK(results[2].second);
+    CHECK(results[3].first.empty());
+    CHECK(results[4].first.size() == 5);
+
+    // Unknown owners get the right number of empty results
+    user_pubkey pubkey3;
+    REQUIRE(pubkey3.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcded"));
+    results = storage.retrieve_multi(pubkey3, params);
+    REQUIRE(results.size() == params.size());
+    for (auto& [msgs, more] : results) {
+        CHECK(msgs.empty());
+        CHECK_FALSE(more);
+    }
+}
+
 namespace oxenss {
 class TestSuiteHacks {
   public:
@@ -378,15 +579,74 @@ class TestSuiteHacks {
     }
     static int db_pool_size(Database& db) {
         std::lock_guard lock{db.impl_lock_};
-        return db.impl_pool_.size();
+        return db.writers_.idle.size();
+    }
+    static int db_open_count(Database& db) {
+        std::lock_guard lock{db.impl_lock_};
+        return db.writers_.open;
+    }
+    static void db_text_hashes(Database& db) { db.test_suite_text_hashes(); }
+    static void db_skew_owner_counts(Database& db, int64_t extra) {
+        db.test_suite_skew_owner_counts(extra);
+    }
+    static int64_t db_evict(Database& db, int64_t count) { return db.test_suite_evict(count); }
+    static int64_t db_limit_pages(Database& db, int64_t extra) {
+        return db.test_suite_limit_pages(extra);
+    }
+    static std::vector<std::string> db_retrieve_plans(Database& db) {
+        return db.test_suite_retrieve_plans();
     }
 };
 }  // namespace oxenss
 
-TEST_CASE("storage - connection pool", "[storage][pool]") {
+TEST_CASE("storage - batched store partially overflowing", "[storage]") {
     StorageDeleter fixture;
 
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+
     Database storage{"."};
+    // Room for a handful of the messages below, but nowhere near all of them
+    oxenss::TestSuiteHacks::db_limit_pages(storage, 8);
+
+    std::vector<message> batch;
+    for (int i = 0; i < 40; i++)
+        batch.emplace_back(
+                pubkey,
+                "h" + std::to_string(i),
+                namespace_id::Default,
+                now,
+                now + 1h,
+                std::string(2000, 'x'));
+    auto results = storage.store_batch(batch);
+    REQUIRE(results.size() == batch.size());
+
+    // Only the messages that didn't fit are refused; the others are stored
+    auto [items, more] = storage.retrieve(pubkey, namespace_id::Default, "");
+    int stored = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        bool found = std::any_of(items.begin(), items.end(), [&](auto& m) {
+            return m.hash == batch[i].hash;
+        });
+        if (results[i].first == StoreResult::New) {
+            CHECK(found);
+            stored++;
+        } else {
+            CHECK(results[i].first == StoreResult::Full);
+            CHECK_FALSE(found);
+        }
+    }
+    CHECK(stored > 0);
+    CHECK(stored < 40);
+    CHECK(storage.get_message_count() == stored);
+}
+
+TEST_CASE("storage - connection pool", "[storage][pool]") {
+    StorageDeleter fixture;
+
+    constexpr int max_writers = 3;
+    Database storage{".", max_writers};
 
     auto n_blocked_threads = GENERATE(1, 2, 5, 10);
 
@@ -407,17 +667,1160 @@ TEST_CASE("storage - connection pool", "[storage][pool]") {
 
     std::this_thread::sleep_for(20ms);
     CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 0);
+    // Connections beyond the limit don't get created; the extra threads are waiting instead:
+    CHECK(oxenss::TestSuiteHacks::db_open_count(storage) ==
+          std::min(n_blocked_threads, max_writers));
+
+    // Reads use a separate pool, so aren't held up by the busy writers:
+    auto started = std::chrono::steady_clock::now();
+    CHECK(storage.retrieve(pubkey1, namespace_id::Default, "").first.empty());
+    CHECK(std::chrono::steady_clock::now() - started < blocking_time / 2);
+
     auto now = std::chrono::system_clock::now();
+    started = std::chrono::steady_clock::now();
     CHECK(storage.store(
                   {pubkey1, "hash0", namespace_id::Default, now, now + 1s, "bytesasstring0"}) ==
           StoreResult::New);
-    // The blocking threads are still there, so our store should have created a new one then
-    // returned it the pool:
-    CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 1);
+    if (n_blocked_threads < max_writers) {
+        // We were below the limit, so our store should have created a new connection then
+        // returned it the pool:
+        CHECK(std::chrono::steady_clock::now() - started < blocking_time / 2);
+        CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 1);
+    } else {
+        // At the limit, so the store had to wait for one of the blocked connections
+        CHECK(std::chrono::steady_clock::now() - started >= blocking_time / 2);
+    }
     for (auto& b : busy)
         b.join();
 
-    // Now we've waited for the blocking threads to finish, so the blocked conns should have been
+    // Now we've waited for the blocking threads to finish, so all the connections should have been
     // returned to the pool:
-    CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) == 1 + n_blocked_threads);
+    CHECK(oxenss::TestSuiteHacks::db_pool_size(storage) ==
+          std::min(n_blocked_threads + 1, max_writers));
+    CHECK(oxenss::TestSuiteHacks::db_open_count(storage) ==
+          std::min(n_blocked_threads + 1, max_writers));
+}
+
+TEST_CASE("storage - random message selection", "[storage][random]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    CHECK_FALSE(storage.retrieve_random());
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    std::vector<message> items;
+    for (int i = 0; i < 100; i++)
+        items.emplace_back(
+                pubkey, "hash" + std::to_string(i), namespace_id::Default, now, now + 100s, "x");
+    storage.bulk_store(items);
+
+    // Delete most of them so that there are large gaps in the id range
+    std::vector<std::string> del;
+    for (int i = 0; i < 100; i++)
+        if (i % 25 != 0)
+            del.push_back("hash" + std::to_string(i));
+    CHECK(storage.delete_by_hash(pubkey, del).size() == 96);
+
+    std::set<std::string> seen;
+    for (int i = 0; i < 200; i++) {
+        auto msg = storage.retrieve_random();
+        REQUIRE(msg);
+        seen.insert(msg->hash);
+    }
+    CHECK(seen == std::set<std::string>{"hash0", "hash25", "hash50", "hash75"});
+
+    // Expired (but not yet cleaned up) messages must not be selected
+    CHECK(storage.store({pubkey, "expired", namespace_id::Default, now - 10s, now - 1s, "x"}) ==
+          StoreResult::New);
+    for (int i = 0; i < 50; i++)
+        CHECK(storage.retrieve_random()->hash != "expired");
+}
+
+TEST_CASE("storage - random message selection benchmark", "[.][storage][random][bench]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    constexpr int iterations = 1000;
+    auto time_random = [&] {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            REQUIRE(storage.retrieve_random());
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start) /
+               iterations;
+    };
+
+    int stored = 0;
+    std::chrono::microseconds small_time;
+    for (int target : {10'000, 1'000'000}) {
+        std::vector<message> items;
+        for (; stored < target; stored++)
+            items.emplace_back(
+                    pubkey,
+                    "hash" + std::to_string(stored),
+                    namespace_id::Default,
+                    now,
+                    now + 1h,
+                    "bytesasstring");
+        storage.bulk_store(items);
+
+        auto t = time_random();
+        WARN("retrieve_random with " << target << " rows: " << t.count() << "us/call");
+        if (target == 10'000)
+            small_time = t;
+        else
+            // Selection cost should not grow with the table size (allow plenty of slack for noise)
+            CHECK(t < 10 * small_time + 100us);
+    }
+}
+
+TEST_CASE("storage - streaming message visitor", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    auto now = std::chrono::system_clock::now();
+
+    for (int i = 0; i < 10; i++) {
+        auto h = std::to_string(i);
+        storage.store({pubkey1, "a" + h, namespace_id::Default, now, now + 100s, "x"});
+        storage.store({pubkey2, "b" + h, namespace_id{42}, now, now + 100s, "y"});
+    }
+    storage.store({pubkey2, "expired", namespace_id::Default, now - 10s, now - 1s, "z"});
+
+    std::vector<message> all;
+    storage.for_each_message(nullptr, [&](message&& m) {
+        all.push_back(std::move(m));
+        return true;
+    });
+    CHECK(all.size() == 20);
+
+    std::vector<message> only2;
+    int owners_seen = 0;
+    storage.for_each_message(
+            [&](const user_pubkey& pk) {
+                owners_seen++;
+                return pk == pubkey2;
+            },
+            [&](message&& m) {
+                only2.push_back(std::move(m));
+                return true;
+            });
+    CHECK(owners_seen == 2);
+    REQUIRE(only2.size() == 10);
+    for (auto& m : only2) {
+        CHECK(m.pubkey == pubkey2);
+        CHECK(m.msg_namespace == namespace_id{42});
+        CHECK(m.data == "y");
+    }
+
+    int visited = 0;
+    storage.for_each_message(nullptr, [&](message&&) { return ++visited < 5; });
+    CHECK(visited == 5);
+}
+
+TEST_CASE("storage - swarm space range scans", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    // The swarm space of these is just the last 8 bytes:
+    user_pubkey pk100, pk200, pkmax;
+    REQUIRE(pk100.load("050000000000000000000000000000000000000000000000000000000000000064"));
+    REQUIRE(pk200.load("0500000000000000000000000000000000000000000000000000000000000000c8"));
+    REQUIRE(pkmax.load("05000000000000000000000000000000000000000000000000ffffffffffffffff"));
+    REQUIRE(pk100.swarm_space() == 100);
+    REQUIRE(pkmax.swarm_space() == std::numeric_limits<uint64_t>::max());
+
+    auto now = std::chrono::system_clock::now();
+    for (auto* pk : {&pk100, &pk200, &pkmax})
+        for (int i = 0; i < 3; i++)
+            storage.store(
+                    {*pk,
+                     pk->hex() + std::to_string(i),
+                     namespace_id::Default,
+                     now,
+                     now + 100s,
+                     "x"});
+
+    auto visit = [&](uint64_t begin, uint64_t end) {
+        std::map<std::string, int> counts;
+        storage.for_each_message_in_range(begin, end, [&](message&& m) {
+            counts[m.pubkey.hex()]++;
+            return true;
+        });
+        return counts;
+    };
+
+    CHECK(visit(0, 99).empty());
+    CHECK(visit(100, 100) == std::map<std::string, int>{{pk100.hex(), 3}});
+    CHECK(visit(101, 200) == std::map<std::string, int>{{pk200.hex(), 3}});
+    CHECK(visit(0, std::numeric_limits<uint64_t>::max()).size() == 3);
+    // Wrapping range:
+    CHECK(visit(150, 100) == std::map<std::string, int>{
+                                     {pk100.hex(), 3}, {pk200.hex(), 3}, {pkmax.hex(), 3}});
+    CHECK(visit(201, 150) == std::map<std::string, int>{{pk100.hex(), 3}, {pkmax.hex(), 3}});
+}
+
+TEST_CASE("storage - owner id cache invalidation", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    auto now = std::chrono::system_clock::now();
+
+    CHECK(storage.store({pubkey1, "hash1", namespace_id::Default, now, now + 100s, "x"}) ==
+          StoreResult::New);
+    // Retrieve so that pubkey1's owner id gets cached:
+    CHECK(storage.retrieve(pubkey1, namespace_id::Default, "").first.size() == 1);
+
+    // Deleting the last message removes the owner row (via the owner_autoclean trigger), so the
+    // next owner inserted on the now-empty table will reuse the same owner id:
+    CHECK(storage.delete_all(pubkey1).size() == 1);
+    CHECK(storage.get_owner_count() == 0);
+    CHECK(storage.store({pubkey2, "hash2", namespace_id::Default, now, now + 100s, "y"}) ==
+          StoreResult::New);
+
+    // pubkey1 must not see pubkey2's message through a stale cached owner id:
+    CHECK(storage.retrieve(pubkey1, namespace_id::Default, "").first.empty());
+    CHECK(storage.get_expiries(pubkey1, {"hash2"}).empty());
+    auto [msgs, more] = storage.retrieve(pubkey2, namespace_id::Default, "");
+    REQUIRE(msgs.size() == 1);
+    CHECK(msgs[0].hash == "hash2");
+}
+
+TEST_CASE("storage - incremental message counts", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    auto now = std::chrono::system_clock::now();
+    using ns_counts = std::vector<std::pair<namespace_id, int64_t>>;
+
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 0);
+        CHECK(storage.get_owner_count() == 0);
+        CHECK(storage.get_namespace_counts().empty());
+
+        for (int i = 0; i < 5; i++)
+            storage.store(
+                    {pubkey1, "a" + std::to_string(i), namespace_id::Default, now, now + 1h, "x"});
+        storage.store({pubkey1, "b0", namespace_id::UserProfile, now, now + 1h, "x"});
+        storage.store({pubkey2, "c0", namespace_id::Default, now, now + 1h, "x"});
+        storage.store({pubkey2, "c1", namespace_id::Default, now, now, "x"});
+        // Re-storing an existing message must not change the counts:
+        CHECK(storage.store({pubkey1, "a0", namespace_id::Default, now, now + 2h, "x"}) ==
+              StoreResult::Extended);
+
+        CHECK(storage.get_message_count() == 8);
+        CHECK(storage.get_owner_count() == 2);
+        CHECK(storage.get_namespace_counts() ==
+              ns_counts{{namespace_id::Default, 7}, {namespace_id::UserProfile, 1}});
+        auto counts = storage.get_message_counts();
+        std::sort(counts.begin(), counts.end());
+        CHECK(counts == std::vector<int>{2, 6});
+
+        CHECK(storage.delete_by_hash(pubkey1, {"a1", "a2", "b0"}).size() == 3);
+        std::this_thread::sleep_for(5ms);
+        storage.clean_expired();
+        CHECK(storage.get_message_count() == 4);
+        CHECK(storage.get_namespace_counts() == ns_counts{{namespace_id::Default, 4}});
+        counts = storage.get_message_counts();
+        std::sort(counts.begin(), counts.end());
+        CHECK(counts == std::vector<int>{1, 3});
+
+        // Removing all of an owner's messages also removes the owner:
+        CHECK(storage.delete_all(pubkey2).size() == 1);
+        CHECK(storage.get_owner_count() == 1);
+        CHECK(storage.get_message_counts() == std::vector<int>{3});
+    }
+
+    // Counts are reconciled (and should be unchanged) when reopening the database:
+    Database storage{"."};
+    CHECK(storage.get_message_count() == 3);
+    CHECK(storage.get_owner_count() == 1);
+    CHECK(storage.get_namespace_counts() == ns_counts{{namespace_id::Default, 3}});
+    CHECK(storage.get_message_counts() == std::vector<int>{3});
+}
+
+TEST_CASE("storage - quotas", "[storage][quota]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    auto now = std::chrono::system_clock::now();
+    const auto ns = namespace_id::Default;
+
+    {
+        Database storage{"."};
+        storage.set_quotas({/*owner_messages=*/3, /*owner_bytes=*/0, 0, /*namespace_bytes=*/10});
+
+        CHECK(storage.store({pubkey1, "a0", ns, now, now + 1h, "xx"}) == StoreResult::New);
+        CHECK(storage.store({pubkey1, "a1", ns, now, now + 1h, "xx"}) == StoreResult::New);
+        CHECK(storage.store({pubkey1, "a2", ns, now, now + 1h, "xx"}) == StoreResult::New);
+        CHECK_FALSE(storage.within_quota(pubkey1, ns, 1));
+        CHECK(storage.store({pubkey1, "a3", ns, now, now + 1h, "xx"}) == StoreResult::OverQuota);
+        // Messages we already have can still be re-stored (and extended)
+        CHECK(storage.store({pubkey1, "a0", ns, now, now + 2h, "xx"}) == StoreResult::Extended);
+        // Other namespaces share the owner quota
+        CHECK(storage.store({pubkey1, "b0", namespace_id::UserProfile, now, now + 1h, "x"}) ==
+              StoreResult::OverQuota);
+        // ... but not the namespace quota: the default namespace has 4 bytes of room left
+        CHECK(storage.within_quota(pubkey2, ns, 4));
+        CHECK_FALSE(storage.within_quota(pubkey2, ns, 5));
+        CHECK(storage.store({pubkey2, "c0", ns, now, now + 1h, "xxxxx"}) ==
+              StoreResult::OverQuota);
+        CHECK(storage.store({pubkey2, "c0", namespace_id::UserProfile, now, now + 1h, "xxxxx"}) ==
+              StoreResult::New);
+        CHECK(storage.quota_rejections() == 3);
+        // (A rejected store for a new owner doesn't leave an empty owner behind)
+        CHECK(storage.get_owner_count() == 2);
+
+        // Deletes and expiries free up quota
+        CHECK(storage.delete_by_hash(pubkey1, {"a1"}).size() == 1);
+        CHECK(storage.within_quota(pubkey1, ns, 2));
+        CHECK(storage.store({pubkey1, "a3", ns, now, now, "xx"}) == StoreResult::New);
+        CHECK_FALSE(storage.within_quota(pubkey1, ns, 1));
+        std::this_thread::sleep_for(5ms);
+        storage.clean_expired();
+        CHECK(storage.within_quota(pubkey1, ns, 1));
+    }
+
+    // The totals should be unchanged when reopening the database
+    Database storage{"."};
+    storage.set_quotas({0, /*owner_bytes=*/5, 0, 0});
+    CHECK(storage.within_quota(pubkey1, ns, 1));
+    CHECK_FALSE(storage.within_quota(pubkey1, ns, 2));
+    CHECK(storage.within_quota(pubkey2, ns, 0));
+    CHECK_FALSE(storage.within_quota(pubkey2, ns, 1));
+}
+
+TEST_CASE("storage - owner counts get reconciled", "[storage][quota]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    const auto ns = namespace_id::Default;
+
+    Database storage{"."};
+    storage.set_quotas({/*owner_messages=*/3, 0, 0, 0});
+    CHECK(storage.store({pubkey, "a0", ns, now, now + 1h, "xx"}) == StoreResult::New);
+    CHECK(storage.within_quota(pubkey, ns, 1));
+
+    TestSuiteHacks::db_skew_owner_counts(storage, 5);
+    CHECK_FALSE(storage.within_quota(pubkey, ns, 1));
+    CHECK(storage.reconcile_owner_counts() == 1);
+    CHECK(storage.within_quota(pubkey, ns, 1));
+    // Nothing left to fix on the next pass (which wraps around to the same owners)
+    CHECK(storage.reconcile_owner_counts() == 0);
+}
+
+TEST_CASE("storage - binary message hashes", "[storage][hash]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    // Real hashes are unpadded base64 of 32 bytes, and get stored in binary; anything else (such
+    // as other tests' made up hashes) is stored as-is.
+    std::vector<std::string> hashes;
+    for (int i = 0; i < 20; i++) {
+        std::string raw(32, static_cast<char>(i));
+        raw[0] = '\xff';
+        auto h = oxenc::to_base64(raw);
+        h.resize(43);
+        hashes.push_back(std::move(h));
+    }
+    hashes.push_back("not-a-real-hash");
+    // Valid base64 of the right length, but with non-zero padding bits so it doesn't round-trip:
+    hashes.push_back(std::string(42, 'A') + 'B');
+
+    Database storage{"."};
+    for (auto& h : hashes)
+        REQUIRE(storage.store({pubkey, h, namespace_id::Default, now, now + 1h, "data " + h}) ==
+                StoreResult::New);
+
+    auto check_lookups = [&] {
+        auto [msgs, more] = storage.retrieve(pubkey, namespace_id::Default, "");
+        REQUIRE(msgs.size() == hashes.size());
+        for (size_t i = 0; i < hashes.size(); i++) {
+            CHECK(msgs[i].hash == hashes[i]);
+            CHECK(msgs[i].data == "data " + hashes[i]);
+        }
+        CHECK(storage.retrieve(pubkey, namespace_id::Default, hashes[15]).first.size() ==
+              hashes.size() - 16);
+        auto by_hash = storage.retrieve_by_hash(hashes[3]);
+        REQUIRE(by_hash);
+        CHECK(by_hash->hash == hashes[3]);
+        CHECK(storage.get_expiries(pubkey, {hashes[4]}).count(hashes[4]));
+        CHECK(storage.get_expiries(pubkey, hashes).size() == hashes.size());
+        CHECK(storage.store({pubkey, hashes[5], namespace_id::Default, now, now + 1h, "x"}) ==
+              StoreResult::Exists);
+        storage.bulk_store({{pubkey, hashes[6], namespace_id::Default, now, now + 1h, "x"}});
+        CHECK(storage.get_message_count() == hashes.size());
+    };
+    check_lookups();
+    CHECK_FALSE(storage.hash_migration_pending());
+
+    // Simulate an upgraded database where everything is still stored as text:
+    oxenss::TestSuiteHacks::db_text_hashes(storage);
+    REQUIRE(storage.hash_migration_pending());
+    check_lookups();
+
+    while (!storage.migrate_hashes()) {}
+    CHECK_FALSE(storage.hash_migration_pending());
+    check_lookups();
+
+    auto deleted = storage.delete_by_hash(pubkey, {hashes[0], hashes[1], hashes.back()});
+    std::sort(deleted.begin(), deleted.end());
+    std::vector<std::string> expected{hashes[0], hashes[1], hashes.back()};
+    std::sort(expected.begin(), expected.end());
+    CHECK(deleted == expected);
+    CHECK(storage.get_message_count() == hashes.size() - 3);
+}
+
+TEST_CASE("storage - bloom filter", "[storage][hash]") {
+    BloomFilter filter{1000};
+    for (int i = 0; i < 1000; i++)
+        filter.add("hash" + std::to_string(i));
+    // No false negatives:
+    for (int i = 0; i < 1000; i++)
+        CHECK(filter.maybe_contains("hash" + std::to_string(i)));
+    // ~1% false positives at capacity; allow plenty of slack:
+    int false_positives = 0;
+    for (int i = 1000; i < 11000; i++)
+        false_positives += filter.maybe_contains("hash" + std::to_string(i));
+    CHECK(false_positives < 300);
+}
+
+TEST_CASE("storage - hash filter rebuild with stores in flight", "[storage][hash]") {
+    HashFilter filter;
+    REQUIRE(filter.begin_rebuild(100));
+    filter.finish_rebuild(0);
+    REQUIRE(filter.ready());
+
+    // A store that starts before a rebuild and commits after it finishes: the rebuild's scan
+    // doesn't see it, and the commit comes too late to add it to the rebuilt filter.
+    filter.add("early");
+    REQUIRE(filter.begin_rebuild(100));
+    // One that starts during the rebuild, and one that starts before it but commits during it
+    filter.add("during");
+    filter.add("committed");
+    filter.add_committed("committed");
+    filter.add_rebuilt("scanned");
+    filter.finish_rebuild(1);
+    filter.add_committed("early");
+    filter.add_committed("during");
+
+    for (auto h : {"early", "during", "committed", "scanned"})
+        CHECK(filter.maybe_contains(h));
+
+    // Once carried over, they aren't carried into later rebuilds unless the scan finds them
+    REQUIRE(filter.begin_rebuild(100));
+    filter.add_rebuilt("scanned");
+    filter.finish_rebuild(1);
+    CHECK(filter.maybe_contains("scanned"));
+    CHECK_FALSE(filter.maybe_contains("early"));
+    CHECK_FALSE(filter.maybe_contains("during"));
+}
+
+TEST_CASE("storage - message hash filter", "[storage][hash]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    Database storage{"."};
+    for (int i = 0; i < 10; i++)
+        storage.store(
+                {pubkey, "old" + std::to_string(i), namespace_id::Default, now, now + 1h, "x"});
+
+    // Not built yet, so everything still works via the database:
+    CHECK(storage.retrieve_by_hash("old3"));
+    CHECK_FALSE(storage.retrieve_by_hash("nope"));
+
+    storage.rebuild_hash_filter();
+    CHECK(storage.retrieve_by_hash("old3"));
+    CHECK_FALSE(storage.retrieve_by_hash("nope"));
+
+    // Messages stored (via any path) after the rebuild are found, and re-storing existing messages
+    // still gets detected:
+    storage.store({pubkey, "new0", namespace_id::Default, now, now + 1h, "x"});
+    storage.store_batch({{pubkey, "new1", namespace_id::Default, now, now + 1h, "x"}});
+    storage.bulk_store({{pubkey, "new2", namespace_id::Default, now, now + 1h, "x"}});
+    for (auto h : {"new0", "new1", "new2", "old0"})
+        CHECK(storage.retrieve_by_hash(h));
+    CHECK(storage.store({pubkey, "old5", namespace_id::Default, now, now + 1h, "x"}) ==
+          StoreResult::Exists);
+    CHECK(storage.store({pubkey, "new0", namespace_id::Default, now, now + 2h, "x"}) ==
+          StoreResult::Extended);
+    CHECK(storage.get_message_count() == 13);
+
+    // Deleted messages stay in the filter until the next rebuild, but must still not be found:
+    CHECK(storage.delete_by_hash(pubkey, {"old1"}).size() == 1);
+    CHECK_FALSE(storage.retrieve_by_hash("old1"));
+    storage.rebuild_hash_filter(/*force=*/true);
+    CHECK_FALSE(storage.retrieve_by_hash("old1"));
+    CHECK(storage.retrieve_by_hash("old2"));
+    CHECK(storage.store({pubkey, "old1", namespace_id::Default, now, now + 1h, "x"}) ==
+          StoreResult::New);
+}
+
+TEST_CASE("storage - multi-hash operations", "[storage][hash]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey, pubkey2;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    auto now = std::chrono::system_clock::now();
+
+    Database storage{"."};
+    // Hashes get passed through as a json array, so make sure ones needing escaping work:
+    std::vector<std::string> hashes{"quo\"te", "back\\slash", "ctrl\x01", "[]", ","};
+    for (int i = 0; i < 300; i++)
+        hashes.push_back("hash" + std::to_string(i));
+    for (auto& h : hashes)
+        REQUIRE(storage.store({pubkey, h, namespace_id::Default, now, now + 1h, "x"}) ==
+                StoreResult::New);
+    storage.store({pubkey2, "other", namespace_id::Default, now, now + 1h, "x"});
+
+    auto with_missing = hashes;
+    with_missing.push_back("missing");
+    with_missing.push_back("other");  // Exists, but belongs to pubkey2
+    auto expiries = storage.get_expiries(pubkey, with_missing);
+    CHECK(expiries.size() == hashes.size());
+    for (auto& h : hashes)
+        CHECK(expiries.count(h));
+
+    auto updated = storage.update_expiry(pubkey, with_missing, {now + 2h});
+    CHECK(updated.size() == hashes.size());
+    for (auto& [h, exp] : storage.get_expiries(pubkey, hashes))
+        CHECK(exp == to_epoch_ms(now + 2h));
+
+    std::vector<std::string> to_delete{hashes.begin(), hashes.begin() + 10};
+    to_delete.push_back("other");
+    auto deleted = storage.delete_by_hash(pubkey, to_delete);
+    std::sort(deleted.begin(), deleted.end());
+    std::vector<std::string> expected{hashes.begin(), hashes.begin() + 10};
+    std::sort(expected.begin(), expected.end());
+    CHECK(deleted == expected);
+    CHECK(storage.get_message_count() == hashes.size() - 10 + 1);
+}
+
+TEST_CASE("storage - revoked subaccounts", "[storage][subaccount]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("030123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+
+    auto make_token = [](int i) {
+        subaccount_token t;
+        t.token[0] = 0x03;
+        t.token[SUBACCOUNT_TOKEN_PUBKEY_INDEX] = static_cast<uint8_t>(i);
+        t.token[SUBACCOUNT_TOKEN_PUBKEY_INDEX + 1] = static_cast<uint8_t>(i >> 8);
+        return t;
+    };
+    auto revoked_count = [&](Database& db, int n) {
+        int count = 0;
+        for (int i = 0; i < n; i++)
+            count += db.subaccount_revoked(pubkey, make_token(i));
+        return count;
+    };
+
+    {
+        Database storage{"."};
+        // Revoking requires an owner row, i.e. at least one stored message
+        storage.revoke_subaccounts(pubkey, {make_token(0)});
+        CHECK_FALSE(storage.subaccount_revoked(pubkey, make_token(0)));
+
+        REQUIRE(storage.store({pubkey, "hash1", namespace_id::Default, now, now + 1h, "x"}) ==
+                StoreResult::New);
+        storage.revoke_subaccounts(pubkey, {make_token(0)});
+        storage.revoke_subaccounts(pubkey, {make_token(1), make_token(2)});
+        CHECK(storage.subaccount_revoked(pubkey, make_token(0)));
+        CHECK(storage.subaccount_revoked(pubkey, make_token(2)));
+        CHECK_FALSE(storage.subaccount_revoked(pubkey, make_token(3)));
+
+        CHECK(storage.unrevoke_subaccounts(pubkey, {make_token(1), make_token(3)}) == 1);
+        CHECK_FALSE(storage.subaccount_revoked(pubkey, make_token(1)));
+        CHECK(revoked_count(storage, 4) == 2);
+
+        // The autoclean trigger limits us to the most recent MAX_SUBACCOUNT_TOKENS:
+        std::vector<subaccount_token> many;
+        for (int i = 100; i < 100 + MAX_SUBACCOUNT_TOKENS + 10; i++)
+            many.push_back(make_token(i));
+        storage.revoke_subaccounts(pubkey, many);
+        CHECK(revoked_count(storage, 200) == MAX_SUBACCOUNT_TOKENS);
+    }
+    {
+        // The revoked set gets loaded back from the database at startup
+        Database storage{"."};
+        CHECK(revoked_count(storage, 200) == MAX_SUBACCOUNT_TOKENS);
+
+        // Removing the owner (by deleting its last message) drops its revocations
+        storage.delete_all(pubkey);
+        CHECK(storage.get_owner_count() == 0);
+        CHECK(revoked_count(storage, 200) == 0);
+    }
+}
+
+TEST_CASE("storage - sharded database", "[storage][shards]") {
+    StorageDeleter fixture;
+    struct ShardDeleter {
+        ShardDeleter() { std::filesystem::remove_all("shards"); }
+        ~ShardDeleter() { std::filesystem::remove_all("shards"); }
+    } shard_fixture;
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey> pubkeys(20);
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        auto hex = "05" + std::string(62, '0') + (i < 10 ? "0" : "") + std::to_string(i);
+        REQUIRE(pubkeys[i].load(hex));
+    }
+
+    {
+        Database storage{".", 1, 2, 4};
+
+        std::vector<message> msgs;
+        for (size_t i = 0; i < pubkeys.size(); i++)
+            for (int j = 0; j < 3; j++)
+                msgs.emplace_back(
+                        pubkeys[i],
+                        "hash" + std::to_string(i) + "-" + std::to_string(j),
+                        static_cast<namespace_id>(j),
+                        now,
+                        now + 1h,
+                        "data");
+        auto stored = storage.store_batch(msgs);
+        REQUIRE(stored.size() == msgs.size());
+        for (auto& [res, exp] : stored)
+            CHECK(res == StoreResult::New);
+
+        CHECK(storage.get_owner_count() == 20);
+        CHECK(storage.get_message_count() == 60);
+        CHECK(storage.get_message_counts().size() == 20);
+        CHECK(storage.get_namespace_counts() ==
+              std::vector<std::pair<namespace_id, int64_t>>{
+                      {namespace_id{0}, 20}, {namespace_id{1}, 20}, {namespace_id{2}, 20}});
+        CHECK(storage.retrieve_all().size() == 60);
+
+        for (int i = 0; i < 4; i++)
+            CHECK(std::filesystem::exists("shards/" + std::to_string(i) + "/storage.db"));
+        CHECK_FALSE(std::filesystem::exists("storage.db"));
+
+        for (size_t i = 0; i < pubkeys.size(); i++) {
+            auto [items, more] = storage.retrieve(pubkeys[i], namespace_id{1}, "");
+            REQUIRE(items.size() == 1);
+            CHECK(items[0].hash == "hash" + std::to_string(i) + "-1");
+        }
+
+        auto found = storage.retrieve_by_hash("hash7-2");
+        REQUIRE(found);
+        CHECK(found->pubkey == pubkeys[7]);
+        CHECK_FALSE(storage.retrieve_by_hash("nosuchhash"));
+        CHECK(storage.retrieve_random());
+
+        auto bulk = storage.bulk_store(
+                {{pubkeys[3], "hash3-0", namespace_id{0}, now, now + 1h, "data"},
+                 {pubkeys[4], "newhash", namespace_id{0}, now, now - 1s, "data"}});
+        REQUIRE(bulk.size() == 2);
+        CHECK(bulk[0] == StoreResult::Exists);
+        CHECK(bulk[1] == StoreResult::New);
+
+        CHECK(storage.delete_all(pubkeys[5]).size() == 3);
+        CHECK(storage.get_owner_count() == 19);
+
+        // The expired bulk-stored message
+        CHECK(storage.clean_expired() == 1);
+        CHECK(storage.get_message_count() == 57);
+
+        size_t visited = 0;
+        storage.for_each_message(nullptr, [&](message&&) { return ++visited < 10; });
+        CHECK(visited == 10);
+    }
+
+    // The shard count can't be changed, and a sharded database can't be opened unsharded
+    CHECK_THROWS(Database{".", 1, 2, 3});
+    CHECK_THROWS(Database{"."});
+
+    Database storage{".", 1, 2, 4};
+    CHECK(storage.get_message_count() == 57);
+}
+
+TEST_CASE("storage - eviction", "[storage][evict]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+
+    // Messages in namespaces 0, 1 and 2; within each namespace, message i expires after i hours.
+    for (int ns = 0; ns < 3; ns++)
+        for (int i = 1; i <= 4; i++)
+            storage.store(
+                    {pubkey,
+                     "h" + std::to_string(ns) + "-" + std::to_string(i),
+                     static_cast<namespace_id>(ns),
+                     now,
+                     now + std::chrono::hours{i},
+                     std::string(1000, 'x')});
+
+    // Nowhere near full, so nothing to do
+    CHECK(storage.make_space() == 0);
+
+    auto remaining = [&](int ns) {
+        std::set<std::string> hashes;
+        for (auto& m : storage.retrieve(pubkey, static_cast<namespace_id>(ns), "").first)
+            hashes.emplace(m.hash);
+        return hashes;
+    };
+
+    // Without priorities we just evict whatever expires soonest:
+    CHECK(TestSuiteHacks::db_evict(storage, 3) == 3);
+    CHECK(remaining(0) == std::set<std::string>{"h0-2", "h0-3", "h0-4"});
+    CHECK(remaining(1) == std::set<std::string>{"h1-2", "h1-3", "h1-4"});
+    CHECK(remaining(2) == std::set<std::string>{"h2-2", "h2-3", "h2-4"});
+
+    // Namespace 1 goes first, namespace 2 last:
+    storage.set_eviction_priority(namespace_id{1}, -1);
+    storage.set_eviction_priority(namespace_id{2}, 5);
+    CHECK(TestSuiteHacks::db_evict(storage, 4) == 4);
+    CHECK(remaining(1).empty());
+    CHECK(remaining(0) == std::set<std::string>{"h0-3", "h0-4"});
+    CHECK(remaining(2) == std::set<std::string>{"h2-2", "h2-3", "h2-4"});
+
+    CHECK(TestSuiteHacks::db_evict(storage, 3) == 3);
+    CHECK(remaining(0).empty());
+    CHECK(remaining(2) == std::set<std::string>{"h2-3", "h2-4"});
+
+    CHECK(storage.evicted_messages() == 10);
+    CHECK(storage.get_message_count() == 2);
+}
+
+TEST_CASE("storage - expiry buckets", "[storage][expiry]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+    const auto ns = namespace_id::Default;
+
+    // Expired a few buckets ago, expired just now, expires shortly, and expires far in the future:
+    storage.store({pubkey, "old", ns, now - 2h, now - 3 * Database::EXPIRY_BUCKET_SIZE, "a"});
+    storage.store({pubkey, "recent", ns, now - 1h, now - 1ms, "b"});
+    storage.store({pubkey, "soon", ns, now, now + 1min, "c"});
+    storage.store({pubkey, "later", ns, now, now + 14 * 24h, "d"});
+
+    CHECK(storage.clean_expired() == 2);
+    CHECK(storage.retrieve_by_hash("soon"));
+    CHECK(storage.retrieve_by_hash("later"));
+
+    // Small extensions stay within a bucket; shortening to the past moves "later" all the way back
+    // into an expired bucket, which cleanup has to notice.
+    CHECK(storage.update_expiry(pubkey, {"soon"}, {now + 2min}).size() == 1);
+    CHECK(storage.update_expiry(pubkey, {"later"}, {now - 4 * Database::EXPIRY_BUCKET_SIZE})
+                  .size() == 1);
+    CHECK(storage.clean_expired() == 1);
+    CHECK_FALSE(storage.retrieve_by_hash("later"));
+    CHECK(storage.get_expiries(pubkey, {"soon"}) ==
+          std::map<std::string, int64_t>{{"soon", to_epoch_ms(now + 2min)}});
+
+    // Moving it from the current bucket into a later one keeps it around
+    storage.update_expiry(pubkey, {"soon"}, {now + 3 * Database::EXPIRY_BUCKET_SIZE});
+    CHECK(storage.clean_expired() == 0);
+    CHECK(storage.update_all_expiries(pubkey, now - 1ms).size() == 1);
+    CHECK(storage.clean_expired() == 1);
+    CHECK(storage.get_message_count() == 0);
+}
+
+TEST_CASE("storage - retrieve query plans", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    // The last hash lookup goes by the (unique) hash; the retrieves page through the owner's
+    // namespace with the id-ordered index, rather than having to sort the owner's messages.
+    auto plans = oxenss::TestSuiteHacks::db_retrieve_plans(storage);
+    REQUIRE(plans.size() == 3);
+    CHECK_THAT(plans[0], Catch::Contains("(hash=?)"));
+    for (size_t i : {1, 2}) {
+        INFO(plans[i]);
+        CHECK_THAT(plans[i], Catch::Contains("USING INDEX messages_owner_id"));
+        CHECK_THAT(plans[i], !Catch::Contains("TEMP B-TREE"));
+    }
+    CHECK_THAT(plans[2], Catch::Contains("id>?"));
+}
+
+TEST_CASE("storage - background WAL checkpoints", "[storage][checkpoint]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+    // Checkpoint after every write, and truncate the WAL once writes stop for a moment
+    storage.start_checkpointer(10ms, 1, 100ms);
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 20; i++)
+        storage.store(
+                {pubkey, "hash" + std::to_string(i), namespace_id::Default, now, now + 1h, "x"});
+
+    auto wait_for = [&](auto&& f) {
+        auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (!f(storage.get_checkpoint_stats()) && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(5ms);
+        return storage.get_checkpoint_stats();
+    };
+    auto stats = wait_for([](const auto& s) { return s.passive > 0; });
+    CHECK(stats.passive > 0);
+    stats = wait_for([](const auto& s) { return s.truncate > 0 && s.wal_bytes == 0; });
+    CHECK(stats.truncate > 0);
+    CHECK(stats.wal_bytes == 0);
+    CHECK(stats.seconds > 0);
+
+    // Everything is still there, of course
+    CHECK(storage.get_message_count() == 20);
+}
+
+TEST_CASE("storage - memory tier", "[storage][memory]") {
+    StorageDeleter fixture;
+    struct SpillDeleter {
+        SpillDeleter() { std::filesystem::remove(Database::MEMORY_TIER_SPILL_FILE); }
+        ~SpillDeleter() { std::filesystem::remove(Database::MEMORY_TIER_SPILL_FILE); }
+    } spill_fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+    const auto mem_ns = namespace_id::GroupMessages;
+    auto msg = [&](std::string hash, namespace_id ns, std::chrono::milliseconds ttl = 1h) {
+        return message{pubkey, std::move(hash), ns, now, now + ttl, "data"};
+    };
+
+    {
+        Database storage{"."};
+        REQUIRE(storage.store(msg("disk1", namespace_id::Default)) == StoreResult::New);
+        // Already on disk when the memory tier gets enabled, and so should get moved into memory
+        REQUIRE(storage.store(msg("mem1", mem_ns)) == StoreResult::New);
+
+        storage.enable_memory_tier({mem_ns, namespace_id::ConvoInfoVolatile}, 1024 * 1024, true);
+        CHECK(storage.get_message_count() == 2);
+        CHECK(storage.memory_tier_bytes() > 0);
+
+        CHECK(storage.store(msg("mem2", mem_ns)) == StoreResult::New);
+        CHECK(storage.store(msg("mem3", mem_ns)) == StoreResult::New);
+        CHECK(storage.store(msg("mem3", mem_ns, 2h)) == StoreResult::Extended);
+        CHECK(storage.store(msg("mem3", mem_ns)) == StoreResult::Exists);
+        CHECK(storage.store(msg("disk2", namespace_id::Default)) == StoreResult::New);
+
+        auto [all, more] = storage.retrieve(pubkey, mem_ns, "");
+        REQUIRE(all.size() == 3);
+        CHECK(all[0].hash == "mem1");
+        CHECK(all[1].hash == "mem2");
+        CHECK(all[2].hash == "mem3");
+        CHECK_FALSE(more);
+
+        auto [after, more2] = storage.retrieve(pubkey, mem_ns, "mem1", 1);
+        REQUIRE(after.size() == 1);
+        CHECK(after[0].hash == "mem2");
+        CHECK(more2);
+
+        auto multi = storage.retrieve_multi(
+                pubkey,
+                {{namespace_id::Default, "", std::nullopt, std::nullopt},
+                 {mem_ns, "mem2", std::nullopt, std::nullopt}});
+        REQUIRE(multi.size() == 2);
+        CHECK(multi[0].first.size() == 2);
+        REQUIRE(multi[1].first.size() == 1);
+        CHECK(multi[1].first[0].hash == "mem3");
+
+        CHECK(storage.get_message_count() == 5);
+        CHECK(storage.retrieve_by_hash("mem2"));
+        CHECK(storage.retrieve_all().size() == 5);
+        int visited = 0;
+        storage.for_each_message(nullptr, [&](message&&) { return ++visited > 0; });
+        CHECK(visited == 5);
+
+        // Operations spanning both tiers
+        auto expiries = storage.get_expiries(pubkey, {"disk1", "mem2", "nope"});
+        CHECK(expiries.size() == 2);
+        CHECK(expiries.count("disk1"));
+        CHECK(expiries.count("mem2"));
+
+        auto updated = storage.update_expiry(pubkey, {"disk1", "mem1"}, {now + 30min});
+        CHECK(updated.size() == 2);
+
+        auto deleted = storage.delete_by_hash(pubkey, {"disk1", "mem1"});
+        std::sort(deleted.begin(), deleted.end());
+        CHECK(deleted == std::vector<std::string>{"disk1", "mem1"});
+        CHECK(storage.get_message_count() == 3);
+    }
+
+    // The memory tier was saved on shutdown, and gets loaded back in:
+    REQUIRE(std::filesystem::exists(Database::MEMORY_TIER_SPILL_FILE));
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 1);
+        storage.enable_memory_tier({mem_ns}, 1024 * 1024, false);
+        CHECK_FALSE(std::filesystem::exists(Database::MEMORY_TIER_SPILL_FILE));
+        CHECK(storage.get_message_count() == 3);
+        auto [msgs, more] = storage.retrieve(pubkey, mem_ns, "");
+        REQUIRE(msgs.size() == 2);
+        CHECK(msgs[0].hash == "mem2");
+        CHECK(msgs[1].hash == "mem3");
+
+        auto deleted = storage.delete_all(pubkey);
+        CHECK(deleted.size() == 3);
+        CHECK(storage.get_message_count() == 0);
+    }
+    // Without spilling the (now empty) memory tier isn't saved
+    CHECK_FALSE(std::filesystem::exists(Database::MEMORY_TIER_SPILL_FILE));
+}
+
+TEST_CASE("storage - memory tier eviction and expiry", "[storage][memory]") {
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    const auto now = std::chrono::system_clock::now();
+    const auto ns = namespace_id::GroupMessages;
+
+    const std::string data(1000, 'x');
+    const size_t size = MemoryStore::ENTRY_OVERHEAD + 2 + data.size();
+    MemoryStore memory{{ns}, 3 * size};
+    CHECK(memory.handles(ns));
+    CHECK_FALSE(memory.handles(namespace_id::Default));
+
+    // h3 expires first, h1 last
+    for (int i = 1; i <= 3; i++)
+        CHECK(memory.store(
+                      {pubkey,
+                       "h" + std::to_string(i),
+                       ns,
+                       now,
+                       now + std::chrono::hours{4 - i},
+                       data}) == StoreResult::New);
+    CHECK(memory.bytes() == 3 * size);
+
+    // Full, so the message closest to expiry makes way for a new one
+    CHECK(memory.store({pubkey, "h4", ns, now, now + 5h, data}) == StoreResult::New);
+    CHECK(memory.evicted() == 1);
+    CHECK_FALSE(memory.retrieve_by_hash("h3"));
+    CHECK(memory.message_count() == 3);
+
+    CHECK(memory.update_all_expiries(pubkey, now - 1s).size() == 3);
+    CHECK(memory.clean_expired() == 3);
+    CHECK(memory.message_count() == 0);
+    CHECK(memory.owner_count() == 0);
+    CHECK(memory.bytes() == 0);
+}
+
+TEST_CASE("storage - snapshot and import", "[storage][snapshot]") {
+    StorageDeleter fixture;
+    struct SnapshotDeleter {
+        SnapshotDeleter() {
+            std::filesystem::remove_all("snapshot_test");
+            std::filesystem::remove_all("import_test");
+        }
+        ~SnapshotDeleter() {
+            std::filesystem::remove_all("snapshot_test");
+            std::filesystem::remove_all("import_test");
+        }
+    } snapshot_fixture;
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey> pubkeys(3);
+    for (size_t i = 0; i < pubkeys.size(); i++)
+        REQUIRE(pubkeys[i].load("05" + std::string(63, '0') + std::to_string(i + 1)));
+
+    Database storage{"."};
+    for (size_t i = 0; i < pubkeys.size(); i++)
+        for (int j = 0; j < 2; j++)
+            REQUIRE(storage.store({pubkeys[i],
+                                   "hash" + std::to_string(i) + "-" + std::to_string(j),
+                                   namespace_id::Default,
+                                   now,
+                                   now + 1h,
+                                   "data"}) == StoreResult::New);
+
+    CHECK_THROWS_AS(storage.snapshot("."), std::invalid_argument);
+
+    storage.snapshot("snapshot_test");
+    CHECK(std::filesystem::exists("snapshot_test/storage.db"));
+    CHECK_FALSE(std::filesystem::exists("snapshot_test/storage.db.tmp"));
+
+    // Not in the snapshot:
+    REQUIRE(storage.store({pubkeys[0], "late", namespace_id::Default, now, now + 1h, "data"}) ==
+            StoreResult::New);
+
+    {
+        Database copy{"snapshot_test"};
+        CHECK(copy.get_message_count() == 6);
+        CHECK_FALSE(copy.retrieve_by_hash("late"));
+    }
+
+    // Taking another snapshot replaces the first one
+    REQUIRE(storage.snapshot_async("snapshot_test"));
+    while (storage.snapshot_running())
+        std::this_thread::sleep_for(10ms);
+    {
+        Database copy{"snapshot_test"};
+        CHECK(copy.get_message_count() == 7);
+    }
+
+    auto read_file = [](const std::filesystem::path& path) {
+        std::ifstream in{path, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>{in}, {}};
+    };
+    auto snapshot_data = read_file("snapshot_test/storage.db");
+
+    std::filesystem::create_directories("import_test");
+    Database fresh{"import_test"};
+    REQUIRE(fresh.store({pubkeys[1], "hash1-0", namespace_id::Default, now, now + 1h, "data"}) ==
+            StoreResult::New);
+    auto space = pubkeys[1].swarm_space();
+    CHECK(fresh.import_snapshot("snapshot_test", std::pair{space, space}) == 1);
+    CHECK(fresh.get_message_count() == 2);
+    CHECK(fresh.retrieve(pubkeys[0], namespace_id::Default, "").first.empty());
+
+    CHECK(fresh.import_snapshot("snapshot_test") == 5);
+    CHECK(fresh.get_message_count() == 7);
+    CHECK(fresh.retrieve(pubkeys[0], namespace_id::Default, "").first.size() == 3);
+
+    // Importing only reads the snapshot
+    CHECK(read_file("snapshot_test/storage.db") == snapshot_data);
+}
+
+TEST_CASE("storage - swarm space range digests", "[storage][sync]") {
+    // Bucket assignment and bounds must agree, including for wrapping and full ranges
+    for (auto [begin, end] : std::vector<std::pair<uint64_t, uint64_t>>{
+                 {0, std::numeric_limits<uint64_t>::max()},
+                 {1000, 1999},
+                 {std::numeric_limits<uint64_t>::max() - 99, 150},
+                 {5, 5}}) {
+        for (size_t buckets : {1, 7, 256}) {
+            auto first = Database::range_bucket_bounds(begin, end, buckets, 0);
+            auto last = Database::range_bucket_bounds(begin, end, buckets, buckets - 1);
+            CHECK(first.first == begin);
+            CHECK(last.second == end);
+            for (size_t i = 0; i + 1 < buckets; i++) {
+                auto [lo, hi] = Database::range_bucket_bounds(begin, end, buckets, i);
+                if (hi + 1 == lo)
+                    continue;  // Empty bucket (more buckets than values)
+                CHECK(Database::range_bucket(lo, begin, end, buckets) == i);
+                CHECK(Database::range_bucket(hi, begin, end, buckets) == i);
+                CHECK(Database::range_bucket(hi + 1, begin, end, buckets) == i + 1);
+            }
+        }
+    }
+
+    StorageDeleter fixture;
+    struct PeerDeleter {
+        PeerDeleter() { std::filesystem::remove_all("sync_peer"); }
+        ~PeerDeleter() { std::filesystem::remove_all("sync_peer"); }
+    } peer_fixture;
+    std::filesystem::create_directories("sync_peer");
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey> pubkeys(16);
+    std::vector<message> msgs;
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        // Swarm space i << 60 puts each owner in its own 1/16th of the space
+        std::string hex = "05" + std::string(64, '0');
+        hex[50] = "0123456789abcdef"[i];
+        REQUIRE(pubkeys[i].load(hex));
+        for (int j = 0; j < 3; j++) {
+            std::string hash(43, 'A' + i);
+            hash[0] = 'a' + j;
+            hash[42] = 'A';  // Keeps the base64 canonical
+            msgs.emplace_back(pubkeys[i], hash, namespace_id::Default, now, now + 1h, "data");
+        }
+    }
+
+    Database ours{"."};
+    Database peer{"sync_peer"};
+    ours.bulk_store(msgs);
+    peer.bulk_store(msgs);
+
+    const uint64_t begin = 0, end = std::numeric_limits<uint64_t>::max();
+    auto digests = ours.range_digests(begin, end, 16);
+    REQUIRE(digests.size() == 16);
+    for (auto& d : digests)
+        CHECK(d.count == 3);
+    CHECK(digests == peer.range_digests(begin, end, 16));
+
+    // Deleting one message changes just its bucket
+    auto& gone = msgs[3 * 5 + 1];
+    REQUIRE(peer.delete_by_hash(gone.pubkey, {gone.hash}).size() == 1);
+    auto peer_digests = peer.range_digests(begin, end, 16);
+    for (size_t i = 0; i < 16; i++)
+        CHECK((digests[i] == peer_digests[i]) == (i != 5));
+
+    auto bounds = Database::range_bucket_bounds(begin, end, 16, 5);
+    auto hashes = ours.range_hashes(bounds.first, bounds.second, 100);
+    REQUIRE(hashes);
+    CHECK(hashes->size() == 3);
+    CHECK(std::is_sorted(hashes->begin(), hashes->end()));
+    auto peer_hashes = peer.range_hashes(bounds.first, bounds.second, 100);
+    REQUIRE(peer_hashes);
+    CHECK(peer_hashes->size() == 2);
+    CHECK(std::find(peer_hashes->begin(), peer_hashes->end(), gone.hash) == peer_hashes->end());
+
+    CHECK_FALSE(ours.range_hashes(begin, end, 10));
+    // A wrapping range covering the last and first buckets
+    auto wrap = ours.range_hashes(Database::range_bucket_bounds(begin, end, 16, 15).first,
+                                  Database::range_bucket_bounds(begin, end, 16, 0).second,
+                                  100);
+    REQUIRE(wrap);
+    CHECK(wrap->size() == 6);
+}
+
+TEST_CASE("storage - startup opens the reader pool", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{".", 1, 3};
+        auto pools = storage.get_pool_usage();
+        CHECK(pools.writers_open == 1);
+        CHECK(pools.readers_open == 3);
+        CHECK(pools.readers_busy == 0);
+        storage.store({pubkey, "a", namespace_id::Default, now, now + 1h, "x"});
+        storage.store({pubkey, "b", namespace_id::Default, now - 1h, now - 1ms, "x"});
+    }
+
+    // Reopening removes the expired message while warming the readers
+    Database storage{".", 1, 3};
+    CHECK(storage.get_pool_usage().readers_open == 3);
+    CHECK(storage.get_message_count() == 1);
+    CHECK(storage.get_owner_count() == 1);
+    auto [items, more] = storage.retrieve(pubkey, namespace_id::Default, "");
+    REQUIRE(items.size() == 1);
+    CHECK(items[0].hash == "a");
 }
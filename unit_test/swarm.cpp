@@ -1,11 +1,17 @@
 #include <catch2/catch.hpp>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <set>
 
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/server/utils.h>
 #include <oxenss/snode/swarm.h>
 #include <oxenss/utils/time.hpp>
 
+#include <oxenc/base32z.h>
 #include <oxenc/base64.h>
 
 using namespace std::literals;
@@ -150,3 +156,326 @@ TEST_CASE("service nodes - pubkey to swarm id") {
     REQUIRE(pk.load("05000000000000000000000000000000000000000000000000fffffffffffffffe"));
     CHECK(get_swarm_by_pk(swarms, pk)->swarm_id == 0);
 }
+
+TEST_CASE("service nodes - swarm space ranges", "[swarm]") {
+    using oxenss::snode::get_swarm_by_space;
+    using oxenss::snode::swarm_space_range;
+
+    std::vector<oxenss::snode::SwarmInfo> swarms{
+            {100, {}}, {200, {}}, {300, {}}, {399, {}}, {498, {}}, {596, {}}, {694, {}}};
+
+    using range = std::pair<uint64_t, uint64_t>;
+    CHECK(swarm_space_range(swarms, 0) == range{0x8000'0000'0000'018e, 150});
+    CHECK(swarm_space_range(swarms, 1) == range{151, 250});
+    CHECK(swarm_space_range(swarms, 2) == range{251, 349});
+    CHECK(swarm_space_range(swarms, 3) == range{350, 448});
+    CHECK(swarm_space_range(swarms, 6) == range{646, 0x8000'0000'0000'018d});
+
+    auto in_range = [](uint64_t v, range r) {
+        return r.first <= r.second ? v >= r.first && v <= r.second : v >= r.first || v <= r.second;
+    };
+
+    // Every range boundary (and its neighbours) must map to the swarm whose range contains it
+    for (size_t i = 0; i < swarms.size(); i++) {
+        auto r = swarm_space_range(swarms, i);
+        for (uint64_t v :
+             {r.first - 1, r.first, r.first + 1, r.second - 1, r.second, r.second + 1}) {
+            auto* s = get_swarm_by_space(swarms, v);
+            REQUIRE(s);
+            CHECK(in_range(v, r) == (s->swarm_id == swarms[i].swarm_id));
+        }
+    }
+
+    // A single swarm covers everything
+    std::vector<oxenss::snode::SwarmInfo> one{{12345, {}}};
+    CHECK(swarm_space_range(one, 0) == range{0, std::numeric_limits<uint64_t>::max()});
+}
+
+TEST_CASE("service nodes - swarm state snapshots", "[swarm]") {
+    using namespace oxenss::snode;
+    using oxenss::crypto::legacy_pubkey;
+
+    std::vector<sn_record> snodes(4);
+    for (size_t i = 0; i < snodes.size(); i++) {
+        snodes[i].pubkey_legacy = legacy_pubkey::from_hex(std::string(63, '0') + char('1' + i));
+        snodes[i].pubkey_ed25519.data()[0] = static_cast<unsigned char>(i + 1);
+    }
+
+    Swarm swarm{snodes[0]};
+    auto initial = swarm.state();
+    REQUIRE(initial);
+    CHECK_FALSE(initial->is_valid());
+
+    std::vector<SwarmInfo> swarms{{100, {snodes[0], snodes[1]}}, {200, {snodes[2], snodes[3]}}};
+    auto events = swarm.derive_swarm_events(swarms);
+    REQUIRE(events.our_swarm_id == 100);
+    swarm.set_swarm_id(events.our_swarm_id);
+    swarm.update_state(std::vector<SwarmInfo>{swarms}, {}, events, true);
+
+    // A state obtained earlier is unaffected by later updates
+    CHECK_FALSE(initial->is_valid());
+    CHECK(initial->all_valid_swarms.empty());
+    CHECK_FALSE(initial->find_node(snodes[2].pubkey_legacy));
+
+    auto state = swarm.state();
+    CHECK(state->is_valid());
+    CHECK(state->our_swarm_id == 100);
+    REQUIRE(state->swarm_peers.size() == 1);
+    CHECK(state->swarm_peers[0] == snodes[1]);
+    CHECK(state->find_node(snodes[2].pubkey_legacy));
+    CHECK(state->find_node(snodes[3].pubkey_ed25519));
+
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("050000000000000000000000000000000000000000000000000000000000000064"));
+    CHECK(state->is_pubkey_for_us(pk));
+    REQUIRE(pk.load("0500000000000000000000000000000000000000000000000000000000000000c8"));
+    CHECK_FALSE(state->is_pubkey_for_us(pk));
+
+    // Moving to the other swarm publishes a new state, again without touching the old one
+    swarm.set_swarm_id(200);
+    CHECK(state->our_swarm_id == 100);
+    CHECK(swarm.state()->our_swarm_id == 200);
+    CHECK(swarm.state()->is_pubkey_for_us(pk));
+}
+
+TEST_CASE("service nodes - incremental swarm state updates", "[swarm]") {
+    using namespace oxenss::snode;
+
+    std::vector<sn_record> snodes(4);
+    for (size_t i = 0; i < snodes.size(); i++) {
+        auto& sn = snodes[i];
+        sn.ip = "10.0.0." + std::to_string(i + 1);
+        sn.port = 22000 + i;
+        sn.omq_quic_port = 23000 + i;
+        sn.pubkey_legacy.data()[0] = i + 1;
+        sn.pubkey_ed25519.data()[1] = i + 1;
+        sn.pubkey_x25519.data()[2] = i + 1;
+    }
+
+    Swarm swarm{snodes[0]};
+    auto apply = [&](std::vector<SwarmInfo> swarms, std::vector<sn_record> decomm = {}) {
+        auto events = swarm.derive_swarm_events(swarms);
+        swarm.set_swarm_id(events.our_swarm_id);
+        swarm.update_state(std::move(swarms), decomm, events, true);
+    };
+
+    apply({{100, {snodes[0], snodes[1]}}, {200, {snodes[2]}}}, {snodes[3]});
+    auto first = swarm.state();
+    CHECK(first->all_funded_nodes.size() == 4);
+    CHECK(first->all_funded_ed25519.size() == 4);
+    CHECK(first->all_funded_x25519.size() == 4);
+
+    // An identical update (as we get for most blocks) doesn't publish anything new
+    apply({{100, {snodes[0], snodes[1]}}, {200, {snodes[2]}}}, {snodes[3]});
+    CHECK(swarm.state() == first);
+
+    // Changed nodes get updated, including their ed25519/x25519 lookups
+    auto old_ed = snodes[2].pubkey_ed25519;
+    snodes[2].pubkey_ed25519.data()[1] = 42;
+    snodes[1].ip = "10.1.1.1";
+    apply({{100, {snodes[0], snodes[1]}}, {200, {snodes[2]}}}, {snodes[3]});
+    auto second = swarm.state();
+    REQUIRE(second != first);
+    CHECK(second->find_node(snodes[1].pubkey_legacy)->ip == "10.1.1.1");
+    REQUIRE(second->swarm_peers.size() == 1);
+    CHECK(second->swarm_peers[0].ip == "10.1.1.1");
+    CHECK_FALSE(second->find_node(old_ed));
+    CHECK(second->find_node(snodes[2].pubkey_ed25519));
+    CHECK(second->all_funded_ed25519.size() == 4);
+    // ... without affecting the earlier state
+    CHECK(first->find_node(snodes[1].pubkey_legacy)->ip == "10.0.0.2");
+    CHECK(first->find_node(old_ed));
+
+    // Nodes that aren't listed anymore go away entirely
+    apply({{100, {snodes[0], snodes[1]}}, {200, {snodes[2]}}});
+    auto third = swarm.state();
+    CHECK(third->all_funded_nodes.size() == 3);
+    CHECK_FALSE(third->find_node(snodes[3].pubkey_legacy));
+    CHECK_FALSE(third->find_node(snodes[3].pubkey_ed25519));
+    CHECK_FALSE(third->find_node(snodes[3].pubkey_x25519));
+    CHECK(third->all_funded_x25519.size() == 3);
+
+    SwarmState state = *third;
+    std::vector<SwarmInfo> swarms{{100, {snodes[0], snodes[1]}}, {200, {snodes[2], snodes[3]}}};
+    CHECK_FALSE(state.same_funded_nodes(swarms, {}));
+    CHECK(state.update_funded_nodes(swarms, {}) == 1);
+    CHECK(state.same_funded_nodes(swarms, {}));
+    CHECK(state.update_funded_nodes(swarms, {}) == 0);
+    swarms[1].snodes.pop_back();
+    swarms[0].snodes.pop_back();
+    CHECK(state.update_funded_nodes(swarms, {}) == 2);
+    CHECK(state.all_funded_nodes.size() == 2);
+    CHECK(state.all_funded_ed25519.size() == 2);
+}
+
+TEST_CASE("service nodes - saved block updates", "[swarm]") {
+    using namespace oxenss::snode;
+
+    auto make_sn = [](int i) {
+        sn_record sn;
+        sn.ip = "10.0.0." + std::to_string(i);
+        sn.port = 22000 + i;
+        sn.omq_quic_port = 23000 + i;
+        sn.pubkey_legacy.data()[0] = i;
+        sn.pubkey_ed25519.data()[1] = i;
+        sn.pubkey_x25519.data()[2] = i;
+        return sn;
+    };
+
+    block_update bu;
+    bu.swarms = {{300, {make_sn(3), make_sn(4)}}, {100, {make_sn(1), make_sn(2)}}};
+    bu.decommissioned_nodes = {make_sn(5)};
+    bu.height = 1234567;
+    bu.block_hash = std::string(64, 'a');
+    bu.hardfork = 19;
+    bu.snode_revision = 3;
+    const std::chrono::system_clock::time_point saved{1'700'000'000s};
+
+    auto loaded = deserialize_block_update(serialize_block_update(bu, saved));
+    REQUIRE(loaded);
+    auto& [lbu, lsaved] = *loaded;
+    CHECK(lsaved == saved);
+    CHECK(lbu.height == bu.height);
+    CHECK(lbu.block_hash == bu.block_hash);
+    CHECK(lbu.hardfork == 19);
+    CHECK(lbu.snode_revision == 3);
+    CHECK_FALSE(lbu.unchanged);
+    REQUIRE(lbu.swarms.size() == 2);
+    CHECK(lbu.swarms[0].swarm_id == 100);
+    CHECK(lbu.swarms[1].swarm_id == 300);
+    REQUIRE(lbu.swarms[1].snodes.size() == 2);
+    const auto& sn = lbu.swarms[1].snodes[1];
+    CHECK(sn.ip == "10.0.0.4");
+    CHECK(sn.port == 22004);
+    CHECK(sn.omq_quic_port == 23004);
+    CHECK(sn.pubkey_legacy == make_sn(4).pubkey_legacy);
+    CHECK(sn.pubkey_ed25519 == make_sn(4).pubkey_ed25519);
+    CHECK(sn.pubkey_x25519 == make_sn(4).pubkey_x25519);
+    REQUIRE(lbu.decommissioned_nodes.size() == 1);
+    CHECK(lbu.decommissioned_nodes[0].ip == "10.0.0.5");
+    CHECK(lbu.active_x25519_pubkeys.size() == 4);
+    CHECK(lbu.active_x25519_pubkeys.count(std::string{make_sn(2).pubkey_x25519.view()}));
+
+    CHECK_FALSE(deserialize_block_update(""));
+    CHECK_FALSE(deserialize_block_update("de"));
+    auto data = serialize_block_update(bu, saved);
+    CHECK_FALSE(deserialize_block_update(data.substr(0, data.size() - 5)));
+}
+
+TEST_CASE("service nodes - swarm id index lookups", "[swarm]") {
+    using namespace oxenss::snode;
+
+    std::mt19937_64 rng{42};
+    std::vector<SwarmInfo> swarms;
+    std::set<swarm_id_t> ids;
+    while (ids.size() < 300)
+        ids.insert(rng() % INVALID_SWARM_ID);
+    for (auto id : ids)
+        swarms.push_back({id, {}});
+
+    SwarmState state;
+    state.set_swarms(std::vector<SwarmInfo>{swarms});
+    REQUIRE(state.swarm_ids.size() == swarms.size());
+
+    // Must agree with the plain search everywhere, including at and around the swarm ids
+    std::vector<uint64_t> spaces{0, 1, std::numeric_limits<uint64_t>::max()};
+    for (auto id : ids)
+        for (uint64_t d : {0, 1})
+            spaces.insert(spaces.end(), {id - d, id + d, id + (id - d) / 2});
+    for (int i = 0; i < 10000; i++)
+        spaces.push_back(rng());
+    for (auto space : spaces) {
+        auto* expected = get_swarm_by_space(swarms, space);
+        REQUIRE(state.get_swarm_by_space(space)->swarm_id == expected->swarm_id);
+    }
+
+    SwarmState single;
+    single.set_swarms({{100, {}}});
+    CHECK(single.get_swarm_by_space(0)->swarm_id == 100);
+    CHECK(single.get_swarm_by_space(std::numeric_limits<uint64_t>::max())->swarm_id == 100);
+    CHECK(SwarmState{}.get_swarm_by_space(123) == nullptr);
+}
+
+TEST_CASE("service nodes - encoded swarms", "[swarm]") {
+    using namespace oxenss::snode;
+
+    std::vector<sn_record> snodes(2);
+    for (size_t i = 0; i < snodes.size(); i++) {
+        auto& sn = snodes[i];
+        sn.ip = "10.0.0." + std::to_string(i + 1);
+        sn.port = 22000 + i;
+        sn.omq_quic_port = 23000 + i;
+        sn.pubkey_legacy = legacy_pubkey::from_hex(std::string(63, '0') + char('1' + i));
+        sn.pubkey_x25519.data()[0] = static_cast<unsigned char>(i + 1);
+        sn.pubkey_ed25519.data()[0] = static_cast<unsigned char>(i + 1);
+    }
+    SwarmState state;
+    state.set_swarms({{0x1234, snodes}});
+    REQUIRE(state.encoded_swarms.size() == 1);
+    auto& enc = *state.encoded_swarms[0];
+    CHECK(enc.id_hex == "1234");
+    CHECK(enc.size == 2);
+
+    // Must match what we'd get from building the same thing as json
+    auto expected = nlohmann::json::array();
+    for (const auto& sn : snodes)
+        expected.push_back(
+                {{"address", oxenc::to_base32z(sn.pubkey_legacy.view()) + ".snode"},
+                 {"pubkey_legacy", sn.pubkey_legacy.hex()},
+                 {"pubkey_x25519", sn.pubkey_x25519.hex()},
+                 {"pubkey_ed25519", sn.pubkey_ed25519.hex()},
+                 {"port", std::to_string(sn.port)},
+                 {"port_https", sn.port},
+                 {"port_omq", sn.omq_quic_port},
+                 {"port_quic", sn.omq_quic_port},
+                 {"ip", sn.ip}});
+    CHECK(enc.json == expected.dump());
+    CHECK(oxenss::bt_to_json(oxenc::bt_list_consumer{enc.bt}) == expected);
+
+    oxenss::user_pubkey pk;
+    REQUIRE(pk.load("053506f4a71324b7dd114eddbf4e311f39dde243e1f2cb97c40db1961f70ebaae8"));
+    CHECK(state.get_encoded_swarm(pk) == state.encoded_swarms[0]);
+    auto none = SwarmState{}.get_encoded_swarm(pk);
+    CHECK(none->id_hex == "ffffffffffffffff");
+    CHECK(none->json == "[]");
+    CHECK(none->bt == "le");
+    CHECK(none->size == 0);
+}
+
+TEST_CASE("service nodes - swarm lookup benchmark", "[.][benchmark]") {
+    using namespace oxenss::snode;
+
+    // Roughly mainnet-sized: ~2000 nodes in ~300 swarms
+    std::mt19937_64 rng{42};
+    std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
+    while (swarm_map.size() < 300)
+        swarm_map[rng() % INVALID_SWARM_ID];
+    for (int i = 0; i < 2000; i++) {
+        auto it = std::next(swarm_map.begin(), rng() % swarm_map.size());
+        auto& sn = it->second.emplace_back();
+        sn.ip = "10.0.0.1";
+        for (auto& c : sn.pubkey_legacy)
+            c = static_cast<unsigned char>(rng());
+    }
+    std::vector<SwarmInfo> swarms;
+    for (auto& [id, snodes] : swarm_map)
+        swarms.push_back({id, snodes});
+    SwarmState state;
+    state.set_swarms(std::vector<SwarmInfo>{swarms});
+
+    std::vector<oxenss::user_pubkey> pubkeys(4096);
+    for (auto& pk : pubkeys) {
+        std::string raw(33, '\x05');
+        for (size_t i = 1; i < raw.size(); i++)
+            raw[i] = static_cast<char>(rng());
+        REQUIRE(pk.load(raw));
+    }
+
+    size_t i = 0;
+    BENCHMARK("get_swarm_by_pk") {
+        return get_swarm_by_pk(swarms, pubkeys[i++ % pubkeys.size()]);
+    };
+    BENCHMARK("SwarmState::get_swarm") {
+        return state.get_swarm(pubkeys[i++ % pubkeys.size()]);
+    };
+}
@@ -0,0 +1,83 @@
+#include <oxenss/utils/timer_wheel.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <vector>
+
+using namespace oxenss;
+using namespace std::literals;
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+std::vector<int> pop(
+        util::timer_wheel<int>& wheel, clock::time_point now, size_t limit = 1000) {
+    std::vector<int> out;
+    wheel.pop_due(now, limit, [&](int v) { out.push_back(v); });
+    return out;
+}
+
+}  // namespace
+
+TEST_CASE("timer wheel - pops values once due, in order", "[timer_wheel]") {
+    auto start = clock::now();
+    util::timer_wheel<int> wheel{100ms, 16, start};
+
+    wheel.add(start + 250ms, 3);
+    wheel.add(start + 100ms, 1);
+    wheel.add(start + 150ms, 2);
+    wheel.add(start + 260ms, 4);
+    CHECK(wheel.size() == 4);
+
+    CHECK(pop(wheel, start + 50ms).empty());
+    // Due times get rounded up to a tick, so nothing pops early
+    CHECK(pop(wheel, start + 100ms) == std::vector{1});
+    CHECK(pop(wheel, start + 199ms).empty());
+    CHECK(pop(wheel, start + 200ms) == std::vector{2});
+    CHECK(pop(wheel, start + 1s) == std::vector{3, 4});
+    CHECK(wheel.empty());
+
+    // Times in the past are due right away
+    wheel.add(start, 5);
+    CHECK(pop(wheel, start + 1s) == std::vector{5});
+}
+
+TEST_CASE("timer wheel - limits", "[timer_wheel]") {
+    auto start = clock::now();
+    util::timer_wheel<int> wheel{100ms, 16, start};
+    for (int i = 0; i < 10; i++)
+        wheel.add(start + 100ms * (i / 4), i);
+
+    CHECK(pop(wheel, start + 1s, 3) == std::vector{0, 1, 2});
+    CHECK(pop(wheel, start + 1s, 3) == std::vector{3, 4, 5});
+    CHECK(pop(wheel, start + 1s, 3) == std::vector{6, 7, 8});
+    CHECK(pop(wheel, start + 1s, 3) == std::vector{9});
+    CHECK(wheel.empty());
+}
+
+TEST_CASE("timer wheel - delays beyond a turn of the wheel", "[timer_wheel]") {
+    auto start = clock::now();
+    util::timer_wheel<int> wheel{100ms, 8, start};  // one turn = 800ms
+
+    wheel.add(start + 2s, 2);  // shares its slot with the next one
+    wheel.add(start + 400ms, 1);
+    wheel.add(start + 1200ms, 3);
+
+    CHECK(pop(wheel, start + 400ms) == std::vector{1});
+    CHECK(pop(wheel, start + 1300ms) == std::vector{3});
+    CHECK(pop(wheel, start + 1999ms).empty());
+    CHECK(pop(wheel, start + 2s) == std::vector{2});
+
+    // Values added while popping that are already due come out in the same call
+    wheel.add(start + 2100ms, 4);
+    std::vector<int> out;
+    wheel.pop_due(start + 3s, 10, [&](int v) {
+        out.push_back(v);
+        if (v == 4)
+            wheel.add(start, 5);
+    });
+    CHECK(out == std::vector{4, 5});
+    CHECK(wheel.empty());
+}
@@ -0,0 +1,142 @@
+#include <oxenss/server/tls_sessions.h>
+
+#include <catch2/catch.hpp>
+
+extern "C" {
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+}
+
+#include <memory>
+
+using namespace oxenss::server;
+using namespace std::literals;
+
+namespace {
+
+// A server context with a throwaway self-signed ed25519 certificate
+SSL_CTX* make_server_ctx() {
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> kctx{
+            EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr), EVP_PKEY_CTX_free};
+    EVP_PKEY* key = nullptr;
+    REQUIRE(EVP_PKEY_keygen_init(kctx.get()) == 1);
+    REQUIRE(EVP_PKEY_keygen(kctx.get(), &key) == 1);
+
+    X509* cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    auto* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(
+            name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("test"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    REQUIRE(X509_sign(cert, key, nullptr) > 0);
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    REQUIRE(SSL_CTX_use_certificate(ctx, cert) == 1);
+    REQUIRE(SSL_CTX_use_PrivateKey(ctx, key) == 1);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+
+// Connects a client to the server context over an in-memory BIO pair, optionally resuming
+// `session`.  Returns the client's session (for resuming later), and sets `resumed`.
+SSL_SESSION* connect(
+        SSL_CTX* server_ctx, SSL_CTX* client_ctx, SSL_SESSION* session, bool& resumed) {
+    SSL* server = SSL_new(server_ctx);
+    SSL* client = SSL_new(client_ctx);
+    BIO *sbio, *cbio;
+    REQUIRE(BIO_new_bio_pair(&sbio, 0, &cbio, 0) == 1);
+    SSL_set_bio(server, sbio, sbio);
+    SSL_set_bio(client, cbio, cbio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    if (session)
+        SSL_set_session(client, session);
+
+    bool server_done = false, client_done = false;
+    for (int i = 0; i < 20 && !(server_done && client_done); i++) {
+        if (!client_done)
+            client_done = SSL_do_handshake(client) == 1;
+        if (!server_done)
+            server_done = SSL_do_handshake(server) == 1;
+    }
+    REQUIRE(server_done);
+    REQUIRE(client_done);
+
+    // TLS 1.3 tickets arrive after the handshake, so exchange some data to receive them
+    REQUIRE(SSL_write(server, "hi", 2) == 2);
+    char buf[2];
+    REQUIRE(SSL_read(client, buf, 2) == 2);
+
+    resumed = SSL_session_reused(client);
+    auto* result = SSL_get1_session(client);
+    // (OpenSSL drops the sessions of connections that aren't shut down cleanly)
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    SSL_free(client);
+    SSL_free(server);
+    return result;
+}
+
+}  // namespace
+
+TEST_CASE("TLS sessions - resumption", "[tls]") {
+    auto tickets = GENERATE(true, false);
+    auto version = GENERATE(TLS1_2_VERSION, TLS1_3_VERSION);
+    CAPTURE(tickets, version);
+
+    TlsSessions sessions{{tickets, 1h, 100}};
+    // Two server contexts, as with multiple HTTPS event loops, sharing the sessions
+    SSL_CTX* server1 = make_server_ctx();
+    SSL_CTX* server2 = make_server_ctx();
+    sessions.install(server1);
+    sessions.install(server2);
+
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(client_ctx, version);
+    SSL_CTX_set_max_proto_version(client_ctx, version);
+
+    bool resumed;
+    auto* s1 = connect(server1, client_ctx, nullptr, resumed);
+    CHECK_FALSE(resumed);
+    CHECK(sessions.full_handshakes() == 1);
+    CHECK(sessions.resumed_handshakes() == 0);
+    // Without tickets the session has to come from our cache
+    if (!tickets)
+        CHECK(sessions.cached() == 1);
+
+    auto* s2 = connect(server2, client_ctx, s1, resumed);
+    CHECK(resumed);
+    CHECK(sessions.full_handshakes() == 1);
+    CHECK(sessions.resumed_handshakes() == 1);
+
+    SSL_SESSION_free(s1);
+    SSL_SESSION_free(s2);
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(server1);
+    SSL_CTX_free(server2);
+}
+
+TEST_CASE("TLS sessions - resumption disabled", "[tls]") {
+    TlsSessions sessions{{false, 1h, 0}};
+    SSL_CTX* server = make_server_ctx();
+    sessions.install(server);
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+
+    bool resumed;
+    auto* s1 = connect(server, client_ctx, nullptr, resumed);
+    auto* s2 = connect(server, client_ctx, s1, resumed);
+    CHECK_FALSE(resumed);
+    CHECK(sessions.full_handshakes() == 2);
+    CHECK(sessions.resumed_handshakes() == 0);
+    CHECK(sessions.cached() == 0);
+
+    SSL_SESSION_free(s1);
+    SSL_SESSION_free(s2);
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(server);
+}
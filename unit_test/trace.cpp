@@ -0,0 +1,139 @@
+#include <oxenss/utils/trace.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <set>
+#include <string>
+
+using namespace oxenss::util::trace;
+using namespace std::literals;
+
+TEST_CASE("trace - traceparent", "[trace]") {
+    auto tp = "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"sv;
+    auto ctx = context::parse(tp);
+    REQUIRE(ctx);
+    CHECK(ctx.trace_hex() == "0af7651916cd43dd8448eb211c80319c");
+    CHECK(ctx.span_hex() == "b7ad6b7169203331");
+    CHECK(ctx.traceparent() == tp);
+
+    // Later versions may add fields
+    CHECK(context::parse("01-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-xyz"));
+
+    // Not sampled
+    CHECK_FALSE(context::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00"));
+    // Invalid
+    CHECK_FALSE(context::parse(""));
+    CHECK_FALSE(context::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-xyz"));
+    CHECK_FALSE(context::parse("ff-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"));
+    CHECK_FALSE(context::parse("00-00000000000000000000000000000000-b7ad6b7169203331-01"));
+    CHECK_FALSE(context::parse("00-0af7651916cd43dd8448eb211c80319c-0000000000000000-01"));
+    CHECK_FALSE(context::parse("00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01"));
+    CHECK_FALSE(context::parse("00_0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"));
+}
+
+TEST_CASE("trace - sampling", "[trace]") {
+    TraceBuffer buf;
+    buf.sample_rate(0);
+    CHECK_FALSE(span::sampled(buf, "a"));
+    buf.sample_rate(1);
+    CHECK(buf.sample_rate() == 1.0);
+    CHECK(span::sampled(buf, "a"));
+
+    buf.sample_rate(0.25);
+    CHECK(buf.sample_rate() == Approx(0.25));
+    int sampled = 0;
+    for (int i = 0; i < 10000; i++)
+        sampled += buf.sample();
+    CHECK(sampled > 2000);
+    CHECK(sampled < 3000);
+
+    // A request continuing a trace is always traced
+    buf.sample_rate(0);
+    auto parent = context::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+    auto s = span::sampled(buf, "b", parent);
+    REQUIRE(s);
+    CHECK(s.ctx().trace_id == parent.trace_id);
+    CHECK(s.ctx().span_id != parent.span_id);
+
+    // A span with an empty parent does nothing
+    CHECK_FALSE(span(buf, "c", context{}));
+}
+
+TEST_CASE("trace - span hierarchy", "[trace]") {
+    TraceBuffer buf;
+    buf.sample_rate(1);
+
+    // Without an active span, child spans aren't recorded
+    CHECK_FALSE(span{"orphan"});
+
+    context root_ctx, child_ctx;
+    {
+        auto root = span::sampled(buf, "root");
+        REQUIRE(root);
+        root_ctx = root.ctx();
+        scope sc{&root};
+        CHECK(current() == &root);
+        {
+            span child{"child"};
+            REQUIRE(child);
+            child.tag("k", "v");
+            child_ctx = child.ctx();
+            // Requests arriving while a span is active continue its trace
+            auto nested = span::sampled(buf, "nested");
+            CHECK(nested.ctx().trace_id == root_ctx.trace_id);
+        }
+        {
+            // A non-recording span masks the active one
+            span none;
+            scope masked{&none};
+            CHECK_FALSE(span{"masked"});
+        }
+        CHECK(current() == &root);
+    }
+    CHECK(current() == nullptr);
+
+    auto spans = buf.get();
+    REQUIRE(spans.size() == 3);
+    CHECK(spans[0].name == "nested");
+    CHECK(spans[0].parent_id == root_ctx.span_id);
+    CHECK(spans[1].name == "child");
+    CHECK(spans[1].ctx.trace_id == root_ctx.trace_id);
+    CHECK(spans[1].ctx.span_id == child_ctx.span_id);
+    CHECK(spans[1].parent_id == root_ctx.span_id);
+    REQUIRE(spans[1].tags.size() == 1);
+    CHECK(spans[1].tags[0] == std::pair{"k"s, "v"s});
+    CHECK(spans[2].name == "root");
+    CHECK(spans[2].parent_id == 0);
+}
+
+TEST_CASE("trace - span end and move", "[trace]") {
+    TraceBuffer buf;
+    buf.sample_rate(1);
+    auto a = span::sampled(buf, "a");
+    span b{std::move(a)};
+    CHECK_FALSE(a);
+    REQUIRE(b);
+    b.end();
+    CHECK_FALSE(b);
+    b.end();
+    CHECK(buf.recorded() == 1);
+    CHECK(buf.get().size() == 1);
+}
+
+TEST_CASE("trace - ring buffer", "[trace]") {
+    TraceBuffer buf{3};
+    buf.sample_rate(1);
+    for (int i = 0; i < 5; i++)
+        span::sampled(buf, std::to_string(i));
+    CHECK(buf.recorded() == 5);
+    auto spans = buf.get();
+    REQUIRE(spans.size() == 3);
+    CHECK(spans[0].name == "2");
+    CHECK(spans[1].name == "3");
+    CHECK(spans[2].name == "4");
+
+    std::set<uint64_t> ids;
+    for (auto& s : spans)
+        ids.insert(s.ctx.span_id);
+    CHECK(ids.size() == 3);
+}
@@ -0,0 +1,173 @@
+#include <oxenss/rpc/traffic_capture.h>
+
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+
+using oxenss::rpc::TrafficCapture;
+using namespace std::literals;
+
+namespace {
+
+struct temp_file {
+    std::filesystem::path path =
+            std::filesystem::temp_directory_path() /
+            ("oxenss-capture-test-" + std::to_string(std::random_device{}()));
+    ~temp_file() { std::filesystem::remove(path); }
+};
+
+// Captures a request (if sampled) and returns whether it was
+bool capture(
+        TrafficCapture& cap,
+        std::string_view method,
+        std::string_view pubkey = ""sv,
+        TrafficCapture::transport via = TrafficCapture::transport::omq) {
+    auto p = cap.start(via, method, 123, false);
+    if (!p)
+        return false;
+    cap.set_account(*p, pubkey);
+    cap.finish(std::move(*p), 200, 45);
+    return true;
+}
+
+}  // namespace
+
+TEST_CASE("traffic capture - records round trip", "[capture]") {
+    temp_file f;
+    auto pk = "05" + std::string(64, 'a');
+    {
+        TrafficCapture cap{f.path, 1.0};
+        REQUIRE(capture(cap, "store", pk, TrafficCapture::transport::https));
+        REQUIRE(capture(cap, "retrieve", pk, TrafficCapture::transport::quic));
+        REQUIRE(capture(cap, "info"));
+        CHECK(cap.captured() == 3);
+    }
+
+    auto log = TrafficCapture::read(f.path);
+    REQUIRE(log.records.size() == 3);
+    auto& store = log.records[0];
+    CHECK(store.method == "store");
+    CHECK(store.via == TrafficCapture::transport::https);
+    CHECK_FALSE(store.bt);
+    CHECK(store.params_size == 123);
+    CHECK(store.status == 200);
+    CHECK(store.response_size == 45);
+    CHECK(store.account != 0);
+    CHECK(log.records[1].method == "retrieve");
+    CHECK(log.records[1].via == TrafficCapture::transport::quic);
+    CHECK(log.records[1].arrival >= store.arrival);
+    // The same account gets the same hash
+    CHECK(log.records[1].account == store.account);
+    CHECK(log.records[2].account == 0);
+
+    // Nothing of the pubkey ends up in the log
+    std::ifstream in{f.path, std::ios::binary};
+    std::string data{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    CHECK(data.find(std::string(32, '\xaa')) == std::string::npos);
+    CHECK(data.find(pk) == std::string::npos);
+}
+
+TEST_CASE("traffic capture - account hashes", "[capture]") {
+    temp_file f;
+    TrafficCapture cap{f.path, 1.0};
+    auto pk_hex = "05" + std::string(64, 'b');
+    auto pk_bytes = "\x05" + std::string(32, '\xbb');
+
+    auto account = [&](std::string_view pubkey) {
+        auto p = cap.start(TrafficCapture::transport::omq, "retrieve", 1, true);
+        REQUIRE(p);
+        cap.set_account(*p, pubkey);
+        return p->rec.account;
+    };
+    // Hex and raw bytes of the same pubkey hash the same
+    CHECK(account(pk_hex) == account(pk_bytes));
+    CHECK(account(pk_hex) != account("05" + std::string(64, 'c')));
+    CHECK(account("") == 0);
+
+    // Another capture uses another key
+    temp_file f2;
+    TrafficCapture cap2{f2.path, 1.0};
+    auto p = cap2.start(TrafficCapture::transport::omq, "retrieve", 1, true);
+    REQUIRE(p);
+    cap2.set_account(*p, pk_hex);
+    CHECK(p->rec.account != account(pk_hex));
+}
+
+TEST_CASE("traffic capture - request pubkeys", "[capture]") {
+    auto pk = "05" + std::string(64, 'd');
+    CHECK(TrafficCapture::json_pubkey({{"pubkey", pk}, {"timestamp", 1}}) == pk);
+    CHECK(TrafficCapture::json_pubkey({{"timestamp", 1}}).empty());
+    auto batch = nlohmann::json{
+            {"requests",
+             {{{"method", "retrieve"}, {"params", {{"pubkey", pk}}}},
+              {{"method", "retrieve"}, {"params", {{"pubkey", "x"}}}}}}};
+    CHECK(TrafficCapture::json_pubkey(batch) == pk);
+    CHECK(TrafficCapture::request_pubkey(batch.dump()) == pk);
+
+    auto bytes = "\x05" + std::string(32, '\xdd');
+    CHECK(TrafficCapture::request_pubkey("d6:pubkey33:" + bytes + "9:timestampi1ee") == bytes);
+    CHECK(TrafficCapture::request_pubkey(
+                  "d8:requestsld6:method8:retrieve6:paramsd6:pubkey33:" + bytes + "eeee") ==
+          bytes);
+    CHECK(TrafficCapture::request_pubkey("d9:timestampi1ee"sv).empty());
+    CHECK(TrafficCapture::request_pubkey("not json"sv).empty());
+    CHECK(TrafficCapture::request_pubkey("d6:pubkey"sv).empty());
+}
+
+TEST_CASE("traffic capture - sampling and size limit", "[capture]") {
+    temp_file f;
+    {
+        TrafficCapture none{f.path, 0.0};
+        for (int i = 0; i < 100; i++)
+            CHECK_FALSE(capture(none, "store"));
+    }
+    CHECK(TrafficCapture::read(f.path).records.empty());
+
+    {
+        TrafficCapture some{f.path, 0.5};
+        int captured = 0;
+        for (int i = 0; i < 1000; i++)
+            captured += capture(some, "store");
+        CHECK(captured > 400);
+        CHECK(captured < 600);
+    }
+
+    {
+        // Room for the header and a few records
+        TrafficCapture small{f.path, 1.0, TrafficCapture::MAGIC.size() + 8 + 100};
+        for (int i = 0; i < 100; i++)
+            capture(small, "store");
+        CHECK(small.captured() > 0);
+        CHECK(small.captured() < 10);
+        CHECK_FALSE(capture(small, "store"));
+    }
+    CHECK(std::filesystem::file_size(f.path) <= TrafficCapture::MAGIC.size() + 8 + 100);
+    auto log = TrafficCapture::read(f.path);
+    CHECK(log.records.size() > 0);
+    CHECK(log.records.size() < 10);
+}
+
+TEST_CASE("traffic capture - truncated and invalid logs", "[capture]") {
+    temp_file f;
+    {
+        TrafficCapture cap{f.path, 1.0};
+        capture(cap, "store");
+        capture(cap, "retrieve");
+    }
+    auto size = std::filesystem::file_size(f.path);
+    std::filesystem::resize_file(f.path, size - 3);
+    auto log = TrafficCapture::read(f.path);
+    REQUIRE(log.records.size() == 1);
+    CHECK(log.records[0].method == "store");
+
+    {
+        std::ofstream out{f.path, std::ios::binary | std::ios::trunc};
+        out << "definitely not a capture";
+    }
+    CHECK_THROWS_AS(TrafficCapture::read(f.path), std::runtime_error);
+    CHECK_THROWS_AS(TrafficCapture::read(f.path.string() + ".missing"), std::runtime_error);
+}